@@ -1,5 +1,6 @@
 using System.CommandLine;
 using System.Net.Http.Json;
+using System.Net.WebSockets;
 using System.Text.Json;
 using Spectre.Console;
 using SecureHostCore.Models;
@@ -63,6 +64,16 @@ class Program
         connectionsCommand.SetHandler(HandleConnectionsAsync);
         networkCommand.AddCommand(connectionsCommand);
 
+        var watchCommand = new Command("watch", "Stream connection changes as they happen");
+        var watchPidOption = new Option<uint?>("--pid", "Only connections of this process");
+        var watchPortOption = new Option<ushort?>("--port", "Only connections with this local or remote port");
+        var watchVerdictOption = new Option<string?>("--verdict", "Only connections with this verdict (Allow, Block, Audit)");
+        watchCommand.AddOption(watchPidOption);
+        watchCommand.AddOption(watchPortOption);
+        watchCommand.AddOption(watchVerdictOption);
+        watchCommand.SetHandler(HandleWatchAsync, watchPidOption, watchPortOption, watchVerdictOption);
+        networkCommand.AddCommand(watchCommand);
+
         var listenersCommand = new Command("listeners", "Show active listeners");
         listenersCommand.SetHandler(HandleListenersAsync);
         networkCommand.AddCommand(listenersCommand);
@@ -76,13 +87,19 @@ class Program
         var outputOption = new Option<string>("--output", "Output file path") { IsRequired = true };
         var startTimeOption = new Option<DateTime?>("--start", "Start time (UTC)");
         var endTimeOption = new Option<DateTime?>("--end", "End time (UTC)");
+        var formatOption = new Option<string>("--format", () => "cef", "Output format (cef, json)");
 
         exportCommand.AddOption(outputOption);
         exportCommand.AddOption(startTimeOption);
         exportCommand.AddOption(endTimeOption);
-        exportCommand.SetHandler(HandleExportAuditAsync, outputOption, startTimeOption, endTimeOption);
+        exportCommand.AddOption(formatOption);
+        exportCommand.SetHandler(HandleExportAuditAsync, outputOption, startTimeOption, endTimeOption, formatOption);
         auditCommand.AddCommand(exportCommand);
 
+        var exportsCommand = new Command("exports", "Show background SIEM exports and their progress");
+        exportsCommand.SetHandler(HandleListExportsAsync);
+        auditCommand.AddCommand(exportsCommand);
+
         rootCommand.AddCommand(auditCommand);
 
         // System commands
@@ -295,6 +312,105 @@ class Program
         }
     }
 
+    static async Task HandleWatchAsync(uint? pid, ushort? port, string? verdict)
+    {
+        if (!ConnectionStreamFilter.TryParse(pid?.ToString(), port?.ToString(), verdict, out var filter))
+        {
+            AnsiConsole.MarkupLine("[red]Error: Invalid verdict. Use: Allow, Block, or Audit[/]");
+            return;
+        }
+
+        using var cts = new CancellationTokenSource();
+        Console.CancelKeyPress += (_, e) =>
+        {
+            e.Cancel = true;
+            cts.Cancel();
+        };
+
+        try
+        {
+            using var socket = new ClientWebSocket();
+            var uri = new Uri($"ws://{_httpClient.BaseAddress!.Authority}/api/network/connections/stream{filter.ToQueryString()}");
+            await socket.ConnectAsync(uri, cts.Token);
+
+            var buffer = new byte[ConnectionStreamCodec.GetMessageSize(ConnectionStreamCodec.MaxRecordsPerMessage)];
+
+            while (socket.State == WebSocketState.Open)
+            {
+                var length = 0;
+                WebSocketReceiveResult result;
+                do
+                {
+                    if (length == buffer.Length)
+                        Array.Resize(ref buffer, buffer.Length * 2);
+
+                    result = await socket.ReceiveAsync(new ArraySegment<byte>(buffer, length, buffer.Length - length), cts.Token);
+                    length += result.Count;
+                }
+                while (!result.EndOfMessage);
+
+                if (result.MessageType == WebSocketMessageType.Close)
+                    break;
+
+                if (!ConnectionStreamCodec.TryRead(buffer.AsSpan(0, length), out var header, out var records))
+                {
+                    AnsiConsole.MarkupLine("[red]Error: Malformed stream message[/]");
+                    return;
+                }
+
+                switch (header.Type)
+                {
+                    case ConnectionStreamMessageType.SnapshotEnd:
+                        AnsiConsole.MarkupLine($"[green]{header.Count} connections; watching for changes (Ctrl+C to stop)[/]");
+                        break;
+
+                    case ConnectionStreamMessageType.Resync:
+                        AnsiConsole.MarkupLine("[yellow]Fell behind the service; run the command again for a fresh snapshot[/]");
+                        return;
+
+                    default:
+                        foreach (var record in records)
+                            PrintConnection(header.Type, record);
+                        break;
+                }
+            }
+        }
+        catch (OperationCanceledException)
+        {
+        }
+        catch (WebSocketException ex)
+        {
+            AnsiConsole.MarkupLine($"[red]Error: Unable to connect to service - {ex.Message}[/]");
+        }
+        catch (Exception ex)
+        {
+            AnsiConsole.MarkupLine($"[red]Error: {ex.Message}[/]");
+        }
+    }
+
+    static void PrintConnection(ConnectionStreamMessageType type, in ConnectionStreamRecord record)
+    {
+        if (type == ConnectionStreamMessageType.Remove)
+        {
+            AnsiConsole.MarkupLine($"[dim]-  #{record.Id}[/]");
+            return;
+        }
+
+        var marker = type == ConnectionStreamMessageType.Snapshot ? " " : "+";
+        var verdict = record.Verdict switch
+        {
+            (byte)PolicyAction.Block => "[red]Block[/]",
+            (byte)PolicyAction.Allow => "[green]Allow[/]",
+            (byte)PolicyAction.Audit => "[yellow]Audit[/]",
+            _ => "[dim]-[/]"
+        };
+
+        AnsiConsole.MarkupLine(
+            $"{marker} #{record.Id} {(NetworkProtocol)record.Protocol} " +
+            $"{record.GetLocalAddress()}:{record.LocalPort} -> {record.GetRemoteAddress()}:{record.RemotePort} " +
+            $"pid={record.ProcessId} {verdict} x{record.Count} {record.LastSeenUtc.ToLocalTime():HH:mm:ss}");
+    }
+
     static async Task HandleListenersAsync()
     {
         try
@@ -336,23 +452,24 @@ class Program
         }
     }
 
-    static async Task HandleExportAuditAsync(string output, DateTime? startTime, DateTime? endTime)
+    static async Task HandleExportAuditAsync(string output, DateTime? startTime, DateTime? endTime, string format)
     {
         try
         {
             var start = startTime ?? DateTime.UtcNow.AddDays(-7);
             var end = endTime ?? DateTime.UtcNow;
 
-            var url = $"/api/audit/export?startTime={start:O}&endTime={end:O}";
+            var url = $"/api/audit/export?startTime={start:O}&endTime={end:O}&format={Uri.EscapeDataString(format)}";
 
-            var response = await _httpClient.GetAsync(url);
+            // Stream the body to disk instead of buffering the whole export
+            using var response = await _httpClient.GetAsync(url, HttpCompletionOption.ResponseHeadersRead);
             if (!response.IsSuccessStatusCode)
             {
                 AnsiConsole.MarkupLine("[red]Error: Failed to export audit logs[/]");
                 return;
             }
 
-            var content = await response.Content.ReadAsStreamAsync();
+            await using var content = await response.Content.ReadAsStreamAsync();
             await using var fileStream = File.Create(output);
             await content.CopyToAsync(fileStream);
 
@@ -364,6 +481,45 @@ class Program
         }
     }
 
+    static async Task HandleListExportsAsync()
+    {
+        try
+        {
+            var exports = await _httpClient.GetFromJsonAsync<List<SiemExportProgress>>("/api/audit/exports");
+            if (exports == null || exports.Count == 0)
+            {
+                AnsiConsole.MarkupLine("[yellow]No SIEM exports[/]");
+                return;
+            }
+
+            var table = new Table();
+            table.AddColumn("ID");
+            table.AddColumn("Destination");
+            table.AddColumn("State");
+            table.AddColumn("Segments");
+            table.AddColumn("Events");
+            table.AddColumn("Bytes");
+
+            foreach (var export in exports)
+            {
+                table.AddRow(
+                    export.Id.ToString(),
+                    Markup.Escape(export.Request.Destination),
+                    export.Error != null ? $"{export.State}: {Markup.Escape(export.Error)}" : export.State.ToString(),
+                    $"{export.SegmentsDone}/{export.SegmentsTotal}",
+                    export.EventsWritten.ToString(),
+                    export.BytesWritten.ToString()
+                );
+            }
+
+            AnsiConsole.Write(table);
+        }
+        catch (Exception ex)
+        {
+            AnsiConsole.MarkupLine($"[red]Error: {ex.Message}[/]");
+        }
+    }
+
     static async Task HandleToggleRuleAsync(ulong ruleId)
     {
         try
@@ -1,5 +1,8 @@
+using System.IO;
 using System.Net.Http;
 using System.Net.Http.Json;
+using System.Net.WebSockets;
+using System.Runtime.CompilerServices;
 using System.Text.Json;
 using SecureHostCore.Models;
 
@@ -104,20 +107,73 @@ public class ApiClient
         }
     }
 
-    public async Task<byte[]?> ExportAuditAsync(DateTime startTime, DateTime endTime)
+    /// <summary>
+    /// Streams the connection table: snapshot messages, SnapshotEnd, then
+    /// changes. Ends after Resync or when the service closes the stream;
+    /// connection errors are thrown to the caller.
+    /// </summary>
+    public async IAsyncEnumerable<ConnectionStreamUpdate> StreamConnectionsAsync(
+        ConnectionStreamFilter filter,
+        [EnumeratorCancellation] CancellationToken cancellationToken)
+    {
+        using var socket = new ClientWebSocket();
+        var uri = new Uri($"ws://{_httpClient.BaseAddress!.Authority}/api/network/connections/stream{filter.ToQueryString()}");
+        await socket.ConnectAsync(uri, cancellationToken).ConfigureAwait(false);
+
+        var buffer = new byte[ConnectionStreamCodec.GetMessageSize(ConnectionStreamCodec.MaxRecordsPerMessage)];
+
+        while (socket.State == WebSocketState.Open)
+        {
+            var length = 0;
+            WebSocketReceiveResult result;
+            do
+            {
+                if (length == buffer.Length)
+                    Array.Resize(ref buffer, buffer.Length * 2);
+
+                result = await socket.ReceiveAsync(
+                    new ArraySegment<byte>(buffer, length, buffer.Length - length), cancellationToken).ConfigureAwait(false);
+                length += result.Count;
+            }
+            while (!result.EndOfMessage);
+
+            if (result.MessageType == WebSocketMessageType.Close)
+                yield break;
+
+            if (!ConnectionStreamCodec.TryRead(buffer.AsSpan(0, length), out var header, out var records))
+                throw new InvalidDataException("Malformed connection stream message");
+
+            yield return new ConnectionStreamUpdate(header, records);
+
+            if (header.Type == ConnectionStreamMessageType.Resync)
+                yield break;
+        }
+    }
+
+    /// <summary>
+    /// Streams an audit export into <paramref name="destination"/> as it
+    /// arrives; false if the service refused or the download broke off
+    /// </summary>
+    public async Task<bool> ExportAuditAsync(
+        DateTime startTime,
+        DateTime endTime,
+        Stream destination,
+        CancellationToken cancellationToken = default)
     {
         try
         {
-            var url = $"/api/audit/export?startTime={startTime:O}&endTime={endTime:O}";
-            var response = await _httpClient.GetAsync(url);
+            var url = $"/api/audit/export?startTime={startTime.ToUniversalTime():O}&endTime={endTime.ToUniversalTime():O}";
+            using var response = await _httpClient.GetAsync(url, HttpCompletionOption.ResponseHeadersRead, cancellationToken);
             if (!response.IsSuccessStatusCode)
-                return null;
+                return false;
 
-            return await response.Content.ReadAsByteArrayAsync();
+            await using var content = await response.Content.ReadAsStreamAsync(cancellationToken);
+            await content.CopyToAsync(destination, cancellationToken);
+            return true;
         }
         catch
         {
-            return null;
+            return false;
         }
     }
 
@@ -158,12 +214,35 @@ public class ServiceStatus
     public string Uptime { get; set; } = string.Empty;
 }
 
+public sealed record ConnectionStreamUpdate(ConnectionStreamHeader Header, ConnectionStreamRecord[] Records);
+
 public class NetworkConnection
 {
+    public ulong Id { get; set; }
+    public uint ProcessId { get; set; }
     public string Protocol { get; set; } = string.Empty;
     public string LocalAddress { get; set; } = string.Empty;
     public int LocalPort { get; set; }
     public string RemoteAddress { get; set; } = string.Empty;
     public int RemotePort { get; set; }
     public string State { get; set; } = string.Empty;
+    public string Verdict { get; set; } = string.Empty;
+    public uint Count { get; set; }
+
+    public static NetworkConnection FromStreamRecord(in ConnectionStreamRecord record)
+    {
+        return new NetworkConnection
+        {
+            Id = record.Id,
+            ProcessId = record.ProcessId,
+            Protocol = ((NetworkProtocol)record.Protocol).ToString(),
+            LocalAddress = record.GetLocalAddress().ToString(),
+            LocalPort = record.LocalPort,
+            RemoteAddress = record.GetRemoteAddress().ToString(),
+            RemotePort = record.RemotePort,
+            State = record.Verdict == (byte)PolicyAction.Block ? "Blocked" : "Open",
+            Verdict = record.Verdict != 0 ? ((PolicyAction)record.Verdict).ToString() : string.Empty,
+            Count = record.Count
+        };
+    }
 }
@@ -13,6 +13,10 @@ public partial class MainViewModel : ObservableObject
 {
     private readonly ApiClient _apiClient;
 
+    // Position of each streamed connection in NetworkConnections
+    private readonly Dictionary<ulong, int> _connectionIndex = new();
+    private CancellationTokenSource? _connectionStreamCts;
+
     [ObservableProperty]
     private bool _isConnected;
 
@@ -120,27 +124,114 @@ public partial class MainViewModel : ObservableObject
         }
     }
 
+    /// <summary>
+    /// (Re)starts the connection stream; the service pushes a snapshot and
+    /// then each change, so there is nothing to poll
+    /// </summary>
     [RelayCommand]
-    private async Task RefreshConnectionsAsync()
+    private Task RefreshConnectionsAsync()
     {
-        try
+        _connectionStreamCts?.Cancel();
+        _connectionStreamCts = new CancellationTokenSource();
+
+        StatusBarText = "Loading network connections...";
+        _ = RunConnectionStreamAsync(_connectionStreamCts.Token);
+        return Task.CompletedTask;
+    }
+
+    private async Task RunConnectionStreamAsync(CancellationToken cancellationToken)
+    {
+        while (!cancellationToken.IsCancellationRequested)
         {
-            StatusBarText = "Loading network connections...";
+            try
+            {
+                var snapshot = new List<NetworkConnection>();
 
-            var connections = await _apiClient.GetConnectionsAsync();
-            NetworkConnections.Clear();
-            foreach (var conn in connections)
+                await foreach (var update in _apiClient.StreamConnectionsAsync(ConnectionStreamFilter.All, cancellationToken))
+                {
+                    switch (update.Header.Type)
+                    {
+                        case ConnectionStreamMessageType.Snapshot:
+                            foreach (var record in update.Records)
+                                snapshot.Add(NetworkConnection.FromStreamRecord(record));
+                            break;
+
+                        case ConnectionStreamMessageType.SnapshotEnd:
+                            ReplaceConnections(snapshot);
+                            StatusBarText = $"Loaded {snapshot.Count} active connections";
+                            break;
+
+                        case ConnectionStreamMessageType.Upsert:
+                            foreach (var record in update.Records)
+                                UpsertConnection(NetworkConnection.FromStreamRecord(record));
+                            break;
+
+                        case ConnectionStreamMessageType.Remove:
+                            foreach (var record in update.Records)
+                                RemoveConnection(record.Id);
+                            break;
+                    }
+
+                    ActiveConnections = NetworkConnections.Count;
+                }
+            }
+            catch (OperationCanceledException) when (cancellationToken.IsCancellationRequested)
             {
-                NetworkConnections.Add(conn);
+                return;
+            }
+            catch (Exception ex)
+            {
+                StatusBarText = $"Connection stream error: {ex.Message}";
             }
 
-            ActiveConnections = connections.Count;
-            StatusBarText = $"Loaded {connections.Count} active connections";
+            // The stream ended (service restart, or it asked for a resync)
+            try
+            {
+                await Task.Delay(TimeSpan.FromSeconds(5), cancellationToken);
+            }
+            catch (OperationCanceledException)
+            {
+                return;
+            }
         }
-        catch (Exception ex)
+    }
+
+    private void ReplaceConnections(List<NetworkConnection> connections)
+    {
+        NetworkConnections = new ObservableCollection<NetworkConnection>(connections);
+
+        _connectionIndex.Clear();
+        for (var i = 0; i < connections.Count; i++)
+            _connectionIndex[connections[i].Id] = i;
+    }
+
+    private void UpsertConnection(NetworkConnection connection)
+    {
+        if (_connectionIndex.TryGetValue(connection.Id, out var index))
+        {
+            NetworkConnections[index] = connection;
+            return;
+        }
+
+        _connectionIndex[connection.Id] = NetworkConnections.Count;
+        NetworkConnections.Add(connection);
+    }
+
+    private void RemoveConnection(ulong id)
+    {
+        if (!_connectionIndex.Remove(id, out var index))
+            return;
+
+        // Moves the last row into the gap so no other index shifts
+        var last = NetworkConnections.Count - 1;
+        if (index != last)
         {
-            StatusBarText = $"Error loading connections: {ex.Message}";
+            var moved = NetworkConnections[last];
+            NetworkConnections[index] = moved;
+            _connectionIndex[moved.Id] = index;
         }
+
+        NetworkConnections.RemoveAt(last);
     }
 
     [RelayCommand]
@@ -355,15 +446,20 @@ public partial class MainViewModel : ObservableObject
             {
                 StatusBarText = "Exporting audit logs...";
 
-                var data = await _apiClient.ExportAuditAsync(AuditStartDate, AuditEndDate);
-                if (data != null)
+                bool exported;
+                await using (var file = System.IO.File.Create(dialog.FileName))
+                {
+                    exported = await _apiClient.ExportAuditAsync(AuditStartDate, AuditEndDate, file);
+                }
+
+                if (exported)
                 {
-                    await System.IO.File.WriteAllBytesAsync(dialog.FileName, data);
                     StatusBarText = $"Audit logs exported to: {dialog.FileName}";
                     MessageBox.Show($"Audit logs exported successfully!\n\n{dialog.FileName}", "Export Complete", MessageBoxButton.OK, MessageBoxImage.Information);
                 }
                 else
                 {
+                    System.IO.File.Delete(dialog.FileName);
                     StatusBarText = "Failed to export audit logs";
                     MessageBox.Show("Failed to export audit logs. Please check the service connection.", "Export Failed", MessageBoxButton.OK, MessageBoxImage.Error);
                 }
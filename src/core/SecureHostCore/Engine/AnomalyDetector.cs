@@ -0,0 +1,493 @@
+using System.Globalization;
+using System.Numerics;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Thresholds and sizes for <see cref="AnomalyDetector"/>
+/// </summary>
+public sealed class AnomalyDetectorOptions
+{
+    /// <summary>
+    /// Port scan window; distinct endpoint counts restart with each one
+    /// </summary>
+    public TimeSpan Window { get; set; } = TimeSpan.FromMinutes(1);
+
+    /// <summary>
+    /// Processes given distinct endpoint sketches per window at most
+    /// </summary>
+    public int MaxTrackedProcesses { get; set; } = 256;
+
+    /// <summary>
+    /// Connections a process makes in a window before it is tracked
+    /// </summary>
+    public uint TrackAfterConnections { get; set; } = 16;
+
+    public int PortScanEndpoints { get; set; } = 100;
+
+    public int PortScanPorts { get; set; } = 50;
+
+    /// <summary>
+    /// Process and endpoint pairs whose connection intervals are followed
+    /// </summary>
+    public int BeaconSlots { get; set; } = 4096;
+
+    public int BeaconConnections { get; set; } = 8;
+
+    public TimeSpan BeaconMinInterval { get; set; } = TimeSpan.FromSeconds(5);
+
+    /// <summary>
+    /// Mean deviation of the interval, as a fraction of the interval, at
+    /// or below which connections count as periodic
+    /// </summary>
+    public double BeaconMaxJitter { get; set; } = 0.1;
+
+    /// <summary>
+    /// How far the short-term rate must exceed the baseline to be a burst
+    /// </summary>
+    public double BurstFactor { get; set; } = 4;
+
+    public double DeviceBurstMinRate { get; set; } = 2;
+
+    public double BlockSurgeMinRate { get; set; } = 20;
+
+    public double ConnectionSurgeMinRate { get; set; } = 500;
+
+    public TimeSpan ShortHalfLife { get; set; } = TimeSpan.FromSeconds(15);
+
+    public TimeSpan BaselineHalfLife { get; set; } = TimeSpan.FromMinutes(15);
+
+    /// <summary>
+    /// History a baseline needs before bursts are judged against it
+    /// </summary>
+    public TimeSpan BaselineWarmup { get; set; } = TimeSpan.FromMinutes(2);
+
+    /// <summary>
+    /// Minimum time between alerts of one kind for one subject
+    /// </summary>
+    public TimeSpan AlertCooldown { get; set; } = TimeSpan.FromMinutes(10);
+
+    public int MaxPendingAlerts { get; set; } = 64;
+}
+
+/// <summary>
+/// Streaming anomaly detection over the drivers' connection and device
+/// events and counters, in memory fixed at construction whatever the
+/// connection volume:
+///
+/// - Port scans: a count-min sketch counts connections per process in the
+///   window; a process past TrackAfterConnections gets HyperLogLogs of the
+///   distinct remote endpoints and ports it reaches, from a fixed pool.
+/// - Beaconing: a direct-mapped table of process and endpoint pairs keeps
+///   a moving mean and mean deviation of the interval between
+///   connections; a steady interval over enough connections is flagged.
+///   A colliding pair takes the slot over.
+/// - Bursts and surges: short-term and baseline EWMA rates of device
+///   access checks per device type, and of the WFP driver's block and
+///   classification counters.
+///
+/// Record methods are O(1) and only take the detector's lock, so they can
+/// run on the event reader threads. Evaluate is called periodically and
+/// returns what was flagged since the last call.
+/// </summary>
+public sealed class AnomalyDetector
+{
+    private sealed class ProcessWindow
+    {
+        public ProcessKey Process;
+        public readonly HyperLogLog Endpoints = new();
+        public readonly HyperLogLog Ports = new();
+        public bool Reported;
+    }
+
+    private struct BeaconSlot
+    {
+        public ulong Tag;                   // 0 = free
+        public ProcessKey Process;
+        public UInt128 Address;
+        public byte IpVersion;
+        public ushort Port;
+        public ulong LastSeen;              // FILETIME
+        public uint Connections;            // Since the interval last broke
+        public double MeanInterval;         // Seconds
+        public double Deviation;
+        public bool Reported;
+    }
+
+    private struct RateMonitor
+    {
+        public EwmaRate Short;
+        public EwmaRate Baseline;
+        public double Pending;              // Since the last evaluation
+    }
+
+    private readonly record struct AlertKey(AnomalyKind Kind, ProcessKey Process, ulong Subject);
+
+    private const double BeaconSmoothing = 0.25;
+    private const int MaxAlertKeys = 1024;
+    private const int DeviceTypeCount = (int)DeviceType.Bluetooth + 1;
+
+    private readonly AnomalyDetectorOptions _options;
+    private readonly object _lock = new();
+    private readonly CountMinSketch _processConnections = new();
+    private readonly CountMinSketch _deviceChecks = new(width: 1024);
+    private readonly Dictionary<ProcessKey, ProcessWindow> _processes;
+    private readonly Stack<ProcessWindow> _sparePool = new();
+    private readonly BeaconSlot[] _beacons;
+    private readonly RateMonitor[] _deviceRates = new RateMonitor[DeviceTypeCount];
+    private readonly (ProcessKey Process, uint Checks)[] _deviceLeaders = new (ProcessKey, uint)[DeviceTypeCount];
+    private readonly List<AnomalyAlert> _pending = new();
+    private readonly Dictionary<AlertKey, DateTime> _lastAlerts = new();
+    private RateMonitor _blocks;
+    private RateMonitor _classifications;
+    private ulong? _lastBlockCounter;
+    private ulong? _lastClassificationCounter;
+    private DateTime _windowStart;
+    private DateTime _lastEvaluation;
+    private long _untracked;
+    private long _raised;
+    private long _dropped;
+
+    public AnomalyDetector(AnomalyDetectorOptions? options = null)
+    {
+        _options = options ?? new AnomalyDetectorOptions();
+        _processes = new Dictionary<ProcessKey, ProcessWindow>(Math.Max(1, _options.MaxTrackedProcesses));
+        _beacons = new BeaconSlot[(int)BitOperations.RoundUpToPowerOf2(
+            (uint)Math.Clamp(_options.BeaconSlots, 16, 1 << 20))];
+    }
+
+    /// <summary>
+    /// Connections from processes not tracked because the pool was full
+    /// </summary>
+    public long UntrackedConnections => Interlocked.Read(ref _untracked);
+
+    public long AlertsRaised => Interlocked.Read(ref _raised);
+
+    /// <summary>
+    /// Alerts lost because Evaluate was not called often enough
+    /// </summary>
+    public long AlertsDropped => Interlocked.Read(ref _dropped);
+
+    public int TrackedProcesses
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return _processes.Count;
+            }
+        }
+    }
+
+    public void RecordConnection(in ConnectionObservation observation)
+    {
+        var count = Math.Max(1u, observation.Count);
+        var processHash = ProcessHash(observation.Process);
+        var addressHash = SketchHash.Combine((ulong)(observation.RemoteAddress >> 64), (ulong)observation.RemoteAddress);
+        var port = (ulong)observation.RemotePort | ((ulong)observation.Protocol << 16);
+
+        lock (_lock)
+        {
+            var connections = _processConnections.Add(processHash, count);
+
+            if (!_processes.TryGetValue(observation.Process, out var window) &&
+                connections >= _options.TrackAfterConnections)
+            {
+                window = Track(observation.Process);
+                if (window == null)
+                    Interlocked.Add(ref _untracked, count);
+            }
+
+            if (window != null)
+            {
+                window.Endpoints.Add(SketchHash.Combine(addressHash, port));
+                window.Ports.Add(SketchHash.Mix(port));
+            }
+
+            ObserveInterval(in observation, SketchHash.Combine(processHash, addressHash, port));
+        }
+    }
+
+    public void RecordDeviceAccess(ProcessKey process, DeviceType deviceType, uint count)
+    {
+        var type = (int)deviceType is >= 0 and < DeviceTypeCount ? (int)deviceType : 0;
+        count = Math.Max(1u, count);
+
+        lock (_lock)
+        {
+            _deviceRates[type].Pending += count;
+
+            // Remembers which process checked most since the last evaluation
+            var checks = _deviceChecks.Add(SketchHash.Combine(ProcessHash(process), (ulong)type), count);
+            if (checks > _deviceLeaders[type].Checks)
+                _deviceLeaders[type] = (process, checks);
+        }
+    }
+
+    /// <summary>
+    /// Takes the WFP driver's cumulative counters (DriverStatistics). A
+    /// counter that went backwards means the driver restarted and only
+    /// sets the new starting point.
+    /// </summary>
+    public void RecordDriverCounters(ulong classifications, ulong blocks)
+    {
+        lock (_lock)
+        {
+            AddCounterDelta(ref _classifications, ref _lastClassificationCounter, classifications);
+            AddCounterDelta(ref _blocks, ref _lastBlockCounter, blocks);
+        }
+    }
+
+    /// <summary>
+    /// Updates the rates, checks the tracked processes, closes the window
+    /// once it has run its length, and returns the alerts raised since the
+    /// last call
+    /// </summary>
+    public IReadOnlyList<AnomalyAlert> Evaluate(DateTime now)
+    {
+        lock (_lock)
+        {
+            if (_windowStart == default)
+                _windowStart = now;
+
+            var elapsed = _lastEvaluation != default ? now - _lastEvaluation : TimeSpan.Zero;
+            _lastEvaluation = now;
+
+            if (elapsed > TimeSpan.Zero)
+            {
+                for (var type = 0; type < DeviceTypeCount; type++)
+                {
+                    if (IsBurst(ref _deviceRates[type], elapsed, _options.DeviceBurstMinRate, out var rate, out var baseline))
+                    {
+                        var leader = _deviceLeaders[type].Process;
+                        Raise(now, new AnomalyAlert
+                        {
+                            Kind = AnomalyKind.DeviceAccessBurst,
+                            DetectedAt = now,
+                            Process = leader,
+                            DeviceType = (DeviceType)type,
+                            Observed = rate,
+                            Baseline = baseline,
+                            Message = string.Create(CultureInfo.InvariantCulture,
+                                $"{(DeviceType)type} access checks at {rate:F1}/s against a baseline of {baseline:F1}/s, mostly from process {leader}")
+                        }, (ulong)type);
+                    }
+
+                    _deviceLeaders[type] = default;
+                }
+
+                _deviceChecks.Clear();
+
+                CheckDriverRate(now, ref _blocks, elapsed, AnomalyKind.BlockSurge, _options.BlockSurgeMinRate, "blocks");
+                CheckDriverRate(now, ref _classifications, elapsed, AnomalyKind.ConnectionSurge, _options.ConnectionSurgeMinRate, "classifications");
+            }
+
+            foreach (var window in _processes.Values)
+            {
+                if (!window.Reported)
+                    CheckPortScan(now, window);
+            }
+
+            if (now - _windowStart >= _options.Window)
+            {
+                foreach (var window in _processes.Values)
+                {
+                    window.Endpoints.Clear();
+                    window.Ports.Clear();
+                    _sparePool.Push(window);
+                }
+
+                _processes.Clear();
+                _processConnections.Clear();
+                _windowStart = now;
+            }
+
+            if (_pending.Count == 0)
+                return Array.Empty<AnomalyAlert>();
+
+            var alerts = _pending.ToArray();
+            _pending.Clear();
+            return alerts;
+        }
+    }
+
+    private ProcessWindow? Track(ProcessKey process)
+    {
+        if (_processes.Count >= _options.MaxTrackedProcesses)
+            return null;
+
+        var window = _sparePool.Count != 0 ? _sparePool.Pop() : new ProcessWindow();
+        window.Process = process;
+        window.Reported = false;
+        _processes.Add(process, window);
+        return window;
+    }
+
+    private void CheckPortScan(DateTime now, ProcessWindow window)
+    {
+        var endpoints = window.Endpoints.Estimate();
+        var ports = window.Ports.Estimate();
+        if (endpoints < _options.PortScanEndpoints && ports < _options.PortScanPorts)
+            return;
+
+        window.Reported = true;
+        Raise(now, new AnomalyAlert
+        {
+            Kind = AnomalyKind.PortScan,
+            DetectedAt = now,
+            Process = window.Process,
+            Observed = endpoints,
+            Baseline = _options.PortScanEndpoints,
+            Message = string.Create(CultureInfo.InvariantCulture,
+                $"Process {window.Process} reached about {endpoints:F0} remote endpoints on {ports:F0} ports within {_options.Window.TotalSeconds:F0}s")
+        }, 0);
+    }
+
+    /// <summary>
+    /// Follows the interval between connections of one process to one
+    /// endpoint. Coalesced repeats and intervals below the minimum are
+    /// not periodic and start the slot over.
+    /// </summary>
+    private void ObserveInterval(in ConnectionObservation observation, ulong hash)
+    {
+        ref var slot = ref _beacons[(int)(hash & (ulong)(_beacons.Length - 1))];
+        var tag = hash | 1;
+
+        if (slot.Tag != tag)
+        {
+            slot = new BeaconSlot
+            {
+                Tag = tag,
+                Process = observation.Process,
+                Address = observation.RemoteAddress,
+                IpVersion = observation.IpVersion,
+                Port = observation.RemotePort,
+                LastSeen = observation.Timestamp,
+                Connections = 1
+            };
+            return;
+        }
+
+        if (observation.Timestamp <= slot.LastSeen)
+            return;
+
+        var interval = (observation.Timestamp - slot.LastSeen) / (double)TimeSpan.TicksPerSecond;
+        slot.LastSeen = observation.Timestamp;
+
+        if (observation.Count > 1 || interval < _options.BeaconMinInterval.TotalSeconds)
+        {
+            slot.Connections = 1;
+            return;
+        }
+
+        if (slot.Connections == 1)
+        {
+            slot.MeanInterval = interval;
+            slot.Deviation = 0;
+        }
+        else
+        {
+            slot.Deviation += BeaconSmoothing * (Math.Abs(interval - slot.MeanInterval) - slot.Deviation);
+            slot.MeanInterval += BeaconSmoothing * (interval - slot.MeanInterval);
+        }
+
+        slot.Connections++;
+
+        if (slot.Reported ||
+            slot.Connections < _options.BeaconConnections ||
+            slot.Deviation > _options.BeaconMaxJitter * slot.MeanInterval)
+        {
+            return;
+        }
+
+        slot.Reported = true;
+
+        var now = DateTime.FromFileTimeUtc((long)observation.Timestamp);
+        var endpoint = $"{ConnectionObservation.UnpackAddress(slot.Address, slot.IpVersion)}:{slot.Port}";
+        Raise(now, new AnomalyAlert
+        {
+            Kind = AnomalyKind.Beaconing,
+            DetectedAt = now,
+            Process = slot.Process,
+            Endpoint = endpoint,
+            Observed = slot.MeanInterval,
+            Baseline = slot.Deviation,
+            Message = string.Create(CultureInfo.InvariantCulture,
+                $"Process {slot.Process} connects to {endpoint} every {slot.MeanInterval:F1}s (within {slot.Deviation:F1}s) over {slot.Connections} connections")
+        }, tag);
+    }
+
+    private void CheckDriverRate(DateTime now, ref RateMonitor monitor, TimeSpan elapsed, AnomalyKind kind, double minRate, string counter)
+    {
+        if (!IsBurst(ref monitor, elapsed, minRate, out var rate, out var baseline))
+            return;
+
+        Raise(now, new AnomalyAlert
+        {
+            Kind = kind,
+            DetectedAt = now,
+            Observed = rate,
+            Baseline = baseline,
+            Message = string.Create(CultureInfo.InvariantCulture,
+                $"Network driver {counter} at {rate:F0}/s against a baseline of {baseline:F0}/s")
+        }, 0);
+    }
+
+    /// <summary>
+    /// Folds the events since the last evaluation into both rates and
+    /// reports whether the short-term rate is a burst over the baseline
+    /// </summary>
+    private bool IsBurst(ref RateMonitor monitor, TimeSpan elapsed, double minRate, out double rate, out double baseline)
+    {
+        var warm = monitor.Baseline.Observed >= _options.BaselineWarmup;
+
+        monitor.Short.Update(monitor.Pending, elapsed, _options.ShortHalfLife);
+        monitor.Baseline.Update(monitor.Pending, elapsed, _options.BaselineHalfLife);
+        monitor.Pending = 0;
+
+        rate = monitor.Short.Rate;
+        baseline = monitor.Baseline.Rate;
+        return warm && rate >= minRate && rate > _options.BurstFactor * baseline;
+    }
+
+    private static void AddCounterDelta(ref RateMonitor monitor, ref ulong? last, ulong value)
+    {
+        if (last is { } previous && value >= previous)
+            monitor.Pending += value - previous;
+
+        last = value;
+    }
+
+    private void Raise(DateTime now, AnomalyAlert alert, ulong subject)
+    {
+        var key = new AlertKey(alert.Kind, alert.Process ?? default, subject);
+        if (_lastAlerts.TryGetValue(key, out var last) && now - last < _options.AlertCooldown)
+            return;
+
+        if (_lastAlerts.Count >= MaxAlertKeys && !_lastAlerts.ContainsKey(key))
+        {
+            foreach (var (oldKey, raisedAt) in _lastAlerts)
+            {
+                if (now - raisedAt >= _options.AlertCooldown)
+                    _lastAlerts.Remove(oldKey);
+            }
+
+            if (_lastAlerts.Count >= MaxAlertKeys)
+                _lastAlerts.Clear();
+        }
+
+        _lastAlerts[key] = now;
+
+        if (_pending.Count >= _options.MaxPendingAlerts)
+        {
+            Interlocked.Increment(ref _dropped);
+            return;
+        }
+
+        _pending.Add(alert);
+        Interlocked.Increment(ref _raised);
+    }
+
+    private static ulong ProcessHash(ProcessKey process) => SketchHash.Combine(process.ProcessId, process.CreateTime);
+}
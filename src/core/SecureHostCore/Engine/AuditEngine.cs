@@ -1,5 +1,7 @@
-using System.Collections.Concurrent;
+using System.Diagnostics;
 using System.Diagnostics.Tracing;
+using System.Globalization;
+using System.Net.Sockets;
 using System.Text.Json;
 using SecureHostCore.Models;
 using Microsoft.Extensions.Logging;
@@ -9,36 +11,85 @@ namespace SecureHostCore.Engine;
 /// <summary>
 /// Audit and logging engine with ETW support
 /// Provides tamper-resistant audit trail with SIEM export
+/// Events are appended in batches to a daily binary segment
+/// (<see cref="AuditLogSegment"/>) whose blocks are hash-chained and
+/// time-indexed, so exports map the segment and read only the blocks in
+/// the requested window.
+///
+/// Events flow through a bounded pipeline: capture, enrich, serialize,
+/// write. Each stage is a bounded queue with one worker; when a queue is
+/// full, info events are dropped, warnings sampled and errors wait, so a
+/// connection storm costs fidelity instead of memory. The writer commits
+/// every block queued behind an fsync with the next one (group commit).
 /// </summary>
 public sealed class AuditEngine : IDisposable
 {
+    private static readonly TimeSpan ShutdownTimeout = TimeSpan.FromSeconds(30);
+    private const int ExportFileBufferSize = 64 * 1024;
+
     private readonly ILogger<AuditEngine> _logger;
-    private readonly ConcurrentQueue<AuditEvent> _eventQueue;
     private readonly string _auditLogPath;
+    private readonly AuditPipelineOptions _options;
     private readonly SecureHostEventSource _eventSource;
-    private readonly Timer _flushTimer;
-    private readonly SemaphoreSlim _flushSemaphore;
+    private readonly LatencyTracer? _latencyTracer;
+    private readonly AuditStage<AuditPipelineItem> _captureStage;
+    private readonly AuditStage<AuditPipelineItem> _serializeStage;
+    private readonly AuditStage<AuditWriteItem> _writeStage;
+    private readonly ProcessMetadataCache _processCache;
+    private readonly Lazy<(string? Sid, string? Name)> _serviceIdentity;
+    private readonly Task _pipelineTask;
+    private readonly Dictionary<Guid, SiemExportJob> _exportJobs = new();
+    private AuditLogWriter? _logWriter;         // Serialize stage
+    private long _eventsWritten;
+    private long _eventsLost;
+    private long _blocksWritten;
+    private long _commits;
+    private AuditLatencyCounter _commitLatency;
+    private AuditLatencyCounter _endToEndLatency;
     private bool _disposed;
 
-    public AuditEngine(ILogger<AuditEngine> logger, string auditLogPath)
+    /// <param name="processCache">
+    /// Resolves event processes; shared with the service so the drivers'
+    /// process metadata is looked up once. Defaults to a private cache
+    /// sized by <paramref name="options"/>.
+    /// </param>
+    /// <param name="latencyTracer">
+    /// Receives the driver-verdict-to-durable time of traced events
+    /// (<see cref="LatencyStage.AuditDurable"/>)
+    /// </param>
+    public AuditEngine(
+        ILogger<AuditEngine> logger,
+        string auditLogPath,
+        AuditPipelineOptions? options = null,
+        ProcessMetadataCache? processCache = null,
+        LatencyTracer? latencyTracer = null)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _auditLogPath = auditLogPath ?? throw new ArgumentNullException(nameof(auditLogPath));
-        _eventQueue = new ConcurrentQueue<AuditEvent>();
-        _eventSource = new SecureHostEventSource();
-        _flushSemaphore = new SemaphoreSlim(1, 1);
+        _options = options ?? new AuditPipelineOptions();
+        _eventSource = SecureHostEventSource.Log;
+        _latencyTracer = latencyTracer;
+
+        _captureStage = new AuditStage<AuditPipelineItem>("Capture", _options.CaptureCapacity, _options.WarningSampleRate);
+        _serializeStage = new AuditStage<AuditPipelineItem>("Serialize", _options.SerializeCapacity, _options.WarningSampleRate);
+        _writeStage = new AuditStage<AuditWriteItem>("Write", _options.WriteCapacity, _options.WarningSampleRate);
+        _processCache = processCache ?? new ProcessMetadataCache(_options.ProcessCacheSize, _options.ProcessCacheLifetime);
+        _serviceIdentity = new Lazy<(string?, string?)>(GetServiceIdentity);
 
         // Ensure audit directory exists
         Directory.CreateDirectory(Path.GetDirectoryName(_auditLogPath)!);
 
-        // Flush events to disk every 5 seconds
-        _flushTimer = new Timer(FlushTimerCallback, null, TimeSpan.FromSeconds(5), TimeSpan.FromSeconds(5));
+        _pipelineTask = Task.WhenAll(
+            Task.Run(EnrichLoopAsync),
+            Task.Run(SerializeLoopAsync),
+            Task.Run(WriteLoopAsync));
 
         _logger.LogInformation("Audit engine initialized. Log path: {AuditLogPath}", _auditLogPath);
     }
 
     /// <summary>
-    /// Logs a network connection event
+    /// Logs a network connection event. A traced driver verdict keeps its
+    /// correlation ID in the event's metadata.
     /// </summary>
     public async Task LogNetworkEventAsync(
         uint processId,
@@ -46,18 +97,24 @@ public sealed class AuditEngine : IDisposable
         PolicyAction action,
         NetworkEventDetails details,
         ulong? ruleId = null,
-        string? message = null)
+        string? message = null,
+        Dictionary<string, string>? metadata = null,
+        ulong processCreateTime = 0,
+        VerdictTrace trace = default)
     {
         var auditEvent = new AuditEvent
         {
             EventType = AuditEventType.NetworkConnection,
             Severity = action == PolicyAction.Block ? EventSeverity.Warning : EventSeverity.Info,
             ProcessId = processId,
+            ProcessCreateTime = processCreateTime,
             ProcessName = processName,
             Action = action,
             RuleId = ruleId,
             ResourceType = "Network",
             NetworkDetails = details,
+            Metadata = AddTraceMetadata(metadata, trace),
+            Trace = trace,
             Message = message ?? $"Network connection {action.ToString().ToLowerInvariant()}"
         };
 
@@ -65,7 +122,7 @@ public sealed class AuditEngine : IDisposable
     }
 
     /// <summary>
-    /// Logs a device access event
+    /// Logs a device access event; traced as network events are
     /// </summary>
     public async Task LogDeviceEventAsync(
         uint processId,
@@ -73,24 +130,84 @@ public sealed class AuditEngine : IDisposable
         PolicyAction action,
         DeviceEventDetails details,
         ulong? ruleId = null,
-        string? message = null)
+        string? message = null,
+        Dictionary<string, string>? metadata = null,
+        ulong processCreateTime = 0,
+        VerdictTrace trace = default)
     {
         var auditEvent = new AuditEvent
         {
             EventType = AuditEventType.DeviceAccess,
             Severity = action == PolicyAction.Block ? EventSeverity.Warning : EventSeverity.Info,
             ProcessId = processId,
+            ProcessCreateTime = processCreateTime,
             ProcessName = processName,
             Action = action,
             RuleId = ruleId,
             ResourceType = "Device",
             DeviceDetails = details,
+            Metadata = AddTraceMetadata(metadata, trace),
+            Trace = trace,
             Message = message ?? $"Device access {action.ToString().ToLowerInvariant()}"
         };
 
         await LogEventAsync(auditEvent);
     }
 
+    /// <summary>
+    /// Records a traced verdict's correlation ID as "correlationId", so
+    /// the audit log and exports can be joined with the latency trace
+    /// </summary>
+    private static Dictionary<string, string>? AddTraceMetadata(Dictionary<string, string>? metadata, VerdictTrace trace)
+    {
+        if (!trace.IsTraced)
+            return metadata;
+
+        metadata ??= new Dictionary<string, string>(1);
+        metadata["correlationId"] = trace.FormatId();
+        return metadata;
+    }
+
+    /// <summary>
+    /// Metadata for an event the driver reported as a summary of repeated
+    /// attempts; null for a single attempt
+    /// </summary>
+    public static Dictionary<string, string>? CreateRepeatMetadata(uint count, DateTime firstSeen, DateTime lastSeen)
+    {
+        if (count <= 1)
+            return null;
+
+        return new Dictionary<string, string>
+        {
+            ["count"] = count.ToString(CultureInfo.InvariantCulture),
+            ["firstSeen"] = firstSeen.ToString("O", CultureInfo.InvariantCulture),
+            ["lastSeen"] = lastSeen.ToString("O", CultureInfo.InvariantCulture)
+        };
+    }
+
+    /// <summary>
+    /// Metadata for a permit the driver reported under a rule's audit
+    /// mode: the repeat metadata plus the mode and the number of
+    /// connections the event stands for, which is what totals are rebuilt
+    /// from. Null for a single connection reported in full.
+    /// </summary>
+    public static Dictionary<string, string>? CreateSampleMetadata(
+        uint count,
+        uint weight,
+        PermitAuditMode mode,
+        DateTime firstSeen,
+        DateTime lastSeen)
+    {
+        var metadata = CreateRepeatMetadata(count, firstSeen, lastSeen);
+        if (mode is not (PermitAuditMode.Sampled or PermitAuditMode.RateLimited) && weight <= Math.Max(count, 1))
+            return metadata;
+
+        metadata ??= new Dictionary<string, string>();
+        metadata["auditMode"] = mode.ToString();
+        metadata["weight"] = Math.Max(weight, count).ToString(CultureInfo.InvariantCulture);
+        return metadata;
+    }
+
     /// <summary>
     /// Logs a policy change event
     /// </summary>
@@ -142,25 +259,40 @@ public sealed class AuditEngine : IDisposable
     }
 
     /// <summary>
-    /// Core event logging method
+    /// Logs behaviour flagged by the anomaly detector
     /// </summary>
-    private async Task LogEventAsync(AuditEvent auditEvent)
+    public async Task LogAnomalyAsync(AnomalyAlert alert)
     {
-        // Enrich with current user info
-        try
-        {
-            var identity = System.Security.Principal.WindowsIdentity.GetCurrent();
-            auditEvent.UserSid = identity.User?.Value;
-            auditEvent.UserName = identity.Name;
-        }
-        catch
+        var auditEvent = new AuditEvent
         {
-            // Ignore errors getting user info
-        }
+            Timestamp = alert.DetectedAt,
+            EventType = AuditEventType.Anomaly,
+            Severity = EventSeverity.Warning,
+            ProcessId = alert.Process?.ProcessId ?? 0,
+            ProcessCreateTime = alert.Process?.CreateTime ?? 0,
+            ProcessName = string.Empty,
+            Action = PolicyAction.Audit,
+            ResourceType = alert.DeviceType != null ? "Device" : "Network",
+            Message = alert.Message,
+            Metadata = new Dictionary<string, string>
+            {
+                ["anomaly"] = alert.Kind.ToString(),
+                ["observed"] = alert.Observed.ToString("G6", CultureInfo.InvariantCulture),
+                ["baseline"] = alert.Baseline.ToString("G6", CultureInfo.InvariantCulture)
+            }
+        };
 
-        // Queue for batch writing
-        _eventQueue.Enqueue(auditEvent);
+        if (alert.Endpoint != null)
+            auditEvent.Metadata["endpoint"] = alert.Endpoint;
+
+        await LogEventAsync(auditEvent);
+    }
 
+    /// <summary>
+    /// Core event logging method
+    /// </summary>
+    private async Task LogEventAsync(AuditEvent auditEvent)
+    {
         // Write to ETW immediately for real-time monitoring
         _eventSource.WriteAuditEvent(
             auditEvent.Id.ToString(),
@@ -183,67 +315,382 @@ public sealed class AuditEngine : IDisposable
             "Audit Event: {EventType} | PID: {ProcessId} | Action: {Action} | Message: {Message}",
             auditEvent.EventType, auditEvent.ProcessId, auditEvent.Action, auditEvent.Message);
 
-        // Flush if queue is large
-        if (_eventQueue.Count >= 100)
+        // Queue for the audit log; waits only for errors and critical
+        // events when the pipeline is full
+        await _captureStage.AdmitAsync(
+            new AuditPipelineItem(auditEvent, null, Stopwatch.GetTimestamp()), auditEvent.Severity);
+    }
+
+    /// <summary>
+    /// Waits until every event logged before the call is on disk (or
+    /// counted as lost)
+    /// </summary>
+    public async Task FlushAsync()
+    {
+        var flush = new TaskCompletionSource(TaskCreationOptions.RunContinuationsAsynchronously);
+        if (await _captureStage.AdmitAsync(new AuditPipelineItem(null, flush, Stopwatch.GetTimestamp()), null))
+            await flush.Task;
+    }
+
+    /// <summary>
+    /// Returns pipeline counters
+    /// </summary>
+    public AuditPipelineStatistics GetStatistics()
+    {
+        return new AuditPipelineStatistics
         {
-            await FlushEventsAsync();
-        }
+            Stages = new[]
+            {
+                _captureStage.GetStatistics(),
+                _serializeStage.GetStatistics(),
+                _writeStage.GetStatistics()
+            },
+            EventsWritten = Interlocked.Read(ref _eventsWritten),
+            EventsLost = Interlocked.Read(ref _eventsLost),
+            BlocksWritten = Interlocked.Read(ref _blocksWritten),
+            Commits = Interlocked.Read(ref _commits),
+            AverageCommitMicroseconds = _commitLatency.AverageMicroseconds,
+            AverageEndToEndMicroseconds = _endToEndLatency.AverageMicroseconds,
+            MaxEndToEndMicroseconds = _endToEndLatency.MaxMicroseconds
+        };
     }
 
     /// <summary>
-    /// Timer callback for periodic flush
+    /// Enrich stage: fills in user and process details
     /// </summary>
-    private void FlushTimerCallback(object? state)
+    private async Task EnrichLoopAsync()
     {
-        _ = FlushEventsAsync();
+        try
+        {
+            while (await _captureStage.WaitToReadAsync())
+            {
+                while (_captureStage.TryRead(out var item))
+                {
+                    if (item.Event is { } evt)
+                        await EnrichAsync(evt);
+
+                    await _serializeStage.AdmitAsync(item, item.Event?.Severity);
+                }
+            }
+        }
+        catch (Exception ex)
+        {
+            _logger.LogCritical(ex, "Audit enrich stage failed");
+        }
+        finally
+        {
+            _serializeStage.Complete();
+        }
     }
 
     /// <summary>
-    /// Flushes queued events to disk
+    /// The user is the event process's where the drivers captured it, else
+    /// the service's, which raised the event. Cache hits complete
+    /// synchronously.
     /// </summary>
-    private async Task FlushEventsAsync()
+    private async ValueTask EnrichAsync(AuditEvent evt)
     {
-        if (!await _flushSemaphore.WaitAsync(0))
-            return; // Another flush in progress
+        var key = new ProcessKey(evt.ProcessId, evt.ProcessCreateTime);
+        if (!_processCache.TryGet(key, out var process))
+        {
+            try
+            {
+                process = await _processCache.GetAsync(key);
+            }
+            catch (Exception ex)
+            {
+                _logger.LogDebug(ex, "Process {ProcessKey} not resolved", key);
+            }
+        }
+
+        if (process?.UserSid != null)
+        {
+            evt.UserSid = process.UserSid;
+            evt.UserName = process.UserName;
+        }
+        else
+        {
+            var (sid, name) = _serviceIdentity.Value;
+            evt.UserSid = sid;
+            evt.UserName = name;
+        }
+
+        if (process != null)
+        {
+            evt.ProcessPath ??= process.ImagePath;
+            if (string.IsNullOrEmpty(evt.ProcessName))
+                evt.ProcessName = process.Name ?? string.Empty;
+        }
+    }
 
+    private static (string? Sid, string? Name) GetServiceIdentity()
+    {
         try
         {
-            if (_eventQueue.IsEmpty)
-                return;
+            using var identity = System.Security.Principal.WindowsIdentity.GetCurrent();
+            return (identity.User?.Value, identity.Name);
+        }
+        catch
+        {
+            // Ignore errors getting user info
+            return (null, null);
+        }
+    }
+
+    /// <summary>
+    /// Serialize stage: groups events into blocks of up to MaxBatchEvents,
+    /// waiting BatchDelay for a partial block to fill unless a flush is
+    /// pending
+    /// </summary>
+    private async Task SerializeLoopAsync()
+    {
+        var batch = new List<AuditEvent>(_options.MaxBatchEvents);
 
-            var eventsToFlush = new List<AuditEvent>();
-            while (_eventQueue.TryDequeue(out var evt) && eventsToFlush.Count < 1000)
+        try
+        {
+            while (await _serializeStage.WaitToReadAsync())
             {
-                eventsToFlush.Add(evt);
+                var oldestCapturedAt = long.MaxValue;
+                var flushes = new List<TaskCompletionSource>();
+                List<VerdictTrace>? traces = null;
+
+                void Drain()
+                {
+                    while (batch.Count < _options.MaxBatchEvents && _serializeStage.TryRead(out var item))
+                    {
+                        if (item.Flush != null)
+                            flushes.Add(item.Flush);
+
+                        if (item.Event != null)
+                        {
+                            batch.Add(item.Event);
+                            oldestCapturedAt = Math.Min(oldestCapturedAt, item.CapturedAt);
+
+                            if (_latencyTracer != null && item.Event.Trace.Timestamp != 0)
+                                (traces ??= new List<VerdictTrace>()).Add(item.Event.Trace);
+                        }
+                    }
+                }
+
+                Drain();
+
+                if (batch.Count < _options.MaxBatchEvents && flushes.Count == 0 && _options.BatchDelay > TimeSpan.Zero)
+                {
+                    await Task.Delay(_options.BatchDelay);
+                    Drain();
+                }
+
+                AuditLogWriter? writer = null;
+                AuditLogBlock block = default;
+
+                if (batch.Count > 0)
+                {
+                    writer = GetLogWriter(batch);
+                    try
+                    {
+                        if (writer != null)
+                            block = writer.Encode(batch);
+                    }
+                    catch (Exception ex)
+                    {
+                        _logger.LogError(ex, "Error serializing {Count} audit events", batch.Count);
+                        writer = null;
+                    }
+
+                    if (writer == null)
+                        Interlocked.Add(ref _eventsLost, batch.Count);
+                }
+
+                var writeItem = new AuditWriteItem
+                {
+                    Writer = writer,
+                    Block = block,
+                    OldestCapturedAt = oldestCapturedAt,
+                    Traces = writer != null ? traces : null
+                };
+                writeItem.Flushes.AddRange(flushes);
+
+                batch.Clear();
+                await _writeStage.AdmitAsync(writeItem, null);
             }
+        }
+        catch (Exception ex)
+        {
+            _logger.LogCritical(ex, "Audit serialize stage failed");
+        }
+        finally
+        {
+            _writeStage.Complete();
+        }
+    }
 
-            if (eventsToFlush.Count == 0)
-                return;
+    /// <summary>
+    /// Returns the writer for the current segment, rotating daily and
+    /// reopening after a write fault. A segment that fails verification on
+    /// reopen is moved aside and recorded as a tamper attempt in the new
+    /// segment. Returns null if the segment cannot be opened.
+    /// </summary>
+    private AuditLogWriter? GetLogWriter(List<AuditEvent> batch)
+    {
+        var logFile = GetCurrentLogFilePath();
+        if (_logWriter != null && !_logWriter.Faulted && _logWriter.Path == logFile)
+            return _logWriter;
 
-            // Append to audit log file (JSON Lines format)
-            var logFile = GetCurrentLogFilePath();
-            var jsonOptions = new JsonSerializerOptions
+        // The write stage closes the previous writer once its blocks are
+        // committed
+        _logWriter = null;
+
+        try
+        {
+            _logWriter = AuditLogWriter.Open(logFile, (quarantinePath, reason) =>
             {
-                WriteIndented = false
-            };
+                _logger.LogCritical(
+                    "SECURITY ALERT: Audit log {LogFile} failed verification ({Reason}); moved to {QuarantinePath}",
+                    logFile, reason, quarantinePath);
+
+                batch.Insert(0, new AuditEvent
+                {
+                    EventType = AuditEventType.TamperAttempt,
+                    Severity = EventSeverity.Critical,
+                    ProcessId = (uint)Environment.ProcessId,
+                    ProcessName = "SecureHostService",
+                    Action = PolicyAction.Audit,
+                    ResourceType = "AuditLog",
+                    ResourceId = quarantinePath,
+                    Message = $"TAMPER ATTEMPT: Audit log failed verification: {reason}"
+                });
+            });
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error opening audit log file: {LogFile}", logFile);
+        }
+
+        return _logWriter;
+    }
 
-            await using var writer = new StreamWriter(logFile, append: true);
-            foreach (var evt in eventsToFlush)
+    /// <summary>
+    /// Write stage: appends every queued block, then commits them with a
+    /// single fsync per segment
+    /// </summary>
+    private async Task WriteLoopAsync()
+    {
+        AuditLogWriter? current = null;
+        var pending = new List<(AuditWriteItem Item, bool Written)>();
+        var uncommitted = false;
+
+        try
+        {
+            while (await _writeStage.WaitToReadAsync())
             {
-                var json = JsonSerializer.Serialize(evt, jsonOptions);
-                await writer.WriteLineAsync(json);
-            }
+                while (_writeStage.TryRead(out var item))
+                {
+                    if (item.Writer != null && item.Writer != current)
+                    {
+                        // Rotation or reopen: the previous segment is complete
+                        CompleteWrites(pending, !uncommitted || Commit(current));
+                        current?.Dispose();
+                        current = item.Writer;
+                        uncommitted = false;
+                    }
+
+                    var written = false;
+                    if (item.Writer != null)
+                    {
+                        try
+                        {
+                            if (item.Writer.Faulted)
+                                throw new IOException("Audit log writer faulted; block discarded");
+
+                            item.Writer.Write(item.Block);
+                            Interlocked.Increment(ref _blocksWritten);
+                            written = true;
+                            uncommitted = true;
+                        }
+                        catch (Exception ex)
+                        {
+                            _logger.LogError(ex, "Error writing {Count} audit events", item.Block.EventCount);
+                        }
+                    }
 
-            _logger.LogDebug("Flushed {Count} audit events to disk", eventsToFlush.Count);
+                    pending.Add((item, written));
+                }
+
+                CompleteWrites(pending, !uncommitted || Commit(current));
+                uncommitted = false;
+            }
         }
         catch (Exception ex)
         {
-            _logger.LogError(ex, "Error flushing audit events");
+            _logger.LogCritical(ex, "Audit write stage failed");
         }
         finally
         {
-            _flushSemaphore.Release();
+            CompleteWrites(pending, !uncommitted || Commit(current));
+            current?.Dispose();
+        }
+    }
+
+    /// <summary>
+    /// Accounts for blocks once their segment is committed (or failed to
+    /// commit), releases their buffers and completes flush markers
+    /// </summary>
+    private void CompleteWrites(List<(AuditWriteItem Item, bool Written)> pending, bool durable)
+    {
+        var now = Stopwatch.GetTimestamp();
+
+        foreach (var (item, written) in pending)
+        {
+            if (item.Writer != null)
+            {
+                if (written && durable)
+                {
+                    Interlocked.Add(ref _eventsWritten, item.Block.EventCount);
+                    _endToEndLatency.Record(now - item.OldestCapturedAt);
+
+                    if (item.Traces != null)
+                    {
+                        foreach (var trace in item.Traces)
+                            _latencyTracer!.Record(LatencyStage.AuditDurable, trace.CorrelationId, now - trace.Timestamp);
+                    }
+                }
+                else
+                {
+                    Interlocked.Add(ref _eventsLost, item.Block.EventCount);
+                }
+
+                item.Block.Return();
+            }
+
+            foreach (var flush in item.Flushes)
+                flush.TrySetResult();
+        }
+
+        pending.Clear();
+    }
+
+    /// <summary>
+    /// Flushes a segment to disk; false if that failed
+    /// </summary>
+    private bool Commit(AuditLogWriter? writer)
+    {
+        if (writer == null || writer.Faulted)
+            return writer == null;
+
+        var started = Stopwatch.GetTimestamp();
+        try
+        {
+            writer.Commit();
         }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error committing audit log: {LogFile}", writer.Path);
+            return false;
+        }
+
+        _commitLatency.Record(Stopwatch.GetTimestamp() - started);
+        Interlocked.Increment(ref _commits);
+        return true;
     }
 
     /// <summary>
@@ -261,97 +708,375 @@ public sealed class AuditEngine : IDisposable
 
     /// <summary>
     /// Exports events to SIEM format (CEF)
+    /// Events are written in log order, day by day.
     /// </summary>
     public async Task<int> ExportToSiemAsync(DateTime startTime, DateTime endTime, string outputPath)
     {
-        var events = await ReadEventsAsync(startTime, endTime);
-        var cefLines = new List<string>();
+        long count;
+        await using (var output = new FileStream(
+            outputPath, FileMode.Create, FileAccess.Write, FileShare.None, ExportFileBufferSize, useAsync: true))
+        {
+            var exporter = CreateExporter(startTime, endTime, SiemExportFormat.Cef, syslog: false, checkpoint: null);
+            await exporter.ExportAsync(output);
+            count = exporter.EventsWritten;
+        }
+
+        _logger.LogInformation("Exported {Count} events to SIEM format: {OutputPath}", count, outputPath);
+
+        return (int)count;
+    }
+
+    /// <summary>
+    /// Streams events in the window to <paramref name="output"/> as they
+    /// are formatted; nothing is staged on disk and memory use does not
+    /// grow with the window. Returns the number of events written.
+    /// </summary>
+    public async Task<long> ExportToSiemAsync(
+        DateTime startTime,
+        DateTime endTime,
+        Stream output,
+        SiemExportFormat format,
+        bool syslog = false,
+        CancellationToken cancellationToken = default)
+    {
+        var exporter = CreateExporter(startTime, endTime, format, syslog, checkpoint: null);
+        await exporter.ExportAsync(output, cancellationToken: cancellationToken);
+
+        _logger.LogInformation("Exported {Count} events to SIEM format ({Format}) stream", exporter.EventsWritten, format);
+
+        return exporter.EventsWritten;
+    }
+
+    /// <summary>
+    /// Starts a background export to a file in <see cref="ExportDirectory"/>
+    /// or a TCP syslog collector. Its checkpoint is saved in the same
+    /// directory after every chunk, so <see cref="ResumeSiemExport"/> can
+    /// continue it after a cancel, a failure or a service restart.
+    /// </summary>
+    /// <exception cref="ArgumentException">The window or destination is invalid</exception>
+    public SiemExportProgress StartSiemExport(SiemExportRequest request)
+    {
+        ArgumentNullException.ThrowIfNull(request);
+
+        if (request.EndTime < request.StartTime)
+            throw new ArgumentException("The export window ends before it starts", nameof(request));
+
+        if (!TryParseTcpDestination(request.Destination, out _, out _) && !IsExportFileName(request.Destination))
+            throw new ArgumentException("Destination must be a file name or tcp://host:port", nameof(request));
+
+        var checkpoint = new SiemExportCheckpoint
+        {
+            Id = Guid.NewGuid(),
+            Request = new SiemExportRequest
+            {
+                StartTime = request.StartTime,
+                EndTime = request.EndTime,
+                Format = request.Format,
+                Syslog = request.Syslog,
+                Destination = request.Destination
+            }
+        };
+
+        return StartExportJob(checkpoint, resume: false).GetProgress();
+    }
+
+    /// <summary>
+    /// Continues an export from its last checkpoint. Returns the running
+    /// job if it has not stopped, and null for an unknown ID.
+    /// </summary>
+    public SiemExportProgress? ResumeSiemExport(Guid id)
+    {
+        // Held throughout, so two resumes cannot both write the file
+        lock (_exportJobs)
+        {
+            if (_exportJobs.TryGetValue(id, out var job) && job.State == SiemExportState.Running)
+                return job.GetProgress();
+
+            var checkpoint = LoadCheckpoint(id);
+            if (checkpoint == null)
+                return null;
+
+            return StartExportJob(checkpoint, resume: true).GetProgress();
+        }
+    }
+
+    public SiemExportProgress? GetSiemExport(Guid id)
+    {
+        lock (_exportJobs)
+        {
+            return _exportJobs.TryGetValue(id, out var job) ? job.GetProgress() : null;
+        }
+    }
 
-        foreach (var evt in events)
+    public IReadOnlyList<SiemExportProgress> GetSiemExports()
+    {
+        lock (_exportJobs)
         {
-            var cef = ConvertToCef(evt);
-            cefLines.Add(cef);
+            return _exportJobs.Values.Select(job => job.GetProgress()).OrderBy(p => p.StartedAt).ToList();
         }
+    }
 
-        await File.WriteAllLinesAsync(outputPath, cefLines);
-        _logger.LogInformation("Exported {Count} events to SIEM format: {OutputPath}", cefLines.Count, outputPath);
+    /// <summary>
+    /// Cancels a running export; its checkpoint is kept for resuming
+    /// </summary>
+    public bool CancelSiemExport(Guid id)
+    {
+        lock (_exportJobs)
+        {
+            if (!_exportJobs.TryGetValue(id, out var job) || job.State != SiemExportState.Running)
+                return false;
 
-        return cefLines.Count;
+            job.Cancel();
+            return true;
+        }
     }
 
     /// <summary>
-    /// Reads audit events from log files
+    /// Directory for export files and checkpoints, beside the audit log
     /// </summary>
-    private async Task<List<AuditEvent>> ReadEventsAsync(DateTime startTime, DateTime endTime)
+    public string ExportDirectory => Path.Combine(Path.GetDirectoryName(_auditLogPath)!, "Exports");
+
+    private SiemExporter CreateExporter(
+        DateTime startTime,
+        DateTime endTime,
+        SiemExportFormat format,
+        bool syslog,
+        SiemExportCheckpoint? checkpoint)
     {
-        var events = new List<AuditEvent>();
-        var directory = Path.GetDirectoryName(_auditLogPath)!;
-        var pattern = Path.GetFileNameWithoutExtension(_auditLogPath) + "_*.jsonl";
+        var files = GetLogFiles(startTime, endTime);
 
-        var files = Directory.GetFiles(directory, pattern);
+        // Files wholly before the checkpoint are done
+        if (checkpoint?.Segment is { } segment)
+        {
+            var resumeAt = Path.Combine(Path.GetDirectoryName(_auditLogPath)!, segment);
+            files.RemoveAll(file => CompareLogFiles(file, resumeAt) < 0);
+        }
 
-        foreach (var file in files)
+        return new SiemExporter(
+            _logger, files, IsLegacyLog, startTime, endTime, format, syslog,
+            _options.ExportParallelism, _options.ExportChunkEvents, checkpoint);
+    }
+
+    private SiemExportJob StartExportJob(SiemExportCheckpoint checkpoint, bool resume)
+    {
+        var request = checkpoint.Request;
+        var syslog = request.Syslog || TryParseTcpDestination(request.Destination, out _, out _);
+        var exporter = CreateExporter(request.StartTime, request.EndTime, request.Format, syslog, checkpoint);
+        var job = new SiemExportJob(checkpoint, exporter);
+
+        // Saved before the job runs, so even an export cancelled at once can be resumed
+        if (!resume)
         {
-            try
+            Directory.CreateDirectory(ExportDirectory);
+            SaveCheckpoint(GetCheckpointPath(checkpoint.Id), checkpoint);
+        }
+
+        lock (_exportJobs)
+        {
+            _exportJobs[checkpoint.Id] = job;
+        }
+
+        job.Run(token => RunExportJobAsync(job, resume, token));
+        return job;
+    }
+
+    private async Task RunExportJobAsync(SiemExportJob job, bool resume, CancellationToken cancellationToken)
+    {
+        var checkpoint = job.Checkpoint;
+        var checkpointPath = GetCheckpointPath(checkpoint.Id);
+
+        try
+        {
+            if (!checkpoint.Completed)
             {
-                var lines = await File.ReadAllLinesAsync(file);
-                foreach (var line in lines)
+                await using var output = await OpenExportDestinationAsync(checkpoint, resume, cancellationToken);
+                await job.Exporter.ExportAsync(output, _ =>
                 {
-                    if (string.IsNullOrWhiteSpace(line))
-                        continue;
+                    if (output is FileStream file)
+                        file.Flush(flushToDisk: true);
+                    SaveCheckpoint(checkpointPath, checkpoint);
+                    return ValueTask.CompletedTask;
+                }, cancellationToken);
 
-                    var evt = JsonSerializer.Deserialize<AuditEvent>(line);
-                    if (evt != null &&
-                        evt.Timestamp >= startTime &&
-                        evt.Timestamp <= endTime)
-                    {
-                        events.Add(evt);
-                    }
-                }
+                checkpoint.Completed = true;
+                SaveCheckpoint(checkpointPath, checkpoint);
             }
-            catch (Exception ex)
+
+            _logger.LogInformation("SIEM export {ExportId} to {Destination} completed: {Count} events",
+                checkpoint.Id, checkpoint.Request.Destination, checkpoint.EventsWritten);
+            job.Complete(SiemExportState.Completed, null);
+        }
+        catch (OperationCanceledException) when (cancellationToken.IsCancellationRequested)
+        {
+            _logger.LogInformation("SIEM export {ExportId} cancelled after {Count} events",
+                checkpoint.Id, checkpoint.EventsWritten);
+            job.Complete(SiemExportState.Cancelled, null);
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "SIEM export {ExportId} to {Destination} failed",
+                checkpoint.Id, checkpoint.Request.Destination);
+            job.Complete(SiemExportState.Failed, ex.Message);
+        }
+    }
+
+    /// <summary>
+    /// Connects to a TCP collector, or opens the export file; a resumed
+    /// file is cut back to the checkpoint, dropping anything written after
+    /// it. A TCP collector may see the chunk after the checkpoint twice.
+    /// </summary>
+    private async Task<Stream> OpenExportDestinationAsync(
+        SiemExportCheckpoint checkpoint,
+        bool resume,
+        CancellationToken cancellationToken)
+    {
+        if (TryParseTcpDestination(checkpoint.Request.Destination, out var host, out var port))
+        {
+            var socket = new Socket(SocketType.Stream, ProtocolType.Tcp);
+            try
+            {
+                await socket.ConnectAsync(host, port, cancellationToken);
+                return new NetworkStream(socket, ownsSocket: true);
+            }
+            catch
+            {
+                socket.Dispose();
+                throw;
+            }
+        }
+
+        var path = Path.Combine(ExportDirectory, checkpoint.Request.Destination);
+        var output = new FileStream(
+            path, resume ? FileMode.OpenOrCreate : FileMode.Create, FileAccess.Write, FileShare.Read,
+            ExportFileBufferSize, useAsync: true);
+
+        if (resume)
+        {
+            if (output.Length < checkpoint.BytesWritten)
             {
-                _logger.LogError(ex, "Error reading audit log file: {File}", file);
+                await output.DisposeAsync();
+                throw new InvalidDataException($"Export file {path} is shorter than its checkpoint");
             }
+
+            output.SetLength(checkpoint.BytesWritten);
+            output.Seek(0, SeekOrigin.End);
+        }
+
+        return output;
+    }
+
+    private string GetCheckpointPath(Guid id) => Path.Combine(ExportDirectory, $"{id:N}.checkpoint");
+
+    private static void SaveCheckpoint(string path, SiemExportCheckpoint checkpoint)
+    {
+        // Replace, so a crash leaves the previous checkpoint whole
+        var temporary = path + ".tmp";
+        using (var stream = new FileStream(temporary, FileMode.Create, FileAccess.Write, FileShare.None))
+        {
+            JsonSerializer.Serialize(stream, checkpoint);
+            stream.Flush(flushToDisk: true);
         }
 
-        return events.OrderBy(e => e.Timestamp).ToList();
+        File.Move(temporary, path, overwrite: true);
+    }
+
+    private SiemExportCheckpoint? LoadCheckpoint(Guid id)
+    {
+        var path = GetCheckpointPath(id);
+        if (!File.Exists(path))
+            return null;
+
+        try
+        {
+            var checkpoint = JsonSerializer.Deserialize<SiemExportCheckpoint>(File.ReadAllText(path));
+            return checkpoint?.Id == id ? checkpoint : null;
+        }
+        catch (JsonException ex)
+        {
+            _logger.LogError(ex, "Invalid SIEM export checkpoint: {Path}", path);
+            return null;
+        }
+    }
+
+    private static bool TryParseTcpDestination(string destination, out string host, out int port)
+    {
+        host = string.Empty;
+        port = 0;
+
+        if (!Uri.TryCreate(destination, UriKind.Absolute, out var uri) ||
+            !uri.Scheme.Equals("tcp", StringComparison.OrdinalIgnoreCase) ||
+            uri.Port <= 0 ||
+            string.IsNullOrEmpty(uri.Host))
+        {
+            return false;
+        }
+
+        host = uri.Host;
+        port = uri.Port;
+        return true;
     }
 
     /// <summary>
-    /// Converts audit event to CEF (Common Event Format) for SIEM
+    /// A plain file name, so an API caller cannot write outside the
+    /// export directory
     /// </summary>
-    private string ConvertToCef(AuditEvent evt)
+    private static bool IsExportFileName(string destination)
     {
-        // CEF format:
-        // CEF:Version|Device Vendor|Device Product|Device Version|Signature ID|Name|Severity|Extension
-        var severity = evt.Severity switch
-        {
-            EventSeverity.Info => 0,
-            EventSeverity.Warning => 5,
-            EventSeverity.Error => 7,
-            EventSeverity.Critical => 10,
-            _ => 0
-        };
+        return !string.IsNullOrWhiteSpace(destination) &&
+               destination.IndexOfAny(Path.GetInvalidFileNameChars()) < 0 &&
+               Path.GetFileName(destination) == destination &&
+               destination != "." && destination != ".." &&
+               !destination.EndsWith(".checkpoint", StringComparison.OrdinalIgnoreCase);
+    }
+
+    /// <summary>
+    /// Lists audit log files that may hold events in the window, oldest
+    /// first. Segments are picked by the day in their name, with a day of
+    /// slack either side for events flushed across midnight.
+    /// </summary>
+    private List<string> GetLogFiles(DateTime startTime, DateTime endTime)
+    {
+        var directory = Path.GetDirectoryName(_auditLogPath)!;
+        var baseName = Path.GetFileNameWithoutExtension(_auditLogPath);
+        var extension = Path.GetExtension(_auditLogPath);
+
+        var files = Directory.GetFiles(directory, $"{baseName}_*{extension}").ToList();
+        if (!extension.Equals(".jsonl", StringComparison.OrdinalIgnoreCase))
+            files.AddRange(Directory.GetFiles(directory, $"{baseName}_*.jsonl"));
+
+        var firstDay = startTime.Date.AddDays(-1);
+        var lastDay = endTime.Date.AddDays(1);
 
-        var extension = $"dvchost={Environment.MachineName} " +
-                       $"duser={evt.UserName} " +
-                       $"suid={evt.UserSid} " +
-                       $"sproc={evt.ProcessName} " +
-                       $"spid={evt.ProcessId} " +
-                       $"act={evt.Action} " +
-                       $"msg={EscapeCef(evt.Message)}";
+        files = files
+            .Where(file => !DateTime.TryParseExact(GetDayStamp(file), "yyyyMMdd", CultureInfo.InvariantCulture,
+                               DateTimeStyles.None, out var day) ||
+                           (day >= firstDay && day <= lastDay))
+            .ToList();
 
-        return $"CEF:0|SecureHost|SecureHostSuite|1.0|{evt.EventType}|{evt.EventType}|{severity}|{extension}";
+        files.Sort(CompareLogFiles);
+        return files;
+    }
+
+    /// <summary>
+    /// Orders log files by day, then name: a day's legacy log (.jsonl)
+    /// comes before its segment
+    /// </summary>
+    private int CompareLogFiles(string first, string second)
+    {
+        var order = string.CompareOrdinal(GetDayStamp(first), GetDayStamp(second));
+        return order != 0 ? order : string.CompareOrdinal(Path.GetFileName(first), Path.GetFileName(second));
     }
 
-    private static string EscapeCef(string value)
+    private string GetDayStamp(string file)
     {
-        return value.Replace("\\", "\\\\")
-                   .Replace("|", "\\|")
-                   .Replace("=", "\\=")
-                   .Replace("\n", "\\n")
-                   .Replace("\r", "\\r");
+        var name = Path.GetFileNameWithoutExtension(file);
+        var baseLength = Path.GetFileNameWithoutExtension(_auditLogPath).Length + 1;
+        return name.Length > baseLength ? name[baseLength..] : string.Empty;
+    }
+
+    private bool IsLegacyLog(string file)
+    {
+        return !Path.GetExtension(file).Equals(Path.GetExtension(_auditLogPath), StringComparison.OrdinalIgnoreCase);
     }
 
     public void Dispose()
@@ -359,19 +1084,42 @@ public sealed class AuditEngine : IDisposable
         if (_disposed)
             return;
 
-        _flushTimer.Dispose();
-        _eventSource.Dispose();
-        _flushSemaphore.Dispose();
+        // Running exports stop at their last checkpoint
+        List<Task> exports;
+        lock (_exportJobs)
+        {
+            exports = _exportJobs.Values.Select(job => job.Cancel()).ToList();
+        }
+        Task.WaitAll(exports.ToArray(), ShutdownTimeout);
+
+        // Drain the pipeline: each stage completes the next when it runs dry
+        _captureStage.Complete();
+        if (!_pipelineTask.Wait(ShutdownTimeout))
+            _logger.LogError("Audit pipeline did not drain within {Timeout}", ShutdownTimeout);
+
         _disposed = true;
     }
 }
 
 /// <summary>
-/// ETW Event Source for SecureHost audit events
+/// ETW Event Source for SecureHost audit events and verdict latency
+/// traces. One instance per process; ETW takes one registration per
+/// provider.
 /// </summary>
 [EventSource(Name = "SecureHost-Audit")]
 public sealed class SecureHostEventSource : EventSource
 {
+    public static SecureHostEventSource Log { get; } = new();
+
+    public static class Keywords
+    {
+        public const EventKeywords Latency = (EventKeywords)0x1;
+    }
+
+    private SecureHostEventSource()
+    {
+    }
+
     [Event(1, Level = EventLevel.Informational, Message = "Audit Event: {0} | Type: {1} | Severity: {2} | Process: {3} | Message: {4}")]
     public void WriteAuditEvent(string eventId, string eventType, string severity, string processName, string message)
     {
@@ -383,4 +1131,23 @@ public sealed class SecureHostEventSource : EventSource
     {
         WriteEvent(2, processId, processName, details);
     }
+
+    /// <summary>
+    /// One stage of a traced verdict. Written without allocation; only
+    /// listeners that enable <see cref="Keywords.Latency"/> receive it.
+    /// </summary>
+    [Event(3, Level = EventLevel.Verbose, Keywords = Keywords.Latency,
+        Message = "Verdict {0}: {1} took {2} ns")]
+    public unsafe void VerdictLatency(ulong correlationId, LatencyStage stage, long nanoseconds)
+    {
+        if (!IsEnabled(EventLevel.Verbose, Keywords.Latency))
+            return;
+
+        var stageValue = (int)stage;
+        var data = stackalloc EventData[3];
+        data[0] = new EventData { DataPointer = (IntPtr)(&correlationId), Size = sizeof(ulong) };
+        data[1] = new EventData { DataPointer = (IntPtr)(&stageValue), Size = sizeof(int) };
+        data[2] = new EventData { DataPointer = (IntPtr)(&nanoseconds), Size = sizeof(long) };
+        WriteEventCore(3, 3, data);
+    }
 }
@@ -0,0 +1,954 @@
+using System.Buffers;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+using System.Security.Cryptography;
+using System.Text;
+using System.Text.Json;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Binary audit log segment format (one file per day)
+///
+/// A segment is a <see cref="AuditSegmentHeader"/> followed by blocks, one
+/// per flush. Each block is an <see cref="AuditBlockHeader"/>, a string
+/// section, then fixed-size <see cref="AuditRecord"/>s. Block headers carry
+/// the block's time range, so a reader walks headers alone to reach the
+/// blocks overlapping a window.
+///
+/// Strings: records refer to strings by ID. Low-cardinality fields
+/// (process, user, addresses, devices) are interned in a per-segment
+/// dictionary; each block defines the dictionary entries first used in
+/// it. Per-event text (message, resource ID, metadata) is block-local.
+///
+/// Integrity: each block stores the previous block's hash and
+/// SHA-256(header fields, previous hash, payload). Readers verify the hash
+/// of every block they read records from and the chain link of every
+/// block they skip, so edits, removed or reordered blocks are reported.
+/// The hash is unkeyed; it detects tampering with the file alone, not an
+/// attacker who rewrites the whole chain.
+/// </summary>
+internal static class AuditLogSegment
+{
+    public const ulong SegmentMagic = 0x474F4C4455414853;   // "SHAUDLOG"
+    public const uint BlockMagic = 0x4B4C4253;              // "SBLK"
+    public const uint Version = 1;
+
+    public const int HashSize = 32;
+
+    // String references: 0 = null; otherwise a dictionary ID, or a
+    // block-local index with the high bit set
+    public const uint NullString = 0;
+    public const uint LocalStringFlag = 0x80000000;
+
+    public const int MaxDictionaryEntries = 65536;
+    public const int MaxInternedChars = 512;
+    public const int MaxStringChars = 16383;    // Fits a UInt16 byte length as UTF-8
+
+    public static readonly int SegmentHeaderSize = Unsafe.SizeOf<AuditSegmentHeader>();
+    public static readonly int BlockHeaderSize = Unsafe.SizeOf<AuditBlockHeader>();
+    public static readonly int RecordSize = Unsafe.SizeOf<AuditRecord>();
+
+    // Bytes of a block header covered by its hash: everything but Hash
+    public static readonly int HashedHeaderSize = BlockHeaderSize - HashSize;
+
+    public static int Align(int length) => (length + 7) & ~7;
+}
+
+[StructLayout(LayoutKind.Sequential, Size = 64)]
+internal unsafe struct AuditSegmentHeader
+{
+    public ulong Magic;
+    public uint Version;
+    public uint HeaderSize;
+    public uint BlockHeaderSize;
+    public uint RecordSize;
+    public long CreatedTicks;
+    public fixed byte Reserved[32];
+}
+
+[StructLayout(LayoutKind.Sequential, Size = 112)]
+internal unsafe struct AuditBlockHeader
+{
+    public uint Magic;
+    public uint RecordCount;
+    public uint DictionaryCount;    // Dictionary entries defined by this block
+    public uint LocalCount;
+    public uint StringBytes;        // String section length, before alignment
+    public uint Reserved;
+    public long MinTimestamp;       // UTC ticks
+    public long MaxTimestamp;
+    public long Sequence;           // 0 for the first block of a segment
+    public fixed byte PreviousHash[AuditLogSegment.HashSize];
+    public fixed byte Hash[AuditLogSegment.HashSize];
+
+    public readonly int PayloadLength =>
+        AuditLogSegment.Align((int)StringBytes) + (int)RecordCount * AuditLogSegment.RecordSize;
+}
+
+[Flags]
+internal enum AuditRecordFlags : byte
+{
+    None = 0,
+    HasRuleId = 0x1,
+    HasNetwork = 0x2,
+    HasDevice = 0x4
+}
+
+/// <summary>
+/// One audit event; string fields are string references
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 112)]
+internal struct AuditRecord
+{
+    public long Timestamp;          // UTC ticks
+    public Guid Id;
+    public ulong RuleId;
+    public ulong BytesTransferred;
+    public uint ProcessId;
+    public byte EventType;
+    public byte Severity;
+    public byte Action;
+    public AuditRecordFlags Flags;
+    public uint ProcessName;
+    public uint ProcessPath;
+    public uint UserSid;
+    public uint UserName;
+    public uint ResourceType;
+    public uint ResourceId;
+    public uint Message;
+    public uint Metadata;           // JSON object
+    public ushort LocalPort;
+    public ushort RemotePort;
+    public byte Protocol;
+    public byte Direction;
+    public byte DeviceType;
+    public byte AccessType;
+    public uint LocalAddress;
+    public uint RemoteAddress;
+    public uint DeviceId;
+    public uint DeviceName;
+    public uint HardwareId;
+    public uint Manufacturer;
+}
+
+/// <summary>
+/// An encoded block in a pooled buffer
+/// </summary>
+internal readonly record struct AuditLogBlock(byte[] Buffer, int Length, int EventCount)
+{
+    public void Return() => ArrayPool<byte>.Shared.Return(Buffer);
+}
+
+/// <summary>
+/// Appends blocks of audit events to one segment
+/// Encoding and writing are separate so they can run on different
+/// threads: one thread encodes, another writes and commits the blocks in
+/// the order they were encoded. Neither side is otherwise thread-safe.
+/// </summary>
+internal sealed class AuditLogWriter : IDisposable
+{
+    private readonly FileStream _stream;
+    private readonly Dictionary<string, uint> _dictionary = new(StringComparer.Ordinal);
+    private readonly List<string> _pendingDictionary = new();
+    private readonly List<string> _pendingLocal = new();
+    private readonly ArrayBufferWriter<byte> _block = new(64 * 1024);
+    private readonly byte[] _previousHash = new byte[AuditLogSegment.HashSize];
+    private long _sequence;
+    private volatile bool _faulted;
+
+    private AuditLogWriter(string path, FileStream stream)
+    {
+        Path = path;
+        _stream = stream;
+    }
+
+    public string Path { get; }
+
+    /// <summary>
+    /// Set by the writing side when a write fails and the stream is
+    /// closed. Blocks encoded since then chain to data that never reached
+    /// the file, so they are discarded and the segment reopened.
+    /// </summary>
+    public bool Faulted => _faulted;
+
+    /// <summary>
+    /// Opens a segment for appending, creating it if needed. An existing
+    /// segment is walked to restore its dictionary and hash chain; a tail
+    /// torn by a crash is cut off. A segment that fails verification is
+    /// moved aside (reported through <paramref name="onCorrupt"/>) and a
+    /// new one started.
+    /// </summary>
+    public static AuditLogWriter Open(string path, Action<string, string> onCorrupt)
+    {
+        if (File.Exists(path))
+        {
+            var recovery = AuditLogReader.Recover(path);
+            if (recovery.Error == null)
+            {
+                var stream = new FileStream(path, FileMode.Open, FileAccess.Write, FileShare.Read);
+                try
+                {
+                    stream.SetLength(recovery.ValidLength);
+                    stream.Seek(0, SeekOrigin.End);
+
+                    var writer = new AuditLogWriter(path, stream);
+                    for (var i = 0; i < recovery.Dictionary.Count; i++)
+                        writer._dictionary[recovery.Dictionary[i]] = (uint)(i + 1);
+                    recovery.LastHash.CopyTo(writer._previousHash, 0);
+                    writer._sequence = recovery.BlockCount;
+                    return writer;
+                }
+                catch
+                {
+                    stream.Dispose();
+                    throw;
+                }
+            }
+
+            var quarantine = $"{path}.corrupt-{DateTime.UtcNow:yyyyMMddHHmmssfff}";
+            File.Move(path, quarantine);
+            onCorrupt(quarantine, recovery.Error);
+        }
+
+        var created = new FileStream(path, FileMode.CreateNew, FileAccess.Write, FileShare.Read);
+        try
+        {
+            var header = new AuditSegmentHeader
+            {
+                Magic = AuditLogSegment.SegmentMagic,
+                Version = AuditLogSegment.Version,
+                HeaderSize = (uint)AuditLogSegment.SegmentHeaderSize,
+                BlockHeaderSize = (uint)AuditLogSegment.BlockHeaderSize,
+                RecordSize = (uint)AuditLogSegment.RecordSize,
+                CreatedTicks = DateTime.UtcNow.Ticks
+            };
+            created.Write(MemoryMarshal.AsBytes(new ReadOnlySpan<AuditSegmentHeader>(in header)));
+            created.Flush();
+            return new AuditLogWriter(path, created);
+        }
+        catch
+        {
+            created.Dispose();
+            throw;
+        }
+    }
+
+    /// <summary>
+    /// Encodes the events as the next block of the segment
+    /// </summary>
+    public AuditLogBlock Encode(IReadOnlyList<AuditEvent> events)
+    {
+        if (events.Count == 0)
+            throw new ArgumentException("A block needs at least one event", nameof(events));
+
+        BuildBlock(events);
+
+        var buffer = ArrayPool<byte>.Shared.Rent(_block.WrittenCount);
+        _block.WrittenSpan.CopyTo(buffer);
+        return new AuditLogBlock(buffer, _block.WrittenCount, events.Count);
+    }
+
+    /// <summary>
+    /// Appends an encoded block; durable after the next <see cref="Commit"/>.
+    /// On failure the writer is closed and marked faulted.
+    /// </summary>
+    public void Write(in AuditLogBlock block)
+    {
+        try
+        {
+            _stream.Write(block.Buffer, 0, block.Length);
+        }
+        catch
+        {
+            Fault();
+            throw;
+        }
+    }
+
+    /// <summary>
+    /// Flushes everything written so far to disk
+    /// </summary>
+    public void Commit()
+    {
+        try
+        {
+            _stream.Flush(flushToDisk: true);
+        }
+        catch
+        {
+            Fault();
+            throw;
+        }
+    }
+
+    private void Fault()
+    {
+        _stream.Dispose();
+        _faulted = true;
+    }
+
+    private void BuildBlock(IReadOnlyList<AuditEvent> events)
+    {
+        _pendingDictionary.Clear();
+        _pendingLocal.Clear();
+        _block.Clear();
+
+        // Records first, into a scratch span, so every string is known
+        // before the string section is laid out
+        var records = ArrayPool<AuditRecord>.Shared.Rent(events.Count);
+        try
+        {
+            var minTimestamp = long.MaxValue;
+            var maxTimestamp = long.MinValue;
+
+            for (var i = 0; i < events.Count; i++)
+            {
+                records[i] = ToRecord(events[i]);
+                minTimestamp = Math.Min(minTimestamp, records[i].Timestamp);
+                maxTimestamp = Math.Max(maxTimestamp, records[i].Timestamp);
+            }
+
+            var headerSpan = _block.GetSpan(AuditLogSegment.BlockHeaderSize)[..AuditLogSegment.BlockHeaderSize];
+            headerSpan.Clear();
+            _block.Advance(AuditLogSegment.BlockHeaderSize);
+
+            var stringStart = _block.WrittenCount;
+            WriteStrings(_pendingDictionary);
+            WriteStrings(_pendingLocal);
+            var stringBytes = _block.WrittenCount - stringStart;
+
+            var padding = AuditLogSegment.Align(stringBytes) - stringBytes;
+            _block.GetSpan(padding)[..padding].Clear();
+            _block.Advance(padding);
+
+            var recordBytes = MemoryMarshal.AsBytes(records.AsSpan(0, events.Count));
+            recordBytes.CopyTo(_block.GetSpan(recordBytes.Length));
+            _block.Advance(recordBytes.Length);
+
+            var header = new AuditBlockHeader
+            {
+                Magic = AuditLogSegment.BlockMagic,
+                RecordCount = (uint)events.Count,
+                DictionaryCount = (uint)_pendingDictionary.Count,
+                LocalCount = (uint)_pendingLocal.Count,
+                StringBytes = (uint)stringBytes,
+                MinTimestamp = minTimestamp,
+                MaxTimestamp = maxTimestamp,
+                Sequence = _sequence
+            };
+
+            var block = MemoryMarshal.AsMemory(_block.WrittenMemory).Span;
+            MemoryMarshal.Write(block, in header);
+            _previousHash.CopyTo(block.Slice(AuditLogSegment.HashedHeaderSize - AuditLogSegment.HashSize));
+
+            var hash = block.Slice(AuditLogSegment.HashedHeaderSize, AuditLogSegment.HashSize);
+            using var hasher = IncrementalHash.CreateHash(HashAlgorithmName.SHA256);
+            AuditLogReader.ComputeBlockHash(hasher, block[..AuditLogSegment.HashedHeaderSize],
+                block[AuditLogSegment.BlockHeaderSize..], hash);
+
+            hash.CopyTo(_previousHash);
+            _sequence++;
+        }
+        finally
+        {
+            ArrayPool<AuditRecord>.Shared.Return(records);
+        }
+    }
+
+    private void WriteStrings(List<string> strings)
+    {
+        foreach (var value in strings)
+        {
+            var length = Encoding.UTF8.GetByteCount(value);
+            var span = _block.GetSpan(sizeof(ushort) + length);
+            BitConverter.TryWriteBytes(span, (ushort)length);
+            Encoding.UTF8.GetBytes(value, span[sizeof(ushort)..]);
+            _block.Advance(sizeof(ushort) + length);
+        }
+    }
+
+    private AuditRecord ToRecord(AuditEvent evt)
+    {
+        var record = new AuditRecord
+        {
+            Timestamp = evt.Timestamp.Ticks,
+            Id = evt.Id,
+            RuleId = evt.RuleId ?? 0,
+            ProcessId = evt.ProcessId,
+            EventType = (byte)evt.EventType,
+            Severity = (byte)evt.Severity,
+            Action = (byte)evt.Action,
+            Flags = evt.RuleId.HasValue ? AuditRecordFlags.HasRuleId : AuditRecordFlags.None,
+            ProcessName = Intern(evt.ProcessName),
+            ProcessPath = Intern(evt.ProcessPath),
+            UserSid = Intern(evt.UserSid),
+            UserName = Intern(evt.UserName),
+            ResourceType = Intern(evt.ResourceType),
+            ResourceId = Local(evt.ResourceId),
+            Message = Local(evt.Message),
+            Metadata = evt.Metadata != null ? Local(JsonSerializer.Serialize(evt.Metadata)) : AuditLogSegment.NullString
+        };
+
+        if (evt.NetworkDetails is { } network)
+        {
+            record.Flags |= AuditRecordFlags.HasNetwork;
+            record.Protocol = (byte)network.Protocol;
+            record.Direction = (byte)network.Direction;
+            record.LocalPort = network.LocalPort;
+            record.RemotePort = network.RemotePort;
+            record.LocalAddress = Intern(network.LocalAddress);
+            record.RemoteAddress = Intern(network.RemoteAddress);
+            record.BytesTransferred = network.BytesTransferred;
+        }
+
+        if (evt.DeviceDetails is { } device)
+        {
+            record.Flags |= AuditRecordFlags.HasDevice;
+            record.DeviceType = (byte)device.DeviceType;
+            record.AccessType = (byte)device.AccessType;
+            record.DeviceId = Intern(device.DeviceId);
+            record.DeviceName = Intern(device.DeviceName);
+            record.HardwareId = Intern(device.HardwareId);
+            record.Manufacturer = Intern(device.Manufacturer);
+        }
+
+        return record;
+    }
+
+    private uint Intern(string? value)
+    {
+        if (value == null)
+            return AuditLogSegment.NullString;
+
+        if (_dictionary.TryGetValue(value, out var id))
+            return id;
+
+        if (value.Length > AuditLogSegment.MaxInternedChars ||
+            _dictionary.Count >= AuditLogSegment.MaxDictionaryEntries)
+            return Local(value);
+
+        id = (uint)(_dictionary.Count + 1);
+        _dictionary.Add(value, id);
+        _pendingDictionary.Add(value);
+        return id;
+    }
+
+    private uint Local(string? value)
+    {
+        if (value == null)
+            return AuditLogSegment.NullString;
+
+        if (value.Length > AuditLogSegment.MaxStringChars)
+        {
+            var length = AuditLogSegment.MaxStringChars;
+            if (char.IsHighSurrogate(value[length - 1]))
+                length--;
+            value = value[..length];
+        }
+
+        _pendingLocal.Add(value);
+        return AuditLogSegment.LocalStringFlag | (uint)(_pendingLocal.Count - 1);
+    }
+
+    public void Dispose()
+    {
+        _stream.Dispose();
+    }
+}
+
+/// <summary>
+/// Strings visible to a record: the segment dictionary so far and the
+/// current block's local strings, as UTF-8 slices of the mapped segment
+/// </summary>
+internal readonly ref struct AuditStringTable
+{
+    private readonly ReadOnlySpan<byte> _segment;
+    private readonly List<(int Offset, int Length)> _dictionary;
+    private readonly List<(int Offset, int Length)> _local;
+
+    public AuditStringTable(
+        ReadOnlySpan<byte> segment,
+        List<(int Offset, int Length)> dictionary,
+        List<(int Offset, int Length)> local)
+    {
+        _segment = segment;
+        _dictionary = dictionary;
+        _local = local;
+    }
+
+    /// <summary>
+    /// UTF-8 bytes of a string reference; empty for null or unknown IDs
+    /// </summary>
+    public ReadOnlySpan<byte> GetUtf8(uint reference)
+    {
+        var (list, index) = (reference & AuditLogSegment.LocalStringFlag) != 0
+            ? (_local, (int)(reference & ~AuditLogSegment.LocalStringFlag))
+            : (_dictionary, (int)reference - 1);
+
+        if (reference == AuditLogSegment.NullString || (uint)index >= (uint)list.Count)
+            return ReadOnlySpan<byte>.Empty;
+
+        var (offset, length) = list[index];
+        return _segment.Slice(offset, length);
+    }
+
+    public string? GetString(uint reference)
+    {
+        return reference == AuditLogSegment.NullString ? null : Encoding.UTF8.GetString(GetUtf8(reference));
+    }
+}
+
+internal delegate void AuditRecordVisitor(in AuditRecord record, in AuditStringTable strings);
+
+/// <summary>
+/// Where a block lies in its segment
+/// </summary>
+internal readonly record struct AuditBlockLocation(int Offset, int Length, long Sequence, int RecordCount);
+
+/// <summary>
+/// Read-only memory map of a whole segment. The file may still be
+/// growing; the map covers the bytes present when it was opened.
+/// </summary>
+internal sealed unsafe class AuditSegmentMap : IDisposable
+{
+    private readonly FileStream _stream;
+    private readonly MemoryMappedFile _map;
+    private readonly MemoryMappedViewAccessor _view;
+    private readonly byte* _pointer;
+    private readonly int _length;
+
+    private AuditSegmentMap(FileStream stream)
+    {
+        _stream = stream;
+        _length = (int)stream.Length;
+
+        _map = MemoryMappedFile.CreateFromFile(
+            stream, null, 0, MemoryMappedFileAccess.Read, HandleInheritability.None, leaveOpen: true);
+        _view = _map.CreateViewAccessor(0, _length, MemoryMappedFileAccess.Read);
+
+        byte* pointer = null;
+        _view.SafeMemoryMappedViewHandle.AcquirePointer(ref pointer);
+        _pointer = pointer + _view.PointerOffset;
+    }
+
+    public ReadOnlySpan<byte> Span => new(_pointer, _length);
+
+    /// <summary>
+    /// Maps a segment; null with an error if it is too short or too large to map
+    /// </summary>
+    public static AuditSegmentMap? Open(string path, out string? error)
+    {
+        error = null;
+
+        var stream = new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete);
+        try
+        {
+            if (stream.Length < AuditLogSegment.SegmentHeaderSize)
+                error = "segment header is missing";
+            else if (stream.Length > int.MaxValue)
+                error = "segment exceeds 2 GB";
+            else
+                return new AuditSegmentMap(stream);
+        }
+        catch
+        {
+            stream.Dispose();
+            throw;
+        }
+
+        stream.Dispose();
+        return null;
+    }
+
+    public void Dispose()
+    {
+        _view.SafeMemoryMappedViewHandle.ReleasePointer();
+        _view.Dispose();
+        _map.Dispose();
+        _stream.Dispose();
+    }
+}
+
+/// <summary>
+/// Scans a segment through a read-only memory map. The file may still be
+/// growing; the scan sees the blocks complete when it was opened.
+/// </summary>
+internal static unsafe class AuditLogReader
+{
+    public sealed class RecoveryResult
+    {
+        public long ValidLength { get; init; }
+        public long BlockCount { get; init; }
+        public List<string> Dictionary { get; init; } = new();
+        public byte[] LastHash { get; init; } = new byte[AuditLogSegment.HashSize];
+        public string? Error { get; init; }
+    }
+
+    public sealed class SegmentIndex
+    {
+        // Every dictionary entry walked; a block only refers to entries
+        // defined before it, so one list serves all blocks
+        public List<(int Offset, int Length)> Dictionary { get; set; } = new();
+        public List<AuditBlockLocation> Blocks { get; } = new();
+        public long NextSequence { get; set; }     // First block not walked
+        public int BlocksSkipped { get; set; }
+        public string? Error { get; set; }
+    }
+
+    public sealed class ScanResult
+    {
+        public int BlocksRead { get; set; }
+        public int BlocksSkipped { get; set; }
+        public long RecordsVisited { get; set; }
+        public string? Error { get; set; }
+    }
+
+    /// <summary>
+    /// Visits records with startTicks &lt;= Timestamp &lt;= endTicks in
+    /// file order. Blocks outside the window are skipped by header; blocks
+    /// read are hash-verified. Stops at the first integrity failure and
+    /// reports it in the result.
+    /// </summary>
+    public static ScanResult Scan(string path, long startTicks, long endTicks, AuditRecordVisitor visitor)
+    {
+        var result = new ScanResult();
+        using var hash = IncrementalHash.CreateHash(HashAlgorithmName.SHA256);
+
+        Walk(path, (blockStart, block, header, segment, dictionary, local) =>
+        {
+            if (header.MaxTimestamp < startTicks || header.MinTimestamp > endTicks)
+            {
+                result.BlocksSkipped++;
+                return true;
+            }
+
+            if (!VerifyBlockHash(hash, block))
+            {
+                result.Error = $"block {header.Sequence} at offset {blockStart} failed hash verification";
+                return false;
+            }
+
+            var strings = new AuditStringTable(segment, dictionary, local);
+            result.RecordsVisited += VisitRecords(block, header, in strings, startTicks, endTicks, visitor);
+            result.BlocksRead++;
+            return true;
+        }, out var error);
+
+        result.Error ??= error;
+        return result;
+    }
+
+    /// <summary>
+    /// Walks a segment without reading records and lists the blocks from
+    /// <paramref name="firstSequence"/> on that overlap the window, for
+    /// <see cref="ScanBlocks"/> to read in parallel. Checks chain links
+    /// and string sections; hashes are left to the scan.
+    /// </summary>
+    public static SegmentIndex Index(string path, long startTicks, long endTicks, long firstSequence = 0)
+    {
+        var index = new SegmentIndex();
+
+        Walk(path, (blockStart, block, header, segment, dictionary, local) =>
+        {
+            index.Dictionary = dictionary;
+            index.NextSequence = header.Sequence + 1;
+
+            if (header.Sequence < firstSequence ||
+                header.MaxTimestamp < startTicks ||
+                header.MinTimestamp > endTicks)
+            {
+                index.BlocksSkipped++;
+                return true;
+            }
+
+            index.Blocks.Add(new AuditBlockLocation((int)blockStart, block.Length, header.Sequence, (int)header.RecordCount));
+            return true;
+        }, out var error);
+
+        index.Error = error;
+        return index;
+    }
+
+    /// <summary>
+    /// Visits records in the window from <paramref name="count"/> indexed
+    /// blocks, hash-verifying each. Safe to call concurrently for
+    /// different ranges of one index: each call maps the segment itself
+    /// and only reads the shared dictionary. Stops at the first
+    /// integrity failure and reports it in the result.
+    /// </summary>
+    public static ScanResult ScanBlocks(
+        string path,
+        SegmentIndex index,
+        int first,
+        int count,
+        long startTicks,
+        long endTicks,
+        AuditRecordVisitor visitor)
+    {
+        var result = new ScanResult();
+
+        using var map = AuditSegmentMap.Open(path, out var error);
+        if (map == null)
+        {
+            result.Error = error;
+            return result;
+        }
+
+        using var hash = IncrementalHash.CreateHash(HashAlgorithmName.SHA256);
+        var segment = map.Span;
+        var local = new List<(int Offset, int Length)>();
+
+        for (var i = first; i < first + count; i++)
+        {
+            var location = index.Blocks[i];
+            if (location.Length > segment.Length - location.Offset)
+            {
+                result.Error = $"block {location.Sequence} at offset {location.Offset} is past the end of the segment";
+                break;
+            }
+
+            var block = segment.Slice(location.Offset, location.Length);
+            var header = MemoryMarshal.Read<AuditBlockHeader>(block);
+
+            if (!VerifyBlockHash(hash, block))
+            {
+                result.Error = $"block {location.Sequence} at offset {location.Offset} failed hash verification";
+                break;
+            }
+
+            if (!ReadStrings(segment, location.Offset + AuditLogSegment.BlockHeaderSize, header, null, local))
+            {
+                result.Error = $"block {location.Sequence} at offset {location.Offset} has a malformed string section";
+                break;
+            }
+
+            var strings = new AuditStringTable(segment, index.Dictionary, local);
+            result.RecordsVisited += VisitRecords(block, header, in strings, startTicks, endTicks, visitor);
+            result.BlocksRead++;
+        }
+
+        return result;
+    }
+
+    private static long VisitRecords(
+        ReadOnlySpan<byte> block,
+        in AuditBlockHeader header,
+        in AuditStringTable strings,
+        long startTicks,
+        long endTicks,
+        AuditRecordVisitor visitor)
+    {
+        var records = MemoryMarshal.Cast<byte, AuditRecord>(
+            block.Slice(block.Length - (int)header.RecordCount * AuditLogSegment.RecordSize));
+        var visited = 0L;
+
+        foreach (ref readonly var record in records)
+        {
+            if (record.Timestamp >= startTicks && record.Timestamp <= endTicks)
+            {
+                visitor(in record, in strings);
+                visited++;
+            }
+        }
+
+        return visited;
+    }
+
+    /// <summary>
+    /// Verifies a whole segment for the writer and returns the end of the
+    /// last complete block, the dictionary and the chain tail. A block cut
+    /// short at the end of the file is treated as a torn write; anything
+    /// else that does not parse, chain or hash is an error.
+    /// </summary>
+    public static RecoveryResult Recover(string path)
+    {
+        using var hash = IncrementalHash.CreateHash(HashAlgorithmName.SHA256);
+        var validLength = (long)AuditLogSegment.SegmentHeaderSize;
+        var blocks = 0L;
+        var lastHash = new byte[AuditLogSegment.HashSize];
+        var strings = new List<string>();
+        string? hashError = null;
+
+        Walk(path, (blockStart, block, header, segment, dictionary, local) =>
+        {
+            if (!VerifyBlockHash(hash, block))
+            {
+                hashError = $"block {header.Sequence} at offset {blockStart} failed hash verification";
+                return false;
+            }
+
+            validLength = blockStart + block.Length;
+            blocks++;
+            return true;
+        }, out var error, dictionaryOut: strings, lastHashOut: lastHash);
+
+        error ??= hashError;
+
+        return new RecoveryResult
+        {
+            ValidLength = validLength,
+            BlockCount = blocks,
+            Dictionary = strings,
+            LastHash = lastHash,
+            Error = error
+        };
+    }
+
+    public static void ComputeBlockHash(
+        IncrementalHash hash,
+        ReadOnlySpan<byte> hashedHeader,
+        ReadOnlySpan<byte> payload,
+        Span<byte> destination)
+    {
+        hash.AppendData(hashedHeader);
+        hash.AppendData(payload);
+        hash.TryGetHashAndReset(destination, out _);
+    }
+
+    private static bool VerifyBlockHash(IncrementalHash hash, ReadOnlySpan<byte> block)
+    {
+        Span<byte> computed = stackalloc byte[AuditLogSegment.HashSize];
+        ComputeBlockHash(hash, block[..AuditLogSegment.HashedHeaderSize],
+            block[AuditLogSegment.BlockHeaderSize..], computed);
+
+        return computed.SequenceEqual(block.Slice(AuditLogSegment.HashedHeaderSize, AuditLogSegment.HashSize));
+    }
+
+    private delegate bool BlockVisitor(
+        long blockStart,
+        ReadOnlySpan<byte> block,
+        AuditBlockHeader header,
+        ReadOnlySpan<byte> segment,
+        List<(int Offset, int Length)> dictionary,
+        List<(int Offset, int Length)> local);
+
+    /// <summary>
+    /// Maps the segment and walks its blocks, maintaining the dictionary
+    /// and checking chain links. Returns false if the walk stopped early:
+    /// the visitor declined, an error, or a block torn at the end of file.
+    /// </summary>
+    private static bool Walk(
+        string path,
+        BlockVisitor visitor,
+        out string? error,
+        List<string>? dictionaryOut = null,
+        byte[]? lastHashOut = null)
+    {
+        using var map = AuditSegmentMap.Open(path, out error);
+        if (map == null)
+            return false;
+
+        var segment = map.Span;
+
+        var segmentHeader = MemoryMarshal.Read<AuditSegmentHeader>(segment);
+        if (segmentHeader.Magic != AuditLogSegment.SegmentMagic ||
+            segmentHeader.Version != AuditLogSegment.Version ||
+            segmentHeader.HeaderSize != AuditLogSegment.SegmentHeaderSize ||
+            segmentHeader.BlockHeaderSize != AuditLogSegment.BlockHeaderSize ||
+            segmentHeader.RecordSize != AuditLogSegment.RecordSize)
+        {
+            error = "unsupported segment header";
+            return false;
+        }
+
+        var dictionary = new List<(int Offset, int Length)>();
+        var local = new List<(int Offset, int Length)>();
+        Span<byte> previousHash = stackalloc byte[AuditLogSegment.HashSize];
+        previousHash.Clear();
+
+        var offset = AuditLogSegment.SegmentHeaderSize;
+        var sequence = 0L;
+
+        while (offset < segment.Length)
+        {
+            if (segment.Length - offset < AuditLogSegment.BlockHeaderSize)
+            {
+                return false;    // Torn tail
+            }
+
+            var header = MemoryMarshal.Read<AuditBlockHeader>(segment[offset..]);
+            if (header.Magic != AuditLogSegment.BlockMagic ||
+                header.Sequence != sequence ||
+                header.RecordCount > int.MaxValue / AuditLogSegment.RecordSize ||
+                header.StringBytes > int.MaxValue / 2)
+            {
+                error = $"block {sequence} at offset {offset} is malformed";
+                return false;
+            }
+
+            var blockLength = (long)AuditLogSegment.BlockHeaderSize + header.PayloadLength;
+            if (blockLength > segment.Length - offset)
+            {
+                return false;    // Torn tail
+            }
+
+            var block = segment.Slice(offset, (int)blockLength);
+            if (!block.Slice(AuditLogSegment.HashedHeaderSize - AuditLogSegment.HashSize, AuditLogSegment.HashSize)
+                    .SequenceEqual(previousHash))
+            {
+                error = $"block {sequence} at offset {offset} does not chain to the previous block";
+                return false;
+            }
+
+            if (!ReadStrings(segment, offset + AuditLogSegment.BlockHeaderSize, header, dictionary, local))
+            {
+                error = $"block {sequence} at offset {offset} has a malformed string section";
+                return false;
+            }
+
+            if (dictionaryOut != null)
+            {
+                for (var i = dictionary.Count - (int)header.DictionaryCount; i < dictionary.Count; i++)
+                    dictionaryOut.Add(Encoding.UTF8.GetString(segment.Slice(dictionary[i].Offset, dictionary[i].Length)));
+            }
+
+            if (!visitor(offset, block, header, segment, dictionary, local))
+                return false;
+
+            block.Slice(AuditLogSegment.HashedHeaderSize, AuditLogSegment.HashSize).CopyTo(previousHash);
+            if (lastHashOut != null)
+                previousHash.CopyTo(lastHashOut);
+            offset += (int)blockLength;
+            sequence++;
+        }
+
+        return true;
+    }
+
+    private static bool ReadStrings(
+        ReadOnlySpan<byte> segment,
+        int start,
+        in AuditBlockHeader header,
+        List<(int Offset, int Length)>? dictionary,
+        List<(int Offset, int Length)> local)
+    {
+        local.Clear();
+
+        var end = start + (int)header.StringBytes;
+        var position = start;
+        var total = header.DictionaryCount + header.LocalCount;
+
+        for (var i = 0u; i < total; i++)
+        {
+            if (end - position < sizeof(ushort))
+                return false;
+
+            int length = MemoryMarshal.Read<ushort>(segment[position..]);
+            position += sizeof(ushort);
+
+            if (end - position < length)
+                return false;
+
+            if (i >= header.DictionaryCount)
+                local.Add((position, length));
+            else
+                dictionary?.Add((position, length));
+            position += length;
+        }
+
+        return position == end;
+    }
+}
@@ -0,0 +1,249 @@
+using System.Diagnostics;
+using System.Threading.Channels;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Audit pipeline sizing and overload behaviour
+/// </summary>
+public sealed class AuditPipelineOptions
+{
+    /// <summary>
+    /// Events accepted from callers and not yet enriched
+    /// </summary>
+    public int CaptureCapacity { get; set; } = 65536;
+
+    /// <summary>
+    /// Enriched events waiting to be serialized
+    /// </summary>
+    public int SerializeCapacity { get; set; } = 65536;
+
+    /// <summary>
+    /// Serialized blocks waiting to be written
+    /// </summary>
+    public int WriteCapacity { get; set; } = 64;
+
+    /// <summary>
+    /// Upper bound on events per block
+    /// </summary>
+    public int MaxBatchEvents { get; set; } = 4096;
+
+    /// <summary>
+    /// How long the serializer waits for a partial block to fill
+    /// </summary>
+    public TimeSpan BatchDelay { get; set; } = TimeSpan.FromMilliseconds(100);
+
+    /// <summary>
+    /// While a stage is full, one in this many warning events waits for
+    /// space and the rest are dropped. Info events are dropped; error and
+    /// critical events always wait.
+    /// </summary>
+    public int WarningSampleRate { get; set; } = 10;
+
+    /// <summary>
+    /// Processes remembered by the enrichment stage
+    /// </summary>
+    public int ProcessCacheSize { get; set; } = 4096;
+
+    public TimeSpan ProcessCacheLifetime { get; set; } = TimeSpan.FromMinutes(1);
+
+    /// <summary>
+    /// Chunks a SIEM export formats at once, and holds before writing;
+    /// 0 for one per processor
+    /// </summary>
+    public int ExportParallelism { get; set; }
+
+    /// <summary>
+    /// Events per SIEM export chunk, rounded up to whole blocks
+    /// </summary>
+    public int ExportChunkEvents { get; set; } = 4096;
+}
+
+/// <summary>
+/// Counters for one pipeline stage. Latency is the time an item waited
+/// in the stage's queue.
+/// </summary>
+public sealed class AuditStageStatistics
+{
+    public string Name { get; init; } = string.Empty;
+    public int Capacity { get; init; }
+    public int Depth { get; init; }
+    public long Accepted { get; init; }
+    public long Dropped { get; init; }
+    public long SampledUnderPressure { get; init; }
+    public double AverageLatencyMicroseconds { get; init; }
+    public double MaxLatencyMicroseconds { get; init; }
+}
+
+/// <summary>
+/// Audit pipeline counters
+/// </summary>
+public sealed class AuditPipelineStatistics
+{
+    public IReadOnlyList<AuditStageStatistics> Stages { get; init; } = Array.Empty<AuditStageStatistics>();
+    public long EventsWritten { get; init; }
+    public long EventsLost { get; init; }       // Accepted but not written (I/O or encoding failure)
+    public long BlocksWritten { get; init; }
+    public long Commits { get; init; }          // Flushes to disk; each covers all blocks written since the last
+    public double AverageCommitMicroseconds { get; init; }
+    public double AverageEndToEndMicroseconds { get; init; }    // Capture to durable
+    public double MaxEndToEndMicroseconds { get; init; }
+}
+
+/// <summary>
+/// Latency accumulator updated with interlocked operations
+/// </summary>
+internal struct AuditLatencyCounter
+{
+    private long _totalTicks;
+    private long _count;
+    private long _maxTicks;
+
+    public void Record(long ticks)
+    {
+        Interlocked.Add(ref _totalTicks, ticks);
+        Interlocked.Increment(ref _count);
+
+        var max = Volatile.Read(ref _maxTicks);
+        while (ticks > max)
+        {
+            var observed = Interlocked.CompareExchange(ref _maxTicks, ticks, max);
+            if (observed == max)
+                break;
+            max = observed;
+        }
+    }
+
+    public readonly double AverageMicroseconds
+    {
+        get
+        {
+            var count = Volatile.Read(in _count);
+            return count == 0 ? 0 : ToMicroseconds(Volatile.Read(in _totalTicks)) / count;
+        }
+    }
+
+    public readonly double MaxMicroseconds => ToMicroseconds(Volatile.Read(in _maxTicks));
+
+    public static double ToMicroseconds(long ticks) => ticks * 1_000_000.0 / Stopwatch.Frequency;
+}
+
+/// <summary>
+/// A bounded queue between two pipeline stages with severity-based
+/// admission. One reader; any number of writers.
+/// </summary>
+internal sealed class AuditStage<T>
+{
+    private readonly Channel<(T Item, long EnqueuedAt)> _channel;
+    private readonly int _warningSampleRate;
+    private long _accepted;
+    private long _dropped;
+    private long _sampled;
+    private long _pressure;
+    private AuditLatencyCounter _latency;
+
+    public AuditStage(string name, int capacity, int warningSampleRate)
+    {
+        Name = name;
+        Capacity = capacity;
+        _warningSampleRate = Math.Max(1, warningSampleRate);
+        _channel = Channel.CreateBounded<(T, long)>(new BoundedChannelOptions(capacity)
+        {
+            FullMode = BoundedChannelFullMode.Wait,
+            SingleReader = true
+        });
+    }
+
+    public string Name { get; }
+    public int Capacity { get; }
+
+    /// <summary>
+    /// Queues an item, waiting for space or dropping it by severity when
+    /// the stage is full. Null severity always waits. Returns false if the
+    /// item was dropped or the pipeline has shut down.
+    /// </summary>
+    public async ValueTask<bool> AdmitAsync(T item, EventSeverity? severity)
+    {
+        if (_channel.Writer.TryWrite((item, Stopwatch.GetTimestamp())))
+        {
+            Interlocked.Increment(ref _accepted);
+            return true;
+        }
+
+        var wait = severity switch
+        {
+            null or EventSeverity.Error or EventSeverity.Critical => true,
+            EventSeverity.Warning => Interlocked.Increment(ref _pressure) % _warningSampleRate == 0,
+            _ => false
+        };
+
+        if (wait)
+        {
+            try
+            {
+                await _channel.Writer.WriteAsync((item, Stopwatch.GetTimestamp()));
+                Interlocked.Increment(ref _accepted);
+                if (severity == EventSeverity.Warning)
+                    Interlocked.Increment(ref _sampled);
+                return true;
+            }
+            catch (ChannelClosedException)
+            {
+            }
+        }
+
+        Interlocked.Increment(ref _dropped);
+        return false;
+    }
+
+    public ValueTask<bool> WaitToReadAsync() => _channel.Reader.WaitToReadAsync();
+
+    public bool TryRead(out T item)
+    {
+        if (_channel.Reader.TryRead(out var entry))
+        {
+            _latency.Record(Stopwatch.GetTimestamp() - entry.EnqueuedAt);
+            item = entry.Item;
+            return true;
+        }
+
+        item = default!;
+        return false;
+    }
+
+    public void Complete() => _channel.Writer.TryComplete();
+
+    public AuditStageStatistics GetStatistics()
+    {
+        return new AuditStageStatistics
+        {
+            Name = Name,
+            Capacity = Capacity,
+            Depth = _channel.Reader.Count,
+            Accepted = Interlocked.Read(ref _accepted),
+            Dropped = Interlocked.Read(ref _dropped),
+            SampledUnderPressure = Interlocked.Read(ref _sampled),
+            AverageLatencyMicroseconds = _latency.AverageMicroseconds,
+            MaxLatencyMicroseconds = _latency.MaxMicroseconds
+        };
+    }
+}
+
+/// <summary>
+/// An event, or a flush marker, moving through the pipeline
+/// </summary>
+internal readonly record struct AuditPipelineItem(AuditEvent? Event, TaskCompletionSource? Flush, long CapturedAt);
+
+/// <summary>
+/// A serialized block for the write stage; Flush markers ride along and
+/// complete once the block is durable
+/// </summary>
+internal sealed class AuditWriteItem
+{
+    public AuditLogWriter? Writer { get; init; }
+    public AuditLogBlock Block { get; init; }
+    public long OldestCapturedAt { get; init; }
+    public List<VerdictTrace>? Traces { get; init; }    // Traced events in the block, if tracing
+    public List<TaskCompletionSource> Flushes { get; } = new();
+}
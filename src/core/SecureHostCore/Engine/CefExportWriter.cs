@@ -0,0 +1,127 @@
+using System.Text;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Writes audit events as CEF (Common Event Format) lines for SIEM
+/// CEF:Version|Device Vendor|Device Product|Device Version|Signature ID|Name|Severity|Extension
+/// Lines are assembled as UTF-8 straight from the audit log's string
+/// slices into a pooled buffer; enum names and the host name are encoded
+/// once. Only the message is escaped, as its text is free-form.
+/// </summary>
+internal sealed class CefExportWriter : SiemExportWriter
+{
+    private const int FixedLineBytes = 256;     // Prefix, keys, numbers and enum names
+
+    private static readonly byte[][] s_eventTypeNames = CreateEnumNames<AuditEventType>();
+    private static readonly byte[][] s_actionNames = CreateEnumNames<PolicyAction>();
+
+    public CefExportWriter(SiemExportChunk chunk, bool syslog = false)
+        : base(chunk, syslog)
+    {
+    }
+
+    public override void Write(in AuditRecord record, in AuditStringTable strings)
+    {
+        WriteLine(
+            record.Timestamp,
+            record.EventType,
+            record.Severity,
+            record.Action,
+            record.ProcessId,
+            strings.GetUtf8(record.UserName),
+            strings.GetUtf8(record.UserSid),
+            strings.GetUtf8(record.ProcessName),
+            strings.GetUtf8(record.Message));
+    }
+
+    public override void Write(AuditEvent evt)
+    {
+        WriteLine(
+            evt.Timestamp.Ticks,
+            (byte)evt.EventType,
+            (byte)evt.Severity,
+            (byte)evt.Action,
+            evt.ProcessId,
+            Encoding.UTF8.GetBytes(evt.UserName ?? string.Empty),
+            Encoding.UTF8.GetBytes(evt.UserSid ?? string.Empty),
+            Encoding.UTF8.GetBytes(evt.ProcessName ?? string.Empty),
+            Encoding.UTF8.GetBytes(evt.Message ?? string.Empty));
+    }
+
+    private void WriteLine(
+        long timestamp,
+        byte eventType,
+        byte severity,
+        byte action,
+        uint processId,
+        ReadOnlySpan<byte> userName,
+        ReadOnlySpan<byte> userSid,
+        ReadOnlySpan<byte> processName,
+        ReadOnlySpan<byte> message)
+    {
+        var maxLength = FixedLineBytes + HostName.Length + userName.Length + userSid.Length +
+                        processName.Length + message.Length * 2;
+        var span = BeginLine(maxLength, timestamp, severity, out var position);
+
+        Append(span, ref position, "CEF:0|SecureHost|SecureHostSuite|1.0|"u8);
+        Append(span, ref position, s_eventTypeNames[eventType]);
+        Append(span, ref position, "|"u8);
+        Append(span, ref position, s_eventTypeNames[eventType]);
+        Append(span, ref position, "|"u8);
+        AppendNumber(span, ref position, MapSeverity((EventSeverity)severity));
+        Append(span, ref position, "|dvchost="u8);
+        Append(span, ref position, HostName);
+        Append(span, ref position, " duser="u8);
+        Append(span, ref position, userName);
+        Append(span, ref position, " suid="u8);
+        Append(span, ref position, userSid);
+        Append(span, ref position, " sproc="u8);
+        Append(span, ref position, processName);
+        Append(span, ref position, " spid="u8);
+        AppendNumber(span, ref position, processId);
+        Append(span, ref position, " act="u8);
+        Append(span, ref position, s_actionNames[action]);
+        Append(span, ref position, " msg="u8);
+        AppendEscaped(span, ref position, message);
+        EndLine(span, position);
+    }
+
+    private static uint MapSeverity(EventSeverity severity)
+    {
+        return severity switch
+        {
+            EventSeverity.Info => 0,
+            EventSeverity.Warning => 5,
+            EventSeverity.Error => 7,
+            EventSeverity.Critical => 10,
+            _ => 0
+        };
+    }
+
+    private static void AppendEscaped(Span<byte> span, ref int position, ReadOnlySpan<byte> value)
+    {
+        // UTF-8 continuation bytes never fall in the ASCII range, so
+        // escaping byte by byte cannot split a character
+        while (!value.IsEmpty)
+        {
+            var special = value.IndexOfAny("\\|=\n\r"u8);
+            if (special < 0)
+            {
+                Append(span, ref position, value);
+                return;
+            }
+
+            Append(span, ref position, value[..special]);
+            span[position++] = (byte)'\\';
+            span[position++] = value[special] switch
+            {
+                (byte)'\n' => (byte)'n',
+                (byte)'\r' => (byte)'r',
+                var c => c
+            };
+            value = value[(special + 1)..];
+        }
+    }
+}
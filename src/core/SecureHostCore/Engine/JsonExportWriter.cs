@@ -0,0 +1,125 @@
+using System.Buffers;
+using System.Text.Json;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Writes audit events as JSON lines for SIEM, one object per event with
+/// the property names of <see cref="AuditEvent"/>. Segment records are
+/// written field by field from the log's UTF-8 string slices; metadata is
+/// already JSON in the log and is copied as is. Legacy events are
+/// serialized whole.
+/// </summary>
+internal sealed class JsonExportWriter : SiemExportWriter
+{
+    private static readonly byte[][] s_eventTypeNames = CreateEnumNames<AuditEventType>();
+    private static readonly byte[][] s_severityNames = CreateEnumNames<EventSeverity>();
+    private static readonly byte[][] s_actionNames = CreateEnumNames<PolicyAction>();
+    private static readonly byte[][] s_protocolNames = CreateEnumNames<NetworkProtocol>();
+    private static readonly byte[][] s_directionNames = CreateEnumNames<NetworkDirection>();
+    private static readonly byte[][] s_deviceTypeNames = CreateEnumNames<DeviceType>();
+    private static readonly byte[][] s_accessTypeNames = CreateEnumNames<DeviceAccessType>();
+
+    // Each object is written here, then copied into the line buffer
+    private readonly ArrayBufferWriter<byte> _line = new(1024);
+    private readonly Utf8JsonWriter _json;
+
+    public JsonExportWriter(SiemExportChunk chunk, bool syslog = false)
+        : base(chunk, syslog)
+    {
+        _json = new Utf8JsonWriter(_line);
+    }
+
+    public override void Write(in AuditRecord record, in AuditStringTable strings)
+    {
+        _json.WriteStartObject();
+        _json.WriteString("id"u8, record.Id);
+        _json.WriteString("timestamp"u8, new DateTime(record.Timestamp, DateTimeKind.Utc));
+        _json.WriteString("eventType"u8, s_eventTypeNames[record.EventType]);
+        _json.WriteString("severity"u8, s_severityNames[record.Severity]);
+        _json.WriteNumber("processId"u8, record.ProcessId);
+        WriteString("processName"u8, record.ProcessName, in strings);
+        WriteString("processPath"u8, record.ProcessPath, in strings);
+        WriteString("userSid"u8, record.UserSid, in strings);
+        WriteString("userName"u8, record.UserName, in strings);
+
+        if ((record.Flags & AuditRecordFlags.HasRuleId) != 0)
+            _json.WriteNumber("ruleId"u8, record.RuleId);
+        else
+            _json.WriteNull("ruleId"u8);
+
+        _json.WriteString("action"u8, s_actionNames[record.Action]);
+        WriteString("resourceType"u8, record.ResourceType, in strings);
+        WriteString("resourceId"u8, record.ResourceId, in strings);
+
+        if ((record.Flags & AuditRecordFlags.HasNetwork) != 0)
+        {
+            _json.WriteStartObject("networkDetails"u8);
+            _json.WriteString("protocol"u8, s_protocolNames[record.Protocol]);
+            WriteString("localAddress"u8, record.LocalAddress, in strings);
+            _json.WriteNumber("localPort"u8, record.LocalPort);
+            WriteString("remoteAddress"u8, record.RemoteAddress, in strings);
+            _json.WriteNumber("remotePort"u8, record.RemotePort);
+            _json.WriteString("direction"u8, s_directionNames[record.Direction]);
+            _json.WriteNumber("bytesTransferred"u8, record.BytesTransferred);
+            _json.WriteEndObject();
+        }
+
+        if ((record.Flags & AuditRecordFlags.HasDevice) != 0)
+        {
+            _json.WriteStartObject("deviceDetails"u8);
+            _json.WriteString("deviceType"u8, s_deviceTypeNames[record.DeviceType]);
+            WriteString("deviceId"u8, record.DeviceId, in strings);
+            WriteString("deviceName"u8, record.DeviceName, in strings);
+            WriteString("hardwareId"u8, record.HardwareId, in strings);
+            WriteString("manufacturer"u8, record.Manufacturer, in strings);
+            _json.WriteString("accessType"u8, s_accessTypeNames[record.AccessType]);
+            _json.WriteEndObject();
+        }
+
+        _json.WriteString("message"u8, strings.GetUtf8(record.Message));
+
+        if (record.Metadata != AuditLogSegment.NullString)
+        {
+            _json.WritePropertyName("metadata"u8);
+            _json.WriteRawValue(strings.GetUtf8(record.Metadata));
+        }
+
+        _json.WriteEndObject();
+        CompleteLine(record.Timestamp, record.Severity);
+    }
+
+    public override void Write(AuditEvent evt)
+    {
+        JsonSerializer.Serialize(_json, evt);
+        CompleteLine(evt.Timestamp.Ticks, (byte)evt.Severity);
+    }
+
+    private void WriteString(ReadOnlySpan<byte> name, uint reference, in AuditStringTable strings)
+    {
+        if (reference == AuditLogSegment.NullString)
+            _json.WriteNull(name);
+        else
+            _json.WriteString(name, strings.GetUtf8(reference));
+    }
+
+    private void CompleteLine(long timestamp, byte severity)
+    {
+        _json.Flush();
+
+        var line = _line.WrittenSpan;
+        var span = BeginLine(line.Length, timestamp, severity, out var position);
+        Append(span, ref position, line);
+        EndLine(span, position);
+
+        _line.Clear();
+        _json.Reset();
+    }
+
+    public override void Dispose()
+    {
+        _json.Dispose();
+        base.Dispose();
+    }
+}
@@ -0,0 +1,226 @@
+using System.Diagnostics;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Stages of a verdict's path from the drivers to its consumers. Each
+/// stage is timed from the driver's performance counter timestamps, which
+/// share the clock of <see cref="Stopwatch.GetTimestamp"/>.
+/// </summary>
+public enum LatencyStage
+{
+    KernelVerdict,      // WFP classify entry to a verdict decided in the driver
+    ServiceVerdict,     // WFP pend to the service's verdict applied on reauthorization
+    DeviceVerdict,      // Device access check request to verdict
+    DecisionDelivery,   // WFP pend to the service reading the decision request
+    PolicyEvaluation,   // Service policy evaluation of a decision request
+    EventDelivery,      // Driver verdict to the service reading its event
+    AuditDurable,       // Driver verdict to its audit record being on disk
+    ApiStream           // Driver verdict to the connection stream sending it to a client
+}
+
+/// <summary>
+/// Latency tracing options
+/// </summary>
+public sealed class LatencyTracingOptions
+{
+    /// <summary>
+    /// p99 target for verdicts decided in a driver
+    /// </summary>
+    public TimeSpan KernelVerdictTarget { get; set; } = TimeSpan.FromMicroseconds(20);
+
+    /// <summary>
+    /// p99 target for verdicts left to the service
+    /// </summary>
+    public TimeSpan ServiceVerdictTarget { get; set; } = TimeSpan.FromMilliseconds(2);
+}
+
+/// <summary>
+/// Latency percentiles of one stage. Percentiles are bucket upper bounds,
+/// within 12.5% of the true value.
+/// </summary>
+public sealed class LatencyStageStatistics
+{
+    public string Stage { get; init; } = string.Empty;
+    public long Count { get; init; }
+    public double P50Microseconds { get; init; }
+    public double P90Microseconds { get; init; }
+    public double P99Microseconds { get; init; }
+    public double P999Microseconds { get; init; }
+    public double MaxMicroseconds { get; init; }
+    public double? TargetP99Microseconds { get; init; }     // Only for verdict stages
+
+    public bool? MeetsTarget => TargetP99Microseconds is { } target && Count > 0
+        ? P99Microseconds <= target
+        : null;
+}
+
+/// <summary>
+/// Records the latency of each stage a driver verdict passes through,
+/// keyed by the verdict's correlation ID. Every sample goes to a per-stage
+/// histogram and, when a listener enables the Latency keyword, to ETW
+/// (<see cref="SecureHostEventSource.VerdictLatency"/>) so one verdict
+/// can be followed across stages. Recording takes no locks.
+/// </summary>
+public sealed class LatencyTracer
+{
+    private static readonly int StageCount = Enum.GetValues<LatencyStage>().Length;
+
+    private readonly LatencyTracingOptions _options;
+    private readonly LatencyHistogram[] _histograms;
+
+    public LatencyTracer(LatencyTracingOptions? options = null)
+    {
+        _options = options ?? new LatencyTracingOptions();
+        _histograms = new LatencyHistogram[StageCount];
+        for (var i = 0; i < _histograms.Length; i++)
+            _histograms[i] = new LatencyHistogram();
+    }
+
+    /// <summary>
+    /// Records a stage that took <paramref name="elapsedTicks"/> performance
+    /// counter ticks. Negative times, from an untraced source, are ignored.
+    /// </summary>
+    public void Record(LatencyStage stage, ulong correlationId, long elapsedTicks)
+    {
+        if (elapsedTicks < 0)
+            return;
+
+        var nanoseconds = LatencyHistogram.ToNanoseconds(elapsedTicks);
+        _histograms[(int)stage].Record(nanoseconds);
+        SecureHostEventSource.Log.VerdictLatency(correlationId, stage, nanoseconds);
+    }
+
+    /// <summary>
+    /// Records a stage that began at <paramref name="startTimestamp"/> and
+    /// ends now; a zero start means the source was not traced
+    /// </summary>
+    public void RecordSince(LatencyStage stage, ulong correlationId, long startTimestamp)
+    {
+        if (startTimestamp != 0)
+            Record(stage, correlationId, Stopwatch.GetTimestamp() - startTimestamp);
+    }
+
+    public IReadOnlyList<LatencyStageStatistics> GetStatistics()
+    {
+        var statistics = new List<LatencyStageStatistics>(StageCount);
+        for (var i = 0; i < StageCount; i++)
+        {
+            var stage = (LatencyStage)i;
+            var histogram = _histograms[i];
+
+            statistics.Add(new LatencyStageStatistics
+            {
+                Stage = stage.ToString(),
+                Count = histogram.Count,
+                P50Microseconds = histogram.GetPercentileMicroseconds(0.50),
+                P90Microseconds = histogram.GetPercentileMicroseconds(0.90),
+                P99Microseconds = histogram.GetPercentileMicroseconds(0.99),
+                P999Microseconds = histogram.GetPercentileMicroseconds(0.999),
+                MaxMicroseconds = histogram.MaxNanoseconds / 1000.0,
+                TargetP99Microseconds = GetTarget(stage)?.TotalMicroseconds
+            });
+        }
+        return statistics;
+    }
+
+    private TimeSpan? GetTarget(LatencyStage stage)
+    {
+        return stage switch
+        {
+            LatencyStage.KernelVerdict or LatencyStage.DeviceVerdict => _options.KernelVerdictTarget,
+            LatencyStage.ServiceVerdict => _options.ServiceVerdictTarget,
+            _ => null
+        };
+    }
+}
+
+/// <summary>
+/// Log-linear latency histogram in nanoseconds: eight linear sub-buckets
+/// per power of two, so a percentile read from bucket bounds is within
+/// 12.5%. Values from about 18 minutes up share the last bucket. Updated
+/// with interlocked operations.
+/// </summary>
+internal sealed class LatencyHistogram
+{
+    private const int SubBucketBits = 3;
+    private const int SubBuckets = 1 << SubBucketBits;
+    private const int MaxExponent = 40;
+    private const int BucketCount = (MaxExponent - SubBucketBits + 2) * SubBuckets;
+
+    private readonly long[] _counts = new long[BucketCount];
+    private long _count;
+    private long _maxNanoseconds;
+
+    public long Count => Volatile.Read(ref _count);
+    public long MaxNanoseconds => Volatile.Read(ref _maxNanoseconds);
+
+    public static long ToNanoseconds(long ticks)
+    {
+        return (long)(ticks * (1_000_000_000.0 / Stopwatch.Frequency));
+    }
+
+    public void Record(long nanoseconds)
+    {
+        Interlocked.Increment(ref _counts[GetBucket(nanoseconds)]);
+        Interlocked.Increment(ref _count);
+
+        var max = Volatile.Read(ref _maxNanoseconds);
+        while (nanoseconds > max)
+        {
+            var observed = Interlocked.CompareExchange(ref _maxNanoseconds, nanoseconds, max);
+            if (observed == max)
+                break;
+            max = observed;
+        }
+    }
+
+    /// <summary>
+    /// Upper bound of the bucket holding the given fraction of samples,
+    /// capped at the largest sample; 0 when empty
+    /// </summary>
+    public double GetPercentileMicroseconds(double fraction)
+    {
+        var count = Count;
+        if (count == 0)
+            return 0;
+
+        var rank = (long)Math.Ceiling(fraction * count);
+        long seen = 0;
+
+        for (var bucket = 0; bucket < BucketCount; bucket++)
+        {
+            seen += Volatile.Read(ref _counts[bucket]);
+            if (seen >= rank)
+                return Math.Min(GetUpperBound(bucket), MaxNanoseconds) / 1000.0;
+        }
+
+        return MaxNanoseconds / 1000.0;
+    }
+
+    internal static int GetBucket(long nanoseconds)
+    {
+        if (nanoseconds < SubBuckets)
+            return (int)Math.Max(nanoseconds, 0);
+
+        var exponent = 63 - (int)long.LeadingZeroCount(nanoseconds);
+        if (exponent > MaxExponent)
+            return BucketCount - 1;
+
+        var subBucket = (int)(nanoseconds >> (exponent - SubBucketBits)) & (SubBuckets - 1);
+        return (exponent - SubBucketBits + 1) * SubBuckets + subBucket;
+    }
+
+    /// <summary>
+    /// Exclusive upper bound of a bucket in nanoseconds
+    /// </summary>
+    internal static long GetUpperBound(int bucket)
+    {
+        if (bucket < SubBuckets)
+            return bucket + 1;
+
+        var exponent = bucket / SubBuckets + SubBucketBits - 1;
+        var subBucket = bucket % SubBuckets;
+        return (long)(SubBuckets + subBucket + 1) << (exponent - SubBucketBits);
+    }
+}
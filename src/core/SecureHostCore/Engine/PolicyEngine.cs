@@ -8,12 +8,31 @@ namespace SecureHostCore.Engine;
 /// <summary>
 /// Core policy evaluation and enforcement engine
 /// Thread-safe, high-performance policy rule evaluation
+/// Rules are compiled when added or updated; evaluation reads an immutable
+/// <see cref="PolicyRuleIndex"/> without locks or allocation, rebuilt on
+/// the first evaluation after a change
 /// </summary>
 public sealed class PolicyEngine : IDisposable
 {
+    private static readonly PolicyDecision DefaultNetworkDecision = new()
+    {
+        Action = PolicyAction.Allow,
+        Reason = "No matching rule (default policy)",
+        AuditLevel = AuditLevel.Low
+    };
+
+    private static readonly PolicyDecision DefaultDeviceDecision = new()
+    {
+        Action = PolicyAction.Block,
+        Reason = "No matching rule (default policy: deny)",
+        AuditLevel = AuditLevel.High
+    };
+
     private readonly ILogger<PolicyEngine> _logger;
     private readonly ConcurrentDictionary<ulong, PolicyRule> _rules;
+    private readonly ConcurrentDictionary<ulong, CompiledPolicyRule> _compiledRules;
     private readonly ReaderWriterLockSlim _rulesLock;
+    private volatile PolicyRuleIndex? _index;
     private ulong _nextRuleId;
     private bool _disposed;
 
@@ -21,7 +40,9 @@ public sealed class PolicyEngine : IDisposable
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _rules = new ConcurrentDictionary<ulong, PolicyRule>();
+        _compiledRules = new ConcurrentDictionary<ulong, CompiledPolicyRule>();
         _rulesLock = new ReaderWriterLockSlim(LockRecursionPolicy.NoRecursion);
+        _index = PolicyRuleIndex.Empty;
         _nextRuleId = 1;
     }
 
@@ -39,12 +60,17 @@ public sealed class PolicyEngine : IDisposable
             rule.CreatedAt = DateTime.UtcNow;
             rule.ModifiedAt = DateTime.UtcNow;
 
+            var compiled = new CompiledPolicyRule(rule);
+
             if (!_rules.TryAdd(rule.Id, rule))
             {
                 _logger.LogError("Failed to add rule {RuleId}", rule.Id);
                 throw new InvalidOperationException($"Failed to add rule {rule.Id}");
             }
 
+            _compiledRules[rule.Id] = compiled;
+            _index = null;
+
             _logger.LogInformation("Added policy rule {RuleId}: {RuleName}", rule.Id, rule.Name);
             return rule.Id;
         }
@@ -54,6 +80,43 @@ public sealed class PolicyEngine : IDisposable
         }
     }
 
+    /// <summary>
+    /// Adds a rule loaded from storage, keeping its id and timestamps so
+    /// saved rules stay byte-identical across restarts. A rule without an
+    /// id, or whose id is taken, gets a new one as with AddRule.
+    /// </summary>
+    public ulong RestoreRule(PolicyRule rule)
+    {
+        ArgumentNullException.ThrowIfNull(rule);
+
+        _rulesLock.EnterWriteLock();
+        try
+        {
+            if (rule.Id == 0 || _rules.ContainsKey(rule.Id))
+                rule.Id = _nextRuleId;
+
+            _nextRuleId = Math.Max(_nextRuleId, rule.Id + 1);
+
+            var compiled = new CompiledPolicyRule(rule);
+
+            if (!_rules.TryAdd(rule.Id, rule))
+            {
+                _logger.LogError("Failed to restore rule {RuleId}", rule.Id);
+                throw new InvalidOperationException($"Failed to restore rule {rule.Id}");
+            }
+
+            _compiledRules[rule.Id] = compiled;
+            _index = null;
+
+            _logger.LogDebug("Restored policy rule {RuleId}: {RuleName}", rule.Id, rule.Name);
+            return rule.Id;
+        }
+        finally
+        {
+            _rulesLock.ExitWriteLock();
+        }
+    }
+
     /// <summary>
     /// Updates an existing policy rule
     /// </summary>
@@ -74,7 +137,11 @@ public sealed class PolicyEngine : IDisposable
             updatedRule.CreatedAt = existingRule.CreatedAt;
             updatedRule.ModifiedAt = DateTime.UtcNow;
 
+            var compiled = new CompiledPolicyRule(updatedRule);
+
             _rules[ruleId] = updatedRule;
+            _compiledRules[ruleId] = compiled;
+            _index = null;
             _logger.LogInformation("Updated policy rule {RuleId}: {RuleName}", ruleId, updatedRule.Name);
             return true;
         }
@@ -94,6 +161,9 @@ public sealed class PolicyEngine : IDisposable
         {
             if (_rules.TryRemove(ruleId, out var rule))
             {
+                _compiledRules.TryRemove(ruleId, out _);
+                _index = null;
+
                 _logger.LogInformation("Removed policy rule {RuleId}: {RuleName}", ruleId, rule.Name);
                 return true;
             }
@@ -151,47 +221,26 @@ public sealed class PolicyEngine : IDisposable
         string? remoteAddress,
         string? userSid)
     {
-        _rulesLock.EnterReadLock();
-        try
-        {
-            // Get applicable rules, sorted by priority (descending)
-            var applicableRules = _rules.Values
-                .Where(r => r.Type == PolicyRuleType.Network && r.IsValid())
-                .OrderByDescending(r => r.Priority)
-                .ToList();
+        var rule = GetIndex().FindNetworkRule(
+            processId, processName ?? string.Empty, protocol, localPort, remotePort, remoteAddress, userSid);
 
-            foreach (var rule in applicableRules)
+        if (rule != null)
+        {
+            if (_logger.IsEnabled(LogLevel.Debug))
             {
-                if (MatchesNetworkRule(rule, processId, processName, protocol, localPort, remotePort, remoteAddress, userSid))
-                {
-                    _logger.LogDebug(
-                        "Network connection matched rule {RuleId}: {RuleName} - Action: {Action}",
-                        rule.Id, rule.Name, rule.Action);
-
-                    return new PolicyDecision
-                    {
-                        Action = rule.Action,
-                        RuleId = rule.Id,
-                        RuleName = rule.Name,
-                        Reason = $"Matched rule: {rule.Name}",
-                        AuditLevel = rule.AuditLevel
-                    };
-                }
+                _logger.LogDebug(
+                    "Network connection matched rule {RuleId}: {RuleName} - Action: {Action}",
+                    rule.Id, rule.Name, rule.Action);
             }
 
-            // Default: allow (can be configured)
-            _logger.LogDebug("No matching network rule found, applying default policy (Allow)");
-            return new PolicyDecision
-            {
-                Action = PolicyAction.Allow,
-                Reason = "No matching rule (default policy)",
-                AuditLevel = AuditLevel.Low
-            };
-        }
-        finally
-        {
-            _rulesLock.ExitReadLock();
+            return rule.Decision;
         }
+
+        // Default: allow (can be configured)
+        if (_logger.IsEnabled(LogLevel.Debug))
+            _logger.LogDebug("No matching network rule found, applying default policy (Allow)");
+
+        return DefaultNetworkDecision;
     }
 
     /// <summary>
@@ -204,160 +253,54 @@ public sealed class PolicyEngine : IDisposable
         string? deviceHardwareId,
         string? userSid)
     {
-        _rulesLock.EnterReadLock();
-        try
-        {
-            var applicableRules = _rules.Values
-                .Where(r => r.Type == PolicyRuleType.Device && r.IsValid())
-                .OrderByDescending(r => r.Priority)
-                .ToList();
+        var rule = GetIndex().FindDeviceRule(
+            processId, processName ?? string.Empty, deviceType, deviceHardwareId, userSid);
 
-            foreach (var rule in applicableRules)
+        if (rule != null)
+        {
+            if (_logger.IsEnabled(LogLevel.Debug))
             {
-                if (MatchesDeviceRule(rule, processId, processName, deviceType, deviceHardwareId, userSid))
-                {
-                    _logger.LogDebug(
-                        "Device access matched rule {RuleId}: {RuleName} - Action: {Action}",
-                        rule.Id, rule.Name, rule.Action);
-
-                    return new PolicyDecision
-                    {
-                        Action = rule.Action,
-                        RuleId = rule.Id,
-                        RuleName = rule.Name,
-                        Reason = $"Matched rule: {rule.Name}",
-                        AuditLevel = rule.AuditLevel
-                    };
-                }
+                _logger.LogDebug(
+                    "Device access matched rule {RuleId}: {RuleName} - Action: {Action}",
+                    rule.Id, rule.Name, rule.Action);
             }
 
-            // Default: block device access (secure default)
-            _logger.LogDebug("No matching device rule found, applying default policy (Block)");
-            return new PolicyDecision
-            {
-                Action = PolicyAction.Block,
-                Reason = "No matching rule (default policy: deny)",
-                AuditLevel = AuditLevel.High
-            };
+            return rule.Decision;
         }
-        finally
-        {
-            _rulesLock.ExitReadLock();
-        }
-    }
 
-    /// <summary>
-    /// Checks if a network rule matches the connection parameters
-    /// </summary>
-    private bool MatchesNetworkRule(
-        PolicyRule rule,
-        uint processId,
-        string processName,
-        NetworkProtocol protocol,
-        ushort localPort,
-        ushort remotePort,
-        string? remoteAddress,
-        string? userSid)
-    {
-        // Process ID filter (0 = match all)
-        if (rule.ProcessId != 0 && rule.ProcessId != processId)
-            return false;
-
-        // Process name filter (with wildcard support)
-        if (!string.IsNullOrEmpty(rule.ProcessName) &&
-            !MatchesWildcard(processName, rule.ProcessName))
-            return false;
-
-        // Protocol filter
-        if (rule.Protocol != NetworkProtocol.Any && rule.Protocol != protocol)
-            return false;
-
-        // Local port filter (0 = match all)
-        if (rule.LocalPort != 0 && rule.LocalPort != localPort)
-            return false;
-
-        // Remote port filter (0 = match all)
-        if (rule.RemotePort != 0 && rule.RemotePort != remotePort)
-            return false;
-
-        // Remote address filter (CIDR support)
-        if (!string.IsNullOrEmpty(rule.RemoteAddress) &&
-            !string.IsNullOrEmpty(remoteAddress) &&
-            !MatchesAddress(remoteAddress, rule.RemoteAddress))
-            return false;
-
-        // User SID filter
-        if (!string.IsNullOrEmpty(rule.UserSid) &&
-            !string.Equals(rule.UserSid, userSid, StringComparison.OrdinalIgnoreCase))
-            return false;
-
-        return true;
-    }
-
-    /// <summary>
-    /// Checks if a device rule matches the access parameters
-    /// </summary>
-    private bool MatchesDeviceRule(
-        PolicyRule rule,
-        uint processId,
-        string processName,
-        DeviceType deviceType,
-        string? deviceHardwareId,
-        string? userSid)
-    {
-        if (rule.ProcessId != 0 && rule.ProcessId != processId)
-            return false;
-
-        if (!string.IsNullOrEmpty(rule.ProcessName) &&
-            !MatchesWildcard(processName, rule.ProcessName))
-            return false;
-
-        if (rule.DeviceType != DeviceType.Unknown && rule.DeviceType != deviceType)
-            return false;
-
-        if (!string.IsNullOrEmpty(rule.DeviceHardwareId) &&
-            !string.IsNullOrEmpty(deviceHardwareId) &&
-            !MatchesWildcard(deviceHardwareId, rule.DeviceHardwareId))
-            return false;
-
-        if (!string.IsNullOrEmpty(rule.UserSid) &&
-            !string.Equals(rule.UserSid, userSid, StringComparison.OrdinalIgnoreCase))
-            return false;
+        // Default: block device access (secure default)
+        if (_logger.IsEnabled(LogLevel.Debug))
+            _logger.LogDebug("No matching device rule found, applying default policy (Block)");
 
-        return true;
+        return DefaultDeviceDecision;
     }
 
     /// <summary>
-    /// Simple wildcard matching (* and ?)
+    /// Returns the current rule index, building it if rules changed since
+    /// the last evaluation. Writers are held off while it is built, so the
+    /// published index always reflects a complete rule set.
     /// </summary>
-    private static bool MatchesWildcard(string input, string pattern)
+    private PolicyRuleIndex GetIndex()
     {
-        if (string.IsNullOrEmpty(pattern))
-            return true;
+        var index = _index;
+        if (index != null)
+            return index;
 
-        if (pattern == "*")
-            return true;
-
-        // Convert wildcard pattern to regex
-        var regexPattern = "^" + System.Text.RegularExpressions.Regex.Escape(pattern)
-            .Replace("\\*", ".*")
-            .Replace("\\?", ".") + "$";
-
-        return System.Text.RegularExpressions.Regex.IsMatch(
-            input,
-            regexPattern,
-            System.Text.RegularExpressions.RegexOptions.IgnoreCase);
-    }
-
-    /// <summary>
-    /// Basic IP address/CIDR matching
-    /// </summary>
-    private static bool MatchesAddress(string address, string pattern)
-    {
-        // Simple implementation - production should use proper CIDR parsing
-        return string.Equals(address, pattern, StringComparison.OrdinalIgnoreCase) ||
-               pattern == "*" ||
-               address.StartsWith(pattern.TrimEnd('*'), StringComparison.OrdinalIgnoreCase);
+        _rulesLock.EnterReadLock();
+        try
+        {
+            index = _index;
+            if (index == null)
+            {
+                index = new PolicyRuleIndex(_compiledRules.Values);
+                _index = index;
+            }
+            return index;
+        }
+        finally
+        {
+            _rulesLock.ExitReadLock();
+        }
     }
 
     /// <summary>
@@ -369,6 +312,8 @@ public sealed class PolicyEngine : IDisposable
         try
         {
             _rules.Clear();
+            _compiledRules.Clear();
+            _index = null;
             _logger.LogWarning("All policy rules cleared");
         }
         finally
@@ -392,9 +337,9 @@ public sealed class PolicyEngine : IDisposable
 /// </summary>
 public sealed class PolicyDecision
 {
-    public PolicyAction Action { get; set; }
-    public ulong? RuleId { get; set; }
-    public string? RuleName { get; set; }
-    public string Reason { get; set; } = string.Empty;
-    public AuditLevel AuditLevel { get; set; }
+    public PolicyAction Action { get; init; }
+    public ulong? RuleId { get; init; }
+    public string? RuleName { get; init; }
+    public string Reason { get; init; } = string.Empty;
+    public AuditLevel AuditLevel { get; init; }
 }
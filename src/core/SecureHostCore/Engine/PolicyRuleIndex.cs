@@ -0,0 +1,383 @@
+using System.Collections.Frozen;
+using System.Net;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// A policy rule with its patterns compiled and its decision prebuilt
+/// Compiled once in <see cref="PolicyEngine.AddRule"/> and
+/// <see cref="PolicyEngine.UpdateRule"/>; immutable afterwards.
+/// </summary>
+internal sealed class CompiledPolicyRule
+{
+    private readonly PolicyRule _rule;
+    private readonly WildcardMatcher? _processName;
+    private readonly WildcardMatcher? _deviceHardwareId;
+    private readonly IPNetwork? _remotePrefix;
+    private readonly string? _remoteAddressPattern;
+
+    public CompiledPolicyRule(PolicyRule rule)
+    {
+        _rule = rule.Clone();
+
+        if (!string.IsNullOrEmpty(_rule.ProcessName))
+            _processName = WildcardMatcher.Compile(_rule.ProcessName);
+
+        if (!string.IsNullOrEmpty(_rule.DeviceHardwareId))
+            _deviceHardwareId = WildcardMatcher.Compile(_rule.DeviceHardwareId);
+
+        if (PolicyRule.TryParseAddressPrefix(_rule.RemoteAddress, out var prefix))
+            _remotePrefix = prefix;
+        else if (!string.IsNullOrEmpty(_rule.RemoteAddress))
+            _remoteAddressPattern = _rule.RemoteAddress;
+
+        Decision = new PolicyDecision
+        {
+            Action = _rule.Action,
+            RuleId = _rule.Id,
+            RuleName = _rule.Name,
+            Reason = $"Matched rule: {_rule.Name}",
+            AuditLevel = _rule.AuditLevel
+        };
+    }
+
+    public ulong Id => _rule.Id;
+    public string Name => _rule.Name;
+    public PolicyAction Action => _rule.Action;
+    public PolicyRuleType Type => _rule.Type;
+    public bool Enabled => _rule.Enabled;
+    public PolicyDecision Decision { get; }
+
+    /// <summary>
+    /// Process name the rule matches exactly, if it names one
+    /// </summary>
+    public string? ExactProcessName => _processName?.ExactValue;
+
+    public uint ProcessId => _rule.ProcessId;
+    public ushort LocalPort => _rule.LocalPort;
+    public ushort RemotePort => _rule.RemotePort;
+    public DeviceType DeviceType => _rule.DeviceType;
+
+    /// <summary>
+    /// Evaluation order: higher priority first, then lower ID
+    /// </summary>
+    public bool Precedes(CompiledPolicyRule other)
+    {
+        return _rule.Priority != other._rule.Priority
+            ? _rule.Priority > other._rule.Priority
+            : _rule.Id < other._rule.Id;
+    }
+
+    public bool MatchesNetwork(
+        uint processId,
+        string processName,
+        NetworkProtocol protocol,
+        ushort localPort,
+        ushort remotePort,
+        ref RemoteAddressOperand remoteAddress,
+        string? userSid,
+        DateTime now)
+    {
+        var rule = _rule;
+
+        if (rule.ProcessId != 0 && rule.ProcessId != processId)
+            return false;
+
+        if (rule.Protocol != NetworkProtocol.Any && rule.Protocol != protocol)
+            return false;
+
+        if (rule.LocalPort != 0 && rule.LocalPort != localPort)
+            return false;
+
+        if (rule.RemotePort != 0 && rule.RemotePort != remotePort)
+            return false;
+
+        if (_processName != null && !_processName.IsMatch(processName))
+            return false;
+
+        if (!remoteAddress.IsEmpty)
+        {
+            if (_remotePrefix.HasValue)
+            {
+                var parsed = remoteAddress.Parsed;
+                if (parsed == null || !_remotePrefix.Value.Contains(parsed))
+                    return false;
+            }
+            else if (_remoteAddressPattern != null &&
+                     !MatchesAddressPattern(remoteAddress.Text, _remoteAddressPattern))
+            {
+                return false;
+            }
+        }
+
+        if (!string.IsNullOrEmpty(rule.UserSid) &&
+            !string.Equals(rule.UserSid, userSid, StringComparison.OrdinalIgnoreCase))
+            return false;
+
+        return IsActive(now);
+    }
+
+    public bool MatchesDevice(
+        uint processId,
+        string processName,
+        DeviceType deviceType,
+        string? deviceHardwareId,
+        string? userSid,
+        DateTime now)
+    {
+        var rule = _rule;
+
+        if (rule.ProcessId != 0 && rule.ProcessId != processId)
+            return false;
+
+        if (rule.DeviceType != DeviceType.Unknown && rule.DeviceType != deviceType)
+            return false;
+
+        if (_processName != null && !_processName.IsMatch(processName))
+            return false;
+
+        if (_deviceHardwareId != null &&
+            !string.IsNullOrEmpty(deviceHardwareId) &&
+            !_deviceHardwareId.IsMatch(deviceHardwareId))
+            return false;
+
+        if (!string.IsNullOrEmpty(rule.UserSid) &&
+            !string.Equals(rule.UserSid, userSid, StringComparison.OrdinalIgnoreCase))
+            return false;
+
+        return IsActive(now);
+    }
+
+    private bool IsActive(DateTime now)
+    {
+        return (!_rule.ValidFrom.HasValue || now >= _rule.ValidFrom.Value) &&
+               (!_rule.ValidUntil.HasValue || now <= _rule.ValidUntil.Value);
+    }
+
+    /// <summary>
+    /// Non-CIDR address patterns: exact text, "*", or a trailing-wildcard prefix
+    /// </summary>
+    private static bool MatchesAddressPattern(string address, string pattern)
+    {
+        return string.Equals(address, pattern, StringComparison.OrdinalIgnoreCase) ||
+               pattern == "*" ||
+               address.AsSpan().StartsWith(pattern.AsSpan().TrimEnd('*'), StringComparison.OrdinalIgnoreCase);
+    }
+}
+
+/// <summary>
+/// Connection remote address, parsed at most once per evaluation and
+/// only if a CIDR rule is reached
+/// </summary>
+internal struct RemoteAddressOperand
+{
+    private IPAddress? _parsed;
+    private bool _attempted;
+
+    public RemoteAddressOperand(string? text)
+    {
+        Text = text ?? string.Empty;
+        _parsed = null;
+        _attempted = false;
+    }
+
+    public string Text { get; }
+    public bool IsEmpty => Text.Length == 0;
+
+    public IPAddress? Parsed
+    {
+        get
+        {
+            if (!_attempted)
+            {
+                _attempted = true;
+                IPAddress.TryParse(Text, out _parsed);
+            }
+            return _parsed;
+        }
+    }
+}
+
+/// <summary>
+/// Immutable lookup structure over the enabled rules, rebuilt after rule
+/// changes and read without locks
+/// Network rules are filed under their most selective exact field: process
+/// name, then remote port, local port and process ID, else a generic
+/// list. A lookup probes the connection's lists, each kept in evaluation
+/// order, and stops each probe at the first match or at the first rule
+/// that cannot beat the best match so far. Device rules are kept per
+/// device type, with any-type rules merged into every list.
+/// </summary>
+internal sealed class PolicyRuleIndex
+{
+    public static readonly PolicyRuleIndex Empty = new(Array.Empty<CompiledPolicyRule>());
+
+    private readonly FrozenDictionary<string, CompiledPolicyRule[]> _networkByProcessName;
+    private readonly FrozenDictionary<ushort, CompiledPolicyRule[]> _networkByRemotePort;
+    private readonly FrozenDictionary<ushort, CompiledPolicyRule[]> _networkByLocalPort;
+    private readonly FrozenDictionary<uint, CompiledPolicyRule[]> _networkByProcessId;
+    private readonly CompiledPolicyRule[] _networkGeneric;
+    private readonly FrozenDictionary<DeviceType, CompiledPolicyRule[]> _deviceByType;
+    private readonly CompiledPolicyRule[] _deviceAnyType;
+
+    public PolicyRuleIndex(IEnumerable<CompiledPolicyRule> rules)
+    {
+        var ordered = rules.Where(r => r.Enabled).ToList();
+        ordered.Sort((a, b) => a.Precedes(b) ? -1 : b.Precedes(a) ? 1 : 0);
+
+        var byProcessName = new Dictionary<string, List<CompiledPolicyRule>>(StringComparer.OrdinalIgnoreCase);
+        var byRemotePort = new Dictionary<ushort, List<CompiledPolicyRule>>();
+        var byLocalPort = new Dictionary<ushort, List<CompiledPolicyRule>>();
+        var byProcessId = new Dictionary<uint, List<CompiledPolicyRule>>();
+        var generic = new List<CompiledPolicyRule>();
+        var byDeviceType = new Dictionary<DeviceType, List<CompiledPolicyRule>>();
+        var anyType = new List<CompiledPolicyRule>();
+
+        foreach (var rule in ordered)
+        {
+            if (rule.Type == PolicyRuleType.Network)
+            {
+                if (rule.ExactProcessName is { } processName)
+                    Add(byProcessName, processName, rule);
+                else if (rule.RemotePort != 0)
+                    Add(byRemotePort, rule.RemotePort, rule);
+                else if (rule.LocalPort != 0)
+                    Add(byLocalPort, rule.LocalPort, rule);
+                else if (rule.ProcessId != 0)
+                    Add(byProcessId, rule.ProcessId, rule);
+                else
+                    generic.Add(rule);
+            }
+            else if (rule.Type == PolicyRuleType.Device)
+            {
+                if (rule.DeviceType == DeviceType.Unknown)
+                {
+                    // Any-type rules join every list, keeping its order
+                    anyType.Add(rule);
+                    foreach (var list in byDeviceType.Values)
+                        list.Add(rule);
+                }
+                else
+                {
+                    if (!byDeviceType.TryGetValue(rule.DeviceType, out var list))
+                    {
+                        list = new List<CompiledPolicyRule>(anyType);
+                        byDeviceType.Add(rule.DeviceType, list);
+                    }
+                    list.Add(rule);
+                }
+            }
+        }
+
+        _networkByProcessName = Freeze(byProcessName, StringComparer.OrdinalIgnoreCase);
+        _networkByRemotePort = Freeze(byRemotePort);
+        _networkByLocalPort = Freeze(byLocalPort);
+        _networkByProcessId = Freeze(byProcessId);
+        _networkGeneric = generic.ToArray();
+        _deviceByType = Freeze(byDeviceType);
+        _deviceAnyType = anyType.ToArray();
+    }
+
+    /// <summary>
+    /// Finds the first network rule in evaluation order matching a connection
+    /// </summary>
+    public CompiledPolicyRule? FindNetworkRule(
+        uint processId,
+        string processName,
+        NetworkProtocol protocol,
+        ushort localPort,
+        ushort remotePort,
+        string? remoteAddress,
+        string? userSid)
+    {
+        CompiledPolicyRule? best = null;
+        var address = new RemoteAddressOperand(remoteAddress);
+        var now = DateTime.UtcNow;
+
+        if (_networkByProcessName.Count != 0 &&
+            _networkByProcessName.TryGetValue(processName, out var rules))
+        {
+            Probe(rules, ref best, processId, processName, protocol, localPort, remotePort, ref address, userSid, now);
+        }
+
+        if (_networkByRemotePort.TryGetValue(remotePort, out rules))
+            Probe(rules, ref best, processId, processName, protocol, localPort, remotePort, ref address, userSid, now);
+
+        if (_networkByLocalPort.TryGetValue(localPort, out rules))
+            Probe(rules, ref best, processId, processName, protocol, localPort, remotePort, ref address, userSid, now);
+
+        if (_networkByProcessId.TryGetValue(processId, out rules))
+            Probe(rules, ref best, processId, processName, protocol, localPort, remotePort, ref address, userSid, now);
+
+        Probe(_networkGeneric, ref best, processId, processName, protocol, localPort, remotePort, ref address, userSid, now);
+
+        return best;
+    }
+
+    /// <summary>
+    /// Finds the first device rule in evaluation order matching an access
+    /// </summary>
+    public CompiledPolicyRule? FindDeviceRule(
+        uint processId,
+        string processName,
+        DeviceType deviceType,
+        string? deviceHardwareId,
+        string? userSid)
+    {
+        var rules = _deviceByType.TryGetValue(deviceType, out var typed) ? typed : _deviceAnyType;
+        var now = DateTime.UtcNow;
+
+        foreach (var rule in rules)
+        {
+            if (rule.MatchesDevice(processId, processName, deviceType, deviceHardwareId, userSid, now))
+                return rule;
+        }
+
+        return null;
+    }
+
+    private static void Probe(
+        CompiledPolicyRule[] rules,
+        ref CompiledPolicyRule? best,
+        uint processId,
+        string processName,
+        NetworkProtocol protocol,
+        ushort localPort,
+        ushort remotePort,
+        ref RemoteAddressOperand remoteAddress,
+        string? userSid,
+        DateTime now)
+    {
+        foreach (var rule in rules)
+        {
+            if (best != null && !rule.Precedes(best))
+                return;
+
+            if (rule.MatchesNetwork(processId, processName, protocol, localPort, remotePort, ref remoteAddress, userSid, now))
+            {
+                best = rule;
+                return;
+            }
+        }
+    }
+
+    private static void Add<TKey>(Dictionary<TKey, List<CompiledPolicyRule>> index, TKey key, CompiledPolicyRule rule)
+        where TKey : notnull
+    {
+        if (!index.TryGetValue(key, out var list))
+        {
+            list = new List<CompiledPolicyRule>();
+            index.Add(key, list);
+        }
+        list.Add(rule);
+    }
+
+    private static FrozenDictionary<TKey, CompiledPolicyRule[]> Freeze<TKey>(
+        Dictionary<TKey, List<CompiledPolicyRule>> index,
+        IEqualityComparer<TKey>? comparer = null)
+        where TKey : notnull
+    {
+        return index.ToFrozenDictionary(kv => kv.Key, kv => kv.Value.ToArray(), comparer);
+    }
+}
@@ -0,0 +1,196 @@
+using System.Diagnostics;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Least recently used cache of process metadata, keyed the way the
+/// drivers key their events (<see cref="ProcessKey"/>), so a hit is one
+/// dictionary lookup and no string work. Misses go to the source (the
+/// drivers' process caches, in the service) and then to a local lookup
+/// by process ID.
+///
+/// An exact key names one process forever, so what is found for it never
+/// expires and only falls out when the cache is full. Misses, and lookups
+/// by process ID alone, expire after the lifetime: the process may start,
+/// or the ID may be reused.
+/// </summary>
+public sealed class ProcessMetadataCache
+{
+    private sealed class Entry
+    {
+        public required ProcessKey Key { get; init; }
+        public required ProcessMetadata? Metadata { get; init; }
+        public long ExpiresAt { get; init; }        // Stopwatch ticks; long.MaxValue = never
+    }
+
+    private readonly object _lock = new();
+    private readonly Dictionary<ProcessKey, LinkedListNode<Entry>> _entries;
+    private readonly LinkedList<Entry> _order = new();      // Most recently used first
+    private readonly IProcessMetadataSource? _source;
+    private readonly int _capacity;
+    private readonly long _lifetimeTicks;
+    private long _hits;
+    private long _misses;
+
+    /// <param name="capacity">Processes remembered</param>
+    /// <param name="lifetime">How long misses and lookups by process ID alone are remembered</param>
+    /// <param name="source">Consulted on a miss before the local lookup</param>
+    public ProcessMetadataCache(int capacity = 4096, TimeSpan? lifetime = null, IProcessMetadataSource? source = null)
+    {
+        _capacity = Math.Max(1, capacity);
+        _lifetimeTicks = (long)((lifetime ?? TimeSpan.FromMinutes(1)).TotalSeconds * Stopwatch.Frequency);
+        _source = source;
+        _entries = new Dictionary<ProcessKey, LinkedListNode<Entry>>(Math.Min(_capacity, 4096));
+    }
+
+    public int Count
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return _entries.Count;
+            }
+        }
+    }
+
+    public long Hits => Interlocked.Read(ref _hits);
+
+    public long Misses => Interlocked.Read(ref _misses);
+
+    /// <summary>
+    /// Looks up a process without resolving it. Returns true if the key
+    /// is cached; <paramref name="metadata"/> is then null for a process
+    /// not found.
+    /// </summary>
+    public bool TryGet(ProcessKey key, out ProcessMetadata? metadata)
+    {
+        lock (_lock)
+        {
+            if (_entries.TryGetValue(key, out var node))
+            {
+                if (node.Value.ExpiresAt > Stopwatch.GetTimestamp())
+                {
+                    _order.Remove(node);
+                    _order.AddFirst(node);
+                    metadata = node.Value.Metadata;
+                    Interlocked.Increment(ref _hits);
+                    return true;
+                }
+
+                _order.Remove(node);
+                _entries.Remove(key);
+            }
+        }
+
+        metadata = null;
+        return false;
+    }
+
+    /// <summary>
+    /// Returns a process's metadata, resolving and caching it on a miss;
+    /// null if it cannot be found
+    /// </summary>
+    public async ValueTask<ProcessMetadata?> GetAsync(ProcessKey key, CancellationToken cancellationToken = default)
+    {
+        if (TryGet(key, out var metadata))
+            return metadata;
+
+        Interlocked.Increment(ref _misses);
+
+        metadata = null;
+        if (_source != null)
+        {
+            try
+            {
+                metadata = await _source.ResolveAsync(key, cancellationToken).ConfigureAwait(false);
+            }
+            catch (Exception ex) when (ex is not OperationCanceledException)
+            {
+                // The local lookup below still applies
+            }
+        }
+
+        metadata ??= ResolveLocal(key);
+        Add(key, metadata);
+        return metadata;
+    }
+
+    private void Add(ProcessKey key, ProcessMetadata? metadata)
+    {
+        var now = Stopwatch.GetTimestamp();
+
+        lock (_lock)
+        {
+            Insert(key, metadata, key.IsExact && metadata != null ? long.MaxValue : now + _lifetimeTicks);
+
+            // A lookup by ID alone also teaches us the exact key
+            if (!key.IsExact && metadata is { Key.IsExact: true })
+                Insert(metadata.Key, metadata, long.MaxValue);
+        }
+    }
+
+    private void Insert(ProcessKey key, ProcessMetadata? metadata, long expiresAt)
+    {
+        if (_entries.Remove(key, out var existing))
+            _order.Remove(existing);
+
+        while (_entries.Count >= _capacity && _order.Last is { } oldest)
+        {
+            _order.RemoveLast();
+            _entries.Remove(oldest.Value.Key);
+        }
+
+        var node = _order.AddFirst(new Entry { Key = key, Metadata = metadata, ExpiresAt = expiresAt });
+        _entries[key] = node;
+    }
+
+    /// <summary>
+    /// Looks a process up by ID in user mode. For an exact key the
+    /// process found must have the key's creation time; an ID that has
+    /// been reused since does not match.
+    /// </summary>
+    private static ProcessMetadata? ResolveLocal(ProcessKey key)
+    {
+        try
+        {
+            using var process = Process.GetProcessById((int)key.ProcessId);
+
+            ulong createTime = 0;
+            try
+            {
+                createTime = (ulong)process.StartTime.ToFileTimeUtc();
+            }
+            catch
+            {
+                // Not accessible; only an inexact key can match
+            }
+
+            if (key.IsExact && createTime != key.CreateTime)
+                return null;
+
+            string? path = null;
+            try
+            {
+                path = process.MainModule?.FileName;
+            }
+            catch
+            {
+                // Protected or 32/64-bit mismatch; the name still helps
+            }
+
+            return new ProcessMetadata
+            {
+                Key = new ProcessKey(key.ProcessId, createTime),
+                ImagePath = path,
+                Name = process.ProcessName
+            };
+        }
+        catch
+        {
+            // Exited, or never existed
+            return null;
+        }
+    }
+}
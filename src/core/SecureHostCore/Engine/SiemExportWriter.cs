@@ -0,0 +1,181 @@
+using System.Buffers;
+using System.Buffers.Text;
+using System.Globalization;
+using System.Text;
+using SecureHostCore.Models;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Base for the SIEM export formats: one line per event, assembled in
+/// pooled 64 KiB buffers that are handed to a <see cref="SiemExportChunk"/>
+/// as they fill. With syslog framing each line starts with an RFC 5424
+/// header and ends with a bare LF, as RFC 6587 non-transparent framing
+/// over TCP expects; otherwise lines end with the platform newline.
+/// </summary>
+internal abstract class SiemExportWriter : IDisposable
+{
+    private const int BufferSize = 64 * 1024;
+
+    // <PRI>1 TIMESTAMP HOST APP-NAME PROCID MSGID SD, before the host name
+    private const int SyslogHeaderBytes = 64;
+
+    // Facility 13 (log audit)
+    private const int SyslogFacility = 13;
+
+    private static readonly byte[] s_newLine = Encoding.UTF8.GetBytes(Environment.NewLine);
+    private static readonly byte[] s_syslogNewLine = "\n"u8.ToArray();
+
+    private readonly SiemExportChunk _chunk;
+    private readonly bool _syslog;
+    private readonly byte[] _newLine;
+    private byte[] _buffer;
+    private int _length;
+
+    protected SiemExportWriter(SiemExportChunk chunk, bool syslog)
+    {
+        _chunk = chunk ?? throw new ArgumentNullException(nameof(chunk));
+        _syslog = syslog;
+        _newLine = syslog ? s_syslogNewLine : s_newLine;
+        HostName = Encoding.UTF8.GetBytes(Environment.MachineName);
+        _buffer = ArrayPool<byte>.Shared.Rent(BufferSize);
+    }
+
+    public static SiemExportWriter Create(SiemExportFormat format, SiemExportChunk chunk, bool syslog)
+    {
+        return format switch
+        {
+            SiemExportFormat.Cef => new CefExportWriter(chunk, syslog),
+            SiemExportFormat.Json => new JsonExportWriter(chunk, syslog),
+            _ => throw new ArgumentOutOfRangeException(nameof(format), format, "Unknown export format")
+        };
+    }
+
+    protected byte[] HostName { get; }
+
+    public int Count { get; private set; }
+
+    /// <summary>
+    /// Writes a record from a binary audit log segment
+    /// </summary>
+    public abstract void Write(in AuditRecord record, in AuditStringTable strings);
+
+    /// <summary>
+    /// Writes an event read from a legacy JSON lines log
+    /// </summary>
+    public abstract void Write(AuditEvent evt);
+
+    /// <summary>
+    /// Reserves room for a line of at most <paramref name="maxLength"/>
+    /// bytes and writes its syslog header; the caller appends the body
+    /// from <paramref name="position"/> and ends it with <see cref="EndLine"/>
+    /// </summary>
+    protected Span<byte> BeginLine(int maxLength, long timestampTicks, byte severity, out int position)
+    {
+        maxLength += _newLine.Length;
+        if (_syslog)
+            maxLength += SyslogHeaderBytes + HostName.Length;
+
+        Reserve(maxLength);
+
+        var span = _buffer.AsSpan(_length);
+        position = 0;
+
+        if (_syslog)
+        {
+            Append(span, ref position, "<"u8);
+            AppendNumber(span, ref position, SyslogFacility * 8 + MapSyslogSeverity((EventSeverity)severity));
+            Append(span, ref position, ">1 "u8);
+
+            // RFC 5424 allows at most six fractional digits
+            new DateTime(timestampTicks, DateTimeKind.Utc).TryFormat(
+                span[position..], out var written, "yyyy-MM-dd'T'HH:mm:ss.ffffff'Z'", CultureInfo.InvariantCulture);
+            position += written;
+
+            Append(span, ref position, " "u8);
+            Append(span, ref position, HostName);
+            Append(span, ref position, " SecureHost - - - "u8);
+        }
+
+        return span;
+    }
+
+    protected void EndLine(Span<byte> span, int position)
+    {
+        Append(span, ref position, _newLine);
+        _length += position;
+        Count++;
+    }
+
+    private static uint MapSyslogSeverity(EventSeverity severity)
+    {
+        return severity switch
+        {
+            EventSeverity.Warning => 4,
+            EventSeverity.Error => 3,
+            EventSeverity.Critical => 2,
+            _ => 6
+        };
+    }
+
+    protected static void Append(Span<byte> span, ref int position, ReadOnlySpan<byte> value)
+    {
+        value.CopyTo(span[position..]);
+        position += value.Length;
+    }
+
+    protected static void AppendNumber(Span<byte> span, ref int position, uint value)
+    {
+        Utf8Formatter.TryFormat(value, span[position..], out var written);
+        position += written;
+    }
+
+    private void Reserve(int length)
+    {
+        if (_buffer.Length - _length >= length)
+            return;
+
+        Flush();
+
+        if (_buffer.Length < length)
+        {
+            ArrayPool<byte>.Shared.Return(_buffer);
+            _buffer = ArrayPool<byte>.Shared.Rent(length);
+        }
+    }
+
+    /// <summary>
+    /// Hands the lines written so far to the chunk
+    /// </summary>
+    public void Flush()
+    {
+        if (_length > 0)
+        {
+            _chunk.Add(_buffer, _length);
+            _buffer = ArrayPool<byte>.Shared.Rent(BufferSize);
+            _length = 0;
+        }
+    }
+
+    public virtual void Dispose()
+    {
+        Flush();
+        ArrayPool<byte>.Shared.Return(_buffer);
+        _buffer = Array.Empty<byte>();
+    }
+
+    /// <summary>
+    /// UTF-8 names indexed by value; undefined values format as numbers,
+    /// as Enum.ToString does
+    /// </summary>
+    protected static byte[][] CreateEnumNames<TEnum>() where TEnum : struct, Enum
+    {
+        var names = new byte[byte.MaxValue + 1][];
+        for (var i = 0; i < names.Length; i++)
+        {
+            var value = (TEnum)Enum.ToObject(typeof(TEnum), i);
+            names[i] = Encoding.UTF8.GetBytes(value.ToString());
+        }
+        return names;
+    }
+}
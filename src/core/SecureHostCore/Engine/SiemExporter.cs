@@ -0,0 +1,467 @@
+using System.Buffers;
+using System.Runtime.ExceptionServices;
+using System.Text.Json;
+using System.Threading.Channels;
+using SecureHostCore.Models;
+using Microsoft.Extensions.Logging;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Streams the audit events in a window to a SIEM destination.
+///
+/// Each segment is indexed once by walking its block headers; its
+/// blocks in the window are then split into runs of about ChunkEvents
+/// events, formatted in parallel into pooled <see cref="SiemExportChunk"/>s
+/// and written in log order as they complete. At most MaxParallelism
+/// chunks are being formatted or waiting to be written, so memory stays
+/// bounded however long the window. Legacy JSON lines logs are split the
+/// same way by line.
+///
+/// The position after each chunk written is kept in a
+/// <see cref="SiemExportCheckpoint"/>: the segment and the next block (a
+/// line, for a legacy log). With a checkpoint callback the output is
+/// flushed before each call, so a job can persist the position and an
+/// export cut short resumes at the next chunk.
+/// </summary>
+internal sealed class SiemExporter
+{
+    private readonly ILogger _logger;
+    private readonly IReadOnlyList<string> _files;
+    private readonly Func<string, bool> _isLegacy;
+    private readonly DateTime _startTime;
+    private readonly DateTime _endTime;
+    private readonly SiemExportFormat _format;
+    private readonly bool _syslog;
+    private readonly int _parallelism;
+    private readonly int _chunkEvents;
+    private readonly SiemExportCheckpoint _checkpoint;
+    private int _segmentsDone;
+    private long _eventsWritten;
+    private long _bytesWritten;
+
+    /// <param name="files">Segments and legacy logs, oldest first</param>
+    /// <param name="checkpoint">
+    /// Where to start; updated as chunks are written. Its counters carry
+    /// on from a resumed export's.
+    /// </param>
+    public SiemExporter(
+        ILogger logger,
+        IReadOnlyList<string> files,
+        Func<string, bool> isLegacy,
+        DateTime startTime,
+        DateTime endTime,
+        SiemExportFormat format,
+        bool syslog,
+        int parallelism,
+        int chunkEvents,
+        SiemExportCheckpoint? checkpoint = null)
+    {
+        _logger = logger ?? throw new ArgumentNullException(nameof(logger));
+        _files = files ?? throw new ArgumentNullException(nameof(files));
+        _isLegacy = isLegacy ?? throw new ArgumentNullException(nameof(isLegacy));
+        _startTime = startTime;
+        _endTime = endTime;
+        _format = format;
+        _syslog = syslog;
+        _parallelism = parallelism > 0 ? parallelism : Environment.ProcessorCount;
+        _chunkEvents = Math.Max(chunkEvents, 1);
+        _checkpoint = checkpoint ?? new SiemExportCheckpoint();
+        _eventsWritten = _checkpoint.EventsWritten;
+        _bytesWritten = _checkpoint.BytesWritten;
+    }
+
+    public int SegmentsTotal => _files.Count;
+
+    public int SegmentsDone => Volatile.Read(ref _segmentsDone);
+
+    public long EventsWritten => Interlocked.Read(ref _eventsWritten);
+
+    public long BytesWritten => Interlocked.Read(ref _bytesWritten);
+
+    public async Task ExportAsync(
+        Stream output,
+        Func<CancellationToken, ValueTask>? checkpointed = null,
+        CancellationToken cancellationToken = default)
+    {
+        ArgumentNullException.ThrowIfNull(output);
+
+        var pending = Channel.CreateBounded<Task<SiemExportChunk>>(new BoundedChannelOptions(_parallelism)
+        {
+            SingleReader = true,
+            SingleWriter = true
+        });
+
+        using var stop = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+        var producer = Task.Run(() => ProduceAsync(pending.Writer, stop.Token), CancellationToken.None);
+
+        ExceptionDispatchInfo? failure = null;
+        string? abandonedSegment = null;
+
+        // Every chunk is awaited and returned to the pool, even after a failure
+        await foreach (var task in pending.Reader.ReadAllAsync(CancellationToken.None))
+        {
+            using var chunk = await task.ConfigureAwait(false);
+            if (failure != null)
+                continue;
+
+            try
+            {
+                if (chunk.Segment == abandonedSegment)
+                {
+                    if (chunk.LastInSegment)
+                        Interlocked.Increment(ref _segmentsDone);
+                    continue;
+                }
+
+                if (chunk.Failure != null)
+                {
+                    _logger.LogError(chunk.Failure, "Error reading audit log file: {File}", chunk.Segment);
+                    abandonedSegment = chunk.Segment;
+                }
+                else if (chunk.IntegrityError != null)
+                {
+                    _logger.LogCritical(
+                        "SECURITY ALERT: Audit log {File} failed verification during export: {Reason}",
+                        chunk.Segment, chunk.IntegrityError);
+                    abandonedSegment = chunk.Segment;
+                }
+
+                // Chunks hold whole lines only, so what was formatted
+                // before a failure is still written
+                await chunk.WriteToAsync(output, stop.Token).ConfigureAwait(false);
+
+                Interlocked.Add(ref _eventsWritten, chunk.Events);
+                Interlocked.Add(ref _bytesWritten, chunk.Length);
+                if (chunk.LastInSegment)
+                    Interlocked.Increment(ref _segmentsDone);
+
+                _checkpoint.Segment = chunk.Segment;
+                _checkpoint.NextBlock = chunk.NextBlock;
+                _checkpoint.EventsWritten = EventsWritten;
+                _checkpoint.BytesWritten = BytesWritten;
+
+                if (checkpointed != null)
+                {
+                    await output.FlushAsync(stop.Token).ConfigureAwait(false);
+                    await checkpointed(stop.Token).ConfigureAwait(false);
+                }
+            }
+            catch (Exception ex)
+            {
+                failure = ExceptionDispatchInfo.Capture(ex);
+                stop.Cancel();
+            }
+        }
+
+        try
+        {
+            await producer.ConfigureAwait(false);
+        }
+        catch (OperationCanceledException) when (stop.IsCancellationRequested)
+        {
+            cancellationToken.ThrowIfCancellationRequested();
+        }
+
+        failure?.Throw();
+        await output.FlushAsync(cancellationToken).ConfigureAwait(false);
+    }
+
+    /// <summary>
+    /// Indexes files in order and queues a formatting task per chunk.
+    /// Every file ends with a chunk marked LastInSegment, empty if nothing
+    /// in it falls in the window.
+    /// </summary>
+    private async Task ProduceAsync(ChannelWriter<Task<SiemExportChunk>> pending, CancellationToken cancellationToken)
+    {
+        try
+        {
+            var startTicks = _startTime.Ticks;
+            var endTicks = _endTime.Ticks;
+
+            foreach (var file in _files)
+            {
+                cancellationToken.ThrowIfCancellationRequested();
+
+                var segment = Path.GetFileName(file);
+                var firstBlock = segment == _checkpoint.Segment ? _checkpoint.NextBlock : 0;
+
+                if (_isLegacy(file))
+                {
+                    await ProduceLegacyAsync(pending, file, segment, firstBlock, cancellationToken).ConfigureAwait(false);
+                    continue;
+                }
+
+                AuditLogReader.SegmentIndex index;
+                try
+                {
+                    index = AuditLogReader.Index(file, startTicks, endTicks, firstBlock);
+                }
+                catch (Exception ex) when (ex is not OperationCanceledException)
+                {
+                    _logger.LogError(ex, "Error reading audit log file: {File}", file);
+                    await pending.WriteAsync(Task.FromResult(new SiemExportChunk(segment, firstBlock, true)), cancellationToken)
+                        .ConfigureAwait(false);
+                    continue;
+                }
+
+                if (index.Error != null)
+                {
+                    _logger.LogCritical(
+                        "SECURITY ALERT: Audit log {File} failed verification during export: {Reason}",
+                        file, index.Error);
+                }
+
+                var nextBlock = Math.Max(index.NextSequence, firstBlock);
+                if (index.Blocks.Count == 0)
+                {
+                    await pending.WriteAsync(Task.FromResult(new SiemExportChunk(segment, nextBlock, true)), cancellationToken)
+                        .ConfigureAwait(false);
+                    continue;
+                }
+
+                var first = 0;
+                var events = 0;
+                for (var i = 0; i < index.Blocks.Count; i++)
+                {
+                    events += index.Blocks[i].RecordCount;
+
+                    var last = i == index.Blocks.Count - 1;
+                    if (events < _chunkEvents && !last)
+                        continue;
+
+                    var chunk = new SiemExportChunk(segment, last ? nextBlock : index.Blocks[i].Sequence + 1, last);
+                    var (start, count) = (first, i - first + 1);
+
+                    await pending.WriteAsync(
+                        Task.Run(() => FormatBlocks(chunk, file, index, start, count, startTicks, endTicks), CancellationToken.None),
+                        cancellationToken).ConfigureAwait(false);
+
+                    first = i + 1;
+                    events = 0;
+                }
+            }
+        }
+        finally
+        {
+            pending.TryComplete();
+        }
+    }
+
+    private async Task ProduceLegacyAsync(
+        ChannelWriter<Task<SiemExportChunk>> pending,
+        string file,
+        string segment,
+        long firstLine,
+        CancellationToken cancellationToken)
+    {
+        var lines = new List<string>(_chunkEvents);
+        var lineNumber = 0L;
+
+        try
+        {
+            foreach (var line in File.ReadLines(file))
+            {
+                if (lineNumber++ < firstLine || string.IsNullOrWhiteSpace(line))
+                    continue;
+
+                lines.Add(line);
+                if (lines.Count < _chunkEvents)
+                    continue;
+
+                var batch = lines;
+                var chunk = new SiemExportChunk(segment, lineNumber, false);
+                await pending.WriteAsync(Task.Run(() => FormatLegacy(chunk, batch), CancellationToken.None), cancellationToken)
+                    .ConfigureAwait(false);
+                lines = new List<string>(_chunkEvents);
+            }
+        }
+        catch (Exception ex) when (ex is not OperationCanceledException)
+        {
+            _logger.LogError(ex, "Error reading audit log file: {File}", file);
+        }
+
+        var tail = new SiemExportChunk(segment, Math.Max(lineNumber, firstLine), true);
+        await pending.WriteAsync(Task.Run(() => FormatLegacy(tail, lines), CancellationToken.None), cancellationToken)
+            .ConfigureAwait(false);
+    }
+
+    private SiemExportChunk FormatBlocks(
+        SiemExportChunk chunk,
+        string file,
+        AuditLogReader.SegmentIndex index,
+        int first,
+        int count,
+        long startTicks,
+        long endTicks)
+    {
+        var writer = SiemExportWriter.Create(_format, chunk, _syslog);
+        try
+        {
+            var result = AuditLogReader.ScanBlocks(file, index, first, count, startTicks, endTicks,
+                (in AuditRecord record, in AuditStringTable strings) => writer.Write(in record, in strings));
+            chunk.IntegrityError = result.Error;
+        }
+        catch (Exception ex)
+        {
+            chunk.Failure = ex;
+        }
+        finally
+        {
+            writer.Dispose();
+            chunk.Events = writer.Count;
+        }
+
+        return chunk;
+    }
+
+    private SiemExportChunk FormatLegacy(SiemExportChunk chunk, List<string> lines)
+    {
+        var writer = SiemExportWriter.Create(_format, chunk, _syslog);
+        try
+        {
+            foreach (var line in lines)
+            {
+                var evt = JsonSerializer.Deserialize<AuditEvent>(line);
+                if (evt != null &&
+                    evt.Timestamp >= _startTime &&
+                    evt.Timestamp <= _endTime)
+                {
+                    writer.Write(evt);
+                }
+            }
+        }
+        catch (Exception ex)
+        {
+            chunk.Failure = ex;
+        }
+        finally
+        {
+            writer.Dispose();
+            chunk.Events = writer.Count;
+        }
+
+        return chunk;
+    }
+}
+
+/// <summary>
+/// Formatted lines for one run of blocks, in pooled buffers, and the
+/// export position once they are written
+/// </summary>
+internal sealed class SiemExportChunk : IDisposable
+{
+    private readonly List<(byte[] Buffer, int Length)> _buffers = new();
+
+    public SiemExportChunk(string segment, long nextBlock, bool lastInSegment)
+    {
+        Segment = segment;
+        NextBlock = nextBlock;
+        LastInSegment = lastInSegment;
+    }
+
+    public string Segment { get; }
+
+    public long NextBlock { get; }
+
+    public bool LastInSegment { get; }
+
+    public int Events { get; set; }
+
+    public long Length { get; private set; }
+
+    /// <summary>
+    /// A block failed verification; later chunks of the segment are dropped
+    /// </summary>
+    public string? IntegrityError { get; set; }
+
+    public Exception? Failure { get; set; }
+
+    /// <summary>
+    /// Takes ownership of a pooled buffer
+    /// </summary>
+    public void Add(byte[] buffer, int length)
+    {
+        _buffers.Add((buffer, length));
+        Length += length;
+    }
+
+    public async ValueTask WriteToAsync(Stream output, CancellationToken cancellationToken)
+    {
+        foreach (var (buffer, length) in _buffers)
+            await output.WriteAsync(buffer.AsMemory(0, length), cancellationToken).ConfigureAwait(false);
+    }
+
+    public void Dispose()
+    {
+        foreach (var (buffer, _) in _buffers)
+            ArrayPool<byte>.Shared.Return(buffer);
+
+        _buffers.Clear();
+    }
+}
+
+/// <summary>
+/// A background export started through <see cref="AuditEngine.StartSiemExport"/>
+/// </summary>
+internal sealed class SiemExportJob
+{
+    private readonly CancellationTokenSource _cancellation = new();
+    private readonly DateTime _startedAt = DateTime.UtcNow;
+    private Task _task = Task.CompletedTask;
+    private volatile SiemExportState _state = SiemExportState.Running;
+    private DateTime? _completedAt;
+    private string? _error;
+
+    public SiemExportJob(SiemExportCheckpoint checkpoint, SiemExporter exporter)
+    {
+        Checkpoint = checkpoint ?? throw new ArgumentNullException(nameof(checkpoint));
+        Exporter = exporter ?? throw new ArgumentNullException(nameof(exporter));
+    }
+
+    public SiemExportCheckpoint Checkpoint { get; }
+
+    public SiemExporter Exporter { get; }
+
+    public SiemExportState State => _state;
+
+    public void Run(Func<CancellationToken, Task> export)
+    {
+        _task = Task.Run(() => export(_cancellation.Token));
+    }
+
+    /// <summary>
+    /// Requests cancellation; the task completes once the export has stopped
+    /// </summary>
+    public Task Cancel()
+    {
+        _cancellation.Cancel();
+        return _task;
+    }
+
+    public void Complete(SiemExportState state, string? error)
+    {
+        _error = error;
+        _completedAt = DateTime.UtcNow;
+        _state = state;
+    }
+
+    public SiemExportProgress GetProgress()
+    {
+        var state = _state;
+
+        return new SiemExportProgress
+        {
+            Id = Checkpoint.Id,
+            State = state,
+            Request = Checkpoint.Request,
+            SegmentsTotal = Exporter.SegmentsTotal,
+            SegmentsDone = Exporter.SegmentsDone,
+            EventsWritten = Exporter.EventsWritten,
+            BytesWritten = Exporter.BytesWritten,
+            StartedAt = _startedAt,
+            CompletedAt = state == SiemExportState.Running ? null : _completedAt,
+            Error = _error
+        };
+    }
+}
@@ -0,0 +1,213 @@
+using System.Numerics;
+
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Hashing shared by the sketches. Keys are folded into 64 bits and
+/// mixed so that every bit depends on every input bit.
+/// </summary>
+public static class SketchHash
+{
+    public static ulong Mix(ulong value)
+    {
+        // SplitMix64 finalizer
+        value ^= value >> 30;
+        value *= 0xBF58476D1CE4E5B9ul;
+        value ^= value >> 27;
+        value *= 0x94D049BB133111EBul;
+        value ^= value >> 31;
+        return value;
+    }
+
+    public static ulong Combine(ulong first, ulong second) => Mix(first ^ Mix(second + 0x9E3779B97F4A7C15ul));
+
+    public static ulong Combine(ulong first, ulong second, ulong third) => Combine(Combine(first, second), third);
+}
+
+/// <summary>
+/// Count-min sketch: approximate counts per key in fixed memory. An
+/// estimate never undercounts; it overcounts by more than 2N/width (N =
+/// everything added) with probability below 2^-depth. Uses conservative
+/// update, which only raises the counters that hold the minimum.
+/// Not thread-safe.
+/// </summary>
+public sealed class CountMinSketch
+{
+    private readonly uint[] _counters;
+    private readonly int _depth;
+    private readonly int _widthMask;
+    private readonly int _widthBits;
+    private long _total;
+
+    /// <param name="width">Counters per row, rounded up to a power of two</param>
+    /// <param name="depth">Rows, each with its own hash</param>
+    public CountMinSketch(int width = 2048, int depth = 4)
+    {
+        var roundedWidth = (int)BitOperations.RoundUpToPowerOf2((uint)Math.Clamp(width, 16, 1 << 24));
+        _depth = Math.Clamp(depth, 1, 16);
+        _widthMask = roundedWidth - 1;
+        _widthBits = BitOperations.Log2((uint)roundedWidth);
+        _counters = new uint[roundedWidth * _depth];
+    }
+
+    /// <summary>
+    /// Everything added since the last clear
+    /// </summary>
+    public long Total => _total;
+
+    /// <summary>
+    /// Adds to a key's count and returns its new estimate
+    /// </summary>
+    public uint Add(ulong key, uint count = 1)
+    {
+        var hash = SketchHash.Mix(key);
+        var estimate = EstimateHashed(hash);
+        var target = estimate > uint.MaxValue - count ? uint.MaxValue : estimate + count;
+
+        for (var row = 0; row < _depth; row++)
+        {
+            ref var counter = ref _counters[Index(hash, row)];
+            if (counter < target)
+                counter = target;
+        }
+
+        _total += count;
+        return target;
+    }
+
+    public uint Estimate(ulong key) => EstimateHashed(SketchHash.Mix(key));
+
+    public void Clear()
+    {
+        Array.Clear(_counters);
+        _total = 0;
+    }
+
+    private uint EstimateHashed(ulong hash)
+    {
+        var minimum = uint.MaxValue;
+        for (var row = 0; row < _depth; row++)
+            minimum = Math.Min(minimum, _counters[Index(hash, row)]);
+
+        return minimum;
+    }
+
+    // Double hashing: row i probes h1 + i * h2
+    private int Index(ulong hash, int row)
+    {
+        var h1 = (uint)hash;
+        var h2 = (uint)(hash >> 32) | 1;
+        return (row << _widthBits) + (int)((h1 + (uint)row * h2) & (uint)_widthMask);
+    }
+}
+
+/// <summary>
+/// HyperLogLog: approximate count of distinct keys in 2^precision bytes,
+/// with a standard error of about 1.04 / sqrt(2^precision) (3% at the
+/// default precision of 10). Takes keys already hashed with
+/// <see cref="SketchHash"/>. Not thread-safe.
+/// </summary>
+public sealed class HyperLogLog
+{
+    private readonly byte[] _registers;
+    private readonly int _precision;
+
+    public HyperLogLog(int precision = 10)
+    {
+        _precision = Math.Clamp(precision, 4, 16);
+        _registers = new byte[1 << _precision];
+    }
+
+    /// <summary>
+    /// Adds a hashed key; returns true if the estimate may have changed
+    /// </summary>
+    public bool Add(ulong hash)
+    {
+        var index = (int)(hash >> (64 - _precision));
+
+        // The guard bit bounds the rank at 64 - precision + 1
+        var rank = (byte)(BitOperations.LeadingZeroCount((hash << _precision) | (1ul << (_precision - 1))) + 1);
+
+        ref var register = ref _registers[index];
+        if (rank <= register)
+            return false;
+
+        register = rank;
+        return true;
+    }
+
+    public double Estimate()
+    {
+        var m = _registers.Length;
+        var sum = 0.0;
+        var zeros = 0;
+
+        foreach (var register in _registers)
+        {
+            sum += 1.0 / (1ul << register);
+            if (register == 0)
+                zeros++;
+        }
+
+        var alpha = m switch
+        {
+            16 => 0.673,
+            32 => 0.697,
+            64 => 0.709,
+            _ => 0.7213 / (1 + 1.079 / m)
+        };
+
+        var estimate = alpha * m * m / sum;
+
+        // Linear counting is more accurate while registers are still empty
+        if (estimate <= 2.5 * m && zeros != 0)
+            estimate = m * Math.Log((double)m / zeros);
+
+        return estimate;
+    }
+
+    public void Clear() => Array.Clear(_registers);
+}
+
+/// <summary>
+/// Exponentially weighted moving average of an event rate, for updates at
+/// irregular intervals. The half-life is how long an old rate takes to
+/// lose half its weight.
+/// </summary>
+public struct EwmaRate
+{
+    private bool _started;
+
+    /// <summary>
+    /// Events per second
+    /// </summary>
+    public double Rate { get; private set; }
+
+    /// <summary>
+    /// Time covered by the samples so far
+    /// </summary>
+    public TimeSpan Observed { get; private set; }
+
+    /// <summary>
+    /// Adds <paramref name="count"/> events seen over <paramref name="elapsed"/>
+    /// </summary>
+    public void Update(double count, TimeSpan elapsed, TimeSpan halfLife)
+    {
+        if (elapsed <= TimeSpan.Zero)
+            return;
+
+        var sample = count / elapsed.TotalSeconds;
+        if (!_started)
+        {
+            Rate = sample;
+            _started = true;
+        }
+        else
+        {
+            var weight = 1 - Math.Exp(-Math.Log(2) * elapsed.TotalSeconds / halfLife.TotalSeconds);
+            Rate += weight * (sample - Rate);
+        }
+
+        Observed += elapsed;
+    }
+}
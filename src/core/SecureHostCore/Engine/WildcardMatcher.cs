@@ -0,0 +1,120 @@
+namespace SecureHostCore.Engine;
+
+/// <summary>
+/// Case-insensitive wildcard pattern (* and ?) compiled once per rule
+/// Patterns are classified up front so the common shapes (exact path,
+/// "dir\*", "*.exe", "*name*") are a single span comparison; anything
+/// else runs a backtracking glob over the pre-folded pattern.
+/// Matching never allocates.
+/// </summary>
+internal sealed class WildcardMatcher
+{
+    private enum MatchKind
+    {
+        Any,
+        Exact,
+        Prefix,
+        Suffix,
+        Contains,
+        Glob
+    }
+
+    private readonly MatchKind _kind;
+    private readonly string _literal;
+
+    private WildcardMatcher(MatchKind kind, string literal)
+    {
+        _kind = kind;
+        _literal = literal;
+    }
+
+    /// <summary>
+    /// The pattern without wildcards when it matches one string exactly
+    /// </summary>
+    public string? ExactValue => _kind == MatchKind.Exact ? _literal : null;
+
+    public static WildcardMatcher Compile(string pattern)
+    {
+        ArgumentNullException.ThrowIfNull(pattern);
+
+        if (pattern.AsSpan().TrimStart('*').IsEmpty)
+            return new WildcardMatcher(MatchKind.Any, string.Empty);
+
+        var span = pattern.AsSpan();
+        if (span.IndexOf('?') < 0)
+        {
+            var inner = span.Trim('*');
+            if (inner.IndexOf('*') < 0)
+            {
+                var leading = span[0] == '*';
+                var trailing = span[^1] == '*';
+                var kind = (leading, trailing) switch
+                {
+                    (false, false) => MatchKind.Exact,
+                    (false, true) => MatchKind.Prefix,
+                    (true, false) => MatchKind.Suffix,
+                    _ => MatchKind.Contains
+                };
+
+                return new WildcardMatcher(kind, inner.ToString());
+            }
+        }
+
+        return new WildcardMatcher(MatchKind.Glob, pattern.ToUpperInvariant());
+    }
+
+    public bool IsMatch(ReadOnlySpan<char> input)
+    {
+        return _kind switch
+        {
+            MatchKind.Any => true,
+            MatchKind.Exact => input.Equals(_literal, StringComparison.OrdinalIgnoreCase),
+            MatchKind.Prefix => input.StartsWith(_literal, StringComparison.OrdinalIgnoreCase),
+            MatchKind.Suffix => input.EndsWith(_literal, StringComparison.OrdinalIgnoreCase),
+            MatchKind.Contains => input.Contains(_literal, StringComparison.OrdinalIgnoreCase),
+            _ => GlobMatch(input, _literal)
+        };
+    }
+
+    /// <summary>
+    /// Greedy glob with single-star backtracking: on a mismatch, retry
+    /// from the most recent '*' consuming one more input character.
+    /// Linear for patterns with one star, O(n*m) at worst.
+    /// </summary>
+    private static bool GlobMatch(ReadOnlySpan<char> input, string pattern)
+    {
+        var i = 0;
+        var p = 0;
+        var starPattern = -1;
+        var starInput = 0;
+
+        while (i < input.Length)
+        {
+            if (p < pattern.Length &&
+                (pattern[p] == '?' || (pattern[p] != '*' && pattern[p] == char.ToUpperInvariant(input[i]))))
+            {
+                i++;
+                p++;
+            }
+            else if (p < pattern.Length && pattern[p] == '*')
+            {
+                starPattern = p++;
+                starInput = i;
+            }
+            else if (starPattern >= 0)
+            {
+                p = starPattern + 1;
+                i = ++starInput;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        while (p < pattern.Length && pattern[p] == '*')
+            p++;
+
+        return p == pattern.Length;
+    }
+}
@@ -0,0 +1,98 @@
+using System.Buffers.Binary;
+using System.Net;
+using System.Text.Json.Serialization;
+
+namespace SecureHostCore.Models;
+
+/// <summary>
+/// Kind of behaviour flagged by <see cref="Engine.AnomalyDetector"/>
+/// </summary>
+[JsonConverter(typeof(JsonStringEnumConverter))]
+public enum AnomalyKind
+{
+    /// <summary>
+    /// A process reached many distinct remote endpoints or ports in one window
+    /// </summary>
+    PortScan = 1,
+
+    /// <summary>
+    /// A process connects to one endpoint at a steady interval
+    /// </summary>
+    Beaconing = 2,
+
+    /// <summary>
+    /// Device access checks for one device type well above their baseline
+    /// </summary>
+    DeviceAccessBurst = 3,
+
+    /// <summary>
+    /// Driver block rate well above its baseline
+    /// </summary>
+    BlockSurge = 4,
+
+    /// <summary>
+    /// Driver classification rate well above its baseline
+    /// </summary>
+    ConnectionSurge = 5
+}
+
+/// <summary>
+/// One connection event as the anomaly detector sees it. RemoteAddress
+/// packs the 16 address bytes (network order, IPv4 in the first four)
+/// with <see cref="PackAddress"/>.
+/// </summary>
+public readonly record struct ConnectionObservation(
+    ProcessKey Process,
+    UInt128 RemoteAddress,
+    byte IpVersion,
+    ushort RemotePort,
+    NetworkProtocol Protocol,
+    bool Blocked,
+    uint Count,
+    ulong Timestamp)        // FILETIME, UTC
+{
+    public static UInt128 PackAddress(ReadOnlySpan<byte> address)
+    {
+        return new UInt128(
+            BinaryPrimitives.ReadUInt64BigEndian(address),
+            BinaryPrimitives.ReadUInt64BigEndian(address[8..]));
+    }
+
+    public static IPAddress UnpackAddress(UInt128 address, byte ipVersion)
+    {
+        Span<byte> bytes = stackalloc byte[16];
+        BinaryPrimitives.WriteUInt64BigEndian(bytes, (ulong)(address >> 64));
+        BinaryPrimitives.WriteUInt64BigEndian(bytes[8..], (ulong)address);
+        return new IPAddress(ipVersion == 4 ? bytes[..4] : bytes);
+    }
+}
+
+/// <summary>
+/// A flagged anomaly. Observed and Baseline are in the kind's own unit:
+/// distinct endpoints per window, seconds between connections, or events
+/// per second.
+/// </summary>
+public sealed record AnomalyAlert
+{
+    public AnomalyKind Kind { get; init; }
+
+    public DateTime DetectedAt { get; init; }
+
+    /// <summary>
+    /// The process, where the anomaly belongs to one
+    /// </summary>
+    public ProcessKey? Process { get; init; }
+
+    /// <summary>
+    /// Remote endpoint, for beaconing
+    /// </summary>
+    public string? Endpoint { get; init; }
+
+    public DeviceType? DeviceType { get; init; }
+
+    public double Observed { get; init; }
+
+    public double Baseline { get; init; }
+
+    public string Message { get; init; } = string.Empty;
+}
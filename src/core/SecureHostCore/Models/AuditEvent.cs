@@ -37,6 +37,21 @@ public sealed class AuditEvent
     [JsonPropertyName("processId")]
     public uint ProcessId { get; set; }
 
+    /// <summary>
+    /// Process creation time (FILETIME, UTC) the driver reported with the
+    /// process ID; 0 if unknown. Used to resolve the process, not stored
+    /// in the audit log.
+    /// </summary>
+    [JsonPropertyName("processCreateTime")]
+    public ulong ProcessCreateTime { get; set; }
+
+    /// <summary>
+    /// Trace of the driver verdict this event records, if any. Times the
+    /// audit stage; only the correlation ID is stored, in Metadata.
+    /// </summary>
+    [JsonIgnore]
+    public VerdictTrace Trace { get; set; }
+
     /// <summary>
     /// Process name
     /// </summary>
@@ -137,7 +152,8 @@ public enum AuditEventType
     DriverUnload = 7,
     AuthenticationAttempt = 8,
     ConfigurationChange = 9,
-    TamperAttempt = 10
+    TamperAttempt = 10,
+    Anomaly = 11
 }
 
 /// <summary>
@@ -0,0 +1,242 @@
+using System.Net;
+using System.Runtime.InteropServices;
+
+namespace SecureHostCore.Models;
+
+/// <summary>
+/// Kind of message on the connection stream
+/// </summary>
+public enum ConnectionStreamMessageType : byte
+{
+    Snapshot = 1,       // Part of the initial snapshot
+    SnapshotEnd = 2,    // Snapshot complete; Count is the number of entries sent
+    Upsert = 3,         // Connection added or changed
+    Remove = 4,         // Connection gone; only Id is meaningful
+    Resync = 5          // Updates were lost; reconnect for a new snapshot
+}
+
+/// <summary>
+/// Connection stream message header. A message is the header followed by
+/// Count records. Sequence numbers every change on the server, so a
+/// client can tell where the snapshot ends and updates begin.
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 16)]
+public struct ConnectionStreamHeader
+{
+    public const byte CurrentVersion = 1;
+
+    public byte Version;
+    public ConnectionStreamMessageType Type;
+    public ushort RecordSize;
+    public uint Count;
+    public ulong Sequence;
+}
+
+/// <summary>
+/// A tracked connection on the connection stream. Addresses are in network
+/// byte order, IPv4 in the first four bytes. Verdict is the last driver
+/// verdict (0 if only seen in the system connection table) and Count the
+/// number of attempts the driver reported.
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 64)]
+public unsafe struct ConnectionStreamRecord
+{
+    public ulong Id;
+    public ulong LastSeen;              // FILETIME, UTC
+    public uint ProcessId;              // 0 = unknown
+    public uint Count;
+    public ushort LocalPort;
+    public ushort RemotePort;
+    public byte Protocol;
+    public byte Verdict;                // PolicyAction
+    public byte Direction;              // NetworkDirection
+    public byte IpVersion;
+    public fixed byte LocalAddress[16];
+    public fixed byte RemoteAddress[16];
+
+    public readonly DateTime LastSeenUtc => DateTime.FromFileTimeUtc((long)LastSeen);
+
+    public IPAddress GetLocalAddress()
+    {
+        fixed (byte* address = LocalAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    public IPAddress GetRemoteAddress()
+    {
+        fixed (byte* address = RemoteAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    public void SetAddresses(IPAddress local, IPAddress remote)
+    {
+        fixed (byte* localAddress = LocalAddress)
+        fixed (byte* remoteAddress = RemoteAddress)
+        {
+            local.TryWriteBytes(new Span<byte>(localAddress, 16), out var length);
+            remote.TryWriteBytes(new Span<byte>(remoteAddress, 16), out _);
+            IpVersion = (byte)(length == 4 ? 4 : 6);
+        }
+    }
+
+    private static IPAddress ToAddress(byte* address, byte ipVersion)
+    {
+        return new IPAddress(new ReadOnlySpan<byte>(address, ipVersion == 4 ? 4 : 16));
+    }
+}
+
+/// <summary>
+/// Server-side connection stream filter; unset fields match everything.
+/// A port matches either end of the connection.
+/// </summary>
+public sealed record ConnectionStreamFilter
+{
+    public static readonly ConnectionStreamFilter All = new();
+
+    public uint? ProcessId { get; init; }
+    public ushort? Port { get; init; }
+    public PolicyAction? Verdict { get; init; }
+
+    public bool Matches(in ConnectionStreamRecord record)
+    {
+        return (ProcessId == null || record.ProcessId == ProcessId) &&
+               (Port == null || record.LocalPort == Port || record.RemotePort == Port) &&
+               (Verdict == null || record.Verdict == (byte)Verdict);
+    }
+
+    /// <summary>
+    /// Query string for the stream endpoint; empty when unfiltered
+    /// </summary>
+    public string ToQueryString()
+    {
+        var parts = new List<string>(3);
+        if (ProcessId != null)
+            parts.Add($"pid={ProcessId}");
+        if (Port != null)
+            parts.Add($"port={Port}");
+        if (Verdict != null)
+            parts.Add($"verdict={Verdict}");
+
+        return parts.Count == 0 ? string.Empty : "?" + string.Join('&', parts);
+    }
+
+    /// <summary>
+    /// Parses the stream endpoint's query values. Empty values are unset;
+    /// returns false if a value is present but invalid.
+    /// </summary>
+    public static bool TryParse(string? processId, string? port, string? verdict, out ConnectionStreamFilter filter)
+    {
+        filter = All;
+
+        uint? pid = null;
+        ushort? portValue = null;
+        PolicyAction? action = null;
+
+        if (!string.IsNullOrEmpty(processId))
+        {
+            if (!uint.TryParse(processId, out var value))
+                return false;
+            pid = value;
+        }
+
+        if (!string.IsNullOrEmpty(port))
+        {
+            if (!ushort.TryParse(port, out var value))
+                return false;
+            portValue = value;
+        }
+
+        if (!string.IsNullOrEmpty(verdict))
+        {
+            if (!Enum.TryParse<PolicyAction>(verdict, ignoreCase: true, out var value) || !Enum.IsDefined(value))
+                return false;
+            action = value;
+        }
+
+        filter = new ConnectionStreamFilter { ProcessId = pid, Port = portValue, Verdict = action };
+        return true;
+    }
+}
+
+/// <summary>
+/// Encodes and decodes connection stream messages. Records are blittable
+/// and copied as is; readers accept larger records from a newer server
+/// and read the fields they know.
+/// </summary>
+public static class ConnectionStreamCodec
+{
+    public static readonly int HeaderSize = Marshal.SizeOf<ConnectionStreamHeader>();
+    public static readonly int RecordSize = Marshal.SizeOf<ConnectionStreamRecord>();
+
+    /// <summary>
+    /// Largest number of records the server puts in one message
+    /// </summary>
+    public const int MaxRecordsPerMessage = 1024;
+
+    public static int GetMessageSize(int recordCount) => HeaderSize + recordCount * RecordSize;
+
+    /// <summary>
+    /// Writes a message into <paramref name="buffer"/> and returns its length
+    /// </summary>
+    public static int Write(
+        Span<byte> buffer,
+        ConnectionStreamMessageType type,
+        ulong sequence,
+        ReadOnlySpan<ConnectionStreamRecord> records,
+        uint? count = null)
+    {
+        var header = new ConnectionStreamHeader
+        {
+            Version = ConnectionStreamHeader.CurrentVersion,
+            Type = type,
+            RecordSize = (ushort)RecordSize,
+            Count = count ?? (uint)records.Length,
+            Sequence = sequence
+        };
+        MemoryMarshal.Write(buffer, in header);
+
+        MemoryMarshal.AsBytes(records).CopyTo(buffer[HeaderSize..]);
+        return GetMessageSize(records.Length);
+    }
+
+    /// <summary>
+    /// Reads a message. For SnapshotEnd and Resync, Count is not a record
+    /// count and no records follow.
+    /// </summary>
+    public static bool TryRead(
+        ReadOnlySpan<byte> message,
+        out ConnectionStreamHeader header,
+        out ConnectionStreamRecord[] records)
+    {
+        records = Array.Empty<ConnectionStreamRecord>();
+
+        if (message.Length < HeaderSize)
+        {
+            header = default;
+            return false;
+        }
+
+        header = MemoryMarshal.Read<ConnectionStreamHeader>(message);
+        if (header.Version != ConnectionStreamHeader.CurrentVersion || header.RecordSize < RecordSize)
+            return false;
+
+        if (header.Type is ConnectionStreamMessageType.SnapshotEnd or ConnectionStreamMessageType.Resync)
+            return true;
+
+        if ((long)header.Count * header.RecordSize > message.Length - HeaderSize)
+            return false;
+
+        records = new ConnectionStreamRecord[header.Count];
+        for (var i = 0; i < records.Length; i++)
+        {
+            records[i] = MemoryMarshal.Read<ConnectionStreamRecord>(
+                message.Slice(HeaderSize + i * header.RecordSize, RecordSize));
+        }
+
+        return true;
+    }
+}
@@ -1,3 +1,4 @@
+using System.Net;
 using System.Text.Json.Serialization;
 
 namespace SecureHostCore.Models;
@@ -133,6 +134,20 @@ public sealed class PolicyRule
     [JsonPropertyName("auditLevel")]
     public AuditLevel AuditLevel { get; set; } = AuditLevel.Normal;
 
+    /// <summary>
+    /// How the driver reports connections this network rule permits.
+    /// Blocks are always reported in full.
+    /// </summary>
+    [JsonPropertyName("permitAuditMode")]
+    public PermitAuditMode PermitAuditMode { get; set; }
+
+    /// <summary>
+    /// Sampled: one connection reported in this many. Rate limited:
+    /// connections reported per second at most.
+    /// </summary>
+    [JsonPropertyName("permitAuditRate")]
+    public uint PermitAuditRate { get; set; }
+
     /// <summary>
     /// Custom metadata (JSON object)
     /// </summary>
@@ -158,6 +173,28 @@ public sealed class PolicyRule
         return true;
     }
 
+    /// <summary>
+    /// Parses an address pattern written as a CIDR prefix ("10.0.0.0/8",
+    /// "2001:db8::/32") or a single address. Wildcard patterns and
+    /// prefixes with host bits set do not parse.
+    /// </summary>
+    public static bool TryParseAddressPrefix(string? pattern, out IPNetwork prefix)
+    {
+        prefix = default;
+
+        if (string.IsNullOrEmpty(pattern))
+            return false;
+
+        if (pattern.Contains('/'))
+            return IPNetwork.TryParse(pattern, out prefix);
+
+        if (!IPAddress.TryParse(pattern, out var address))
+            return false;
+
+        prefix = new IPNetwork(address, address.GetAddressBytes().Length * 8);
+        return true;
+    }
+
     /// <summary>
     /// Creates a deep copy of this rule
     /// </summary>
@@ -186,6 +223,8 @@ public sealed class PolicyRule
             CreatedAt = CreatedAt,
             ModifiedAt = ModifiedAt,
             AuditLevel = AuditLevel,
+            PermitAuditMode = PermitAuditMode,
+            PermitAuditRate = PermitAuditRate,
             Metadata = Metadata != null ? new Dictionary<string, string>(Metadata) : null
         };
     }
@@ -251,3 +290,22 @@ public enum AuditLevel
     High = 3,
     Critical = 4
 }
+
+/// <summary>
+/// How permitted connections on a network rule are reported. Each
+/// reported connection records how many it stands for, so totals can be
+/// rebuilt from samples.
+/// </summary>
+[JsonConverter(typeof(JsonStringEnumConverter))]
+public enum PermitAuditMode
+{
+    /// <summary>
+    /// As the rule's action implies: Audit rules report every permit,
+    /// Allow rules only what the driver happens to see
+    /// </summary>
+    Default = 0,
+    Off = 1,
+    Sampled = 2,
+    RateLimited = 3,
+    Full = 4
+}
@@ -0,0 +1,68 @@
+namespace SecureHostCore.Models;
+
+/// <summary>
+/// Names one process: its ID plus its creation time (FILETIME, UTC),
+/// which together stay unique after the ID is reused. The drivers stamp
+/// this pair on their events. A CreateTime of 0 means whichever process
+/// has the ID at the time of the lookup.
+/// </summary>
+public readonly record struct ProcessKey(uint ProcessId, ulong CreateTime)
+{
+    /// <summary>
+    /// True if the key names one process rather than a reusable ID
+    /// </summary>
+    public bool IsExact => CreateTime != 0;
+
+    public override string ToString() => IsExact ? $"{ProcessId}@{CreateTime:X}" : ProcessId.ToString();
+}
+
+/// <summary>
+/// What is known about a process: captured by the drivers when it
+/// started, or looked up in user mode for processes they have not seen
+/// </summary>
+public sealed record ProcessMetadata
+{
+    public ProcessKey Key { get; init; }
+
+    public uint ParentProcessId { get; init; }
+
+    /// <summary>
+    /// Image path (DOS form where it could be converted)
+    /// </summary>
+    public string? ImagePath { get; init; }
+
+    /// <summary>
+    /// Image file name without extension, as in Process.ProcessName
+    /// </summary>
+    public string? Name { get; init; }
+
+    public string? UserSid { get; init; }
+
+    public string? UserName { get; init; }
+
+    /// <summary>
+    /// Code integrity signing level of the image (SE_SIGNING_LEVEL), if
+    /// the driver saw it
+    /// </summary>
+    public byte? SigningLevel { get; init; }
+
+    /// <summary>
+    /// Set once the process has exited
+    /// </summary>
+    public DateTime? ExitTimeUtc { get; init; }
+
+    public bool HasExited => ExitTimeUtc != null;
+}
+
+/// <summary>
+/// Resolves process metadata for <see cref="Engine.ProcessMetadataCache"/>
+/// on a cache miss
+/// </summary>
+public interface IProcessMetadataSource
+{
+    /// <summary>
+    /// Returns the process's metadata, or null if this source does not
+    /// know it
+    /// </summary>
+    ValueTask<ProcessMetadata?> ResolveAsync(ProcessKey key, CancellationToken cancellationToken = default);
+}
@@ -0,0 +1,112 @@
+using System.Text.Json.Serialization;
+
+namespace SecureHostCore.Models;
+
+/// <summary>
+/// Line format of a SIEM export
+/// </summary>
+[JsonConverter(typeof(JsonStringEnumConverter))]
+public enum SiemExportFormat
+{
+    Cef = 0,
+    Json = 1        // JSON lines with the property names of AuditEvent
+}
+
+[JsonConverter(typeof(JsonStringEnumConverter))]
+public enum SiemExportState
+{
+    Running = 1,
+    Completed = 2,
+    Failed = 3,
+    Cancelled = 4   // Can be resumed from its checkpoint
+}
+
+/// <summary>
+/// A background SIEM export. Destination is a file name in the audit
+/// log's Exports directory, or tcp://host:port for a syslog collector.
+/// </summary>
+public sealed class SiemExportRequest
+{
+    [JsonPropertyName("startTime")]
+    public DateTime StartTime { get; set; }
+
+    [JsonPropertyName("endTime")]
+    public DateTime EndTime { get; set; }
+
+    [JsonPropertyName("format")]
+    public SiemExportFormat Format { get; set; }
+
+    /// <summary>
+    /// Prefixes each line with an RFC 5424 syslog header; implied for TCP destinations
+    /// </summary>
+    [JsonPropertyName("syslog")]
+    public bool Syslog { get; set; }
+
+    [JsonPropertyName("destination")]
+    public string Destination { get; set; } = string.Empty;
+}
+
+/// <summary>
+/// How far an export got. Everything before block NextBlock of Segment
+/// (a segment file name) has been written and flushed to the
+/// destination, BytesWritten bytes in all.
+/// </summary>
+public sealed class SiemExportCheckpoint
+{
+    [JsonPropertyName("id")]
+    public Guid Id { get; set; }
+
+    [JsonPropertyName("request")]
+    public SiemExportRequest Request { get; set; } = new();
+
+    [JsonPropertyName("segment")]
+    public string? Segment { get; set; }
+
+    [JsonPropertyName("nextBlock")]
+    public long NextBlock { get; set; }
+
+    [JsonPropertyName("eventsWritten")]
+    public long EventsWritten { get; set; }
+
+    [JsonPropertyName("bytesWritten")]
+    public long BytesWritten { get; set; }
+
+    [JsonPropertyName("completed")]
+    public bool Completed { get; set; }
+}
+
+/// <summary>
+/// Progress of a background SIEM export
+/// </summary>
+public sealed class SiemExportProgress
+{
+    [JsonPropertyName("id")]
+    public Guid Id { get; init; }
+
+    [JsonPropertyName("state")]
+    public SiemExportState State { get; init; }
+
+    [JsonPropertyName("request")]
+    public SiemExportRequest Request { get; init; } = new();
+
+    [JsonPropertyName("segmentsTotal")]
+    public int SegmentsTotal { get; init; }
+
+    [JsonPropertyName("segmentsDone")]
+    public int SegmentsDone { get; init; }
+
+    [JsonPropertyName("eventsWritten")]
+    public long EventsWritten { get; init; }
+
+    [JsonPropertyName("bytesWritten")]
+    public long BytesWritten { get; init; }
+
+    [JsonPropertyName("startedAt")]
+    public DateTime StartedAt { get; init; }
+
+    [JsonPropertyName("completedAt")]
+    public DateTime? CompletedAt { get; init; }
+
+    [JsonPropertyName("error")]
+    public string? Error { get; init; }
+}
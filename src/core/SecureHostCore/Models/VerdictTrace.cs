@@ -0,0 +1,17 @@
+using System.Globalization;
+
+namespace SecureHostCore.Models;
+
+/// <summary>
+/// Correlation ID a driver gave a verdict and the performance counter
+/// timestamp of the verdict; default when the event was not traced
+/// </summary>
+public readonly record struct VerdictTrace(ulong CorrelationId, long Timestamp)
+{
+    public bool IsTraced => CorrelationId != 0;
+
+    /// <summary>
+    /// Hex form used in audit metadata and logs
+    /// </summary>
+    public string FormatId() => CorrelationId.ToString("x16", CultureInfo.InvariantCulture);
+}
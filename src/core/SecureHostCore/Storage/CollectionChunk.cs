@@ -0,0 +1,206 @@
+using System.Security.Cryptography;
+using System.Text;
+using System.Text.Json;
+using System.Text.Json.Serialization;
+
+namespace SecureHostCore.Storage;
+
+/// <summary>
+/// Manifest of a chunked collection, stored DPAPI-protected in place of a
+/// single value. It lists the live chunk of each partition and carries the
+/// data key the chunks are sealed with, so a load costs one DPAPI call
+/// however many chunks there are.
+/// </summary>
+internal sealed class CollectionManifest
+{
+    public const string FormatName = "SecureHost.Collection";
+    public const int CurrentVersion = 1;
+
+    [JsonPropertyName("format")]
+    public string Format { get; set; } = FormatName;
+
+    [JsonPropertyName("version")]
+    public int Version { get; set; } = CurrentVersion;
+
+    /// <summary>
+    /// Incremented by every save; chunks written by a save carry its generation
+    /// </summary>
+    [JsonPropertyName("generation")]
+    public long Generation { get; set; }
+
+    /// <summary>
+    /// Number of partitions items are hashed into, a power of two
+    /// </summary>
+    [JsonPropertyName("chunkCount")]
+    public int ChunkCount { get; set; }
+
+    [JsonPropertyName("dataKey")]
+    public byte[] DataKey { get; set; } = Array.Empty<byte>();
+
+    /// <summary>
+    /// Non-empty partitions in index order
+    /// </summary>
+    [JsonPropertyName("chunks")]
+    public List<CollectionChunkEntry> Chunks { get; set; } = new();
+
+    [JsonIgnore]
+    public int ItemCount => Chunks.Sum(c => c.Items);
+
+    public CollectionChunkEntry? Find(int index)
+    {
+        foreach (var chunk in Chunks)
+        {
+            if (chunk.Index == index)
+                return chunk;
+        }
+        return null;
+    }
+
+    /// <summary>
+    /// Parses a decrypted value as a manifest; returns null for values
+    /// written by SaveAsync, including collections saved before chunking
+    /// </summary>
+    public static CollectionManifest? TryParse(byte[] plaintext)
+    {
+        var start = 0;
+        while (start < plaintext.Length && char.IsWhiteSpace((char)plaintext[start]))
+            start++;
+
+        if (start == plaintext.Length || plaintext[start] != (byte)'{')
+            return null;
+
+        CollectionManifest? manifest;
+        try
+        {
+            manifest = JsonSerializer.Deserialize<CollectionManifest>(plaintext);
+        }
+        catch (JsonException)
+        {
+            return null;
+        }
+
+        if (manifest == null || manifest.Format != FormatName)
+            return null;
+
+        if (manifest.Version > CurrentVersion)
+            throw new NotSupportedException($"Collection format version {manifest.Version} is not supported");
+
+        if (manifest.DataKey.Length != CollectionChunk.KeySize ||
+            manifest.ChunkCount <= 0 || (manifest.ChunkCount & (manifest.ChunkCount - 1)) != 0)
+        {
+            throw new InvalidDataException("Invalid collection manifest");
+        }
+
+        return manifest;
+    }
+}
+
+internal sealed class CollectionChunkEntry
+{
+    [JsonPropertyName("index")]
+    public int Index { get; set; }
+
+    /// <summary>
+    /// Generation of the save that wrote this chunk
+    /// </summary>
+    [JsonPropertyName("generation")]
+    public long Generation { get; set; }
+
+    [JsonPropertyName("items")]
+    public int Items { get; set; }
+
+    /// <summary>
+    /// SHA-256 of the plaintext, compared on save to skip unchanged chunks
+    /// </summary>
+    [JsonPropertyName("hash")]
+    public byte[] Hash { get; set; } = Array.Empty<byte>();
+}
+
+/// <summary>
+/// One chunk of a collection on disk: a JSON array of items sealed with
+/// AES-256-GCM under the collection's data key. The associated data binds
+/// the chunk to its collection, partition and generation, so a chunk
+/// cannot be moved to another partition or rolled back to an older
+/// version without failing authentication.
+/// </summary>
+internal static class CollectionChunk
+{
+    public const int KeySize = 32;
+
+    private const int NonceSize = 12;
+    private const int TagSize = 16;
+
+    // Magic, nonce, tag, ciphertext
+    private static ReadOnlySpan<byte> Magic => "SHC1"u8;
+    private static int HeaderSize => Magic.Length + NonceSize + TagSize;
+
+    public static string GetFileName(CollectionChunkEntry entry)
+    {
+        return $"{entry.Index:x4}-{entry.Generation:x}.chunk";
+    }
+
+    /// <summary>
+    /// Partition of an item key, stable across processes and runs
+    /// </summary>
+    public static int Partition(string key, int chunkCount)
+    {
+        // FNV-1a, finished with the MurmurHash3 mixer so the low bits of
+        // sequential keys spread across partitions
+        var hash = 2166136261u;
+        foreach (var c in key)
+        {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35u;
+        hash ^= hash >> 16;
+
+        return (int)(hash & (uint)(chunkCount - 1));
+    }
+
+    public static byte[] Seal(byte[] dataKey, string collection, CollectionChunkEntry entry, byte[] plaintext)
+    {
+        var sealedChunk = new byte[HeaderSize + plaintext.Length];
+        var span = sealedChunk.AsSpan();
+
+        Magic.CopyTo(span);
+        var nonce = span.Slice(Magic.Length, NonceSize);
+        var tag = span.Slice(Magic.Length + NonceSize, TagSize);
+        RandomNumberGenerator.Fill(nonce);
+
+        using var aes = new AesGcm(dataKey, TagSize);
+        aes.Encrypt(nonce, plaintext, span[HeaderSize..], tag, GetAssociatedData(collection, entry));
+
+        return sealedChunk;
+    }
+
+    /// <summary>
+    /// Decrypts a chunk; throws <see cref="CryptographicException"/> if it
+    /// was modified or does not belong at this partition and generation
+    /// </summary>
+    public static byte[] Open(byte[] dataKey, string collection, CollectionChunkEntry entry, byte[] sealedChunk)
+    {
+        var span = sealedChunk.AsSpan();
+        if (span.Length < HeaderSize || !span[..Magic.Length].SequenceEqual(Magic))
+            throw new CryptographicException($"Invalid chunk {entry.Index} in collection {collection}");
+
+        var nonce = span.Slice(Magic.Length, NonceSize);
+        var tag = span.Slice(Magic.Length + NonceSize, TagSize);
+        var ciphertext = span[HeaderSize..];
+        var plaintext = new byte[ciphertext.Length];
+
+        using var aes = new AesGcm(dataKey, TagSize);
+        aes.Decrypt(nonce, ciphertext, tag, plaintext, GetAssociatedData(collection, entry));
+
+        return plaintext;
+    }
+
+    private static byte[] GetAssociatedData(string collection, CollectionChunkEntry entry)
+    {
+        return Encoding.UTF8.GetBytes($"{collection}\n{entry.Index}\n{entry.Generation}");
+    }
+}
@@ -1,3 +1,5 @@
+using System.Numerics;
+using System.Runtime.ExceptionServices;
 using System.Security.Cryptography;
 using System.Text;
 using System.Text.Json;
@@ -5,23 +7,51 @@ using Microsoft.Extensions.Logging;
 
 namespace SecureHostCore.Storage;
 
+/// <summary>
+/// Secure storage sizing
+/// </summary>
+public sealed class SecureStorageOptions
+{
+    /// <summary>
+    /// Target items per chunk of a collection
+    /// </summary>
+    public int CollectionChunkItems { get; set; } = 512;
+}
+
 /// <summary>
 /// Secure encrypted storage for sensitive configuration and policy data
 /// Uses DPAPI (Data Protection API) with machine-level encryption
 /// </summary>
+/// <remarks>
+/// Large keyed collections such as the policy rules are stored chunked
+/// (<see cref="SaveCollectionAsync{T}"/>): items are hashed by key into
+/// partitions, each sealed separately with AES-GCM, and a DPAPI-protected
+/// manifest lists the live chunks. Saves write only the chunks whose
+/// contents changed and then replace the manifest, so a store is always
+/// either the old or the new version. Decrypted chunks are cached until
+/// the manifest changes on disk.
+/// </remarks>
 public sealed class SecureStorage
 {
     private readonly ILogger<SecureStorage> _logger;
     private readonly string _storagePath;
+    private readonly SecureStorageOptions _options;
     private readonly byte[] _entropy;
     private readonly SemaphoreSlim _lockSemaphore;
 
-    public SecureStorage(ILogger<SecureStorage> logger, string storagePath)
+    // Guarded by _lockSemaphore
+    private readonly Dictionary<string, CollectionState> _collections = new(StringComparer.Ordinal);
+
+    public SecureStorage(ILogger<SecureStorage> logger, string storagePath, SecureStorageOptions? options = null)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _storagePath = storagePath ?? throw new ArgumentNullException(nameof(storagePath));
+        _options = options ?? new SecureStorageOptions();
         _lockSemaphore = new SemaphoreSlim(1, 1);
 
+        if (_options.CollectionChunkItems <= 0)
+            throw new ArgumentOutOfRangeException(nameof(options), "CollectionChunkItems must be positive");
+
         // Generate entropy from machine-specific data
         _entropy = GenerateEntropy();
 
@@ -48,25 +78,15 @@ public sealed class SecureStorage
             });
 
             var plaintext = Encoding.UTF8.GetBytes(json);
-
-            // Encrypt using DPAPI
-            var encrypted = System.Security.Cryptography.ProtectedData.Protect(
-                plaintext,
-                _entropy,
-                DataProtectionScope.LocalMachine);
-
-            // Generate HMAC for integrity verification
-            var hmac = ComputeHmac(encrypted);
-
-            // Combine HMAC + encrypted data
-            var combined = new byte[hmac.Length + encrypted.Length];
-            Buffer.BlockCopy(hmac, 0, combined, 0, hmac.Length);
-            Buffer.BlockCopy(encrypted, 0, combined, hmac.Length, encrypted.Length);
+            var combined = Protect(plaintext);
 
             // Write to file
             var filePath = GetFilePath(key);
             await File.WriteAllBytesAsync(filePath, combined);
 
+            // A single value replaces a collection of the same key
+            DeleteCollectionChunks(key);
+
             _logger.LogDebug("Saved encrypted data for key: {Key}", key);
         }
         catch (Exception ex)
@@ -96,34 +116,9 @@ public sealed class SecureStorage
             }
 
             var combined = await File.ReadAllBytesAsync(filePath);
-
-            // Extract HMAC and encrypted data
-            const int hmacSize = 32; // SHA256 size
-            if (combined.Length <= hmacSize)
-            {
-                _logger.LogWarning("Invalid secure storage file for key: {Key}", key);
+            var plaintext = Unprotect(combined, key);
+            if (plaintext == null)
                 return default;
-            }
-
-            var hmac = new byte[hmacSize];
-            var encrypted = new byte[combined.Length - hmacSize];
-
-            Buffer.BlockCopy(combined, 0, hmac, 0, hmacSize);
-            Buffer.BlockCopy(combined, hmacSize, encrypted, 0, encrypted.Length);
-
-            // Verify HMAC
-            var computedHmac = ComputeHmac(encrypted);
-            if (!hmac.SequenceEqual(computedHmac))
-            {
-                _logger.LogError("HMAC verification failed for key: {Key} - possible tampering detected", key);
-                throw new CryptographicException("Data integrity check failed");
-            }
-
-            // Decrypt using DPAPI
-            var plaintext = System.Security.Cryptography.ProtectedData.Unprotect(
-                encrypted,
-                _entropy,
-                DataProtectionScope.LocalMachine);
 
             var json = Encoding.UTF8.GetString(plaintext);
 
@@ -174,6 +169,8 @@ public sealed class SecureStorage
                 File.Delete(filePath);
                 _logger.LogInformation("Deleted secure data for key: {Key}", key);
             }
+
+            DeleteCollectionChunks(key);
         }
         catch (Exception ex)
         {
@@ -186,6 +183,172 @@ public sealed class SecureStorage
         }
     }
 
+    /// <summary>
+    /// Saves a collection as encrypted chunks of items partitioned by key.
+    /// Only chunks whose contents changed since the last save are written.
+    /// </summary>
+    public async Task SaveCollectionAsync<T>(string key, IReadOnlyCollection<T> items, Func<T, string> keySelector)
+    {
+        ArgumentNullException.ThrowIfNull(items);
+        ArgumentNullException.ThrowIfNull(keySelector);
+
+        await _lockSemaphore.WaitAsync();
+        try
+        {
+            var (state, _) = await ReadCollectionAsync(key);
+            var written = await SaveCollectionCoreAsync(key, state, items, keySelector);
+
+            _logger.LogDebug("Saved collection {Key}: {Count} items, {Chunks} chunks written",
+                key, items.Count, written);
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error saving secure collection for key: {Key}", key);
+            throw;
+        }
+        finally
+        {
+            _lockSemaphore.Release();
+        }
+    }
+
+    /// <summary>
+    /// Adds or replaces <paramref name="upserts"/> and removes the items
+    /// keyed <paramref name="removedKeys"/>, reading and writing only the
+    /// chunks they fall in. A key holding a single value is converted to
+    /// a collection.
+    /// </summary>
+    public async Task UpdateCollectionAsync<T>(
+        string key,
+        IEnumerable<T> upserts,
+        IEnumerable<string> removedKeys,
+        Func<T, string> keySelector)
+    {
+        ArgumentNullException.ThrowIfNull(upserts);
+        ArgumentNullException.ThrowIfNull(removedKeys);
+        ArgumentNullException.ThrowIfNull(keySelector);
+
+        await _lockSemaphore.WaitAsync();
+        try
+        {
+            var (state, legacy) = await ReadCollectionAsync(key);
+
+            if (state == null)
+            {
+                var items = legacy != null
+                    ? JsonSerializer.Deserialize<List<T>>(legacy) ?? new List<T>()
+                    : new List<T>();
+
+                await SaveCollectionCoreAsync(key, null, ApplyChanges(items, upserts, removedKeys, keySelector), keySelector);
+                return;
+            }
+
+            var chunkCount = state.Manifest.ChunkCount;
+            var upsertsByChunk = upserts.GroupBy(item => CollectionChunk.Partition(keySelector(item), chunkCount))
+                .ToDictionary(g => g.Key, g => g.ToList());
+            var removalsByChunk = removedKeys.GroupBy(k => CollectionChunk.Partition(k, chunkCount))
+                .ToDictionary(g => g.Key, g => g.ToList());
+
+            var updated = new Dictionary<int, SerializedChunk?>();
+            var itemCount = state.Manifest.ItemCount;
+
+            foreach (var index in upsertsByChunk.Keys.Union(removalsByChunk.Keys))
+            {
+                var items = ReadChunkItems<T>(key, state, index);
+                var previousCount = items.Count;
+
+                items = ApplyChanges(
+                    items,
+                    upsertsByChunk.GetValueOrDefault(index) ?? Enumerable.Empty<T>(),
+                    removalsByChunk.GetValueOrDefault(index) ?? Enumerable.Empty<string>(),
+                    keySelector);
+
+                itemCount += items.Count - previousCount;
+                updated[index] = SerializeChunk(items, keySelector);
+            }
+
+            if (ChooseChunkCount(itemCount, chunkCount) != chunkCount)
+            {
+                // Outgrew its partitioning, or shrank well below it
+                var all = new List<T>(itemCount);
+                for (var index = 0; index < chunkCount; index++)
+                {
+                    if (!updated.TryGetValue(index, out var chunk))
+                        all.AddRange(ReadChunkItems<T>(key, state, index));
+                    else if (chunk != null)
+                        all.AddRange(JsonSerializer.Deserialize<List<T>>(chunk.Plaintext)!);
+                }
+
+                await SaveCollectionCoreAsync(key, state, all, keySelector);
+            }
+            else
+            {
+                await CommitCollectionAsync(key, state, chunkCount, updated);
+            }
+
+            _logger.LogDebug("Updated collection {Key}: {Chunks} chunks changed", key, updated.Count);
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error updating secure collection for key: {Key}", key);
+            throw;
+        }
+        finally
+        {
+            _lockSemaphore.Release();
+        }
+    }
+
+    /// <summary>
+    /// Loads a collection saved by <see cref="SaveCollectionAsync{T}"/>, or a
+    /// list saved by <see cref="SaveAsync{T}"/>. Chunks not already cached
+    /// are decrypted in parallel. Items come back grouped by chunk, not in
+    /// the order they were saved.
+    /// </summary>
+    public async Task<List<T>?> LoadCollectionAsync<T>(string key)
+    {
+        await _lockSemaphore.WaitAsync();
+        try
+        {
+            var (state, legacy) = await ReadCollectionAsync(key);
+
+            if (state == null)
+            {
+                if (legacy == null)
+                    return default;
+
+                _logger.LogInformation("Key {Key} holds a single encrypted list; it is chunked on the next save", key);
+                return JsonSerializer.Deserialize<List<T>>(legacy);
+            }
+
+            var plaintexts = ReadChunks(key, state);
+            var parts = new List<T>[plaintexts.Length];
+            Parallel.For(0, plaintexts.Length, i => parts[i] = JsonSerializer.Deserialize<List<T>>(plaintexts[i])!);
+
+            var items = new List<T>(state.Manifest.ItemCount);
+            foreach (var part in parts)
+                items.AddRange(part);
+
+            _logger.LogDebug("Loaded collection {Key}: {Count} items in {Chunks} chunks",
+                key, items.Count, plaintexts.Length);
+            return items;
+        }
+        catch (CryptographicException)
+        {
+            _logger.LogError("Integrity check failed for collection: {Key} - possible tampering detected", key);
+            throw;
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error loading secure collection for key: {Key}", key);
+            return default;
+        }
+        finally
+        {
+            _lockSemaphore.Release();
+        }
+    }
+
     /// <summary>
     /// Checks if key exists
     /// </summary>
@@ -223,6 +386,382 @@ public sealed class SecureStorage
         return Path.Combine(directory, $"{sanitized}.dat");
     }
 
+    /// <summary>
+    /// Reads the manifest of a collection, from the cache while the file is
+    /// unchanged. A key holding a single value yields its plaintext instead.
+    /// </summary>
+    private async Task<(CollectionState? State, byte[]? Value)> ReadCollectionAsync(string key)
+    {
+        var file = new FileInfo(GetFilePath(key));
+        if (!file.Exists)
+        {
+            _collections.Remove(key);
+            return (null, null);
+        }
+
+        if (_collections.TryGetValue(key, out var cached) && cached.IsCurrent(file))
+            return (cached, null);
+
+        _collections.Remove(key);
+
+        var combined = await File.ReadAllBytesAsync(file.FullName);
+        var plaintext = Unprotect(combined, key);
+        if (plaintext == null)
+            return (null, null);
+
+        var manifest = CollectionManifest.TryParse(plaintext);
+        if (manifest == null)
+            return (null, plaintext);
+
+        var state = new CollectionState(manifest, file);
+        _collections[key] = state;
+        return (state, null);
+    }
+
+    /// <summary>
+    /// Partitions and serializes a whole collection and commits it; returns
+    /// the number of chunks written
+    /// </summary>
+    private async Task<int> SaveCollectionCoreAsync<T>(
+        string key, CollectionState? state, IReadOnlyCollection<T> items, Func<T, string> keySelector)
+    {
+        var chunkCount = ChooseChunkCount(items.Count, state?.Manifest.ChunkCount ?? 0);
+
+        var partitions = new List<T>?[chunkCount];
+        foreach (var item in items)
+        {
+            var index = CollectionChunk.Partition(keySelector(item), chunkCount);
+            (partitions[index] ??= new List<T>()).Add(item);
+        }
+
+        var chunks = new SerializedChunk?[chunkCount];
+        Parallel.For(0, chunkCount, i => chunks[i] = SerializeChunk(partitions[i], keySelector));
+
+        var updated = new Dictionary<int, SerializedChunk?>(chunkCount);
+        for (var i = 0; i < chunkCount; i++)
+            updated[i] = chunks[i];
+
+        return await CommitCollectionAsync(key, state, chunkCount, updated);
+    }
+
+    /// <summary>
+    /// Writes the chunks in <paramref name="updated"/> whose contents
+    /// changed, carries the other chunks over, then replaces the manifest.
+    /// Chunks are never overwritten in place: each is written under the new
+    /// generation, and files the new manifest no longer references are
+    /// deleted once it is in place. Returns the number of chunks written.
+    /// </summary>
+    private async Task<int> CommitCollectionAsync(
+        string key, CollectionState? state, int chunkCount, Dictionary<int, SerializedChunk?> updated)
+    {
+        var previous = state?.Manifest;
+        var sameLayout = previous != null && previous.ChunkCount == chunkCount;
+
+        var manifest = new CollectionManifest
+        {
+            Generation = (previous?.Generation ?? 0) + 1,
+            DataKey = previous?.DataKey ?? RandomNumberGenerator.GetBytes(CollectionChunk.KeySize),
+            ChunkCount = chunkCount
+        };
+
+        var plaintexts = new Dictionary<int, byte[]>();
+        var writes = new List<(CollectionChunkEntry Entry, byte[] Plaintext)>();
+
+        for (var index = 0; index < chunkCount; index++)
+        {
+            var existing = sameLayout ? previous!.Find(index) : null;
+
+            if (!updated.TryGetValue(index, out var chunk))
+            {
+                if (existing != null)
+                {
+                    manifest.Chunks.Add(existing);
+                    if (state!.Chunks.TryGetValue(index, out var cachedPlaintext))
+                        plaintexts[index] = cachedPlaintext;
+                }
+                continue;
+            }
+
+            if (chunk == null)
+                continue;
+
+            var hash = SHA256.HashData(chunk.Plaintext);
+            if (existing != null && hash.AsSpan().SequenceEqual(existing.Hash))
+            {
+                manifest.Chunks.Add(existing);
+                plaintexts[index] = chunk.Plaintext;
+                continue;
+            }
+
+            var entry = new CollectionChunkEntry
+            {
+                Index = index,
+                Generation = manifest.Generation,
+                Items = chunk.Items,
+                Hash = hash
+            };
+
+            manifest.Chunks.Add(entry);
+            plaintexts[index] = chunk.Plaintext;
+            writes.Add((entry, chunk.Plaintext));
+        }
+
+        var filePath = GetFilePath(key);
+        var directory = GetCollectionDirectory(key);
+
+        if (writes.Count == 0 && sameLayout && manifest.Chunks.Count == previous!.Chunks.Count)
+        {
+            // Nothing changed; keep the current generation
+            return 0;
+        }
+
+        if (writes.Count > 0)
+        {
+            Directory.CreateDirectory(directory);
+
+            var sealedChunks = new byte[writes.Count][];
+            Parallel.For(0, writes.Count, i =>
+                sealedChunks[i] = CollectionChunk.Seal(manifest.DataKey, key, writes[i].Entry, writes[i].Plaintext));
+
+            await Task.WhenAll(writes.Select((write, i) => WriteDurableAsync(
+                Path.Combine(directory, CollectionChunk.GetFileName(write.Entry)), sealedChunks[i])));
+        }
+
+        // The manifest is the commit point: until it is replaced, loads see
+        // the previous generation and the new chunks are unreferenced
+        var tempPath = Path.ChangeExtension(filePath, ".tmp");
+        await WriteDurableAsync(tempPath, Protect(JsonSerializer.SerializeToUtf8Bytes(manifest)));
+        File.Move(tempPath, filePath, overwrite: true);
+
+        var committed = new CollectionState(manifest, new FileInfo(filePath));
+        foreach (var (index, plaintext) in plaintexts)
+            committed.Chunks[index] = plaintext;
+        _collections[key] = committed;
+
+        DeleteUnreferencedChunks(key, manifest);
+        return writes.Count;
+    }
+
+    /// <summary>
+    /// Deletes chunk files superseded by <paramref name="manifest"/>, and
+    /// any left by a save that failed before its manifest was written
+    /// </summary>
+    private void DeleteUnreferencedChunks(string key, CollectionManifest manifest)
+    {
+        var directory = GetCollectionDirectory(key);
+        if (!Directory.Exists(directory))
+            return;
+
+        var live = manifest.Chunks.Select(CollectionChunk.GetFileName).ToHashSet(StringComparer.OrdinalIgnoreCase);
+
+        foreach (var path in Directory.EnumerateFiles(directory, "*.chunk"))
+        {
+            if (live.Contains(Path.GetFileName(path)))
+                continue;
+
+            try
+            {
+                File.Delete(path);
+            }
+            catch (IOException ex)
+            {
+                _logger.LogWarning(ex, "Could not delete stale chunk {Path}", path);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Removes the chunks of a collection. They are deleted without
+    /// overwriting: their key is only in the manifest, which the caller has
+    /// already replaced or securely deleted.
+    /// </summary>
+    private void DeleteCollectionChunks(string key)
+    {
+        _collections.Remove(key);
+
+        var directory = GetCollectionDirectory(key);
+        if (Directory.Exists(directory))
+            Directory.Delete(directory, recursive: true);
+    }
+
+    /// <summary>
+    /// Decrypted plaintext of every chunk in manifest order, decrypting the
+    /// ones not cached in parallel
+    /// </summary>
+    private byte[][] ReadChunks(string key, CollectionState state)
+    {
+        var entries = state.Manifest.Chunks;
+        var plaintexts = new byte[entries.Count][];
+        var missing = new List<int>();
+
+        for (var i = 0; i < entries.Count; i++)
+        {
+            if (state.Chunks.TryGetValue(entries[i].Index, out var cached))
+                plaintexts[i] = cached;
+            else
+                missing.Add(i);
+        }
+
+        try
+        {
+            Parallel.ForEach(missing, i => plaintexts[i] = ReadChunk(key, state.Manifest, entries[i]));
+        }
+        catch (AggregateException ex)
+        {
+            // Surface a failed integrity check as the CryptographicException itself
+            ExceptionDispatchInfo.Capture(ex.InnerExceptions[0]).Throw();
+        }
+
+        foreach (var i in missing)
+            state.Chunks[entries[i].Index] = plaintexts[i];
+
+        return plaintexts;
+    }
+
+    private List<T> ReadChunkItems<T>(string key, CollectionState state, int index)
+    {
+        var entry = state.Manifest.Find(index);
+        if (entry == null)
+            return new List<T>();
+
+        if (!state.Chunks.TryGetValue(index, out var plaintext))
+        {
+            plaintext = ReadChunk(key, state.Manifest, entry);
+            state.Chunks[index] = plaintext;
+        }
+
+        return JsonSerializer.Deserialize<List<T>>(plaintext)!;
+    }
+
+    private byte[] ReadChunk(string key, CollectionManifest manifest, CollectionChunkEntry entry)
+    {
+        var path = Path.Combine(GetCollectionDirectory(key), CollectionChunk.GetFileName(entry));
+        if (!File.Exists(path))
+            throw new CryptographicException($"Chunk {entry.Index} of collection {key} is missing");
+
+        return CollectionChunk.Open(manifest.DataKey, key, entry, File.ReadAllBytes(path));
+    }
+
+    /// <summary>
+    /// Power-of-two partition count for <paramref name="itemCount"/> items,
+    /// keeping <paramref name="current"/> while chunks stay between a
+    /// quarter and twice the target size so saves rarely repartition
+    /// </summary>
+    private int ChooseChunkCount(int itemCount, int current)
+    {
+        var chunkItems = _options.CollectionChunkItems;
+
+        if (current > 0 &&
+            (long)itemCount <= (long)current * chunkItems * 2 &&
+            (current == 1 || (long)itemCount * 4 > (long)current * chunkItems))
+        {
+            return current;
+        }
+
+        var needed = (int)Math.Min((itemCount + (long)chunkItems - 1) / chunkItems, 1 << 16);
+        return (int)BitOperations.RoundUpToPowerOf2((uint)Math.Max(needed, 1));
+    }
+
+    /// <summary>
+    /// Serializes a chunk's items in key order, so equal contents always
+    /// produce the same plaintext; null when the chunk is empty
+    /// </summary>
+    private static SerializedChunk? SerializeChunk<T>(List<T>? items, Func<T, string> keySelector)
+    {
+        if (items == null || items.Count == 0)
+            return null;
+
+        items.Sort((a, b) => string.CompareOrdinal(keySelector(a), keySelector(b)));
+        return new SerializedChunk(JsonSerializer.SerializeToUtf8Bytes(items), items.Count);
+    }
+
+    private static List<T> ApplyChanges<T>(
+        List<T> items, IEnumerable<T> upserts, IEnumerable<string> removedKeys, Func<T, string> keySelector)
+    {
+        var byKey = new Dictionary<string, T>(StringComparer.Ordinal);
+        foreach (var item in items)
+            byKey[keySelector(item)] = item;
+
+        foreach (var removed in removedKeys)
+            byKey.Remove(removed);
+
+        foreach (var item in upserts)
+            byKey[keySelector(item)] = item;
+
+        return byKey.Values.ToList();
+    }
+
+    private static async Task WriteDurableAsync(string path, byte[] data)
+    {
+        await using var fs = new FileStream(
+            path, FileMode.Create, FileAccess.Write, FileShare.None, 4096, FileOptions.Asynchronous);
+        await fs.WriteAsync(data);
+        fs.Flush(flushToDisk: true);
+    }
+
+    /// <summary>
+    /// Gets the chunk directory for a collection key
+    /// </summary>
+    private string GetCollectionDirectory(string key)
+    {
+        return Path.ChangeExtension(GetFilePath(key), ".chunks");
+    }
+
+    /// <summary>
+    /// Encrypts with DPAPI and prefixes the HMAC
+    /// </summary>
+    private byte[] Protect(byte[] plaintext)
+    {
+        // Encrypt using DPAPI
+        var encrypted = System.Security.Cryptography.ProtectedData.Protect(
+            plaintext,
+            _entropy,
+            DataProtectionScope.LocalMachine);
+
+        // Generate HMAC for integrity verification
+        var hmac = ComputeHmac(encrypted);
+
+        // Combine HMAC + encrypted data
+        var combined = new byte[hmac.Length + encrypted.Length];
+        Buffer.BlockCopy(hmac, 0, combined, 0, hmac.Length);
+        Buffer.BlockCopy(encrypted, 0, combined, hmac.Length, encrypted.Length);
+        return combined;
+    }
+
+    /// <summary>
+    /// Verifies the HMAC and decrypts; null if the file is too short to be valid
+    /// </summary>
+    private byte[]? Unprotect(byte[] combined, string key)
+    {
+        // Extract HMAC and encrypted data
+        const int hmacSize = 32; // SHA256 size
+        if (combined.Length <= hmacSize)
+        {
+            _logger.LogWarning("Invalid secure storage file for key: {Key}", key);
+            return null;
+        }
+
+        var hmac = new byte[hmacSize];
+        var encrypted = new byte[combined.Length - hmacSize];
+
+        Buffer.BlockCopy(combined, 0, hmac, 0, hmacSize);
+        Buffer.BlockCopy(combined, hmacSize, encrypted, 0, encrypted.Length);
+
+        // Verify HMAC
+        var computedHmac = ComputeHmac(encrypted);
+        if (!hmac.SequenceEqual(computedHmac))
+        {
+            _logger.LogError("HMAC verification failed for key: {Key} - possible tampering detected", key);
+            throw new CryptographicException("Data integrity check failed");
+        }
+
+        // Decrypt using DPAPI
+        return System.Security.Cryptography.ProtectedData.Unprotect(
+            encrypted,
+            _entropy,
+            DataProtectionScope.LocalMachine);
+    }
+
     /// <summary>
     /// Generates entropy from machine-specific data
     /// </summary>
@@ -244,4 +783,35 @@ public sealed class SecureStorage
         using var hmac = new HMACSHA256(_entropy);
         return hmac.ComputeHash(data);
     }
+
+    private sealed record SerializedChunk(byte[] Plaintext, int Items);
+
+    /// <summary>
+    /// Cached manifest and decrypted chunks of a collection, valid while the
+    /// manifest file is unchanged
+    /// </summary>
+    private sealed class CollectionState
+    {
+        private readonly DateTime _lastWriteTimeUtc;
+        private readonly long _length;
+
+        public CollectionState(CollectionManifest manifest, FileInfo file)
+        {
+            Manifest = manifest;
+            _lastWriteTimeUtc = file.LastWriteTimeUtc;
+            _length = file.Length;
+        }
+
+        public CollectionManifest Manifest { get; }
+
+        /// <summary>
+        /// Decrypted chunk plaintext by partition index
+        /// </summary>
+        public Dictionary<int, byte[]> Chunks { get; } = new();
+
+        public bool IsCurrent(FileInfo file)
+        {
+            return file.LastWriteTimeUtc == _lastWriteTimeUtc && file.Length == _length;
+        }
+    }
 }
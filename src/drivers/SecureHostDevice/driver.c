@@ -12,12 +12,16 @@ Environment:
 
 --*/
 
-#include <ntddk.h>
+#include <ntifs.h>
 #include <wdf.h>
 #include <initguid.h>
 #include <devpkey.h>
 #include <ntstrsafe.h>
 
+#include "SecureHostMatch.h"
+#include "SecureHostWire.h"
+#include "SecureHostProcess.h"
+
 #pragma warning(push)
 #pragma warning(disable:4201)
 
@@ -26,6 +30,109 @@ Environment:
 //
 #define SECUREHOST_DEVICE_TAG 'VDHS'  // 'SHDV' reversed
 
+//
+// IOCTL definitions
+//
+#define IOCTL_SECUREHOST_CHECK_ACCESS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Adds, replaces and removes policies in one call. The batch travels in
+// the direct (output) buffer: a SECUREHOST_RULESET_HEADER followed by
+// RuleCount SECUREHOST_DEVICE_RULE_RECORDs and their process names (see
+// SecureHostWire.h). Same function code and header as the WFP driver's
+// ruleset load. Callers must hold SeTcbPrivilege.
+//
+#define IOCTL_SECUREHOST_APPLY_DEVICE_RULES \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+//
+// Returns aggregated driver counters (SECUREHOST_STATISTICS). Same code
+// and layout as the WFP driver's statistics query.
+//
+#define IOCTL_SECUREHOST_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Statistics
+//
+// Counters are kept per processor, one cache-line-aligned block each, and
+// only updated at DISPATCH_LEVEL by the owning processor. Lookup latency
+// is sampled and bucketed by log2 of performance counter ticks; verdict
+// latency, from the access check request to its verdict, is kept the
+// same way for every check. DecisionLatency is unused by this driver.
+//
+// Version 2 appends VerdictLatency and DecisionLatency.
+//
+#define SECUREHOST_STATISTICS_VERSION   2u
+#define SECUREHOST_LATENCY_BUCKETS      16u
+#define SECUREHOST_LATENCY_SAMPLE_RATE  16u     // Power of two
+
+C_ASSERT((SECUREHOST_LATENCY_SAMPLE_RATE & (SECUREHOST_LATENCY_SAMPLE_RATE - 1)) == 0);
+
+typedef struct _SECUREHOST_COUNTERS {
+    UINT64 Classifications;         // Access checks
+    UINT64 Permits;
+    UINT64 Blocks;
+    UINT64 CacheHits;
+    UINT64 RuleLookups;             // Policy list walks
+    UINT64 EventsDropped;
+    UINT64 LockContentions;         // Unused by this driver
+    UINT64 LookupLatency[SECUREHOST_LATENCY_BUCKETS];
+    UINT64 VerdictLatency[SECUREHOST_LATENCY_BUCKETS];
+    UINT64 DecisionLatency[SECUREHOST_LATENCY_BUCKETS];
+} SECUREHOST_COUNTERS, *PSECUREHOST_COUNTERS;
+
+typedef struct DECLSPEC_CACHEALIGN _SECUREHOST_CPU_COUNTERS {
+    SECUREHOST_COUNTERS Counters;
+    UINT64 TraceSequence;           // Last correlation ID sequence issued here
+} SECUREHOST_CPU_COUNTERS, *PSECUREHOST_CPU_COUNTERS;
+
+C_ASSERT(sizeof(SECUREHOST_CPU_COUNTERS) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+
+typedef struct _SECUREHOST_STATISTICS {
+    UINT32 Version;
+    UINT32 ProcessorCount;
+    UINT64 PerformanceFrequency;    // Ticks per second for LookupLatency
+    UINT64 RuleTableGeneration;     // Policy snapshot generation
+    UINT32 RuleCount;               // Policies loaded
+    UINT32 Reserved;
+    SECUREHOST_COUNTERS Totals;
+} SECUREHOST_STATISTICS, *PSECUREHOST_STATISTICS;
+
+C_ASSERT(sizeof(SECUREHOST_STATISTICS) == 472);
+
+//
+// Times the policy scan with a synthetic workload. Same code and layout
+// as the WFP driver's benchmark; each batch scans one policy snapshot.
+//
+#define IOCTL_SECUREHOST_RUN_BENCHMARK \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define SECUREHOST_BENCHMARK_VERSION        1u
+#define SECUREHOST_BENCHMARK_BATCH          64u     // Operations per timed batch
+#define SECUREHOST_BENCHMARK_MAX_BATCHES    16384u
+
+typedef struct _SECUREHOST_BENCHMARK_INPUT {
+    UINT32 Version;
+    UINT32 Batches;
+    UINT32 Seed;                    // 0 picks one
+    UINT32 HitPercent;              // Inputs derived from loaded policy, 0-100
+} SECUREHOST_BENCHMARK_INPUT, *PSECUREHOST_BENCHMARK_INPUT;
+
+typedef struct _SECUREHOST_BENCHMARK_RESULT {
+    UINT32 Version;
+    UINT32 Batches;
+    UINT32 OperationsPerBatch;
+    UINT32 RuleCount;               // Policies scanned
+    UINT64 PerformanceFrequency;
+    UINT64 TotalTicks;
+    UINT64 Matches;                 // Checks that granted access
+    UINT64 BatchLatency[SECUREHOST_LATENCY_BUCKETS];
+} SECUREHOST_BENCHMARK_RESULT, *PSECUREHOST_BENCHMARK_RESULT;
+
+C_ASSERT(sizeof(SECUREHOST_BENCHMARK_RESULT) == 168);
+
 //
 // Device types we monitor
 //
@@ -37,23 +144,253 @@ typedef enum _SECUREHOST_DEVICE_TYPE {
     DeviceTypeUnknown = 0
 } SECUREHOST_DEVICE_TYPE;
 
+#define SECUREHOST_DEVICE_TYPE_COUNT 5u
+
 //
-// Device policy structure
+// Device classification
 //
-typedef struct _SECUREHOST_DEVICE_POLICY {
+// A device's type is resolved once in SecureHostDeviceAdd and kept in its
+// context, so access checks only read a field. The setup class decides
+// unless it is unknown or plain USB; then the hardware and compatible IDs
+// are matched against bus and USB interface-class prefixes (a composite
+// webcam reports USB\Class_0E, for example), and the first match more
+// specific than plain USB wins. Both tables are sorted and searched by
+// bisection; keep them in order when adding entries.
+//
+#define SECUREHOST_DEVICE_ID_CHARS  512u    // Per ID list on the stack; longer lists go to pool
+#define SECUREHOST_DEVICE_ID_MAX_BYTES  (32u * 1024u)   // Longest list matched at all
+
+typedef struct _SECUREHOST_CLASS_TYPE {
+    GUID ClassGuid;
     SECUREHOST_DEVICE_TYPE DeviceType;
+} SECUREHOST_CLASS_TYPE;
+
+typedef struct _SECUREHOST_ID_PREFIX_TYPE {
+    PCWSTR Prefix;                  // Upper case
+    USHORT Length;                  // In characters
+    SECUREHOST_DEVICE_TYPE DeviceType;
+} SECUREHOST_ID_PREFIX_TYPE;
+
+#define SECUREHOST_ID_PREFIX(p, t) { L##p, (USHORT)(sizeof(L##p) / sizeof(WCHAR) - 1), (t) }
+
+//
+// Ordered by SecureHostCompareGuid
+//
+static const SECUREHOST_CLASS_TYPE SecureHostClassTypes[] = {
+    // GUID_DEVCLASS_USB
+    { { 0x36fc9e60, 0xc465, 0x11cf, { 0x80, 0x56, 0x44, 0x45, 0x53, 0x54, 0x00, 0x00 } }, DeviceTypeUSB },
+    // GUID_DEVCLASS_MEDIA
+    { { 0x4d36e96c, 0xe325, 0x11ce, { 0xbf, 0xc1, 0x08, 0x00, 0x2b, 0xe1, 0x03, 0x18 } }, DeviceTypeMicrophone },
+    // GUID_DEVCLASS_IMAGE
+    { { 0x6bdd1fc6, 0x810f, 0x11d0, { 0xbe, 0xc7, 0x08, 0x00, 0x2b, 0xe2, 0x09, 0x2f } }, DeviceTypeCamera },
+    // GUID_DEVCLASS_USBDEVICE
+    { { 0x88bae032, 0x5a81, 0x49f0, { 0xbc, 0x3d, 0xa4, 0xff, 0x13, 0x82, 0x16, 0xd6 } }, DeviceTypeUSB },
+    // GUID_DEVCLASS_CAMERA
+    { { 0xca3e7ab9, 0xb4c3, 0x4ae6, { 0x82, 0x51, 0x57, 0x9e, 0xf9, 0x33, 0x89, 0x0f } }, DeviceTypeCamera },
+    // GUID_DEVCLASS_BLUETOOTH
+    { { 0xe0cbf06c, 0xcd8b, 0x4647, { 0xbb, 0x8a, 0x26, 0x3b, 0x43, 0xf0, 0xf9, 0x74 } }, DeviceTypeBluetooth },
+};
+
+//
+// Ordered by code unit
+//
+static const SECUREHOST_ID_PREFIX_TYPE SecureHostIdPrefixTypes[] = {
+    SECUREHOST_ID_PREFIX("BTHENUM\\", DeviceTypeBluetooth),
+    SECUREHOST_ID_PREFIX("BTHLEDEVICE\\", DeviceTypeBluetooth),
+    SECUREHOST_ID_PREFIX("BTHLE\\", DeviceTypeBluetooth),
+    SECUREHOST_ID_PREFIX("USB\\", DeviceTypeUSB),
+    SECUREHOST_ID_PREFIX("USB\\CLASS_01&SUBCLASS_01", DeviceTypeMicrophone),        // Audio control
+    SECUREHOST_ID_PREFIX("USB\\CLASS_0E", DeviceTypeCamera),                        // Video
+    SECUREHOST_ID_PREFIX("USB\\CLASS_E0&SUBCLASS_01&PROT_01", DeviceTypeBluetooth), // Bluetooth radio
+};
+
+//
+// Access events
+//
+// Every access check is recorded in its device's backlog, with the
+// caller's process ID and creation time for the service to resolve
+// through IOCTL_SECUREHOST_QUERY_PROCESSES. The service
+// keeps several IOCTL_SECUREHOST_GET_DEVICE_EVENTS requests parked in the
+// device's manual EventQueue; recording an event completes the oldest
+// one with everything buffered so far, so a busy device delivers in
+// batches and an idle one costs nothing. With no request parked, events
+// wait for the next fetch; once the backlog is full they are dropped and
+// counted in EventsDropped. Callers must hold SeTcbPrivilege.
+//
+// A process retrying a blocked device would otherwise fill the backlog
+// with identical records. The first check of each (process, verdict) key
+// in a window is recorded as it happens; repeats only bump the key's
+// entry in the device's repeat table, and when the window closes each key
+// that repeated is recorded once with its count and first/last times. A
+// device timer closes the window if no further check arrives. Keys that
+// find the table full are recorded individually.
+//
+// Each check is traced (see SecureHostWire.h): a record carries the
+// correlation ID of the check, the performance counter when the request
+// arrived and the ticks to its verdict. A record of repeats carries the
+// trace of the first repeat.
+//
+#define IOCTL_SECUREHOST_GET_DEVICE_EVENTS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Process metadata query (SecureHostWire.h), same code as the WFP
+// driver's. Callers must hold SeTcbPrivilege.
+//
+#define IOCTL_SECUREHOST_QUERY_PROCESSES \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define SECUREHOST_DEVICE_EVENT_BACKLOG 256u    // Per device, power of two
+#define SECUREHOST_DEVICE_REPEAT_ENTRIES 16u    // Per device
+#define SECUREHOST_DEVICE_REPEAT_WINDOW_MS 1000u
+
+C_ASSERT((SECUREHOST_DEVICE_EVENT_BACKLOG & (SECUREHOST_DEVICE_EVENT_BACKLOG - 1)) == 0);
+
+typedef struct _SECUREHOST_DEVICE_EVENT {
+    UINT64 Timestamp;               // System time (FILETIME); first check covered
+    UINT32 ProcessId;
+    UINT8 DeviceType;               // SECUREHOST_DEVICE_TYPE
+    UINT8 Verdict;                  // SECUREHOST_DEVICE_ACTION_ALLOW or _BLOCK
+    UINT16 Reserved;
+    UINT32 Count;                   // Checks covered by this record
+    UINT32 Reserved2;
+    UINT64 LastTimestamp;           // Last check covered
+    UINT64 ProcessCreateTime;       // With ProcessId, the process cache key
+    UINT64 CorrelationId;
+    UINT64 CheckTime;               // Performance counter when the check arrived
+    UINT32 VerdictTicks;            // CheckTime to verdict, saturating
+    UINT32 Reserved3;
+} SECUREHOST_DEVICE_EVENT, *PSECUREHOST_DEVICE_EVENT;
+
+C_ASSERT(sizeof(SECUREHOST_DEVICE_EVENT) == 64);
+
+//
+// Trace of one access check, kept with its event record
+//
+typedef struct _SECUREHOST_DEVICE_TRACE {
+    UINT64 CorrelationId;
+    UINT64 CheckTime;
+    UINT32 VerdictTicks;
+} SECUREHOST_DEVICE_TRACE, *PSECUREHOST_DEVICE_TRACE;
+
+typedef struct _SECUREHOST_DEVICE_REPEAT {
+    UINT64 ProcessCreateTime;
     UINT32 ProcessId;
-    BOOLEAN Allowed;
-    WCHAR ProcessName[256];
-} SECUREHOST_DEVICE_POLICY, *PSECUREHOST_DEVICE_POLICY;
+    UINT8 Verdict;
+    BOOLEAN InUse;
+    UINT16 Reserved;
+    UINT32 Repeats;                 // Checks since the recorded one
+    UINT64 FirstRepeat;
+    UINT64 LastRepeat;
+    SECUREHOST_DEVICE_TRACE FirstTrace;
+} SECUREHOST_DEVICE_REPEAT, *PSECUREHOST_DEVICE_REPEAT;
+
+//
+// Decision cache
+//
+// Recent verdicts per device type, direct-mapped by process ID. A slot is
+// one 64-bit word so it can be read and written without a lock:
+//
+//   [63:32] ProcessId   [31:1] policy generation   [0] allowed
+//
+// Each device type has its own policy generation. Every policy change
+// queues the verdicts it can affect (see SecureHostQueueInvalidationLocked)
+// and they are dropped once the new snapshot is published and the old
+// one has no readers left: a policy scoped to one process clears only
+// that process's slot, and a policy for any process bumps its device
+// type's generation. Slots of an exiting process are cleared so a reused
+// PID cannot inherit them.
+//
+#define SECUREHOST_DECISION_CACHE_SHIFT     6u
+#define SECUREHOST_DECISION_CACHE_SIZE      (1u << SECUREHOST_DECISION_CACHE_SHIFT)
+#define SECUREHOST_DECISION_GENERATION_MASK 0x7FFFFFFFu
+#define SECUREHOST_MAX_PENDING_INVALIDATIONS 64u
+
+//
+// Device rule actions (SECUREHOST_DEVICE_RULE_RECORD in SecureHostWire.h).
+// Actions match PolicyAction; anything but Block grants access.
+//
+#define SECUREHOST_DEVICE_ACTION_ALLOW  SECUREHOST_RULE_ACTION_ALLOW
+#define SECUREHOST_DEVICE_ACTION_BLOCK  SECUREHOST_RULE_ACTION_BLOCK
+#define SECUREHOST_DEVICE_ACTION_AUDIT  SECUREHOST_RULE_ACTION_AUDIT
+
+#define SECUREHOST_MAX_PROCESS_NAME_CHARS   256u
+#define SECUREHOST_MAX_DEVICE_RULE_BATCH    65536u
+
+//
+// Policy store
+//
+// Access checks scan an immutable snapshot of the match keys: a dense
+// NonPagedPool array, eight policies to a cache line, published by
+// pointer and read at DISPATCH_LEVEL without a lock. Writers edit working
+// copies (match keys, and rule ID and process name in a parallel array)
+// in PagedPool, serialized by PolicyUpdateLock at PASSIVE_LEVEL, and
+// publish a new snapshot once per rule batch. A retired snapshot is freed
+// after a grace period (see SecureHostWaitForPolicyReaders).
+//
+// Process names are interned: one copy per distinct name, carved from
+// page-sized arena chunks that are released at unload. Unreferenced
+// names stay interned for reuse.
+//
+#define SECUREHOST_MIN_POLICY_CAPACITY  16u
+#define SECUREHOST_MAX_DEVICE_POLICIES  65536u
+#define SECUREHOST_NAME_HASH_BUCKETS    64u     // Power of two
+#define SECUREHOST_NAME_ARENA_CHUNK     PAGE_SIZE
+
+C_ASSERT((SECUREHOST_NAME_HASH_BUCKETS & (SECUREHOST_NAME_HASH_BUCKETS - 1)) == 0);
+
+typedef struct _SECUREHOST_POLICY_NAME {
+    struct _SECUREHOST_POLICY_NAME* Next;   // Intern hash chain
+    ULONG Hash;
+    ULONG References;
+    USHORT Length;                          // In bytes
+    WCHAR Buffer[ANYSIZE_ARRAY];
+} SECUREHOST_POLICY_NAME, *PSECUREHOST_POLICY_NAME;
+
+typedef struct _SECUREHOST_DEVICE_POLICY_INFO {
+    UINT64 RuleId;
+    PSECUREHOST_POLICY_NAME ProcessName;    // NULL if the rule names none
+} SECUREHOST_DEVICE_POLICY_INFO, *PSECUREHOST_DEVICE_POLICY_INFO;
+
+typedef struct _SECUREHOST_NAME_CHUNK {
+    struct _SECUREHOST_NAME_CHUNK* Next;
+    SIZE_T Used;                            // Bytes, including this header
+} SECUREHOST_NAME_CHUNK, *PSECUREHOST_NAME_CHUNK;
+
+typedef struct _SECUREHOST_POLICY_SNAPSHOT {
+    UINT64 Generation;                      // Bumped by every publish
+    ULONG Count;
+    ULONG Reserved;
+    SECUREHOST_DEVICE_POLICY Policies[ANYSIZE_ARRAY];
+} SECUREHOST_POLICY_SNAPSHOT, *PSECUREHOST_POLICY_SNAPSHOT;
+
+C_ASSERT(sizeof(SECUREHOST_NAME_CHUNK) +
+         FIELD_OFFSET(SECUREHOST_POLICY_NAME, Buffer) +
+         SECUREHOST_MAX_PROCESS_NAME_CHARS * sizeof(WCHAR) <= SECUREHOST_NAME_ARENA_CHUNK);
 
 //
 // Device extension
 //
 typedef struct _DEVICE_CONTEXT {
     WDFDEVICE Device;
-    WDFQUEUE Queue;
+    WDFQUEUE Queue;                 // Parallel: checks and queries
+    WDFQUEUE UpdateQueue;           // Sequential: policy changes
     SECUREHOST_DEVICE_TYPE DeviceType;
+
+    //
+    // Access event backlog and repeat table, guarded by EventLock.
+    // EventQueue holds the parked fetch requests; EventTimer closes the
+    // repeat window.
+    //
+    WDFQUEUE EventQueue;
+    WDFTIMER EventTimer;
+    KSPIN_LOCK EventLock;
+    ULONG EventHead;
+    ULONG EventCount;
+    UINT64 RepeatWindowEnd;         // System time; 0 = no window open
+    BOOLEAN RepeatTimerArmed;
+    SECUREHOST_DEVICE_EVENT Events[SECUREHOST_DEVICE_EVENT_BACKLOG];
+    SECUREHOST_DEVICE_REPEAT Repeats[SECUREHOST_DEVICE_REPEAT_ENTRIES];
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
@@ -63,12 +400,71 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
 //
 typedef struct _DRIVER_CONTEXT {
     WDFDRIVER Driver;
-    KSPIN_LOCK PolicyLock;
-    LIST_ENTRY PolicyList;
+    //
+    // Published match keys, read by access checks at DISPATCH_LEVEL
+    //
+    PSECUREHOST_POLICY_SNAPSHOT volatile ActivePolicies;
+
+    //
+    // Writer-only state, guarded by PolicyUpdateLock
+    //
+    FAST_MUTEX PolicyUpdateLock;
+    PSECUREHOST_DEVICE_POLICY Policies;
+    PSECUREHOST_DEVICE_POLICY_INFO PolicyInfo;
+    ULONG PolicyCount;
+    ULONG PolicyCapacity;
+    UINT64 PolicySnapshotGeneration;
+    PSECUREHOST_POLICY_NAME NameBuckets[SECUREHOST_NAME_HASH_BUCKETS];
+    PSECUREHOST_NAME_CHUNK NameChunks;
+
+    //
+    // Verdicts made stale by changes not yet published: whole device
+    // types (bit per type), then single process slots
+    //
+    ULONG StaleDeviceTypes;
+    ULONG StalePolicyCount;
+    SECUREHOST_DEVICE_POLICY StalePolicies[SECUREHOST_MAX_PENDING_INVALIDATIONS];
+
+    //
+    // Grace period DPCs for retiring snapshots, one per possible
+    // processor, guarded by PolicyUpdateLock
+    //
+    PKDPC GracePeriodDpcs;
+    ULONG GracePeriodDpcCount;
+
+    //
+    // Verdict cache, valid only while exits are being observed
+    //
+    volatile LONG PolicyGeneration[SECUREHOST_DEVICE_TYPE_COUNT];
+    BOOLEAN DecisionCacheEnabled;
+    volatile LONG64 DecisionCache[SECUREHOST_DEVICE_TYPE_COUNT][SECUREHOST_DECISION_CACHE_SIZE];
+
+    //
+    // Per-processor counters, indexed by processor number
+    //
+    PSECUREHOST_CPU_COUNTERS CpuCounters;
+    ULONG CpuCounterCount;
+
+    //
+    // Process metadata cache, filled by SecureHostProcessNotify while
+    // ProcessNotifyRegistered is set
+    //
+    SECUREHOST_PROCESS_CACHE ProcessCache;
+    BOOLEAN ProcessNotifyRegistered;
 } DRIVER_CONTEXT, *PDRIVER_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DRIVER_CONTEXT, DriverGetContext)
 
+C_ASSERT(SECUREHOST_DEVICE_TYPE_COUNT <= 32);
+
+//
+// Grace period tracking for retired policy snapshots
+//
+typedef struct _SECUREHOST_GRACE_PERIOD {
+    KEVENT Done;
+    volatile LONG Pending;
+} SECUREHOST_GRACE_PERIOD, *PSECUREHOST_GRACE_PERIOD;
+
 //
 // Function declarations
 //
@@ -76,19 +472,203 @@ DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD SecureHostDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP SecureHostDriverCleanup;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL SecureHostIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL SecureHostIoPolicyUpdate;
+EVT_WDF_TIMER SecureHostDeviceEventTimer;
+KDEFERRED_ROUTINE SecureHostGracePeriodDpc;
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SecureHostProcessNotify(
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+);
 
 NTSTATUS
 SecureHostCheckDeviceAccess(
     _In_ PDRIVER_CONTEXT Context,
     _In_ SECUREHOST_DEVICE_TYPE DeviceType,
-    _In_ UINT32 ProcessId
+    _In_ UINT32 ProcessId,
+    _Inout_ PSECUREHOST_DEVICE_TRACE Trace
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostRunBenchmark(
+    _In_ PDRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_BENCHMARK_INPUT* Input,
+    _Out_ PSECUREHOST_BENCHMARK_RESULT Result
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostApplyDeviceRules(
+    _In_ PDRIVER_CONTEXT Context,
+    _In_reads_bytes_(BufferLength) const VOID* Buffer,
+    _In_ SIZE_T BufferLength
+);
+
+_IRQL_requires_(APC_LEVEL)
+_Requires_lock_held_(Context->PolicyUpdateLock)
+NTSTATUS
+SecureHostAddDevicePolicyLocked(
+    _Inout_ PDRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_DEVICE_RULE_RECORD* Rule,
+    _In_reads_bytes_opt_(NameLength) PCWCH Name,
+    _In_ USHORT NameLength
+);
+
+_IRQL_requires_(APC_LEVEL)
+_Requires_lock_held_(Context->PolicyUpdateLock)
+NTSTATUS
+SecureHostRemoveDevicePolicyLocked(
+    _Inout_ PDRIVER_CONTEXT Context,
+    _In_ UINT64 RuleId
+);
+
+_Requires_lock_held_(Context->PolicyUpdateLock)
+VOID
+SecureHostQueueInvalidationLocked(
+    _Inout_ PDRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_DEVICE_POLICY* Policy
 );
 
+_IRQL_requires_(APC_LEVEL)
+_Requires_lock_held_(Context->PolicyUpdateLock)
+VOID
+SecureHostPublishDevicePoliciesLocked(
+    _Inout_ PDRIVER_CONTEXT Context,
+    _In_ PSECUREHOST_POLICY_SNAPSHOT Snapshot
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+VOID
+SecureHostWaitForPolicyReaders(
+    _In_ PDRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
 SECUREHOST_DEVICE_TYPE
 SecureHostIdentifyDevice(
     _In_ PWDFDEVICE_INIT DeviceInit
 );
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostRecordDeviceEvent(
+    _In_ PDRIVER_CONTEXT Context,
+    _Inout_ PDEVICE_CONTEXT Device,
+    _In_ UINT32 ProcessId,
+    _In_ UINT64 ProcessCreateTime,
+    _In_ BOOLEAN Allowed,
+    _In_ const SECUREHOST_DEVICE_TRACE* Trace
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SecureHostGetDeviceEvents(
+    _Inout_ PDEVICE_CONTEXT Device,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostQueryProcessesRequest(
+    _Inout_ PDRIVER_CONTEXT Context,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostQueryStatistics(
+    _In_ PDRIVER_CONTEXT Context,
+    _Out_ PSECUREHOST_STATISTICS Statistics
+);
+
+//
+// Returns the current processor's counters. The caller must stay at
+// DISPATCH_LEVEL while updating them.
+//
+FORCEINLINE
+PSECUREHOST_COUNTERS
+SecureHostLocalCounters(
+    _In_ PDRIVER_CONTEXT Context
+)
+{
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+    return &Context->CpuCounters[KeGetCurrentProcessorNumberEx(NULL)].Counters;
+}
+
+//
+// Maps elapsed performance counter ticks to a latency bucket
+//
+FORCEINLINE
+ULONG
+SecureHostLatencyBucket(
+    _In_ LONGLONG Ticks
+)
+{
+    ULONG index;
+
+    if (Ticks <= 0 || !BitScanReverse64(&index, (ULONG64)Ticks)) {
+        return 0;
+    }
+
+    return min(index + 1, SECUREHOST_LATENCY_BUCKETS - 1);
+}
+
+//
+// Issues a correlation ID from the current processor's sequence. The
+// caller must be at DISPATCH_LEVEL.
+//
+FORCEINLINE
+UINT64
+SecureHostNextCorrelationId(
+    _In_ PDRIVER_CONTEXT Context
+)
+{
+    ULONG processor;
+
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+    return SECUREHOST_CORRELATION_ID(SECUREHOST_TRACE_SOURCE_DEVICE, processor,
+                                     ++Context->CpuCounters[processor].TraceSequence);
+}
+
+//
+// Decision cache slot for a process. PIDs are multiples of four, so the
+// low bits are dropped before the multiplicative hash.
+//
+FORCEINLINE
+ULONG
+SecureHostDecisionSlot(
+    _In_ UINT32 ProcessId
+)
+{
+    return ((ProcessId >> 2) * 0x9E3779B1u) >> (32 - SECUREHOST_DECISION_CACHE_SHIFT);
+}
+
+FORCEINLINE
+LONG64
+SecureHostDecisionEntry(
+    _In_ UINT32 ProcessId,
+    _In_ LONG Generation,
+    _In_ BOOLEAN Allowed
+)
+{
+    return (LONG64)(((UINT64)ProcessId << 32) |
+                    (((UINT64)Generation & SECUREHOST_DECISION_GENERATION_MASK) << 1) |
+                    (Allowed ? 1u : 0u));
+}
+
+//
+// The driver context, for callbacks that do not receive one
+//
+static PDRIVER_CONTEXT SecureHostDriverContext;
+
 //
 // Paged code
 //
@@ -96,6 +676,15 @@ SecureHostIdentifyDevice(
 #pragma alloc_text (INIT, DriverEntry)
 #pragma alloc_text (PAGE, SecureHostDeviceAdd)
 #pragma alloc_text (PAGE, SecureHostDriverCleanup)
+#pragma alloc_text (PAGE, SecureHostProcessNotify)
+#pragma alloc_text (PAGE, SecureHostQueryProcessesRequest)
+#pragma alloc_text (PAGE, SecureHostIoPolicyUpdate)
+#pragma alloc_text (PAGE, SecureHostAddDevicePolicyLocked)
+#pragma alloc_text (PAGE, SecureHostRunBenchmark)
+#pragma alloc_text (PAGE, SecureHostRemoveDevicePolicyLocked)
+#pragma alloc_text (PAGE, SecureHostPublishDevicePoliciesLocked)
+#pragma alloc_text (PAGE, SecureHostWaitForPolicyReaders)
+#pragma alloc_text (PAGE, SecureHostIdentifyDevice)
 #endif
 
 /*++
@@ -116,6 +705,7 @@ DriverEntry(
     WDF_OBJECT_ATTRIBUTES attributes;
     WDFDRIVER driver;
     PDRIVER_CONTEXT context;
+    ULONG i;
 
     KdPrint(("SecureHostDevice: DriverEntry\n"));
 
@@ -152,8 +742,61 @@ DriverEntry(
     context = DriverGetContext(driver);
     RtlZeroMemory(context, sizeof(DRIVER_CONTEXT));
     context->Driver = driver;
-    KeInitializeSpinLock(&context->PolicyLock);
-    InitializeListHead(&context->PolicyList);
+    ExInitializeFastMutex(&context->PolicyUpdateLock);
+
+    //
+    // Start above zero so an empty slot never matches
+    //
+    for (i = 0; i < SECUREHOST_DEVICE_TYPE_COUNT; i++) {
+        context->PolicyGeneration[i] = 1;
+    }
+
+    //
+    // One counter block per possible processor (ExAllocatePool2 zeroes).
+    // On failure the driver object is deleted and cleanup runs.
+    //
+    context->CpuCounterCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    context->CpuCounters = (PSECUREHOST_CPU_COUNTERS)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        (SIZE_T)context->CpuCounterCount * sizeof(SECUREHOST_CPU_COUNTERS),
+        SECUREHOST_DEVICE_TAG
+    );
+
+    if (context->CpuCounters == NULL) {
+        KdPrint(("SecureHostDevice: Failed to allocate statistics counters\n"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Pre-allocate grace period DPCs so retiring a snapshot cannot fail
+    //
+    context->GracePeriodDpcCount = context->CpuCounterCount;
+    context->GracePeriodDpcs = (PKDPC)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)context->GracePeriodDpcCount * sizeof(KDPC),
+        SECUREHOST_DEVICE_TAG
+    );
+
+    if (context->GracePeriodDpcs == NULL) {
+        KdPrint(("SecureHostDevice: Failed to allocate grace period DPCs\n"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Without exit notifications a cached verdict could outlive its
+    // process, so the cache stays off if registration fails
+    //
+    SecureHostDriverContext = context;
+
+    SecureHostInitializeProcessCache(&context->ProcessCache);
+
+    status = PsSetCreateProcessNotifyRoutineEx(SecureHostProcessNotify, FALSE);
+    if (NT_SUCCESS(status)) {
+        context->ProcessNotifyRegistered = TRUE;
+        context->DecisionCacheEnabled = TRUE;
+    } else {
+        KdPrint(("SecureHostDevice: PsSetCreateProcessNotifyRoutineEx failed: 0x%08X, decision and process caches disabled\n", status));
+    }
 
     KdPrint(("SecureHostDevice: Driver initialized successfully\n"));
     return STATUS_SUCCESS;
@@ -174,10 +817,14 @@ SecureHostDeviceAdd(
 {
     NTSTATUS status;
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
+    WDF_OBJECT_ATTRIBUTES queueAttributes;
+    WDF_OBJECT_ATTRIBUTES timerAttributes;
     PDEVICE_CONTEXT deviceContext;
     WDFDEVICE device;
     WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_TIMER_CONFIG timerConfig;
     WDFQUEUE queue;
+    SECUREHOST_DEVICE_TYPE deviceType;
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -192,6 +839,12 @@ SecureHostDeviceAdd(
     WdfDeviceInitSetCharacteristics(DeviceInit, FILE_DEVICE_SECURE_OPEN, TRUE);
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoBuffered);
 
+    //
+    // Classify while the PnP properties are still reachable through
+    // DeviceInit; WdfDeviceCreate consumes it
+    //
+    deviceType = SecureHostIdentifyDevice(DeviceInit);
+
     //
     // Initialize device attributes
     //
@@ -211,7 +864,7 @@ SecureHostDeviceAdd(
     //
     deviceContext = DeviceGetContext(device);
     deviceContext->Device = device;
-    deviceContext->DeviceType = SecureHostIdentifyDevice(DeviceInit);
+    deviceContext->DeviceType = deviceType;
 
     //
     // Create default I/O queue
@@ -219,10 +872,16 @@ SecureHostDeviceAdd(
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchParallel);
     queueConfig.EvtIoDeviceControl = SecureHostIoDeviceControl;
 
+    //
+    // Policy updates use paged memory
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&queueAttributes);
+    queueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
     status = WdfIoQueueCreate(
         device,
         &queueConfig,
-        WDF_NO_OBJECT_ATTRIBUTES,
+        &queueAttributes,
         &queue
     );
 
@@ -233,6 +892,42 @@ SecureHostDeviceAdd(
 
     deviceContext->Queue = queue;
 
+    //
+    // Policy changes are forwarded to a sequential queue of their own, so
+    // a batch being applied never occupies the threads serving checks
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    queueConfig.EvtIoDeviceControl = SecureHostIoPolicyUpdate;
+
+    status = WdfIoQueueCreate(device, &queueConfig, &queueAttributes, &deviceContext->UpdateQueue);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostDevice: WdfIoQueueCreate (updates) failed: 0x%08X\n", status));
+        return status;
+    }
+
+    //
+    // Event fetches park here until an access check is recorded
+    //
+    KeInitializeSpinLock(&deviceContext->EventLock);
+
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->EventQueue);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostDevice: WdfIoQueueCreate (events) failed: 0x%08X\n", status));
+        return status;
+    }
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, SecureHostDeviceEventTimer);
+    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+    timerAttributes.ParentObject = device;
+
+    status = WdfTimerCreate(&timerConfig, &timerAttributes, &deviceContext->EventTimer);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostDevice: WdfTimerCreate failed: 0x%08X\n", status));
+        return status;
+    }
+
     KdPrint(("SecureHostDevice: Device added successfully\n"));
     return STATUS_SUCCESS;
 }
@@ -257,17 +952,51 @@ SecureHostDriverCleanup(
 
     context = DriverGetContext((WDFDRIVER)DriverObject);
 
+    if (context->ProcessNotifyRegistered) {
+        PsSetCreateProcessNotifyRoutineEx(SecureHostProcessNotify, TRUE);
+        context->ProcessNotifyRegistered = FALSE;
+        context->DecisionCacheEnabled = FALSE;
+    }
+
+    SecureHostDestroyProcessCache(&context->ProcessCache);
+
     //
-    // Clean up policy list
+    // Release the policy store; interned names go with their chunks. No
+    // check can be running, so the snapshot is freed without a grace
+    // period.
     //
-    while (!IsListEmpty(&context->PolicyList)) {
-        PLIST_ENTRY entry = RemoveHeadList(&context->PolicyList);
-        PSECUREHOST_DEVICE_POLICY policy = CONTAINING_RECORD(
-            entry,
-            SECUREHOST_DEVICE_POLICY,
-            DeviceType
-        );
-        ExFreePoolWithTag(policy, SECUREHOST_DEVICE_TAG);
+    if (context->ActivePolicies != NULL) {
+        ExFreePoolWithTag(context->ActivePolicies, SECUREHOST_DEVICE_TAG);
+        context->ActivePolicies = NULL;
+    }
+
+    if (context->Policies != NULL) {
+        ExFreePoolWithTag(context->Policies, SECUREHOST_DEVICE_TAG);
+        context->Policies = NULL;
+    }
+
+    if (context->PolicyInfo != NULL) {
+        ExFreePoolWithTag(context->PolicyInfo, SECUREHOST_DEVICE_TAG);
+        context->PolicyInfo = NULL;
+    }
+
+    while (context->NameChunks != NULL) {
+        PSECUREHOST_NAME_CHUNK chunk = context->NameChunks;
+        context->NameChunks = chunk->Next;
+        ExFreePoolWithTag(chunk, SECUREHOST_DEVICE_TAG);
+    }
+
+    context->PolicyCount = 0;
+    context->PolicyCapacity = 0;
+
+    if (context->GracePeriodDpcs != NULL) {
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_DEVICE_TAG);
+        context->GracePeriodDpcs = NULL;
+    }
+
+    if (context->CpuCounters != NULL) {
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_DEVICE_TAG);
+        context->CpuCounters = NULL;
     }
 }
 
@@ -290,8 +1019,10 @@ SecureHostIoDeviceControl(
     NTSTATUS status = STATUS_SUCCESS;
     PDEVICE_CONTEXT deviceContext;
     PDRIVER_CONTEXT driverContext;
+    SECUREHOST_DEVICE_TRACE trace;
     UINT32 processId;
-    HANDLE processHandle;
+    PVOID buffer;
+    size_t information = 0;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
@@ -307,14 +1038,31 @@ SecureHostIoDeviceControl(
     switch (IoControlCode) {
         case IOCTL_SECUREHOST_CHECK_ACCESS:
             //
-            // Check if process has access to this device
+            // Check if process has access to this device; the verdict
+            // is timed from here
             //
+            trace.CorrelationId = 0;
+            trace.CheckTime = (UINT64)KeQueryPerformanceCounter(NULL).QuadPart;
+            trace.VerdictTicks = 0;
+
             status = SecureHostCheckDeviceAccess(
                 driverContext,
                 deviceContext->DeviceType,
-                processId
+                processId,
+                &trace
             );
 
+            //
+            // Access checks run in the caller's context
+            //
+            SecureHostRecordDeviceEvent(
+                driverContext,
+                deviceContext,
+                processId,
+                (UINT64)PsGetProcessCreateTimeQuadPart(PsGetCurrentProcess()),
+                NT_SUCCESS(status),
+                &trace);
+
             if (!NT_SUCCESS(status)) {
                 KdPrint(("SecureHostDevice: Access denied for PID %lu to device type %d\n",
                          processId, deviceContext->DeviceType));
@@ -322,66 +1070,1742 @@ SecureHostIoDeviceControl(
             }
             break;
 
-        default:
-            status = STATUS_INVALID_DEVICE_REQUEST;
-            break;
-    }
+        case IOCTL_SECUREHOST_RUN_BENCHMARK:
+            if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_TCB_PRIVILEGE),
+                                        WdfRequestGetRequestorMode(Request))) {
+                status = STATUS_PRIVILEGE_NOT_HELD;
+                break;
+            }
 
-    WdfRequestComplete(Request, status);
-}
+            status = WdfRequestRetrieveInputBuffer(
+                Request,
+                sizeof(SECUREHOST_BENCHMARK_INPUT),
+                &buffer,
+                NULL
+            );
 
-/*++
+            if (NT_SUCCESS(status)) {
+                SECUREHOST_BENCHMARK_INPUT input = *(const SECUREHOST_BENCHMARK_INPUT*)buffer;
 
-Routine Description:
-    Checks if a process has access to a specific device type.
+                status = WdfRequestRetrieveOutputBuffer(
+                    Request,
+                    sizeof(SECUREHOST_BENCHMARK_RESULT),
+                    &buffer,
+                    NULL
+                );
 
---*/
-_Use_decl_annotations_
-NTSTATUS
-SecureHostCheckDeviceAccess(
-    PDRIVER_CONTEXT Context,
-    SECUREHOST_DEVICE_TYPE DeviceType,
-    UINT32 ProcessId
-)
-{
+                if (NT_SUCCESS(status)) {
+                    status = SecureHostRunBenchmark(driverContext, &input, (PSECUREHOST_BENCHMARK_RESULT)buffer);
+                }
+
+                if (NT_SUCCESS(status)) {
+                    information = sizeof(SECUREHOST_BENCHMARK_RESULT);
+                }
+            }
+            break;
+
+        case IOCTL_SECUREHOST_APPLY_DEVICE_RULES:
+            if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_TCB_PRIVILEGE),
+                                        WdfRequestGetRequestorMode(Request))) {
+                status = STATUS_PRIVILEGE_NOT_HELD;
+                break;
+            }
+
+            //
+            // Privilege is checked here, in the caller's context; the
+            // update queue may run the request on another thread
+            //
+            status = WdfRequestForwardToIoQueue(Request, deviceContext->UpdateQueue);
+            if (NT_SUCCESS(status)) {
+                return;
+            }
+            break;
+
+        case IOCTL_SECUREHOST_GET_DEVICE_EVENTS:
+            if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_TCB_PRIVILEGE),
+                                        WdfRequestGetRequestorMode(Request))) {
+                status = STATUS_PRIVILEGE_NOT_HELD;
+                break;
+            }
+
+            status = SecureHostGetDeviceEvents(deviceContext, Request, &information);
+            if (status == STATUS_PENDING) {
+                return;
+            }
+            break;
+
+        case IOCTL_SECUREHOST_QUERY_PROCESSES:
+            if (!SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_TCB_PRIVILEGE),
+                                        WdfRequestGetRequestorMode(Request))) {
+                status = STATUS_PRIVILEGE_NOT_HELD;
+                break;
+            }
+
+            status = SecureHostQueryProcessesRequest(driverContext, Request, &information);
+            break;
+
+        case IOCTL_SECUREHOST_GET_STATISTICS:
+            status = WdfRequestRetrieveOutputBuffer(
+                Request,
+                sizeof(SECUREHOST_STATISTICS),
+                &buffer,
+                NULL
+            );
+
+            if (NT_SUCCESS(status)) {
+                SecureHostQueryStatistics(driverContext, (PSECUREHOST_STATISTICS)buffer);
+                information = sizeof(SECUREHOST_STATISTICS);
+            }
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, information);
+}
+
+/*++
+
+Routine Description:
+    Handles policy changes forwarded from the parallel queue, one at a
+    time. Callers were checked for SeTcbPrivilege before forwarding.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostIoPolicyUpdate(
+    WDFQUEUE Queue,
+    WDFREQUEST Request,
+    size_t OutputBufferLength,
+    size_t InputBufferLength,
+    ULONG IoControlCode
+)
+{
+    NTSTATUS status;
+    PDRIVER_CONTEXT driverContext;
+    PVOID buffer;
+    size_t bufferLength;
+
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    driverContext = DriverGetContext(WdfGetDriver());
+
+    switch (IoControlCode) {
+        case IOCTL_SECUREHOST_APPLY_DEVICE_RULES:
+            //
+            // METHOD_IN_DIRECT: the batch is in the MDL-described buffer
+            //
+            status = WdfRequestRetrieveOutputBuffer(
+                Request,
+                sizeof(SECUREHOST_RULESET_HEADER),
+                &buffer,
+                &bufferLength
+            );
+
+            if (NT_SUCCESS(status)) {
+                status = SecureHostApplyDeviceRules(driverContext, buffer, bufferLength);
+            }
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    WdfRequestComplete(Request, status);
+}
+
+/*++
+
+Routine Description:
+    Checks if a process has access to a specific device type. Times the
+    verdict from Trace->CheckTime and issues the check's correlation ID.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostCheckDeviceAccess(
+    PDRIVER_CONTEXT Context,
+    SECUREHOST_DEVICE_TYPE DeviceType,
+    UINT32 ProcessId,
+    PSECUREHOST_DEVICE_TRACE Trace
+)
+{
+    const SECUREHOST_POLICY_SNAPSHOT* snapshot;
+    KIRQL oldIrql;
+    NTSTATUS status;
+    PSECUREHOST_COUNTERS counters;
+    LARGE_INTEGER start = {0};
+    volatile LONG64* slot = NULL;
+    LONG64 cached;
+    LONG generation = 0;
+    LONGLONG elapsed;
+    BOOLEAN sampled;
+
+    //
+    // The snapshot is only dereferenced at DISPATCH_LEVEL, and a verdict
+    // computed from it reaches the decision cache before the section
+    // ends; see SecureHostPublishDevicePoliciesLocked
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    counters = SecureHostLocalCounters(Context);
+    counters->Classifications++;
+
+    //
+    // Try the decision cache first. A slot matches only if it was filled
+    // for this process under the current policy generation.
+    //
+    if (Context->DecisionCacheEnabled && (ULONG)DeviceType < SECUREHOST_DEVICE_TYPE_COUNT) {
+        slot = &Context->DecisionCache[DeviceType][SecureHostDecisionSlot(ProcessId)];
+        generation = ReadNoFence(&Context->PolicyGeneration[DeviceType]);
+        cached = ReadNoFence64(slot);
+
+        if ((cached & ~1ll) == SecureHostDecisionEntry(ProcessId, generation, FALSE)) {
+            status = (cached & 1) ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
+            counters->CacheHits++;
+            slot = NULL;
+            goto exit;
+        }
+    }
+
+    //
+    // Scan the published policies
+    //
+    snapshot = (const SECUREHOST_POLICY_SNAPSHOT*)ReadPointerAcquire(
+        (PVOID const volatile*)&Context->ActivePolicies);
+
+    sampled = (counters->RuleLookups++ & (SECUREHOST_LATENCY_SAMPLE_RATE - 1)) == 0;
+    if (sampled) {
+        start = KeQueryPerformanceCounter(NULL);
+    }
+
+    status = (snapshot != NULL && SecureHostScanDevicePolicies(
+        snapshot->Policies,
+        snapshot->Count,
+        (UINT8)DeviceType,
+        ProcessId)) ? STATUS_SUCCESS : STATUS_ACCESS_DENIED;
+
+    if (sampled) {
+        counters->LookupLatency[SecureHostLatencyBucket(
+            KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart)]++;
+    }
+
+    //
+    // A change published since the section began is only invalidated
+    // after it ends, so this fill cannot outlive the change
+    //
+    if (slot != NULL) {
+        WriteNoFence64(slot, SecureHostDecisionEntry(ProcessId, generation, NT_SUCCESS(status)));
+    }
+
+exit:
+    if (NT_SUCCESS(status)) {
+        counters->Permits++;
+    } else {
+        counters->Blocks++;
+    }
+
+    elapsed = KeQueryPerformanceCounter(NULL).QuadPart - (LONGLONG)Trace->CheckTime;
+    counters->VerdictLatency[SecureHostLatencyBucket(elapsed)]++;
+
+    Trace->VerdictTicks = (elapsed <= 0) ? 0 : (UINT32)min((ULONGLONG)elapsed, MAXUINT32);
+    Trace->CorrelationId = SecureHostNextCorrelationId(Context);
+
+    KeLowerIrql(oldIrql);
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Moves as much of the device's event backlog as fits into a fetch
+    request's output buffer. Returns the number of bytes written.
+
+--*/
+_Requires_lock_held_(Device->EventLock)
+static
+size_t
+SecureHostTakeDeviceEventsLocked(
+    _Inout_ PDEVICE_CONTEXT Device,
+    _In_ WDFREQUEST Request
+)
+{
+    PSECUREHOST_DEVICE_EVENT records;
+    size_t bufferLength;
+    ULONG count;
+    ULONG i;
+
+    //
+    // The length was checked before the request was parked
+    //
+    if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(
+            Request,
+            sizeof(SECUREHOST_DEVICE_EVENT),
+            (PVOID*)&records,
+            &bufferLength))) {
+        return 0;
+    }
+
+    count = (ULONG)min(bufferLength / sizeof(SECUREHOST_DEVICE_EVENT), (size_t)Device->EventCount);
+
+    for (i = 0; i < count; i++) {
+        records[i] = Device->Events[(Device->EventHead + i) & (SECUREHOST_DEVICE_EVENT_BACKLOG - 1)];
+    }
+
+    Device->EventHead = (Device->EventHead + count) & (SECUREHOST_DEVICE_EVENT_BACKLOG - 1);
+    Device->EventCount -= count;
+
+    return count * sizeof(SECUREHOST_DEVICE_EVENT);
+}
+
+//
+// Appends a record to the backlog, or counts it dropped if full
+//
+_Requires_lock_held_(Device->EventLock)
+static
+VOID
+SecureHostAppendDeviceEventLocked(
+    _In_ PDRIVER_CONTEXT Context,
+    _Inout_ PDEVICE_CONTEXT Device,
+    _In_ UINT32 ProcessId,
+    _In_ UINT64 ProcessCreateTime,
+    _In_ UINT8 Verdict,
+    _In_ UINT32 Count,
+    _In_ UINT64 FirstTimestamp,
+    _In_ UINT64 LastTimestamp,
+    _In_ const SECUREHOST_DEVICE_TRACE* Trace
+)
+{
+    PSECUREHOST_DEVICE_EVENT event;
+
+    if (Device->EventCount == SECUREHOST_DEVICE_EVENT_BACKLOG) {
+        SecureHostLocalCounters(Context)->EventsDropped++;
+        return;
+    }
+
+    event = &Device->Events[(Device->EventHead + Device->EventCount) & (SECUREHOST_DEVICE_EVENT_BACKLOG - 1)];
+    event->Timestamp = FirstTimestamp;
+    event->ProcessId = ProcessId;
+    event->DeviceType = (UINT8)Device->DeviceType;
+    event->Verdict = Verdict;
+    event->Reserved = 0;
+    event->Count = Count;
+    event->Reserved2 = 0;
+    event->LastTimestamp = LastTimestamp;
+    event->ProcessCreateTime = ProcessCreateTime;
+    event->CorrelationId = Trace->CorrelationId;
+    event->CheckTime = Trace->CheckTime;
+    event->VerdictTicks = Trace->VerdictTicks;
+    event->Reserved3 = 0;
+    Device->EventCount++;
+}
+
+/*++
+
+Routine Description:
+    Closes the repeat window: records every key that repeated and empties
+    the table.
+
+--*/
+_Requires_lock_held_(Device->EventLock)
+static
+VOID
+SecureHostFlushDeviceRepeatsLocked(
+    _In_ PDRIVER_CONTEXT Context,
+    _Inout_ PDEVICE_CONTEXT Device
+)
+{
+    PSECUREHOST_DEVICE_REPEAT repeat;
+    ULONG i;
+
+    for (i = 0; i < SECUREHOST_DEVICE_REPEAT_ENTRIES; i++) {
+        repeat = &Device->Repeats[i];
+
+        if (repeat->InUse && repeat->Repeats != 0) {
+            SecureHostAppendDeviceEventLocked(
+                Context,
+                Device,
+                repeat->ProcessId,
+                repeat->ProcessCreateTime,
+                repeat->Verdict,
+                repeat->Repeats,
+                repeat->FirstRepeat,
+                repeat->LastRepeat,
+                &repeat->FirstTrace);
+        }
+
+        repeat->InUse = FALSE;
+    }
+
+    Device->RepeatWindowEnd = 0;
+}
+
+/*++
+
+Routine Description:
+    Completes the oldest parked fetch request with the backlog, if both
+    exist. Returns the request for the caller to complete after dropping
+    EventLock.
+
+--*/
+_Requires_lock_held_(Device->EventLock)
+static
+WDFREQUEST
+SecureHostTakeParkedRequestLocked(
+    _Inout_ PDEVICE_CONTEXT Device,
+    _Out_ size_t* Information
+)
+{
+    WDFREQUEST request;
+
+    *Information = 0;
+
+    if (Device->EventCount == 0 ||
+        !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Device->EventQueue, &request))) {
+        return NULL;
+    }
+
+    *Information = SecureHostTakeDeviceEventsLocked(Device, request);
+    return request;
+}
+
+/*++
+
+Routine Description:
+    Records an access check and, if a fetch request is parked, completes
+    it with the backlog. A repeat of a key already recorded in the
+    current window is counted instead.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostRecordDeviceEvent(
+    PDRIVER_CONTEXT Context,
+    PDEVICE_CONTEXT Device,
+    UINT32 ProcessId,
+    UINT64 ProcessCreateTime,
+    BOOLEAN Allowed,
+    const SECUREHOST_DEVICE_TRACE* Trace
+)
+{
+    PSECUREHOST_DEVICE_REPEAT repeat;
+    PSECUREHOST_DEVICE_REPEAT freeEntry = NULL;
+    LARGE_INTEGER timestamp;
+    WDFREQUEST request;
+    size_t information;
+    UINT64 now;
+    UINT8 verdict;
+    BOOLEAN startTimer = FALSE;
+    ULONG i;
+    KIRQL oldIrql;
+
+    KeQuerySystemTimePrecise(&timestamp);
+    now = (UINT64)timestamp.QuadPart;
+    verdict = Allowed ? SECUREHOST_DEVICE_ACTION_ALLOW : SECUREHOST_DEVICE_ACTION_BLOCK;
+
+    KeAcquireSpinLock(&Device->EventLock, &oldIrql);
+
+    if (now >= Device->RepeatWindowEnd) {
+        SecureHostFlushDeviceRepeatsLocked(Context, Device);
+        Device->RepeatWindowEnd = now + (UINT64)SECUREHOST_DEVICE_REPEAT_WINDOW_MS * 10000;
+    }
+
+    for (i = 0; i < SECUREHOST_DEVICE_REPEAT_ENTRIES; i++) {
+        repeat = &Device->Repeats[i];
+
+        if (!repeat->InUse) {
+            if (freeEntry == NULL) {
+                freeEntry = repeat;
+            }
+            continue;
+        }
+
+        if (repeat->ProcessId == ProcessId && repeat->ProcessCreateTime == ProcessCreateTime &&
+            repeat->Verdict == verdict && repeat->Repeats != MAXUINT32) {
+            if (repeat->Repeats++ == 0) {
+                repeat->FirstRepeat = now;
+                repeat->FirstTrace = *Trace;
+            }
+            repeat->LastRepeat = now;
+
+            if (!Device->RepeatTimerArmed) {
+                Device->RepeatTimerArmed = TRUE;
+                startTimer = TRUE;
+            }
+            break;
+        }
+    }
+
+    if (i == SECUREHOST_DEVICE_REPEAT_ENTRIES) {
+        if (freeEntry != NULL) {
+            freeEntry->ProcessId = ProcessId;
+            freeEntry->ProcessCreateTime = ProcessCreateTime;
+            freeEntry->Verdict = verdict;
+            freeEntry->Repeats = 0;
+            freeEntry->InUse = TRUE;
+        }
+
+        SecureHostAppendDeviceEventLocked(Context, Device, ProcessId, ProcessCreateTime, verdict, 1, now, now, Trace);
+    }
+
+    request = SecureHostTakeParkedRequestLocked(Device, &information);
+
+    KeReleaseSpinLock(&Device->EventLock, oldIrql);
+
+    if (startTimer) {
+        WdfTimerStart(Device->EventTimer, WDF_REL_TIMEOUT_IN_MS(SECUREHOST_DEVICE_REPEAT_WINDOW_MS));
+    }
+
+    if (request != NULL) {
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, information);
+    }
+}
+
+/*++
+
+Routine Description:
+    Closes a repeat window that no later access check has closed, so a
+    burst is reported even if the process gives up.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostDeviceEventTimer(
+    WDFTIMER Timer
+)
+{
+    PDEVICE_CONTEXT device;
+    PDRIVER_CONTEXT context;
+    LARGE_INTEGER timestamp;
+    WDFREQUEST request;
+    size_t information;
+    BOOLEAN restart = FALSE;
+    KIRQL oldIrql;
+
+    device = DeviceGetContext(WdfTimerGetParentObject(Timer));
+    context = DriverGetContext(WdfGetDriver());
+
+    KeQuerySystemTimePrecise(&timestamp);
+
+    KeAcquireSpinLock(&device->EventLock, &oldIrql);
+
+    if ((UINT64)timestamp.QuadPart >= device->RepeatWindowEnd) {
+        SecureHostFlushDeviceRepeatsLocked(context, device);
+        device->RepeatTimerArmed = FALSE;
+    } else {
+        //
+        // A check opened a new window since the timer was started
+        //
+        restart = TRUE;
+    }
+
+    request = SecureHostTakeParkedRequestLocked(device, &information);
+
+    KeReleaseSpinLock(&device->EventLock, oldIrql);
+
+    if (restart) {
+        WdfTimerStart(Timer, WDF_REL_TIMEOUT_IN_MS(SECUREHOST_DEVICE_REPEAT_WINDOW_MS));
+    }
+
+    if (request != NULL) {
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, information);
+    }
+}
+
+/*++
+
+Routine Description:
+    Returns buffered access events, or parks the request until the next
+    one is recorded (STATUS_PENDING; the caller must not complete it).
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostGetDeviceEvents(
+    PDEVICE_CONTEXT Device,
+    WDFREQUEST Request,
+    size_t* Information
+)
+{
+    PVOID buffer;
+    KIRQL oldIrql;
+    NTSTATUS status;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(SECUREHOST_DEVICE_EVENT), &buffer, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // Checked and parked under EventLock so a concurrent event cannot
+    // slip in between and leave the request waiting
+    //
+    KeAcquireSpinLock(&Device->EventLock, &oldIrql);
+
+    if (Device->EventCount != 0) {
+        *Information = SecureHostTakeDeviceEventsLocked(Device, Request);
+    } else {
+        status = WdfRequestForwardToIoQueue(Request, Device->EventQueue);
+        if (NT_SUCCESS(status)) {
+            status = STATUS_PENDING;
+        }
+    }
+
+    KeReleaseSpinLock(&Device->EventLock, oldIrql);
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Handles IOCTL_SECUREHOST_QUERY_PROCESSES. Input and output share the
+    buffered I/O buffer.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostQueryProcessesRequest(
+    PDRIVER_CONTEXT Context,
+    WDFREQUEST Request,
+    size_t* Information
+)
+{
+    PVOID input;
+    PVOID output;
+    size_t inputLength;
+    size_t outputLength;
+    ULONG written;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(SECUREHOST_PROCESS_QUERY), &input, &inputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(SECUREHOST_PROCESS_RECORD), &output, &outputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = SecureHostQueryProcesses(
+        &Context->ProcessCache,
+        input,
+        (ULONG)min(inputLength, MAXULONG),
+        output,
+        (ULONG)min(outputLength, MAXULONG),
+        &written);
+
+    if (NT_SUCCESS(status)) {
+        *Information = written;
+    }
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Hashes a process name for interning (FNV-1a over the UTF-16 bytes).
+    Interning is exact; case-insensitive matching is left to the matcher.
+
+--*/
+FORCEINLINE
+ULONG
+SecureHostHashName(
+    _In_reads_bytes_(Length) PCWCH Name,
+    _In_ USHORT Length
+)
+{
+    const UCHAR* bytes = (const UCHAR*)Name;
+    ULONG hash = 2166136261u;
+    USHORT i;
+
+    for (i = 0; i < Length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*++
+
+Routine Description:
+    Returns the interned copy of a process name, adding it if needed, and
+    takes a reference on it. Empty names intern to NULL.
+
+--*/
+static
+_Requires_lock_held_(Context->PolicyUpdateLock)
+NTSTATUS
+SecureHostInternName(
+    _In_ PDRIVER_CONTEXT Context,
+    _In_reads_bytes_opt_(Length) PCWCH Name,
+    _In_ USHORT Length,
+    _Out_ PSECUREHOST_POLICY_NAME* Interned
+)
+{
+    PSECUREHOST_POLICY_NAME* bucket;
+    PSECUREHOST_POLICY_NAME entry;
+    PSECUREHOST_NAME_CHUNK chunk;
+    SIZE_T size;
+    ULONG hash;
+
+    PAGED_CODE();
+
+    *Interned = NULL;
+
+    if (Name == NULL || Length == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    hash = SecureHostHashName(Name, Length);
+    bucket = &Context->NameBuckets[hash & (SECUREHOST_NAME_HASH_BUCKETS - 1)];
+
+    for (entry = *bucket; entry != NULL; entry = entry->Next) {
+        if (entry->Hash == hash &&
+            entry->Length == Length &&
+            RtlEqualMemory(entry->Buffer, Name, Length)) {
+
+            entry->References++;
+            *Interned = entry;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    //
+    // Carve a new entry from the current chunk, starting a chunk if full
+    //
+    size = ALIGN_UP_BY(FIELD_OFFSET(SECUREHOST_POLICY_NAME, Buffer) + Length, sizeof(PVOID));
+    chunk = Context->NameChunks;
+
+    if (chunk == NULL || chunk->Used + size > SECUREHOST_NAME_ARENA_CHUNK) {
+        chunk = (PSECUREHOST_NAME_CHUNK)ExAllocatePool2(
+            POOL_FLAG_PAGED,
+            SECUREHOST_NAME_ARENA_CHUNK,
+            SECUREHOST_DEVICE_TAG
+        );
+
+        if (chunk == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        chunk->Used = ALIGN_UP_BY(sizeof(SECUREHOST_NAME_CHUNK), sizeof(PVOID));
+        chunk->Next = Context->NameChunks;
+        Context->NameChunks = chunk;
+    }
+
+    entry = (PSECUREHOST_POLICY_NAME)((PUCHAR)chunk + chunk->Used);
+    chunk->Used += size;
+
+    entry->Hash = hash;
+    entry->References = 1;
+    entry->Length = Length;
+    RtlCopyMemory(entry->Buffer, Name, Length);
+
+    entry->Next = *bucket;
+    *bucket = entry;
+
+    *Interned = entry;
+    return STATUS_SUCCESS;
+}
+
+FORCEINLINE
+VOID
+SecureHostReleaseName(
+    _In_opt_ PSECUREHOST_POLICY_NAME Name
+)
+{
+    if (Name != NULL) {
+        NT_ASSERT(Name->References != 0);
+        Name->References--;
+    }
+}
+
+//
+// Index of the policy with the given rule ID, or PolicyCount if none
+//
+static
+_Requires_lock_held_(Context->PolicyUpdateLock)
+ULONG
+SecureHostFindDevicePolicy(
+    _In_ PDRIVER_CONTEXT Context,
+    _In_ UINT64 RuleId
+)
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < Context->PolicyCount; i++) {
+        if (Context->PolicyInfo[i].RuleId == RuleId) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/*++
+
+Routine Description:
+    Makes room for one more policy, doubling both working arrays when
+    full. Checks only read published snapshots, so the arrays can be
+    reallocated without excluding them.
+
+--*/
+static
+_Requires_lock_held_(Context->PolicyUpdateLock)
+NTSTATUS
+SecureHostReserveDevicePolicy(
+    _In_ PDRIVER_CONTEXT Context
+)
+{
+    PSECUREHOST_DEVICE_POLICY policies;
+    PSECUREHOST_DEVICE_POLICY_INFO info;
+    ULONG capacity;
+
+    PAGED_CODE();
+
+    if (Context->PolicyCount < Context->PolicyCapacity) {
+        return STATUS_SUCCESS;
+    }
+
+    if (Context->PolicyCapacity >= SECUREHOST_MAX_DEVICE_POLICIES) {
+        return STATUS_QUOTA_EXCEEDED;
+    }
+
+    capacity = max(Context->PolicyCapacity * 2, SECUREHOST_MIN_POLICY_CAPACITY);
+
+    policies = (PSECUREHOST_DEVICE_POLICY)ExAllocatePool2(
+        POOL_FLAG_PAGED,
+        (SIZE_T)capacity * sizeof(SECUREHOST_DEVICE_POLICY),
+        SECUREHOST_DEVICE_TAG
+    );
+
+    info = (PSECUREHOST_DEVICE_POLICY_INFO)ExAllocatePool2(
+        POOL_FLAG_PAGED,
+        (SIZE_T)capacity * sizeof(SECUREHOST_DEVICE_POLICY_INFO),
+        SECUREHOST_DEVICE_TAG
+    );
+
+    if (policies == NULL || info == NULL) {
+        if (policies != NULL) {
+            ExFreePoolWithTag(policies, SECUREHOST_DEVICE_TAG);
+        }
+        if (info != NULL) {
+            ExFreePoolWithTag(info, SECUREHOST_DEVICE_TAG);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Context->PolicyCount != 0) {
+        RtlCopyMemory(policies, Context->Policies,
+                      Context->PolicyCount * sizeof(SECUREHOST_DEVICE_POLICY));
+        RtlCopyMemory(info, Context->PolicyInfo,
+                      Context->PolicyCount * sizeof(SECUREHOST_DEVICE_POLICY_INFO));
+    }
+
+    if (Context->Policies != NULL) {
+        ExFreePoolWithTag(Context->Policies, SECUREHOST_DEVICE_TAG);
+    }
+
+    if (Context->PolicyInfo != NULL) {
+        ExFreePoolWithTag(Context->PolicyInfo, SECUREHOST_DEVICE_TAG);
+    }
+
+    Context->Policies = policies;
+    Context->PolicyInfo = info;
+    Context->PolicyCapacity = capacity;
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Applies a device rule batch (IOCTL_SECUREHOST_APPLY_DEVICE_RULES) in
+    record order. Enabled records add or replace a policy; disabled ones
+    remove it, and a disabled rule is simply absent from the store. The
+    first invalid record fails the request; the records before it stay
+    applied. Checks see the whole batch at once.
+
+    The buffer is mapped user memory and may change underneath us, so the
+    header, every record and every name are captured exactly once.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostApplyDeviceRules(
+    PDRIVER_CONTEXT Context,
+    const VOID* Buffer,
+    SIZE_T BufferLength
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    SECUREHOST_RULESET_HEADER header;
+    SECUREHOST_DEVICE_RULE_RECORD record;
+    WCHAR name[SECUREHOST_MAX_PROCESS_NAME_CHARS];
+    PSECUREHOST_POLICY_SNAPSHOT snapshot;
+    const UCHAR* records;
+    ULONG capacity;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (BufferLength < sizeof(SECUREHOST_RULESET_HEADER)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlCopyMemory(&header, Buffer, sizeof(header));
+
+    if (header.Version != SECUREHOST_DEVICE_RULESET_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    if (header.HeaderSize < sizeof(SECUREHOST_RULESET_HEADER) ||
+        header.HeaderSize > BufferLength ||
+        header.RuleSize < SECUREHOST_DEVICE_RULE_RECORD_MIN_SIZE ||
+        header.RuleCount > SECUREHOST_MAX_DEVICE_RULE_BATCH ||
+        header.Generation != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((UINT64)header.RuleCount * header.RuleSize > BufferLength - header.HeaderSize) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    records = (const UCHAR*)Buffer + header.HeaderSize;
+
+    ExAcquireFastMutex(&Context->PolicyUpdateLock);
+
+    //
+    // Sized for every record adding a policy, so publishing the batch
+    // cannot fail once it has been applied
+    //
+    capacity = min(Context->PolicyCount + header.RuleCount, SECUREHOST_MAX_DEVICE_POLICIES);
+    snapshot = (PSECUREHOST_POLICY_SNAPSHOT)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(SECUREHOST_POLICY_SNAPSHOT, Policies) +
+            (SIZE_T)capacity * sizeof(SECUREHOST_DEVICE_POLICY),
+        SECUREHOST_DEVICE_TAG
+    );
+
+    if (snapshot == NULL) {
+        ExReleaseFastMutex(&Context->PolicyUpdateLock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < header.RuleCount && NT_SUCCESS(status); i++) {
+        SecureHostCaptureRecord(&header, records, i, &record, sizeof(record));
+
+        if ((record.Flags & ~SECUREHOST_DEVICE_RULE_FLAGS_VALID) != 0 ||
+            record.ProcessNameLength % sizeof(WCHAR) != 0 ||
+            record.ProcessNameLength > sizeof(name) ||
+            (UINT64)record.ProcessNameOffset + record.ProcessNameLength > BufferLength) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        if ((record.Flags & SECUREHOST_RULE_FLAG_ENABLED) == 0) {
+            status = SecureHostRemoveDevicePolicyLocked(Context, record.RuleId);
+            if (status == STATUS_NOT_FOUND) {
+                status = STATUS_SUCCESS;
+            }
+            continue;
+        }
+
+        RtlCopyMemory(name, (const UCHAR*)Buffer + record.ProcessNameOffset, record.ProcessNameLength);
+
+        status = SecureHostAddDevicePolicyLocked(
+            Context,
+            &record,
+            (record.ProcessNameLength != 0) ? name : NULL,
+            record.ProcessNameLength
+        );
+    }
+
+    //
+    // Every change queues an invalidation; none means nothing to publish
+    //
+    if (Context->StaleDeviceTypes != 0 || Context->StalePolicyCount != 0) {
+        SecureHostPublishDevicePoliciesLocked(Context, snapshot);
+    } else {
+        ExFreePoolWithTag(snapshot, SECUREHOST_DEVICE_TAG);
+    }
+
+    ExReleaseFastMutex(&Context->PolicyUpdateLock);
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Adds a device policy to the working copy, or replaces the one with
+    the same rule ID. Checks see it once the batch is published.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostAddDevicePolicyLocked(
+    PDRIVER_CONTEXT Context,
+    const SECUREHOST_DEVICE_RULE_RECORD* Rule,
+    PCWCH Name,
+    USHORT NameLength
+)
+{
+    SECUREHOST_DEVICE_POLICY policy = {0};
+    PSECUREHOST_POLICY_NAME name;
+    NTSTATUS status;
+    ULONG index;
+
+    PAGED_CODE();
+
+    if (Rule->DeviceType >= SECUREHOST_DEVICE_TYPE_COUNT ||
+        Rule->Action < SECUREHOST_DEVICE_ACTION_ALLOW ||
+        Rule->Action > SECUREHOST_DEVICE_ACTION_AUDIT) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    policy.ProcessId = Rule->ProcessId;
+    policy.DeviceType = (UINT8)Rule->DeviceType;
+    policy.Allowed = (Rule->Action != SECUREHOST_DEVICE_ACTION_BLOCK);
+
+    status = SecureHostInternName(Context, Name, NameLength, &name);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    index = SecureHostFindDevicePolicy(Context, Rule->RuleId);
+
+    if (index == Context->PolicyCount) {
+        status = SecureHostReserveDevicePolicy(Context);
+        if (!NT_SUCCESS(status)) {
+            SecureHostReleaseName(name);
+            return status;
+        }
+        Context->PolicyCount++;
+    } else {
+        SecureHostReleaseName(Context->PolicyInfo[index].ProcessName);
+        SecureHostQueueInvalidationLocked(Context, &Context->Policies[index]);
+    }
+
+    Context->PolicyInfo[index].RuleId = Rule->RuleId;
+    Context->PolicyInfo[index].ProcessName = name;
+    Context->Policies[index] = policy;
+    SecureHostQueueInvalidationLocked(Context, &policy);
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Notes the cached verdicts a policy being added or removed could
+    change, to be dropped when the change is published. A policy for one
+    process can only change that process's verdicts for its device type,
+    so only its slot will be cleared; one for any process (or one past
+    the pending list's capacity) makes the whole device type stale.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostQueueInvalidationLocked(
+    PDRIVER_CONTEXT Context,
+    const SECUREHOST_DEVICE_POLICY* Policy
+)
+{
+    if (Policy->ProcessId == 0 || Context->StalePolicyCount == SECUREHOST_MAX_PENDING_INVALIDATIONS) {
+        Context->StaleDeviceTypes |= 1u << Policy->DeviceType;
+        return;
+    }
+
+    Context->StalePolicies[Context->StalePolicyCount++] = *Policy;
+}
+
+/*++
+
+Routine Description:
+    Drops the queued verdicts: bumps the generation of each stale device
+    type and clears the remaining process slots (if the process still
+    owns them).
+
+--*/
+static
+_Requires_lock_held_(Context->PolicyUpdateLock)
+VOID
+SecureHostFlushInvalidationsLocked(
+    _Inout_ PDRIVER_CONTEXT Context
+)
+{
+    const SECUREHOST_DEVICE_POLICY* policy;
+    volatile LONG64* slot;
+    LONG64 cached;
+    ULONG i;
+
+    for (i = 0; i < SECUREHOST_DEVICE_TYPE_COUNT; i++) {
+        if (Context->StaleDeviceTypes & (1u << i)) {
+            InterlockedIncrement(&Context->PolicyGeneration[i]);
+        }
+    }
+
+    for (i = 0; i < Context->StalePolicyCount; i++) {
+        policy = &Context->StalePolicies[i];
+        if (Context->StaleDeviceTypes & (1u << policy->DeviceType)) {
+            continue;
+        }
+
+        slot = &Context->DecisionCache[policy->DeviceType][SecureHostDecisionSlot(policy->ProcessId)];
+        cached = ReadNoFence64(slot);
+
+        if ((UINT32)((UINT64)cached >> 32) == policy->ProcessId) {
+            InterlockedCompareExchange64(slot, 0, cached);
+        }
+    }
+
+    Context->StaleDeviceTypes = 0;
+    Context->StalePolicyCount = 0;
+}
+
+/*++
+
+Routine Description:
+    Publishes the working policies as a new snapshot, retires the old one
+    and drops the verdicts the changes made stale. Snapshot must have room
+    for PolicyCount policies; it is consumed.
+
+    Checks read the snapshot and fill the decision cache within one
+    DISPATCH_LEVEL section. Once the grace period is over no check can
+    still hold the old snapshot, or be about to cache a verdict computed
+    from it, so invalidating after that needs no lock on the check path.
+    Until then a check may still return a verdict from before the change.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostPublishDevicePoliciesLocked(
+    PDRIVER_CONTEXT Context,
+    PSECUREHOST_POLICY_SNAPSHOT Snapshot
+)
+{
+    PSECUREHOST_POLICY_SNAPSHOT previous;
+
+    PAGED_CODE();
+
+    Snapshot->Generation = ++Context->PolicySnapshotGeneration;
+    Snapshot->Count = Context->PolicyCount;
+    Snapshot->Reserved = 0;
+
+    if (Context->PolicyCount != 0) {
+        RtlCopyMemory(Snapshot->Policies, Context->Policies,
+                      Context->PolicyCount * sizeof(SECUREHOST_DEVICE_POLICY));
+    }
+
+    previous = (PSECUREHOST_POLICY_SNAPSHOT)InterlockedExchangePointer(
+        (PVOID volatile*)&Context->ActivePolicies,
+        Snapshot
+    );
+
+    SecureHostWaitForPolicyReaders(Context);
+    SecureHostFlushInvalidationsLocked(Context);
+
+    if (previous != NULL) {
+        ExFreePoolWithTag(previous, SECUREHOST_DEVICE_TAG);
+    }
+}
+
+/*++
+
+Routine Description:
+    Grace period DPC. Runs once on each processor after every DISPATCH_LEVEL
+    section that was active at queue time has finished.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostGracePeriodDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+)
+{
+    PSECUREHOST_GRACE_PERIOD gracePeriod = (PSECUREHOST_GRACE_PERIOD)DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (InterlockedDecrement(&gracePeriod->Pending) == 0) {
+        KeSetEvent(&gracePeriod->Done, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+/*++
+
+Routine Description:
+    Waits for all processors to pass through a quiescent state, so that
+    no check still holds a pointer to a retired snapshot. The caller holds
+    PolicyUpdateLock, which also guards the DPC array.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostWaitForPolicyReaders(
+    PDRIVER_CONTEXT Context
+)
+{
+    SECUREHOST_GRACE_PERIOD gracePeriod;
+    ULONG processorCount;
+    ULONG i;
+
+    PAGED_CODE();
+
+    processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (processorCount > Context->GracePeriodDpcCount) {
+        processorCount = Context->GracePeriodDpcCount;
+    }
+
+    KeInitializeEvent(&gracePeriod.Done, NotificationEvent, FALSE);
+    gracePeriod.Pending = (LONG)processorCount;
+
+    for (i = 0; i < processorCount; i++) {
+        PROCESSOR_NUMBER processor;
+        PKDPC dpc = &Context->GracePeriodDpcs[i];
+
+        KeInitializeDpc(dpc, SecureHostGracePeriodDpc, &gracePeriod);
+
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor)) &&
+            NT_SUCCESS(KeSetTargetProcessorDpcEx(dpc, &processor))) {
+            KeSetImportanceDpc(dpc, HighImportance);
+            KeInsertQueueDpc(dpc, NULL, NULL);
+        } else if (InterlockedDecrement(&gracePeriod.Pending) == 0) {
+            KeSetEvent(&gracePeriod.Done, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    KeWaitForSingleObject(&gracePeriod.Done, Executive, KernelMode, FALSE, NULL);
+}
+
+/*++
+
+Routine Description:
+    Removes the device policy with the given rule ID from the working
+    copy. The last policy moves into the freed slot; evaluation does not
+    depend on order.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostRemoveDevicePolicyLocked(
+    PDRIVER_CONTEXT Context,
+    UINT64 RuleId
+)
+{
+    PSECUREHOST_POLICY_NAME name;
+    ULONG index;
+    ULONG last;
+
+    PAGED_CODE();
+
+    index = SecureHostFindDevicePolicy(Context, RuleId);
+    if (index == Context->PolicyCount) {
+        return STATUS_NOT_FOUND;
+    }
+
+    last = Context->PolicyCount - 1;
+    name = Context->PolicyInfo[index].ProcessName;
+
+    SecureHostQueueInvalidationLocked(Context, &Context->Policies[index]);
+
+    Context->PolicyInfo[index] = Context->PolicyInfo[last];
+    Context->Policies[index] = Context->Policies[last];
+    Context->PolicyCount = last;
+
+    SecureHostReleaseName(name);
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Process notification callback. Keeps the process metadata cache and
+    clears the exiting process's decision cache slots. A process cannot
+    exit with an access check in flight, so no slot is refilled for it
+    afterwards.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostProcessNotify(
+    PEPROCESS Process,
+    HANDLE ProcessId,
+    PPS_CREATE_NOTIFY_INFO CreateInfo
+)
+{
+    PDRIVER_CONTEXT context = SecureHostDriverContext;
+    UINT32 processId;
+    ULONG slot;
+    ULONG type;
+    LONG64 cached;
+
+    PAGED_CODE();
+
+    if (context->ProcessNotifyRegistered) {
+        SecureHostProcessCacheNotify(&context->ProcessCache, Process, ProcessId, CreateInfo);
+    }
+
+    if (CreateInfo != NULL) {
+        return;
+    }
+
+    processId = HandleToUlong(ProcessId);
+    slot = SecureHostDecisionSlot(processId);
+
+    for (type = 0; type < SECUREHOST_DEVICE_TYPE_COUNT; type++) {
+        cached = ReadNoFence64(&context->DecisionCache[type][slot]);
+
+        //
+        // Leave the slot alone if another process has taken it over
+        //
+        if ((UINT32)((UINT64)cached >> 32) == processId) {
+            InterlockedCompareExchange64(&context->DecisionCache[type][slot], 0, cached);
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Sums the per-processor counters into a statistics snapshot. Counters
+    are read without synchronization; the snapshot is not atomic.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostQueryStatistics(
+    PDRIVER_CONTEXT Context,
+    PSECUREHOST_STATISTICS Statistics
+)
+{
+    const SECUREHOST_POLICY_SNAPSHOT* snapshot;
+    const SECUREHOST_COUNTERS* counters;
+    LARGE_INTEGER frequency;
+    KIRQL oldIrql;
+    ULONG cpu;
+    ULONG bucket;
+
+    RtlZeroMemory(Statistics, sizeof(SECUREHOST_STATISTICS));
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Statistics->Version = SECUREHOST_STATISTICS_VERSION;
+    Statistics->ProcessorCount = Context->CpuCounterCount;
+    Statistics->PerformanceFrequency = (UINT64)frequency.QuadPart;
+
+    //
+    // Snapshots are only dereferenced at DISPATCH_LEVEL
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    snapshot = (const SECUREHOST_POLICY_SNAPSHOT*)ReadPointerAcquire(
+        (PVOID const volatile*)&Context->ActivePolicies);
+
+    if (snapshot != NULL) {
+        Statistics->RuleTableGeneration = snapshot->Generation;
+        Statistics->RuleCount = snapshot->Count;
+    }
+
+    KeLowerIrql(oldIrql);
+
+    for (cpu = 0; cpu < Context->CpuCounterCount; cpu++) {
+        counters = &Context->CpuCounters[cpu].Counters;
+
+        Statistics->Totals.Classifications += ReadULong64NoFence(&counters->Classifications);
+        Statistics->Totals.Permits += ReadULong64NoFence(&counters->Permits);
+        Statistics->Totals.Blocks += ReadULong64NoFence(&counters->Blocks);
+        Statistics->Totals.CacheHits += ReadULong64NoFence(&counters->CacheHits);
+        Statistics->Totals.RuleLookups += ReadULong64NoFence(&counters->RuleLookups);
+        Statistics->Totals.EventsDropped += ReadULong64NoFence(&counters->EventsDropped);
+        Statistics->Totals.LockContentions += ReadULong64NoFence(&counters->LockContentions);
+
+        for (bucket = 0; bucket < SECUREHOST_LATENCY_BUCKETS; bucket++) {
+            Statistics->Totals.LookupLatency[bucket] +=
+                ReadULong64NoFence(&counters->LookupLatency[bucket]);
+            Statistics->Totals.VerdictLatency[bucket] +=
+                ReadULong64NoFence(&counters->VerdictLatency[bucket]);
+            Statistics->Totals.DecisionLatency[bucket] +=
+                ReadULong64NoFence(&counters->DecisionLatency[bucket]);
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Times policy scans with a synthetic workload. Inputs for a batch are
+    generated and the batch timed against one snapshot at DISPATCH_LEVEL,
+    so the scan sees the same memory a real check does. Bypasses the decision cache
+    and does not touch the statistics counters.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostRunBenchmark(
+    PDRIVER_CONTEXT Context,
+    const SECUREHOST_BENCHMARK_INPUT* Input,
+    PSECUREHOST_BENCHMARK_RESULT Result
+)
+{
+    const SECUREHOST_POLICY_SNAPSHOT* snapshot;
+    UINT8 deviceTypes[SECUREHOST_BENCHMARK_BATCH];
+    UINT32 processIds[SECUREHOST_BENCHMARK_BATCH];
+    const SECUREHOST_DEVICE_POLICY* policies;
+    ULONG policyCount;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LONGLONG elapsed;
     KIRQL oldIrql;
-    PLIST_ENTRY entry;
-    NTSTATUS status = STATUS_ACCESS_DENIED;
+    UINT32 state;
+    UINT32 batch;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (Input->Version != SECUREHOST_BENCHMARK_VERSION ||
+        Input->Batches == 0 ||
+        Input->Batches > SECUREHOST_BENCHMARK_MAX_BATCHES ||
+        Input->HitPercent > 100) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Result, sizeof(SECUREHOST_BENCHMARK_RESULT));
+    KeQueryPerformanceCounter(&frequency);
+
+    Result->Version = SECUREHOST_BENCHMARK_VERSION;
+    Result->OperationsPerBatch = SECUREHOST_BENCHMARK_BATCH;
+    Result->PerformanceFrequency = (UINT64)frequency.QuadPart;
+
+    state = (Input->Seed != 0) ? Input->Seed : (UINT32)frequency.QuadPart | 1;
+
+    for (batch = 0; batch < Input->Batches; batch++) {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+        snapshot = (const SECUREHOST_POLICY_SNAPSHOT*)ReadPointerAcquire(
+            (PVOID const volatile*)&Context->ActivePolicies);
+        policies = (snapshot != NULL) ? snapshot->Policies : NULL;
+        policyCount = (snapshot != NULL) ? snapshot->Count : 0;
+
+        for (i = 0; i < SECUREHOST_BENCHMARK_BATCH; i++) {
+            SecureHostSynthesizeDeviceRequest(
+                policies,
+                policyCount,
+                SECUREHOST_DEVICE_TYPE_COUNT,
+                Input->HitPercent,
+                &state,
+                &deviceTypes[i],
+                &processIds[i]);
+        }
+
+        start = KeQueryPerformanceCounter(NULL);
+
+        for (i = 0; i < SECUREHOST_BENCHMARK_BATCH; i++) {
+            if (SecureHostScanDevicePolicies(policies, policyCount,
+                                             deviceTypes[i], processIds[i])) {
+                Result->Matches++;
+            }
+        }
+
+        elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart;
+        Result->RuleCount = policyCount;
+
+        KeLowerIrql(oldIrql);
+
+        Result->TotalTicks += (UINT64)elapsed;
+        Result->BatchLatency[SecureHostLatencyBucket(elapsed)]++;
+        Result->Batches++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Orders GUIDs field by field, as SecureHostClassTypes is sorted.
+
+--*/
+FORCEINLINE
+LONG
+SecureHostCompareGuid(
+    _In_ const GUID* Left,
+    _In_ const GUID* Right
+)
+{
+    ULONG i;
+
+    if (Left->Data1 != Right->Data1) {
+        return (Left->Data1 < Right->Data1) ? -1 : 1;
+    }
+
+    if (Left->Data2 != Right->Data2) {
+        return (Left->Data2 < Right->Data2) ? -1 : 1;
+    }
+
+    if (Left->Data3 != Right->Data3) {
+        return (Left->Data3 < Right->Data3) ? -1 : 1;
+    }
+
+    for (i = 0; i < sizeof(Left->Data4); i++) {
+        if (Left->Data4[i] != Right->Data4[i]) {
+            return (Left->Data4[i] < Right->Data4[i]) ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+/*++
+
+Routine Description:
+    Combines two classifications: anything known beats unknown, and
+    anything more specific beats plain USB.
+
+--*/
+FORCEINLINE
+SECUREHOST_DEVICE_TYPE
+SecureHostRefineDeviceType(
+    _In_ SECUREHOST_DEVICE_TYPE Current,
+    _In_ SECUREHOST_DEVICE_TYPE Candidate
+)
+{
+    if (Current == DeviceTypeUnknown ||
+        (Current == DeviceTypeUSB && Candidate != DeviceTypeUnknown)) {
+        return Candidate;
+    }
+
+    return Current;
+}
+
+/*++
+
+Routine Description:
+    Compares a prefix table entry with a device ID, ignoring the ID's
+    case. Returns 0 if the entry is a prefix of the ID, otherwise the
+    entry's order relative to the ID.
+
+--*/
+FORCEINLINE
+LONG
+SecureHostCompareIdPrefix(
+    _In_ const SECUREHOST_ID_PREFIX_TYPE* Entry,
+    _In_reads_(IdLength) PCWCH Id,
+    _In_ SIZE_T IdLength
+)
+{
+    SIZE_T i;
+    WCHAR c;
+
+    for (i = 0; i < Entry->Length; i++) {
+        if (i == IdLength) {
+            return 1;
+        }
+
+        c = RtlUpcaseUnicodeChar(Id[i]);
+        if (Entry->Prefix[i] != c) {
+            return (Entry->Prefix[i] < c) ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+/*++
+
+Routine Description:
+    Maps a setup class GUID to a device type.
+
+--*/
+static
+SECUREHOST_DEVICE_TYPE
+SecureHostClassifyClassGuid(
+    _In_ const GUID* ClassGuid
+)
+{
+    ULONG low = 0;
+    ULONG high = RTL_NUMBER_OF(SecureHostClassTypes);
+    ULONG mid;
+    LONG order;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        order = SecureHostCompareGuid(&SecureHostClassTypes[mid].ClassGuid, ClassGuid);
+
+        if (order == 0) {
+            return SecureHostClassTypes[mid].DeviceType;
+        }
+
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return DeviceTypeUnknown;
+}
+
+/*++
+
+Routine Description:
+    Maps a hardware or compatible ID to the type of its longest known
+    prefix. Prefixes of the ID sort at or before it, and a longer one
+    sorts after a shorter one it extends, so the nearest match at or
+    below the bisection point is the longest.
+
+--*/
+static
+SECUREHOST_DEVICE_TYPE
+SecureHostClassifyDeviceId(
+    _In_reads_(IdLength) PCWCH Id,
+    _In_ SIZE_T IdLength
+)
+{
+    ULONG low = 0;
+    ULONG high = RTL_NUMBER_OF(SecureHostIdPrefixTypes);
+    ULONG mid;
+
+    //
+    // First entry ordered after the ID
+    //
+    while (low < high) {
+        mid = low + (high - low) / 2;
+
+        if (SecureHostCompareIdPrefix(&SecureHostIdPrefixTypes[mid], Id, IdLength) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    while (low-- > 0) {
+        if (SecureHostCompareIdPrefix(&SecureHostIdPrefixTypes[low], Id, IdLength) == 0) {
+            return SecureHostIdPrefixTypes[low].DeviceType;
+        }
+    }
+
+    return DeviceTypeUnknown;
+}
+
+/*++
+
+Routine Description:
+    Classifies each ID of a device ID list. Returns the first type more
+    specific than plain USB, or USB if only that matched. A list longer
+    than Buffer is queried again into pool sized by the first query.
+
+--*/
+static
+SECUREHOST_DEVICE_TYPE
+SecureHostClassifyDeviceIds(
+    _In_ PWDFDEVICE_INIT DeviceInit,
+    _In_ const DEVPROPKEY* PropertyKey,
+    _Out_writes_(SECUREHOST_DEVICE_ID_CHARS) PWCHAR Buffer
+)
+{
+    WDF_DEVICE_PROPERTY_DATA property;
+    SECUREHOST_DEVICE_TYPE result = DeviceTypeUnknown;
+    DEVPROPTYPE propertyType;
+    PWCHAR list = Buffer;
+    PWCHAR allocated = NULL;
+    ULONG length;
+    PCWCH id;
+    SIZE_T idLength;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    WDF_DEVICE_PROPERTY_DATA_INIT(&property, PropertyKey);
 
     //
-    // Search policy list
+    // The last two characters stay zero, terminating the list even if
+    // the property is not terminated
     //
-    KeAcquireSpinLock(&Context->PolicyLock, &oldIrql);
+    RtlZeroMemory(Buffer, SECUREHOST_DEVICE_ID_CHARS * sizeof(WCHAR));
+
+    status = WdfFdoInitQueryPropertyEx(
+        DeviceInit,
+        &property,
+        (SECUREHOST_DEVICE_ID_CHARS - 2) * sizeof(WCHAR),
+        Buffer,
+        &length,
+        &propertyType
+    );
+
+    if (status == STATUS_BUFFER_TOO_SMALL && length <= SECUREHOST_DEVICE_ID_MAX_BYTES) {
+        //
+        // Zeroed, with the same two spare characters
+        //
+        allocated = (PWCHAR)ExAllocatePool2(
+            POOL_FLAG_PAGED,
+            (SIZE_T)length + 2 * sizeof(WCHAR),
+            SECUREHOST_DEVICE_TAG
+        );
 
-    for (entry = Context->PolicyList.Flink;
-         entry != &Context->PolicyList;
-         entry = entry->Flink) {
+        if (allocated == NULL) {
+            return DeviceTypeUnknown;
+        }
 
-        PSECUREHOST_DEVICE_POLICY policy = CONTAINING_RECORD(
-            entry,
-            SECUREHOST_DEVICE_POLICY,
-            DeviceType
+        list = allocated;
+        status = WdfFdoInitQueryPropertyEx(
+            DeviceInit,
+            &property,
+            length,
+            list,
+            &length,
+            &propertyType
         );
+    }
 
-        if (policy->DeviceType == DeviceType &&
-            (policy->ProcessId == 0 || policy->ProcessId == ProcessId)) {
+    if (NT_SUCCESS(status) && propertyType == DEVPROP_TYPE_STRING_LIST) {
+        for (id = list; *id != UNICODE_NULL; id += idLength + 1) {
+            idLength = wcslen(id);
+            result = SecureHostRefineDeviceType(result, SecureHostClassifyDeviceId(id, idLength));
 
-            if (policy->Allowed) {
-                status = STATUS_SUCCESS;
+            if (result != DeviceTypeUnknown && result != DeviceTypeUSB) {
                 break;
             }
         }
     }
 
-    KeReleaseSpinLock(&Context->PolicyLock, oldIrql);
+    if (allocated != NULL) {
+        ExFreePoolWithTag(allocated, SECUREHOST_DEVICE_TAG);
+    }
 
-    return status;
+    return result;
 }
 
 /*++
 
 Routine Description:
-    Identifies the device type based on device properties.
+    Identifies the device type from its setup class, then its hardware
+    and compatible IDs. Must run before WdfDeviceCreate consumes
+    DeviceInit.
 
 --*/
 _Use_decl_annotations_
@@ -390,19 +2814,43 @@ SecureHostIdentifyDevice(
     PWDFDEVICE_INIT DeviceInit
 )
 {
-    UNREFERENCED_PARAMETER(DeviceInit);
+    WDF_DEVICE_PROPERTY_DATA property;
+    SECUREHOST_DEVICE_TYPE result = DeviceTypeUnknown;
+    DEVPROPTYPE propertyType;
+    GUID classGuid;
+    ULONG length;
+    WCHAR ids[SECUREHOST_DEVICE_ID_CHARS];
 
-    //
-    // In production, query device properties to identify type
-    // For now, return unknown
-    //
-    return DeviceTypeUnknown;
-}
+    PAGED_CODE();
 
-//
-// IOCTL definitions
-//
-#define IOCTL_SECUREHOST_CHECK_ACCESS \
-    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+    WDF_DEVICE_PROPERTY_DATA_INIT(&property, &DEVPKEY_Device_ClassGuid);
+
+    if (NT_SUCCESS(WdfFdoInitQueryPropertyEx(
+            DeviceInit,
+            &property,
+            sizeof(classGuid),
+            &classGuid,
+            &length,
+            &propertyType)) &&
+        propertyType == DEVPROP_TYPE_GUID) {
+        result = SecureHostClassifyClassGuid(&classGuid);
+    }
+
+    if (result != DeviceTypeUnknown && result != DeviceTypeUSB) {
+        return result;
+    }
+
+    result = SecureHostRefineDeviceType(
+        result,
+        SecureHostClassifyDeviceIds(DeviceInit, &DEVPKEY_Device_HardwareIds, ids));
+
+    if (result != DeviceTypeUnknown && result != DeviceTypeUSB) {
+        return result;
+    }
+
+    return SecureHostRefineDeviceType(
+        result,
+        SecureHostClassifyDeviceIds(DeviceInit, &DEVPKEY_Device_CompatibleIds, ids));
+}
 
 #pragma warning(pop)
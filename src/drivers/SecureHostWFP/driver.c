@@ -12,13 +12,18 @@ Environment:
 
 --*/
 
-#include <ntddk.h>
+#include <ntifs.h>
 #include <wdf.h>
 #include <fwpsk.h>
 #include <fwpmk.h>
 #include <guiddef.h>
 #include <initguid.h>
 #include <ntstrsafe.h>
+#include <wdmsec.h>
+
+#include "SecureHostMatch.h"
+#include "SecureHostWire.h"
+#include "SecureHostProcess.h"
 
 #pragma warning(push)
 #pragma warning(disable:4201) // nameless struct/union
@@ -27,6 +32,8 @@ Environment:
 // Pool tags for memory allocation tracking
 //
 #define SECUREHOST_WFP_TAG 'FWHS'  // 'SHWF' reversed
+#define SECUREHOST_FLOW_TAG 'CFHS'  // 'SHFC' reversed
+#define SECUREHOST_DECISION_TAG 'DDHS'  // 'SHDD' reversed
 
 //
 // Driver version
@@ -49,6 +56,42 @@ DEFINE_GUID(
     0xf6a7b8c9, 0xd0e1, 0x9f0a, 0x3b, 0x4c, 0x5d, 0x6e, 0x7f, 0x8a, 0x9b, 0x0c
 );
 
+// {B8C9D0E1-F2A3-1B2C-5D6E-7F8A9B0C1D2E}
+DEFINE_GUID(
+    SECUREHOST_WFP_FLOW_ESTABLISHED_V4_GUID,
+    0xb8c9d0e1, 0xf2a3, 0x1b2c, 0x5d, 0x6e, 0x7f, 0x8a, 0x9b, 0x0c, 0x1d, 0x2e
+);
+
+// {C9D0E1F2-A3B4-2C3D-6E7F-8A9B0C1D2E3F}
+DEFINE_GUID(
+    SECUREHOST_WFP_FLOW_ESTABLISHED_V6_GUID,
+    0xc9d0e1f2, 0xa3b4, 0x2c3d, 0x6e, 0x7f, 0x8a, 0x9b, 0x0c, 0x1d, 0x2e, 0x3f
+);
+
+// {D0E1F2A3-B4C5-3D4E-7F8A-9B0C1D2E3F4A}
+DEFINE_GUID(
+    SECUREHOST_WFP_STREAM_V4_GUID,
+    0xd0e1f2a3, 0xb4c5, 0x3d4e, 0x7f, 0x8a, 0x9b, 0x0c, 0x1d, 0x2e, 0x3f, 0x4a
+);
+
+// {E1F2A3B4-C5D6-4E5F-8A9B-0C1D2E3F4A5B}
+DEFINE_GUID(
+    SECUREHOST_WFP_STREAM_V6_GUID,
+    0xe1f2a3b4, 0xc5d6, 0x4e5f, 0x8a, 0x9b, 0x0c, 0x1d, 0x2e, 0x3f, 0x4a, 0x5b
+);
+
+// {F2A3B4C5-D6E7-5F6A-9B0C-1D2E3F4A5B6C}
+DEFINE_GUID(
+    SECUREHOST_WFP_DATAGRAM_DATA_V4_GUID,
+    0xf2a3b4c5, 0xd6e7, 0x5f6a, 0x9b, 0x0c, 0x1d, 0x2e, 0x3f, 0x4a, 0x5b, 0x6c
+);
+
+// {A3B4C5D6-E7F8-6A7B-0C1D-2E3F4A5B6C7D}
+DEFINE_GUID(
+    SECUREHOST_WFP_DATAGRAM_DATA_V6_GUID,
+    0xa3b4c5d6, 0xe7f8, 0x6a7b, 0x0c, 0x1d, 0x2e, 0x3f, 0x4a, 0x5b, 0x6c, 0x7d
+);
+
 // {A7B8C9D0-E1F2-0A1B-4C5D-6E7F8A9B0C1D}
 DEFINE_GUID(
     SECUREHOST_WFP_SUBLAYER_GUID,
@@ -56,402 +99,5705 @@ DEFINE_GUID(
 );
 
 //
-// Policy rule structure
+// Control device names
 //
-typedef struct _SECUREHOST_POLICY_RULE {
-    UINT64 RuleId;
+#define SECUREHOST_WFP_DEVICE_NAME      L"\\Device\\SecureHostWFP"
+#define SECUREHOST_WFP_SYMLINK_NAME     L"\\DosDevices\\SecureHostWFP"
+
+//
+// IOCTL definitions
+//
+// Replaces the whole network rule set in one call. The ruleset travels in
+// the direct (output) buffer: a SECUREHOST_RULESET_HEADER followed by
+// RuleCount SECUREHOST_NETWORK_RULE_RECORDs (see SecureHostWire.h).
+//
+#define IOCTL_SECUREHOST_LOAD_NETWORK_RULESET \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+//
+// Adds, replaces or removes individual rules of the active rule set. The
+// delta travels in the direct (output) buffer: a SECUREHOST_RULE_DELTA_HEADER
+// followed by SECUREHOST_NETWORK_RULE_DELTA_RECORDs (see SecureHostWire.h).
+// Fails with STATUS_INVALID_DEVICE_STATE unless BaseGeneration is the
+// active generation, in which case the sender reloads the whole set.
+//
+// The edited set is compiled into a fresh table as for a load, but only
+// flows whose cached verdict the edited rules can change are re-matched:
+// a flow is affected if its verdict came from an edited rule, or if an
+// inserted rule matches it. Every other verdict carries over to the new
+// generation.
+//
+#define IOCTL_SECUREHOST_UPDATE_NETWORK_RULES \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+#define SECUREHOST_MAX_RULE_DELTAS      64u
+
+//
+// Persisted ruleset
+//
+// The service keeps a copy of the last ruleset the driver accepted, in
+// the load IOCTL's format, at SECUREHOST_PERSISTED_RULESET_PATH. DriverEntry
+// loads it as soon as the callouts are registered, so policy is enforced
+// once BFE is up and the filters are in, still before the service loads
+// its rules; the service's first load replaces it by generation. The file gets
+// the same validation as an IOCTL; if it is missing or rejected the
+// driver starts without rules, as before. Rules scoped to a process ID
+// are skipped, since IDs do not survive a restart.
+//
+#define SECUREHOST_PERSISTED_RULESET_PATH \
+    L"\\SystemRoot\\System32\\drivers\\SecureHost\\NetworkRuleset.bin"
+
+#define SECUREHOST_PERSISTED_RULESET_MAX_SIZE \
+    (sizeof(SECUREHOST_RULESET_HEADER) + (SIZE_T)SECUREHOST_MAX_RULES * sizeof(SECUREHOST_NETWORK_RULE_RECORD))
+
+//
+// Maps the connection event channel into the calling process. Input is
+// the subscriber's wake event handle; output is the mapped view. The
+// mapping lives until the subscribing handle is closed.
+//
+#define IOCTL_SECUREHOST_SUBSCRIBE_EVENTS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+typedef struct _SECUREHOST_EVENT_SUBSCRIBE_INPUT {
+    UINT64 EventHandle;
+} SECUREHOST_EVENT_SUBSCRIBE_INPUT, *PSECUREHOST_EVENT_SUBSCRIBE_INPUT;
+
+typedef struct _SECUREHOST_EVENT_SUBSCRIBE_OUTPUT {
+    UINT64 BaseAddress;
+    UINT64 Size;
+} SECUREHOST_EVENT_SUBSCRIBE_OUTPUT, *PSECUREHOST_EVENT_SUBSCRIBE_OUTPUT;
+
+//
+// Connection event channel (shared with user mode)
+//
+// [channel header][ring 0][ring 1]...[ring N-1], one ring per processor.
+// Each ring has a single producer: the classify path running at
+// DISPATCH_LEVEL on that processor. The consumer owns ReadIndex. A full
+// ring drops new events rather than block the classify path.
+//
+// Repeats are coalesced before they reach a ring. Each processor keeps a
+// table of the keys it reported in the current window: process, rule,
+// verdict, protocol, direction, addresses and the service port (remote
+// port outbound, local port inbound; the ephemeral side changes on
+// every retry). The first event for a key is recorded at once. Repeats
+// only update its table entry, which at the end of the window becomes
+// one record with the repeat count and the first and last repeat times.
+// A key that finds no free entry is recorded on its own.
+//
+// Permits on a rule with an audit mode (SECUREHOST_AUDIT_MODE_*) are
+// sampled or rate limited before they become events. Each event carries
+// its Weight, the matching connections it stands for, so totals can be
+// rebuilt: a 1 in N sample weighs N, and a rate limited event also
+// counts the permits skipped since the previous one for its rule.
+//
+// Every record is traced (see SecureHostWire.h): CorrelationId, the
+// performance counter at classify entry and the ticks to the verdict. A
+// service verdict is timed from the classification that pended it and
+// keeps that classification's ID, which the decision request carried. A
+// coalesced record carries the trace of its first repeat.
+//
+#define SECUREHOST_EVENT_CHANNEL_VERSION    4u
+#define SECUREHOST_EVENT_RING_CAPACITY      4096u   // Records per ring, power of two
+#define SECUREHOST_EVENT_WATERMARK          (SECUREHOST_EVENT_RING_CAPACITY / 4)
+
+//
+// Converts milliseconds to interrupt time units (100 ns)
+//
+#define SECUREHOST_MS_TO_INTERRUPT_TIME(Milliseconds) ((UINT64)(Milliseconds) * 10000)
+
+#define SECUREHOST_AGGREGATE_WINDOW_MS      1000u
+#define SECUREHOST_AGGREGATE_ENTRIES        256u    // Per processor, power of two
+#define SECUREHOST_AGGREGATE_PROBES         8u
+
+#define SECUREHOST_UNREGISTER_RETRY_MS      10u     // Unload wait for callouts still in use
+
+#define SECUREHOST_DIRECTION_INBOUND        1u      // Matches NetworkDirection in SecureHostCore
+#define SECUREHOST_DIRECTION_OUTBOUND       2u
+
+C_ASSERT((SECUREHOST_EVENT_RING_CAPACITY & (SECUREHOST_EVENT_RING_CAPACITY - 1)) == 0);
+C_ASSERT((SECUREHOST_AGGREGATE_ENTRIES & (SECUREHOST_AGGREGATE_ENTRIES - 1)) == 0);
+
+//
+// Connection record. Addresses are in network byte order; IPv4
+// addresses occupy the first four bytes. A coalesced record keeps the
+// ports of the first connection it stands for.
+//
+typedef struct _SECUREHOST_CONNECTION_EVENT {
+    UINT64 Timestamp;       // System time (100ns units since 1601, UTC); first occurrence
+    UINT64 RuleId;          // 0 if no rule matched
+    UINT32 ProcessId;
+    UINT8 IpVersion;        // 4 or 6
+    UINT8 Protocol;
+    UINT8 Direction;        // SECUREHOST_DIRECTION_*
+    UINT8 Verdict;          // SECUREHOST_RULE_ACTION_ALLOW or _BLOCK
+    UINT16 LocalPort;
+    UINT16 RemotePort;
+    UINT32 Count;           // Connections this record stands for
+    UINT8 LocalAddress[16];
+    UINT8 RemoteAddress[16];
+    UINT64 LastTimestamp;   // Last occurrence; Timestamp when Count is 1
+    UINT64 ProcessCreateTime;   // With ProcessId, the process cache key; 0 = not cached
+    UINT32 Weight;          // Matching connections this record stands for, at least Count
+    UINT8 AuditMode;        // SECUREHOST_AUDIT_MODE_* of the rule
+    UINT8 Reserved[3];
+    UINT64 CorrelationId;
+    UINT64 ClassifyTime;    // Performance counter at classify entry
+    UINT32 VerdictTicks;    // ClassifyTime to verdict, saturating
+    UINT8 TraceFlags;       // SECUREHOST_TRACE_FLAG_*
+    UINT8 Reserved2[3];
+} SECUREHOST_CONNECTION_EVENT, *PSECUREHOST_CONNECTION_EVENT;
+
+C_ASSERT(sizeof(SECUREHOST_CONNECTION_EVENT) == 112);
+
+#define SECUREHOST_TRACE_FLAG_SERVICE_VERDICT   0x1u    // Decided by the service
+
+typedef struct _SECUREHOST_EVENT_RING {
+    volatile LONG64 WriteIndex;     // Producer
+    volatile LONG64 Dropped;        // Producer
+    UCHAR Reserved0[48];
+    volatile LONG64 ReadIndex;      // Consumer
+    UCHAR Reserved1[56];
+    SECUREHOST_CONNECTION_EVENT Records[SECUREHOST_EVENT_RING_CAPACITY];
+} SECUREHOST_EVENT_RING, *PSECUREHOST_EVENT_RING;
+
+C_ASSERT(FIELD_OFFSET(SECUREHOST_EVENT_RING, ReadIndex) == 64);
+C_ASSERT(FIELD_OFFSET(SECUREHOST_EVENT_RING, Records) == 128);
+
+typedef struct _SECUREHOST_EVENT_CHANNEL_HEADER {
+    UINT32 Version;
+    UINT32 HeaderSize;              // Offset of ring 0
+    UINT32 RingCount;
+    UINT32 RingCapacity;
+    UINT32 RingSize;                // Stride between rings
+    UINT32 RecordSize;
+    UINT32 Watermark;
+    volatile LONG WakeupArmed;      // Set by the consumer before it waits
+    UCHAR Reserved[32];
+} SECUREHOST_EVENT_CHANNEL_HEADER, *PSECUREHOST_EVENT_CHANNEL_HEADER;
+
+C_ASSERT(sizeof(SECUREHOST_EVENT_CHANNEL_HEADER) == 64);
+
+//
+// Per-processor repeat table (kernel only). Touched at DISPATCH_LEVEL by
+// its own processor: the classify path and FlushDpc, which is targeted
+// there. Entries with Repeats of 0 were recorded individually and only
+// absorb further repeats.
+//
+typedef struct _SECUREHOST_EVENT_AGGREGATE {
+    UINT32 Hash;                    // 0 = free
+    UINT32 Repeats;
+    UINT32 RepeatWeight;            // Sum of the repeats' weights
+    SECUREHOST_CONNECTION_EVENT Event;  // Key, ports, and first and last repeat
+} SECUREHOST_EVENT_AGGREGATE, *PSECUREHOST_EVENT_AGGREGATE;
+
+typedef struct DECLSPEC_CACHEALIGN _SECUREHOST_EVENT_AGGREGATOR {
+    UINT64 WindowEnd;               // Interrupt time; 0 = no window open
+    ULONG Occupied;
+    BOOLEAN FlushTargeted;          // FlushDpc runs on this processor
+    KDPC FlushDpc;
+    SECUREHOST_EVENT_AGGREGATE Entries[SECUREHOST_AGGREGATE_ENTRIES];
+} SECUREHOST_EVENT_AGGREGATOR, *PSECUREHOST_EVENT_AGGREGATOR;
+
+//
+// Returns aggregated driver counters (SECUREHOST_STATISTICS). Shares its
+// code with the device driver's statistics query.
+//
+#define IOCTL_SECUREHOST_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Statistics
+//
+// Counters are kept per processor, one cache-line-aligned block each, and
+// only ever updated at DISPATCH_LEVEL by the processor that owns the
+// block, so plain increments suffice. The query sums all blocks; totals
+// are approximate while traffic is flowing.
+//
+// Lookup latency is sampled on one lookup in SECUREHOST_LATENCY_SAMPLE_RATE
+// and bucketed by log2 of the elapsed performance counter ticks: bucket 0
+// is under one tick, bucket n covers [2^(n-1), 2^n) ticks and the last
+// bucket is open-ended. Verdict latency (classify entry to verdict) is
+// kept the same way for every auth-connect classification decided in
+// the driver, and decision latency (pend to the service's verdict on
+// reauthorization) for those decided by the service.
+//
+// Version 2 appends VerdictLatency and DecisionLatency.
+//
+#define SECUREHOST_STATISTICS_VERSION   2u
+#define SECUREHOST_LATENCY_BUCKETS      16u
+#define SECUREHOST_LATENCY_SAMPLE_RATE  16u     // Power of two
+
+C_ASSERT((SECUREHOST_LATENCY_SAMPLE_RATE & (SECUREHOST_LATENCY_SAMPLE_RATE - 1)) == 0);
+
+typedef struct _SECUREHOST_COUNTERS {
+    UINT64 Classifications;
+    UINT64 Permits;
+    UINT64 Blocks;
+    UINT64 CacheHits;               // Verdicts served from a flow context
+    UINT64 RuleLookups;
+    UINT64 EventsDropped;
+    UINT64 LockContentions;
+    UINT64 LookupLatency[SECUREHOST_LATENCY_BUCKETS];
+    UINT64 VerdictLatency[SECUREHOST_LATENCY_BUCKETS];
+    UINT64 DecisionLatency[SECUREHOST_LATENCY_BUCKETS];
+} SECUREHOST_COUNTERS, *PSECUREHOST_COUNTERS;
+
+typedef struct DECLSPEC_CACHEALIGN _SECUREHOST_CPU_COUNTERS {
+    SECUREHOST_COUNTERS Counters;
+    UINT64 TraceSequence;           // Last correlation ID sequence issued here
+} SECUREHOST_CPU_COUNTERS, *PSECUREHOST_CPU_COUNTERS;
+
+C_ASSERT(sizeof(SECUREHOST_CPU_COUNTERS) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0);
+
+typedef struct _SECUREHOST_STATISTICS {
+    UINT32 Version;
+    UINT32 ProcessorCount;
+    UINT64 PerformanceFrequency;    // Ticks per second for LookupLatency
+    UINT64 RuleTableGeneration;     // 0 if no table is published
+    UINT32 RuleCount;
+    UINT32 OffloadedRuleCount;      // Rules also enforced by native filters
+    SECUREHOST_COUNTERS Totals;
+} SECUREHOST_STATISTICS, *PSECUREHOST_STATISTICS;
+
+C_ASSERT(sizeof(SECUREHOST_STATISTICS) == 472);
+
+//
+// Runs the rule lookup against the active table with a synthetic
+// workload and returns its timing (SECUREHOST_BENCHMARK_INPUT / _RESULT).
+// Same code and layout in the device driver.
+//
+// Lookups run in batches at DISPATCH_LEVEL, as in the classify path.
+// Inputs for a batch are generated before its timer starts; BatchLatency
+// buckets whole batches by log2 of their ticks, like LookupLatency.
+//
+#define IOCTL_SECUREHOST_RUN_BENCHMARK \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define SECUREHOST_BENCHMARK_VERSION        1u
+#define SECUREHOST_BENCHMARK_BATCH          64u     // Operations per timed batch
+#define SECUREHOST_BENCHMARK_MAX_BATCHES    16384u
+
+typedef struct _SECUREHOST_BENCHMARK_INPUT {
+    UINT32 Version;
+    UINT32 Batches;
+    UINT32 Seed;                    // 0 picks one
+    UINT32 HitPercent;              // Inputs derived from loaded policy, 0-100
+} SECUREHOST_BENCHMARK_INPUT, *PSECUREHOST_BENCHMARK_INPUT;
+
+typedef struct _SECUREHOST_BENCHMARK_RESULT {
+    UINT32 Version;
+    UINT32 Batches;
+    UINT32 OperationsPerBatch;
+    UINT32 RuleCount;               // Policy size the run was measured against
+    UINT64 PerformanceFrequency;
+    UINT64 TotalTicks;
+    UINT64 Matches;                 // Operations that matched a rule
+    UINT64 BatchLatency[SECUREHOST_LATENCY_BUCKETS];
+} SECUREHOST_BENCHMARK_RESULT, *PSECUREHOST_BENCHMARK_RESULT;
+
+C_ASSERT(sizeof(SECUREHOST_BENCHMARK_RESULT) == 168);
+
+//
+// Deferred decisions
+//
+// Connections matching a deferred rule depend on conditions only the
+// service can evaluate (process path, user, remote address). The
+// auth-connect callout pends them with FwpsPendOperation0 and queues a
+// decision request. The service collects requests in batches by keeping
+// an IOCTL_SECUREHOST_FETCH_DECISIONS call outstanding, and answers with
+// IOCTL_SECUREHOST_COMPLETE_DECISIONS. Completing the pended operation
+// makes WFP reauthorize the connection; that classify applies the
+// decided verdict, and flow establishment stores it on the flow's cache
+// entry.
+//
+// At most SECUREHOST_MAX_PENDED_DECISIONS connections wait at once. Past
+// that, with no service attached, or once a request is older than
+// SECUREHOST_DECISION_TIMEOUT_MS, the deferred rule's own action applies.
+// Only the handle that fetched first may answer; closing it releases
+// every waiting connection to the fallback.
+//
+#define IOCTL_SECUREHOST_FETCH_DECISIONS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_SECUREHOST_COMPLETE_DECISIONS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define SECUREHOST_MAX_PENDED_DECISIONS     1024u
+#define SECUREHOST_DECISION_TIMEOUT_MS      1000u
+#define SECUREHOST_DECISION_RETENTION_MS    5000u   // Kept for reauth and flow establishment
+#define SECUREHOST_DECISION_TIMER_MS        100u
+#define SECUREHOST_DECISION_FLUSH_BATCH     32u     // Completions per lock hold
+
+//
+// Fetch output: one record per waiting connection. Addresses as in
+// SECUREHOST_CONNECTION_EVENT.
+//
+typedef struct _SECUREHOST_DECISION_REQUEST {
+    UINT64 RequestId;
+    UINT64 RuleId;                  // Deferred rule that matched
     UINT32 ProcessId;
-    UINT16 Protocol;
+    UINT8 IpVersion;
+    UINT8 Protocol;
+    UINT8 Direction;                // SECUREHOST_DIRECTION_*
+    UINT8 Reserved0;
     UINT16 LocalPort;
     UINT16 RemotePort;
-    UINT32 Action;  // FWP_ACTION_BLOCK or FWP_ACTION_PERMIT
-    BOOLEAN Enabled;
-} SECUREHOST_POLICY_RULE, *PSECUREHOST_POLICY_RULE;
+    UINT32 Reserved1;
+    UCHAR LocalAddress[16];
+    UCHAR RemoteAddress[16];
+    UINT64 ProcessCreateTime;       // As in SECUREHOST_CONNECTION_EVENT
+    UINT64 CorrelationId;           // Carried by the event reported on reauthorization
+    UINT64 PendTime;                // Performance counter at classify entry
+} SECUREHOST_DECISION_REQUEST, *PSECUREHOST_DECISION_REQUEST;
+
+C_ASSERT(sizeof(SECUREHOST_DECISION_REQUEST) == 88);
+
+//
+// Complete input: any number of responses. Unknown IDs (already timed
+// out) are ignored.
+//
+typedef struct _SECUREHOST_DECISION_RESPONSE {
+    UINT64 RequestId;
+    UINT32 Verdict;                 // SECUREHOST_RULE_ACTION_*
+    UINT32 Reserved;
+} SECUREHOST_DECISION_RESPONSE, *PSECUREHOST_DECISION_RESPONSE;
+
+C_ASSERT(sizeof(SECUREHOST_DECISION_RESPONSE) == 16);
+
+//
+// Process metadata query (SecureHostWire.h). Connection events and
+// decision requests carry the process creation time; the service resolves
+// the (ProcessId, ProcessCreateTime) pair here once and caches the result.
+//
+#define IOCTL_SECUREHOST_QUERY_PROCESSES \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Native filter offload
+//
+// Rules that only constrain protocol and ports are also installed as
+// plain BFE filters on the ALE auth-connect layers, weighted above the
+// catch-all callout filter in the SecureHost sublayer, so BFE settles
+// matching connections without a callout round trip. A rule is only
+// offloaded if no earlier callout-only rule could match the same
+// connection with a different outcome, which keeps rule order intact.
+// Offloaded rules stay in the compiled table for the flow layers.
+//
+#define SECUREHOST_MAX_OFFLOAD_RULES    1024u   // Per load, one filter per family
+#define SECUREHOST_MAX_OFFLOAD_BARRIERS 256u    // Callout-only rules checked per candidate
+#define SECUREHOST_CALLOUT_FILTER_WEIGHT 0ull   // Offloaded filters weigh 1..N
+
+//
+// A rule edited by a delta, as checked against cached flow verdicts.
+// Match is the inserted rule compiled for matching (Matches is FALSE for
+// a removal or a disabled rule); Prefix is its masked remote prefix.
+//
+typedef struct _SECUREHOST_RULE_CHANGE {
+    UINT64 RuleId;
+    BOOLEAN Matches;
+    UINT8 RemoteIpVersion;
+    SECUREHOST_COMPILED_RULE Match;
+    SECUREHOST_REMOTE_PREFIX Prefix;
+} SECUREHOST_RULE_CHANGE, *PSECUREHOST_RULE_CHANGE;
+
+//
+// How a connection is to be reported (SecureHostEvaluateConnection)
+//
+typedef struct _SECUREHOST_AUDIT_SAMPLE {
+    UINT32 Weight;                  // Connections its event stands for; 0 = not reported
+    UINT8 Mode;                     // SECUREHOST_AUDIT_MODE_* of the matching rule
+} SECUREHOST_AUDIT_SAMPLE, *PSECUREHOST_AUDIT_SAMPLE;
+
+//
+// Rate limited audit bucket: last refill (interrupt time, ms) above
+// the token count, which fits as SECUREHOST_MAX_AUDIT_RATE does
+//
+#define SECUREHOST_AUDIT_TOKEN_BITS     20u
+#define SECUREHOST_AUDIT_TOKEN_MASK     ((1ull << SECUREHOST_AUDIT_TOKEN_BITS) - 1)
+
+C_ASSERT(SECUREHOST_MAX_AUDIT_RATE <= SECUREHOST_AUDIT_TOKEN_MASK);
+
+//
+// Run-time callouts registered by the driver
+//
+typedef enum _SECUREHOST_CALLOUT_INDEX {
+    SecureHostCalloutAuthConnectV4 = 0,
+    SecureHostCalloutAuthConnectV6,
+    SecureHostCalloutFlowEstablishedV4,
+    SecureHostCalloutFlowEstablishedV6,
+    SecureHostCalloutStreamV4,
+    SecureHostCalloutStreamV6,
+    SecureHostCalloutDatagramDataV4,
+    SecureHostCalloutDatagramDataV6,
+    SecureHostCalloutMax
+} SECUREHOST_CALLOUT_INDEX;
+
+//
+// Per-flow verdict cache entry, associated with the stream or datagram
+// data layer of a permitted flow. VerdictState packs the rule table
+// generation the verdict was computed against with the blocked bit:
+// (Generation << 1) | Blocked. A stale generation forces a re-match;
+// a rule delta moves the entries it cannot affect to the new generation.
+//
+typedef struct _SECUREHOST_FLOW_CONTEXT {
+    LIST_ENTRY Link;
+    UINT64 FlowHandle;
+    UINT16 LayerId;
+    BOOLEAN OnList;
+    UINT32 CalloutId;
+    SECUREHOST_CONNECTION_KEY Key;
+    volatile LONG64 VerdictState;
+    volatile UINT64 RuleId;
+    BOOLEAN ServicePermitted;       // Re-matching a deferred rule keeps the permit
+} SECUREHOST_FLOW_CONTEXT, *PSECUREHOST_FLOW_CONTEXT;
+
+#define SECUREHOST_VERDICT_STATE(Generation, Blocked) \
+    ((LONG64)(((Generation) << 1) | ((Blocked) ? 1u : 0u)))
+
+//
+// Connection pended on a deferred rule. Queued until fetched, Delivered
+// until answered or timed out, then Decided until its reauthorization
+// applies the verdict. A permit stays Applied until flow establishment
+// picks it up. Deadline (interrupt time) is the timeout while pending
+// and the retention limit afterwards.
+//
+typedef enum _SECUREHOST_DECISION_STATE {
+    SecureHostDecisionQueued = 0,
+    SecureHostDecisionDelivered,
+    SecureHostDecisionDecided,
+    SecureHostDecisionApplied
+} SECUREHOST_DECISION_STATE;
+
+//
+// Trace of one verdict: its correlation ID (0 = not issued yet) and the
+// performance counter it is timed from
+//
+typedef struct _SECUREHOST_VERDICT_TRACE {
+    UINT64 CorrelationId;
+    UINT64 StartTime;
+} SECUREHOST_VERDICT_TRACE, *PSECUREHOST_VERDICT_TRACE;
+
+typedef struct _SECUREHOST_PENDED_CONNECTION {
+    LIST_ENTRY Link;
+    UINT64 RequestId;
+    UINT64 RuleId;
+    UINT64 Deadline;
+    UINT64 ProcessCreateTime;
+    UINT64 CorrelationId;
+    UINT64 PendTime;
+    HANDLE CompletionContext;
+    SECUREHOST_CONNECTION_KEY Key;
+    FWP_ACTION_TYPE Fallback;
+    FWP_ACTION_TYPE Verdict;
+    SECUREHOST_DECISION_STATE State;
+} SECUREHOST_PENDED_CONNECTION, *PSECUREHOST_PENDED_CONNECTION;
 
 //
 // Global driver context
 //
 typedef struct _SECUREHOST_DRIVER_CONTEXT {
     WDFDRIVER Driver;
+    WDFDEVICE ControlDevice;
     HANDLE EngineHandle;
-    UINT32 CalloutIdV4;
-    UINT32 CalloutIdV6;
-    UINT32 FilterIdV4;
-    UINT32 FilterIdV6;
-    KSPIN_LOCK RulesLock;
-    LIST_ENTRY RulesList;
+    UINT32 CalloutIds[SecureHostCalloutMax];
+
+    //
+    // BFE state subscription. Callouts are registered without BFE; the
+    // session behind EngineHandle is opened by BfeWorkItem once BFE is
+    // running, and closed when it stops. The callback only queues the
+    // work item after DriverEntry sets BfeWorkArmed.
+    //
+    HANDLE BfeStateHandle;
+    WDFWORKITEM BfeWorkItem;
+    volatile LONG BfeWorkArmed;
+
+    //
+    // Catch-all filters routing each layer to its callout, and native
+    // filters for offloaded rules. Filters live in a dynamic BFE session
+    // and disappear when EngineHandle is closed. The offload set is only
+    // touched from RulesetQueue, which runs one load at a time, or from
+    // BfeWorkItem with RulesetQueue stopped.
+    //
+    UINT64 CalloutFilterIds[SecureHostCalloutMax];
+    PUINT64 OffloadFilterIds;
+    UINT32 OffloadFilterCount;
+    volatile LONG OffloadedRuleCount;
+    WDFQUEUE RulesetQueue;
+
+    //
+    // Source rules of the active table, in precedence order, kept for
+    // deltas to edit. Only touched from RulesetQueue.
+    //
+    PSECUREHOST_POLICY_RULE SourceRules;
+    UINT32 SourceRuleCount;
+
+    //
+    // Active compiled rule table. Read by the classify path without locks
+    // at DISPATCH_LEVEL; replaced by writers holding RuleTableMutex.
+    //
+    PSECUREHOST_RULE_TABLE volatile ActiveRuleTable;
+    FAST_MUTEX RuleTableMutex;
+    UINT64 RuleTableGeneration;
+
+    //
+    // Per-processor DPCs used to wait out readers of a retired table
+    //
+    PKDPC GracePeriodDpcs;
+    ULONG GracePeriodDpcCount;
+
+    //
+    // Per-flow verdict cache. Live contexts are tracked so unload can
+    // detach them from flows that outlive the driver. Once
+    // FlowContextsStopping is set (under FlowListLock) no new context is
+    // attached.
+    //
+    LOOKASIDE_LIST_EX FlowContextLookaside;
+    BOOLEAN FlowContextLookasideInitialized;
+    KSPIN_LOCK FlowListLock;
+    LIST_ENTRY FlowList;
+    BOOLEAN FlowContextsStopping;
+
+    //
+    // Deferred decisions, guarded by DecisionLock. Each entry is on
+    // exactly one list, by state. DecisionClient is the file object
+    // allowed to fetch and answer (NULL = no service attached); parked
+    // fetch requests wait in DecisionRequestQueue. DecisionTimer runs
+    // while any entry exists.
+    //
+    LOOKASIDE_LIST_EX DecisionLookaside;
+    BOOLEAN DecisionLookasideInitialized;
+    KSPIN_LOCK DecisionLock;
+    LIST_ENTRY QueuedDecisions;
+    LIST_ENTRY DeliveredDecisions;
+    LIST_ENTRY DecidedConnections;
+    ULONG DecisionCount;
+    UINT64 NextDecisionId;
+    WDFFILEOBJECT volatile DecisionClient;
+    WDFQUEUE DecisionRequestQueue;
+    KTIMER DecisionTimer;
+    KDPC DecisionTimerDpc;
+    BOOLEAN DecisionTimerArmed;
+    BOOLEAN DecisionsClosed;
+
+    //
+    // Connection event channel. Allocated on first subscribe and kept
+    // until unload; producers only write while EventSignal is set.
+    // Subscription state is guarded by EventChannelMutex. The flush
+    // timer runs while subscribed and closes each processor's repeat
+    // window. The user view lives in EventSubscriberProcess, referenced
+    // until the view is unmapped, which may happen from another process.
+    //
+    PSECUREHOST_EVENT_CHANNEL_HEADER EventChannel;
+    SIZE_T EventChannelSize;
+    ULONG EventRingCount;
+    PSECUREHOST_EVENT_AGGREGATOR EventAggregators;  // EventRingCount entries
+    KTIMER EventFlushTimer;
+    KDPC EventFlushTimerDpc;
+    PMDL EventChannelMdl;
+    PKEVENT volatile EventSignal;
+    PVOID EventUserAddress;
+    PEPROCESS EventSubscriberProcess;
+    WDFFILEOBJECT EventSubscriber;
+    FAST_MUTEX EventChannelMutex;
+
+    //
+    // Per-processor counters, indexed by processor number
+    //
+    PSECUREHOST_CPU_COUNTERS CpuCounters;
+    ULONG CpuCounterCount;
+
+    //
+    // Process metadata cache, filled by SecureHostProcessNotify while
+    // ProcessNotifyRegistered is set
+    //
+    SECUREHOST_PROCESS_CACHE ProcessCache;
+    BOOLEAN ProcessNotifyRegistered;
+
     UINT64 NextRuleId;
 } SECUREHOST_DRIVER_CONTEXT, *PSECUREHOST_DRIVER_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SECUREHOST_DRIVER_CONTEXT, GetDriverContext)
 
+//
+// Grace period tracking for retired rule tables
+//
+typedef struct _SECUREHOST_GRACE_PERIOD {
+    KEVENT Done;
+    volatile LONG Pending;
+} SECUREHOST_GRACE_PERIOD, *PSECUREHOST_GRACE_PERIOD;
+
 //
 // Function declarations
 //
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_UNLOAD SecureHostEvtDriverUnload;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL SecureHostEvtIoDeviceControl;
+EVT_WDF_IO_IN_CALLER_CONTEXT SecureHostEvtIoInCallerContext;
+EVT_WDF_FILE_CLEANUP SecureHostEvtFileCleanup;
 
 NTSTATUS
-SecureHostRegisterCallouts(
+SecureHostCreateControlDevice(
     _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
 );
 
+_IRQL_requires_(PASSIVE_LEVEL)
 NTSTATUS
-SecureHostUnregisterCallouts(
+SecureHostLoadRuleset(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_reads_bytes_(BufferLength) const VOID* Buffer,
+    _In_ SIZE_T BufferLength,
+    _In_ BOOLEAN Persisted
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostLoadPersistedRuleset(
     _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
 );
 
-VOID NTAPI
-SecureHostClassifyFn(
-    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
-    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
-    _Inout_opt_ VOID* LayerData,
-    _In_opt_ const void* ClassifyContext,
-    _In_ const FWPS_FILTER3* Filter,
-    _In_ UINT64 FlowContext,
-    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostApplyRuleDelta(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_reads_bytes_(BufferLength) const VOID* Buffer,
+    _In_ SIZE_T BufferLength
 );
 
-NTSTATUS NTAPI
-SecureHostNotifyFn(
-    _In_ FWPS_CALLOUT_NOTIFY_TYPE NotifyType,
-    _In_ const GUID* FilterKey,
-    _Inout_ FWPS_FILTER3* Filter
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostRetainSourceRules(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_opt_ PSECUREHOST_POLICY_RULE Rules,
+    _In_ UINT32 RuleCount
 );
 
-VOID NTAPI
-SecureHostFlowDeleteFn(
-    _In_ UINT16 LayerId,
-    _In_ UINT32 CalloutId,
-    _In_ UINT64 FlowContext
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostCarryFlowVerdicts(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ UINT64 OldGeneration,
+    _In_ UINT64 NewGeneration,
+    _In_reads_(ChangeCount) const SECUREHOST_RULE_CHANGE* Changes,
+    _In_ UINT32 ChangeCount
 );
 
-//
-// Paged code segments
-//
-#ifdef ALLOC_PRAGMA
-#pragma alloc_text(INIT, DriverEntry)
-#pragma alloc_text(PAGE, SecureHostEvtDriverUnload)
-#pragma alloc_text(PAGE, SecureHostRegisterCallouts)
-#pragma alloc_text(PAGE, SecureHostUnregisterCallouts)
-#endif
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostUpdateOffloadFilters(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_reads_(RuleCount) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 RuleCount
+);
 
-/*++
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostRemoveOffloadFilters(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
 
-Routine Description:
-    Driver entry point. Initializes WDF driver and registers WFP callouts.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostQueryStatistics(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Out_ PSECUREHOST_STATISTICS Statistics
+);
 
---*/
-_Use_decl_annotations_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SecureHostProcessNotify(
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
 NTSTATUS
-DriverEntry(
-    PDRIVER_OBJECT DriverObject,
-    PUNICODE_STRING RegistryPath
-)
-{
-    NTSTATUS status;
-    WDF_DRIVER_CONFIG config;
-    WDFDRIVER driver;
-    WDF_OBJECT_ATTRIBUTES attributes;
-    PSECUREHOST_DRIVER_CONTEXT context;
+SecureHostQueryProcessesRequest(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostReleaseProcessCache(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostRunBenchmark(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_BENCHMARK_INPUT* Input,
+    _Out_ PSECUREHOST_BENCHMARK_RESULT Result
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostSubscribeEvents(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostUnsubscribeEvents(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFFILEOBJECT FileObject
+);
+
+_IRQL_requires_(APC_LEVEL)
+VOID
+SecureHostUnmapEventChannelLocked(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostRecordConnectionEvent(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_CONNECTION_EVENT* Event
+);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+SecureHostFlushEventAggregator(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Inout_ PSECUREHOST_EVENT_AGGREGATOR Aggregator,
+    _In_ ULONG Processor,
+    _In_ PKEVENT Signal
+);
+
+KDEFERRED_ROUTINE SecureHostEventFlushTimerDpc;
+KDEFERRED_ROUTINE SecureHostEventAggregatorDpc;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+SecureHostPendConnection(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _In_ UINT64 RuleId,
+    _In_ FWP_ACTION_TYPE Fallback,
+    _In_ HANDLE CompletionHandle,
+    _In_ UINT64 ClassifyTime
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+SecureHostTakeDecision(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _In_ SECUREHOST_DECISION_STATE State,
+    _Out_ FWP_ACTION_TYPE* Verdict,
+    _Out_opt_ PSECUREHOST_VERDICT_TRACE Trace
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SecureHostFetchDecisions(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+SecureHostCompleteDecisions(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFFILEOBJECT FileObject,
+    _In_reads_(ResponseCount) const SECUREHOST_DECISION_RESPONSE* Responses,
+    _In_ SIZE_T ResponseCount
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostFlushDecisions(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ BOOLEAN ExpiredOnly
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostCloseDecisionChannel(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_opt_ WDFFILEOBJECT FileObject
+);
+
+KDEFERRED_ROUTINE SecureHostDecisionTimerDpc;
+
+NTSTATUS
+SecureHostRegisterCallouts(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+NTSTATUS
+SecureHostUnregisterCallouts(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostUnregisterCalloutIds(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+SecureHostAddFilters(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+SecureHostCloseFilterEngine(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+VOID
+NTAPI
+SecureHostBfeStateChange(
+    _Inout_ PVOID Context,
+    _In_ FWPM_SERVICE_STATE NewState
+);
+
+EVT_WDF_WORKITEM SecureHostBfeWorkItem;
+
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS
+SecureHostCompileRuleTable(
+    _In_reads_(RuleCount) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 RuleCount,
+    _In_ UINT64 Generation,
+    _Outptr_ PSECUREHOST_RULE_TABLE* Table
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS
+SecureHostPublishRuleTable(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_opt_ PSECUREHOST_RULE_TABLE Table
+);
+
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Context->RuleTableMutex)
+VOID
+SecureHostWaitForRuleTableReaders(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+_IRQL_requires_(DISPATCH_LEVEL)
+const SECUREHOST_COMPILED_RULE*
+SecureHostTimedLookupRule(
+    _In_ const SECUREHOST_RULE_TABLE* Table,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _Inout_ PSECUREHOST_COUNTERS Counters
+);
+
+KDEFERRED_ROUTINE SecureHostGracePeriodDpc;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FWP_ACTION_TYPE
+SecureHostEvaluateConnection(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _Out_ PUINT64 RuleId,
+    _Out_ PUINT64 Generation,
+    _Out_ PBOOLEAN Deferred,
+    _Out_opt_ PSECUREHOST_AUDIT_SAMPLE Audit
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+SecureHostAttachFlowContext(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ UINT64 FlowHandle,
+    _In_ UINT16 LayerId,
+    _In_ UINT32 CalloutId,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _In_ UINT64 RuleId,
+    _In_ UINT64 Generation,
+    _In_ BOOLEAN ServicePermitted
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FWP_ACTION_TYPE
+SecureHostGetFlowVerdict(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Inout_ PSECUREHOST_FLOW_CONTEXT Flow
+);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+SecureHostRemoveFlowContexts(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context
+);
+
+VOID NTAPI
+SecureHostClassifyV4Fn(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _Inout_opt_ VOID* LayerData,
+    _In_opt_ const void* ClassifyContext,
+    _In_ const FWPS_FILTER3* Filter,
+    _In_ UINT64 FlowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+);
+
+VOID NTAPI
+SecureHostClassifyV6Fn(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _Inout_opt_ VOID* LayerData,
+    _In_opt_ const void* ClassifyContext,
+    _In_ const FWPS_FILTER3* Filter,
+    _In_ UINT64 FlowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+);
+
+VOID NTAPI
+SecureHostFlowEstablishedClassifyV4Fn(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _Inout_opt_ VOID* LayerData,
+    _In_opt_ const void* ClassifyContext,
+    _In_ const FWPS_FILTER3* Filter,
+    _In_ UINT64 FlowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+);
+
+VOID NTAPI
+SecureHostFlowEstablishedClassifyV6Fn(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _Inout_opt_ VOID* LayerData,
+    _In_opt_ const void* ClassifyContext,
+    _In_ const FWPS_FILTER3* Filter,
+    _In_ UINT64 FlowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+);
+
+VOID NTAPI
+SecureHostFlowDataClassifyFn(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _Inout_opt_ VOID* LayerData,
+    _In_opt_ const void* ClassifyContext,
+    _In_ const FWPS_FILTER3* Filter,
+    _In_ UINT64 FlowContext,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+);
+
+NTSTATUS NTAPI
+SecureHostNotifyFn(
+    _In_ FWPS_CALLOUT_NOTIFY_TYPE NotifyType,
+    _In_ const GUID* FilterKey,
+    _Inout_ FWPS_FILTER3* Filter
+);
+
+VOID NTAPI
+SecureHostFlowDeleteFn(
+    _In_ UINT16 LayerId,
+    _In_ UINT32 CalloutId,
+    _In_ UINT64 FlowContext
+);
+
+//
+// Paged code segments
+//
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(PAGE, SecureHostEvtDriverUnload)
+#pragma alloc_text(PAGE, SecureHostProcessNotify)
+#pragma alloc_text(PAGE, SecureHostCreateControlDevice)
+#pragma alloc_text(PAGE, SecureHostEvtIoDeviceControl)
+#pragma alloc_text(PAGE, SecureHostLoadRuleset)
+#pragma alloc_text(INIT, SecureHostLoadPersistedRuleset)
+#pragma alloc_text(PAGE, SecureHostApplyRuleDelta)
+#pragma alloc_text(PAGE, SecureHostRetainSourceRules)
+#pragma alloc_text(PAGE, SecureHostUpdateOffloadFilters)
+#pragma alloc_text(PAGE, SecureHostRemoveOffloadFilters)
+#pragma alloc_text(PAGE, SecureHostQueryStatistics)
+#pragma alloc_text(PAGE, SecureHostQueryProcessesRequest)
+#pragma alloc_text(PAGE, SecureHostReleaseProcessCache)
+#pragma alloc_text(PAGE, SecureHostRunBenchmark)
+#pragma alloc_text(PAGE, SecureHostEvtIoInCallerContext)
+#pragma alloc_text(PAGE, SecureHostEvtFileCleanup)
+#pragma alloc_text(PAGE, SecureHostSubscribeEvents)
+#pragma alloc_text(PAGE, SecureHostUnsubscribeEvents)
+#pragma alloc_text(PAGE, SecureHostUnmapEventChannelLocked)
+#pragma alloc_text(PAGE, SecureHostRegisterCallouts)
+#pragma alloc_text(PAGE, SecureHostUnregisterCallouts)
+#pragma alloc_text(PAGE, SecureHostUnregisterCalloutIds)
+#pragma alloc_text(PAGE, SecureHostAddFilters)
+#pragma alloc_text(PAGE, SecureHostCloseFilterEngine)
+#pragma alloc_text(PAGE, SecureHostBfeWorkItem)
+#pragma alloc_text(PAGE, SecureHostCompileRuleTable)
+#pragma alloc_text(PAGE, SecureHostPublishRuleTable)
+#pragma alloc_text(PAGE, SecureHostWaitForRuleTableReaders)
+#pragma alloc_text(PAGE, SecureHostRemoveFlowContexts)
+#endif
+
+//
+// Run-time callout descriptors, indexed by SECUREHOST_CALLOUT_INDEX.
+// The data layer callouts only run for flows that carry a verdict cache
+// entry attached at flow establishment.
+//
+typedef struct _SECUREHOST_CALLOUT_DESCRIPTOR {
+    const GUID* CalloutKey;
+    const GUID* LayerKey;
+    FWPS_CALLOUT_CLASSIFY_FN3 ClassifyFn;
+    UINT32 Flags;
+    PCWSTR Name;
+    PCWSTR Description;
+} SECUREHOST_CALLOUT_DESCRIPTOR;
+
+static const SECUREHOST_CALLOUT_DESCRIPTOR SecureHostCallouts[SecureHostCalloutMax] = {
+    {
+        &SECUREHOST_WFP_CALLOUT_V4_GUID, &FWPM_LAYER_ALE_AUTH_CONNECT_V4,
+        SecureHostClassifyV4Fn, 0,
+        L"SecureHost WFP IPv4 Callout", L"Inspects IPv4 network traffic"
+    },
+    {
+        &SECUREHOST_WFP_CALLOUT_V6_GUID, &FWPM_LAYER_ALE_AUTH_CONNECT_V6,
+        SecureHostClassifyV6Fn, 0,
+        L"SecureHost WFP IPv6 Callout", L"Inspects IPv6 network traffic"
+    },
+    {
+        &SECUREHOST_WFP_FLOW_ESTABLISHED_V4_GUID, &FWPM_LAYER_ALE_FLOW_ESTABLISHED_V4,
+        SecureHostFlowEstablishedClassifyV4Fn, 0,
+        L"SecureHost WFP IPv4 Flow Callout", L"Caches verdicts for established IPv4 flows"
+    },
+    {
+        &SECUREHOST_WFP_FLOW_ESTABLISHED_V6_GUID, &FWPM_LAYER_ALE_FLOW_ESTABLISHED_V6,
+        SecureHostFlowEstablishedClassifyV6Fn, 0,
+        L"SecureHost WFP IPv6 Flow Callout", L"Caches verdicts for established IPv6 flows"
+    },
+    {
+        &SECUREHOST_WFP_STREAM_V4_GUID, &FWPM_LAYER_STREAM_V4,
+        SecureHostFlowDataClassifyFn, FWP_CALLOUT_FLAG_CONDITIONAL_ON_FLOW,
+        L"SecureHost WFP IPv4 Stream Callout", L"Applies cached verdicts to IPv4 streams"
+    },
+    {
+        &SECUREHOST_WFP_STREAM_V6_GUID, &FWPM_LAYER_STREAM_V6,
+        SecureHostFlowDataClassifyFn, FWP_CALLOUT_FLAG_CONDITIONAL_ON_FLOW,
+        L"SecureHost WFP IPv6 Stream Callout", L"Applies cached verdicts to IPv6 streams"
+    },
+    {
+        &SECUREHOST_WFP_DATAGRAM_DATA_V4_GUID, &FWPM_LAYER_DATAGRAM_DATA_V4,
+        SecureHostFlowDataClassifyFn, FWP_CALLOUT_FLAG_CONDITIONAL_ON_FLOW,
+        L"SecureHost WFP IPv4 Datagram Callout", L"Applies cached verdicts to IPv4 datagrams"
+    },
+    {
+        &SECUREHOST_WFP_DATAGRAM_DATA_V6_GUID, &FWPM_LAYER_DATAGRAM_DATA_V6,
+        SecureHostFlowDataClassifyFn, FWP_CALLOUT_FLAG_CONDITIONAL_ON_FLOW,
+        L"SecureHost WFP IPv6 Datagram Callout", L"Applies cached verdicts to IPv6 datagrams"
+    },
+};
+
+//
+// Captures the connection key from a layer's incoming values. Only call
+// through SECUREHOST_READ_CONNECTION_KEY: every field index and the
+// address family are then compile-time constants, so each classify
+// function gets its own straight-line specialization with no layer
+// checks. Direction is layer-specific and left to the caller.
+// The app ID is hashed here so per-application rules match on a single
+// compare; layers hand it over as a counted, NUL-terminated device path.
+//
+FORCEINLINE
+VOID
+SecureHostReadConnectionKey(
+    _In_ const FWPS_INCOMING_VALUES0* InFixedValues,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _In_ UINT8 IpVersion,
+    _In_ UINT32 ProtocolField,
+    _In_ UINT32 LocalAddressField,
+    _In_ UINT32 RemoteAddressField,
+    _In_ UINT32 LocalPortField,
+    _In_ UINT32 RemotePortField,
+    _In_ UINT32 AppIdField,
+    _Out_ PSECUREHOST_CONNECTION_KEY Key
+)
+{
+    const FWPS_INCOMING_VALUE0* values = InFixedValues->incomingValue;
+
+    RtlZeroMemory(Key, sizeof(SECUREHOST_CONNECTION_KEY));
+
+    if (values[AppIdField].value.type == FWP_BYTE_BLOB_TYPE) {
+        const FWP_BYTE_BLOB* appId = values[AppIdField].value.byteBlob;
+
+        if (appId != NULL && appId->data != NULL) {
+            Key->AppIdHash = SecureHostHashAppId((const WCHAR*)appId->data, appId->size / sizeof(WCHAR));
+        }
+    }
+
+    if (FWPS_IS_METADATA_FIELD_PRESENT(InMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
+        Key->ProcessId = (UINT32)InMetaValues->processId;
+    }
+
+    Key->IpVersion = IpVersion;
+    Key->Protocol = values[ProtocolField].value.uint8;
+    Key->LocalPort = values[LocalPortField].value.uint16;
+    Key->RemotePort = values[RemotePortField].value.uint16;
+
+    if (IpVersion == 4) {
+        //
+        // IPv4 addresses arrive as host-order integers
+        //
+        Key->LocalAddress.V4 = RtlUlongByteSwap(values[LocalAddressField].value.uint32);
+        Key->RemoteAddress.V4 = RtlUlongByteSwap(values[RemoteAddressField].value.uint32);
+    } else {
+        RtlCopyMemory(Key->LocalAddress.Bytes,
+                      values[LocalAddressField].value.byteArray16->byteArray16,
+                      sizeof(Key->LocalAddress.Bytes));
+        RtlCopyMemory(Key->RemoteAddress.Bytes,
+                      values[RemoteAddressField].value.byteArray16->byteArray16,
+                      sizeof(Key->RemoteAddress.Bytes));
+    }
+}
+
+#define SECUREHOST_READ_CONNECTION_KEY(Layer, IpVersion, InFixedValues, InMetaValues, Key) \
+    SecureHostReadConnectionKey(                                                \
+        (InFixedValues),                                                        \
+        (InMetaValues),                                                         \
+        (IpVersion),                                                            \
+        FWPS_FIELD_##Layer##_IP_PROTOCOL,                                       \
+        FWPS_FIELD_##Layer##_IP_LOCAL_ADDRESS,                                  \
+        FWPS_FIELD_##Layer##_IP_REMOTE_ADDRESS,                                 \
+        FWPS_FIELD_##Layer##_IP_LOCAL_PORT,                                     \
+        FWPS_FIELD_##Layer##_IP_REMOTE_PORT,                                    \
+        FWPS_FIELD_##Layer##_ALE_APP_ID,                                        \
+        (Key))
+
+//
+// Packet direction for layers without a direction field (ALE auth
+// connect is outbound unless the metadata says otherwise)
+//
+FORCEINLINE
+UINT8
+SecureHostMetadataDirection(
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues
+)
+{
+    if (FWPS_IS_METADATA_FIELD_PRESENT(InMetaValues, FWPS_METADATA_FIELD_PACKET_DIRECTION)) {
+        return (UINT8)InMetaValues->packetDirection;
+    }
+
+    return (UINT8)FWP_DIRECTION_OUTBOUND;
+}
+
+//
+// Returns the current processor's counters. The caller must stay at
+// DISPATCH_LEVEL while updating them.
+//
+FORCEINLINE
+PSECUREHOST_COUNTERS
+SecureHostLocalCounters(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+    return &Context->CpuCounters[KeGetCurrentProcessorNumberEx(NULL)].Counters;
+}
+
+//
+// Maps elapsed performance counter ticks to a latency bucket
+//
+FORCEINLINE
+ULONG
+SecureHostLatencyBucket(
+    _In_ LONGLONG Ticks
+)
+{
+    ULONG index;
+
+    if (Ticks <= 0 || !BitScanReverse64(&index, (ULONG64)Ticks)) {
+        return 0;
+    }
+
+    return min(index + 1, SECUREHOST_LATENCY_BUCKETS - 1);
+}
+
+//
+// Issues a correlation ID from the current processor's sequence. The
+// caller must be at DISPATCH_LEVEL.
+//
+FORCEINLINE
+UINT64
+SecureHostNextCorrelationId(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    ULONG processor;
+
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+    return SECUREHOST_CORRELATION_ID(SECUREHOST_TRACE_SOURCE_WFP, processor,
+                                     ++Context->CpuCounters[processor].TraceSequence);
+}
+
+/*++
+
+Routine Description:
+    Closes the trace of a verdict: counts its latency from Trace->StartTime
+    in the verdict or decision histogram and issues a correlation ID if
+    the verdict has none yet. Returns the elapsed ticks, saturated to 32
+    bits for the event record.
+
+--*/
+FORCEINLINE
+UINT32
+SecureHostCompleteVerdictTrace(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Inout_ PSECUREHOST_VERDICT_TRACE Trace,
+    _In_ BOOLEAN ServiceVerdict
+)
+{
+    PSECUREHOST_COUNTERS counters;
+    LONGLONG elapsed;
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    elapsed = KeQueryPerformanceCounter(NULL).QuadPart - (LONGLONG)Trace->StartTime;
+    counters = SecureHostLocalCounters(Context);
+
+    if (ServiceVerdict) {
+        counters->DecisionLatency[SecureHostLatencyBucket(elapsed)]++;
+    } else {
+        counters->VerdictLatency[SecureHostLatencyBucket(elapsed)]++;
+    }
+
+    if (Trace->CorrelationId == 0) {
+        Trace->CorrelationId = SecureHostNextCorrelationId(Context);
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return (elapsed <= 0) ? 0 : (UINT32)min((ULONGLONG)elapsed, MAXUINT32);
+}
+
+//
+// Acquires the flow list lock, counting the acquisition as contended if
+// another processor holds it
+//
+FORCEINLINE
+VOID
+SecureHostAcquireFlowListLock(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Out_ PKLOCK_QUEUE_HANDLE LockHandle
+)
+{
+    BOOLEAN contended = !KeTestSpinLock(&Context->FlowListLock);
+
+    KeAcquireInStackQueuedSpinLock(&Context->FlowListLock, LockHandle);
+
+    if (contended) {
+        SecureHostLocalCounters(Context)->LockContentions++;
+    }
+}
+
+/*++
+
+Routine Description:
+    Driver entry point. Initializes WDF driver and registers WFP callouts.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+DriverEntry(
+    PDRIVER_OBJECT DriverObject,
+    PUNICODE_STRING RegistryPath
+)
+{
+    NTSTATUS status;
+    WDF_DRIVER_CONFIG config;
+    WDFDRIVER driver;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    PSECUREHOST_DRIVER_CONTEXT context;
+
+    KdPrint(("SecureHostWFP: DriverEntry\n"));
+
+    //
+    // Initialize WDF driver
+    //
+    WDF_DRIVER_CONFIG_INIT(&config, WDF_NO_EVENT_CALLBACK);
+    config.DriverInitFlags = WdfDriverInitNonPnpDriver;
+    config.EvtDriverUnload = SecureHostEvtDriverUnload;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, SECUREHOST_DRIVER_CONTEXT);
+    attributes.EvtCleanupCallback = NULL;
+
+    status = WdfDriverCreate(
+        DriverObject,
+        RegistryPath,
+        &attributes,
+        &config,
+        &driver
+    );
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfDriverCreate failed: 0x%08X\n", status));
+        return status;
+    }
+
+    //
+    // Initialize driver context
+    //
+    context = GetDriverContext(driver);
+    RtlZeroMemory(context, sizeof(SECUREHOST_DRIVER_CONTEXT));
+
+    context->Driver = driver;
+    context->ActiveRuleTable = NULL;
+    ExInitializeFastMutex(&context->RuleTableMutex);
+    ExInitializeFastMutex(&context->EventChannelMutex);
+    KeInitializeSpinLock(&context->FlowListLock);
+    InitializeListHead(&context->FlowList);
+    KeInitializeSpinLock(&context->DecisionLock);
+    InitializeListHead(&context->QueuedDecisions);
+    InitializeListHead(&context->DeliveredDecisions);
+    InitializeListHead(&context->DecidedConnections);
+    KeInitializeTimer(&context->DecisionTimer);
+    KeInitializeDpc(&context->DecisionTimerDpc, SecureHostDecisionTimerDpc, context);
+    KeInitializeTimer(&context->EventFlushTimer);
+    KeInitializeDpc(&context->EventFlushTimerDpc, SecureHostEventFlushTimerDpc, context);
+    SecureHostInitializeProcessCache(&context->ProcessCache);
+    context->NextDecisionId = 1;
+    context->NextRuleId = 1;
+
+    //
+    // Pre-allocate grace period DPCs so retiring a rule table cannot fail
+    //
+    context->GracePeriodDpcCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    context->GracePeriodDpcs = (PKDPC)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)context->GracePeriodDpcCount * sizeof(KDPC),
+        SECUREHOST_WFP_TAG
+    );
+
+    if (context->GracePeriodDpcs == NULL) {
+        KdPrint(("SecureHostWFP: Failed to allocate grace period DPCs\n"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // One counter block per possible processor (ExAllocatePool2 zeroes)
+    //
+    context->CpuCounterCount = context->GracePeriodDpcCount;
+    context->CpuCounters = (PSECUREHOST_CPU_COUNTERS)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        (SIZE_T)context->CpuCounterCount * sizeof(SECUREHOST_CPU_COUNTERS),
+        SECUREHOST_WFP_TAG
+    );
+
+    if (context->CpuCounters == NULL) {
+        KdPrint(("SecureHostWFP: Failed to allocate statistics counters\n"));
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // Initialize the flow context pool used by the verdict cache
+    //
+    status = ExInitializeLookasideListEx(
+        &context->FlowContextLookaside,
+        NULL,
+        NULL,
+        NonPagedPoolNx,
+        0,
+        sizeof(SECUREHOST_FLOW_CONTEXT),
+        SECUREHOST_FLOW_TAG,
+        0
+    );
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: ExInitializeLookasideListEx failed: 0x%08X\n", status));
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_WFP_TAG);
+        context->CpuCounters = NULL;
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+        return status;
+    }
+
+    context->FlowContextLookasideInitialized = TRUE;
+
+    status = ExInitializeLookasideListEx(
+        &context->DecisionLookaside,
+        NULL,
+        NULL,
+        NonPagedPoolNx,
+        0,
+        sizeof(SECUREHOST_PENDED_CONNECTION),
+        SECUREHOST_DECISION_TAG,
+        0
+    );
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: ExInitializeLookasideListEx (decisions) failed: 0x%08X\n", status));
+        ExDeleteLookasideListEx(&context->FlowContextLookaside);
+        context->FlowContextLookasideInitialized = FALSE;
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_WFP_TAG);
+        context->CpuCounters = NULL;
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+        return status;
+    }
+
+    context->DecisionLookasideInitialized = TRUE;
+
+    //
+    // Without the notify routine events go out with no creation time
+    // and the service resolves processes itself
+    //
+    status = PsSetCreateProcessNotifyRoutineEx(SecureHostProcessNotify, FALSE);
+    if (NT_SUCCESS(status)) {
+        context->ProcessNotifyRegistered = TRUE;
+    } else {
+        KdPrint(("SecureHostWFP: PsSetCreateProcessNotifyRoutineEx failed: 0x%08X, process cache disabled\n", status));
+    }
+
+    //
+    // Create the control device used for IOCTLs and callout registration
+    //
+    status = SecureHostCreateControlDevice(context);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: SecureHostCreateControlDevice failed: 0x%08X\n", status));
+        SecureHostReleaseProcessCache(context);
+        ExDeleteLookasideListEx(&context->DecisionLookaside);
+        context->DecisionLookasideInitialized = FALSE;
+        ExDeleteLookasideListEx(&context->FlowContextLookaside);
+        context->FlowContextLookasideInitialized = FALSE;
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_WFP_TAG);
+        context->CpuCounters = NULL;
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+        return status;
+    }
+
+    //
+    // Register WFP callouts. This does not need BFE, which is a user-mode
+    // service and is not running yet when the driver loads at system
+    // start; the filters that route traffic to the callouts are added
+    // once it is.
+    //
+    status = SecureHostRegisterCallouts(context);
+    if (NT_SUCCESS(status)) {
+        status = FwpmBfeStateSubscribeChanges0(
+            WdfDeviceWdmGetDeviceObject(context->ControlDevice),
+            SecureHostBfeStateChange,
+            context,
+            &context->BfeStateHandle
+        );
+
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("SecureHostWFP: FwpmBfeStateSubscribeChanges0 failed: 0x%08X\n", status));
+            SecureHostUnregisterCallouts(context);
+        }
+    } else {
+        KdPrint(("SecureHostWFP: SecureHostRegisterCallouts failed: 0x%08X\n", status));
+    }
+
+    if (!NT_SUCCESS(status)) {
+        WdfObjectDelete(context->ControlDevice);
+        context->ControlDevice = NULL;
+        SecureHostReleaseProcessCache(context);
+        ExDeleteLookasideListEx(&context->DecisionLookaside);
+        context->DecisionLookasideInitialized = FALSE;
+        ExDeleteLookasideListEx(&context->FlowContextLookaside);
+        context->FlowContextLookasideInitialized = FALSE;
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_WFP_TAG);
+        context->CpuCounters = NULL;
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+        return status;
+    }
+
+    //
+    // Compile the last known ruleset so it is enforced from the moment
+    // the filters are in, which is before the service takes over. The
+    // ruleset queue is held so an early IOCTL load cannot interleave
+    // with this one.
+    //
+    WdfIoQueueStopSynchronously(context->RulesetQueue);
+
+    status = SecureHostLoadPersistedRuleset(context);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: Persisted ruleset not loaded: 0x%08X\n", status));
+    }
+
+    WdfIoQueueStart(context->RulesetQueue);
+
+    //
+    // Add the filters now if BFE is already running. State changes seen
+    // before this point were dropped; the work item reads the current
+    // state itself.
+    //
+    InterlockedExchange(&context->BfeWorkArmed, 1);
+    WdfWorkItemEnqueue(context->BfeWorkItem);
+
+    KdPrint(("SecureHostWFP: Driver loaded successfully\n"));
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Driver unload callback. Cleans up WFP callouts and resources.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEvtDriverUnload(
+    WDFDRIVER Driver
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context;
+
+    PAGED_CODE();
+
+    KdPrint(("SecureHostWFP: SecureHostEvtDriverUnload\n"));
+
+    context = GetDriverContext(Driver);
+
+    //
+    // Release pended connections to their fallback verdicts and stop
+    // pending new ones
+    //
+    SecureHostCloseDecisionChannel(context, NULL);
+    KeCancelTimer(&context->EventFlushTimer);
+    KeFlushQueuedDpcs();
+
+    //
+    // Remove the filters, detach verdict cache entries from flows still
+    // alive, then unregister callouts (waits for in-flight flow delete
+    // callbacks)
+    //
+    SecureHostUnregisterCallouts(context);
+
+    //
+    // Callouts are gone; the device object they were registered with
+    // and the IOCTL path can go too
+    //
+    if (context->ControlDevice != NULL) {
+        WdfObjectDelete(context->ControlDevice);
+        context->ControlDevice = NULL;
+    }
+
+    if (context->FlowContextLookasideInitialized) {
+        ExDeleteLookasideListEx(&context->FlowContextLookaside);
+        context->FlowContextLookasideInitialized = FALSE;
+    }
+
+    if (context->DecisionLookasideInitialized) {
+        ExDeleteLookasideListEx(&context->DecisionLookaside);
+        context->DecisionLookasideInitialized = FALSE;
+    }
+
+    SecureHostReleaseProcessCache(context);
+
+    //
+    // No producers or subscribers remain; release the event channel
+    //
+    if (context->EventChannelMdl != NULL) {
+        IoFreeMdl(context->EventChannelMdl);
+        context->EventChannelMdl = NULL;
+    }
+
+    if (context->EventChannel != NULL) {
+        ExFreePoolWithTag(context->EventChannel, SECUREHOST_WFP_TAG);
+        context->EventChannel = NULL;
+    }
+
+    if (context->EventAggregators != NULL) {
+        ExFreePoolWithTag(context->EventAggregators, SECUREHOST_WFP_TAG);
+        context->EventAggregators = NULL;
+    }
+
+    //
+    // Retire the active rule table (no classify callbacks remain)
+    //
+    if (context->GracePeriodDpcs != NULL) {
+        SecureHostPublishRuleTable(context, NULL);
+        ExFreePoolWithTag(context->GracePeriodDpcs, SECUREHOST_WFP_TAG);
+        context->GracePeriodDpcs = NULL;
+    }
+
+    SecureHostRetainSourceRules(context, NULL, 0);
+
+    if (context->CpuCounters != NULL) {
+        ExFreePoolWithTag(context->CpuCounters, SECUREHOST_WFP_TAG);
+        context->CpuCounters = NULL;
+    }
+
+    KdPrint(("SecureHostWFP: Driver unloaded\n"));
+}
+
+/*++
+
+Routine Description:
+    Registers the run-time callouts for IPv4 and IPv6 traffic inspection.
+    Needs no BFE session, so it works before BFE has started.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostRegisterCallouts(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    NTSTATUS status;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    KdPrint(("SecureHostWFP: Registering callouts\n"));
+
+    for (i = 0; i < SecureHostCalloutMax; i++) {
+        FWPS_CALLOUT3 callout = {0};
+
+        callout.calloutKey = *SecureHostCallouts[i].CalloutKey;
+        callout.classifyFn = SecureHostCallouts[i].ClassifyFn;
+        callout.notifyFn = SecureHostNotifyFn;
+        callout.flowDeleteFn = SecureHostFlowDeleteFn;
+        callout.flags = SecureHostCallouts[i].Flags;
+
+        status = FwpsCalloutRegister3(
+            WdfDeviceWdmGetDeviceObject(Context->ControlDevice),
+            &callout,
+            &Context->CalloutIds[i]
+        );
+
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("SecureHostWFP: FwpsCalloutRegister3 (%ws) failed: 0x%08X\n",
+                     SecureHostCallouts[i].Name, status));
+            goto unregister;
+        }
+    }
+
+    KdPrint(("SecureHostWFP: Callouts registered successfully\n"));
+    return STATUS_SUCCESS;
+
+unregister:
+    SecureHostUnregisterCalloutIds(Context);
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Opens a dynamic BFE session and adds the sublayer, management callouts
+    and catch-all filters that route traffic to the run-time callouts,
+    then offloads the active ruleset's static rules. BFE must be running.
+    Called with RulesetQueue stopped.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostAddFilters(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    NTSTATUS status;
+    FWPM_CALLOUT0 mCallout = {0};
+    FWPM_SUBLAYER0 sublayer = {0};
+    FWPM_FILTER0 filter = {0};
+    FWPM_SESSION0 session = {0};
+    UINT64 weight = SECUREHOST_CALLOUT_FILTER_WEIGHT;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    KdPrint(("SecureHostWFP: Adding filters\n"));
+
+    //
+    // Open filter engine. The session is dynamic so every object added
+    // through it is removed when the engine handle closes.
+    //
+    session.flags = FWPM_SESSION_FLAG_DYNAMIC;
+
+    status = FwpmEngineOpen0(
+        NULL,
+        RPC_C_AUTHN_DEFAULT,
+        NULL,
+        &session,
+        &Context->EngineHandle
+    );
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: FwpmEngineOpen0 failed: 0x%08X\n", status));
+        goto cleanup;
+    }
+
+    //
+    // Begin transaction
+    //
+    status = FwpmTransactionBegin0(Context->EngineHandle, 0);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: FwpmTransactionBegin0 failed: 0x%08X\n", status));
+        goto cleanup;
+    }
+
+    //
+    // Add sublayer
+    //
+    sublayer.subLayerKey = SECUREHOST_WFP_SUBLAYER_GUID;
+    sublayer.displayData.name = L"SecureHost WFP Sublayer";
+    sublayer.displayData.description = L"SecureHost network policy enforcement";
+    sublayer.weight = 0x8000; // High priority
+
+    status = FwpmSubLayerAdd0(Context->EngineHandle, &sublayer, NULL);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: FwpmSubLayerAdd0 failed: 0x%08X\n", status));
+        goto abort;
+    }
+
+    //
+    // Add management callouts
+    //
+    for (i = 0; i < SecureHostCalloutMax; i++) {
+        mCallout.calloutKey = *SecureHostCallouts[i].CalloutKey;
+        mCallout.displayData.name = (wchar_t*)SecureHostCallouts[i].Name;
+        mCallout.displayData.description = (wchar_t*)SecureHostCallouts[i].Description;
+        mCallout.applicableLayer = *SecureHostCallouts[i].LayerKey;
+
+        status = FwpmCalloutAdd0(Context->EngineHandle, &mCallout, NULL, NULL);
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("SecureHostWFP: FwpmCalloutAdd0 (%ws) failed: 0x%08X\n",
+                     SecureHostCallouts[i].Name, status));
+            goto abort;
+        }
+    }
+
+    //
+    // Route everything not decided by an offloaded rule to the callouts.
+    // Offloaded rule filters always carry a higher weight.
+    //
+    for (i = 0; i < SecureHostCalloutMax; i++) {
+        RtlZeroMemory(&filter, sizeof(filter));
+
+        filter.displayData.name = (wchar_t*)SecureHostCallouts[i].Name;
+        filter.displayData.description = (wchar_t*)SecureHostCallouts[i].Description;
+        filter.layerKey = *SecureHostCallouts[i].LayerKey;
+        filter.subLayerKey = SECUREHOST_WFP_SUBLAYER_GUID;
+        filter.weight.type = FWP_UINT64;
+        filter.weight.uint64 = &weight;
+        filter.action.type = FWP_ACTION_CALLOUT_TERMINATING;
+        filter.action.calloutKey = *SecureHostCallouts[i].CalloutKey;
+
+        status = FwpmFilterAdd0(Context->EngineHandle, &filter, NULL, &Context->CalloutFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("SecureHostWFP: FwpmFilterAdd0 (%ws) failed: 0x%08X\n",
+                     SecureHostCallouts[i].Name, status));
+            goto abort;
+        }
+    }
+
+    //
+    // Commit transaction
+    //
+    status = FwpmTransactionCommit0(Context->EngineHandle);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: FwpmTransactionCommit0 failed: 0x%08X\n", status));
+        goto cleanup;
+    }
+
+    //
+    // A ruleset loaded while BFE was down, including the persisted one,
+    // is enforced by the callout alone until now
+    //
+    SecureHostUpdateOffloadFilters(Context, Context->SourceRules, Context->SourceRuleCount);
+
+    KdPrint(("SecureHostWFP: Filters added successfully\n"));
+    return STATUS_SUCCESS;
+
+abort:
+    FwpmTransactionAbort0(Context->EngineHandle);
+
+cleanup:
+    SecureHostCloseFilterEngine(Context);
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Closes the BFE session, which removes every filter added through it,
+    and forgets their IDs. The callouts stay registered. Called with
+    RulesetQueue stopped, or once no loads can run.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostCloseFilterEngine(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    PAGED_CODE();
+
+    if (Context->EngineHandle != NULL) {
+        FwpmEngineClose0(Context->EngineHandle);
+        Context->EngineHandle = NULL;
+    }
+
+    RtlZeroMemory(Context->CalloutFilterIds, sizeof(Context->CalloutFilterIds));
+
+    if (Context->OffloadFilterIds != NULL) {
+        ExFreePoolWithTag(Context->OffloadFilterIds, SECUREHOST_WFP_TAG);
+        Context->OffloadFilterIds = NULL;
+        Context->OffloadFilterCount = 0;
+    }
+
+    InterlockedExchange(&Context->OffloadedRuleCount, 0);
+}
+
+/*++
+
+Routine Description:
+    BFE state change callback. Adding or removing filters waits on BFE,
+    so the work is left to BfeWorkItem.
+
+--*/
+_Use_decl_annotations_
+VOID
+NTAPI
+SecureHostBfeStateChange(
+    PVOID Context,
+    FWPM_SERVICE_STATE NewState
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = (PSECUREHOST_DRIVER_CONTEXT)Context;
+
+    if ((NewState == FWPM_SERVICE_RUNNING || NewState == FWPM_SERVICE_STOP_PENDING) &&
+        ReadAcquire(&context->BfeWorkArmed) != 0) {
+        WdfWorkItemEnqueue(context->BfeWorkItem);
+    }
+}
+
+/*++
+
+Routine Description:
+    Brings the filters in line with BFE's current state: added when it
+    runs and there is no session yet, dropped with the session when it
+    is stopping. Rule set loads are held off meanwhile, since they update
+    the offload filters through the same session.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostBfeWorkItem(
+    WDFWORKITEM WorkItem
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = GetDriverContext(WdfGetDriver());
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    UNREFERENCED_PARAMETER(WorkItem);
+
+    WdfIoQueueStopSynchronously(context->RulesetQueue);
+
+    if (FwpmBfeStateGet0() == FWPM_SERVICE_RUNNING) {
+        if (context->EngineHandle == NULL) {
+            status = SecureHostAddFilters(context);
+            if (!NT_SUCCESS(status)) {
+                KdPrint(("SecureHostWFP: Filters not added: 0x%08X, retried when BFE restarts\n", status));
+            }
+        }
+    } else if (context->EngineHandle != NULL) {
+        KdPrint(("SecureHostWFP: BFE stopping, closing filter engine\n"));
+        SecureHostCloseFilterEngine(context);
+    }
+
+    WdfIoQueueStart(context->RulesetQueue);
+}
+
+/*++
+
+Routine Description:
+    Unregisters WFP callouts and closes filter engine.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostUnregisterCallouts(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    PAGED_CODE();
+
+    KdPrint(("SecureHostWFP: Unregistering callouts\n"));
+
+    //
+    // Stop following BFE, and let a queued state change finish, before
+    // the session goes
+    //
+    if (Context->BfeStateHandle != NULL) {
+        FwpmBfeStateUnsubscribeChanges0(Context->BfeStateHandle);
+        Context->BfeStateHandle = NULL;
+    }
+
+    InterlockedExchange(&Context->BfeWorkArmed, 0);
+    if (Context->BfeWorkItem != NULL) {
+        WdfWorkItemFlush(Context->BfeWorkItem);
+    }
+
+    //
+    // Closing the dynamic session deletes the filters that reference the
+    // callouts, so no classify can attach a flow context from here on
+    // except one already in flight; those are refused once stopping is
+    // set, and the rest are detached from their flows.
+    //
+    SecureHostCloseFilterEngine(Context);
+
+    SecureHostAcquireFlowListLock(Context, &lockHandle);
+    Context->FlowContextsStopping = TRUE;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    SecureHostRemoveFlowContexts(Context);
+    SecureHostUnregisterCalloutIds(Context);
+
+    KdPrint(("SecureHostWFP: Callouts unregistered\n"));
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Unregisters every registered run-time callout. A callout still
+    associated with a flow returns STATUS_DEVICE_BUSY and stays until its
+    last flow delete callback has run, so this waits for that instead of
+    letting the callback run after unload. Contexts removed by a racing
+    detach are picked up by retrying.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostUnregisterCalloutIds(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    LARGE_INTEGER interval;
+    NTSTATUS status;
+    ULONG attempts;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    interval.QuadPart = -(LONGLONG)SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_UNREGISTER_RETRY_MS);
+
+    for (i = 0; i < SecureHostCalloutMax; i++) {
+        if (Context->CalloutIds[i] == 0) {
+            continue;
+        }
+
+        for (attempts = 1; ; attempts++) {
+            status = FwpsCalloutUnregisterById0(Context->CalloutIds[i]);
+            if (status != STATUS_DEVICE_BUSY) {
+                break;
+            }
+
+            if (attempts % (1000 / SECUREHOST_UNREGISTER_RETRY_MS) == 0) {
+                KdPrint(("SecureHostWFP: Callout %ws still in use, waiting\n", SecureHostCallouts[i].Name));
+            }
+
+            SecureHostRemoveFlowContexts(Context);
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("SecureHostWFP: FwpsCalloutUnregisterById0 (%ws) failed: 0x%08X\n",
+                     SecureHostCallouts[i].Name, status));
+        }
+
+        Context->CalloutIds[i] = 0;
+    }
+}
+
+/*++
+
+Routine Description:
+    Creates the control device that receives IOCTLs from the service and
+    anchors the run-time callouts. Requests run at PASSIVE_LEVEL so rule
+    table compilation can use paged memory.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostCreateControlDevice(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    NTSTATUS status;
+    PWDFDEVICE_INIT deviceInit;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_FILEOBJECT_CONFIG fileConfig;
+    WDF_WORKITEM_CONFIG workItemConfig;
+    WDFDEVICE device;
+    DECLARE_CONST_UNICODE_STRING(deviceName, SECUREHOST_WFP_DEVICE_NAME);
+    DECLARE_CONST_UNICODE_STRING(symlinkName, SECUREHOST_WFP_SYMLINK_NAME);
+
+    PAGED_CODE();
+
+    //
+    // Only SYSTEM and administrators may open the device
+    //
+    deviceInit = WdfControlDeviceInitAllocate(Context->Driver, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL);
+    if (deviceInit == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    WdfDeviceInitSetDeviceType(deviceInit, FILE_DEVICE_UNKNOWN);
+    WdfDeviceInitSetCharacteristics(deviceInit, FILE_DEVICE_SECURE_OPEN, FALSE);
+    WdfDeviceInitSetIoType(deviceInit, WdfDeviceIoBuffered);
+
+    //
+    // Event subscription maps memory into the caller, so it is handled in
+    // the caller's context; the mapping is torn down on handle cleanup.
+    //
+    WdfDeviceInitSetIoInCallerContextCallback(deviceInit, SecureHostEvtIoInCallerContext);
+
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK, SecureHostEvtFileCleanup);
+    WdfDeviceInitSetFileObjectConfig(deviceInit, &fileConfig, WDF_NO_OBJECT_ATTRIBUTES);
+
+    status = WdfDeviceInitAssignName(deviceInit, &deviceName);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfDeviceInitAssignName failed: 0x%08X\n", status));
+        WdfDeviceInitFree(deviceInit);
+        return status;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+    //
+    // WdfDeviceCreate frees deviceInit on failure
+    //
+    status = WdfDeviceCreate(&deviceInit, &attributes, &device);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfDeviceCreate failed: 0x%08X\n", status));
+        return status;
+    }
+
+    status = WdfDeviceCreateSymbolicLink(device, &symlinkName);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfDeviceCreateSymbolicLink failed: 0x%08X\n", status));
+        WdfObjectDelete(device);
+        return status;
+    }
+
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchParallel);
+    queueConfig.EvtIoDeviceControl = SecureHostEvtIoDeviceControl;
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, NULL);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfIoQueueCreate failed: 0x%08X\n", status));
+        WdfObjectDelete(device);
+        return status;
+    }
+
+    //
+    // Rule set loads are forwarded here so that one load, including its
+    // native filter update, completes before the next starts
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    queueConfig.EvtIoDeviceControl = SecureHostEvtIoDeviceControl;
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Context->RulesetQueue);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfIoQueueCreate (ruleset) failed: 0x%08X\n", status));
+        WdfObjectDelete(device);
+        return status;
+    }
+
+    //
+    // Decision fetches park here until a deferred connection is pended
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &Context->DecisionRequestQueue);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfIoQueueCreate (decisions) failed: 0x%08X\n", status));
+        WdfObjectDelete(device);
+        return status;
+    }
+
+    //
+    // Adds and removes the filters as BFE starts and stops
+    //
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, SecureHostBfeWorkItem);
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+
+    status = WdfWorkItemCreate(&workItemConfig, &attributes, &Context->BfeWorkItem);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: WdfWorkItemCreate failed: 0x%08X\n", status));
+        WdfObjectDelete(device);
+        return status;
+    }
+
+    WdfControlFinishInitializing(device);
+    Context->ControlDevice = device;
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Handles device I/O control requests from the user-mode service.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEvtIoDeviceControl(
+    WDFQUEUE Queue,
+    WDFREQUEST Request,
+    size_t OutputBufferLength,
+    size_t InputBufferLength,
+    ULONG IoControlCode
+)
+{
+    NTSTATUS status;
+    PSECUREHOST_DRIVER_CONTEXT context;
+    PVOID buffer;
+    size_t bufferLength;
+    size_t information = 0;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+
+    context = GetDriverContext(WdfGetDriver());
+
+    switch (IoControlCode) {
+        case IOCTL_SECUREHOST_LOAD_NETWORK_RULESET:
+            if (Queue != context->RulesetQueue) {
+                status = WdfRequestForwardToIoQueue(Request, context->RulesetQueue);
+                if (NT_SUCCESS(status)) {
+                    return;
+                }
+                break;
+            }
+
+            //
+            // METHOD_IN_DIRECT: the ruleset is in the MDL-described buffer
+            //
+            status = WdfRequestRetrieveOutputBuffer(
+                Request,
+                sizeof(SECUREHOST_RULESET_HEADER),
+                &buffer,
+                &bufferLength
+            );
+
+            if (NT_SUCCESS(status)) {
+                status = SecureHostLoadRuleset(context, buffer, bufferLength, FALSE);
+            }
+            break;
+
+        case IOCTL_SECUREHOST_UPDATE_NETWORK_RULES:
+            if (Queue != context->RulesetQueue) {
+                status = WdfRequestForwardToIoQueue(Request, context->RulesetQueue);
+                if (NT_SUCCESS(status)) {
+                    return;
+                }
+                break;
+            }
+
+            status = WdfRequestRetrieveOutputBuffer(
+                Request,
+                sizeof(SECUREHOST_RULE_DELTA_HEADER),
+                &buffer,
+                &bufferLength
+            );
+
+            if (NT_SUCCESS(status)) {
+                status = SecureHostApplyRuleDelta(context, buffer, bufferLength);
+            }
+            break;
+
+        case IOCTL_SECUREHOST_GET_STATISTICS:
+            status = WdfRequestRetrieveOutputBuffer(
+                Request,
+                sizeof(SECUREHOST_STATISTICS),
+                &buffer,
+                NULL
+            );
+
+            if (NT_SUCCESS(status)) {
+                SecureHostQueryStatistics(context, (PSECUREHOST_STATISTICS)buffer);
+                information = sizeof(SECUREHOST_STATISTICS);
+            }
+            break;
+
+        case IOCTL_SECUREHOST_QUERY_PROCESSES:
+            status = SecureHostQueryProcessesRequest(context, Request, &information);
+            break;
+
+        case IOCTL_SECUREHOST_RUN_BENCHMARK:
+            status = WdfRequestRetrieveInputBuffer(
+                Request,
+                sizeof(SECUREHOST_BENCHMARK_INPUT),
+                &buffer,
+                NULL
+            );
+
+            if (NT_SUCCESS(status)) {
+                SECUREHOST_BENCHMARK_INPUT input = *(const SECUREHOST_BENCHMARK_INPUT*)buffer;
+
+                status = WdfRequestRetrieveOutputBuffer(
+                    Request,
+                    sizeof(SECUREHOST_BENCHMARK_RESULT),
+                    &buffer,
+                    NULL
+                );
+
+                if (NT_SUCCESS(status)) {
+                    status = SecureHostRunBenchmark(context, &input, (PSECUREHOST_BENCHMARK_RESULT)buffer);
+                }
+
+                if (NT_SUCCESS(status)) {
+                    information = sizeof(SECUREHOST_BENCHMARK_RESULT);
+                }
+            }
+            break;
+
+        case IOCTL_SECUREHOST_FETCH_DECISIONS:
+            status = SecureHostFetchDecisions(context, Request, &information);
+            if (status == STATUS_PENDING) {
+                return;
+            }
+            break;
+
+        case IOCTL_SECUREHOST_COMPLETE_DECISIONS:
+            status = WdfRequestRetrieveInputBuffer(
+                Request,
+                sizeof(SECUREHOST_DECISION_RESPONSE),
+                &buffer,
+                &bufferLength
+            );
+
+            if (NT_SUCCESS(status)) {
+                status = SecureHostCompleteDecisions(
+                    context,
+                    WdfRequestGetFileObject(Request),
+                    (const SECUREHOST_DECISION_RESPONSE*)buffer,
+                    bufferLength / sizeof(SECUREHOST_DECISION_RESPONSE)
+                );
+            }
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, information);
+}
+
+/*++
+
+Routine Description:
+    Process notification callback; keeps the process metadata cache.
+    A subscriber exiting while another process still holds its handle
+    has the event channel view removed here, in its own context, before
+    its address space goes away.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostProcessNotify(
+    PEPROCESS Process,
+    HANDLE ProcessId,
+    PPS_CREATE_NOTIFY_INFO CreateInfo
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = GetDriverContext(WdfGetDriver());
+
+    PAGED_CODE();
+
+    SecureHostProcessCacheNotify(&context->ProcessCache, Process, ProcessId, CreateInfo);
+
+    if (CreateInfo == NULL && ReadPointerNoFence((PVOID*)&context->EventSubscriberProcess) == Process) {
+        ExAcquireFastMutex(&context->EventChannelMutex);
+
+        if (context->EventSubscriberProcess == Process) {
+            SecureHostUnmapEventChannelLocked(context);
+        }
+
+        ExReleaseFastMutex(&context->EventChannelMutex);
+    }
+}
+
+/*++
+
+Routine Description:
+    Stops the process notify routine and frees the process cache. No
+    classify callback or query may be running.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostReleaseProcessCache(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    PAGED_CODE();
+
+    if (Context->ProcessNotifyRegistered) {
+        PsSetCreateProcessNotifyRoutineEx(SecureHostProcessNotify, TRUE);
+        Context->ProcessNotifyRegistered = FALSE;
+    }
+
+    SecureHostDestroyProcessCache(&Context->ProcessCache);
+}
+
+/*++
+
+Routine Description:
+    Handles IOCTL_SECUREHOST_QUERY_PROCESSES. Input and output share the
+    buffered I/O buffer.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostQueryProcessesRequest(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFREQUEST Request,
+    size_t* Information
+)
+{
+    PVOID input;
+    PVOID output;
+    size_t inputLength;
+    size_t outputLength;
+    ULONG written;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(SECUREHOST_PROCESS_QUERY), &input, &inputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(SECUREHOST_PROCESS_RECORD), &output, &outputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = SecureHostQueryProcesses(
+        &Context->ProcessCache,
+        input,
+        (ULONG)min(inputLength, MAXULONG),
+        output,
+        (ULONG)min(outputLength, MAXULONG),
+        &written);
+
+    if (NT_SUCCESS(status)) {
+        *Information = written;
+    }
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Sums the per-processor counters into a statistics snapshot. Counters
+    are read without synchronization; each value is individually current
+    but the snapshot as a whole is not atomic.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostQueryStatistics(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    PSECUREHOST_STATISTICS Statistics
+)
+{
+    const SECUREHOST_RULE_TABLE* table;
+    const SECUREHOST_COUNTERS* counters;
+    LARGE_INTEGER frequency;
+    KIRQL oldIrql;
+    ULONG cpu;
+    ULONG bucket;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Statistics, sizeof(SECUREHOST_STATISTICS));
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Statistics->Version = SECUREHOST_STATISTICS_VERSION;
+    Statistics->ProcessorCount = Context->CpuCounterCount;
+    Statistics->PerformanceFrequency = (UINT64)frequency.QuadPart;
+    Statistics->OffloadedRuleCount = (UINT32)ReadNoFence(&Context->OffloadedRuleCount);
+
+    //
+    // Rule table pointers are only dereferenced at DISPATCH_LEVEL
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    table = (const SECUREHOST_RULE_TABLE*)ReadPointerAcquire(
+        (PVOID const volatile*)&Context->ActiveRuleTable);
+
+    if (table != NULL) {
+        Statistics->RuleTableGeneration = table->Generation;
+        Statistics->RuleCount = table->RuleCount;
+    }
+
+    KeLowerIrql(oldIrql);
+
+    for (cpu = 0; cpu < Context->CpuCounterCount; cpu++) {
+        counters = &Context->CpuCounters[cpu].Counters;
+
+        Statistics->Totals.Classifications += ReadULong64NoFence(&counters->Classifications);
+        Statistics->Totals.Permits += ReadULong64NoFence(&counters->Permits);
+        Statistics->Totals.Blocks += ReadULong64NoFence(&counters->Blocks);
+        Statistics->Totals.CacheHits += ReadULong64NoFence(&counters->CacheHits);
+        Statistics->Totals.RuleLookups += ReadULong64NoFence(&counters->RuleLookups);
+        Statistics->Totals.EventsDropped += ReadULong64NoFence(&counters->EventsDropped);
+        Statistics->Totals.LockContentions += ReadULong64NoFence(&counters->LockContentions);
+
+        for (bucket = 0; bucket < SECUREHOST_LATENCY_BUCKETS; bucket++) {
+            Statistics->Totals.LookupLatency[bucket] +=
+                ReadULong64NoFence(&counters->LookupLatency[bucket]);
+            Statistics->Totals.VerdictLatency[bucket] +=
+                ReadULong64NoFence(&counters->VerdictLatency[bucket]);
+            Statistics->Totals.DecisionLatency[bucket] +=
+                ReadULong64NoFence(&counters->DecisionLatency[bucket]);
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Times rule lookups against the active table. Each batch re-reads the
+    table pointer at DISPATCH_LEVEL, so a concurrent load is picked up
+    between batches and measured as the reader sees it. Does not touch
+    the statistics counters.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostRunBenchmark(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_BENCHMARK_INPUT* Input,
+    PSECUREHOST_BENCHMARK_RESULT Result
+)
+{
+    const SECUREHOST_RULE_TABLE* table;
+    PSECUREHOST_CONNECTION_KEY keys;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LONGLONG elapsed;
+    KIRQL oldIrql;
+    UINT32 state;
+    UINT32 batch;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (Input->Version != SECUREHOST_BENCHMARK_VERSION ||
+        Input->Batches == 0 ||
+        Input->Batches > SECUREHOST_BENCHMARK_MAX_BATCHES ||
+        Input->HitPercent > 100) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    keys = (PSECUREHOST_CONNECTION_KEY)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        SECUREHOST_BENCHMARK_BATCH * sizeof(SECUREHOST_CONNECTION_KEY),
+        SECUREHOST_WFP_TAG
+    );
+
+    if (keys == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(Result, sizeof(SECUREHOST_BENCHMARK_RESULT));
+    KeQueryPerformanceCounter(&frequency);
+
+    Result->Version = SECUREHOST_BENCHMARK_VERSION;
+    Result->OperationsPerBatch = SECUREHOST_BENCHMARK_BATCH;
+    Result->PerformanceFrequency = (UINT64)frequency.QuadPart;
+
+    state = (Input->Seed != 0) ? Input->Seed : (UINT32)frequency.QuadPart | 1;
+
+    for (batch = 0; batch < Input->Batches; batch++) {
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+        table = (const SECUREHOST_RULE_TABLE*)ReadPointerAcquire(
+            (PVOID const volatile*)&Context->ActiveRuleTable);
+
+        if (table == NULL) {
+            KeLowerIrql(oldIrql);
+            break;
+        }
+
+        for (i = 0; i < SECUREHOST_BENCHMARK_BATCH; i++) {
+            SecureHostSynthesizeConnection(table, Input->HitPercent, &state, &keys[i]);
+        }
+
+        start = KeQueryPerformanceCounter(NULL);
+
+        for (i = 0; i < SECUREHOST_BENCHMARK_BATCH; i++) {
+            if (SecureHostLookupRule(table, &keys[i]) != NULL) {
+                Result->Matches++;
+            }
+        }
+
+        elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart;
+        Result->RuleCount = table->RuleCount;
+
+        KeLowerIrql(oldIrql);
+
+        Result->TotalTicks += (UINT64)elapsed;
+        Result->BatchLatency[SecureHostLatencyBucket(elapsed)]++;
+        Result->Batches++;
+    }
+
+    ExFreePoolWithTag(keys, SECUREHOST_WFP_TAG);
+
+    return (Result->Batches != 0) ? STATUS_SUCCESS : STATUS_DEVICE_NOT_READY;
+}
+
+//
+// Whether a record's remote prefix fields are consistent
+//
+FORCEINLINE
+BOOLEAN
+SecureHostValidRemotePrefix(
+    _In_ UINT8 IpVersion,
+    _In_ UINT8 PrefixLength
+)
+{
+    switch (IpVersion) {
+        case 0:
+            return PrefixLength == 0;
+
+        case 4:
+            return PrefixLength <= 32;
+
+        case 6:
+            return PrefixLength <= 128;
+
+        default:
+            return FALSE;
+    }
+}
+
+//
+// Whether a record's audit fields are consistent. Only the sampled and
+// rate limited modes take a rate.
+//
+FORCEINLINE
+BOOLEAN
+SecureHostValidAuditMode(
+    _In_ UINT8 AuditMode,
+    _In_ UINT32 AuditRate
+)
+{
+    switch (AuditMode) {
+        case SECUREHOST_AUDIT_MODE_SAMPLED:
+        case SECUREHOST_AUDIT_MODE_RATE_LIMITED:
+            return AuditRate != 0 && AuditRate <= SECUREHOST_MAX_AUDIT_RATE;
+
+        default:
+            return AuditMode <= SECUREHOST_AUDIT_MODE_MAX && AuditRate == 0;
+    }
+}
+
+//
+// Validates a captured rule record and converts it to a policy rule
+//
+FORCEINLINE
+NTSTATUS
+SecureHostConvertNetworkRule(
+    _In_ const SECUREHOST_NETWORK_RULE_RECORD* Record,
+    _Out_ PSECUREHOST_POLICY_RULE Rule
+)
+{
+    if ((Record->Flags & ~SECUREHOST_RULE_FLAGS_VALID) != 0 ||
+        Record->Protocol > MAXUINT8 ||
+        !SecureHostValidRemotePrefix(Record->RemoteIpVersion, Record->RemotePrefixLength) ||
+        !SecureHostValidAuditMode(Record->AuditMode, Record->AuditRate)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Rule, sizeof(SECUREHOST_POLICY_RULE));
+    Rule->RuleId = Record->RuleId;
+    Rule->AppIdHash = Record->AppIdHash;
+    Rule->ProcessId = Record->ProcessId;
+    Rule->Protocol = Record->Protocol;
+    Rule->LocalPort = Record->LocalPort;
+    Rule->RemotePort = Record->RemotePort;
+    Rule->Enabled = (Record->Flags & SECUREHOST_RULE_FLAG_ENABLED) != 0;
+    Rule->Deferred = (Record->Flags & SECUREHOST_RULE_FLAG_DEFERRED) != 0;
+    Rule->RemoteIpVersion = Record->RemoteIpVersion;
+    Rule->RemotePrefixLength = Record->RemotePrefixLength;
+    Rule->AuditMode = Record->AuditMode;
+    Rule->AuditRate = Record->AuditRate;
+    RtlCopyMemory(Rule->RemoteAddress.Bytes, Record->RemoteAddress, sizeof(Record->RemoteAddress));
+
+    switch (Record->Action) {
+        case SECUREHOST_RULE_ACTION_BLOCK:
+            Rule->Action = FWP_ACTION_BLOCK;
+            break;
+
+        case SECUREHOST_RULE_ACTION_ALLOW:
+            Rule->Action = FWP_ACTION_PERMIT;
+            break;
+
+        case SECUREHOST_RULE_ACTION_AUDIT:
+            Rule->Action = FWP_ACTION_PERMIT;
+            Rule->Audit = TRUE;
+            break;
+
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Permits the driver samples or records in full must reach the callout
+    //
+    if (Rule->AuditMode >= SECUREHOST_AUDIT_MODE_SAMPLED) {
+        Rule->Audit = TRUE;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Validates a serialized ruleset, compiles it into a new rule table and
+    publishes it. Nothing becomes visible to the classify path unless the
+    whole set is valid and the generation check passes.
+
+    The buffer is mapped user memory and may change underneath us, so the
+    header and every record are captured exactly once before use.
+
+    A persisted ruleset (read at boot) drops rules scoped to a process ID.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostLoadRuleset(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const VOID* Buffer,
+    SIZE_T BufferLength,
+    BOOLEAN Persisted
+)
+{
+    NTSTATUS status;
+    SECUREHOST_RULESET_HEADER header;
+    PSECUREHOST_POLICY_RULE rules = NULL;
+    PSECUREHOST_RULE_TABLE table = NULL;
+    const UCHAR* records;
+    UINT64 payloadLength;
+    UINT32 ruleCount = 0;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (BufferLength < sizeof(SECUREHOST_RULESET_HEADER)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlCopyMemory(&header, Buffer, sizeof(header));
+
+    if (header.Version != SECUREHOST_RULESET_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    if (header.HeaderSize < sizeof(SECUREHOST_RULESET_HEADER) ||
+        header.HeaderSize > BufferLength ||
+        header.RuleSize < SECUREHOST_NETWORK_RULE_RECORD_MIN_SIZE ||
+        header.RuleCount > SECUREHOST_MAX_RULES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    payloadLength = (UINT64)header.RuleCount * header.RuleSize;
+    if (payloadLength > BufferLength - header.HeaderSize) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    records = (const UCHAR*)Buffer + header.HeaderSize;
+
+    if (header.RuleCount != 0) {
+        rules = (PSECUREHOST_POLICY_RULE)ExAllocatePool2(
+            POOL_FLAG_PAGED,
+            (SIZE_T)header.RuleCount * sizeof(SECUREHOST_POLICY_RULE),
+            SECUREHOST_WFP_TAG
+        );
+
+        if (rules == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    for (i = 0; i < header.RuleCount; i++) {
+        SECUREHOST_NETWORK_RULE_RECORD record;
+
+        SecureHostCaptureRecord(&header, records, i, &record, sizeof(record));
+
+        status = SecureHostConvertNetworkRule(&record, &rules[ruleCount]);
+        if (!NT_SUCCESS(status)) {
+            goto cleanup;
+        }
+
+        if (Persisted && record.ProcessId != 0) {
+            continue;
+        }
+
+        ruleCount++;
+    }
+
+    status = SecureHostCompileRuleTable(rules, ruleCount, header.Generation, &table);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    status = SecureHostPublishRuleTable(Context, table);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: Stale ruleset generation %llu rejected\n", header.Generation));
+        ExFreePoolWithTag(table, SECUREHOST_WFP_TAG);
+        goto cleanup;
+    }
+
+    //
+    // The table now belongs to the classify path; do not touch it again.
+    // Loads are serialized, so the offload set and source rules always
+    // track the most recently published table.
+    //
+    KdPrint(("SecureHostWFP: Loaded %lu network rules\n", ruleCount));
+
+    SecureHostUpdateOffloadFilters(Context, rules, ruleCount);
+    SecureHostRetainSourceRules(Context, rules, ruleCount);
+    rules = NULL;
+
+cleanup:
+    if (rules != NULL) {
+        ExFreePoolWithTag(rules, SECUREHOST_WFP_TAG);
+    }
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Reads the persisted ruleset into paged pool and loads it. The file is
+    written by the service, which replaces it atomically, so it is either
+    a whole ruleset or absent.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostLoadPersistedRuleset(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    NTSTATUS status;
+    HANDLE file;
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    FILE_STANDARD_INFORMATION info;
+    LARGE_INTEGER offset;
+    PVOID buffer = NULL;
+    UNICODE_STRING path = RTL_CONSTANT_STRING(SECUREHOST_PERSISTED_RULESET_PATH);
+
+    PAGED_CODE();
+
+    InitializeObjectAttributes(&attributes, &path, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    status = ZwCreateFile(
+        &file,
+        GENERIC_READ | SYNCHRONIZE,
+        &attributes,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+        NULL,
+        0
+    );
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ZwQueryInformationFile(file, &ioStatus, &info, sizeof(info), FileStandardInformation);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    if (info.EndOfFile.QuadPart < (LONGLONG)sizeof(SECUREHOST_RULESET_HEADER) ||
+        info.EndOfFile.QuadPart > (LONGLONG)SECUREHOST_PERSISTED_RULESET_MAX_SIZE) {
+        status = STATUS_INVALID_BUFFER_SIZE;
+        goto cleanup;
+    }
+
+    buffer = ExAllocatePool2(POOL_FLAG_PAGED, (SIZE_T)info.EndOfFile.QuadPart, SECUREHOST_WFP_TAG);
+    if (buffer == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    offset.QuadPart = 0;
+    status = ZwReadFile(file, NULL, NULL, NULL, &ioStatus, buffer, (ULONG)info.EndOfFile.QuadPart, &offset, NULL);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    if (ioStatus.Information != (ULONG_PTR)info.EndOfFile.QuadPart) {
+        status = STATUS_END_OF_FILE;
+        goto cleanup;
+    }
+
+    status = SecureHostLoadRuleset(Context, buffer, (SIZE_T)info.EndOfFile.QuadPart, TRUE);
+
+cleanup:
+    if (buffer != NULL) {
+        ExFreePoolWithTag(buffer, SECUREHOST_WFP_TAG);
+    }
+
+    ZwClose(file);
+    return status;
+}
+
+//
+// Index of the first source rule with a rule ID, or Count if none has it
+//
+FORCEINLINE
+UINT32
+SecureHostFindSourceRule(
+    _In_reads_(Count) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 Count,
+    _In_ UINT64 RuleId
+)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count && Rules[i].RuleId != RuleId; i++) {
+    }
+
+    return i;
+}
+
+/*++
+
+Routine Description:
+    Applies a rule delta to the active rule set. The delta is validated
+    and applied to a copy of the source rules, and the result is compiled
+    and published like a full load. Flow verdicts the edited rules cannot
+    change are then carried over to the new generation instead of being
+    re-matched.
+
+    The compiled table stays one flat allocation for lookup locality, so
+    it is rebuilt rather than patched; what a delta saves is the flush of
+    every cached verdict and, for the sender, the full ruleset transfer.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostApplyRuleDelta(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const VOID* Buffer,
+    SIZE_T BufferLength
+)
+{
+    NTSTATUS status;
+    SECUREHOST_RULE_DELTA_HEADER header;
+    PSECUREHOST_POLICY_RULE rules = NULL;
+    PSECUREHOST_RULE_CHANGE changes = NULL;
+    PSECUREHOST_RULE_TABLE table = NULL;
+    const UCHAR* records;
+    UINT64 payloadLength;
+    UINT64 baseGeneration;
+    UINT32 ruleCount;
+    UINT32 capacity;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (BufferLength < sizeof(SECUREHOST_RULE_DELTA_HEADER)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlCopyMemory(&header, Buffer, sizeof(header));
+
+    if (header.Header.Version != SECUREHOST_RULE_DELTA_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    if (header.Header.HeaderSize < sizeof(SECUREHOST_RULE_DELTA_HEADER) ||
+        header.Header.HeaderSize > BufferLength ||
+        header.Header.RuleSize < SECUREHOST_NETWORK_RULE_DELTA_RECORD_MIN_SIZE ||
+        header.Header.RuleCount == 0 ||
+        header.Header.RuleCount > SECUREHOST_MAX_RULE_DELTAS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    payloadLength = (UINT64)header.Header.RuleCount * header.Header.RuleSize;
+    if (payloadLength > BufferLength - header.Header.HeaderSize) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    //
+    // Only this queue publishes, so the generation cannot move under us
+    //
+    baseGeneration = Context->RuleTableGeneration;
+    if (header.BaseGeneration != baseGeneration) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if ((UINT64)Context->SourceRuleCount + header.Header.RuleCount > SECUREHOST_MAX_RULES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    records = (const UCHAR*)Buffer + header.Header.HeaderSize;
+    ruleCount = Context->SourceRuleCount;
+    capacity = ruleCount + header.Header.RuleCount;
+
+    rules = (PSECUREHOST_POLICY_RULE)ExAllocatePool2(
+        POOL_FLAG_PAGED,
+        (SIZE_T)capacity * sizeof(SECUREHOST_POLICY_RULE),
+        SECUREHOST_WFP_TAG
+    );
+
+    //
+    // Read against flows at DISPATCH_LEVEL
+    //
+    changes = (PSECUREHOST_RULE_CHANGE)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        (SIZE_T)header.Header.RuleCount * sizeof(SECUREHOST_RULE_CHANGE),
+        SECUREHOST_WFP_TAG
+    );
+
+    if (rules == NULL || changes == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    if (ruleCount != 0) {
+        RtlCopyMemory(rules, Context->SourceRules, (SIZE_T)ruleCount * sizeof(SECUREHOST_POLICY_RULE));
+    }
+
+    for (i = 0; i < header.Header.RuleCount; i++) {
+        SECUREHOST_NETWORK_RULE_DELTA_RECORD record;
+        SECUREHOST_POLICY_RULE rule;
+        PSECUREHOST_RULE_CHANGE change = &changes[i];
+        UINT32 index;
+        BOOLEAN found = FALSE;
+
+        SecureHostCaptureRecord(&header.Header, records, i, &record, sizeof(record));
+
+        if (record.Operation == SECUREHOST_RULE_DELTA_UPSERT) {
+            status = SecureHostConvertNetworkRule(&record.Rule, &rule);
+            if (!NT_SUCCESS(status)) {
+                goto cleanup;
+            }
+        } else if (record.Operation != SECUREHOST_RULE_DELTA_REMOVE) {
+            status = STATUS_INVALID_PARAMETER;
+            goto cleanup;
+        }
+
+        //
+        // Both operations start by dropping every copy of the rule
+        //
+        while ((index = SecureHostFindSourceRule(rules, ruleCount, record.Rule.RuleId)) < ruleCount) {
+            RtlMoveMemory(&rules[index],
+                          &rules[index + 1],
+                          (SIZE_T)(ruleCount - index - 1) * sizeof(SECUREHOST_POLICY_RULE));
+            ruleCount--;
+            found = TRUE;
+        }
+
+        RtlZeroMemory(change, sizeof(SECUREHOST_RULE_CHANGE));
+        change->RuleId = record.Rule.RuleId;
+
+        if (record.Operation == SECUREHOST_RULE_DELTA_REMOVE) {
+            if (!found) {
+                status = STATUS_NOT_FOUND;
+                goto cleanup;
+            }
+            continue;
+        }
+
+        index = (record.InsertBefore == 0) ?
+            ruleCount :
+            SecureHostFindSourceRule(rules, ruleCount, record.InsertBefore);
+
+        if (index == ruleCount && record.InsertBefore != 0) {
+            status = STATUS_NOT_FOUND;
+            goto cleanup;
+        }
+
+        RtlMoveMemory(&rules[index + 1],
+                      &rules[index],
+                      (SIZE_T)(ruleCount - index) * sizeof(SECUREHOST_POLICY_RULE));
+        rules[index] = rule;
+        ruleCount++;
+
+        //
+        // A disabled rule is dropped at compile time and cannot match
+        //
+        if (rule.Enabled) {
+            change->Matches = TRUE;
+            change->RemoteIpVersion = rule.RemoteIpVersion;
+            SecureHostCompileRule(&change->Match, &rule, 0);
+
+            if (rule.RemoteIpVersion != 0) {
+                SecureHostAddressToHost(&rule.RemoteAddress, &change->Prefix.High, &change->Prefix.Low);
+                SecureHostMaskPrefix(&change->Prefix.High, &change->Prefix.Low, rule.RemotePrefixLength);
+                change->Prefix.Length = rule.RemotePrefixLength;
+            }
+        }
+    }
+
+    status = SecureHostCompileRuleTable(rules, ruleCount, header.Header.Generation, &table);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    status = SecureHostPublishRuleTable(Context, table);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: Stale delta generation %llu rejected\n", header.Header.Generation));
+        ExFreePoolWithTag(table, SECUREHOST_WFP_TAG);
+        goto cleanup;
+    }
+
+    //
+    // No reader of the previous table remains, so every verdict still
+    // stamped with its generation was computed against it
+    //
+    SecureHostCarryFlowVerdicts(Context,
+                                baseGeneration,
+                                Context->RuleTableGeneration,
+                                changes,
+                                header.Header.RuleCount);
+
+    KdPrint(("SecureHostWFP: Applied %lu rule changes, %lu network rules\n",
+             header.Header.RuleCount, ruleCount));
+
+    SecureHostUpdateOffloadFilters(Context, rules, ruleCount);
+    SecureHostRetainSourceRules(Context, rules, ruleCount);
+    rules = NULL;
+
+cleanup:
+    if (changes != NULL) {
+        ExFreePoolWithTag(changes, SECUREHOST_WFP_TAG);
+    }
+    if (rules != NULL) {
+        ExFreePoolWithTag(rules, SECUREHOST_WFP_TAG);
+    }
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Replaces the retained source rules with those of a newly published
+    table, taking ownership of Rules. NULL frees them.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostRetainSourceRules(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    PSECUREHOST_POLICY_RULE Rules,
+    UINT32 RuleCount
+)
+{
+    PAGED_CODE();
+
+    if (Context->SourceRules != NULL) {
+        ExFreePoolWithTag(Context->SourceRules, SECUREHOST_WFP_TAG);
+    }
+
+    Context->SourceRules = Rules;
+    Context->SourceRuleCount = (Rules != NULL) ? RuleCount : 0;
+}
+
+//
+// Checks whether two rules' remote prefixes share any address. Prefixes
+// nest or are disjoint, so it is enough to compare at the shorter length.
+//
+FORCEINLINE
+BOOLEAN
+SecureHostRemotePrefixesOverlap(
+    _In_ const SECUREHOST_POLICY_RULE* First,
+    _In_ const SECUREHOST_POLICY_RULE* Second
+)
+{
+    UINT32 length;
+    UINT64 firstHigh;
+    UINT64 firstLow;
+    UINT64 secondHigh;
+    UINT64 secondLow;
+
+    if (First->RemoteIpVersion == 0 || Second->RemoteIpVersion == 0) {
+        return TRUE;
+    }
+
+    if (First->RemoteIpVersion != Second->RemoteIpVersion) {
+        return FALSE;
+    }
+
+    length = min(First->RemotePrefixLength, Second->RemotePrefixLength);
+    SecureHostAddressToHost(&First->RemoteAddress, &firstHigh, &firstLow);
+    SecureHostAddressToHost(&Second->RemoteAddress, &secondHigh, &secondLow);
+    SecureHostMaskPrefix(&firstHigh, &firstLow, length);
+    SecureHostMaskPrefix(&secondHigh, &secondLow, length);
+
+    return firstHigh == secondHigh && firstLow == secondLow;
+}
+
+//
+// Checks whether two rules can match the same connection (0 = wildcard)
+//
+FORCEINLINE
+BOOLEAN
+SecureHostRulesOverlap(
+    _In_ const SECUREHOST_POLICY_RULE* First,
+    _In_ const SECUREHOST_POLICY_RULE* Second
+)
+{
+    return (First->Protocol == 0 || Second->Protocol == 0 || First->Protocol == Second->Protocol) &&
+           (First->LocalPort == 0 || Second->LocalPort == 0 || First->LocalPort == Second->LocalPort) &&
+           (First->RemotePort == 0 || Second->RemotePort == 0 || First->RemotePort == Second->RemotePort) &&
+           (First->ProcessId == 0 || Second->ProcessId == 0 || First->ProcessId == Second->ProcessId) &&
+           (First->AppIdHash == 0 || Second->AppIdHash == 0 || First->AppIdHash == Second->AppIdHash) &&
+           SecureHostRemotePrefixesOverlap(First, Second);
+}
+
+/*++
+
+Routine Description:
+    Adds the native auth-connect filters for one offloaded rule, one per
+    address family. Must be called inside a BFE transaction.
+
+--*/
+static
+NTSTATUS
+SecureHostAddOffloadFilters(
+    _In_ HANDLE EngineHandle,
+    _In_ const SECUREHOST_POLICY_RULE* Rule,
+    _In_ UINT64 Weight,
+    _Out_writes_(2) PUINT64 FilterIds
+)
+{
+    static const GUID* const layers[2] = {
+        &FWPM_LAYER_ALE_AUTH_CONNECT_V4,
+        &FWPM_LAYER_ALE_AUTH_CONNECT_V6
+    };
+    FWPM_FILTER0 filter;
+    FWPM_FILTER_CONDITION0 conditions[3];
+    UINT32 conditionCount = 0;
+    NTSTATUS status;
+    UINT32 i;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(conditions, sizeof(conditions));
+
+    if (Rule->Protocol != 0) {
+        conditions[conditionCount].fieldKey = FWPM_CONDITION_IP_PROTOCOL;
+        conditions[conditionCount].matchType = FWP_MATCH_EQUAL;
+        conditions[conditionCount].conditionValue.type = FWP_UINT8;
+        conditions[conditionCount].conditionValue.uint8 = (UINT8)Rule->Protocol;
+        conditionCount++;
+    }
+
+    if (Rule->LocalPort != 0) {
+        conditions[conditionCount].fieldKey = FWPM_CONDITION_IP_LOCAL_PORT;
+        conditions[conditionCount].matchType = FWP_MATCH_EQUAL;
+        conditions[conditionCount].conditionValue.type = FWP_UINT16;
+        conditions[conditionCount].conditionValue.uint16 = Rule->LocalPort;
+        conditionCount++;
+    }
+
+    if (Rule->RemotePort != 0) {
+        conditions[conditionCount].fieldKey = FWPM_CONDITION_IP_REMOTE_PORT;
+        conditions[conditionCount].matchType = FWP_MATCH_EQUAL;
+        conditions[conditionCount].conditionValue.type = FWP_UINT16;
+        conditions[conditionCount].conditionValue.uint16 = Rule->RemotePort;
+        conditionCount++;
+    }
+
+    for (i = 0; i < RTL_NUMBER_OF(layers); i++) {
+        RtlZeroMemory(&filter, sizeof(filter));
+
+        filter.displayData.name = L"SecureHost Offloaded Rule";
+        filter.displayData.description = L"Native filter for a static SecureHost rule";
+        filter.layerKey = *layers[i];
+        filter.subLayerKey = SECUREHOST_WFP_SUBLAYER_GUID;
+        filter.weight.type = FWP_UINT64;
+        filter.weight.uint64 = &Weight;
+        filter.numFilterConditions = conditionCount;
+        filter.filterCondition = (conditionCount != 0) ? conditions : NULL;
+        filter.action.type = Rule->Action;
+        filter.rawContext = Rule->RuleId;
+
+        //
+        // Blocks are final, as they are when the callout decides them
+        //
+        if (Rule->Action == FWP_ACTION_BLOCK) {
+            filter.flags = FWPM_FILTER_FLAG_CLEAR_ACTION_RIGHT;
+        }
+
+        status = FwpmFilterAdd0(EngineHandle, &filter, NULL, &FilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Replaces the native filter set with one derived from a newly published
+    rule set. Walks the rules in precedence order and offloads each permit
+    rule that only constrains protocol and ports, unless an earlier rule
+    that stays with the callout could match the same connection and decide
+    it differently (or must audit it). Block rules always stay with the
+    callout, so every block is counted and reported.
+
+    Failing to offload is never fatal: the callout enforces every rule
+    on its own. If the new set cannot be installed, the old set is
+    removed rather than left enforcing stale precedence.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostUpdateOffloadFilters(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_POLICY_RULE* Rules,
+    UINT32 RuleCount
+)
+{
+    const SECUREHOST_POLICY_RULE* barriers[SECUREHOST_MAX_OFFLOAD_BARRIERS];
+    const SECUREHOST_POLICY_RULE** offload = NULL;
+    PUINT64 filterIds = NULL;
+    UINT32 barrierCount = 0;
+    UINT32 offloadCount = 0;
+    UINT32 filterCount = 0;
+    NTSTATUS status;
+    BOOLEAN blocked;
+    UINT32 i;
+    UINT32 j;
+
+    PAGED_CODE();
+
+    if (Context->EngineHandle == NULL) {
+        return;
+    }
+
+    if (RuleCount != 0) {
+        offload = (const SECUREHOST_POLICY_RULE**)ExAllocatePool2(
+            POOL_FLAG_PAGED,
+            (SIZE_T)min(RuleCount, SECUREHOST_MAX_OFFLOAD_RULES) * sizeof(*offload),
+            SECUREHOST_WFP_TAG
+        );
+
+        if (offload == NULL) {
+            SecureHostRemoveOffloadFilters(Context);
+            return;
+        }
+    }
+
+    for (i = 0; i < RuleCount && offloadCount < SECUREHOST_MAX_OFFLOAD_RULES; i++) {
+        const SECUREHOST_POLICY_RULE* rule = &Rules[i];
+
+        if (!rule->Enabled) {
+            continue;
+        }
+
+        if (rule->ProcessId != 0 || rule->AppIdHash != 0 || rule->RemoteIpVersion != 0 ||
+            rule->Audit || rule->Deferred || rule->Action == FWP_ACTION_BLOCK) {
+            //
+            // Callout-only rule: later rules must not jump ahead of it.
+            // Past the barrier limit, stop offloading altogether.
+            //
+            if (barrierCount == SECUREHOST_MAX_OFFLOAD_BARRIERS) {
+                break;
+            }
+            barriers[barrierCount++] = rule;
+            continue;
+        }
+
+        blocked = FALSE;
+        for (j = 0; j < barrierCount; j++) {
+            if (SecureHostRulesOverlap(barriers[j], rule) &&
+                (barriers[j]->Audit || barriers[j]->Deferred || barriers[j]->Action != rule->Action)) {
+                blocked = TRUE;
+                break;
+            }
+        }
+
+        if (blocked) {
+            if (barrierCount == SECUREHOST_MAX_OFFLOAD_BARRIERS) {
+                break;
+            }
+            barriers[barrierCount++] = rule;
+            continue;
+        }
+
+        offload[offloadCount++] = rule;
+    }
+
+    if (offloadCount != 0) {
+        filterIds = (PUINT64)ExAllocatePool2(
+            POOL_FLAG_PAGED,
+            (SIZE_T)offloadCount * 2 * sizeof(UINT64),
+            SECUREHOST_WFP_TAG
+        );
+
+        if (filterIds == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto fallback;
+        }
+    }
+
+    //
+    // Swap the filter sets in one transaction. Earlier rules get higher
+    // weights; all of them outrank the catch-all callout filter.
+    //
+    status = FwpmTransactionBegin0(Context->EngineHandle, 0);
+    if (!NT_SUCCESS(status)) {
+        goto fallback;
+    }
+
+    for (i = 0; i < Context->OffloadFilterCount; i++) {
+        status = FwpmFilterDeleteById0(Context->EngineHandle, Context->OffloadFilterIds[i]);
+        if (!NT_SUCCESS(status)) {
+            goto abort;
+        }
+    }
+
+    for (i = 0; i < offloadCount; i++) {
+        status = SecureHostAddOffloadFilters(
+            Context->EngineHandle,
+            offload[i],
+            (UINT64)(offloadCount - i),
+            &filterIds[filterCount]
+        );
+
+        if (!NT_SUCCESS(status)) {
+            goto abort;
+        }
+
+        filterCount += 2;
+    }
+
+    status = FwpmTransactionCommit0(Context->EngineHandle);
+    if (!NT_SUCCESS(status)) {
+        goto fallback;
+    }
+
+    if (Context->OffloadFilterIds != NULL) {
+        ExFreePoolWithTag(Context->OffloadFilterIds, SECUREHOST_WFP_TAG);
+    }
+
+    Context->OffloadFilterIds = filterIds;
+    Context->OffloadFilterCount = filterCount;
+    InterlockedExchange(&Context->OffloadedRuleCount, (LONG)offloadCount);
+
+    KdPrint(("SecureHostWFP: Offloaded %lu of %lu network rules\n", offloadCount, RuleCount));
+
+    if (offload != NULL) {
+        ExFreePoolWithTag(offload, SECUREHOST_WFP_TAG);
+    }
+    return;
+
+abort:
+    FwpmTransactionAbort0(Context->EngineHandle);
+
+fallback:
+    KdPrint(("SecureHostWFP: Rule offload failed: 0x%08X\n", status));
+
+    if (filterIds != NULL) {
+        ExFreePoolWithTag(filterIds, SECUREHOST_WFP_TAG);
+    }
+    if (offload != NULL) {
+        ExFreePoolWithTag(offload, SECUREHOST_WFP_TAG);
+    }
+
+    SecureHostRemoveOffloadFilters(Context);
+}
+
+/*++
+
+Routine Description:
+    Removes all native filters for offloaded rules, leaving enforcement
+    entirely to the callout.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostRemoveOffloadFilters(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    UINT32 i;
+
+    PAGED_CODE();
+
+    if (Context->OffloadFilterIds == NULL) {
+        return;
+    }
+
+    for (i = 0; i < Context->OffloadFilterCount; i++) {
+        FwpmFilterDeleteById0(Context->EngineHandle, Context->OffloadFilterIds[i]);
+    }
+
+    ExFreePoolWithTag(Context->OffloadFilterIds, SECUREHOST_WFP_TAG);
+    Context->OffloadFilterIds = NULL;
+    Context->OffloadFilterCount = 0;
+    InterlockedExchange(&Context->OffloadedRuleCount, 0);
+}
+
+/*++
+
+Routine Description:
+    Runs in the requesting thread's context before a request is queued.
+    Event subscription needs that context to reference the caller's event
+    handle and map the channel into its address space; everything else
+    goes to the default queue.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEvtIoInCallerContext(
+    WDFDEVICE Device,
+    WDFREQUEST Request
+)
+{
+    NTSTATUS status;
+    WDF_REQUEST_PARAMETERS params;
+    size_t information = 0;
+
+    PAGED_CODE();
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    if (params.Type == WdfRequestTypeDeviceControl &&
+        params.Parameters.DeviceIoControl.IoControlCode == IOCTL_SECUREHOST_SUBSCRIBE_EVENTS) {
+
+        status = SecureHostSubscribeEvents(GetDriverContext(WdfGetDriver()), Request, &information);
+        WdfRequestCompleteWithInformation(Request, status, information);
+        return;
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+/*++
+
+Routine Description:
+    Handle cleanup callback. Runs in the context of whichever process
+    closes the last handle, which need not be the subscriber. Closing
+    the decision client's handle releases its pended connections.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEvtFileCleanup(
+    WDFFILEOBJECT FileObject
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = GetDriverContext(WdfGetDriver());
+
+    PAGED_CODE();
+
+    SecureHostUnsubscribeEvents(context, FileObject);
+    SecureHostCloseDecisionChannel(context, FileObject);
+}
+
+/*++
+
+Routine Description:
+    Maps the connection event channel into the calling process and starts
+    recording events. Only one subscriber is allowed at a time.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostSubscribeEvents(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFREQUEST Request,
+    size_t* Information
+)
+{
+    NTSTATUS status;
+    PSECUREHOST_EVENT_SUBSCRIBE_INPUT input;
+    PSECUREHOST_EVENT_SUBSCRIBE_OUTPUT output;
+    PSECUREHOST_EVENT_CHANNEL_HEADER channel;
+    PSECUREHOST_EVENT_AGGREGATOR aggregators;
+    PKEVENT signal = NULL;
+    PVOID userAddress = NULL;
+    SIZE_T channelSize;
+    LARGE_INTEGER dueTime;
+    ULONG i;
+
+    PAGED_CODE();
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(*input), (PVOID*)&input, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*output), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(
+        (HANDLE)(ULONG_PTR)input->EventHandle,
+        EVENT_MODIFY_STATE,
+        *ExEventObjectType,
+        UserMode,
+        (PVOID*)&signal,
+        NULL
+    );
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ExAcquireFastMutex(&Context->EventChannelMutex);
+
+    if (Context->EventSubscriber != NULL) {
+        status = STATUS_DEVICE_BUSY;
+        goto unlock;
+    }
+
+    //
+    // Allocate the channel on first use. Page-sized pool allocations are
+    // page aligned and zeroed, so nothing else is exposed by the mapping.
+    //
+    if (Context->EventChannel == NULL) {
+        channelSize = ROUND_TO_PAGES(
+            sizeof(SECUREHOST_EVENT_CHANNEL_HEADER) +
+            (SIZE_T)Context->GracePeriodDpcCount * sizeof(SECUREHOST_EVENT_RING));
+
+        channel = (PSECUREHOST_EVENT_CHANNEL_HEADER)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            channelSize,
+            SECUREHOST_WFP_TAG
+        );
+
+        if (channel == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto unlock;
+        }
+
+        Context->EventChannelMdl = IoAllocateMdl(channel, (ULONG)channelSize, FALSE, FALSE, NULL);
+        if (Context->EventChannelMdl == NULL) {
+            ExFreePoolWithTag(channel, SECUREHOST_WFP_TAG);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto unlock;
+        }
+
+        MmBuildMdlForNonPagedPool(Context->EventChannelMdl);
+
+        aggregators = (PSECUREHOST_EVENT_AGGREGATOR)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            (SIZE_T)Context->GracePeriodDpcCount * sizeof(SECUREHOST_EVENT_AGGREGATOR),
+            SECUREHOST_WFP_TAG
+        );
+
+        if (aggregators == NULL) {
+            IoFreeMdl(Context->EventChannelMdl);
+            Context->EventChannelMdl = NULL;
+            ExFreePoolWithTag(channel, SECUREHOST_WFP_TAG);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto unlock;
+        }
+
+        for (i = 0; i < Context->GracePeriodDpcCount; i++) {
+            PROCESSOR_NUMBER processor;
+
+            KeInitializeDpc(&aggregators[i].FlushDpc, SecureHostEventAggregatorDpc, Context);
+            aggregators[i].FlushTargeted =
+                NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor)) &&
+                NT_SUCCESS(KeSetTargetProcessorDpcEx(&aggregators[i].FlushDpc, &processor));
+        }
+
+        channel->Version = SECUREHOST_EVENT_CHANNEL_VERSION;
+        channel->HeaderSize = sizeof(SECUREHOST_EVENT_CHANNEL_HEADER);
+        channel->RingCount = Context->GracePeriodDpcCount;
+        channel->RingCapacity = SECUREHOST_EVENT_RING_CAPACITY;
+        channel->RingSize = sizeof(SECUREHOST_EVENT_RING);
+        channel->RecordSize = sizeof(SECUREHOST_CONNECTION_EVENT);
+        channel->Watermark = SECUREHOST_EVENT_WATERMARK;
+
+        Context->EventChannel = channel;
+        Context->EventChannelSize = channelSize;
+        Context->EventAggregators = aggregators;
+        Context->EventRingCount = Context->GracePeriodDpcCount;
+    }
+
+    __try {
+        userAddress = MmMapLockedPagesSpecifyCache(
+            Context->EventChannelMdl,
+            UserMode,
+            MmCached,
+            NULL,
+            FALSE,
+            NormalPagePriority | MdlMappingNoExecute
+        );
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        userAddress = NULL;
+    }
+
+    if (userAddress == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto unlock;
+    }
+
+    //
+    // Cleanup can run in another process if the handle was inherited or
+    // duplicated; keep the subscriber's process to unmap the view in
+    //
+    Context->EventUserAddress = userAddress;
+    Context->EventSubscriberProcess = PsGetCurrentProcess();
+    ObReferenceObject(Context->EventSubscriberProcess);
+    Context->EventSubscriber = WdfRequestGetFileObject(Request);
+    InterlockedExchange(&Context->EventChannel->WakeupArmed, 0);
+
+    //
+    // Start producing; the reference on the event now belongs to the
+    // subscription
+    //
+    WritePointerRelease((PVOID volatile*)&Context->EventSignal, signal);
+    signal = NULL;
+
+    dueTime.QuadPart = -(LONGLONG)SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_AGGREGATE_WINDOW_MS);
+    KeSetCoalescableTimer(
+        &Context->EventFlushTimer,
+        dueTime,
+        SECUREHOST_AGGREGATE_WINDOW_MS,
+        SECUREHOST_AGGREGATE_WINDOW_MS / 4,
+        &Context->EventFlushTimerDpc
+    );
+
+    output->BaseAddress = (UINT64)(ULONG_PTR)userAddress;
+    output->Size = Context->EventChannelSize;
+    *Information = sizeof(*output);
+    status = STATUS_SUCCESS;
+
+unlock:
+    ExReleaseFastMutex(&Context->EventChannelMutex);
+
+    if (signal != NULL) {
+        ObDereferenceObject(signal);
+    }
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Stops recording events and removes the subscriber's mapping if
+    FileObject holds the subscription.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostUnsubscribeEvents(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFFILEOBJECT FileObject
+)
+{
+    PKEVENT signal;
+    ULONG i;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Context->EventChannelMutex);
+
+    if (Context->EventSubscriber != FileObject) {
+        ExReleaseFastMutex(&Context->EventChannelMutex);
+        return;
+    }
+
+    signal = (PKEVENT)InterlockedExchangePointer((PVOID volatile*)&Context->EventSignal, NULL);
+
+    //
+    // Producers use the event at DISPATCH_LEVEL; wait them out before
+    // dropping the reference. The grace-period DPCs are shared with rule
+    // table retirement and serialized by RuleTableMutex.
+    //
+    ExAcquireFastMutex(&Context->RuleTableMutex);
+    SecureHostWaitForRuleTableReaders(Context);
+    ExReleaseFastMutex(&Context->RuleTableMutex);
+
+    //
+    // Repeats still held in the aggregators go unreported; the next
+    // subscriber starts with empty windows
+    //
+    KeCancelTimer(&Context->EventFlushTimer);
+    KeFlushQueuedDpcs();
+
+    for (i = 0; i < Context->EventRingCount; i++) {
+        PSECUREHOST_EVENT_AGGREGATOR aggregator = &Context->EventAggregators[i];
+
+        RtlZeroMemory(aggregator->Entries, sizeof(aggregator->Entries));
+        aggregator->Occupied = 0;
+        aggregator->WindowEnd = 0;
+    }
+
+    SecureHostUnmapEventChannelLocked(Context);
+    Context->EventSubscriber = NULL;
+
+    ExReleaseFastMutex(&Context->EventChannelMutex);
+
+    if (signal != NULL) {
+        ObDereferenceObject(signal);
+    }
+}
+
+/*++
+
+Routine Description:
+    Removes the channel's user view from the subscriber's process, if it
+    is still mapped, attaching to that process when called from another.
+    Producers write through the kernel mapping, so events keep flowing
+    into the rings until the subscription itself ends. Called with
+    EventChannelMutex held.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostUnmapEventChannelLocked(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    PEPROCESS process = Context->EventSubscriberProcess;
+    KAPC_STATE apcState;
+
+    PAGED_CODE();
+
+    if (Context->EventUserAddress == NULL) {
+        return;
+    }
+
+    if (process == PsGetCurrentProcess()) {
+        MmUnmapLockedPages(Context->EventUserAddress, Context->EventChannelMdl);
+    } else {
+        KeStackAttachProcess(process, &apcState);
+        MmUnmapLockedPages(Context->EventUserAddress, Context->EventChannelMdl);
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    Context->EventUserAddress = NULL;
+    Context->EventSubscriberProcess = NULL;
+    ObDereferenceObject(process);
+}
+
+/*++
+
+Routine Description:
+    Appends a connection event to a processor's ring, dropping it if the
+    ring is full. Never blocks. Wakes the subscriber once the backlog
+    reaches the watermark and the subscriber has armed wakeup. Runs at
+    DISPATCH_LEVEL on the processor that owns the ring.
+
+    Ring indices live in user-writable memory. They are only ever masked
+    into the ring and used for flow control, never as bounds.
+
+--*/
+static
+VOID
+SecureHostPushConnectionEvent(
+    _In_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ ULONG Processor,
+    _In_ PKEVENT Signal,
+    _In_ const SECUREHOST_CONNECTION_EVENT* Event
+)
+{
+    PSECUREHOST_EVENT_RING ring;
+    LONG64 write;
+    LONG64 pending;
+
+    ring = (PSECUREHOST_EVENT_RING)(Context->EventChannel + 1) + Processor;
+
+    write = ReadNoFence64(&ring->WriteIndex);
+    pending = write - ReadAcquire64(&ring->ReadIndex);
+
+    if ((ULONG64)pending < SECUREHOST_EVENT_RING_CAPACITY) {
+        ring->Records[write & (SECUREHOST_EVENT_RING_CAPACITY - 1)] = *Event;
+        WriteRelease64(&ring->WriteIndex, write + 1);
+        pending++;
+    } else {
+        WriteNoFence64(&ring->Dropped, ReadNoFence64(&ring->Dropped) + 1);
+        SecureHostLocalCounters(Context)->EventsDropped++;
+    }
+
+    if ((ULONG64)pending >= SECUREHOST_EVENT_WATERMARK &&
+        InterlockedExchange(&Context->EventChannel->WakeupArmed, 0) != 0) {
+        KeSetEvent(Signal, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+//
+// The port that identifies the service side of a connection
+//
+FORCEINLINE
+UINT16
+SecureHostEventServicePort(
+    _In_ const SECUREHOST_CONNECTION_EVENT* Event
+)
+{
+    return (Event->Direction == SECUREHOST_DIRECTION_INBOUND) ? Event->LocalPort : Event->RemotePort;
+}
+
+//
+// Hashes the aggregation key of an event. Never returns 0, which marks a
+// free entry.
+//
+FORCEINLINE
+UINT32
+SecureHostHashEventKey(
+    _In_ const SECUREHOST_CONNECTION_EVENT* Event
+)
+{
+    const UINT32* local = (const UINT32*)Event->LocalAddress;
+    const UINT32* remote = (const UINT32*)Event->RemoteAddress;
+    UINT32 hash;
+    ULONG i;
+
+    hash = Event->ProcessId ^ (UINT32)Event->RuleId ^ (UINT32)(Event->RuleId >> 32);
+    hash = (hash ^ ((UINT32)Event->IpVersion | ((UINT32)Event->Protocol << 8) |
+                    ((UINT32)Event->Direction << 16) | ((UINT32)Event->Verdict << 24))) * 0x9E3779B1u;
+    hash = (hash ^ SecureHostEventServicePort(Event)) * 0x9E3779B1u;
+
+    for (i = 0; i < 4; i++) {
+        hash = (hash ^ remote[i]) * 0x9E3779B1u;
+        hash = (hash ^ local[i]) * 0x9E3779B1u;
+    }
+
+    hash ^= hash >> 15;
+    return hash != 0 ? hash : 1;
+}
+
+FORCEINLINE
+BOOLEAN
+SecureHostSameEventKey(
+    _In_ const SECUREHOST_CONNECTION_EVENT* Left,
+    _In_ const SECUREHOST_CONNECTION_EVENT* Right
+)
+{
+    return Left->ProcessId == Right->ProcessId &&
+           Left->ProcessCreateTime == Right->ProcessCreateTime &&
+           Left->RuleId == Right->RuleId &&
+           Left->IpVersion == Right->IpVersion &&
+           Left->Protocol == Right->Protocol &&
+           Left->Direction == Right->Direction &&
+           Left->Verdict == Right->Verdict &&
+           Left->AuditMode == Right->AuditMode &&
+           SecureHostEventServicePort(Left) == SecureHostEventServicePort(Right) &&
+           RtlEqualMemory(Left->RemoteAddress, Right->RemoteAddress, sizeof(Left->RemoteAddress)) &&
+           RtlEqualMemory(Left->LocalAddress, Right->LocalAddress, sizeof(Left->LocalAddress));
+}
+
+/*++
+
+Routine Description:
+    Looks up an event's key in the processor's repeat table. A repeat is
+    absorbed into its entry (returns TRUE). A new key is entered and
+    returns FALSE so the caller records it; so does a key that finds no
+    free entry within SECUREHOST_AGGREGATE_PROBES slots.
+
+--*/
+static
+BOOLEAN
+SecureHostAggregateConnectionEvent(
+    _Inout_ PSECUREHOST_EVENT_AGGREGATOR Aggregator,
+    _In_ const SECUREHOST_CONNECTION_EVENT* Event
+)
+{
+    PSECUREHOST_EVENT_AGGREGATE entry;
+    UINT32 hash;
+    ULONG probe;
+
+    hash = SecureHostHashEventKey(Event);
+
+    for (probe = 0; probe < SECUREHOST_AGGREGATE_PROBES; probe++) {
+        entry = &Aggregator->Entries[(hash + probe) & (SECUREHOST_AGGREGATE_ENTRIES - 1)];
+
+        if (entry->Hash == 0) {
+            entry->Hash = hash;
+            entry->Repeats = 0;
+            entry->RepeatWeight = 0;
+            entry->Event = *Event;
+            Aggregator->Occupied++;
+            return FALSE;
+        }
+
+        if (entry->Hash == hash && SecureHostSameEventKey(&entry->Event, Event)) {
+            if (entry->Repeats == MAXUINT32 || entry->RepeatWeight > MAXUINT32 - Event->Weight) {
+                return FALSE;
+            }
+
+            if (entry->Repeats == 0) {
+                entry->Event.Timestamp = Event->Timestamp;
+                entry->Event.CorrelationId = Event->CorrelationId;
+                entry->Event.ClassifyTime = Event->ClassifyTime;
+                entry->Event.VerdictTicks = Event->VerdictTicks;
+                entry->Event.TraceFlags = Event->TraceFlags;
+            }
+
+            entry->Event.LastTimestamp = Event->Timestamp;
+            entry->Repeats++;
+            entry->RepeatWeight += Event->Weight;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*++
+
+Routine Description:
+    Closes a processor's repeat window: records one event per key that
+    repeated and empties the table.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostFlushEventAggregator(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    PSECUREHOST_EVENT_AGGREGATOR Aggregator,
+    ULONG Processor,
+    PKEVENT Signal
+)
+{
+    PSECUREHOST_EVENT_AGGREGATE entry;
+    ULONG i;
+
+    if (Aggregator->Occupied == 0) {
+        return;
+    }
+
+    for (i = 0; i < SECUREHOST_AGGREGATE_ENTRIES; i++) {
+        entry = &Aggregator->Entries[i];
+
+        if (entry->Hash == 0) {
+            continue;
+        }
+
+        if (entry->Repeats != 0) {
+            entry->Event.Count = entry->Repeats;
+            entry->Event.Weight = entry->RepeatWeight;
+            SecureHostPushConnectionEvent(Context, Processor, Signal, &entry->Event);
+        }
+
+        entry->Hash = 0;
+    }
+
+    Aggregator->Occupied = 0;
+}
+
+/*++
+
+Routine Description:
+    Records a connection event on the current processor. Repeats of a key
+    already recorded in the current window are coalesced; an expired
+    window is flushed first.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostRecordConnectionEvent(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_CONNECTION_EVENT* Event
+)
+{
+    PSECUREHOST_EVENT_AGGREGATOR aggregator;
+    PKEVENT signal;
+    ULONG processor;
+    UINT64 now;
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    signal = (PKEVENT)ReadPointerAcquire((PVOID const volatile*)&Context->EventSignal);
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (signal != NULL && processor < Context->EventRingCount) {
+        aggregator = &Context->EventAggregators[processor];
+        now = KeQueryInterruptTime();
+
+        if (now >= aggregator->WindowEnd) {
+            SecureHostFlushEventAggregator(Context, aggregator, processor, signal);
+            aggregator->WindowEnd = now + SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_AGGREGATE_WINDOW_MS);
+        }
+
+        if (!SecureHostAggregateConnectionEvent(aggregator, Event)) {
+            SecureHostPushConnectionEvent(Context, processor, signal, Event);
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+}
+
+/*++
+
+Routine Description:
+    Periodic timer while subscribed. Closes the windows of processors with
+    pending repeats, so a burst is reported even if its processor goes
+    quiet; each flush runs on its own processor.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEventFlushTimerDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = (PSECUREHOST_DRIVER_CONTEXT)DeferredContext;
+    PSECUREHOST_EVENT_AGGREGATOR aggregator;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    for (i = 0; i < context->EventRingCount; i++) {
+        aggregator = &context->EventAggregators[i];
+
+        //
+        // Unsynchronized read; a stale value only delays the flush to
+        // the next tick or the processor's next event
+        //
+        if (aggregator->FlushTargeted && ReadULongNoFence(&aggregator->Occupied) != 0) {
+            KeInsertQueueDpc(&aggregator->FlushDpc, NULL, NULL);
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Flushes the repeat table of the processor this DPC is targeted at,
+    if its window has expired. The next event opens a new window.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostEventAggregatorDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context = (PSECUREHOST_DRIVER_CONTEXT)DeferredContext;
+    PSECUREHOST_EVENT_AGGREGATOR aggregator;
+    PKEVENT signal;
+    ULONG processor;
+
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    aggregator = CONTAINING_RECORD(Dpc, SECUREHOST_EVENT_AGGREGATOR, FlushDpc);
+    processor = (ULONG)(aggregator - context->EventAggregators);
+
+    signal = (PKEVENT)ReadPointerAcquire((PVOID const volatile*)&context->EventSignal);
+
+    if (signal != NULL &&
+        processor == KeGetCurrentProcessorNumberEx(NULL) &&
+        KeQueryInterruptTime() >= aggregator->WindowEnd) {
+        SecureHostFlushEventAggregator(context, aggregator, processor, signal);
+        aggregator->WindowEnd = 0;
+    }
+}
+
+//
+// Whether two keys describe the same connection. Direction is left out:
+// the auth-connect and flow-established layers report it differently.
+//
+FORCEINLINE
+BOOLEAN
+SecureHostSameConnection(
+    _In_ const SECUREHOST_CONNECTION_KEY* First,
+    _In_ const SECUREHOST_CONNECTION_KEY* Second
+)
+{
+    return First->ProcessId == Second->ProcessId &&
+           First->AppIdHash == Second->AppIdHash &&
+           First->Protocol == Second->Protocol &&
+           First->LocalPort == Second->LocalPort &&
+           First->RemotePort == Second->RemotePort &&
+           First->IpVersion == Second->IpVersion &&
+           RtlEqualMemory(First->LocalAddress.Bytes, Second->LocalAddress.Bytes,
+                          sizeof(First->LocalAddress.Bytes)) &&
+           RtlEqualMemory(First->RemoteAddress.Bytes, Second->RemoteAddress.Bytes,
+                          sizeof(First->RemoteAddress.Bytes));
+}
+
+//
+// Frees a decision entry that has been taken off its list
+//
+FORCEINLINE
+VOID
+SecureHostFreeDecision(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ PSECUREHOST_PENDED_CONNECTION Entry
+)
+{
+    Context->DecisionCount--;
+    ExFreeToLookasideListEx(&Context->DecisionLookaside, Entry);
+}
+
+/*++
+
+Routine Description:
+    Moves a pending entry to the decided list with the given verdict and
+    hands back its completion context. The caller completes the pended
+    operation after dropping DecisionLock; WFP then reauthorizes the
+    connection, which finds the entry here.
+
+--*/
+static
+_Requires_lock_held_(Context->DecisionLock)
+VOID
+SecureHostDecideLocked(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _Inout_ PSECUREHOST_PENDED_CONNECTION Entry,
+    _In_ FWP_ACTION_TYPE Verdict,
+    _Out_writes_(SECUREHOST_DECISION_FLUSH_BATCH) HANDLE* Completions,
+    _Inout_ PULONG CompletionCount
+)
+{
+    RemoveEntryList(&Entry->Link);
+
+    Entry->Verdict = Verdict;
+    Entry->State = SecureHostDecisionDecided;
+    Entry->Deadline = KeQueryInterruptTime() +
+        SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_DECISION_RETENTION_MS);
+    InsertTailList(&Context->DecidedConnections, &Entry->Link);
+
+    Completions[(*CompletionCount)++] = Entry->CompletionContext;
+    Entry->CompletionContext = NULL;
+}
+
+/*++
+
+Routine Description:
+    Fills a fetch request with queued decision requests, oldest first,
+    and marks them delivered. Returns the bytes written.
+
+--*/
+static
+_Requires_lock_held_(Context->DecisionLock)
+NTSTATUS
+SecureHostDeliverDecisionsLocked(
+    _Inout_ PSECUREHOST_DRIVER_CONTEXT Context,
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* Information
+)
+{
+    PSECUREHOST_DECISION_REQUEST records;
+    PSECUREHOST_PENDED_CONNECTION entry;
+    size_t bufferLength;
+    size_t count = 0;
+    NTSTATUS status;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(
+        Request,
+        sizeof(SECUREHOST_DECISION_REQUEST),
+        (PVOID*)&records,
+        &bufferLength
+    );
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    while (!IsListEmpty(&Context->QueuedDecisions) &&
+           (count + 1) * sizeof(SECUREHOST_DECISION_REQUEST) <= bufferLength) {
+        PSECUREHOST_DECISION_REQUEST record = &records[count++];
+
+        entry = CONTAINING_RECORD(RemoveHeadList(&Context->QueuedDecisions),
+                                  SECUREHOST_PENDED_CONNECTION, Link);
+        entry->State = SecureHostDecisionDelivered;
+        InsertTailList(&Context->DeliveredDecisions, &entry->Link);
+
+        RtlZeroMemory(record, sizeof(*record));
+        record->RequestId = entry->RequestId;
+        record->RuleId = entry->RuleId;
+        record->ProcessId = entry->Key.ProcessId;
+        record->ProcessCreateTime = entry->ProcessCreateTime;
+        record->CorrelationId = entry->CorrelationId;
+        record->PendTime = entry->PendTime;
+        record->IpVersion = entry->Key.IpVersion;
+        record->Protocol = (UINT8)entry->Key.Protocol;
+        record->Direction = (entry->Key.Direction == FWP_DIRECTION_INBOUND) ?
+            SECUREHOST_DIRECTION_INBOUND : SECUREHOST_DIRECTION_OUTBOUND;
+        record->LocalPort = entry->Key.LocalPort;
+        record->RemotePort = entry->Key.RemotePort;
+        RtlCopyMemory(record->LocalAddress, entry->Key.LocalAddress.Bytes, sizeof(record->LocalAddress));
+        RtlCopyMemory(record->RemoteAddress, entry->Key.RemoteAddress.Bytes, sizeof(record->RemoteAddress));
+    }
+
+    *Information = count * sizeof(SECUREHOST_DECISION_REQUEST);
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Pends an auth-connect classification on a deferred rule and queues a
+    decision request for the service, completing a parked fetch if there
+    is one. Returns FALSE if the connection cannot wait: no service is
+    attached, the queue is full, or WFP refused to pend. The caller then
+    applies the fallback verdict.
+
+--*/
+_Use_decl_annotations_
+BOOLEAN
+SecureHostPendConnection(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_CONNECTION_KEY* Key,
+    UINT64 RuleId,
+    FWP_ACTION_TYPE Fallback,
+    HANDLE CompletionHandle,
+    UINT64 ClassifyTime
+)
+{
+    PSECUREHOST_PENDED_CONNECTION entry;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    WDFREQUEST request = NULL;
+    size_t information = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (ReadPointerNoFence((PVOID const volatile*)&Context->DecisionClient) == NULL) {
+        return FALSE;
+    }
+
+    entry = (PSECUREHOST_PENDED_CONNECTION)ExAllocateFromLookasideListEx(
+        &Context->DecisionLookaside);
+
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(entry, sizeof(SECUREHOST_PENDED_CONNECTION));
+    entry->RuleId = RuleId;
+    entry->ProcessCreateTime = SecureHostLookupProcessCreateTime(&Context->ProcessCache, Key->ProcessId);
+    entry->Key = *Key;
+    entry->Fallback = Fallback;
+    entry->Verdict = Fallback;
+    entry->State = SecureHostDecisionQueued;
+    entry->PendTime = ClassifyTime;
+
+    KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+    if (Context->DecisionClient == NULL ||
+        Context->DecisionsClosed ||
+        Context->DecisionCount >= SECUREHOST_MAX_PENDED_DECISIONS ||
+        !NT_SUCCESS(FwpsPendOperation0(CompletionHandle, &entry->CompletionContext))) {
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+        ExFreeToLookasideListEx(&Context->DecisionLookaside, entry);
+        return FALSE;
+    }
+
+    entry->RequestId = Context->NextDecisionId++;
+    entry->CorrelationId = SecureHostNextCorrelationId(Context);
+    entry->Deadline = KeQueryInterruptTime() +
+        SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_DECISION_TIMEOUT_MS);
+    InsertTailList(&Context->QueuedDecisions, &entry->Link);
+    Context->DecisionCount++;
+
+    if (!Context->DecisionTimerArmed) {
+        LARGE_INTEGER dueTime;
+
+        dueTime.QuadPart = -(LONGLONG)SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_DECISION_TIMER_MS);
+        KeSetCoalescableTimer(&Context->DecisionTimer, dueTime, SECUREHOST_DECISION_TIMER_MS,
+                              SECUREHOST_DECISION_TIMER_MS / 2, &Context->DecisionTimerDpc);
+        Context->DecisionTimerArmed = TRUE;
+    }
+
+    if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Context->DecisionRequestQueue, &request))) {
+        status = SecureHostDeliverDecisionsLocked(Context, request, &information);
+    } else {
+        request = NULL;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (request != NULL) {
+        WdfRequestCompleteWithInformation(request, status, information);
+    }
+
+    return TRUE;
+}
+
+/*++
+
+Routine Description:
+    Looks up the decision for a connection in the given state. Decided
+    entries are consumed by the reauthorization; a permit then stays as
+    Applied for flow establishment, which consumes it in turn. Trace, if
+    given, receives the pended classification's correlation ID and time.
+
+--*/
+_Use_decl_annotations_
+BOOLEAN
+SecureHostTakeDecision(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_CONNECTION_KEY* Key,
+    SECUREHOST_DECISION_STATE State,
+    FWP_ACTION_TYPE* Verdict,
+    PSECUREHOST_VERDICT_TRACE Trace
+)
+{
+    PSECUREHOST_PENDED_CONNECTION entry;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    PLIST_ENTRY link;
+    BOOLEAN found = FALSE;
+
+    *Verdict = FWP_ACTION_NONE;
+
+    KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+    for (link = Context->DecidedConnections.Flink;
+         link != &Context->DecidedConnections;
+         link = link->Flink) {
+
+        entry = CONTAINING_RECORD(link, SECUREHOST_PENDED_CONNECTION, Link);
+
+        if (entry->State != State || !SecureHostSameConnection(&entry->Key, Key)) {
+            continue;
+        }
+
+        *Verdict = entry->Verdict;
+        found = TRUE;
+
+        if (Trace != NULL) {
+            Trace->CorrelationId = entry->CorrelationId;
+            Trace->StartTime = entry->PendTime;
+        }
+
+        RemoveEntryList(&entry->Link);
+
+        if (State == SecureHostDecisionDecided &&
+            entry->Verdict == FWP_ACTION_PERMIT &&
+            (Key->Protocol == IPPROTO_TCP || Key->Protocol == IPPROTO_UDP)) {
+
+            entry->State = SecureHostDecisionApplied;
+            entry->Deadline = KeQueryInterruptTime() +
+                SECUREHOST_MS_TO_INTERRUPT_TIME(SECUREHOST_DECISION_RETENTION_MS);
+            InsertTailList(&Context->DecidedConnections, &entry->Link);
+        } else {
+            SecureHostFreeDecision(Context, entry);
+        }
+        break;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return found;
+}
+
+/*++
+
+Routine Description:
+    Hands queued decision requests to the service. Completes the request
+    at once if any are waiting; otherwise parks it until the next
+    connection is pended (returns STATUS_PENDING). The first handle to
+    fetch becomes the decision client.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostFetchDecisions(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFREQUEST Request,
+    size_t* Information
+)
+{
+    WDFFILEOBJECT fileObject = WdfRequestGetFileObject(Request);
+    KLOCK_QUEUE_HANDLE lockHandle;
+    PVOID buffer;
+    NTSTATUS status;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(SECUREHOST_DECISION_REQUEST), &buffer, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+    if (Context->DecisionsClosed) {
+        status = STATUS_DELETE_PENDING;
+    } else if (Context->DecisionClient != NULL && Context->DecisionClient != fileObject) {
+        status = STATUS_DEVICE_BUSY;
+    } else {
+        Context->DecisionClient = fileObject;
+
+        if (!IsListEmpty(&Context->QueuedDecisions)) {
+            status = SecureHostDeliverDecisionsLocked(Context, Request, Information);
+        } else {
+            //
+            // Parked under the lock so a connection pended right after
+            // the check above still finds the request
+            //
+            status = WdfRequestForwardToIoQueue(Request, Context->DecisionRequestQueue);
+            if (NT_SUCCESS(status)) {
+                status = STATUS_PENDING;
+            }
+        }
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    return status;
+}
+
+/*++
+
+Routine Description:
+    Applies the service's verdicts to delivered requests and completes
+    their pended operations. The whole batch is validated first; IDs no
+    longer waiting (timed out) are skipped.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostCompleteDecisions(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFFILEOBJECT FileObject,
+    const SECUREHOST_DECISION_RESPONSE* Responses,
+    SIZE_T ResponseCount
+)
+{
+    HANDLE completions[SECUREHOST_DECISION_FLUSH_BATCH];
+    KLOCK_QUEUE_HANDLE lockHandle;
+    ULONG completionCount;
+    SIZE_T next = 0;
+    SIZE_T i;
+    ULONG j;
+
+    for (i = 0; i < ResponseCount; i++) {
+        if (Responses[i].Verdict != SECUREHOST_RULE_ACTION_ALLOW &&
+            Responses[i].Verdict != SECUREHOST_RULE_ACTION_BLOCK &&
+            Responses[i].Verdict != SECUREHOST_RULE_ACTION_AUDIT) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    while (next < ResponseCount) {
+        completionCount = 0;
+
+        KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+        if (Context->DecisionClient != FileObject) {
+            KeReleaseInStackQueuedSpinLock(&lockHandle);
+            return STATUS_ACCESS_DENIED;
+        }
+
+        for (; next < ResponseCount && completionCount < SECUREHOST_DECISION_FLUSH_BATCH; next++) {
+            PLIST_ENTRY link;
+
+            for (link = Context->DeliveredDecisions.Flink;
+                 link != &Context->DeliveredDecisions;
+                 link = link->Flink) {
+
+                PSECUREHOST_PENDED_CONNECTION entry =
+                    CONTAINING_RECORD(link, SECUREHOST_PENDED_CONNECTION, Link);
+
+                if (entry->RequestId == Responses[next].RequestId) {
+                    SecureHostDecideLocked(
+                        Context,
+                        entry,
+                        (Responses[next].Verdict == SECUREHOST_RULE_ACTION_BLOCK) ?
+                            FWP_ACTION_BLOCK : FWP_ACTION_PERMIT,
+                        completions,
+                        &completionCount
+                    );
+                    break;
+                }
+            }
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        for (j = 0; j < completionCount; j++) {
+            FwpsCompleteOperation0(completions[j], NULL);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Times out pending requests and drops stale decided entries, or, when
+    ExpiredOnly is FALSE, releases every pended connection and frees all
+    entries. Released connections reauthorize without a decision and get
+    the fallback verdict. Pended operations are completed in batches
+    outside DecisionLock.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostFlushDecisions(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    BOOLEAN ExpiredOnly
+)
+{
+    HANDLE completions[SECUREHOST_DECISION_FLUSH_BATCH];
+    PLIST_ENTRY pending[2] = { &Context->QueuedDecisions, &Context->DeliveredDecisions };
+    PSECUREHOST_PENDED_CONNECTION entry;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    ULONG completionCount;
+    UINT64 now;
+    ULONG i;
+
+    do {
+        completionCount = 0;
+
+        KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+        now = KeQueryInterruptTime();
+
+        //
+        // Lists are in deadline order; stop at the first live entry
+        //
+        for (i = 0; i < RTL_NUMBER_OF(pending); i++) {
+            while (completionCount < SECUREHOST_DECISION_FLUSH_BATCH && !IsListEmpty(pending[i])) {
+                entry = CONTAINING_RECORD(pending[i]->Flink, SECUREHOST_PENDED_CONNECTION, Link);
+
+                if (ExpiredOnly) {
+                    if (entry->Deadline > now) {
+                        break;
+                    }
+                    SecureHostDecideLocked(Context, entry, entry->Fallback, completions, &completionCount);
+                } else {
+                    RemoveEntryList(&entry->Link);
+                    completions[completionCount++] = entry->CompletionContext;
+                    SecureHostFreeDecision(Context, entry);
+                }
+            }
+        }
+
+        while (!IsListEmpty(&Context->DecidedConnections)) {
+            entry = CONTAINING_RECORD(Context->DecidedConnections.Flink, SECUREHOST_PENDED_CONNECTION, Link);
+
+            if (ExpiredOnly && entry->Deadline > now) {
+                break;
+            }
+
+            RemoveEntryList(&entry->Link);
+            SecureHostFreeDecision(Context, entry);
+        }
+
+        if (Context->DecisionCount == 0 && Context->DecisionTimerArmed) {
+            KeCancelTimer(&Context->DecisionTimer);
+            Context->DecisionTimerArmed = FALSE;
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        for (i = 0; i < completionCount; i++) {
+            FwpsCompleteOperation0(completions[i], NULL);
+        }
+    } while (completionCount == SECUREHOST_DECISION_FLUSH_BATCH);
+}
+
+/*++
+
+Routine Description:
+    Detaches the decision client. With a NULL FileObject (unload) also
+    stops all further pending. Parked fetches are cancelled and every
+    pended connection is released to its fallback verdict.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostCloseDecisionChannel(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    WDFFILEOBJECT FileObject
+)
+{
+    KLOCK_QUEUE_HANDLE lockHandle;
+    WDFREQUEST request;
+    NTSTATUS status;
+    BOOLEAN closing = FALSE;
+
+    KeAcquireInStackQueuedSpinLock(&Context->DecisionLock, &lockHandle);
+
+    if (FileObject == NULL) {
+        Context->DecisionsClosed = TRUE;
+        Context->DecisionClient = NULL;
+        closing = TRUE;
+    } else if (Context->DecisionClient == FileObject) {
+        Context->DecisionClient = NULL;
+        closing = TRUE;
+    }
+
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    if (!closing) {
+        return;
+    }
+
+    if (Context->DecisionRequestQueue != NULL) {
+        for (;;) {
+            status = (FileObject != NULL) ?
+                WdfIoQueueRetrieveRequestByFileObject(Context->DecisionRequestQueue, FileObject, &request) :
+                WdfIoQueueRetrieveNextRequest(Context->DecisionRequestQueue, &request);
+
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            WdfRequestComplete(request, STATUS_CANCELLED);
+        }
+    }
+
+    SecureHostFlushDecisions(Context, FALSE);
+}
+
+/*++
+
+Routine Description:
+    Decision timer DPC. Applies the fallback to requests the service has
+    not answered in time.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostDecisionTimerDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    SecureHostFlushDecisions((PSECUREHOST_DRIVER_CONTEXT)DeferredContext, TRUE);
+}
+
+/*++
+
+Routine Description:
+    Builds a compiled rule table from a rule set. The table is private to
+    the caller until passed to SecureHostPublishRuleTable. Disabled rules
+    are dropped; rule order in the source set is the match precedence.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostCompileRuleTable(
+    const SECUREHOST_POLICY_RULE* Rules,
+    UINT32 RuleCount,
+    UINT64 Generation,
+    PSECUREHOST_RULE_TABLE* Table
+)
+{
+    SECUREHOST_RULE_TABLE_LAYOUT layout;
+    PSECUREHOST_RULE_TABLE table;
+    PUINT32 bucketFill;
+
+    PAGED_CODE();
+
+    *Table = NULL;
+
+    if (RuleCount > SECUREHOST_MAX_RULES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SecureHostGetRuleTableLayout(Rules, RuleCount, &layout);
+
+    table = (PSECUREHOST_RULE_TABLE)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        layout.TotalSize,
+        SECUREHOST_WFP_TAG
+    );
+
+    if (table == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    bucketFill = (PUINT32)ExAllocatePool2(
+        POOL_FLAG_PAGED,
+        ((SIZE_T)layout.BucketCount + 1) * sizeof(UINT32),
+        SECUREHOST_WFP_TAG
+    );
+
+    if (bucketFill == NULL) {
+        ExFreePoolWithTag(table, SECUREHOST_WFP_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    SecureHostBuildRuleTable(Rules, RuleCount, Generation, &layout, table, bucketFill);
+
+    ExFreePoolWithTag(bucketFill, SECUREHOST_WFP_TAG);
+
+    *Table = table;
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Atomically replaces the active rule table, waits until no classify
+    callback can still be reading the previous table, then frees it.
+    Passing NULL retires the active table.
+
+    Generations only move forward. A table compiled with generation 0 is
+    assigned the next one; a table at or below the active generation is
+    rejected with STATUS_REVISION_MISMATCH and stays owned by the caller.
+
+--*/
+_Use_decl_annotations_
+NTSTATUS
+SecureHostPublishRuleTable(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    PSECUREHOST_RULE_TABLE Table
+)
+{
+    PSECUREHOST_RULE_TABLE previous;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&Context->RuleTableMutex);
+
+    if (Table != NULL) {
+        if (Table->Generation == 0) {
+            Table->Generation = Context->RuleTableGeneration + 1;
+        } else if (Table->Generation <= Context->RuleTableGeneration) {
+            ExReleaseFastMutex(&Context->RuleTableMutex);
+            return STATUS_REVISION_MISMATCH;
+        }
+
+        Context->RuleTableGeneration = Table->Generation;
+    }
+
+    previous = (PSECUREHOST_RULE_TABLE)InterlockedExchangePointer(
+        (PVOID volatile*)&Context->ActiveRuleTable,
+        Table
+    );
+
+    if (previous != NULL) {
+        SecureHostWaitForRuleTableReaders(Context);
+    }
+
+    ExReleaseFastMutex(&Context->RuleTableMutex);
+
+    if (previous != NULL) {
+        ExFreePoolWithTag(previous, SECUREHOST_WFP_TAG);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*++
+
+Routine Description:
+    Grace period DPC. Runs once on each processor after every DISPATCH_LEVEL
+    section that was active at queue time has finished.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostGracePeriodDpc(
+    PKDPC Dpc,
+    PVOID DeferredContext,
+    PVOID SystemArgument1,
+    PVOID SystemArgument2
+)
+{
+    PSECUREHOST_GRACE_PERIOD gracePeriod = (PSECUREHOST_GRACE_PERIOD)DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (InterlockedDecrement(&gracePeriod->Pending) == 0) {
+        KeSetEvent(&gracePeriod->Done, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+/*++
+
+Routine Description:
+    Waits for all processors to pass through a quiescent state. Classify
+    reads the rule table at DISPATCH_LEVEL, so once a DPC has run on every
+    processor no reader can still hold a pointer to a retired table.
+    The caller holds RuleTableMutex, which also guards the DPC array.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostWaitForRuleTableReaders(
+    PSECUREHOST_DRIVER_CONTEXT Context
+)
+{
+    SECUREHOST_GRACE_PERIOD gracePeriod;
+    ULONG processorCount;
+    ULONG i;
+
+    PAGED_CODE();
+
+    processorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (processorCount > Context->GracePeriodDpcCount) {
+        processorCount = Context->GracePeriodDpcCount;
+    }
+
+    KeInitializeEvent(&gracePeriod.Done, NotificationEvent, FALSE);
+    gracePeriod.Pending = (LONG)processorCount;
+
+    for (i = 0; i < processorCount; i++) {
+        PROCESSOR_NUMBER processor;
+        PKDPC dpc = &Context->GracePeriodDpcs[i];
+
+        KeInitializeDpc(dpc, SecureHostGracePeriodDpc, &gracePeriod);
+
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processor)) &&
+            NT_SUCCESS(KeSetTargetProcessorDpcEx(dpc, &processor))) {
+            KeSetImportanceDpc(dpc, HighImportance);
+            KeInsertQueueDpc(dpc, NULL, NULL);
+        } else if (InterlockedDecrement(&gracePeriod.Pending) == 0) {
+            KeSetEvent(&gracePeriod.Done, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    KeWaitForSingleObject(&gracePeriod.Done, Executive, KernelMode, FALSE, NULL);
+}
+
+/*++
+
+Routine Description:
+    SecureHostLookupRule plus lookup accounting on the current processor's
+    counters. Latency is measured on a sample of lookups only, keeping the
+    performance counter reads off most classifications.
+
+--*/
+_Use_decl_annotations_
+const SECUREHOST_COMPILED_RULE*
+SecureHostTimedLookupRule(
+    const SECUREHOST_RULE_TABLE* Table,
+    const SECUREHOST_CONNECTION_KEY* Key,
+    PSECUREHOST_COUNTERS Counters
+)
+{
+    const SECUREHOST_COMPILED_RULE* rule;
+    LARGE_INTEGER start;
+
+    if ((Counters->RuleLookups++ & (SECUREHOST_LATENCY_SAMPLE_RATE - 1)) != 0) {
+        return SecureHostLookupRule(Table, Key);
+    }
+
+    start = KeQueryPerformanceCounter(NULL);
+    rule = SecureHostLookupRule(Table, Key);
+    Counters->LookupLatency[SecureHostLatencyBucket(
+        KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart)]++;
+
+    return rule;
+}
+
+/*++
+
+Routine Description:
+    Decides whether a permit on a rule with an audit mode is reported,
+    and returns its event's weight (0 = not reported). Called at
+    DISPATCH_LEVEL with the table the rule was matched in; the counters
+    are shared by all processors.
+
+    The rate limited bucket starts full with one second's worth of
+    tokens and refills continuously. A permit that finds it empty is
+    counted in Skipped and added to the weight of the next one reported.
+
+--*/
+FORCEINLINE
+UINT32
+SecureHostSamplePermit(
+    _Inout_ PSECUREHOST_RULE_AUDIT Audit
+)
+{
+    LONG64 state;
+    LONG64 skipped;
+    UINT64 now;
+    UINT64 last;
+    UINT64 elapsed;
+    UINT32 tokens;
+    UINT32 added;
+
+    switch (Audit->Mode) {
+        case SECUREHOST_AUDIT_MODE_OFF:
+            return 0;
+
+        case SECUREHOST_AUDIT_MODE_SAMPLED:
+            return ((UINT64)InterlockedIncrement64(&Audit->Seen) % Audit->Rate == 0) ? Audit->Rate : 0;
+
+        case SECUREHOST_AUDIT_MODE_RATE_LIMITED:
+            now = KeQueryInterruptTime() / SECUREHOST_MS_TO_INTERRUPT_TIME(1);
+
+            for (;;) {
+                state = ReadNoFence64(&Audit->Bucket);
+                last = (UINT64)state >> SECUREHOST_AUDIT_TOKEN_BITS;
+                tokens = (UINT32)((UINT64)state & SECUREHOST_AUDIT_TOKEN_MASK);
+                elapsed = (now > last) ? now - last : 0;
+
+                if (state == 0 || elapsed >= 1000) {
+                    tokens = Audit->Rate;
+                    last = now;
+                } else {
+                    added = (UINT32)(elapsed * Audit->Rate / 1000);
+                    if (added >= Audit->Rate - tokens) {
+                        tokens = Audit->Rate;
+                        last = now;
+                    } else if (added != 0) {
+                        //
+                        // Keep the remainder of the interval for the next refill
+                        //
+                        tokens += added;
+                        last += (UINT64)added * 1000 / Audit->Rate;
+                    }
+                }
+
+                if (tokens == 0) {
+                    InterlockedIncrement64(&Audit->Skipped);
+                    return 0;
+                }
+
+                if (InterlockedCompareExchange64(
+                        &Audit->Bucket,
+                        (LONG64)((last << SECUREHOST_AUDIT_TOKEN_BITS) | (tokens - 1)),
+                        state) == state) {
+                    break;
+                }
+            }
+
+            skipped = InterlockedExchange64(&Audit->Skipped, 0);
+            return (skipped < MAXUINT32) ? (UINT32)skipped + 1 : MAXUINT32;
+
+        default:
+            return 1;
+    }
+}
+
+/*++
+
+Routine Description:
+    Matches a connection against the active rule table. Returns the
+    verdict along with the matching rule ID (0 if none) and the table
+    generation it was computed against (0 if no table is published).
+    For a deferred rule the verdict is the rule's fallback.
+
+    If Audit is given the connection is to be reported, and it receives
+    the event's weight and audit mode. Blocks and deferred connections
+    are always reported; permits follow their rule's audit mode.
+
+--*/
+_Use_decl_annotations_
+FWP_ACTION_TYPE
+SecureHostEvaluateConnection(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    const SECUREHOST_CONNECTION_KEY* Key,
+    PUINT64 RuleId,
+    PUINT64 Generation,
+    PBOOLEAN Deferred,
+    PSECUREHOST_AUDIT_SAMPLE Audit
+)
+{
+    const SECUREHOST_RULE_TABLE* table;
+    const SECUREHOST_COMPILED_RULE* rule = NULL;
+    PSECUREHOST_RULE_AUDIT ruleAudit;
+    FWP_ACTION_TYPE action = FWP_ACTION_PERMIT;
+    PSECUREHOST_COUNTERS counters;
+    KIRQL oldIrql;
+
+    //
+    // The table pointer is only dereferenced at DISPATCH_LEVEL;
+    // see SecureHostWaitForRuleTableReaders.
+    // Default action (no table or no match): permit
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    table = (const SECUREHOST_RULE_TABLE*)ReadPointerAcquire(
+        (PVOID const volatile*)&Context->ActiveRuleTable);
+
+    *Generation = (table != NULL) ? table->Generation : 0;
+
+    counters = SecureHostLocalCounters(Context);
+    counters->Classifications++;
+
+    if (table != NULL) {
+        rule = SecureHostTimedLookupRule(table, Key, counters);
+        if (rule != NULL && rule->Action == FWP_ACTION_BLOCK) {
+            action = FWP_ACTION_BLOCK;
+        }
+    }
+
+    *RuleId = (rule != NULL) ? rule->RuleId : 0;
+    *Deferred = (rule != NULL) && (rule->Flags & SECUREHOST_COMPILED_RULE_DEFERRED) != 0;
+
+    if (action == FWP_ACTION_BLOCK) {
+        counters->Blocks++;
+    } else {
+        counters->Permits++;
+    }
+
+    if (Audit != NULL) {
+        Audit->Weight = 1;
+        Audit->Mode = SECUREHOST_AUDIT_MODE_DEFAULT;
+
+        if (action == FWP_ACTION_PERMIT && !*Deferred && rule != NULL &&
+            (rule->Flags & SECUREHOST_COMPILED_RULE_AUDITED) != 0) {
+            ruleAudit = SecureHostFindRuleAudit(table, rule->Ordinal);
+            if (ruleAudit != NULL) {
+                Audit->Mode = ruleAudit->Mode;
+                Audit->Weight = SecureHostSamplePermit(ruleAudit);
+            }
+        }
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return action;
+}
+
+/*++
+
+Routine Description:
+    Attaches a verdict cache entry to a flow's data layer. On failure the
+    flow simply runs without a cache entry; the data layer callouts are
+    conditional on flow and will not be invoked for it.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostAttachFlowContext(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    UINT64 FlowHandle,
+    UINT16 LayerId,
+    UINT32 CalloutId,
+    const SECUREHOST_CONNECTION_KEY* Key,
+    UINT64 RuleId,
+    UINT64 Generation,
+    BOOLEAN ServicePermitted
+)
+{
+    PSECUREHOST_FLOW_CONTEXT flow;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    NTSTATUS status;
+
+    flow = (PSECUREHOST_FLOW_CONTEXT)ExAllocateFromLookasideListEx(
+        &Context->FlowContextLookaside);
+
+    if (flow == NULL) {
+        return;
+    }
+
+    RtlZeroMemory(flow, sizeof(SECUREHOST_FLOW_CONTEXT));
+    flow->FlowHandle = FlowHandle;
+    flow->LayerId = LayerId;
+    flow->CalloutId = CalloutId;
+    flow->Key = *Key;
+    flow->VerdictState = SECUREHOST_VERDICT_STATE(Generation, FALSE);
+    flow->RuleId = RuleId;
+    flow->ServicePermitted = ServicePermitted;
+
+    //
+    // Track the entry before associating it so a racing flow delete
+    // always finds it on the list
+    //
+    SecureHostAcquireFlowListLock(Context, &lockHandle);
+
+    if (Context->FlowContextsStopping) {
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+        ExFreeToLookasideListEx(&Context->FlowContextLookaside, flow);
+        return;
+    }
+
+    InsertTailList(&Context->FlowList, &flow->Link);
+    flow->OnList = TRUE;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    status = FwpsFlowAssociateContext0(
+        FlowHandle,
+        LayerId,
+        CalloutId,
+        (UINT64)(ULONG_PTR)flow
+    );
+
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("SecureHostWFP: FwpsFlowAssociateContext0 failed: 0x%08X\n", status));
+        SecureHostFlowDeleteFn(LayerId, CalloutId, (UINT64)(ULONG_PTR)flow);
+    }
+}
+
+/*++
+
+Routine Description:
+    Returns the cached verdict for a flow. The full rule match only runs
+    when the rule table has been replaced since the verdict was cached,
+    unless the replacement was a delta that left the verdict alone.
+
+--*/
+_Use_decl_annotations_
+FWP_ACTION_TYPE
+SecureHostGetFlowVerdict(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    PSECUREHOST_FLOW_CONTEXT Flow
+)
+{
+    const SECUREHOST_RULE_TABLE* table;
+    const SECUREHOST_COMPILED_RULE* rule;
+    PSECUREHOST_COUNTERS counters;
+    UINT64 generation;
+    LONG64 state;
+    BOOLEAN blocked;
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    table = (const SECUREHOST_RULE_TABLE*)ReadPointerAcquire(
+        (PVOID const volatile*)&Context->ActiveRuleTable);
+
+    generation = (table != NULL) ? table->Generation : 0;
+    state = ReadNoFence64(&Flow->VerdictState);
+
+    counters = SecureHostLocalCounters(Context);
+    counters->Classifications++;
+
+    if (((UINT64)state >> 1) == generation) {
+        blocked = (BOOLEAN)(state & 1);
+        counters->CacheHits++;
+    } else {
+        rule = (table != NULL) ? SecureHostTimedLookupRule(table, &Flow->Key, counters) : NULL;
+        blocked = (rule != NULL && rule->Action == FWP_ACTION_BLOCK);
+
+        //
+        // Data layers cannot pend; a flow the service let through keeps
+        // that verdict while a deferred rule still covers it
+        //
+        if (blocked && Flow->ServicePermitted && (rule->Flags & SECUREHOST_COMPILED_RULE_DEFERRED)) {
+            blocked = FALSE;
+        }
+
+        //
+        // Concurrent re-evaluations against the same table agree, so
+        // racing writers store identical values
+        //
+        Flow->RuleId = (rule != NULL) ? rule->RuleId : 0;
+        InterlockedExchange64(&Flow->VerdictState,
+                              SECUREHOST_VERDICT_STATE(generation, blocked));
+    }
+
+    if (blocked) {
+        counters->Blocks++;
+    } else {
+        counters->Permits++;
+    }
+
+    KeLowerIrql(oldIrql);
+
+    return blocked ? FWP_ACTION_BLOCK : FWP_ACTION_PERMIT;
+}
+
+/*++
+
+Routine Description:
+    Moves cached flow verdicts from the previous rule table generation to
+    the new one when no edited rule can change them: the verdict did not
+    come from an edited rule, and no inserted rule matches the flow. All
+    other entries keep the old generation and are re-matched on their
+    next packet. Entries already re-matched, or cached against an older
+    table, are left alone.
+
+--*/
+_Use_decl_annotations_
+VOID
+SecureHostCarryFlowVerdicts(
+    PSECUREHOST_DRIVER_CONTEXT Context,
+    UINT64 OldGeneration,
+    UINT64 NewGeneration,
+    const SECUREHOST_RULE_CHANGE* Changes,
+    UINT32 ChangeCount
+)
+{
+    PSECUREHOST_FLOW_CONTEXT flow;
+    PLIST_ENTRY entry;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    UINT64 high;
+    UINT64 low;
+    LONG64 state;
+    UINT32 i;
 
-    KdPrint(("SecureHostWFP: DriverEntry\n"));
+    SecureHostAcquireFlowListLock(Context, &lockHandle);
 
-    //
-    // Initialize WDF driver
-    //
-    WDF_DRIVER_CONFIG_INIT(&config, WDF_NO_EVENT_CALLBACK);
-    config.DriverInitFlags = WdfDriverInitNonPnpDriver;
-    config.EvtDriverUnload = SecureHostEvtDriverUnload;
+    for (entry = Context->FlowList.Flink; entry != &Context->FlowList; entry = entry->Flink) {
+        flow = CONTAINING_RECORD(entry, SECUREHOST_FLOW_CONTEXT, Link);
+        state = ReadNoFence64(&flow->VerdictState);
 
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, SECUREHOST_DRIVER_CONTEXT);
-    attributes.EvtCleanupCallback = NULL;
+        if (((UINT64)state >> 1) != OldGeneration) {
+            continue;
+        }
 
-    status = WdfDriverCreate(
-        DriverObject,
-        RegistryPath,
-        &attributes,
-        &config,
-        &driver
-    );
+        SecureHostAddressToHost(&flow->Key.RemoteAddress, &high, &low);
 
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: WdfDriverCreate failed: 0x%08X\n", status));
-        return status;
-    }
+        for (i = 0; i < ChangeCount; i++) {
+            const SECUREHOST_RULE_CHANGE* change = &Changes[i];
 
-    //
-    // Initialize driver context
-    //
-    context = GetDriverContext(driver);
-    RtlZeroMemory(context, sizeof(SECUREHOST_DRIVER_CONTEXT));
+            if (flow->RuleId == change->RuleId) {
+                break;
+            }
 
-    context->Driver = driver;
-    KeInitializeSpinLock(&context->RulesLock);
-    InitializeListHead(&context->RulesList);
-    context->NextRuleId = 1;
+            if (change->Matches &&
+                SecureHostRuleMatches(&change->Match, &flow->Key) &&
+                (change->RemoteIpVersion == 0 ||
+                 (change->RemoteIpVersion == flow->Key.IpVersion &&
+                  SecureHostPrefixContains(&change->Prefix, high, low)))) {
+                break;
+            }
+        }
 
-    //
-    // Register WFP callouts
-    //
-    status = SecureHostRegisterCallouts(context);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: SecureHostRegisterCallouts failed: 0x%08X\n", status));
-        return status;
+        //
+        // A racing re-match stores its own verdict for the new table,
+        // so only an untouched entry is moved forward
+        //
+        if (i == ChangeCount) {
+            InterlockedCompareExchange64(&flow->VerdictState,
+                                         SECUREHOST_VERDICT_STATE(NewGeneration, state & 1),
+                                         state);
+        }
     }
 
-    KdPrint(("SecureHostWFP: Driver loaded successfully\n"));
-    return STATUS_SUCCESS;
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
 }
 
 /*++
 
 Routine Description:
-    Driver unload callback. Cleans up WFP callouts and resources.
+    Detaches all live verdict cache entries from their flows. Each removal
+    invokes SecureHostFlowDeleteFn, which returns the entry to the pool.
 
 --*/
 _Use_decl_annotations_
 VOID
-SecureHostEvtDriverUnload(
-    WDFDRIVER Driver
+SecureHostRemoveFlowContexts(
+    PSECUREHOST_DRIVER_CONTEXT Context
 )
 {
-    PSECUREHOST_DRIVER_CONTEXT context;
+    PSECUREHOST_FLOW_CONTEXT flow;
+    KLOCK_QUEUE_HANDLE lockHandle;
+    UINT64 flowHandle;
+    UINT16 layerId;
+    UINT32 calloutId;
 
     PAGED_CODE();
 
-    KdPrint(("SecureHostWFP: SecureHostEvtDriverUnload\n"));
+    for (;;) {
+        SecureHostAcquireFlowListLock(Context, &lockHandle);
 
-    context = GetDriverContext(Driver);
+        if (IsListEmpty(&Context->FlowList)) {
+            KeReleaseInStackQueuedSpinLock(&lockHandle);
+            break;
+        }
 
-    //
-    // Unregister callouts
-    //
-    SecureHostUnregisterCallouts(context);
+        flow = CONTAINING_RECORD(RemoveHeadList(&Context->FlowList),
+                                 SECUREHOST_FLOW_CONTEXT, Link);
+        flow->OnList = FALSE;
 
-    //
-    // Clean up rules list
-    //
-    while (!IsListEmpty(&context->RulesList)) {
-        PLIST_ENTRY entry = RemoveHeadList(&context->RulesList);
-        PSECUREHOST_POLICY_RULE rule = CONTAINING_RECORD(
-            entry,
-            SECUREHOST_POLICY_RULE,
-            RuleId
-        );
-        ExFreePoolWithTag(rule, SECUREHOST_WFP_TAG);
-    }
+        //
+        // The entry may be freed by a racing flow delete once the lock
+        // is dropped; only the copied identifiers are used past this point
+        //
+        flowHandle = flow->FlowHandle;
+        layerId = flow->LayerId;
+        calloutId = flow->CalloutId;
 
-    KdPrint(("SecureHostWFP: Driver unloaded\n"));
+        KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+        FwpsFlowRemoveContext0(flowHandle, layerId, calloutId);
+    }
 }
 
 /*++
 
 Routine Description:
-    Registers WFP callouts for IPv4 and IPv6 traffic inspection.
+    Matches an outbound connection attempt and reports the decision to
+    the subscribed service, if any. A connection on a deferred rule is
+    pended for the service on first sight and gets the service's verdict
+    on reauthorization. Every verdict is timed from entry, or for the
+    service's verdict from the classification that pended it. Shared body
+    of the per-family ALE auth-connect callouts.
 
 --*/
-_Use_decl_annotations_
-NTSTATUS
-SecureHostRegisterCallouts(
-    PSECUREHOST_DRIVER_CONTEXT Context
+FORCEINLINE
+VOID
+SecureHostClassifyConnection(
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _In_ UINT32 ConditionFlags,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _In_ const FWPS_FILTER3* Filter,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
 )
 {
-    NTSTATUS status;
-    FWPS_CALLOUT3 calloutV4 = {0};
-    FWPS_CALLOUT3 calloutV6 = {0};
-    FWPM_CALLOUT0 mCallout = {0};
-    FWPM_SUBLAYER0 sublayer = {0};
-    FWPM_FILTER0 filter = {0};
-    FWPM_FILTER_CONDITION0 conditions[1] = {0};
+    PSECUREHOST_DRIVER_CONTEXT context;
+    SECUREHOST_CONNECTION_EVENT event;
+    SECUREHOST_VERDICT_TRACE trace;
+    FWP_ACTION_TYPE action;
+    FWP_ACTION_TYPE verdict;
+    LARGE_INTEGER timestamp;
+    SECUREHOST_AUDIT_SAMPLE audit;
+    UINT64 ruleId;
+    UINT64 generation;
+    UINT32 verdictTicks;
+    BOOLEAN deferred;
+    BOOLEAN serviceVerdict = FALSE;
+    BOOLEAN subscribed;
 
-    PAGED_CODE();
+    trace.CorrelationId = 0;
+    trace.StartTime = (UINT64)KeQueryPerformanceCounter(NULL).QuadPart;
 
-    KdPrint(("SecureHostWFP: Registering callouts\n"));
+    context = GetDriverContext(WdfGetDriver());
 
     //
-    // Open filter engine
+    // Match against the compiled rule table. Permits are only sampled
+    // while someone receives the events, so skipped counts stay honest.
     //
-    status = FwpmEngineOpen0(
-        NULL,
-        RPC_C_AUTHN_DEFAULT,
-        NULL,
-        NULL,
-        &Context->EngineHandle
-    );
+    subscribed = ReadPointerNoFence((PVOID const volatile*)&context->EventSignal) != NULL;
+    audit.Weight = 0;
+    audit.Mode = SECUREHOST_AUDIT_MODE_DEFAULT;
 
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmEngineOpen0 failed: 0x%08X\n", status));
-        goto cleanup;
+    action = SecureHostEvaluateConnection(
+        context, Key, &ruleId, &generation, &deferred, subscribed ? &audit : NULL);
+
+    if (deferred) {
+        if ((ConditionFlags & FWP_CONDITION_FLAG_IS_REAUTHORIZE) &&
+            SecureHostTakeDecision(context, Key, SecureHostDecisionDecided, &verdict, &trace)) {
+            action = verdict;
+            serviceVerdict = TRUE;
+        } else if (FWPS_IS_METADATA_FIELD_PRESENT(InMetaValues, FWPS_METADATA_FIELD_COMPLETION_HANDLE) &&
+                   SecureHostPendConnection(context, Key, ruleId, action, InMetaValues->completionHandle,
+                                            trace.StartTime)) {
+            //
+            // Held until the service answers or the request times out;
+            // the event is reported on reauthorization
+            //
+            ClassifyOut->actionType = FWP_ACTION_BLOCK;
+            ClassifyOut->flags |= FWPS_CLASSIFY_OUT_FLAG_ABSORB;
+            ClassifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+            return;
+        }
     }
 
+    ClassifyOut->actionType = action;
+    verdictTicks = SecureHostCompleteVerdictTrace(context, &trace, serviceVerdict);
+
     //
-    // Begin transaction
+    // Report the decision to the subscribed service, if any and unless
+    // the rule's audit mode leaves it out
     //
-    status = FwpmTransactionBegin0(Context->EngineHandle, 0);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmTransactionBegin0 failed: 0x%08X\n", status));
-        goto cleanup;
+    if (subscribed && audit.Weight != 0) {
+        KeQuerySystemTimePrecise(&timestamp);
+
+        event.Timestamp = (UINT64)timestamp.QuadPart;
+        event.RuleId = ruleId;
+        event.ProcessId = Key->ProcessId;
+        event.IpVersion = Key->IpVersion;
+        event.Protocol = (UINT8)Key->Protocol;
+        event.Direction = (Key->Direction == FWP_DIRECTION_INBOUND) ?
+            SECUREHOST_DIRECTION_INBOUND : SECUREHOST_DIRECTION_OUTBOUND;
+        event.Verdict = (action == FWP_ACTION_BLOCK) ?
+            SECUREHOST_RULE_ACTION_BLOCK : SECUREHOST_RULE_ACTION_ALLOW;
+        event.LocalPort = Key->LocalPort;
+        event.RemotePort = Key->RemotePort;
+        event.Count = 1;
+        event.Weight = audit.Weight;
+        event.AuditMode = audit.Mode;
+        RtlZeroMemory(event.Reserved, sizeof(event.Reserved));
+        RtlCopyMemory(event.LocalAddress, Key->LocalAddress.Bytes, sizeof(event.LocalAddress));
+        RtlCopyMemory(event.RemoteAddress, Key->RemoteAddress.Bytes, sizeof(event.RemoteAddress));
+        event.LastTimestamp = event.Timestamp;
+        event.ProcessCreateTime = SecureHostLookupProcessCreateTime(&context->ProcessCache, Key->ProcessId);
+        event.CorrelationId = trace.CorrelationId;
+        event.ClassifyTime = trace.StartTime;
+        event.VerdictTicks = verdictTicks;
+        event.TraceFlags = serviceVerdict ? SECUREHOST_TRACE_FLAG_SERVICE_VERDICT : 0;
+        RtlZeroMemory(event.Reserved2, sizeof(event.Reserved2));
+
+        SecureHostRecordConnectionEvent(context, &event);
     }
 
     //
-    // Register IPv4 callout
+    // Clear rights to prevent other filters from processing
     //
-    calloutV4.calloutKey = SECUREHOST_WFP_CALLOUT_V4_GUID;
-    calloutV4.classifyFn = SecureHostClassifyFn;
-    calloutV4.notifyFn = SecureHostNotifyFn;
-    calloutV4.flowDeleteFn = SecureHostFlowDeleteFn;
-    calloutV4.flags = 0;
+    if (action == FWP_ACTION_BLOCK ||
+        (Filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)) {
+        ClassifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
+    }
+}
 
-    status = FwpsCalloutRegister3(
-        (PDEVICE_OBJECT)WdfDriverWdmGetDriverObject(Context->Driver),
-        &calloutV4,
-        &Context->CalloutIdV4
-    );
+/*++
 
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpsCalloutRegister3 (V4) failed: 0x%08X\n", status));
-        FwpmTransactionAbort0(Context->EngineHandle);
-        goto cleanup;
-    }
+Routine Description:
+    WFP classify callbacks for ALE auth connect, one per address family.
+    Inspects outbound connection attempts and applies policy rules.
+
+--*/
+_Use_decl_annotations_
+VOID NTAPI
+SecureHostClassifyV4Fn(
+    const FWPS_INCOMING_VALUES0* InFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    VOID* LayerData,
+    const void* ClassifyContext,
+    const FWPS_FILTER3* Filter,
+    UINT64 FlowContext,
+    FWPS_CLASSIFY_OUT0* ClassifyOut
+)
+{
+    UNREFERENCED_PARAMETER(LayerData);
+    UNREFERENCED_PARAMETER(ClassifyContext);
+    UNREFERENCED_PARAMETER(FlowContext);
+
+    SECUREHOST_CONNECTION_KEY key;
 
     //
-    // Register IPv6 callout
+    // Respect a higher-weight filter that already made a hard decision
     //
-    calloutV6.calloutKey = SECUREHOST_WFP_CALLOUT_V6_GUID;
-    calloutV6.classifyFn = SecureHostClassifyFn;
-    calloutV6.notifyFn = SecureHostNotifyFn;
-    calloutV6.flowDeleteFn = SecureHostFlowDeleteFn;
-    calloutV6.flags = 0;
+    if (!(ClassifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
+    }
+
+    SECUREHOST_READ_CONNECTION_KEY(ALE_AUTH_CONNECT_V4, 4, InFixedValues, InMetaValues, &key);
+    key.Direction = SecureHostMetadataDirection(InMetaValues);
 
-    status = FwpsCalloutRegister3(
-        (PDEVICE_OBJECT)WdfDriverWdmGetDriverObject(Context->Driver),
-        &calloutV6,
-        &Context->CalloutIdV6
+    SecureHostClassifyConnection(
+        &key,
+        InFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_FLAGS].value.uint32,
+        InMetaValues,
+        Filter,
+        ClassifyOut
     );
+}
 
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpsCalloutRegister3 (V6) failed: 0x%08X\n", status));
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
-        FwpmTransactionAbort0(Context->EngineHandle);
-        goto cleanup;
-    }
+_Use_decl_annotations_
+VOID NTAPI
+SecureHostClassifyV6Fn(
+    const FWPS_INCOMING_VALUES0* InFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    VOID* LayerData,
+    const void* ClassifyContext,
+    const FWPS_FILTER3* Filter,
+    UINT64 FlowContext,
+    FWPS_CLASSIFY_OUT0* ClassifyOut
+)
+{
+    UNREFERENCED_PARAMETER(LayerData);
+    UNREFERENCED_PARAMETER(ClassifyContext);
+    UNREFERENCED_PARAMETER(FlowContext);
 
-    //
-    // Add sublayer
-    //
-    sublayer.subLayerKey = SECUREHOST_WFP_SUBLAYER_GUID;
-    sublayer.displayData.name = L"SecureHost WFP Sublayer";
-    sublayer.displayData.description = L"SecureHost network policy enforcement";
-    sublayer.weight = 0x8000; // High priority
+    SECUREHOST_CONNECTION_KEY key;
 
-    status = FwpmSubLayerAdd0(Context->EngineHandle, &sublayer, NULL);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmSubLayerAdd0 failed: 0x%08X\n", status));
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
-        FwpsCalloutUnregisterById0(Context->CalloutIdV6);
-        FwpmTransactionAbort0(Context->EngineHandle);
-        goto cleanup;
+    if (!(ClassifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
     }
 
-    //
-    // Add IPv4 management callout
-    //
-    mCallout.calloutKey = SECUREHOST_WFP_CALLOUT_V4_GUID;
-    mCallout.displayData.name = L"SecureHost WFP IPv4 Callout";
-    mCallout.displayData.description = L"Inspects IPv4 network traffic";
-    mCallout.applicableLayer = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
+    SECUREHOST_READ_CONNECTION_KEY(ALE_AUTH_CONNECT_V6, 6, InFixedValues, InMetaValues, &key);
+    key.Direction = SecureHostMetadataDirection(InMetaValues);
 
-    status = FwpmCalloutAdd0(Context->EngineHandle, &mCallout, NULL, NULL);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmCalloutAdd0 (V4) failed: 0x%08X\n", status));
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
-        FwpsCalloutUnregisterById0(Context->CalloutIdV6);
-        FwpmTransactionAbort0(Context->EngineHandle);
-        goto cleanup;
-    }
+    SecureHostClassifyConnection(
+        &key,
+        InFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V6_FLAGS].value.uint32,
+        InMetaValues,
+        Filter,
+        ClassifyOut
+    );
+}
 
-    //
-    // Add IPv6 management callout
-    //
-    mCallout.calloutKey = SECUREHOST_WFP_CALLOUT_V6_GUID;
-    mCallout.displayData.name = L"SecureHost WFP IPv6 Callout";
-    mCallout.displayData.description = L"Inspects IPv6 network traffic";
-    mCallout.applicableLayer = FWPM_LAYER_ALE_AUTH_CONNECT_V6;
+/*++
 
-    status = FwpmCalloutAdd0(Context->EngineHandle, &mCallout, NULL, NULL);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmCalloutAdd0 (V6) failed: 0x%08X\n", status));
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
-        FwpsCalloutUnregisterById0(Context->CalloutIdV6);
-        FwpmTransactionAbort0(Context->EngineHandle);
-        goto cleanup;
-    }
+Routine Description:
+    Matches an established flow once and, if permitted, attaches a
+    verdict cache entry to its stream (TCP) or datagram data layer for
+    the callouts there to reuse. Flows on a deferred rule take the
+    service's decision from auth connect. Shared body of the per-family ALE flow
+    established callouts; IsV4 is a compile-time constant at each call.
+
+--*/
+FORCEINLINE
+VOID
+SecureHostClassifyFlowEstablished(
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _In_ BOOLEAN IsV4,
+    _In_ const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    _In_ const FWPS_FILTER3* Filter,
+    _Inout_ FWPS_CLASSIFY_OUT0* ClassifyOut
+)
+{
+    PSECUREHOST_DRIVER_CONTEXT context;
+    FWP_ACTION_TYPE action;
+    SECUREHOST_CALLOUT_INDEX dataCallout;
+    UINT16 dataLayerId;
+    UINT64 ruleId;
+    UINT64 generation;
+    BOOLEAN deferred;
+    BOOLEAN servicePermitted = FALSE;
+
+    context = GetDriverContext(WdfGetDriver());
+
+    action = SecureHostEvaluateConnection(context, Key, &ruleId, &generation, &deferred, NULL);
 
     //
-    // Commit transaction
+    // A connection the service permitted at auth connect carries that
+    // verdict into its flow; without one the fallback stands
     //
-    status = FwpmTransactionCommit0(Context->EngineHandle);
-    if (!NT_SUCCESS(status)) {
-        KdPrint(("SecureHostWFP: FwpmTransactionCommit0 failed: 0x%08X\n", status));
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
-        FwpsCalloutUnregisterById0(Context->CalloutIdV6);
-        goto cleanup;
+    if (deferred && SecureHostTakeDecision(context, Key, SecureHostDecisionApplied, &action, NULL)) {
+        servicePermitted = (action == FWP_ACTION_PERMIT);
     }
 
-    KdPrint(("SecureHostWFP: Callouts registered successfully\n"));
-    return STATUS_SUCCESS;
+    if (action == FWP_ACTION_PERMIT &&
+        FWPS_IS_METADATA_FIELD_PRESENT(InMetaValues, FWPS_METADATA_FIELD_FLOW_HANDLE)) {
 
-cleanup:
-    if (Context->EngineHandle != NULL) {
-        FwpmEngineClose0(Context->EngineHandle);
-        Context->EngineHandle = NULL;
+        if (Key->Protocol == IPPROTO_TCP) {
+            dataCallout = IsV4 ? SecureHostCalloutStreamV4 : SecureHostCalloutStreamV6;
+            dataLayerId = IsV4 ? FWPS_LAYER_STREAM_V4 : FWPS_LAYER_STREAM_V6;
+        } else {
+            dataCallout = IsV4 ? SecureHostCalloutDatagramDataV4 : SecureHostCalloutDatagramDataV6;
+            dataLayerId = IsV4 ? FWPS_LAYER_DATAGRAM_DATA_V4 : FWPS_LAYER_DATAGRAM_DATA_V6;
+        }
+
+        SecureHostAttachFlowContext(
+            context,
+            InMetaValues->flowHandle,
+            dataLayerId,
+            context->CalloutIds[dataCallout],
+            Key,
+            ruleId,
+            generation,
+            servicePermitted
+        );
+    }
+
+    ClassifyOut->actionType = action;
+
+    if (action == FWP_ACTION_BLOCK ||
+        (Filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)) {
+        ClassifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
     }
-    return status;
 }
 
 /*++
 
 Routine Description:
-    Unregisters WFP callouts and closes filter engine.
+    WFP classify callbacks for ALE flow established, one per address
+    family.
 
 --*/
 _Use_decl_annotations_
-NTSTATUS
-SecureHostUnregisterCallouts(
-    PSECUREHOST_DRIVER_CONTEXT Context
+VOID NTAPI
+SecureHostFlowEstablishedClassifyV4Fn(
+    const FWPS_INCOMING_VALUES0* InFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    VOID* LayerData,
+    const void* ClassifyContext,
+    const FWPS_FILTER3* Filter,
+    UINT64 FlowContext,
+    FWPS_CLASSIFY_OUT0* ClassifyOut
 )
 {
-    PAGED_CODE();
+    UNREFERENCED_PARAMETER(LayerData);
+    UNREFERENCED_PARAMETER(ClassifyContext);
+    UNREFERENCED_PARAMETER(FlowContext);
 
-    KdPrint(("SecureHostWFP: Unregistering callouts\n"));
+    SECUREHOST_CONNECTION_KEY key;
 
-    if (Context->CalloutIdV4 != 0) {
-        FwpsCalloutUnregisterById0(Context->CalloutIdV4);
+    if (!(ClassifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
     }
 
-    if (Context->CalloutIdV6 != 0) {
-        FwpsCalloutUnregisterById0(Context->CalloutIdV6);
-    }
+    SECUREHOST_READ_CONNECTION_KEY(ALE_FLOW_ESTABLISHED_V4, 4, InFixedValues, InMetaValues, &key);
+    key.Direction = (UINT8)InFixedValues->incomingValue[
+        FWPS_FIELD_ALE_FLOW_ESTABLISHED_V4_DIRECTION].value.uint32;
 
-    if (Context->EngineHandle != NULL) {
-        FwpmEngineClose0(Context->EngineHandle);
-        Context->EngineHandle = NULL;
+    SecureHostClassifyFlowEstablished(&key, TRUE, InMetaValues, Filter, ClassifyOut);
+}
+
+_Use_decl_annotations_
+VOID NTAPI
+SecureHostFlowEstablishedClassifyV6Fn(
+    const FWPS_INCOMING_VALUES0* InFixedValues,
+    const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
+    VOID* LayerData,
+    const void* ClassifyContext,
+    const FWPS_FILTER3* Filter,
+    UINT64 FlowContext,
+    FWPS_CLASSIFY_OUT0* ClassifyOut
+)
+{
+    UNREFERENCED_PARAMETER(LayerData);
+    UNREFERENCED_PARAMETER(ClassifyContext);
+    UNREFERENCED_PARAMETER(FlowContext);
+
+    SECUREHOST_CONNECTION_KEY key;
+
+    if (!(ClassifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
     }
 
-    KdPrint(("SecureHostWFP: Callouts unregistered\n"));
-    return STATUS_SUCCESS;
+    SECUREHOST_READ_CONNECTION_KEY(ALE_FLOW_ESTABLISHED_V6, 6, InFixedValues, InMetaValues, &key);
+    key.Direction = (UINT8)InFixedValues->incomingValue[
+        FWPS_FIELD_ALE_FLOW_ESTABLISHED_V6_DIRECTION].value.uint32;
+
+    SecureHostClassifyFlowEstablished(&key, FALSE, InMetaValues, Filter, ClassifyOut);
 }
 
 /*++
 
 Routine Description:
-    WFP classify callback. Inspects network traffic and applies policy rules.
+    WFP classify callback for the stream and datagram data layers. Applies
+    the verdict cached on the flow; O(1) unless the rule table changed.
 
 --*/
 _Use_decl_annotations_
 VOID NTAPI
-SecureHostClassifyFn(
+SecureHostFlowDataClassifyFn(
     const FWPS_INCOMING_VALUES0* InFixedValues,
     const FWPS_INCOMING_METADATA_VALUES0* InMetaValues,
     VOID* LayerData,
@@ -461,46 +5807,26 @@ SecureHostClassifyFn(
     FWPS_CLASSIFY_OUT0* ClassifyOut
 )
 {
+    UNREFERENCED_PARAMETER(InFixedValues);
+    UNREFERENCED_PARAMETER(InMetaValues);
     UNREFERENCED_PARAMETER(LayerData);
     UNREFERENCED_PARAMETER(ClassifyContext);
-    UNREFERENCED_PARAMETER(Filter);
-    UNREFERENCED_PARAMETER(FlowContext);
 
-    UINT16 localPort = 0;
-    UINT16 remotePort = 0;
-    UINT32 processId = 0;
-    FWP_DIRECTION direction;
+    PSECUREHOST_FLOW_CONTEXT flow = (PSECUREHOST_FLOW_CONTEXT)(ULONG_PTR)FlowContext;
+    FWP_ACTION_TYPE action = FWP_ACTION_PERMIT;
 
-    //
-    // Extract connection details
-    //
-    if (FWPS_IS_METADATA_FIELD_PRESENT(InMetaValues, FWPS_METADATA_FIELD_PROCESS_ID)) {
-        processId = (UINT32)InMetaValues->processId;
+    if (!(ClassifyOut->rights & FWPS_RIGHT_ACTION_WRITE)) {
+        return;
     }
 
-    //
-    // Get ports from fixed values (layer-dependent indices)
-    //
-    localPort = InFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_LOCAL_PORT].value.uint16;
-    remotePort = InFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_IP_REMOTE_PORT].value.uint16;
-    direction = InFixedValues->incomingValue[FWPS_FIELD_ALE_AUTH_CONNECT_V4_DIRECTION].value.uint8;
-
-    //
-    // Default action: permit
-    // In production, query policy engine here
-    //
-    ClassifyOut->actionType = FWP_ACTION_PERMIT;
+    if (flow != NULL) {
+        action = SecureHostGetFlowVerdict(GetDriverContext(WdfGetDriver()), flow);
+    }
 
-    //
-    // Log connection attempt (production: send to user-mode service)
-    //
-    KdPrint(("SecureHostWFP: Connection - PID:%lu Local:%u Remote:%u Dir:%u\n",
-             processId, localPort, remotePort, direction));
+    ClassifyOut->actionType = action;
 
-    //
-    // Clear rights to prevent other filters from processing
-    //
-    if (Filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT) {
+    if (action == FWP_ACTION_BLOCK ||
+        (Filter->flags & FWPS_FILTER_FLAG_CLEAR_ACTION_RIGHT)) {
         ClassifyOut->rights &= ~FWPS_RIGHT_ACTION_WRITE;
     }
 }
@@ -541,7 +5867,8 @@ SecureHostNotifyFn(
 /*++
 
 Routine Description:
-    WFP flow delete callback. Cleans up flow context.
+    WFP flow delete callback. Returns the flow's verdict cache entry to
+    the lookaside list.
 
 --*/
 _Use_decl_annotations_
@@ -554,9 +5881,25 @@ SecureHostFlowDeleteFn(
 {
     UNREFERENCED_PARAMETER(LayerId);
     UNREFERENCED_PARAMETER(CalloutId);
-    UNREFERENCED_PARAMETER(FlowContext);
 
-    KdPrint(("SecureHostWFP: Flow deleted\n"));
+    PSECUREHOST_DRIVER_CONTEXT context;
+    PSECUREHOST_FLOW_CONTEXT flow = (PSECUREHOST_FLOW_CONTEXT)(ULONG_PTR)FlowContext;
+    KLOCK_QUEUE_HANDLE lockHandle;
+
+    if (flow == NULL) {
+        return;
+    }
+
+    context = GetDriverContext(WdfGetDriver());
+
+    SecureHostAcquireFlowListLock(context, &lockHandle);
+    if (flow->OnList) {
+        RemoveEntryList(&flow->Link);
+        flow->OnList = FALSE;
+    }
+    KeReleaseInStackQueuedSpinLock(&lockHandle);
+
+    ExFreeToLookasideListEx(&context->FlowContextLookaside, flow);
 }
 
 #pragma warning(pop)
@@ -0,0 +1,1152 @@
+/*++
+
+Module Name:
+    SecureHostMatch.h
+
+Abstract:
+    Policy matching core shared by the SecureHost drivers and the
+    user-mode benchmark host. Contains the compiled network rule table,
+    its lookup, and the device policy scan.
+
+    Nothing here allocates, locks or depends on kernel-only headers; the
+    includer supplies the Windows base types (ntddk.h or windows.h).
+    Callers own memory and synchronization.
+
+Environment:
+    Kernel and user mode
+
+--*/
+
+#pragma once
+
+#ifndef ALIGN_UP_BY
+#define ALIGN_UP_BY(Length, Alignment) \
+    (((ULONG_PTR)(Length) + (Alignment) - 1) & ~((ULONG_PTR)(Alignment) - 1))
+#endif
+
+//
+// IP address in network byte order. IPv4 addresses occupy the first four
+// bytes and the remainder is zero, so addresses of either family compare
+// and mask as two 64-bit words.
+//
+typedef union _SECUREHOST_IP_ADDRESS {
+    UINT8 Bytes[16];
+    UINT32 V4;
+    UINT64 Words[2];
+} SECUREHOST_IP_ADDRESS, *PSECUREHOST_IP_ADDRESS;
+
+C_ASSERT(sizeof(SECUREHOST_IP_ADDRESS) == 16);
+
+//
+// Network policy rule, in precedence order within a rule set
+//
+typedef struct _SECUREHOST_POLICY_RULE {
+    UINT64 RuleId;
+    UINT64 AppIdHash;   // SecureHostHashAppId of the image's ALE app ID; 0 = any
+    UINT32 ProcessId;
+    UINT16 Protocol;
+    UINT16 LocalPort;
+    UINT16 RemotePort;
+    UINT32 Action;  // FWP_ACTION_BLOCK or FWP_ACTION_PERMIT
+    BOOLEAN Enabled;
+    BOOLEAN Audit;  // Permitted, but matches must still reach the callout
+    BOOLEAN Deferred;   // Decided by the service; Action is the fallback
+    UINT8 RemoteIpVersion;      // 4 or 6 to match a remote prefix; 0 = any address
+    UINT8 RemotePrefixLength;
+    UINT8 AuditMode;    // How permits are recorded; 0 = every permit the callout sees
+    SECUREHOST_IP_ADDRESS RemoteAddress;
+    UINT32 AuditRate;   // Meaning depends on AuditMode
+} SECUREHOST_POLICY_RULE, *PSECUREHOST_POLICY_RULE;
+
+//
+// Compiled rule table limits
+//
+#define SECUREHOST_MAX_RULES            (1u << 20)
+#define SECUREHOST_MIN_RULE_BUCKETS     16u
+
+//
+// Index key kinds. Every compiled rule is filed under its most selective
+// non-wildcard field: application, then remote port, local port and
+// process ID. Rules with none of those set land in the generic bucket.
+// Remote prefix rules are not hashed at all; see the remote prefix index.
+//
+#define SECUREHOST_RULE_KEY_REMOTE_PORT 1u
+#define SECUREHOST_RULE_KEY_LOCAL_PORT  2u
+#define SECUREHOST_RULE_KEY_PROCESS_ID  3u
+#define SECUREHOST_RULE_KEY_APP_ID      4u
+
+//
+// Compiled (read-only) rule. Two rules per cache line.
+// Ordinal is the rule's position in the source rule set; lower wins.
+//
+typedef struct _SECUREHOST_COMPILED_RULE {
+    UINT64 RuleId;
+    UINT64 AppIdHash;               // 0 = any application
+    UINT32 Ordinal;
+    UINT32 ProcessId;
+    UINT16 LocalPort;
+    UINT16 RemotePort;
+    UINT8 Protocol;
+    UINT8 Flags;                    // SECUREHOST_COMPILED_RULE_*
+    UINT16 Action;                  // FWP_ACTION_* fits in the low 16 bits
+} SECUREHOST_COMPILED_RULE, *PSECUREHOST_COMPILED_RULE;
+
+C_ASSERT(sizeof(SECUREHOST_COMPILED_RULE) == 32);
+
+#define SECUREHOST_COMPILED_RULE_DEFERRED   0x0001u
+#define SECUREHOST_COMPILED_RULE_AUDITED    0x0002u     // Has a SECUREHOST_RULE_AUDIT entry
+
+//
+// Permit audit state of a rule with an AuditMode, kept in a table's
+// audit array sorted by Ordinal. Mode and Rate are copied from the
+// source rule and interpreted by the includer. The counters are the
+// only part of a table written after it is built; they are updated with
+// interlocked operations on every matching permit, so each entry has a
+// cache line to itself.
+//
+typedef struct _SECUREHOST_RULE_AUDIT {
+    UINT32 Ordinal;
+    UINT32 Rate;
+    UINT8 Mode;
+    UINT8 Reserved0[7];
+    volatile LONG64 Seen;           // Matching permits, where the mode counts them
+    volatile LONG64 Bucket;         // Token bucket state
+    volatile LONG64 Skipped;        // Matching permits not recorded since the last one recorded
+    UINT64 Reserved1[3];
+} SECUREHOST_RULE_AUDIT, *PSECUREHOST_RULE_AUDIT;
+
+C_ASSERT(sizeof(SECUREHOST_RULE_AUDIT) == 64);
+
+//
+// Remote prefix index
+//
+// Rules with a remote prefix are filed under the prefix instead of a
+// hash bucket, in one sorted prefix array per address family, so large
+// address blocklists cost a bisection rather than a scan. Prefixes are
+// held as host-order 128-bit values (IPv4 in the top 32 bits) sorted by
+// address then length, which puts nested prefixes right after the ones
+// containing them. Each prefix links to the longest prefix containing
+// it: the longest match for an address is the first prefix containing
+// the address on the chain up from the last prefix starting at or below
+// it, and every shorter match is further up the same chain. A front
+// table indexed by the top FrontBits address bits narrows the bisection
+// to a few entries. A prefix's rules run up to the next prefix's
+// RuleStart (RuleEnd for the last one), and ChainOrdinal is the lowest
+// ordinal from it up its chain, so the walk stops once nothing further
+// up can win.
+//
+#define SECUREHOST_PREFIX_NONE              MAXUINT32
+#define SECUREHOST_MAX_PREFIX_FRONT_BITS    16u
+
+typedef struct _SECUREHOST_REMOTE_PREFIX {
+    UINT64 High;
+    UINT64 Low;
+    UINT32 Parent;                  // Longest containing prefix, or SECUREHOST_PREFIX_NONE
+    UINT32 RuleStart;               // Rules under this prefix, ordered by Ordinal
+    UINT32 ChainOrdinal;
+    UINT32 Length;
+} SECUREHOST_REMOTE_PREFIX, *PSECUREHOST_REMOTE_PREFIX;
+
+C_ASSERT(sizeof(SECUREHOST_REMOTE_PREFIX) == 32);
+
+typedef struct _SECUREHOST_PREFIX_SET {
+    PSECUREHOST_REMOTE_PREFIX Prefixes;
+    PUINT32 Front;                  // (1 << FrontBits) + 1 prefix offsets
+    UINT32 Count;
+    UINT32 FrontBits;
+    UINT32 RuleEnd;
+} SECUREHOST_PREFIX_SET, *PSECUREHOST_PREFIX_SET;
+
+//
+// Compiled rule table. A single allocation laid out as
+// [header][rules][bucket offsets][prefixes][front tables][audit], each section
+// cache-line aligned. Rules are grouped by bucket and ordered by Ordinal
+// within a bucket; remote prefix rules follow the generic bucket,
+// grouped by prefix. BucketStart has BucketMask + 3 entries: one per
+// hash bucket, one for the generic bucket, and its end offset.
+// Tables are immutable once built, apart from the audit counters.
+//
+typedef struct DECLSPEC_CACHEALIGN _SECUREHOST_RULE_TABLE {
+    UINT64 Generation;
+    UINT32 RuleCount;
+    UINT32 BucketMask;
+    PSECUREHOST_COMPILED_RULE Rules;
+    PUINT32 BucketStart;
+    SECUREHOST_PREFIX_SET RemotePrefixes[2];    // IPv4, IPv6
+    PSECUREHOST_RULE_AUDIT Audit;
+    UINT32 AuditCount;
+} SECUREHOST_RULE_TABLE, *PSECUREHOST_RULE_TABLE;
+
+//
+// Sizes computed by SecureHostGetRuleTableLayout. The caller allocates
+// TotalSize bytes (cache aligned) for the table and BucketCount + 1
+// zeroed UINT32s of scratch for the build.
+//
+typedef struct _SECUREHOST_RULE_TABLE_LAYOUT {
+    UINT32 EnabledCount;
+    UINT32 BucketCount;
+    UINT32 PrefixRuleCount[2];      // Upper bound on distinct prefixes
+    UINT32 FrontBits[2];
+    UINT32 AuditCount;
+    SIZE_T RulesOffset;
+    SIZE_T BucketsOffset;
+    SIZE_T PrefixesOffset[2];
+    SIZE_T FrontOffset[2];
+    SIZE_T AuditOffset;
+    SIZE_T TotalSize;
+} SECUREHOST_RULE_TABLE_LAYOUT, *PSECUREHOST_RULE_TABLE_LAYOUT;
+
+//
+// Connection attributes matched against the rule table
+//
+typedef struct _SECUREHOST_CONNECTION_KEY {
+    UINT64 AppIdHash;               // 0 when the layer supplies no app ID
+    UINT32 ProcessId;
+    UINT16 Protocol;
+    UINT16 LocalPort;
+    UINT16 RemotePort;
+    UINT8 IpVersion;                // 4 or 6
+    UINT8 Direction;                // FWP_DIRECTION
+    SECUREHOST_IP_ADDRESS LocalAddress;
+    SECUREHOST_IP_ADDRESS RemoteAddress;
+} SECUREHOST_CONNECTION_KEY, *PSECUREHOST_CONNECTION_KEY;
+
+//
+// Device policy match key. Kept dense so one cache line holds eight.
+//
+typedef struct _SECUREHOST_DEVICE_POLICY {
+    UINT32 ProcessId;               // 0 = any process
+    UINT8 DeviceType;
+    BOOLEAN Allowed;
+    UINT16 Reserved;
+} SECUREHOST_DEVICE_POLICY, *PSECUREHOST_DEVICE_POLICY;
+
+C_ASSERT(sizeof(SECUREHOST_DEVICE_POLICY) == 8);
+
+//
+// Mixes an index key into a bucket hash
+//
+FORCEINLINE
+UINT32
+SecureHostHashRuleKey(
+    _In_ UINT32 Kind,
+    _In_ UINT32 Value
+)
+{
+    UINT32 hash = (Value ^ (Kind << 28)) * 0x9E3779B1u;
+    return hash ^ (hash >> 15);
+}
+
+//
+// Hashes an ALE app ID (the NT device path of an image) for rule
+// matching: 64-bit FNV-1a over the UTF-16 code units, ASCII case folded,
+// stopping at Length or the first NUL. Never returns 0, which rules use
+// for "any application". The service hashes the app IDs it resolves for
+// rules the same way, so kernel and user mode must stay in step.
+//
+FORCEINLINE
+UINT64
+SecureHostHashAppId(
+    _In_reads_(Length) const WCHAR* AppId,
+    _In_ SIZE_T Length
+)
+{
+    UINT64 hash = 0xCBF29CE484222325ull;
+    SIZE_T i;
+
+    for (i = 0; i < Length && AppId[i] != 0; i++) {
+        WCHAR c = AppId[i];
+
+        if (c >= L'A' && c <= L'Z') {
+            c = (WCHAR)(c + (L'a' - L'A'));
+        }
+
+        hash = (hash ^ (UINT8)c) * 0x100000001B3ull;
+        hash = (hash ^ (UINT8)(c >> 8)) * 0x100000001B3ull;
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+//
+// Folds an app ID hash into an index key value
+//
+FORCEINLINE
+UINT32
+SecureHostAppIdKeyValue(
+    _In_ UINT64 AppIdHash
+)
+{
+    return (UINT32)(AppIdHash ^ (AppIdHash >> 32));
+}
+
+//
+// Returns the index key a compiled rule is filed under
+//
+FORCEINLINE
+BOOLEAN
+SecureHostGetRuleIndexKey(
+    _In_ const SECUREHOST_POLICY_RULE* Rule,
+    _Out_ PUINT32 Kind,
+    _Out_ PUINT32 Value
+)
+{
+    if (Rule->AppIdHash != 0) {
+        *Kind = SECUREHOST_RULE_KEY_APP_ID;
+        *Value = SecureHostAppIdKeyValue(Rule->AppIdHash);
+        return TRUE;
+    }
+
+    if (Rule->RemotePort != 0) {
+        *Kind = SECUREHOST_RULE_KEY_REMOTE_PORT;
+        *Value = Rule->RemotePort;
+        return TRUE;
+    }
+
+    if (Rule->LocalPort != 0) {
+        *Kind = SECUREHOST_RULE_KEY_LOCAL_PORT;
+        *Value = Rule->LocalPort;
+        return TRUE;
+    }
+
+    if (Rule->ProcessId != 0) {
+        *Kind = SECUREHOST_RULE_KEY_PROCESS_ID;
+        *Value = Rule->ProcessId;
+        return TRUE;
+    }
+
+    *Kind = 0;
+    *Value = 0;
+    return FALSE;
+}
+
+//
+// Checks a compiled rule against a connection (0 = wildcard)
+//
+FORCEINLINE
+BOOLEAN
+SecureHostRuleMatches(
+    _In_ const SECUREHOST_COMPILED_RULE* Rule,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key
+)
+{
+    return (Rule->RemotePort == 0 || Rule->RemotePort == Key->RemotePort) &&
+           (Rule->LocalPort == 0 || Rule->LocalPort == Key->LocalPort) &&
+           (Rule->Protocol == 0 || Rule->Protocol == Key->Protocol) &&
+           (Rule->ProcessId == 0 || Rule->ProcessId == Key->ProcessId) &&
+           (Rule->AppIdHash == 0 || Rule->AppIdHash == Key->AppIdHash);
+}
+
+//
+// Bucket a source rule is placed in
+//
+FORCEINLINE
+UINT32
+SecureHostRuleBucket(
+    _In_ const SECUREHOST_POLICY_RULE* Rule,
+    _In_ UINT32 BucketMask
+)
+{
+    UINT32 kind;
+    UINT32 value;
+
+    return SecureHostGetRuleIndexKey(Rule, &kind, &value) ?
+        (SecureHostHashRuleKey(kind, value) & BucketMask) :
+        BucketMask + 1;
+}
+
+//
+// Converts an address to the host-order form the prefix index uses
+//
+FORCEINLINE
+VOID
+SecureHostAddressToHost(
+    _In_ const SECUREHOST_IP_ADDRESS* Address,
+    _Out_ PUINT64 High,
+    _Out_ PUINT64 Low
+)
+{
+    UINT64 high = 0;
+    UINT64 low = 0;
+    UINT32 i;
+
+    for (i = 0; i < 8; i++) {
+        high = (high << 8) | Address->Bytes[i];
+        low = (low << 8) | Address->Bytes[i + 8];
+    }
+
+    *High = high;
+    *Low = low;
+}
+
+FORCEINLINE
+VOID
+SecureHostHostToAddress(
+    _In_ UINT64 High,
+    _In_ UINT64 Low,
+    _Out_ PSECUREHOST_IP_ADDRESS Address
+)
+{
+    UINT32 i;
+
+    for (i = 0; i < 8; i++) {
+        Address->Bytes[7 - i] = (UINT8)(High >> (i * 8));
+        Address->Bytes[15 - i] = (UINT8)(Low >> (i * 8));
+    }
+}
+
+FORCEINLINE
+VOID
+SecureHostMaskPrefix(
+    _Inout_ PUINT64 High,
+    _Inout_ PUINT64 Low,
+    _In_ UINT32 Length
+)
+{
+    if (Length == 0) {
+        *High = 0;
+        *Low = 0;
+    } else if (Length < 64) {
+        *High &= ~0ull << (64 - Length);
+        *Low = 0;
+    } else if (Length == 64) {
+        *Low = 0;
+    } else if (Length < 128) {
+        *Low &= ~0ull << (128 - Length);
+    }
+}
+
+FORCEINLINE
+BOOLEAN
+SecureHostPrefixContains(
+    _In_ const SECUREHOST_REMOTE_PREFIX* Prefix,
+    _In_ UINT64 High,
+    _In_ UINT64 Low
+)
+{
+    UINT32 length = Prefix->Length;
+
+    if (length == 0) {
+        return TRUE;
+    }
+
+    if (length <= 64) {
+        return ((High ^ Prefix->High) >> (64 - length)) == 0;
+    }
+
+    return High == Prefix->High && ((Low ^ Prefix->Low) >> (128 - length)) == 0;
+}
+
+//
+// Prefix build order: address, then length, then source position
+//
+FORCEINLINE
+BOOLEAN
+SecureHostPrefixBefore(
+    _In_ const SECUREHOST_REMOTE_PREFIX* First,
+    _In_ const SECUREHOST_REMOTE_PREFIX* Second
+)
+{
+    if (First->High != Second->High) {
+        return First->High < Second->High;
+    }
+    if (First->Low != Second->Low) {
+        return First->Low < Second->Low;
+    }
+    if (First->Length != Second->Length) {
+        return First->Length < Second->Length;
+    }
+    return First->RuleStart < Second->RuleStart;
+}
+
+//
+// Heap sort; in place, as the build has no scratch to spare
+//
+FORCEINLINE
+VOID
+SecureHostSiftPrefix(
+    _Inout_updates_(Count) PSECUREHOST_REMOTE_PREFIX Prefixes,
+    _In_ UINT32 Root,
+    _In_ UINT32 Count
+)
+{
+    SECUREHOST_REMOTE_PREFIX item = Prefixes[Root];
+
+    for (;;) {
+        UINT32 child = 2 * Root + 1;
+
+        if (child >= Count) {
+            break;
+        }
+        if (child + 1 < Count && SecureHostPrefixBefore(&Prefixes[child], &Prefixes[child + 1])) {
+            child++;
+        }
+        if (!SecureHostPrefixBefore(&item, &Prefixes[child])) {
+            break;
+        }
+
+        Prefixes[Root] = Prefixes[child];
+        Root = child;
+    }
+
+    Prefixes[Root] = item;
+}
+
+FORCEINLINE
+VOID
+SecureHostSortPrefixes(
+    _Inout_updates_(Count) PSECUREHOST_REMOTE_PREFIX Prefixes,
+    _In_ UINT32 Count
+)
+{
+    UINT32 i;
+
+    for (i = Count / 2; i > 0; i--) {
+        SecureHostSiftPrefix(Prefixes, i - 1, Count);
+    }
+
+    for (i = Count; i > 1; i--) {
+        SECUREHOST_REMOTE_PREFIX top = Prefixes[0];
+
+        Prefixes[0] = Prefixes[i - 1];
+        Prefixes[i - 1] = top;
+        SecureHostSiftPrefix(Prefixes, 0, i - 1);
+    }
+}
+
+FORCEINLINE
+UINT32
+SecureHostPrefixFrontIndex(
+    _In_ UINT64 High,
+    _In_ UINT32 FrontBits
+)
+{
+    return FrontBits != 0 ? (UINT32)(High >> (64 - FrontBits)) : 0;
+}
+
+FORCEINLINE
+VOID
+SecureHostCompileRule(
+    _Out_ PSECUREHOST_COMPILED_RULE Compiled,
+    _In_ const SECUREHOST_POLICY_RULE* Rule,
+    _In_ UINT32 Ordinal
+)
+{
+    Compiled->RuleId = Rule->RuleId;
+    Compiled->AppIdHash = Rule->AppIdHash;
+    Compiled->Ordinal = Ordinal;
+    Compiled->ProcessId = Rule->ProcessId;
+    Compiled->LocalPort = Rule->LocalPort;
+    Compiled->RemotePort = Rule->RemotePort;
+    Compiled->Protocol = (UINT8)Rule->Protocol;
+    Compiled->Flags = (Rule->Deferred ? SECUREHOST_COMPILED_RULE_DEFERRED : 0) |
+                      (Rule->AuditMode != 0 ? SECUREHOST_COMPILED_RULE_AUDITED : 0);
+    Compiled->Action = (UINT16)Rule->Action;
+}
+
+/*++
+
+Routine Description:
+    Sizes a compiled table for a rule set. Disabled rules are dropped.
+    The caller has already bounded RuleCount by SECUREHOST_MAX_RULES.
+
+--*/
+FORCEINLINE
+VOID
+SecureHostGetRuleTableLayout(
+    _In_reads_(RuleCount) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 RuleCount,
+    _Out_ PSECUREHOST_RULE_TABLE_LAYOUT Layout
+)
+{
+    SIZE_T offset;
+    UINT32 family;
+    UINT32 i;
+
+    Layout->EnabledCount = 0;
+    Layout->PrefixRuleCount[0] = 0;
+    Layout->PrefixRuleCount[1] = 0;
+    Layout->AuditCount = 0;
+    for (i = 0; i < RuleCount; i++) {
+        if (Rules[i].Enabled) {
+            Layout->EnabledCount++;
+            if (Rules[i].AuditMode != 0) {
+                Layout->AuditCount++;
+            }
+            if (Rules[i].RemoteIpVersion != 0) {
+                Layout->PrefixRuleCount[Rules[i].RemoteIpVersion == 6]++;
+            }
+        }
+    }
+
+    Layout->BucketCount = SECUREHOST_MIN_RULE_BUCKETS;
+    while (Layout->BucketCount < Layout->EnabledCount) {
+        Layout->BucketCount <<= 1;
+    }
+
+    Layout->RulesOffset = ALIGN_UP_BY(sizeof(SECUREHOST_RULE_TABLE), SYSTEM_CACHE_ALIGNMENT_SIZE);
+    Layout->BucketsOffset = ALIGN_UP_BY(
+        Layout->RulesOffset + (SIZE_T)Layout->EnabledCount * sizeof(SECUREHOST_COMPILED_RULE),
+        SYSTEM_CACHE_ALIGNMENT_SIZE);
+    offset = Layout->BucketsOffset + ((SIZE_T)Layout->BucketCount + 2) * sizeof(UINT32);
+
+    //
+    // One front entry per prefix or so, up to the front table limit
+    //
+    for (family = 0; family < 2; family++) {
+        Layout->FrontBits[family] = 0;
+        while (Layout->FrontBits[family] < SECUREHOST_MAX_PREFIX_FRONT_BITS &&
+               (2u << Layout->FrontBits[family]) <= Layout->PrefixRuleCount[family]) {
+            Layout->FrontBits[family]++;
+        }
+
+        Layout->PrefixesOffset[family] = ALIGN_UP_BY(offset, SYSTEM_CACHE_ALIGNMENT_SIZE);
+        offset = Layout->PrefixesOffset[family] +
+            (SIZE_T)Layout->PrefixRuleCount[family] * sizeof(SECUREHOST_REMOTE_PREFIX);
+    }
+
+    for (family = 0; family < 2; family++) {
+        Layout->FrontOffset[family] = ALIGN_UP_BY(offset, SYSTEM_CACHE_ALIGNMENT_SIZE);
+        offset = Layout->FrontOffset[family] +
+            (((SIZE_T)1 << Layout->FrontBits[family]) + 1) * sizeof(UINT32);
+    }
+
+    Layout->AuditOffset = ALIGN_UP_BY(offset, SYSTEM_CACHE_ALIGNMENT_SIZE);
+    offset = Layout->AuditOffset + (SIZE_T)Layout->AuditCount * sizeof(SECUREHOST_RULE_AUDIT);
+
+    Layout->TotalSize = offset;
+}
+
+/*++
+
+Routine Description:
+    Builds one family's prefix set and compiles its rules, starting at
+    rule index RuleBase, in prefix order. Duplicate prefixes are merged.
+    Returns the rule index following the family's rules.
+
+--*/
+FORCEINLINE
+UINT32
+SecureHostBuildPrefixSet(
+    _In_reads_(RuleCount) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 RuleCount,
+    _In_ UINT8 IpVersion,
+    _In_ UINT32 RuleBase,
+    _Inout_ PSECUREHOST_RULE_TABLE Table,
+    _Inout_ PSECUREHOST_PREFIX_SET Set
+)
+{
+    PSECUREHOST_REMOTE_PREFIX prefixes = Set->Prefixes;
+    UINT32 frontCount = 1u << Set->FrontBits;
+    UINT32 count = 0;
+    UINT32 distinct = 0;
+    UINT32 front;
+    UINT32 i;
+
+    //
+    // Sort one entry per rule, keyed by masked prefix; RuleStart holds
+    // the source position until the rules are compiled
+    //
+    for (i = 0; i < RuleCount; i++) {
+        PSECUREHOST_REMOTE_PREFIX prefix;
+
+        if (!Rules[i].Enabled || Rules[i].RemoteIpVersion != IpVersion) {
+            continue;
+        }
+
+        prefix = &prefixes[count++];
+        SecureHostAddressToHost(&Rules[i].RemoteAddress, &prefix->High, &prefix->Low);
+        SecureHostMaskPrefix(&prefix->High, &prefix->Low, Rules[i].RemotePrefixLength);
+        prefix->Parent = SECUREHOST_PREFIX_NONE;
+        prefix->RuleStart = i;
+        prefix->ChainOrdinal = i;
+        prefix->Length = Rules[i].RemotePrefixLength;
+    }
+
+    SecureHostSortPrefixes(prefixes, count);
+
+    //
+    // Compile rules in sorted order, so each prefix's rules are adjacent
+    // and ordinal-sorted, and merge duplicates down in place
+    //
+    for (i = 0; i < count; i++) {
+        SECUREHOST_REMOTE_PREFIX prefix = prefixes[i];
+
+        SecureHostCompileRule(&Table->Rules[RuleBase + i], &Rules[prefix.RuleStart], prefix.RuleStart);
+
+        if (distinct != 0 &&
+            prefixes[distinct - 1].High == prefix.High &&
+            prefixes[distinct - 1].Low == prefix.Low &&
+            prefixes[distinct - 1].Length == prefix.Length) {
+            continue;
+        }
+
+        //
+        // The first rule of a run has the prefix's lowest ordinal
+        //
+        prefix.RuleStart = RuleBase + i;
+        prefixes[distinct++] = prefix;
+    }
+
+    //
+    // A prefix's parent is the first prefix containing its address on
+    // the chain up from its predecessor. Parents come first, so their
+    // chain ordinals are final by the time a child reads them.
+    //
+    for (i = 0; i < distinct; i++) {
+        UINT32 parent = i - 1;
+
+        while (parent != SECUREHOST_PREFIX_NONE &&
+               !SecureHostPrefixContains(&prefixes[parent], prefixes[i].High, prefixes[i].Low)) {
+            parent = prefixes[parent].Parent;
+        }
+
+        prefixes[i].Parent = parent;
+        if (parent != SECUREHOST_PREFIX_NONE && prefixes[parent].ChainOrdinal < prefixes[i].ChainOrdinal) {
+            prefixes[i].ChainOrdinal = prefixes[parent].ChainOrdinal;
+        }
+    }
+
+    front = 0;
+    for (i = 0; i < frontCount; i++) {
+        while (front < distinct && SecureHostPrefixFrontIndex(prefixes[front].High, Set->FrontBits) < i) {
+            front++;
+        }
+        Set->Front[i] = front;
+    }
+    Set->Front[frontCount] = distinct;
+
+    Set->Count = distinct;
+    Set->RuleEnd = RuleBase + count;
+    return Set->RuleEnd;
+}
+
+/*++
+
+Routine Description:
+    Fills a table sized by SecureHostGetRuleTableLayout. BucketFill is
+    zeroed scratch of Layout->BucketCount + 1 entries.
+
+--*/
+FORCEINLINE
+VOID
+SecureHostBuildRuleTable(
+    _In_reads_(RuleCount) const SECUREHOST_POLICY_RULE* Rules,
+    _In_ UINT32 RuleCount,
+    _In_ UINT64 Generation,
+    _In_ const SECUREHOST_RULE_TABLE_LAYOUT* Layout,
+    _Out_writes_bytes_(Layout->TotalSize) PSECUREHOST_RULE_TABLE Table,
+    _Inout_updates_(Layout->BucketCount + 1) PUINT32 BucketFill
+)
+{
+    UINT32 genericBucket = Layout->BucketCount;
+    UINT32 ruleBase;
+    UINT32 family;
+    UINT32 i;
+
+    Table->Generation = Generation;
+    Table->RuleCount = Layout->EnabledCount;
+    Table->BucketMask = Layout->BucketCount - 1;
+    Table->Rules = (PSECUREHOST_COMPILED_RULE)((PUCHAR)Table + Layout->RulesOffset);
+    Table->BucketStart = (PUINT32)((PUCHAR)Table + Layout->BucketsOffset);
+
+    for (family = 0; family < 2; family++) {
+        Table->RemotePrefixes[family].Prefixes =
+            (PSECUREHOST_REMOTE_PREFIX)((PUCHAR)Table + Layout->PrefixesOffset[family]);
+        Table->RemotePrefixes[family].Front = (PUINT32)((PUCHAR)Table + Layout->FrontOffset[family]);
+        Table->RemotePrefixes[family].Count = 0;
+        Table->RemotePrefixes[family].FrontBits = Layout->FrontBits[family];
+    }
+
+    //
+    // Count rules per bucket, then turn counts into start offsets
+    //
+    for (i = 0; i < RuleCount; i++) {
+        if (Rules[i].Enabled && Rules[i].RemoteIpVersion == 0) {
+            BucketFill[SecureHostRuleBucket(&Rules[i], Table->BucketMask)]++;
+        }
+    }
+
+    Table->BucketStart[0] = 0;
+    for (i = 0; i <= genericBucket; i++) {
+        Table->BucketStart[i + 1] = Table->BucketStart[i] + BucketFill[i];
+        BucketFill[i] = Table->BucketStart[i];
+    }
+
+    //
+    // Place rules in source order so each bucket stays sorted by ordinal
+    //
+    for (i = 0; i < RuleCount; i++) {
+        PSECUREHOST_COMPILED_RULE compiled;
+
+        if (!Rules[i].Enabled || Rules[i].RemoteIpVersion != 0) {
+            continue;
+        }
+
+        compiled = &Table->Rules[BucketFill[SecureHostRuleBucket(&Rules[i], Table->BucketMask)]++];
+        SecureHostCompileRule(compiled, &Rules[i], i);
+    }
+
+    //
+    // Remote prefix rules follow the generic bucket
+    //
+    ruleBase = Table->BucketStart[genericBucket + 1];
+    ruleBase = SecureHostBuildPrefixSet(Rules, RuleCount, 4, ruleBase, Table, &Table->RemotePrefixes[0]);
+    SecureHostBuildPrefixSet(Rules, RuleCount, 6, ruleBase, Table, &Table->RemotePrefixes[1]);
+
+    //
+    // Audit entries in source order, so sorted by ordinal
+    //
+    Table->Audit = (PSECUREHOST_RULE_AUDIT)((PUCHAR)Table + Layout->AuditOffset);
+    Table->AuditCount = 0;
+    for (i = 0; i < RuleCount; i++) {
+        PSECUREHOST_RULE_AUDIT audit;
+
+        if (!Rules[i].Enabled || Rules[i].AuditMode == 0) {
+            continue;
+        }
+
+        audit = &Table->Audit[Table->AuditCount++];
+        RtlZeroMemory(audit, sizeof(*audit));
+        audit->Ordinal = i;
+        audit->Rate = Rules[i].AuditRate;
+        audit->Mode = Rules[i].AuditMode;
+    }
+}
+
+/*++
+
+Routine Description:
+    Finds the audit entry of a compiled rule flagged
+    SECUREHOST_COMPILED_RULE_AUDITED.
+
+--*/
+FORCEINLINE
+PSECUREHOST_RULE_AUDIT
+SecureHostFindRuleAudit(
+    _In_ const SECUREHOST_RULE_TABLE* Table,
+    _In_ UINT32 Ordinal
+)
+{
+    UINT32 low = 0;
+    UINT32 high = Table->AuditCount;
+
+    while (low < high) {
+        UINT32 mid = low + (high - low) / 2;
+
+        if (Table->Audit[mid].Ordinal < Ordinal) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low < Table->AuditCount && Table->Audit[low].Ordinal == Ordinal ? &Table->Audit[low] : NULL;
+}
+
+/*++
+
+Routine Description:
+    Finds the longest prefix in a set containing an address, or
+    SECUREHOST_PREFIX_NONE. Shorter matches follow through Parent.
+
+--*/
+FORCEINLINE
+UINT32
+SecureHostFindRemotePrefix(
+    _In_ const SECUREHOST_PREFIX_SET* Set,
+    _In_ UINT64 High,
+    _In_ UINT64 Low
+)
+{
+    UINT32 front = SecureHostPrefixFrontIndex(High, Set->FrontBits);
+    UINT32 low = Set->Front[front];
+    UINT32 high = Set->Front[front + 1];
+    UINT32 index;
+
+    //
+    // Every prefix before this front slot starts below the address and
+    // every one after it above, so only the slot needs bisecting
+    //
+    while (low < high) {
+        UINT32 middle = low + (high - low) / 2;
+        const SECUREHOST_REMOTE_PREFIX* prefix = &Set->Prefixes[middle];
+
+        if (prefix->High < High || (prefix->High == High && prefix->Low <= Low)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (index = low - 1;
+         index != SECUREHOST_PREFIX_NONE && !SecureHostPrefixContains(&Set->Prefixes[index], High, Low);
+         index = Set->Prefixes[index].Parent) {
+    }
+
+    return index;
+}
+
+FORCEINLINE
+UINT32
+SecureHostPrefixRuleEnd(
+    _In_ const SECUREHOST_PREFIX_SET* Set,
+    _In_ UINT32 Prefix
+)
+{
+    return Prefix + 1 < Set->Count ? Set->Prefixes[Prefix + 1].RuleStart : Set->RuleEnd;
+}
+
+//
+// Scans one ordinal-sorted rule range, stopping at the first match or
+// at the first rule that cannot beat the best so far
+//
+FORCEINLINE
+VOID
+SecureHostScanRules(
+    _In_ const SECUREHOST_RULE_TABLE* Table,
+    _In_ UINT32 Start,
+    _In_ UINT32 End,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key,
+    _Inout_ const SECUREHOST_COMPILED_RULE** Best,
+    _Inout_ PUINT32 BestOrdinal
+)
+{
+    UINT32 index;
+
+    for (index = Start; index < End; index++) {
+        const SECUREHOST_COMPILED_RULE* rule = &Table->Rules[index];
+
+        if (rule->Ordinal >= *BestOrdinal) {
+            break;
+        }
+
+        if (SecureHostRuleMatches(rule, Key)) {
+            *Best = rule;
+            *BestOrdinal = rule->Ordinal;
+            break;
+        }
+    }
+}
+
+/*++
+
+Routine Description:
+    Finds the highest-precedence rule matching a connection. Probes the
+    remote port, local port, process ID and application buckets plus the
+    generic bucket; buckets are ordinal-sorted so each probe stops early.
+    Connections without an app ID skip the application bucket, where no
+    rule could match them. Remote prefix rules are then checked for every
+    prefix containing the remote address, longest first.
+
+--*/
+FORCEINLINE
+const SECUREHOST_COMPILED_RULE*
+SecureHostLookupRule(
+    _In_ const SECUREHOST_RULE_TABLE* Table,
+    _In_ const SECUREHOST_CONNECTION_KEY* Key
+)
+{
+    const SECUREHOST_COMPILED_RULE* best = NULL;
+    UINT32 bestOrdinal = MAXUINT32;
+    UINT32 buckets[5];
+    UINT32 bucketCount = 0;
+    UINT32 probe;
+
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_REMOTE_PORT, Key->RemotePort) & Table->BucketMask;
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_LOCAL_PORT, Key->LocalPort) & Table->BucketMask;
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_PROCESS_ID, Key->ProcessId) & Table->BucketMask;
+    if (Key->AppIdHash != 0) {
+        buckets[bucketCount++] = SecureHostHashRuleKey(
+            SECUREHOST_RULE_KEY_APP_ID, SecureHostAppIdKeyValue(Key->AppIdHash)) & Table->BucketMask;
+    }
+    buckets[bucketCount++] = Table->BucketMask + 1;
+
+    for (probe = 0; probe < bucketCount; probe++) {
+        SecureHostScanRules(Table,
+                            Table->BucketStart[buckets[probe]],
+                            Table->BucketStart[buckets[probe] + 1],
+                            Key,
+                            &best,
+                            &bestOrdinal);
+    }
+
+    if (Key->IpVersion == 4 || Key->IpVersion == 6) {
+        const SECUREHOST_PREFIX_SET* set = &Table->RemotePrefixes[Key->IpVersion == 6];
+
+        if (set->Count != 0) {
+            UINT64 high;
+            UINT64 low;
+            UINT32 prefix;
+
+            SecureHostAddressToHost(&Key->RemoteAddress, &high, &low);
+
+            for (prefix = SecureHostFindRemotePrefix(set, high, low);
+                 prefix != SECUREHOST_PREFIX_NONE && set->Prefixes[prefix].ChainOrdinal < bestOrdinal;
+                 prefix = set->Prefixes[prefix].Parent) {
+                SecureHostScanRules(Table,
+                                    set->Prefixes[prefix].RuleStart,
+                                    SecureHostPrefixRuleEnd(set, prefix),
+                                    Key,
+                                    &best,
+                                    &bestOrdinal);
+            }
+        }
+    }
+
+    return best;
+}
+
+//
+// Scans device policies for one granting access. Any matching allow
+// wins; order does not matter.
+//
+FORCEINLINE
+BOOLEAN
+SecureHostScanDevicePolicies(
+    _In_reads_(Count) const SECUREHOST_DEVICE_POLICY* Policies,
+    _In_ UINT32 Count,
+    _In_ UINT8 DeviceType,
+    _In_ UINT32 ProcessId
+)
+{
+    const SECUREHOST_DEVICE_POLICY* policy;
+    const SECUREHOST_DEVICE_POLICY* end = Policies + Count;
+
+    for (policy = Policies; policy < end; policy++) {
+        if (policy->DeviceType == DeviceType &&
+            policy->Allowed &&
+            (policy->ProcessId == 0 || policy->ProcessId == ProcessId)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// Synthetic workloads
+//
+// Used by the drivers' self-timing IOCTL and the user-mode benchmark so
+// both drive the matchers with the same input mix. HitPercent of inputs
+// are derived from a loaded rule or policy (wildcards filled at random);
+// the rest are random and mostly fall through to the default verdict.
+//
+FORCEINLINE
+UINT32
+SecureHostWorkloadRandom(
+    _Inout_ PUINT32 State
+)
+{
+    UINT32 x = *State;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    *State = x;
+    return x;
+}
+
+FORCEINLINE
+VOID
+SecureHostSynthesizeConnection(
+    _In_ const SECUREHOST_RULE_TABLE* Table,
+    _In_ UINT32 HitPercent,
+    _Inout_ PUINT32 State,
+    _Out_ PSECUREHOST_CONNECTION_KEY Key
+)
+{
+    UINT32 random = SecureHostWorkloadRandom(State);
+
+    Key->AppIdHash = 0x100000000ull | (random >> 20);
+    Key->ProcessId = (random & 0xFFFCu) + 4;
+    Key->Protocol = (random & 0x10000u) ? 17 : 6;
+    Key->LocalPort = (UINT16)SecureHostWorkloadRandom(State);
+    Key->RemotePort = (UINT16)SecureHostWorkloadRandom(State);
+    Key->IpVersion = 4;
+    Key->Direction = 0;
+    Key->LocalAddress.Words[0] = 0;
+    Key->LocalAddress.Words[1] = 0;
+    Key->RemoteAddress.Words[0] = SecureHostWorkloadRandom(State);
+    Key->RemoteAddress.Words[1] = 0;
+
+    if (Table->RuleCount != 0 && SecureHostWorkloadRandom(State) % 100 < HitPercent) {
+        UINT32 index = SecureHostWorkloadRandom(State) % Table->RuleCount;
+        const SECUREHOST_COMPILED_RULE* rule = &Table->Rules[index];
+
+        if (index >= Table->BucketStart[Table->BucketMask + 2]) {
+            //
+            // Remote prefix rule: aim at a random host in one of that
+            // family's prefixes and take the prefix's first rule
+            //
+            BOOLEAN v6 = Table->RemotePrefixes[1].Count != 0 &&
+                         index >= Table->RemotePrefixes[1].Prefixes[0].RuleStart;
+            const SECUREHOST_PREFIX_SET* set = &Table->RemotePrefixes[v6];
+            const SECUREHOST_REMOTE_PREFIX* prefix =
+                &set->Prefixes[SecureHostWorkloadRandom(State) % set->Count];
+            UINT64 high = (UINT64)SecureHostWorkloadRandom(State) << 32;
+            UINT64 low = 0;
+            UINT64 networkHigh;
+            UINT64 networkLow;
+
+            if (v6) {
+                high |= SecureHostWorkloadRandom(State);
+                low = ((UINT64)SecureHostWorkloadRandom(State) << 32) | SecureHostWorkloadRandom(State);
+            }
+
+            networkHigh = high;
+            networkLow = low;
+            SecureHostMaskPrefix(&networkHigh, &networkLow, prefix->Length);
+
+            Key->IpVersion = v6 ? 6 : 4;
+            SecureHostHostToAddress(prefix->High | (high ^ networkHigh),
+                                    prefix->Low | (low ^ networkLow),
+                                    &Key->RemoteAddress);
+            rule = &Table->Rules[prefix->RuleStart];
+        }
+
+        if (rule->AppIdHash != 0) {
+            Key->AppIdHash = rule->AppIdHash;
+        }
+        if (rule->ProcessId != 0) {
+            Key->ProcessId = rule->ProcessId;
+        }
+        if (rule->Protocol != 0) {
+            Key->Protocol = rule->Protocol;
+        }
+        if (rule->LocalPort != 0) {
+            Key->LocalPort = rule->LocalPort;
+        }
+        if (rule->RemotePort != 0) {
+            Key->RemotePort = rule->RemotePort;
+        }
+    }
+}
+
+FORCEINLINE
+VOID
+SecureHostSynthesizeDeviceRequest(
+    _In_reads_(Count) const SECUREHOST_DEVICE_POLICY* Policies,
+    _In_ UINT32 Count,
+    _In_ UINT32 DeviceTypeCount,
+    _In_ UINT32 HitPercent,
+    _Inout_ PUINT32 State,
+    _Out_ PUINT8 DeviceType,
+    _Out_ PUINT32 ProcessId
+)
+{
+    UINT32 random = SecureHostWorkloadRandom(State);
+
+    *DeviceType = (UINT8)(random % DeviceTypeCount);
+    *ProcessId = ((random >> 8) & 0xFFFCu) + 4;
+
+    if (Count != 0 && SecureHostWorkloadRandom(State) % 100 < HitPercent) {
+        const SECUREHOST_DEVICE_POLICY* policy = &Policies[SecureHostWorkloadRandom(State) % Count];
+
+        *DeviceType = policy->DeviceType;
+        if (policy->ProcessId != 0) {
+            *ProcessId = policy->ProcessId;
+        }
+    }
+}
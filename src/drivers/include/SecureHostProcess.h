@@ -0,0 +1,595 @@
+/*++
+
+Module Name:
+    SecureHostProcess.h
+
+Abstract:
+    Process metadata cache shared by the SecureHost drivers. Filled from
+    the process notify routine as processes start, so the image path,
+    user, parent and signing level are captured once per process instead
+    of being looked up per event. Entries are keyed by process ID and
+    creation time; the pair names one process even after its ID is
+    reused, and it is what events carry in place of names. An exited
+    process stays queryable until SECUREHOST_MAX_EXITED_PROCESSES later
+    exits have pushed it out, so the service can still resolve events
+    that were queued before the exit.
+
+    Processes that were already running when the driver loaded are
+    captured the first time they are queried.
+
+    Kernel mode only; the includer supplies ntifs.h and includes
+    SecureHostWire.h first. Nothing here is pageable: the lookup runs at
+    DISPATCH_LEVEL from the classify path.
+
+Environment:
+    Kernel mode
+
+--*/
+
+#pragma once
+
+#define SECUREHOST_PROCESS_TAG              'PCHS'
+
+#define SECUREHOST_PROCESS_BUCKET_SHIFT     10u
+#define SECUREHOST_PROCESS_BUCKETS          (1u << SECUREHOST_PROCESS_BUCKET_SHIFT)
+
+//
+// Entries cached at most, and exited entries kept of those. Starts past
+// the cap are not cached and resolve in user mode instead.
+//
+#define SECUREHOST_MAX_PROCESSES            16384u
+#define SECUREHOST_MAX_EXITED_PROCESSES     512u
+
+//
+// Longest image path kept, in bytes; longer paths keep their tail
+//
+#define SECUREHOST_MAX_IMAGE_PATH_BYTES     (1024u * sizeof(WCHAR))
+
+//
+// Cached process. The image path (UTF-16) and the user SID follow the
+// entry in Data, in that order.
+//
+typedef struct _SECUREHOST_PROCESS_ENTRY {
+    struct _SECUREHOST_PROCESS_ENTRY* Next;     // Bucket chain
+    LIST_ENTRY ExitLink;                        // Exited list, once ExitTime is set
+    UINT64 CreateTime;
+    UINT64 ExitTime;
+    UINT32 ProcessId;
+    UINT32 ParentProcessId;
+    UINT32 Flags;           // SECUREHOST_PROCESS_FLAG_SIGNING_LEVEL
+    UINT8 SigningLevel;
+    UINT8 Reserved;
+    UINT16 ImagePathLength;
+    UINT16 UserSidLength;
+    UINT8 Data[ANYSIZE_ARRAY];
+} SECUREHOST_PROCESS_ENTRY, *PSECUREHOST_PROCESS_ENTRY;
+
+//
+// Lookups take Lock shared and may run at DISPATCH_LEVEL; the notify
+// routine and lazy captures take it exclusive. Entries are allocated and
+// freed with the lock released.
+//
+typedef struct _SECUREHOST_PROCESS_CACHE {
+    EX_SPIN_LOCK Lock;
+    ULONG Count;
+    ULONG ExitedCount;
+    LIST_ENTRY ExitedList;      // Oldest exit first
+    PSECUREHOST_PROCESS_ENTRY Buckets[SECUREHOST_PROCESS_BUCKETS];
+} SECUREHOST_PROCESS_CACHE, *PSECUREHOST_PROCESS_CACHE;
+
+FORCEINLINE
+VOID
+SecureHostInitializeProcessCache(
+    _Out_ PSECUREHOST_PROCESS_CACHE Cache
+)
+{
+    RtlZeroMemory(Cache, sizeof(SECUREHOST_PROCESS_CACHE));
+    InitializeListHead(&Cache->ExitedList);
+}
+
+//
+// Frees every entry. The notify routine must already be unregistered.
+//
+FORCEINLINE
+VOID
+SecureHostDestroyProcessCache(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache
+)
+{
+    PSECUREHOST_PROCESS_ENTRY entry;
+    ULONG bucket;
+
+    for (bucket = 0; bucket < SECUREHOST_PROCESS_BUCKETS; bucket++) {
+        while ((entry = Cache->Buckets[bucket]) != NULL) {
+            Cache->Buckets[bucket] = entry->Next;
+            ExFreePoolWithTag(entry, SECUREHOST_PROCESS_TAG);
+        }
+    }
+
+    Cache->Count = 0;
+    Cache->ExitedCount = 0;
+    InitializeListHead(&Cache->ExitedList);
+}
+
+FORCEINLINE
+ULONG
+SecureHostProcessBucket(
+    _In_ UINT32 ProcessId
+)
+{
+    //
+    // Process IDs are multiples of four
+    //
+    return ((ProcessId >> 2) * 0x9E3779B1u) >> (32 - SECUREHOST_PROCESS_BUCKET_SHIFT);
+}
+
+//
+// Finds a process; a CreateTime of 0 finds the live process with the ID
+//
+_Requires_lock_held_(Cache->Lock)
+FORCEINLINE
+PSECUREHOST_PROCESS_ENTRY
+SecureHostFindProcessLocked(
+    _In_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ UINT32 ProcessId,
+    _In_ UINT64 CreateTime
+)
+{
+    PSECUREHOST_PROCESS_ENTRY entry;
+
+    for (entry = Cache->Buckets[SecureHostProcessBucket(ProcessId)]; entry != NULL; entry = entry->Next) {
+        if (entry->ProcessId != ProcessId) {
+            continue;
+        }
+
+        if (CreateTime != 0 ? entry->CreateTime == CreateTime : entry->ExitTime == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+_Requires_lock_held_(Cache->Lock)
+FORCEINLINE
+VOID
+SecureHostUnlinkProcessLocked(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ PSECUREHOST_PROCESS_ENTRY Entry
+)
+{
+    PSECUREHOST_PROCESS_ENTRY* link = &Cache->Buckets[SecureHostProcessBucket(Entry->ProcessId)];
+
+    while (*link != Entry) {
+        link = &(*link)->Next;
+    }
+
+    *link = Entry->Next;
+    Cache->Count--;
+
+    if (Entry->ExitTime != 0) {
+        RemoveEntryList(&Entry->ExitLink);
+        Cache->ExitedCount--;
+    }
+}
+
+/*++
+
+Routine Description:
+    Captures a process's metadata into a new entry. CreateInfo is the
+    notify routine's, or NULL for a process that is already running; the
+    parent and signing level are only known from it. Returns NULL if the
+    entry cannot be allocated.
+
+--*/
+_IRQL_requires_(PASSIVE_LEVEL)
+FORCEINLINE
+PSECUREHOST_PROCESS_ENTRY
+SecureHostCaptureProcess(
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+)
+{
+    PSECUREHOST_PROCESS_ENTRY entry;
+    PUNICODE_STRING located = NULL;
+    PCUNICODE_STRING imagePath = NULL;
+    PACCESS_TOKEN token;
+    PTOKEN_USER tokenUser = NULL;
+    ULONG pathLength = 0;
+    ULONG sidLength = 0;
+    ULONG signingFlags;
+    SE_SIGNING_LEVEL signingLevel;
+
+    if (CreateInfo != NULL && CreateInfo->ImageFileName != NULL) {
+        imagePath = CreateInfo->ImageFileName;
+    } else if (NT_SUCCESS(SeLocateProcessImageName(Process, &located))) {
+        imagePath = located;
+    }
+
+    if (imagePath != NULL) {
+        pathLength = min((ULONG)imagePath->Length, SECUREHOST_MAX_IMAGE_PATH_BYTES);
+    }
+
+    token = PsReferencePrimaryToken(Process);
+    if (token != NULL) {
+        if (NT_SUCCESS(SeQueryInformationToken(token, TokenUser, (PVOID*)&tokenUser))) {
+            sidLength = RtlLengthSid(tokenUser->User.Sid);
+        }
+
+        PsDereferencePrimaryToken(token);
+    }
+
+    entry = (PSECUREHOST_PROCESS_ENTRY)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        FIELD_OFFSET(SECUREHOST_PROCESS_ENTRY, Data) + pathLength + sidLength,
+        SECUREHOST_PROCESS_TAG);
+
+    if (entry != NULL) {
+        entry->CreateTime = (UINT64)PsGetProcessCreateTimeQuadPart(Process);
+        entry->ProcessId = HandleToUlong(ProcessId);
+        entry->ImagePathLength = (UINT16)pathLength;
+        entry->UserSidLength = (UINT16)sidLength;
+
+        if (pathLength != 0) {
+            //
+            // Keep the tail of an overlong path; the file name is the
+            // part worth having
+            //
+            RtlCopyMemory(
+                entry->Data,
+                (PUCHAR)imagePath->Buffer + (imagePath->Length - pathLength),
+                pathLength);
+        }
+
+        if (sidLength != 0) {
+            RtlCopyMemory(entry->Data + pathLength, tokenUser->User.Sid, sidLength);
+        }
+
+        if (CreateInfo != NULL) {
+            entry->ParentProcessId = HandleToUlong(CreateInfo->ParentProcessId);
+
+            if (CreateInfo->FileObject != NULL &&
+                NT_SUCCESS(SeGetCachedSigningLevel(
+                    (PFILE_OBJECT)CreateInfo->FileObject, &signingFlags, &signingLevel, NULL, NULL, NULL))) {
+                entry->SigningLevel = signingLevel;
+                entry->Flags |= SECUREHOST_PROCESS_FLAG_SIGNING_LEVEL;
+            }
+        }
+    }
+
+    if (tokenUser != NULL) {
+        ExFreePool(tokenUser);
+    }
+
+    if (located != NULL) {
+        ExFreePool(located);
+    }
+
+    return entry;
+}
+
+/*++
+
+Routine Description:
+    Adds a captured entry. Returns the entry if the cache kept it, else
+    NULL and the caller frees it: the process is already cached, or the
+    cache is full of running processes. A full cache makes room by
+    evicting its oldest exited entry, which is returned in Evicted for the
+    caller to free.
+
+--*/
+_Requires_lock_held_(Cache->Lock)
+FORCEINLINE
+PSECUREHOST_PROCESS_ENTRY
+SecureHostInsertProcessLocked(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ PSECUREHOST_PROCESS_ENTRY Entry,
+    _Out_ PSECUREHOST_PROCESS_ENTRY* Evicted
+)
+{
+    ULONG bucket;
+
+    *Evicted = NULL;
+
+    if (SecureHostFindProcessLocked(Cache, Entry->ProcessId, Entry->CreateTime) != NULL) {
+        return NULL;
+    }
+
+    if (Cache->Count >= SECUREHOST_MAX_PROCESSES) {
+        if (IsListEmpty(&Cache->ExitedList)) {
+            return NULL;
+        }
+
+        *Evicted = CONTAINING_RECORD(Cache->ExitedList.Flink, SECUREHOST_PROCESS_ENTRY, ExitLink);
+        SecureHostUnlinkProcessLocked(Cache, *Evicted);
+    }
+
+    bucket = SecureHostProcessBucket(Entry->ProcessId);
+    Entry->Next = Cache->Buckets[bucket];
+    Cache->Buckets[bucket] = Entry;
+    Cache->Count++;
+
+    return Entry;
+}
+
+/*++
+
+Routine Description:
+    Process notify hook; each driver calls it from its own notify
+    routine. A start is captured and cached. An exit stamps the entry's
+    exit time and moves it to the exited list, evicting the oldest exited
+    entry beyond SECUREHOST_MAX_EXITED_PROCESSES.
+
+--*/
+_IRQL_requires_(PASSIVE_LEVEL)
+FORCEINLINE
+VOID
+SecureHostProcessCacheNotify(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+)
+{
+    PSECUREHOST_PROCESS_ENTRY entry;
+    PSECUREHOST_PROCESS_ENTRY evicted = NULL;
+    LARGE_INTEGER exitTime;
+    UINT64 createTime;
+    KIRQL oldIrql;
+
+    if (CreateInfo != NULL) {
+        entry = SecureHostCaptureProcess(Process, ProcessId, CreateInfo);
+        if (entry == NULL) {
+            return;
+        }
+
+        oldIrql = ExAcquireSpinLockExclusive(&Cache->Lock);
+        if (SecureHostInsertProcessLocked(Cache, entry, &evicted) != NULL) {
+            entry = NULL;
+        }
+        ExReleaseSpinLockExclusive(&Cache->Lock, oldIrql);
+
+        if (entry != NULL) {
+            ExFreePoolWithTag(entry, SECUREHOST_PROCESS_TAG);
+        }
+    } else {
+        createTime = (UINT64)PsGetProcessCreateTimeQuadPart(Process);
+        KeQuerySystemTimePrecise(&exitTime);
+
+        oldIrql = ExAcquireSpinLockExclusive(&Cache->Lock);
+
+        entry = SecureHostFindProcessLocked(Cache, HandleToUlong(ProcessId), createTime);
+        if (entry != NULL && entry->ExitTime == 0) {
+            entry->ExitTime = (UINT64)exitTime.QuadPart;
+            InsertTailList(&Cache->ExitedList, &entry->ExitLink);
+            Cache->ExitedCount++;
+
+            if (Cache->ExitedCount > SECUREHOST_MAX_EXITED_PROCESSES) {
+                evicted = CONTAINING_RECORD(Cache->ExitedList.Flink, SECUREHOST_PROCESS_ENTRY, ExitLink);
+                SecureHostUnlinkProcessLocked(Cache, evicted);
+            }
+        }
+
+        ExReleaseSpinLockExclusive(&Cache->Lock, oldIrql);
+    }
+
+    if (evicted != NULL) {
+        ExFreePoolWithTag(evicted, SECUREHOST_PROCESS_TAG);
+    }
+}
+
+//
+// Creation time of the live process with an ID, or 0 if it is not
+// cached. Callable at DISPATCH_LEVEL.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FORCEINLINE
+UINT64
+SecureHostLookupProcessCreateTime(
+    _In_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ UINT32 ProcessId
+)
+{
+    PSECUREHOST_PROCESS_ENTRY entry;
+    UINT64 createTime = 0;
+    KIRQL oldIrql;
+
+    oldIrql = ExAcquireSpinLockShared(&Cache->Lock);
+
+    entry = SecureHostFindProcessLocked(Cache, ProcessId, 0);
+    if (entry != NULL) {
+        createTime = entry->CreateTime;
+    }
+
+    ExReleaseSpinLockShared(&Cache->Lock, oldIrql);
+
+    return createTime;
+}
+
+//
+// Captures a running process that is not cached yet, if it matches the
+// query. Returns FALSE if there is no such process.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+FORCEINLINE
+BOOLEAN
+SecureHostCaptureRunningProcess(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_ UINT32 ProcessId,
+    _In_ UINT64 CreateTime
+)
+{
+    PEPROCESS process;
+    PSECUREHOST_PROCESS_ENTRY entry = NULL;
+    PSECUREHOST_PROCESS_ENTRY evicted = NULL;
+    KIRQL oldIrql;
+
+    if (ProcessId == 0 || !NT_SUCCESS(PsLookupProcessByProcessId(UlongToHandle(ProcessId), &process))) {
+        return FALSE;
+    }
+
+    if (CreateTime == 0 || (UINT64)PsGetProcessCreateTimeQuadPart(process) == CreateTime) {
+        entry = SecureHostCaptureProcess(process, UlongToHandle(ProcessId), NULL);
+    }
+
+    ObDereferenceObject(process);
+
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&Cache->Lock);
+    if (SecureHostInsertProcessLocked(Cache, entry, &evicted) != NULL) {
+        entry = NULL;
+    }
+    ExReleaseSpinLockExclusive(&Cache->Lock, oldIrql);
+
+    //
+    // A concurrent capture of the same process wins; either way it is
+    // cached now, unless the cache is full
+    //
+    if (entry != NULL) {
+        ExFreePoolWithTag(entry, SECUREHOST_PROCESS_TAG);
+    }
+
+    if (evicted != NULL) {
+        ExFreePoolWithTag(evicted, SECUREHOST_PROCESS_TAG);
+    }
+
+    return TRUE;
+}
+
+/*++
+
+Routine Description:
+    Copies one entry into a query record, with its strings at *Strings if
+    they fit before OutputLength. Advances *Strings past what was copied.
+
+--*/
+_Requires_lock_held_(Cache->Lock)
+FORCEINLINE
+VOID
+SecureHostFillProcessRecord(
+    _In_ const SECUREHOST_PROCESS_ENTRY* Entry,
+    _Out_ PSECUREHOST_PROCESS_RECORD Record,
+    _Inout_updates_bytes_(OutputLength) PUCHAR Output,
+    _In_ ULONG OutputLength,
+    _Inout_ PULONG Strings
+)
+{
+    ULONG length = (ULONG)Entry->ImagePathLength + Entry->UserSidLength;
+
+    RtlZeroMemory(Record, sizeof(SECUREHOST_PROCESS_RECORD));
+
+    Record->CreateTime = Entry->CreateTime;
+    Record->ExitTime = Entry->ExitTime;
+    Record->ProcessId = Entry->ProcessId;
+    Record->ParentProcessId = Entry->ParentProcessId;
+    Record->Flags = SECUREHOST_PROCESS_FLAG_FOUND | Entry->Flags;
+    Record->SigningLevel = Entry->SigningLevel;
+
+    if (Entry->ExitTime != 0) {
+        Record->Flags |= SECUREHOST_PROCESS_FLAG_EXITED;
+    }
+
+    if (length > OutputLength - *Strings) {
+        Record->Flags |= SECUREHOST_PROCESS_FLAG_TRUNCATED;
+        return;
+    }
+
+    RtlCopyMemory(Output + *Strings, Entry->Data, length);
+
+    Record->ImagePathLength = Entry->ImagePathLength;
+    Record->ImagePathOffset = *Strings;
+    Record->UserSidLength = Entry->UserSidLength;
+    Record->UserSidOffset = *Strings + Entry->ImagePathLength;
+
+    //
+    // Keep the next path two-byte aligned after an odd-length SID
+    //
+    *Strings += (ULONG)ALIGN_UP_BY(length, sizeof(WCHAR));
+}
+
+/*++
+
+Routine Description:
+    Handles IOCTL_SECUREHOST_QUERY_PROCESSES (see SecureHostWire.h).
+    Input and output may be the same buffered I/O buffer, so the queries
+    are copied out before any record is written. A process missing from
+    the cache that is still running is captured on the way.
+
+--*/
+_IRQL_requires_(PASSIVE_LEVEL)
+FORCEINLINE
+NTSTATUS
+SecureHostQueryProcesses(
+    _Inout_ PSECUREHOST_PROCESS_CACHE Cache,
+    _In_reads_bytes_(InputLength) const VOID* Input,
+    _In_ ULONG InputLength,
+    _Out_writes_bytes_to_(OutputLength, *BytesWritten) PVOID Output,
+    _In_ ULONG OutputLength,
+    _Out_ PULONG BytesWritten
+)
+{
+    PSECUREHOST_PROCESS_QUERY queries;
+    PSECUREHOST_PROCESS_RECORD records = (PSECUREHOST_PROCESS_RECORD)Output;
+    PSECUREHOST_PROCESS_ENTRY entry;
+    ULONG count;
+    ULONG strings;
+    ULONG i;
+    BOOLEAN captured;
+    KIRQL oldIrql;
+
+    *BytesWritten = 0;
+
+    count = InputLength / sizeof(SECUREHOST_PROCESS_QUERY);
+    if (count == 0 || count > SECUREHOST_MAX_PROCESS_QUERIES ||
+        InputLength % sizeof(SECUREHOST_PROCESS_QUERY) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (OutputLength < count * sizeof(SECUREHOST_PROCESS_RECORD)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    queries = (PSECUREHOST_PROCESS_QUERY)ExAllocatePool2(POOL_FLAG_PAGED, InputLength, SECUREHOST_PROCESS_TAG);
+    if (queries == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyMemory(queries, Input, InputLength);
+
+    strings = count * sizeof(SECUREHOST_PROCESS_RECORD);
+
+    for (i = 0; i < count; i++) {
+        for (captured = FALSE;;) {
+            oldIrql = ExAcquireSpinLockShared(&Cache->Lock);
+
+            entry = SecureHostFindProcessLocked(Cache, queries[i].ProcessId, queries[i].CreateTime);
+            if (entry != NULL) {
+                SecureHostFillProcessRecord(entry, &records[i], (PUCHAR)Output, OutputLength, &strings);
+            }
+
+            ExReleaseSpinLockShared(&Cache->Lock, oldIrql);
+
+            if (entry != NULL || captured ||
+                !SecureHostCaptureRunningProcess(Cache, queries[i].ProcessId, queries[i].CreateTime)) {
+                break;
+            }
+
+            captured = TRUE;
+        }
+
+        if (entry == NULL) {
+            RtlZeroMemory(&records[i], sizeof(SECUREHOST_PROCESS_RECORD));
+            records[i].ProcessId = queries[i].ProcessId;
+            records[i].CreateTime = queries[i].CreateTime;
+        }
+    }
+
+    ExFreePoolWithTag(queries, SECUREHOST_PROCESS_TAG);
+
+    *BytesWritten = strings;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/*++
+
+Module Name:
+    SecureHostWire.h
+
+Abstract:
+    Rule wire formats shared by the SecureHost drivers and the service
+    (mirrored byte for byte in DriverWireFormat.cs). Rules travel as a
+    SECUREHOST_RULESET_HEADER followed by RuleCount fixed-size records of
+    RuleSize bytes each, starting at HeaderSize; device rule process
+    names follow the records.
+
+    Versioning: Version changes only when a field's meaning changes.
+    New fields are appended to a record, and zero must mean the old
+    behaviour. Readers accept any RuleSize of at least the record's
+    minimum size. They read the fields they know and treat any missing
+    trailing fields as zero, so an older driver and a newer service (or
+    the reverse) interoperate without repacking. HeaderSize grows the
+    same way.
+
+    All records are little-endian and naturally aligned.
+
+Environment:
+    Kernel and user mode
+
+--*/
+
+#pragma once
+
+typedef struct _SECUREHOST_RULESET_HEADER {
+    UINT32 Version;
+    UINT32 HeaderSize;
+    UINT32 RuleSize;
+    UINT32 RuleCount;
+    UINT64 Generation;  // Network: 0 = next generation, else must exceed the active one. Device: 0
+} SECUREHOST_RULESET_HEADER, *PSECUREHOST_RULESET_HEADER;
+
+C_ASSERT(sizeof(SECUREHOST_RULESET_HEADER) == 24);
+
+//
+// Captures record Index of a ruleset into Record (RecordSize bytes),
+// zero-filling whatever a shorter sender did not supply. Records may sit
+// in mapped user memory, so each is copied exactly once.
+//
+FORCEINLINE
+VOID
+SecureHostCaptureRecord(
+    _In_ const SECUREHOST_RULESET_HEADER* Header,
+    _In_ const VOID* Records,
+    _In_ UINT32 Index,
+    _Out_writes_bytes_(RecordSize) VOID* Record,
+    _In_ UINT32 RecordSize
+)
+{
+    UINT32 length = (Header->RuleSize < RecordSize) ? Header->RuleSize : RecordSize;
+
+    RtlCopyMemory(Record, (const UCHAR*)Records + (SIZE_T)Index * Header->RuleSize, length);
+    RtlZeroMemory((UCHAR*)Record + length, RecordSize - length);
+}
+
+//
+// Rule actions (match PolicyAction in SecureHostCore) and flags
+//
+#define SECUREHOST_RULE_ACTION_ALLOW    1u
+#define SECUREHOST_RULE_ACTION_BLOCK    2u
+#define SECUREHOST_RULE_ACTION_AUDIT    3u
+
+#define SECUREHOST_RULE_FLAG_ENABLED    0x00000001u
+#define SECUREHOST_RULE_FLAG_DEFERRED   0x00000002u // Network only: service decides; Action is the fallback
+
+//
+// How the WFP driver records permits matched by a rule. Blocks, and
+// connections left to the service, are always recorded: block rules are
+// never offloaded to native filters. A recorded event carries the number
+// of permits it stands for, so counts can be rebuilt from sampled events.
+//
+#define SECUREHOST_AUDIT_MODE_DEFAULT       0u  // Each permit the callout sees; offloadable permit rules are not seen
+#define SECUREHOST_AUDIT_MODE_OFF           1u  // None
+#define SECUREHOST_AUDIT_MODE_SAMPLED       2u  // Every AuditRate-th
+#define SECUREHOST_AUDIT_MODE_RATE_LIMITED  3u  // Up to AuditRate a second
+#define SECUREHOST_AUDIT_MODE_FULL          4u  // Each one; keeps the rule in the callout
+#define SECUREHOST_AUDIT_MODE_MAX           SECUREHOST_AUDIT_MODE_FULL
+
+#define SECUREHOST_MAX_AUDIT_RATE           0x000FFFFFu
+
+//
+// Network ruleset (WFP driver, IOCTL_SECUREHOST_LOAD_NETWORK_RULESET)
+//
+#define SECUREHOST_RULESET_VERSION      3u
+
+#define SECUREHOST_RULE_FLAGS_VALID     (SECUREHOST_RULE_FLAG_ENABLED | SECUREHOST_RULE_FLAG_DEFERRED)
+
+typedef struct _SECUREHOST_NETWORK_RULE_RECORD {
+    UINT64 RuleId;
+    UINT32 ProcessId;
+    UINT16 Protocol;
+    UINT16 LocalPort;
+    UINT16 RemotePort;
+    UINT16 Action;      // SECUREHOST_RULE_ACTION_*
+    UINT32 Flags;       // SECUREHOST_RULE_FLAG_*
+    UINT64 AppIdHash;   // SecureHostHashAppId of the image's app ID; 0 = any
+    UINT8 RemoteAddress[16];    // Network byte order, IPv4 in the first four bytes
+    UINT8 RemoteIpVersion;      // 4 or 6 to match a remote prefix; 0 = any address
+    UINT8 RemotePrefixLength;
+    UINT8 AuditMode;            // SECUREHOST_AUDIT_MODE_*, for permits
+    UINT8 Reserved0;
+    UINT32 AuditRate;           // Sampled: 1 in AuditRate; rate limited: per second
+} SECUREHOST_NETWORK_RULE_RECORD, *PSECUREHOST_NETWORK_RULE_RECORD;
+
+C_ASSERT(sizeof(SECUREHOST_NETWORK_RULE_RECORD) == 56);
+
+#define SECUREHOST_NETWORK_RULE_RECORD_MIN_SIZE \
+    FIELD_OFFSET(SECUREHOST_NETWORK_RULE_RECORD, AppIdHash)
+
+//
+// Network rule delta (WFP driver, IOCTL_SECUREHOST_UPDATE_NETWORK_RULES).
+// Edits the active rule set instead of replacing it: records apply in
+// order, and the result must be what a full load of the edited set would
+// give. An upsert first removes any rule with its RuleId, then inserts
+// the rule ahead of the rule with ID InsertBefore (0 = at the end); a
+// remove deletes the rule with RuleId. The delta only applies to the
+// rule set published as BaseGeneration; Header.Generation is the new
+// generation, under the same rules as a full load. RuleSize is the size
+// of a delta record.
+//
+#define SECUREHOST_RULE_DELTA_VERSION   1u
+
+#define SECUREHOST_RULE_DELTA_UPSERT    1u
+#define SECUREHOST_RULE_DELTA_REMOVE    2u
+
+typedef struct _SECUREHOST_RULE_DELTA_HEADER {
+    SECUREHOST_RULESET_HEADER Header;   // Version is SECUREHOST_RULE_DELTA_VERSION
+    UINT64 BaseGeneration;
+} SECUREHOST_RULE_DELTA_HEADER, *PSECUREHOST_RULE_DELTA_HEADER;
+
+C_ASSERT(sizeof(SECUREHOST_RULE_DELTA_HEADER) == 32);
+
+typedef struct _SECUREHOST_NETWORK_RULE_DELTA_RECORD {
+    UINT32 Operation;   // SECUREHOST_RULE_DELTA_*
+    UINT32 Reserved;
+    UINT64 InsertBefore;
+    SECUREHOST_NETWORK_RULE_RECORD Rule;    // Remove: only RuleId is read
+} SECUREHOST_NETWORK_RULE_DELTA_RECORD, *PSECUREHOST_NETWORK_RULE_DELTA_RECORD;
+
+C_ASSERT(sizeof(SECUREHOST_NETWORK_RULE_DELTA_RECORD) == 72);
+
+#define SECUREHOST_NETWORK_RULE_DELTA_RECORD_MIN_SIZE \
+    (FIELD_OFFSET(SECUREHOST_NETWORK_RULE_DELTA_RECORD, Rule) + SECUREHOST_NETWORK_RULE_RECORD_MIN_SIZE)
+
+//
+// Device rule batch (device driver, IOCTL_SECUREHOST_APPLY_DEVICE_RULES).
+// Records are applied in order; an enabled record adds or replaces the
+// policy with its rule ID, a disabled one removes it. ProcessNameOffset
+// is from the start of the batch; the name is UTF-16, unterminated.
+//
+#define SECUREHOST_DEVICE_RULESET_VERSION   1u
+
+#define SECUREHOST_DEVICE_RULE_FLAGS_VALID  SECUREHOST_RULE_FLAG_ENABLED
+
+typedef struct _SECUREHOST_DEVICE_RULE_RECORD {
+    UINT64 RuleId;
+    UINT32 ProcessId;           // 0 = any process
+    UINT32 DeviceType;          // SECUREHOST_DEVICE_TYPE
+    UINT16 Action;              // SECUREHOST_RULE_ACTION_*
+    UINT16 ProcessNameLength;   // In bytes; 0 = any process name
+    UINT32 ProcessNameOffset;
+    UINT32 Flags;               // SECUREHOST_RULE_FLAG_ENABLED
+    UINT32 Reserved;
+} SECUREHOST_DEVICE_RULE_RECORD, *PSECUREHOST_DEVICE_RULE_RECORD;
+
+C_ASSERT(sizeof(SECUREHOST_DEVICE_RULE_RECORD) == 32);
+
+#define SECUREHOST_DEVICE_RULE_RECORD_MIN_SIZE  sizeof(SECUREHOST_DEVICE_RULE_RECORD)
+
+//
+// Process metadata query (both drivers, IOCTL_SECUREHOST_QUERY_PROCESSES).
+// Each driver caches metadata for processes it has seen start, keyed by
+// process ID and creation time, so the pair names one process even after
+// its ID is reused; events carry the creation time alongside the ID. The
+// input is up to SECUREHOST_MAX_PROCESS_QUERIES queries, the output one
+// record per query, in order, followed by the strings. A CreateTime of 0
+// asks for the live process with that ID. String offsets are from the
+// start of the output; the image path is the NT path, UTF-16 and
+// unterminated, and the user SID is binary. The output must hold at least
+// the records; strings that do not fit are left out and flagged.
+//
+#define SECUREHOST_MAX_PROCESS_QUERIES          64u
+
+#define SECUREHOST_PROCESS_FLAG_FOUND           0x1u
+#define SECUREHOST_PROCESS_FLAG_EXITED          0x2u    // ExitTime is set
+#define SECUREHOST_PROCESS_FLAG_SIGNING_LEVEL   0x4u    // SigningLevel is known
+#define SECUREHOST_PROCESS_FLAG_TRUNCATED       0x8u    // Strings did not fit the output
+
+typedef struct _SECUREHOST_PROCESS_QUERY {
+    UINT32 ProcessId;
+    UINT32 Reserved;
+    UINT64 CreateTime;  // FILETIME; 0 = the live process
+} SECUREHOST_PROCESS_QUERY, *PSECUREHOST_PROCESS_QUERY;
+
+C_ASSERT(sizeof(SECUREHOST_PROCESS_QUERY) == 16);
+
+typedef struct _SECUREHOST_PROCESS_RECORD {
+    UINT64 CreateTime;
+    UINT64 ExitTime;            // FILETIME; 0 = running
+    UINT32 ProcessId;
+    UINT32 ParentProcessId;
+    UINT32 Flags;               // SECUREHOST_PROCESS_FLAG_*
+    UINT8 SigningLevel;         // SE_SIGNING_LEVEL of the image
+    UINT8 Reserved0;
+    UINT16 ImagePathLength;     // In bytes
+    UINT32 ImagePathOffset;
+    UINT16 UserSidLength;       // In bytes
+    UINT16 Reserved1;
+    UINT32 UserSidOffset;
+    UINT32 Reserved2;
+} SECUREHOST_PROCESS_RECORD, *PSECUREHOST_PROCESS_RECORD;
+
+C_ASSERT(sizeof(SECUREHOST_PROCESS_RECORD) == 48);
+
+//
+// Latency tracing (both drivers). Each traced verdict gets a correlation
+// ID that follows it through the event channel, the decision channel and
+// the service, so the stages of one verdict can be joined. The ID names
+// the driver, the processor that issued it and a per-processor sequence,
+// so it is unique per driver load without a shared counter. Trace times
+// are performance counter ticks (KeQueryPerformanceCounter), the clock
+// QueryPerformanceCounter reads in user mode.
+//
+#define SECUREHOST_TRACE_SOURCE_WFP             1u
+#define SECUREHOST_TRACE_SOURCE_DEVICE          2u
+
+#define SECUREHOST_CORRELATION_ID(Source, Processor, Sequence) \
+    (((UINT64)(Source) << 60) | (((UINT64)(Processor) & 0xFFFu) << 48) | \
+     ((UINT64)(Sequence) & 0x0000FFFFFFFFFFFFull))
@@ -4,6 +4,9 @@ using Microsoft.AspNetCore.Http;
 using Microsoft.AspNetCore.Mvc;
 using Microsoft.Extensions.DependencyInjection;
 using Microsoft.Extensions.Logging;
+using System.Buffers;
+using System.Globalization;
+using System.Net.WebSockets;
 using System.Text.Json;
 using SecureHostCore.Engine;
 using SecureHostCore.Models;
@@ -17,11 +20,23 @@ namespace SecureHostService.Api;
 /// </summary>
 public sealed class ApiServer
 {
+    /// <summary>
+    /// Origins whose pages may open the connection stream: only the API's
+    /// own. Requests without an Origin header are native clients.
+    /// </summary>
+    private static readonly string[] AllowedWebSocketOrigins =
+    {
+        "http://localhost:5555",
+        "http://127.0.0.1:5555"
+    };
+
     private readonly ILogger<ApiServer> _logger;
     private readonly PolicyEngine _policyEngine;
     private readonly AuditEngine _auditEngine;
     private readonly PolicyManagementService _policyManagement;
     private readonly NetworkControlService _networkControl;
+    private readonly DriverCommunicationService _driverComm;
+    private readonly ConnectionTracker _connectionTracker;
     private DeviceControlService? _deviceControl;
     private IWebHost? _webHost;
 
@@ -32,13 +47,17 @@ public sealed class ApiServer
         PolicyEngine policyEngine,
         AuditEngine auditEngine,
         PolicyManagementService policyManagement,
-        NetworkControlService networkControl)
+        NetworkControlService networkControl,
+        DriverCommunicationService driverComm,
+        ConnectionTracker connectionTracker)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _policyEngine = policyEngine ?? throw new ArgumentNullException(nameof(policyEngine));
         _auditEngine = auditEngine ?? throw new ArgumentNullException(nameof(auditEngine));
         _policyManagement = policyManagement ?? throw new ArgumentNullException(nameof(policyManagement));
         _networkControl = networkControl ?? throw new ArgumentNullException(nameof(networkControl));
+        _driverComm = driverComm ?? throw new ArgumentNullException(nameof(driverComm));
+        _connectionTracker = connectionTracker ?? throw new ArgumentNullException(nameof(connectionTracker));
     }
 
     /// <summary>
@@ -65,9 +84,17 @@ public sealed class ApiServer
                 services.AddSingleton(_auditEngine);
                 services.AddSingleton(_policyManagement);
                 services.AddSingleton(_networkControl);
+                services.AddSingleton(_driverComm);
+                services.AddSingleton(_connectionTracker);
             })
             .Configure(app =>
             {
+                var webSocketOptions = new WebSocketOptions();
+                foreach (var origin in AllowedWebSocketOrigins)
+                    webSocketOptions.AllowedOrigins.Add(origin);
+
+                app.Use(next => new WebSocketOriginMiddleware(next, _logger, AllowedWebSocketOrigins).InvokeAsync);
+                app.UseWebSockets(webSocketOptions);
                 app.UseRouting();
                 app.UseEndpoints(endpoints =>
                 {
@@ -237,6 +264,32 @@ public sealed class ApiServer
             await context.Response.WriteAsJsonAsync(connections);
         });
 
+        // Stream connections over a WebSocket: a snapshot, then changes as
+        // they happen. Binary messages, see ConnectionStreamCodec.
+        endpoints.MapGet("/api/network/connections/stream", async (
+            HttpContext context, ConnectionTracker tracker, LatencyTracer latencyTracer) =>
+        {
+            if (!context.WebSockets.IsWebSocketRequest)
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "WebSocket request expected" });
+                return;
+            }
+
+            var query = context.Request.Query;
+            if (!ConnectionStreamFilter.TryParse(query["pid"], query["port"], query["verdict"], out var filter))
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid filter" });
+                return;
+            }
+
+            using var socket = await context.WebSockets.AcceptWebSocketAsync();
+            using var subscription = tracker.Subscribe(filter);
+
+            await StreamConnectionsAsync(socket, subscription, latencyTracer, context.RequestAborted);
+        });
+
         // Get active listeners
         endpoints.MapGet("/api/network/listeners", async (HttpContext context, NetworkControlService networkCtrl) =>
         {
@@ -244,28 +297,141 @@ public sealed class ApiServer
             await context.Response.WriteAsJsonAsync(listeners);
         });
 
-        // Export audit events
+        // Driver counters (null for a driver that is not loaded)
+        endpoints.MapGet("/api/drivers/statistics", async (HttpContext context, DriverCommunicationService driverComm) =>
+        {
+            var statistics = new
+            {
+                network = await driverComm.GetNetworkStatisticsAsync(context.RequestAborted),
+                device = await driverComm.GetDeviceStatisticsAsync(context.RequestAborted)
+            };
+
+            await context.Response.WriteAsJsonAsync(statistics);
+        });
+
+        // Audit pipeline counters (queue depth, drops, latency)
+        endpoints.MapGet("/api/audit/statistics", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            await context.Response.WriteAsJsonAsync(auditEngine.GetStatistics());
+        });
+
+        // Verdict latency percentiles per stage, driver to API
+        endpoints.MapGet("/api/latency/statistics", async (HttpContext context, LatencyTracer latencyTracer) =>
+        {
+            await context.Response.WriteAsJsonAsync(latencyTracer.GetStatistics());
+        });
+
+        // Export audit events, streamed as they are formatted (?format=cef|json)
         endpoints.MapGet("/api/audit/export", async (HttpContext context, AuditEngine auditEngine) =>
         {
-            var startTimeStr = context.Request.Query["startTime"].ToString();
-            var endTimeStr = context.Request.Query["endTime"].ToString();
+            var startTime = ParseQueryTime(context, "startTime") ?? DateTime.UtcNow.AddDays(-7);
+            var endTime = ParseQueryTime(context, "endTime") ?? DateTime.UtcNow;
+
+            var format = SiemExportFormat.Cef;
+            var formatStr = context.Request.Query["format"].ToString();
+            if (formatStr.Length > 0 && !Enum.TryParse(formatStr, ignoreCase: true, out format))
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid export format" });
+                return;
+            }
 
-            if (!DateTime.TryParse(startTimeStr, out var startTime))
-                startTime = DateTime.UtcNow.AddDays(-7);
+            var json = format == SiemExportFormat.Json;
+            context.Response.ContentType = json ? "application/x-ndjson" : "text/plain";
+            context.Response.Headers.Add("Content-Disposition",
+                json ? "attachment; filename=audit-export.jsonl" : "attachment; filename=audit-export.cef");
 
-            if (!DateTime.TryParse(endTimeStr, out var endTime))
-                endTime = DateTime.UtcNow;
+            await auditEngine.ExportToSiemAsync(
+                startTime, endTime, context.Response.Body, format, cancellationToken: context.RequestAborted);
+        });
+
+        // Background exports to a file or syslog collector, with progress
+        endpoints.MapGet("/api/audit/exports", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            await context.Response.WriteAsJsonAsync(auditEngine.GetSiemExports());
+        });
+
+        endpoints.MapPost("/api/audit/exports", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            var request = await context.Request.ReadFromJsonAsync<SiemExportRequest>();
+            if (request == null)
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid export request" });
+                return;
+            }
 
-            var tempFile = Path.GetTempFileName();
-            var count = await auditEngine.ExportToSiemAsync(startTime, endTime, tempFile);
+            try
+            {
+                var progress = auditEngine.StartSiemExport(request);
+                context.Response.StatusCode = 202;
+                await context.Response.WriteAsJsonAsync(progress);
+            }
+            catch (ArgumentException ex)
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = ex.Message });
+            }
+        });
 
-            context.Response.ContentType = "text/plain";
-            context.Response.Headers.Add("Content-Disposition", "attachment; filename=audit-export.cef");
+        endpoints.MapGet("/api/audit/exports/{id}", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            if (!Guid.TryParse(context.Request.RouteValues["id"]?.ToString(), out var exportId))
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid export ID" });
+                return;
+            }
 
-            await using var fileStream = File.OpenRead(tempFile);
-            await fileStream.CopyToAsync(context.Response.Body);
+            var progress = auditEngine.GetSiemExport(exportId);
+            if (progress == null)
+            {
+                context.Response.StatusCode = 404;
+                await context.Response.WriteAsJsonAsync(new { error = "Export not found" });
+                return;
+            }
 
-            File.Delete(tempFile);
+            await context.Response.WriteAsJsonAsync(progress);
+        });
+
+        endpoints.MapPost("/api/audit/exports/{id}/resume", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            if (!Guid.TryParse(context.Request.RouteValues["id"]?.ToString(), out var exportId))
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid export ID" });
+                return;
+            }
+
+            var progress = auditEngine.ResumeSiemExport(exportId);
+            if (progress == null)
+            {
+                context.Response.StatusCode = 404;
+                await context.Response.WriteAsJsonAsync(new { error = "No checkpoint for this export" });
+                return;
+            }
+
+            context.Response.StatusCode = 202;
+            await context.Response.WriteAsJsonAsync(progress);
+        });
+
+        endpoints.MapDelete("/api/audit/exports/{id}", async (HttpContext context, AuditEngine auditEngine) =>
+        {
+            if (!Guid.TryParse(context.Request.RouteValues["id"]?.ToString(), out var exportId))
+            {
+                context.Response.StatusCode = 400;
+                await context.Response.WriteAsJsonAsync(new { error = "Invalid export ID" });
+                return;
+            }
+
+            if (!auditEngine.CancelSiemExport(exportId))
+            {
+                context.Response.StatusCode = 404;
+                await context.Response.WriteAsJsonAsync(new { error = "No running export with this ID" });
+                return;
+            }
+
+            await context.Response.WriteAsJsonAsync(new { message = "Export cancelled; resume continues from its checkpoint" });
         });
 
         // System status
@@ -314,4 +480,155 @@ public sealed class ApiServer
             }
         });
     }
+
+    /// <summary>
+    /// Sends a subscription's snapshot and then its changes until the
+    /// client goes away. Changes that are queued together go out in one
+    /// message per run of the same type. A subscription that lost changes
+    /// ends with Resync. Traced verdicts are timed once their message is
+    /// sent (<see cref="LatencyStage.ApiStream"/>).
+    /// </summary>
+    private async Task StreamConnectionsAsync(
+        WebSocket socket,
+        ConnectionStreamSubscription subscription,
+        LatencyTracer latencyTracer,
+        CancellationToken cancellationToken)
+    {
+        const int maxRecords = ConnectionStreamCodec.MaxRecordsPerMessage;
+
+        using var closed = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+        var receiveTask = DrainUntilCloseAsync(socket, closed);
+        var token = closed.Token;
+
+        var buffer = ArrayPool<byte>.Shared.Rent(ConnectionStreamCodec.GetMessageSize(maxRecords));
+        var batch = ArrayPool<ConnectionStreamRecord>.Shared.Rent(maxRecords);
+        var traces = ArrayPool<VerdictTrace>.Shared.Rent(maxRecords);
+
+        try
+        {
+            var snapshot = subscription.Snapshot;
+            for (var offset = 0; offset < snapshot.Count; offset += maxRecords)
+            {
+                var count = Math.Min(maxRecords, snapshot.Count - offset);
+                for (var i = 0; i < count; i++)
+                    batch[i] = snapshot[offset + i];
+
+                await SendConnectionMessageAsync(
+                    socket, buffer, ConnectionStreamMessageType.Snapshot, subscription.SnapshotSequence, batch, count, null, token);
+            }
+
+            await SendConnectionMessageAsync(
+                socket, buffer, ConnectionStreamMessageType.SnapshotEnd, subscription.SnapshotSequence,
+                batch, 0, (uint)snapshot.Count, token);
+
+            var reader = subscription.Changes;
+            while (await reader.WaitToReadAsync(token))
+            {
+                var count = 0;
+                var type = ConnectionStreamMessageType.Upsert;
+                ulong sequence = 0;
+
+                while (reader.TryRead(out var change))
+                {
+                    if (count == maxRecords || (count > 0 && change.Type != type))
+                    {
+                        await SendConnectionMessageAsync(socket, buffer, type, sequence, batch, count, null, token);
+                        RecordStreamLatency(latencyTracer, traces, count);
+                        count = 0;
+                    }
+
+                    type = change.Type;
+                    sequence = change.Sequence;
+                    traces[count] = change.Trace;
+                    batch[count++] = change.Record;
+                }
+
+                if (count > 0)
+                {
+                    await SendConnectionMessageAsync(socket, buffer, type, sequence, batch, count, null, token);
+                    RecordStreamLatency(latencyTracer, traces, count);
+                }
+            }
+
+            if (subscription.Lost)
+            {
+                _logger.LogWarning("Connection stream client fell behind; asking it to resync");
+
+                await SendConnectionMessageAsync(
+                    socket, buffer, ConnectionStreamMessageType.Resync, 0, batch, 0, null, token);
+                await socket.CloseOutputAsync(WebSocketCloseStatus.NormalClosure, "resync", token);
+            }
+        }
+        catch (Exception ex) when (ex is OperationCanceledException or WebSocketException)
+        {
+            _logger.LogDebug("Connection stream closed: {Message}", ex.Message);
+        }
+        finally
+        {
+            closed.Cancel();
+            ArrayPool<byte>.Shared.Return(buffer);
+            ArrayPool<ConnectionStreamRecord>.Shared.Return(batch);
+            ArrayPool<VerdictTrace>.Shared.Return(traces);
+        }
+
+        await receiveTask;
+    }
+
+    private static void RecordStreamLatency(LatencyTracer latencyTracer, VerdictTrace[] traces, int count)
+    {
+        for (var i = 0; i < count; i++)
+        {
+            if (traces[i].IsTraced)
+                latencyTracer.RecordSince(LatencyStage.ApiStream, traces[i].CorrelationId, traces[i].Timestamp);
+        }
+    }
+
+    private static Task SendConnectionMessageAsync(
+        WebSocket socket,
+        byte[] buffer,
+        ConnectionStreamMessageType type,
+        ulong sequence,
+        ConnectionStreamRecord[] records,
+        int count,
+        uint? headerCount,
+        CancellationToken cancellationToken)
+    {
+        var length = ConnectionStreamCodec.Write(buffer, type, sequence, records.AsSpan(0, count), headerCount);
+        return socket.SendAsync(
+            new ArraySegment<byte>(buffer, 0, length), WebSocketMessageType.Binary, true, cancellationToken);
+    }
+
+    /// <summary>
+    /// The stream is one-way; reads only to notice the client closing
+    /// </summary>
+    private static async Task DrainUntilCloseAsync(WebSocket socket, CancellationTokenSource closed)
+    {
+        var buffer = new byte[256];
+
+        try
+        {
+            while (!closed.IsCancellationRequested)
+            {
+                var result = await socket.ReceiveAsync(new ArraySegment<byte>(buffer), closed.Token);
+                if (result.MessageType == WebSocketMessageType.Close)
+                    break;
+            }
+        }
+        catch (Exception ex) when (ex is OperationCanceledException or WebSocketException)
+        {
+        }
+
+        closed.Cancel();
+    }
+
+    /// <summary>
+    /// Parses a query time as UTC; times without a zone are taken as UTC
+    /// </summary>
+    private static DateTime? ParseQueryTime(HttpContext context, string name)
+    {
+        return DateTime.TryParse(context.Request.Query[name].ToString(), CultureInfo.InvariantCulture,
+            DateTimeStyles.AdjustToUniversal | DateTimeStyles.AssumeUniversal, out var time)
+            ? time
+            : null;
+    }
 }
@@ -0,0 +1,59 @@
+using Microsoft.AspNetCore.Http;
+using Microsoft.Extensions.Logging;
+using Microsoft.Net.Http.Headers;
+
+namespace SecureHostService.Api;
+
+/// <summary>
+/// Refuses WebSocket upgrades from web pages on other origins. Browsers let
+/// any page open a WebSocket to localhost and read what it is sent, so a
+/// request carrying an Origin header must name an allowed origin. Native
+/// clients (the GUI and CLI) send no Origin and are let through.
+/// </summary>
+public sealed class WebSocketOriginMiddleware
+{
+    private readonly RequestDelegate _next;
+    private readonly ILogger _logger;
+    private readonly HashSet<string> _allowedOrigins;
+
+    public WebSocketOriginMiddleware(RequestDelegate next, ILogger logger, IEnumerable<string> allowedOrigins)
+    {
+        _next = next ?? throw new ArgumentNullException(nameof(next));
+        _logger = logger ?? throw new ArgumentNullException(nameof(logger));
+        ArgumentNullException.ThrowIfNull(allowedOrigins);
+        _allowedOrigins = new HashSet<string>(allowedOrigins, StringComparer.OrdinalIgnoreCase);
+    }
+
+    public Task InvokeAsync(HttpContext context)
+    {
+        if (IsWebSocketUpgrade(context.Request) && !IsAllowedOrigin(context.Request))
+        {
+            _logger.LogWarning("Refused WebSocket upgrade to {Path} from origin {Origin}",
+                context.Request.Path, context.Request.Headers[HeaderNames.Origin].ToString());
+
+            context.Response.StatusCode = StatusCodes.Status403Forbidden;
+            return Task.CompletedTask;
+        }
+
+        return _next(context);
+    }
+
+    private static bool IsWebSocketUpgrade(HttpRequest request)
+    {
+        return string.Equals(request.Headers[HeaderNames.Upgrade], "websocket", StringComparison.OrdinalIgnoreCase);
+    }
+
+    private bool IsAllowedOrigin(HttpRequest request)
+    {
+        var origins = request.Headers[HeaderNames.Origin];
+        if (origins.Count == 0)
+            return true;
+
+        foreach (var origin in origins)
+        {
+            if (origin == null || !_allowedOrigins.Contains(origin))
+                return false;
+        }
+        return true;
+    }
+}
@@ -1,3 +1,4 @@
+using Microsoft.Extensions.Configuration;
 using Microsoft.Extensions.DependencyInjection;
 using Microsoft.Extensions.Hosting;
 using Microsoft.Extensions.Logging;
@@ -58,6 +59,23 @@ public class Program
 
                 // Register core services
                 services.AddSingleton<PolicyEngine>();
+                services.AddSingleton(_ => new LatencyTracer(
+                    hostContext.Configuration
+                        .GetSection("SecureHost:LatencyTracing")
+                        .Get<LatencyTracingOptions>()));
+                services.AddSingleton<DriverProcessMetadataSource>();
+                services.AddSingleton(provider =>
+                {
+                    // One cache for the decision path and the audit
+                    // pipeline, resolving through the drivers
+                    var pipelineOptions = hostContext.Configuration
+                        .GetSection("SecureHost:AuditPipeline")
+                        .Get<AuditPipelineOptions>() ?? new AuditPipelineOptions();
+                    return new ProcessMetadataCache(
+                        pipelineOptions.ProcessCacheSize,
+                        pipelineOptions.ProcessCacheLifetime,
+                        provider.GetRequiredService<DriverProcessMetadataSource>());
+                });
                 services.AddSingleton(provider =>
                 {
                     var logger = provider.GetRequiredService<ILogger<AuditEngine>>();
@@ -65,9 +83,19 @@ public class Program
                         Environment.GetFolderPath(Environment.SpecialFolder.CommonApplicationData),
                         "SecureHost",
                         "Audit",
-                        "audit.jsonl");
-                    return new AuditEngine(logger, auditPath);
+                        "audit.shlog");
+                    var pipelineOptions = hostContext.Configuration
+                        .GetSection("SecureHost:AuditPipeline")
+                        .Get<AuditPipelineOptions>();
+                    return new AuditEngine(
+                        logger, auditPath, pipelineOptions,
+                        provider.GetRequiredService<ProcessMetadataCache>(),
+                        provider.GetRequiredService<LatencyTracer>());
                 });
+                services.AddSingleton(_ => new AnomalyDetector(
+                    hostContext.Configuration
+                        .GetSection("SecureHost:AnomalyDetection")
+                        .Get<AnomalyDetectorOptions>()));
                 services.AddSingleton(provider =>
                 {
                     var logger = provider.GetRequiredService<ILogger<SecureStorage>>();
@@ -76,13 +104,17 @@ public class Program
                         "SecureHost",
                         "Config",
                         "*.dat");
-                    return new SecureStorage(logger, storagePath);
+                    var storageOptions = hostContext.Configuration
+                        .GetSection("SecureHost:SecureStorage")
+                        .Get<SecureStorageOptions>();
+                    return new SecureStorage(logger, storagePath, storageOptions);
                 });
 
                 // Register application services
                 services.AddSingleton<DriverCommunicationService>();
                 services.AddSingleton<PolicyManagementService>();
                 services.AddSingleton<DeviceControlService>();
+                services.AddSingleton<ConnectionTracker>();
                 services.AddSingleton<NetworkControlService>();
 
                 // Register API services
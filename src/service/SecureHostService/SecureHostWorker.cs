@@ -20,8 +20,13 @@ public sealed class SecureHostWorker : BackgroundService
     private readonly DeviceControlService _deviceControl;
     private readonly NetworkControlService _networkControl;
     private readonly ApiServer _apiServer;
+    private readonly AnomalyDetector _anomalyDetector;
     private readonly IHostApplicationLifetime _lifetime;
 
+    // The anomaly detector is evaluated every tick; health is checked less often
+    private static readonly TimeSpan AnalysisInterval = TimeSpan.FromSeconds(5);
+    private static readonly TimeSpan HealthCheckInterval = TimeSpan.FromSeconds(30);
+
     public SecureHostWorker(
         ILogger<SecureHostWorker> logger,
         PolicyEngine policyEngine,
@@ -31,6 +36,7 @@ public sealed class SecureHostWorker : BackgroundService
         DeviceControlService deviceControl,
         NetworkControlService networkControl,
         ApiServer apiServer,
+        AnomalyDetector anomalyDetector,
         IHostApplicationLifetime lifetime)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
@@ -41,6 +47,7 @@ public sealed class SecureHostWorker : BackgroundService
         _deviceControl = deviceControl ?? throw new ArgumentNullException(nameof(deviceControl));
         _networkControl = networkControl ?? throw new ArgumentNullException(nameof(networkControl));
         _apiServer = apiServer ?? throw new ArgumentNullException(nameof(apiServer));
+        _anomalyDetector = anomalyDetector ?? throw new ArgumentNullException(nameof(anomalyDetector));
         _lifetime = lifetime ?? throw new ArgumentNullException(nameof(lifetime));
     }
 
@@ -98,15 +105,21 @@ public sealed class SecureHostWorker : BackgroundService
             _logger.LogInformation("SecureHost Worker Service is running");
 
             // Main service loop
+            var nextHealthCheck = DateTime.UtcNow;
             while (!stoppingToken.IsCancellationRequested)
             {
                 try
                 {
+                    await AnalyzeAsync(stoppingToken);
+
                     // Health check and monitoring
-                    await PerformHealthCheckAsync(stoppingToken);
+                    if (DateTime.UtcNow >= nextHealthCheck)
+                    {
+                        await PerformHealthCheckAsync(stoppingToken);
+                        nextHealthCheck = DateTime.UtcNow + HealthCheckInterval;
+                    }
 
-                    // Wait 30 seconds before next check
-                    await Task.Delay(TimeSpan.FromSeconds(30), stoppingToken);
+                    await Task.Delay(AnalysisInterval, stoppingToken);
                 }
                 catch (OperationCanceledException)
                 {
@@ -205,6 +218,31 @@ public sealed class SecureHostWorker : BackgroundService
         }
     }
 
+    /// <summary>
+    /// Feeds the WFP driver's counters to the anomaly detector and audits
+    /// what it flagged since the last tick. The detector sees connection
+    /// and device events as the readers receive them.
+    /// </summary>
+    private async Task AnalyzeAsync(CancellationToken cancellationToken)
+    {
+        try
+        {
+            var statistics = await _driverComm.GetNetworkStatisticsAsync(cancellationToken);
+            if (statistics != null)
+                _anomalyDetector.RecordDriverCounters(statistics.Classifications, statistics.Blocks);
+
+            foreach (var alert in _anomalyDetector.Evaluate(DateTime.UtcNow))
+            {
+                _logger.LogWarning("Anomaly detected: {Kind}: {Message}", alert.Kind, alert.Message);
+                await _auditEngine.LogAnomalyAsync(alert);
+            }
+        }
+        catch (Exception ex) when (ex is not OperationCanceledException)
+        {
+            _logger.LogError(ex, "Error during anomaly analysis");
+        }
+    }
+
     /// <summary>
     /// Detects tampering attempts
     /// </summary>
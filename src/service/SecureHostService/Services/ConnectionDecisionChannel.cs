@@ -0,0 +1,245 @@
+using Microsoft.Extensions.Logging;
+using Microsoft.Win32.SafeHandles;
+using SecureHostCore.Models;
+using System.Net;
+using System.Runtime.InteropServices;
+
+namespace SecureHostService.Services;
+
+/// <summary>
+/// Connection the WFP driver is holding for a service decision
+/// (SECUREHOST_DECISION_REQUEST); addresses are in network byte order.
+/// The event reported once the verdict applies carries the same
+/// CorrelationId; PendTime is the performance counter at the pend.
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 88)]
+public unsafe struct ConnectionDecisionRequest
+{
+    public ulong RequestId;
+    public ulong RuleId;
+    public uint ProcessId;
+    public byte IpVersion;
+    public byte Protocol;
+    public byte Direction;
+    public byte Reserved0;
+    public ushort LocalPort;
+    public ushort RemotePort;
+    public uint Reserved1;
+    public fixed byte LocalAddress[16];
+    public fixed byte RemoteAddress[16];
+    public ulong ProcessCreateTime;         // 0 if the driver had not seen the process
+    public ulong CorrelationId;
+    public ulong PendTime;
+
+    public readonly ProcessKey ProcessKey => new(ProcessId, ProcessCreateTime);
+
+    public IPAddress GetLocalAddress()
+    {
+        fixed (byte* address = LocalAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    public IPAddress GetRemoteAddress()
+    {
+        fixed (byte* address = RemoteAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    private static IPAddress ToAddress(byte* address, byte ipVersion)
+    {
+        return new IPAddress(new ReadOnlySpan<byte>(address, ipVersion == 4 ? 4 : 16));
+    }
+}
+
+/// <summary>
+/// Decides one held connection. Runs on the channel's reader thread, in
+/// batches of up to 64, and the driver applies the rule's fallback a second
+/// after pending. A handler may wait only briefly (a few milliseconds), so
+/// that a full batch is answered in time.
+/// </summary>
+public delegate PolicyAction ConnectionDecisionHandler(in ConnectionDecisionRequest request);
+
+/// <summary>
+/// Answers the WFP driver's deferred connection decisions
+/// A dedicated thread keeps one fetch outstanding, which the driver
+/// completes with every connection queued since the last batch; the
+/// answers go back in a single complete call on the same handle
+/// </summary>
+public sealed unsafe class ConnectionDecisionChannel : IDisposable
+{
+    private const uint IOCTL_FETCH_DECISIONS = 0x226020;    // METHOD_BUFFERED, FILE_READ_ACCESS
+    private const uint IOCTL_COMPLETE_DECISIONS = 0x22A024; // METHOD_BUFFERED, FILE_WRITE_ACCESS
+
+    private const int ERROR_OPERATION_ABORTED = 995;
+
+    // Requests per fetch; larger backlogs take several round trips
+    private const int BATCH_SIZE = 64;
+
+    private readonly ILogger _logger;
+    private readonly SafeFileHandle _handle;
+    private long _decisions;
+    private bool _disposed;
+
+    internal ConnectionDecisionChannel(ILogger logger, SafeFileHandle handle)
+    {
+        _logger = logger ?? throw new ArgumentNullException(nameof(logger));
+        _handle = handle ?? throw new ArgumentNullException(nameof(handle));
+    }
+
+    /// <summary>
+    /// Connections decided since the channel was opened
+    /// </summary>
+    public long Decisions => Interlocked.Read(ref _decisions);
+
+    /// <summary>
+    /// Answers decisions on a dedicated thread until cancelled
+    /// </summary>
+    public Task RunAsync(ConnectionDecisionHandler handler, CancellationToken cancellationToken)
+    {
+        ArgumentNullException.ThrowIfNull(handler);
+
+        return Task.Factory.StartNew(
+            () => DecisionLoop(handler, cancellationToken),
+            cancellationToken,
+            TaskCreationOptions.LongRunning,
+            TaskScheduler.Default);
+    }
+
+    /// <summary>
+    /// Aborts a fetch the reader thread is blocked in. Cancellation can land
+    /// just before the thread issues its next fetch, so callers stopping the
+    /// reader repeat this until the task completes.
+    /// </summary>
+    public void CancelPendingFetch()
+    {
+        if (!_handle.IsClosed)
+            CancelIoEx(_handle, IntPtr.Zero);
+    }
+
+    private void DecisionLoop(ConnectionDecisionHandler handler, CancellationToken cancellationToken)
+    {
+        var requests = new ConnectionDecisionRequest[BATCH_SIZE];
+        var responses = new DecisionResponse[BATCH_SIZE];
+
+        using var registration = cancellationToken.Register(CancelPendingFetch);
+
+        while (!cancellationToken.IsCancellationRequested)
+        {
+            uint bytesReturned;
+            bool result;
+
+            fixed (ConnectionDecisionRequest* output = requests)
+            {
+                result = DeviceIoControl(
+                    _handle,
+                    IOCTL_FETCH_DECISIONS,
+                    null,
+                    0,
+                    output,
+                    (uint)(BATCH_SIZE * sizeof(ConnectionDecisionRequest)),
+                    out bytesReturned,
+                    IntPtr.Zero);
+            }
+
+            if (!result)
+            {
+                var error = Marshal.GetLastWin32Error();
+                if (error == ERROR_OPERATION_ABORTED)
+                    continue;
+
+                // Another handle owns the channel, or the driver is stopping;
+                // held connections fall back to their rule's action
+                _logger.LogError("Stopped answering driver connection decisions: Error {Error}", error);
+                return;
+            }
+
+            var count = (int)(bytesReturned / (uint)sizeof(ConnectionDecisionRequest));
+            for (var i = 0; i < count; i++)
+            {
+                PolicyAction action;
+                try
+                {
+                    action = handler(in requests[i]);
+                }
+                catch (Exception ex)
+                {
+                    _logger.LogError(ex, "Error deciding held connection");
+                    action = PolicyAction.Allow;
+                }
+
+                responses[i] = new DecisionResponse
+                {
+                    RequestId = requests[i].RequestId,
+                    Verdict = (uint)action
+                };
+            }
+
+            if (count == 0)
+                continue;
+
+            fixed (DecisionResponse* input = responses)
+            {
+                result = DeviceIoControl(
+                    _handle,
+                    IOCTL_COMPLETE_DECISIONS,
+                    input,
+                    (uint)(count * sizeof(DecisionResponse)),
+                    null,
+                    0,
+                    out _,
+                    IntPtr.Zero);
+            }
+
+            if (!result)
+            {
+                // Those connections time out to their fallback; keep serving
+                _logger.LogWarning("Failed to complete {Count} connection decisions: Error {Error}",
+                    count, Marshal.GetLastWin32Error());
+                continue;
+            }
+
+            Interlocked.Add(ref _decisions, count);
+        }
+    }
+
+    /// <summary>
+    /// Closes the channel's handle, releasing any connection still held
+    /// for this service. The reader must be stopped first.
+    /// </summary>
+    public void Dispose()
+    {
+        if (_disposed)
+            return;
+
+        _handle.Dispose();
+        _disposed = true;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct DecisionResponse
+    {
+        public ulong RequestId;
+        public uint Verdict;
+        public uint Reserved;
+    }
+
+    [DllImport("kernel32.dll", SetLastError = true)]
+    [return: MarshalAs(UnmanagedType.Bool)]
+    private static extern bool DeviceIoControl(
+        SafeFileHandle hDevice,
+        uint dwIoControlCode,
+        void* lpInBuffer,
+        uint nInBufferSize,
+        void* lpOutBuffer,
+        uint nOutBufferSize,
+        out uint lpBytesReturned,
+        IntPtr lpOverlapped);
+
+    [DllImport("kernel32.dll", SetLastError = true)]
+    [return: MarshalAs(UnmanagedType.Bool)]
+    private static extern bool CancelIoEx(SafeFileHandle hFile, IntPtr lpOverlapped);
+}
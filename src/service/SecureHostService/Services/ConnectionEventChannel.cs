@@ -0,0 +1,252 @@
+using Microsoft.Extensions.Logging;
+using SecureHostCore.Models;
+using System.Net;
+using System.Runtime.InteropServices;
+
+namespace SecureHostService.Services;
+
+/// <summary>
+/// Connection event written by the WFP driver (SECUREHOST_CONNECTION_EVENT)
+/// Addresses are in network byte order. A record with Count above one
+/// summarizes repeats of one connection key between Timestamp and
+/// LastTimestamp. ProcessId and ProcessCreateTime together are the
+/// process's key in the drivers' process caches; the creation time is 0
+/// if the driver had not seen the process. Weight is the number of
+/// connections the record stands for: Count, unless the rule's audit mode
+/// (AuditMode, a <see cref="PermitAuditMode"/>) sampled its permits.
+/// Weights add up per rule: a rate limited record also stands for the
+/// rule's skipped connections to other addresses. CorrelationId,
+/// ClassifyTime (performance counter) and VerdictTicks trace the verdict,
+/// of the first repeat for a summary record; a service verdict
+/// (<see cref="TraceFlagServiceVerdict"/>) is timed from the pend and
+/// keeps the decision request's correlation ID.
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 112)]
+public unsafe struct ConnectionEventRecord
+{
+    public ulong Timestamp;
+    public ulong RuleId;
+    public uint ProcessId;
+    public byte IpVersion;
+    public byte Protocol;
+    public byte Direction;
+    public byte Verdict;
+    public ushort LocalPort;
+    public ushort RemotePort;
+    public uint Count;
+    public fixed byte LocalAddress[16];
+    public fixed byte RemoteAddress[16];
+    public ulong LastTimestamp;
+    public ulong ProcessCreateTime;
+    public uint Weight;
+    public byte AuditMode;
+    public fixed byte Reserved[3];
+    public ulong CorrelationId;
+    public ulong ClassifyTime;
+    public uint VerdictTicks;
+    public byte TraceFlags;
+    public fixed byte Reserved2[3];
+
+    public const byte TraceFlagServiceVerdict = 0x1;    // SECUREHOST_TRACE_FLAG_SERVICE_VERDICT
+
+    public readonly bool ServiceVerdict => (TraceFlags & TraceFlagServiceVerdict) != 0;
+    public readonly ProcessKey ProcessKey => new(ProcessId, ProcessCreateTime);
+    public readonly DateTime TimestampUtc => DateTime.FromFileTimeUtc((long)Timestamp);
+    public readonly DateTime LastTimestampUtc => DateTime.FromFileTimeUtc((long)LastTimestamp);
+
+    public IPAddress GetLocalAddress()
+    {
+        fixed (byte* address = LocalAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    public IPAddress GetRemoteAddress()
+    {
+        fixed (byte* address = RemoteAddress)
+        {
+            return ToAddress(address, IpVersion);
+        }
+    }
+
+    private static IPAddress ToAddress(byte* address, byte ipVersion)
+    {
+        return new IPAddress(new ReadOnlySpan<byte>(address, ipVersion == 4 ? 4 : 16));
+    }
+}
+
+/// <summary>
+/// Handles one connection event. The record refers to shared memory and is
+/// only valid for the duration of the call.
+/// </summary>
+public delegate void ConnectionEventHandler(in ConnectionEventRecord record);
+
+/// <summary>
+/// Reads connection events from the WFP driver's shared-memory channel
+/// The driver fills one ring per processor without blocking; this reader
+/// drains all rings and sleeps on a wake event the driver signals once a
+/// ring's backlog reaches the watermark
+/// </summary>
+public sealed unsafe class ConnectionEventChannel : IDisposable
+{
+    // Layout mirrors SECUREHOST_EVENT_CHANNEL_HEADER / SECUREHOST_EVENT_RING
+    private const uint CHANNEL_VERSION = 4;
+    private const int RING_READ_INDEX_OFFSET = 64;
+    private const int RING_RECORDS_OFFSET = 128;
+
+    // Upper bound on latency for traffic too light to reach the watermark
+    private static readonly TimeSpan IdleWait = TimeSpan.FromMilliseconds(250);
+
+    private readonly ILogger _logger;
+    private readonly EventWaitHandle _wakeEvent;
+    private readonly ChannelHeader* _header;
+    private readonly byte* _rings;
+    private readonly uint _ringCount;
+    private readonly uint _ringSize;
+    private readonly long _ringMask;
+    private bool _disposed;
+
+    internal ConnectionEventChannel(
+        ILogger logger,
+        EventWaitHandle wakeEvent,
+        IntPtr baseAddress,
+        ulong size)
+    {
+        _logger = logger ?? throw new ArgumentNullException(nameof(logger));
+        _wakeEvent = wakeEvent ?? throw new ArgumentNullException(nameof(wakeEvent));
+        _header = (ChannelHeader*)baseAddress;
+
+        if (size < (ulong)sizeof(ChannelHeader) ||
+            _header->Version != CHANNEL_VERSION ||
+            _header->RecordSize != (uint)sizeof(ConnectionEventRecord) ||
+            _header->RingCapacity == 0 ||
+            (_header->RingCapacity & (_header->RingCapacity - 1)) != 0 ||
+            _header->RingSize < RING_RECORDS_OFFSET + (ulong)_header->RingCapacity * _header->RecordSize ||
+            _header->HeaderSize + (ulong)_header->RingCount * _header->RingSize > size)
+        {
+            throw new InvalidDataException("Unsupported connection event channel layout");
+        }
+
+        _rings = (byte*)baseAddress + _header->HeaderSize;
+        _ringCount = _header->RingCount;
+        _ringSize = _header->RingSize;
+        _ringMask = _header->RingCapacity - 1;
+    }
+
+    /// <summary>
+    /// Events the driver discarded because a ring was full
+    /// </summary>
+    public long DroppedEvents
+    {
+        get
+        {
+            long dropped = 0;
+            for (uint i = 0; i < _ringCount; i++)
+            {
+                dropped += Volatile.Read(ref GetRing(i)->Dropped);
+            }
+            return dropped;
+        }
+    }
+
+    /// <summary>
+    /// Reads events on a dedicated thread until cancelled
+    /// The channel must stay mapped (driver handle open) until the task completes
+    /// </summary>
+    public Task RunAsync(ConnectionEventHandler handler, CancellationToken cancellationToken)
+    {
+        ArgumentNullException.ThrowIfNull(handler);
+
+        return Task.Factory.StartNew(
+            () => ReadLoop(handler, cancellationToken),
+            cancellationToken,
+            TaskCreationOptions.LongRunning,
+            TaskScheduler.Default);
+    }
+
+    private void ReadLoop(ConnectionEventHandler handler, CancellationToken cancellationToken)
+    {
+        var waitHandles = new[] { _wakeEvent, cancellationToken.WaitHandle };
+
+        while (!cancellationToken.IsCancellationRequested)
+        {
+            if (Drain(handler) > 0)
+                continue;
+
+            // Arm wakeup, then drain once more so an event published in
+            // between is not left waiting for the idle timeout
+            Volatile.Write(ref _header->WakeupArmed, 1);
+            if (Drain(handler) > 0)
+                continue;
+
+            WaitHandle.WaitAny(waitHandles, IdleWait);
+        }
+    }
+
+    private int Drain(ConnectionEventHandler handler)
+    {
+        var drained = 0;
+
+        for (uint i = 0; i < _ringCount; i++)
+        {
+            var ring = GetRing(i);
+            var records = (ConnectionEventRecord*)((byte*)ring + RING_RECORDS_OFFSET);
+            var write = Volatile.Read(ref ring->WriteIndex);
+            var read = ring->ReadIndex;
+
+            for (; read < write; read++)
+            {
+                try
+                {
+                    handler(in records[read & _ringMask]);
+                }
+                catch (Exception ex)
+                {
+                    _logger.LogError(ex, "Error handling connection event");
+                }
+                drained++;
+            }
+
+            // Release the slots back to the producer
+            Volatile.Write(ref ring->ReadIndex, read);
+        }
+
+        return drained;
+    }
+
+    private RingHeader* GetRing(uint index)
+    {
+        return (RingHeader*)(_rings + (long)index * _ringSize);
+    }
+
+    public void Dispose()
+    {
+        if (_disposed)
+            return;
+
+        _wakeEvent.Dispose();
+        _disposed = true;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct ChannelHeader
+    {
+        public uint Version;
+        public uint HeaderSize;
+        public uint RingCount;
+        public uint RingCapacity;
+        public uint RingSize;
+        public uint RecordSize;
+        public uint Watermark;
+        public int WakeupArmed;
+    }
+
+    [StructLayout(LayoutKind.Explicit)]
+    private struct RingHeader
+    {
+        [FieldOffset(0)] public long WriteIndex;
+        [FieldOffset(8)] public long Dropped;
+        [FieldOffset(RING_READ_INDEX_OFFSET)] public long ReadIndex;
+    }
+}
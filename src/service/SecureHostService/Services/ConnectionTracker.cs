@@ -0,0 +1,334 @@
+using System.Net.NetworkInformation;
+using System.Threading.Channels;
+using SecureHostCore.Models;
+
+namespace SecureHostService.Services;
+
+/// <summary>
+/// Live connection table behind the connection stream API. Fed by the WFP
+/// driver's connection events as they arrive and reconciled against the
+/// system TCP table by the network monitor, so closed connections drop
+/// out. Subscribers get a snapshot and then every change that passes
+/// their filter, in order. A subscriber that falls behind by more than
+/// its queue is cut off and must resubscribe, rather than slowing down
+/// the event reader.
+/// </summary>
+public sealed class ConnectionTracker
+{
+    private readonly record struct ConnectionKey(
+        byte Protocol,
+        byte IpVersion,
+        UInt128 LocalAddress,
+        ushort LocalPort,
+        UInt128 RemoteAddress,
+        ushort RemotePort);
+
+    // A connection the driver reported is given this long to show up in
+    // the system table before it is taken as closed
+    private static readonly TimeSpan s_closeGrace = TimeSpan.FromSeconds(15);
+
+    private readonly object _lock = new();
+    private readonly Dictionary<ConnectionKey, ConnectionStreamRecord> _connections = new();
+    private readonly List<ConnectionStreamSubscription> _subscribers = new();
+    private readonly int _maxConnections;
+    private readonly TimeSpan _retention;
+    private ulong _nextId;
+    private ulong _sequence;
+    private long _untracked;
+
+    /// <param name="maxConnections">Connections tracked at most; further new ones are only counted</param>
+    /// <param name="retention">How long a connection not in the system table (blocked, UDP) stays listed after it was last seen</param>
+    public ConnectionTracker(int maxConnections = 262144, TimeSpan? retention = null)
+    {
+        _maxConnections = Math.Max(1, maxConnections);
+        _retention = retention ?? TimeSpan.FromMinutes(1);
+    }
+
+    /// <summary>
+    /// New connections not tracked because the table was full
+    /// </summary>
+    public long UntrackedConnections => Interlocked.Read(ref _untracked);
+
+    public int Count
+    {
+        get
+        {
+            lock (_lock)
+            {
+                return _connections.Count;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Records a driver verdict. Runs on the event reader thread; only
+    /// takes the table lock and never waits on a subscriber. The verdict's
+    /// trace rides along with the change, so the stream can time delivery.
+    /// </summary>
+    public void Record(in ConnectionEventRecord record, VerdictTrace trace = default)
+    {
+        var update = new ConnectionStreamRecord
+        {
+            LastSeen = record.LastTimestamp != 0 ? record.LastTimestamp : record.Timestamp,
+            ProcessId = record.ProcessId,
+            Count = Math.Max(1, record.Count),
+            LocalPort = record.LocalPort,
+            RemotePort = record.RemotePort,
+            Protocol = record.Protocol,
+            Verdict = record.Verdict,
+            Direction = record.Direction,
+            IpVersion = record.IpVersion
+        };
+
+        unsafe
+        {
+            fixed (byte* local = record.LocalAddress)
+            fixed (byte* remote = record.RemoteAddress)
+            {
+                new ReadOnlySpan<byte>(local, 16).CopyTo(new Span<byte>(update.LocalAddress, 16));
+                new ReadOnlySpan<byte>(remote, 16).CopyTo(new Span<byte>(update.RemoteAddress, 16));
+            }
+        }
+
+        lock (_lock)
+        {
+            var key = GetKey(in update);
+            var found = _connections.TryGetValue(key, out var existing);
+            if (found)
+            {
+                update.Id = existing.Id;
+                update.Count += existing.Count;
+                if (update.ProcessId == 0)
+                    update.ProcessId = existing.ProcessId;
+            }
+            else if (!TryAssignId(ref update))
+            {
+                return;
+            }
+
+            _connections[key] = update;
+            Publish(found ? existing : null, update, trace);
+        }
+    }
+
+    /// <summary>
+    /// Reconciles the table with the system's TCP connections: adds
+    /// established connections the driver has not reported, and removes
+    /// TCP connections that have closed as well as anything else not seen
+    /// within the retention period
+    /// </summary>
+    public void Reconcile(IReadOnlyCollection<TcpConnectionInformation> tcpConnections)
+    {
+        var now = (ulong)DateTime.UtcNow.ToFileTimeUtc();
+        var cutoff = now - (ulong)_retention.Ticks;
+        var graceCutoff = now - (ulong)s_closeGrace.Ticks;
+        var open = new HashSet<ConnectionKey>(tcpConnections.Count);
+
+        lock (_lock)
+        {
+            foreach (var connection in tcpConnections)
+            {
+                if (connection.State is TcpState.Closed or TcpState.TimeWait or TcpState.DeleteTcb)
+                    continue;
+
+                var record = new ConnectionStreamRecord
+                {
+                    LastSeen = now,
+                    LocalPort = (ushort)connection.LocalEndPoint.Port,
+                    RemotePort = (ushort)connection.RemoteEndPoint.Port,
+                    Protocol = (byte)NetworkProtocol.TCP
+                };
+                record.SetAddresses(connection.LocalEndPoint.Address, connection.RemoteEndPoint.Address);
+
+                var key = GetKey(in record);
+                open.Add(key);
+
+                if (_connections.TryGetValue(key, out var existing))
+                {
+                    // Keeps driver-reported fields; only the last seen time moves
+                    existing.LastSeen = now;
+                    _connections[key] = existing;
+                }
+                else if (connection.State == TcpState.Established && TryAssignId(ref record))
+                {
+                    _connections[key] = record;
+                    Publish(null, record, default);
+                }
+            }
+
+            List<ConnectionKey>? closed = null;
+            foreach (var (key, record) in _connections)
+            {
+                var tcpClosed = key.Protocol == (byte)NetworkProtocol.TCP &&
+                                record.Verdict != (byte)PolicyAction.Block &&
+                                record.LastSeen < graceCutoff &&
+                                !open.Contains(key);
+
+                if (tcpClosed || record.LastSeen < cutoff)
+                    (closed ??= new List<ConnectionKey>()).Add(key);
+            }
+
+            if (closed != null)
+            {
+                foreach (var key in closed)
+                {
+                    _connections.Remove(key, out var record);
+                    Publish(record, null, default);
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Subscribes to changes matching <paramref name="filter"/>. The
+    /// subscription's snapshot holds the matching connections as of the
+    /// subscription; its queue holds every later change, starting right
+    /// after the snapshot.
+    /// </summary>
+    public ConnectionStreamSubscription Subscribe(ConnectionStreamFilter filter, int queueCapacity = 16384)
+    {
+        lock (_lock)
+        {
+            var snapshot = new List<ConnectionStreamRecord>();
+            foreach (var record in _connections.Values)
+            {
+                if (filter.Matches(in record))
+                    snapshot.Add(record);
+            }
+
+            var subscription = new ConnectionStreamSubscription(this, filter, queueCapacity, snapshot, _sequence);
+            _subscribers.Add(subscription);
+            return subscription;
+        }
+    }
+
+    internal void Unsubscribe(ConnectionStreamSubscription subscription)
+    {
+        lock (_lock)
+        {
+            _subscribers.Remove(subscription);
+        }
+    }
+
+    private bool TryAssignId(ref ConnectionStreamRecord record)
+    {
+        if (_connections.Count >= _maxConnections)
+        {
+            Interlocked.Increment(ref _untracked);
+            return false;
+        }
+
+        record.Id = ++_nextId;
+        return true;
+    }
+
+    /// <summary>
+    /// Sends a change to each subscriber that could see it. A connection
+    /// that stops matching a filter is removed from that subscriber's view.
+    /// </summary>
+    private void Publish(ConnectionStreamRecord? previous, ConnectionStreamRecord? current, VerdictTrace trace)
+    {
+        var sequence = ++_sequence;
+
+        for (var i = _subscribers.Count - 1; i >= 0; i--)
+        {
+            var subscriber = _subscribers[i];
+            var wasVisible = previous is { } before && subscriber.Filter.Matches(in before);
+            var isVisible = current is { } after && subscriber.Filter.Matches(in after);
+
+            if (isVisible)
+                subscriber.Post(ConnectionStreamMessageType.Upsert, current!.Value, sequence, trace);
+            else if (wasVisible)
+                subscriber.Post(ConnectionStreamMessageType.Remove, previous!.Value, sequence, default);
+        }
+    }
+
+    private static ConnectionKey GetKey(in ConnectionStreamRecord record)
+    {
+        unsafe
+        {
+            fixed (byte* local = record.LocalAddress)
+            fixed (byte* remote = record.RemoteAddress)
+            {
+                return new ConnectionKey(
+                    record.Protocol,
+                    record.IpVersion,
+                    ReadAddress(local),
+                    record.LocalPort,
+                    ReadAddress(remote),
+                    record.RemotePort);
+            }
+        }
+    }
+
+    private static unsafe UInt128 ReadAddress(byte* address)
+    {
+        return new UInt128(*(ulong*)address, *(ulong*)(address + 8));
+    }
+}
+
+/// <summary>
+/// One connection stream subscriber. Changes are queued without waiting;
+/// if the queue overflows the subscription is marked lost and completed,
+/// and the reader resubscribes.
+/// </summary>
+public sealed class ConnectionStreamSubscription : IDisposable
+{
+    private readonly ConnectionTracker _tracker;
+    private readonly Channel<(ConnectionStreamMessageType Type, ConnectionStreamRecord Record, ulong Sequence, VerdictTrace Trace)> _changes;
+    private volatile bool _lost;
+    private bool _disposed;
+
+    internal ConnectionStreamSubscription(
+        ConnectionTracker tracker,
+        ConnectionStreamFilter filter,
+        int queueCapacity,
+        IReadOnlyList<ConnectionStreamRecord> snapshot,
+        ulong snapshotSequence)
+    {
+        _tracker = tracker;
+        Filter = filter;
+        Snapshot = snapshot;
+        SnapshotSequence = snapshotSequence;
+        _changes = Channel.CreateBounded<(ConnectionStreamMessageType, ConnectionStreamRecord, ulong, VerdictTrace)>(
+            new BoundedChannelOptions(Math.Max(1, queueCapacity))
+            {
+                FullMode = BoundedChannelFullMode.Wait,
+                SingleReader = true
+            });
+    }
+
+    public ConnectionStreamFilter Filter { get; }
+    public IReadOnlyList<ConnectionStreamRecord> Snapshot { get; }
+    public ulong SnapshotSequence { get; }
+
+    /// <summary>
+    /// Changes were dropped; the reader has seen all it will get
+    /// </summary>
+    public bool Lost => _lost;
+
+    public ChannelReader<(ConnectionStreamMessageType Type, ConnectionStreamRecord Record, ulong Sequence, VerdictTrace Trace)> Changes =>
+        _changes.Reader;
+
+    internal void Post(ConnectionStreamMessageType type, in ConnectionStreamRecord record, ulong sequence, VerdictTrace trace)
+    {
+        if (_lost)
+            return;
+
+        if (!_changes.Writer.TryWrite((type, record, sequence, trace)))
+        {
+            _lost = true;
+            _changes.Writer.TryComplete();
+        }
+    }
+
+    public void Dispose()
+    {
+        if (_disposed)
+            return;
+
+        _disposed = true;
+        _tracker.Unsubscribe(this);
+        _changes.Writer.TryComplete();
+    }
+}
@@ -14,16 +14,30 @@ public sealed class DeviceControlService
     private readonly ILogger<DeviceControlService> _logger;
     private readonly PolicyEngine _policyEngine;
     private readonly AuditEngine _auditEngine;
+    private readonly DriverCommunicationService _driverComm;
+    private readonly AnomalyDetector _anomalyDetector;
+    private readonly LatencyTracer _latencyTracer;
     private ManagementEventWatcher? _deviceWatcher;
+    private CancellationTokenSource? _eventReaderCts;
+    private Task? _eventReaderTask;
+
+    // Event fetches kept parked in the device driver
+    private const int DeviceEventFetches = 4;
 
     public DeviceControlService(
         ILogger<DeviceControlService> logger,
         PolicyEngine policyEngine,
-        AuditEngine auditEngine)
+        AuditEngine auditEngine,
+        DriverCommunicationService driverComm,
+        AnomalyDetector anomalyDetector,
+        LatencyTracer latencyTracer)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _policyEngine = policyEngine ?? throw new ArgumentNullException(nameof(policyEngine));
         _auditEngine = auditEngine ?? throw new ArgumentNullException(nameof(auditEngine));
+        _driverComm = driverComm ?? throw new ArgumentNullException(nameof(driverComm));
+        _anomalyDetector = anomalyDetector ?? throw new ArgumentNullException(nameof(anomalyDetector));
+        _latencyTracer = latencyTracer ?? throw new ArgumentNullException(nameof(latencyTracer));
     }
 
     /// <summary>
@@ -33,6 +47,13 @@ public sealed class DeviceControlService
     {
         _logger.LogInformation("Starting device control service...");
 
+        // Access checks are reported by the device driver as they happen
+        _eventReaderCts = new CancellationTokenSource();
+        _eventReaderTask = _driverComm.ReadDeviceEventsAsync(
+            OnDeviceAccessEvent,
+            DeviceEventFetches,
+            _eventReaderCts.Token);
+
         try
         {
             // Monitor device arrival/removal events
@@ -68,7 +89,68 @@ public sealed class DeviceControlService
             _deviceWatcher = null;
         }
 
-        await Task.CompletedTask;
+        // Parked fetches are cancelled in the driver; none hold a thread
+        if (_eventReaderTask != null)
+        {
+            _eventReaderCts!.Cancel();
+            await _eventReaderTask;
+
+            _eventReaderCts.Dispose();
+            _eventReaderCts = null;
+            _eventReaderTask = null;
+        }
+    }
+
+    /// <summary>
+    /// Audits a denied access reported by the device driver
+    /// Runs on the I/O thread pool; must not block
+    /// </summary>
+    private void OnDeviceAccessEvent(in DeviceAccessEventRecord record)
+    {
+        var trace = TraceEvent(in record);
+
+        _anomalyDetector.RecordDeviceAccess(record.ProcessKey, (DeviceType)record.DeviceType, record.Count);
+
+        if (record.Verdict != (byte)PolicyAction.Block)
+            return;
+
+        var deviceType = (DeviceType)record.DeviceType;
+        var attempts = record.Count > 1 ? $" ({record.Count} attempts)" : string.Empty;
+
+        // The audit pipeline resolves the process from its cache key
+        _ = _auditEngine.LogDeviceEventAsync(
+            record.ProcessId,
+            string.Empty,
+            PolicyAction.Block,
+            new DeviceEventDetails
+            {
+                DeviceType = deviceType,
+                AccessType = DeviceAccessType.Open
+            },
+            null,
+            $"{deviceType} access blocked by driver{attempts}",
+            AuditEngine.CreateRepeatMetadata(record.Count, record.TimestampUtc, record.LastTimestampUtc),
+            record.ProcessCreateTime,
+            trace);
+    }
+
+    /// <summary>
+    /// Records the driver's verdict time and the event's delivery here;
+    /// as for connection events, a summary of repeats only times its verdict
+    /// </summary>
+    private VerdictTrace TraceEvent(in DeviceAccessEventRecord record)
+    {
+        if (record.CorrelationId == 0 || record.CheckTime == 0)
+            return default;
+
+        _latencyTracer.Record(LatencyStage.DeviceVerdict, record.CorrelationId, record.VerdictTicks);
+
+        if (record.Count > 1)
+            return new VerdictTrace(record.CorrelationId, 0);
+
+        var verdictTime = (long)record.CheckTime + record.VerdictTicks;
+        _latencyTracer.RecordSince(LatencyStage.EventDelivery, record.CorrelationId, verdictTime);
+        return new VerdictTrace(record.CorrelationId, verdictTime);
     }
 
     /// <summary>
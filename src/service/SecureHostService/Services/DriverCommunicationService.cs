@@ -1,5 +1,7 @@
 using Microsoft.Extensions.Logging;
 using Microsoft.Win32.SafeHandles;
+using SecureHostCore.Models;
+using System.Collections.Concurrent;
 using System.Runtime.InteropServices;
 using System.ComponentModel;
 
@@ -8,23 +10,52 @@ namespace SecureHostService.Services;
 /// <summary>
 /// Handles communication with kernel-mode drivers
 /// Provides IOCTL interface and driver lifecycle management
+/// Driver handles are overlapped and bound to the I/O thread pool, so
+/// requests the driver holds back (event fetches) never tie up a thread
 /// </summary>
 public sealed class DriverCommunicationService : IDisposable
 {
     private readonly ILogger<DriverCommunicationService> _logger;
-    private SafeFileHandle? _wfpDriverHandle;
-    private SafeFileHandle? _deviceDriverHandle;
+    private ThreadPoolBoundHandle? _wfpDriver;
+    private ThreadPoolBoundHandle? _deviceDriver;
+    private long _rulesetGeneration = DateTime.UtcNow.Ticks;
+    private ulong _loadedGeneration;    // Last generation this service loaded; 0 = none yet
     private bool _disposed;
 
+    // Image path -> app ID hash; only successful resolutions are kept
+    private static readonly ConcurrentDictionary<string, ulong> s_appIdHashes =
+        new(StringComparer.OrdinalIgnoreCase);
+
     private const string WFP_DRIVER_NAME = @"\\.\SecureHostWFP";
+
+    // Read by the WFP driver at boot (SECUREHOST_PERSISTED_RULESET_PATH)
+    private static readonly string s_persistedRulesetPath = Path.Combine(
+        Environment.SystemDirectory, "drivers", "SecureHost", "NetworkRuleset.bin");
     private const string DEVICE_DRIVER_NAME = @"\\.\SecureHostDevice";
 
     // IOCTL codes
-    private const uint IOCTL_ADD_NETWORK_RULE = 0x222000;
-    private const uint IOCTL_REMOVE_NETWORK_RULE = 0x222004;
-    private const uint IOCTL_ADD_DEVICE_RULE = 0x222008;
-    private const uint IOCTL_REMOVE_DEVICE_RULE = 0x22200C;
-    private const uint IOCTL_GET_STATISTICS = 0x222010;
+    private const uint IOCTL_GET_STATISTICS = 0x222010;         // Both drivers
+    private const uint IOCTL_LOAD_NETWORK_RULESET = 0x22A015; // WFP; METHOD_IN_DIRECT, FILE_WRITE_ACCESS
+    private const uint IOCTL_UPDATE_NETWORK_RULES = 0x22A02D; // WFP; METHOD_IN_DIRECT, FILE_WRITE_ACCESS
+    private const uint IOCTL_APPLY_DEVICE_RULES = 0x22A015;   // Device; METHOD_IN_DIRECT, FILE_WRITE_ACCESS
+    private const uint IOCTL_SUBSCRIBE_EVENTS = 0x226018;     // METHOD_BUFFERED, FILE_READ_ACCESS
+    private const uint IOCTL_GET_DEVICE_EVENTS = 0x226028;    // METHOD_BUFFERED, FILE_READ_ACCESS
+    private const uint IOCTL_QUERY_PROCESSES = 0x226030;      // Both drivers; METHOD_BUFFERED, FILE_READ_ACCESS
+
+    private const uint FILE_FLAG_OVERLAPPED = 0x40000000;
+    private const int ERROR_IO_PENDING = 997;
+    private const int ERROR_OPERATION_ABORTED = 995;
+
+    // Device events per fetch (see SECUREHOST_DEVICE_EVENT_BACKLOG)
+    private const int DEVICE_EVENT_BATCH = 64;
+
+    // Process query output per query: the record plus room for a full
+    // path (SECUREHOST_MAX_IMAGE_PATH_BYTES) and SID
+    private const int PROCESS_QUERY_OUTPUT_PER_QUERY = 48 + 2048 + 68;
+
+    // Statistics wire format (see SECUREHOST_STATISTICS in either driver)
+    private const uint STATISTICS_VERSION = 2;
+    private const int LATENCY_BUCKETS = 16;
 
     public DriverCommunicationService(ILogger<DriverCommunicationService> logger)
     {
@@ -38,189 +69,565 @@ public sealed class DriverCommunicationService : IDisposable
     {
         _logger.LogInformation("Initializing driver communication...");
 
-        var success = true;
+        _wfpDriver = OpenDriver(WFP_DRIVER_NAME, "WFP");
+        _deviceDriver = OpenDriver(DEVICE_DRIVER_NAME, "Device");
+
+        var success = _wfpDriver != null && _deviceDriver != null;
 
-        // Try to open WFP driver
+        // The driver may be enforcing a persisted ruleset from an earlier
+        // run; later generations must stay ahead of it even if the clock
+        // has moved back
+        var statistics = await GetNetworkStatisticsAsync(cancellationToken);
+        if (statistics != null && (long)statistics.RuleTableGeneration > Interlocked.Read(ref _rulesetGeneration))
+        {
+            Interlocked.Exchange(ref _rulesetGeneration, (long)statistics.RuleTableGeneration);
+        }
+
+        return success;
+    }
+
+    /// <summary>
+    /// Opens a driver for overlapped I/O on the thread pool
+    /// </summary>
+    private ThreadPoolBoundHandle? OpenDriver(string path, string driverName)
+    {
         try
         {
-            _wfpDriverHandle = CreateFileW(
-                WFP_DRIVER_NAME,
+            var handle = CreateFileW(
+                path,
                 FileAccess.ReadWrite,
                 FileShare.ReadWrite,
                 IntPtr.Zero,
                 FileMode.Open,
-                0,
+                FILE_FLAG_OVERLAPPED,
                 IntPtr.Zero);
 
-            if (_wfpDriverHandle.IsInvalid)
+            if (handle.IsInvalid)
             {
                 var error = Marshal.GetLastWin32Error();
-                _logger.LogWarning("Could not open WFP driver: Error {Error}", error);
-                _wfpDriverHandle = null;
-                success = false;
+                _logger.LogWarning("Could not open {Driver} driver: Error {Error}", driverName, error);
+                handle.Dispose();
+                return null;
             }
-            else
+
+            try
             {
-                _logger.LogInformation("WFP driver connection established");
+                var driver = ThreadPoolBoundHandle.BindHandle(handle);
+                _logger.LogInformation("{Driver} driver connection established", driverName);
+                return driver;
+            }
+            catch
+            {
+                handle.Dispose();
+                throw;
             }
         }
         catch (Exception ex)
         {
-            _logger.LogWarning(ex, "Exception opening WFP driver");
-            _wfpDriverHandle = null;
-            success = false;
+            _logger.LogWarning(ex, "Exception opening {Driver} driver", driverName);
+            return null;
         }
+    }
 
-        // Try to open device filter driver
+    /// <summary>
+    /// Replaces the WFP driver's network rule set in a single round trip.
+    /// Rules are matched in list order; the driver validates the whole set
+    /// and swaps it in atomically, or rejects it and keeps the current one.
+    /// Connections matching a rule flagged by <paramref name="isDeferred"/>
+    /// are held for <see cref="ConnectionDecisionChannel"/>; if the service
+    /// does not answer in time the driver allows them. Rules naming an
+    /// image by full path are scoped to its app ID (see
+    /// <see cref="TryGetAppIdHash"/>), so the driver only holds or matches
+    /// that application's connections. Remote addresses given as a CIDR
+    /// prefix or a single address are matched in the driver's prefix index.
+    /// An accepted ruleset is also saved for the driver to enforce from
+    /// its next start, before the service is running.
+    /// </summary>
+    public async Task<bool> LoadNetworkRulesetAsync(
+        IReadOnlyList<PolicyRule> rules,
+        Func<PolicyRule, bool> isDeferred,
+        CancellationToken cancellationToken)
+    {
+        if (_wfpDriver == null)
+        {
+            _logger.LogWarning("WFP driver not available");
+            return false;
+        }
+
+        var buffer = DriverBufferPool.Rent(
+            DriverWireFormat.HeaderSize + rules.Count * DriverWireFormat.NetworkRuleSize);
         try
         {
-            _deviceDriverHandle = CreateFileW(
-                DEVICE_DRIVER_NAME,
-                FileAccess.ReadWrite,
-                FileShare.ReadWrite,
-                IntPtr.Zero,
-                FileMode.Open,
-                0,
-                IntPtr.Zero);
+            var generation = (ulong)Interlocked.Increment(ref _rulesetGeneration);
+            var length = WriteNetworkRuleset(buffer, rules, isDeferred, generation);
 
-            if (_deviceDriverHandle.IsInvalid)
-            {
-                var error = Marshal.GetLastWin32Error();
-                _logger.LogWarning("Could not open device driver: Error {Error}", error);
-                _deviceDriverHandle = null;
-                success = false;
-            }
-            else
-            {
-                _logger.LogInformation("Device driver connection established");
-            }
+            // METHOD_IN_DIRECT: the ruleset goes in the direct (output) buffer
+            await DeviceIoControlAsync(
+                _wfpDriver,
+                IOCTL_LOAD_NETWORK_RULESET,
+                default,
+                new ArraySegment<byte>(buffer, 0, length),
+                cancellationToken);
+
+            _logger.LogDebug("Loaded {Count} network rules into driver (generation {Generation})",
+                rules.Count, generation);
+
+            _loadedGeneration = generation;
+            await PersistNetworkRulesetAsync(new ReadOnlyMemory<byte>(buffer, 0, length), cancellationToken);
+            return true;
+        }
+        catch (Win32Exception ex)
+        {
+            _logger.LogError("Failed to load network ruleset into driver: Error {Error}", ex.NativeErrorCode);
+            return false;
         }
         catch (Exception ex)
         {
-            _logger.LogWarning(ex, "Exception opening device driver");
-            _deviceDriverHandle = null;
-            success = false;
+            _logger.LogError(ex, "Exception loading network ruleset into driver");
+            return false;
+        }
+        finally
+        {
+            DriverBufferPool.Return(buffer);
         }
-
-        await Task.CompletedTask;
-        return success;
     }
 
     /// <summary>
-    /// Sends network rule to WFP driver
+    /// Applies individual rule changes to the ruleset this service last
+    /// loaded, without replacing the whole set. The driver only re-matches
+    /// flows the changed rules can affect, where a full load re-matches
+    /// every flow. <paramref name="rules"/> is the complete set after the
+    /// changes, in match order, and is what gets saved for the next boot.
+    /// Returns false without side effects if the driver holds a ruleset
+    /// the changes were not made against (another generation, or none
+    /// loaded yet) or rejects them; the caller then loads the full set.
+    /// Callers serialize ruleset changes.
     /// </summary>
-    public async Task<bool> SendNetworkRuleAsync(
-        ulong ruleId,
-        uint processId,
-        ushort protocol,
-        ushort localPort,
-        ushort remotePort,
-        uint action,
+    public async Task<bool> UpdateNetworkRulesAsync(
+        IReadOnlyList<PolicyRule> rules,
+        IReadOnlyList<NetworkRuleChange> changes,
+        Func<PolicyRule, bool> isDeferred,
         CancellationToken cancellationToken)
     {
-        if (_wfpDriverHandle == null || _wfpDriverHandle.IsInvalid)
+        if (_wfpDriver == null || _loadedGeneration == 0 ||
+            changes.Count == 0 || changes.Count > DriverWireFormat.MaxRuleDeltas)
         {
-            _logger.LogWarning("WFP driver not available");
             return false;
         }
 
+        var buffer = DriverBufferPool.Rent(
+            DriverWireFormat.DeltaHeaderSize + changes.Count * DriverWireFormat.NetworkRuleDeltaSize);
         try
         {
-            // Create rule structure
-            var rule = new NetworkRule
-            {
-                RuleId = ruleId,
-                ProcessId = processId,
-                Protocol = protocol,
-                LocalPort = localPort,
-                RemotePort = remotePort,
-                Action = action,
-                Enabled = 1
-            };
+            var generation = (ulong)Interlocked.Increment(ref _rulesetGeneration);
+            var length = WriteNetworkRuleDelta(buffer, changes, isDeferred, generation, _loadedGeneration);
 
-            var ruleBytes = StructToBytes(rule);
+            await DeviceIoControlAsync(
+                _wfpDriver,
+                IOCTL_UPDATE_NETWORK_RULES,
+                default,
+                new ArraySegment<byte>(buffer, 0, length),
+                cancellationToken);
 
-            var result = DeviceIoControl(
-                _wfpDriverHandle,
-                IOCTL_ADD_NETWORK_RULE,
-                ruleBytes,
-                (uint)ruleBytes.Length,
-                null,
-                0,
-                out _,
-                IntPtr.Zero);
+            _logger.LogDebug("Applied {Count} network rule changes in driver (generation {Generation})",
+                changes.Count, generation);
 
-            if (!result)
+            _loadedGeneration = generation;
+        }
+        catch (Win32Exception ex)
+        {
+            _logger.LogDebug("Driver did not apply network rule changes: Error {Error}", ex.NativeErrorCode);
+            return false;
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Exception applying network rule changes in driver");
+            return false;
+        }
+        finally
+        {
+            DriverBufferPool.Return(buffer);
+        }
+
+        var ruleset = DriverBufferPool.Rent(
+            DriverWireFormat.HeaderSize + rules.Count * DriverWireFormat.NetworkRuleSize);
+        try
+        {
+            var rulesetLength = WriteNetworkRuleset(ruleset, rules, isDeferred, _loadedGeneration);
+            await PersistNetworkRulesetAsync(new ReadOnlyMemory<byte>(ruleset, 0, rulesetLength), cancellationToken);
+        }
+        finally
+        {
+            DriverBufferPool.Return(ruleset);
+        }
+
+        return true;
+    }
+
+    /// <summary>
+    /// Saves a ruleset the driver accepted. The file is replaced in one
+    /// rename so the driver never reads a partial set; a failure only
+    /// costs boot-time enforcement and is logged.
+    /// </summary>
+    private async Task PersistNetworkRulesetAsync(ReadOnlyMemory<byte> ruleset, CancellationToken cancellationToken)
+    {
+        var tempPath = s_persistedRulesetPath + ".tmp";
+        try
+        {
+            Directory.CreateDirectory(Path.GetDirectoryName(s_persistedRulesetPath)!);
+
+            await using (var stream = new FileStream(
+                tempPath, FileMode.Create, FileAccess.Write, FileShare.None, 4096, FileOptions.Asynchronous))
             {
-                var error = Marshal.GetLastWin32Error();
-                _logger.LogError("Failed to send network rule to driver: Error {Error}", error);
-                return false;
+                await stream.WriteAsync(ruleset, cancellationToken);
+                stream.Flush(flushToDisk: true);
             }
 
-            _logger.LogDebug("Network rule {RuleId} sent to driver", ruleId);
-            return true;
+            File.Move(tempPath, s_persistedRulesetPath, overwrite: true);
+        }
+        catch (Exception ex) when (ex is IOException or UnauthorizedAccessException)
+        {
+            _logger.LogWarning(ex, "Could not save network ruleset for boot-time enforcement");
+        }
+    }
+
+    /// <summary>
+    /// Maps the WFP driver's connection event channel into this process.
+    /// The mapping lives as long as the driver handle, so readers must be
+    /// stopped before <see cref="ShutdownAsync"/>. Only one subscriber is
+    /// allowed per driver instance.
+    /// </summary>
+    public async Task<ConnectionEventChannel?> OpenConnectionEventChannelAsync(CancellationToken cancellationToken)
+    {
+        if (_wfpDriver == null)
+        {
+            _logger.LogWarning("WFP driver not available");
+            return null;
+        }
+
+        var wakeEvent = new EventWaitHandle(false, EventResetMode.AutoReset);
+        try
+        {
+            var subscribe = new EventSubscribeInput
+            {
+                EventHandle = (ulong)wakeEvent.SafeWaitHandle.DangerousGetHandle()
+            };
+            var input = new byte[Marshal.SizeOf<EventSubscribeInput>()];
+            var output = new byte[Marshal.SizeOf<EventSubscribeOutput>()];
+            MemoryMarshal.Write(input, in subscribe);
+
+            await DeviceIoControlAsync(
+                _wfpDriver,
+                IOCTL_SUBSCRIBE_EVENTS,
+                input,
+                output,
+                cancellationToken);
+
+            var mapping = MemoryMarshal.Read<EventSubscribeOutput>(output);
+
+            _logger.LogInformation("Mapped driver connection event channel ({Size} bytes)", mapping.Size);
+            return new ConnectionEventChannel(_logger, wakeEvent, (IntPtr)(long)mapping.BaseAddress, mapping.Size);
+        }
+        catch (Win32Exception ex)
+        {
+            _logger.LogError("Failed to subscribe to driver connection events: Error {Error}", ex.NativeErrorCode);
+            wakeEvent.Dispose();
+            return null;
         }
         catch (Exception ex)
         {
-            _logger.LogError(ex, "Exception sending network rule to driver");
-            return false;
+            _logger.LogError(ex, "Exception subscribing to driver connection events");
+            wakeEvent.Dispose();
+            return null;
         }
     }
 
     /// <summary>
-    /// Sends device rule to device filter driver
+    /// Reads the device driver's access events until cancelled. Keeps
+    /// <paramref name="outstanding"/> fetches parked in the driver, which
+    /// completes one with everything buffered whenever an access is
+    /// checked. The handler runs on the I/O thread pool and must not block.
     /// </summary>
-    public async Task<bool> SendDeviceRuleAsync(
-        ulong ruleId,
-        uint processId,
-        uint deviceType,
-        uint action,
+    public async Task ReadDeviceEventsAsync(
+        DeviceAccessEventHandler handler,
+        int outstanding,
         CancellationToken cancellationToken)
     {
-        if (_deviceDriverHandle == null || _deviceDriverHandle.IsInvalid)
+        ArgumentNullException.ThrowIfNull(handler);
+        ArgumentOutOfRangeException.ThrowIfNegativeOrZero(outstanding);
+
+        if (_deviceDriver == null)
         {
             _logger.LogWarning("Device driver not available");
-            return false;
+            return;
+        }
+
+        var fetches = new Task[outstanding];
+        for (var i = 0; i < outstanding; i++)
+        {
+            fetches[i] = FetchDeviceEventsAsync(_deviceDriver, handler, cancellationToken);
         }
 
+        await Task.WhenAll(fetches);
+    }
+
+    private async Task FetchDeviceEventsAsync(
+        ThreadPoolBoundHandle driver,
+        DeviceAccessEventHandler handler,
+        CancellationToken cancellationToken)
+    {
+        var length = DEVICE_EVENT_BATCH * Marshal.SizeOf<DeviceAccessEventRecord>();
+        var buffer = DriverBufferPool.Rent(length);
+
         try
         {
-            var rule = new DeviceRule
+            while (!cancellationToken.IsCancellationRequested)
             {
-                RuleId = ruleId,
-                ProcessId = processId,
-                DeviceType = deviceType,
-                Action = action,
-                Enabled = 1
-            };
-
-            var ruleBytes = StructToBytes(rule);
+                uint bytesReturned;
+                try
+                {
+                    bytesReturned = await DeviceIoControlAsync(
+                        driver,
+                        IOCTL_GET_DEVICE_EVENTS,
+                        default,
+                        new ArraySegment<byte>(buffer, 0, length),
+                        cancellationToken);
+                }
+                catch (OperationCanceledException)
+                {
+                    return;
+                }
+                catch (Win32Exception ex)
+                {
+                    _logger.LogError("Stopped reading device driver events: Error {Error}", ex.NativeErrorCode);
+                    return;
+                }
 
-            var result = DeviceIoControl(
-                _deviceDriverHandle,
-                IOCTL_ADD_DEVICE_RULE,
-                ruleBytes,
-                (uint)ruleBytes.Length,
-                null,
-                0,
-                out _,
-                IntPtr.Zero);
+                DispatchDeviceEvents(buffer.AsSpan(0, (int)bytesReturned), handler);
+            }
+        }
+        finally
+        {
+            DriverBufferPool.Return(buffer);
+        }
+    }
 
-            if (!result)
+    private void DispatchDeviceEvents(ReadOnlySpan<byte> batch, DeviceAccessEventHandler handler)
+    {
+        foreach (ref readonly var record in MemoryMarshal.Cast<byte, DeviceAccessEventRecord>(batch))
+        {
+            try
             {
-                var error = Marshal.GetLastWin32Error();
-                _logger.LogError("Failed to send device rule to driver: Error {Error}", error);
-                return false;
+                handler(in record);
             }
+            catch (Exception ex)
+            {
+                _logger.LogError(ex, "Error handling device event");
+            }
+        }
+    }
+
+    /// <summary>
+    /// Opens a dedicated WFP driver handle for answering deferred
+    /// connection decisions. The handle is synchronous so fetch and complete
+    /// calls stay ordered; only the first handle to fetch may answer.
+    /// </summary>
+    public ConnectionDecisionChannel? OpenConnectionDecisionChannel()
+    {
+        if (_wfpDriver == null)
+        {
+            _logger.LogWarning("WFP driver not available");
+            return null;
+        }
+
+        var handle = CreateFileW(
+            WFP_DRIVER_NAME,
+            FileAccess.ReadWrite,
+            FileShare.ReadWrite,
+            IntPtr.Zero,
+            FileMode.Open,
+            0,
+            IntPtr.Zero);
+
+        if (handle.IsInvalid)
+        {
+            var error = Marshal.GetLastWin32Error();
+            _logger.LogError("Failed to open driver connection decision channel: Error {Error}", error);
+            handle.Dispose();
+            return null;
+        }
+
+        return new ConnectionDecisionChannel(_logger, handle);
+    }
+
+    /// <summary>
+    /// Applies device rules to the device filter driver in one round trip.
+    /// Enabled rules are added or replace the driver's policy with the same
+    /// ID; disabled ones are removed. Rules are applied in list order.
+    /// </summary>
+    public async Task<bool> ApplyDeviceRulesAsync(
+        IReadOnlyList<PolicyRule> rules,
+        CancellationToken cancellationToken)
+    {
+        if (_deviceDriver == null)
+        {
+            _logger.LogWarning("Device driver not available");
+            return false;
+        }
+
+        if (rules.Count == 0)
+            return true;
+
+        var buffer = DriverBufferPool.Rent(DeviceRulesetSize(rules));
+        try
+        {
+            var length = WriteDeviceRuleset(buffer, rules);
 
-            _logger.LogDebug("Device rule {RuleId} sent to driver", ruleId);
+            // METHOD_IN_DIRECT: the batch goes in the direct (output) buffer
+            await DeviceIoControlAsync(
+                _deviceDriver,
+                IOCTL_APPLY_DEVICE_RULES,
+                default,
+                new ArraySegment<byte>(buffer, 0, length),
+                cancellationToken);
+
+            _logger.LogDebug("Applied {Count} device rules to driver", rules.Count);
             return true;
         }
+        catch (Win32Exception ex)
+        {
+            _logger.LogError("Failed to apply device rules to driver: Error {Error}", ex.NativeErrorCode);
+            return false;
+        }
         catch (Exception ex)
         {
-            _logger.LogError(ex, "Exception sending device rule to driver");
+            _logger.LogError(ex, "Exception applying device rules to driver");
             return false;
         }
+        finally
+        {
+            DriverBufferPool.Return(buffer);
+        }
+    }
+
+    /// <summary>
+    /// Looks processes up in the drivers' process metadata caches, the
+    /// WFP driver's first. Returns one entry per key, in order: null where
+    /// neither driver knows the process, and an empty list if no driver
+    /// answered. Image paths are NT paths.
+    /// </summary>
+    public async Task<IReadOnlyList<DriverProcessInfo?>> QueryProcessesAsync(
+        IReadOnlyList<ProcessKey> keys,
+        CancellationToken cancellationToken)
+    {
+        if (keys.Count == 0 || keys.Count > DriverWireFormat.MaxProcessQueries)
+            throw new ArgumentOutOfRangeException(nameof(keys));
+
+        var inputLength = keys.Count * DriverWireFormat.ProcessQuerySize;
+        var outputLength = keys.Count * PROCESS_QUERY_OUTPUT_PER_QUERY;
+        var input = DriverBufferPool.Rent(inputLength);
+        var output = DriverBufferPool.Rent(outputLength);
+        try
+        {
+            WriteProcessQueries(input.AsSpan(0, inputLength), keys);
+
+            foreach (var driver in new[] { _wfpDriver, _deviceDriver })
+            {
+                if (driver == null)
+                    continue;
+
+                uint bytesReturned;
+                try
+                {
+                    bytesReturned = await DeviceIoControlAsync(
+                        driver,
+                        IOCTL_QUERY_PROCESSES,
+                        new ArraySegment<byte>(input, 0, inputLength),
+                        new ArraySegment<byte>(output, 0, outputLength),
+                        cancellationToken);
+                }
+                catch (Win32Exception ex)
+                {
+                    // An older driver without a process cache, or not permitted
+                    _logger.LogDebug("Process query failed: Error {Error}", ex.NativeErrorCode);
+                    continue;
+                }
+
+                return ReadProcessInfo(output.AsSpan(0, (int)Math.Min(bytesReturned, (uint)outputLength)), keys.Count);
+            }
+
+            return Array.Empty<DriverProcessInfo?>();
+        }
+        finally
+        {
+            DriverBufferPool.Return(input);
+            DriverBufferPool.Return(output);
+        }
+    }
+
+    private static void WriteProcessQueries(Span<byte> buffer, IReadOnlyList<ProcessKey> keys)
+    {
+        var queries = MemoryMarshal.Cast<byte, ProcessQueryRecord>(buffer);
+        for (var i = 0; i < keys.Count; i++)
+        {
+            queries[i] = new ProcessQueryRecord { ProcessId = keys[i].ProcessId, CreateTime = keys[i].CreateTime };
+        }
+    }
+
+    private static DriverProcessInfo?[] ReadProcessInfo(ReadOnlySpan<byte> output, int count)
+    {
+        var results = new DriverProcessInfo?[count];
+        if (output.Length < count * DriverWireFormat.ProcessInfoSize)
+            return results;
+
+        var records = MemoryMarshal.Cast<byte, ProcessInfoRecord>(output[..(count * DriverWireFormat.ProcessInfoSize)]);
+        for (var i = 0; i < count; i++)
+        {
+            ref readonly var record = ref records[i];
+            if ((record.Flags & ProcessInfoRecord.FlagFound) == 0)
+                continue;
+
+            string? imagePath = null;
+            if (record.ImagePathLength != 0 &&
+                (long)record.ImagePathOffset + record.ImagePathLength <= output.Length)
+            {
+                imagePath = new string(MemoryMarshal.Cast<byte, char>(
+                    output.Slice((int)record.ImagePathOffset, record.ImagePathLength & ~1)));
+            }
+
+            byte[]? userSid = null;
+            if (record.UserSidLength != 0 &&
+                (long)record.UserSidOffset + record.UserSidLength <= output.Length)
+            {
+                userSid = output.Slice((int)record.UserSidOffset, record.UserSidLength).ToArray();
+            }
+
+            results[i] = new DriverProcessInfo(
+                new ProcessKey(record.ProcessId, record.CreateTime),
+                record.ParentProcessId,
+                imagePath,
+                userSid,
+                (record.Flags & ProcessInfoRecord.FlagSigningLevel) != 0 ? record.SigningLevel : null,
+                (record.Flags & ProcessInfoRecord.FlagExited) != 0 ? DateTime.FromFileTimeUtc((long)record.ExitTime) : null);
+        }
+
+        return results;
+    }
+
+    /// <summary>
+    /// Queries the WFP driver's aggregated per-processor counters
+    /// </summary>
+    public Task<DriverStatistics?> GetNetworkStatisticsAsync(CancellationToken cancellationToken)
+    {
+        return QueryStatisticsAsync(_wfpDriver, "WFP", cancellationToken);
+    }
+
+    /// <summary>
+    /// Queries the device driver's aggregated per-processor counters
+    /// </summary>
+    public Task<DriverStatistics?> GetDeviceStatisticsAsync(CancellationToken cancellationToken)
+    {
+        return QueryStatisticsAsync(_deviceDriver, "Device", cancellationToken);
     }
 
     /// <summary>
@@ -229,8 +636,8 @@ public sealed class DriverCommunicationService : IDisposable
     public async Task<bool> CheckHealthAsync(CancellationToken cancellationToken)
     {
         // Check if handles are still valid
-        var wfpOk = _wfpDriverHandle != null && !_wfpDriverHandle.IsInvalid;
-        var deviceOk = _deviceDriverHandle != null && !_deviceDriverHandle.IsInvalid;
+        var wfpOk = _wfpDriver != null && !_wfpDriver.Handle.IsInvalid;
+        var deviceOk = _deviceDriver != null && !_deviceDriver.Handle.IsInvalid;
 
         _logger.LogDebug("Driver health: WFP={WfpStatus}, Device={DeviceStatus}",
             wfpOk ? "OK" : "Unavailable",
@@ -247,11 +654,8 @@ public sealed class DriverCommunicationService : IDisposable
     {
         _logger.LogInformation("Shutting down driver communication...");
 
-        _wfpDriverHandle?.Dispose();
-        _wfpDriverHandle = null;
-
-        _deviceDriverHandle?.Dispose();
-        _deviceDriverHandle = null;
+        CloseDriver(ref _wfpDriver);
+        CloseDriver(ref _deviceDriver);
 
         await Task.CompletedTask;
     }
@@ -261,50 +665,387 @@ public sealed class DriverCommunicationService : IDisposable
         if (_disposed)
             return;
 
-        _wfpDriverHandle?.Dispose();
-        _deviceDriverHandle?.Dispose();
+        CloseDriver(ref _wfpDriver);
+        CloseDriver(ref _deviceDriver);
         _disposed = true;
     }
 
     // Helper methods
-    private static byte[] StructToBytes<T>(T structure) where T : struct
+    private static void CloseDriver(ref ThreadPoolBoundHandle? driver)
     {
-        var size = Marshal.SizeOf(structure);
-        var bytes = new byte[size];
-        var ptr = Marshal.AllocHGlobal(size);
+        if (driver == null)
+            return;
+
+        // Unbinding leaves the handle open
+        var handle = driver.Handle;
+        driver.Dispose();
+        handle.Dispose();
+        driver = null;
+    }
+
+    private async Task<DriverStatistics?> QueryStatisticsAsync(
+        ThreadPoolBoundHandle? driver,
+        string driverName,
+        CancellationToken cancellationToken)
+    {
+        if (driver == null)
+        {
+            return null;
+        }
+
+        var length = Marshal.SizeOf<NativeStatistics>();
+        var buffer = DriverBufferPool.Rent(length);
         try
         {
-            Marshal.StructureToPtr(structure, ptr, false);
-            Marshal.Copy(ptr, bytes, 0, size);
+            uint bytesReturned;
+
+            try
+            {
+                bytesReturned = await DeviceIoControlAsync(
+                    driver,
+                    IOCTL_GET_STATISTICS,
+                    default,
+                    new ArraySegment<byte>(buffer, 0, length),
+                    cancellationToken);
+            }
+            catch (Win32Exception ex)
+            {
+                _logger.LogError("Failed to query {Driver} driver statistics: Error {Error}",
+                    driverName, ex.NativeErrorCode);
+                return null;
+            }
+
+            return ToStatistics(buffer.AsSpan(0, length), bytesReturned, driverName);
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Exception querying {Driver} driver statistics", driverName);
+            return null;
         }
         finally
         {
-            Marshal.FreeHGlobal(ptr);
+            DriverBufferPool.Return(buffer);
+        }
+    }
+
+    private unsafe DriverStatistics? ToStatistics(ReadOnlySpan<byte> buffer, uint bytesReturned, string driverName)
+    {
+        var native = MemoryMarshal.Read<NativeStatistics>(buffer);
+        if (bytesReturned < buffer.Length || native.Version != STATISTICS_VERSION)
+        {
+            _logger.LogWarning("Unsupported {Driver} driver statistics (version {Version}, {Size} bytes)",
+                driverName, native.Version, bytesReturned);
+            return null;
+        }
+
+        var tickNanoseconds = native.PerformanceFrequency != 0
+            ? 1_000_000_000.0 / native.PerformanceFrequency
+            : 0;
+
+        return new DriverStatistics
+        {
+            ProcessorCount = native.ProcessorCount,
+            RuleTableGeneration = native.RuleTableGeneration,
+            RuleCount = native.RuleCount,
+            OffloadedRuleCount = native.OffloadedRuleCount,
+            Classifications = native.Totals.Classifications,
+            Permits = native.Totals.Permits,
+            Blocks = native.Totals.Blocks,
+            CacheHits = native.Totals.CacheHits,
+            RuleLookups = native.Totals.RuleLookups,
+            EventsDropped = native.Totals.EventsDropped,
+            LockContentions = native.Totals.LockContentions,
+            LookupLatency = ToLatencyBuckets(native.Totals.LookupLatency, tickNanoseconds),
+            VerdictLatency = ToLatencyBuckets(native.Totals.VerdictLatency, tickNanoseconds),
+            DecisionLatency = ToLatencyBuckets(native.Totals.DecisionLatency, tickNanoseconds)
+        };
+    }
+
+    private static unsafe List<LatencyBucket> ToLatencyBuckets(ulong* counts, double tickNanoseconds)
+    {
+        // Bucket 0 is sub-tick; bucket n ends at 2^n ticks; the last is open-ended
+        var buckets = new List<LatencyBucket>(LATENCY_BUCKETS);
+        for (var i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            buckets.Add(new LatencyBucket
+            {
+                UpperBoundNanoseconds = i < LATENCY_BUCKETS - 1
+                    ? Math.Pow(2, i) * tickNanoseconds
+                    : null,
+                Count = counts[i]
+            });
+        }
+        return buckets;
+    }
+
+    /// <summary>
+    /// Issues an IOCTL on an overlapped driver handle and completes on the
+    /// I/O thread pool. Cancelling aborts the request in the driver; a
+    /// failed request throws <see cref="Win32Exception"/>. A default
+    /// segment passes no buffer. Buffers must not be reused until the
+    /// returned task completes.
+    /// </summary>
+    private static Task<uint> DeviceIoControlAsync(
+        ThreadPoolBoundHandle driver,
+        uint ioControlCode,
+        ArraySegment<byte> input,
+        ArraySegment<byte> output,
+        CancellationToken cancellationToken)
+    {
+        cancellationToken.ThrowIfCancellationRequested();
+        return new DriverIoOperation(driver, cancellationToken).Start(ioControlCode, input, output);
+    }
+
+    /// <summary>
+    /// Writes a network ruleset (SECUREHOST_RULESET_HEADER and records)
+    /// into <paramref name="buffer"/>; returns its length
+    /// </summary>
+    private static int WriteNetworkRuleset(
+        Span<byte> buffer,
+        IReadOnlyList<PolicyRule> rules,
+        Func<PolicyRule, bool> isDeferred,
+        ulong generation)
+    {
+        var headerSize = DriverWireFormat.HeaderSize;
+        var length = headerSize + rules.Count * DriverWireFormat.NetworkRuleSize;
+
+        var header = DriverWireFormat.CreateHeader(
+            DriverWireFormat.NetworkRulesetVersion, DriverWireFormat.NetworkRuleSize, rules.Count, generation);
+        MemoryMarshal.Write(buffer, in header);
+
+        var records = MemoryMarshal.Cast<byte, NetworkRuleRecord>(buffer[headerSize..length]);
+        for (var i = 0; i < rules.Count; i++)
+        {
+            records[i] = CreateNetworkRuleRecord(rules[i], isDeferred);
+        }
+
+        return length;
+    }
+
+    private static int WriteNetworkRuleDelta(
+        Span<byte> buffer,
+        IReadOnlyList<NetworkRuleChange> changes,
+        Func<PolicyRule, bool> isDeferred,
+        ulong generation,
+        ulong baseGeneration)
+    {
+        var headerSize = DriverWireFormat.DeltaHeaderSize;
+        var length = headerSize + changes.Count * DriverWireFormat.NetworkRuleDeltaSize;
+
+        var header = new RuleDeltaHeader
+        {
+            Header = DriverWireFormat.CreateHeader(
+                DriverWireFormat.NetworkRuleDeltaVersion, DriverWireFormat.NetworkRuleDeltaSize, changes.Count, generation),
+            BaseGeneration = baseGeneration
+        };
+        header.Header.HeaderSize = (uint)headerSize;
+        MemoryMarshal.Write(buffer, in header);
+
+        var records = MemoryMarshal.Cast<byte, NetworkRuleDeltaRecord>(buffer[headerSize..length]);
+        for (var i = 0; i < changes.Count; i++)
+        {
+            var change = changes[i];
+            records[i] = new NetworkRuleDeltaRecord
+            {
+                Operation = change.Rule != null ? DriverWireFormat.RuleDeltaUpsert : DriverWireFormat.RuleDeltaRemove,
+                InsertBefore = change.InsertBefore,
+                Rule = change.Rule != null
+                    ? CreateNetworkRuleRecord(change.Rule, isDeferred)
+                    : new NetworkRuleRecord { RuleId = change.RuleId }
+            };
         }
-        return bytes;
+
+        return length;
+    }
+
+    private static NetworkRuleRecord CreateNetworkRuleRecord(PolicyRule rule, Func<PolicyRule, bool> isDeferred)
+    {
+        var deferred = isDeferred(rule);
+
+        // A deferred rule's action is only the driver's fallback
+        var record = new NetworkRuleRecord
+        {
+            RuleId = rule.Id,
+            AppIdHash = TryGetAppIdHash(rule.ProcessName, out var appIdHash) ? appIdHash : 0,
+            ProcessId = rule.ProcessId,
+            Protocol = (ushort)rule.Protocol,
+            LocalPort = rule.LocalPort,
+            RemotePort = rule.RemotePort,
+            Action = (ushort)(deferred ? PolicyAction.Allow : rule.Action),
+            Flags = (rule.Enabled ? DriverWireFormat.RuleFlagEnabled : 0) |
+                    (deferred ? DriverWireFormat.RuleFlagDeferred : 0)
+        };
+
+        if (PolicyRule.TryParseAddressPrefix(rule.RemoteAddress, out var prefix))
+            record.SetRemotePrefix(prefix);
+
+        // Audit rules have always reported every permit
+        var auditMode = rule.PermitAuditMode == PermitAuditMode.Default && rule.Action == PolicyAction.Audit
+            ? PermitAuditMode.Full
+            : rule.PermitAuditMode;
+
+        record.AuditMode = (byte)auditMode;
+        if (auditMode is PermitAuditMode.Sampled or PermitAuditMode.RateLimited)
+            record.AuditRate = Math.Clamp(rule.PermitAuditRate, 1, DriverWireFormat.MaxAuditRate);
+
+        return record;
+    }
+
+    private static int DeviceRulesetSize(IReadOnlyList<PolicyRule> rules)
+    {
+        var length = DriverWireFormat.HeaderSize + rules.Count * DriverWireFormat.DeviceRuleSize;
+        for (var i = 0; i < rules.Count; i++)
+            length += DeviceProcessName(rules[i]).Length * sizeof(char);
+        return length;
+    }
+
+    /// <summary>
+    /// Writes a device rule batch (SECUREHOST_RULESET_HEADER, records, then
+    /// the process names) into <paramref name="buffer"/>; returns its length
+    /// </summary>
+    private static int WriteDeviceRuleset(Span<byte> buffer, IReadOnlyList<PolicyRule> rules)
+    {
+        var headerSize = DriverWireFormat.HeaderSize;
+        var recordsEnd = headerSize + rules.Count * DriverWireFormat.DeviceRuleSize;
+
+        var header = DriverWireFormat.CreateHeader(
+            DriverWireFormat.DeviceRulesetVersion, DriverWireFormat.DeviceRuleSize, rules.Count, 0);
+        MemoryMarshal.Write(buffer, in header);
+
+        var records = MemoryMarshal.Cast<byte, DeviceRuleRecord>(buffer[headerSize..recordsEnd]);
+        var nameOffset = recordsEnd;
+        for (var i = 0; i < rules.Count; i++)
+        {
+            var rule = rules[i];
+            var name = DeviceProcessName(rule);
+            var nameLength = name.Length * sizeof(char);
+
+            // Names are UTF-16 and unterminated
+            MemoryMarshal.AsBytes(name).CopyTo(buffer[nameOffset..]);
+
+            records[i] = new DeviceRuleRecord
+            {
+                RuleId = rule.Id,
+                ProcessId = rule.ProcessId,
+                DeviceType = (uint)rule.DeviceType,
+                Action = (ushort)rule.Action,
+                ProcessNameLength = (ushort)nameLength,
+                ProcessNameOffset = nameLength != 0 ? (uint)nameOffset : 0,
+                Flags = rule.Enabled ? DriverWireFormat.RuleFlagEnabled : 0
+            };
+
+            nameOffset += nameLength;
+        }
+
+        return nameOffset;
+    }
+
+    private static ReadOnlySpan<char> DeviceProcessName(PolicyRule rule)
+    {
+        var name = rule.ProcessName.AsSpan();
+        return name.Length > DriverWireFormat.MaxProcessNameChars
+            ? name[..DriverWireFormat.MaxProcessNameChars]
+            : name;
+    }
+
+    /// <summary>
+    /// Resolves an image path to the hash the WFP driver computes for the
+    /// ALE app ID of connections from that image (SecureHostHashAppId).
+    /// Only rooted paths without wildcards resolve; anything else, or a
+    /// path BFE cannot map to a device path, returns false.
+    /// </summary>
+    public static bool TryGetAppIdHash(string? imagePath, out ulong hash)
+    {
+        hash = 0;
+
+        if (string.IsNullOrEmpty(imagePath) ||
+            !Path.IsPathFullyQualified(imagePath) ||
+            imagePath.AsSpan().IndexOfAny('*', '?') >= 0)
+        {
+            return false;
+        }
+
+        if (s_appIdHashes.TryGetValue(imagePath, out hash))
+            return true;
+
+        if (FwpmGetAppIdFromFileName0(imagePath, out var appId) != 0)
+            return false;
+
+        try
+        {
+            var blob = Marshal.PtrToStructure<FwpByteBlob>(appId);
+            hash = HashAppId(blob.Data, (int)(blob.Size / sizeof(char)));
+        }
+        finally
+        {
+            FwpmFreeMemory0(ref appId);
+        }
+
+        s_appIdHashes[imagePath] = hash;
+        return true;
+    }
+
+    /// <summary>
+    /// 64-bit FNV-1a over the UTF-16 code units, ASCII case folded and
+    /// stopping at the first NUL; must match SecureHostHashAppId
+    /// </summary>
+    private static unsafe ulong HashAppId(IntPtr data, int length)
+    {
+        var chars = new ReadOnlySpan<char>((void*)data, length);
+        var hash = 0xCBF29CE484222325UL;
+
+        foreach (var ch in chars)
+        {
+            if (ch == '\0')
+                break;
+
+            var c = ch is >= 'A' and <= 'Z' ? (char)(ch + ('a' - 'A')) : ch;
+            hash = (hash ^ (byte)c) * 0x100000001B3UL;
+            hash = (hash ^ (byte)(c >> 8)) * 0x100000001B3UL;
+        }
+
+        return hash != 0 ? hash : 1;
     }
 
     // Native structures matching kernel driver structures
     [StructLayout(LayoutKind.Sequential)]
-    private struct NetworkRule
+    private unsafe struct NativeCounters
     {
-        public ulong RuleId;
-        public uint ProcessId;
-        public ushort Protocol;
-        public ushort LocalPort;
-        public ushort RemotePort;
-        public uint Action;
-        public byte Enabled;
+        public ulong Classifications;
+        public ulong Permits;
+        public ulong Blocks;
+        public ulong CacheHits;
+        public ulong RuleLookups;
+        public ulong EventsDropped;
+        public ulong LockContentions;
+        public fixed ulong LookupLatency[LATENCY_BUCKETS];
+        public fixed ulong VerdictLatency[LATENCY_BUCKETS];
+        public fixed ulong DecisionLatency[LATENCY_BUCKETS];
     }
 
     [StructLayout(LayoutKind.Sequential)]
-    private struct DeviceRule
+    private struct NativeStatistics
     {
-        public ulong RuleId;
-        public uint ProcessId;
-        public uint DeviceType;
-        public uint Action;
-        public byte Enabled;
+        public uint Version;
+        public uint ProcessorCount;
+        public ulong PerformanceFrequency;
+        public ulong RuleTableGeneration;
+        public uint RuleCount;
+        public uint OffloadedRuleCount;
+        public NativeCounters Totals;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct EventSubscribeInput
+    {
+        public ulong EventHandle;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct EventSubscribeOutput
+    {
+        public ulong BaseAddress;
+        public ulong Size;
     }
 
     // P/Invoke declarations
@@ -320,13 +1061,227 @@ public sealed class DriverCommunicationService : IDisposable
 
     [DllImport("kernel32.dll", SetLastError = true)]
     [return: MarshalAs(UnmanagedType.Bool)]
-    private static extern bool DeviceIoControl(
-        SafeFileHandle hDevice,
+    private static extern unsafe bool DeviceIoControl(
+        SafeHandle hDevice,
         uint dwIoControlCode,
-        byte[]? lpInBuffer,
+        void* lpInBuffer,
         uint nInBufferSize,
-        byte[]? lpOutBuffer,
+        void* lpOutBuffer,
         uint nOutBufferSize,
-        out uint lpBytesReturned,
-        IntPtr lpOverlapped);
+        IntPtr lpBytesReturned,
+        NativeOverlapped* lpOverlapped);
+
+    [DllImport("kernel32.dll", SetLastError = true)]
+    [return: MarshalAs(UnmanagedType.Bool)]
+    private static extern unsafe bool CancelIoEx(SafeHandle hFile, NativeOverlapped* lpOverlapped);
+
+    [StructLayout(LayoutKind.Sequential)]
+    private struct FwpByteBlob
+    {
+        public uint Size;
+        public IntPtr Data;
+    }
+
+    [DllImport("fwpuclnt.dll", CharSet = CharSet.Unicode)]
+    private static extern uint FwpmGetAppIdFromFileName0(
+        [MarshalAs(UnmanagedType.LPWStr)] string fileName,
+        out IntPtr appId);
+
+    [DllImport("fwpuclnt.dll")]
+    private static extern void FwpmFreeMemory0(ref IntPtr p);
+
+    /// <summary>
+    /// One overlapped IOCTL. The buffers are pinned by the overlapped
+    /// structure until the completion packet arrives; cancellation and
+    /// completion are serialized so CancelIoEx never sees a freed one.
+    /// </summary>
+    private sealed unsafe class DriverIoOperation
+    {
+        private static readonly IOCompletionCallback s_completionCallback = OnCompleted;
+
+        private readonly ThreadPoolBoundHandle _driver;
+        private readonly CancellationToken _cancellationToken;
+        private readonly TaskCompletionSource<uint> _completion =
+            new(TaskCreationOptions.RunContinuationsAsynchronously);
+        private readonly object _lock = new();
+        private NativeOverlapped* _overlapped;
+        private CancellationTokenRegistration _registration;
+
+        public DriverIoOperation(ThreadPoolBoundHandle driver, CancellationToken cancellationToken)
+        {
+            _driver = driver;
+            _cancellationToken = cancellationToken;
+        }
+
+        public Task<uint> Start(uint ioControlCode, ArraySegment<byte> input, ArraySegment<byte> output)
+        {
+            // The overlapped keeps the buffers pinned until completion
+            object? pinned = input.Array != null && output.Array != null
+                ? new object[] { input.Array, output.Array }
+                : (object?)input.Array ?? output.Array;
+
+            _overlapped = _driver.AllocateNativeOverlapped(s_completionCallback, this, pinned);
+
+            var inputBuffer = input.Array != null
+                ? (void*)Marshal.UnsafeAddrOfPinnedArrayElement(input.Array, input.Offset)
+                : null;
+            var outputBuffer = output.Array != null
+                ? (void*)Marshal.UnsafeAddrOfPinnedArrayElement(output.Array, output.Offset)
+                : null;
+
+            // Completion is always reported through the thread pool, even
+            // for requests the driver finishes immediately
+            if (!DeviceIoControl(
+                    _driver.Handle,
+                    ioControlCode,
+                    inputBuffer,
+                    (uint)input.Count,
+                    outputBuffer,
+                    (uint)output.Count,
+                    IntPtr.Zero,
+                    _overlapped))
+            {
+                var error = Marshal.GetLastWin32Error();
+                if (error != ERROR_IO_PENDING)
+                {
+                    _driver.FreeNativeOverlapped(_overlapped);
+                    _overlapped = null;
+                    return Task.FromException<uint>(new Win32Exception(error));
+                }
+            }
+
+            lock (_lock)
+            {
+                if (_overlapped != null && _cancellationToken.CanBeCanceled)
+                    _registration = _cancellationToken.Register(Cancel);
+            }
+
+            return _completion.Task;
+        }
+
+        private void Cancel()
+        {
+            lock (_lock)
+            {
+                if (_overlapped != null)
+                    CancelIoEx(_driver.Handle, _overlapped);
+            }
+        }
+
+        private static void OnCompleted(uint errorCode, uint numBytes, NativeOverlapped* overlapped)
+        {
+            var operation = (DriverIoOperation)ThreadPoolBoundHandle.GetNativeOverlappedState(overlapped)!;
+            CancellationTokenRegistration registration;
+
+            lock (operation._lock)
+            {
+                operation._driver.FreeNativeOverlapped(overlapped);
+                operation._overlapped = null;
+                registration = operation._registration;
+            }
+
+            registration.Dispose();
+
+            if (errorCode == 0)
+                operation._completion.SetResult(numBytes);
+            else if (errorCode == ERROR_OPERATION_ABORTED && operation._cancellationToken.IsCancellationRequested)
+                operation._completion.SetCanceled(operation._cancellationToken);
+            else
+                operation._completion.SetException(new Win32Exception((int)errorCode));
+        }
+    }
+}
+
+/// <summary>
+/// One network rule change for <see cref="DriverCommunicationService.UpdateNetworkRulesAsync"/>.
+/// With a rule, the rule is added or replaced and placed ahead of the
+/// rule with ID <see cref="InsertBefore"/> (0 = last); without one, the
+/// rule with <see cref="RuleId"/> is removed.
+/// </summary>
+public readonly record struct NetworkRuleChange(ulong RuleId, PolicyRule? Rule, ulong InsertBefore);
+
+/// <summary>
+/// Driver counters summed across processors
+/// </summary>
+public sealed class DriverStatistics
+{
+    public uint ProcessorCount { get; set; }
+    public ulong RuleTableGeneration { get; set; }
+    public uint RuleCount { get; set; }
+    public uint OffloadedRuleCount { get; set; }
+    public ulong Classifications { get; set; }
+    public ulong Permits { get; set; }
+    public ulong Blocks { get; set; }
+    public ulong CacheHits { get; set; }
+    public ulong RuleLookups { get; set; }
+    public ulong EventsDropped { get; set; }
+    public ulong LockContentions { get; set; }
+    public List<LatencyBucket> LookupLatency { get; set; } = new();
+
+    /// <summary>
+    /// Request to verdict for every verdict the driver decided itself
+    /// </summary>
+    public List<LatencyBucket> VerdictLatency { get; set; } = new();
+
+    /// <summary>
+    /// WFP only: pend to reauthorization for verdicts left to the service
+    /// </summary>
+    public List<LatencyBucket> DecisionLatency { get; set; } = new();
+}
+
+/// <summary>
+/// Access check reported by the device driver (SECUREHOST_DEVICE_EVENT)
+/// A record with Count above one summarizes repeated checks by one process
+/// between Timestamp and LastTimestamp. ProcessId and ProcessCreateTime
+/// together are the process's key in the drivers' process caches.
+/// CheckTime (performance counter) and VerdictTicks time the check, of
+/// the first repeat for a summary record.
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 64)]
+public struct DeviceAccessEventRecord
+{
+    public ulong Timestamp;
+    public uint ProcessId;
+    public byte DeviceType;
+    public byte Verdict;
+    public ushort Reserved;
+    public uint Count;
+    public uint Reserved2;
+    public ulong LastTimestamp;
+    public ulong ProcessCreateTime;
+    public ulong CorrelationId;
+    public ulong CheckTime;
+    public uint VerdictTicks;
+    public uint Reserved3;
+
+    public readonly ProcessKey ProcessKey => new(ProcessId, ProcessCreateTime);
+    public readonly DateTime TimestampUtc => DateTime.FromFileTimeUtc((long)Timestamp);
+    public readonly DateTime LastTimestampUtc => DateTime.FromFileTimeUtc((long)LastTimestamp);
+}
+
+/// <summary>
+/// A process as a driver's process cache knows it (SECUREHOST_PROCESS_RECORD)
+/// ImagePath is the NT path; UserSid is the binary SID.
+/// </summary>
+public sealed record DriverProcessInfo(
+    ProcessKey Key,
+    uint ParentProcessId,
+    string? ImagePath,
+    byte[]? UserSid,
+    byte? SigningLevel,
+    DateTime? ExitTimeUtc);
+
+/// <summary>
+/// Handles one device access event. The record is only valid for the
+/// duration of the call.
+/// </summary>
+public delegate void DeviceAccessEventHandler(in DeviceAccessEventRecord record);
+
+/// <summary>
+/// Driver latency histogram bucket
+/// </summary>
+public sealed class LatencyBucket
+{
+    public double? UpperBoundNanoseconds { get; set; }   // null for the open-ended bucket
+    public ulong Count { get; set; }
 }
@@ -0,0 +1,161 @@
+using System.Collections.Concurrent;
+using System.ComponentModel;
+using System.Runtime.InteropServices;
+using System.Security.Principal;
+using System.Text;
+using Microsoft.Extensions.Logging;
+using SecureHostCore.Models;
+
+namespace SecureHostService.Services;
+
+/// <summary>
+/// Resolves processes from the drivers' process metadata caches for the
+/// service's <see cref="SecureHostCore.Engine.ProcessMetadataCache"/>.
+/// The drivers report NT image paths and binary SIDs; this converts them
+/// to DOS paths and account names once per process, so nothing on the
+/// event paths does string work for a process already seen.
+/// </summary>
+public sealed class DriverProcessMetadataSource : IProcessMetadataSource
+{
+    private readonly DriverCommunicationService _driverService;
+    private readonly ILogger<DriverProcessMetadataSource> _logger;
+
+    // SID -> account name; SIDs are few and do not change names often
+    private readonly ConcurrentDictionary<string, string?> _accountNames = new(StringComparer.Ordinal);
+
+    // NT device prefix (\Device\HarddiskVolume3) -> drive (C:), rebuilt on a miss
+    private volatile KeyValuePair<string, string>[] _dosDevices = Array.Empty<KeyValuePair<string, string>>();
+    private long _dosDevicesRefreshedAt;
+
+    private static readonly TimeSpan s_dosDeviceRefreshInterval = TimeSpan.FromSeconds(30);
+
+    public DriverProcessMetadataSource(
+        DriverCommunicationService driverService,
+        ILogger<DriverProcessMetadataSource> logger)
+    {
+        _driverService = driverService ?? throw new ArgumentNullException(nameof(driverService));
+        _logger = logger ?? throw new ArgumentNullException(nameof(logger));
+    }
+
+    public async ValueTask<ProcessMetadata?> ResolveAsync(ProcessKey key, CancellationToken cancellationToken = default)
+    {
+        var results = await _driverService.QueryProcessesAsync(new[] { key }, cancellationToken);
+        if (results.Count == 0 || results[0] is not { } info)
+            return null;
+
+        var imagePath = info.ImagePath != null ? ToDosPath(info.ImagePath) : null;
+        var (userSid, userName) = ResolveUser(info.UserSid);
+
+        return new ProcessMetadata
+        {
+            Key = info.Key,
+            ParentProcessId = info.ParentProcessId,
+            ImagePath = imagePath,
+            Name = imagePath != null ? Path.GetFileNameWithoutExtension(imagePath) : null,
+            UserSid = userSid,
+            UserName = userName,
+            SigningLevel = info.SigningLevel,
+            ExitTimeUtc = info.ExitTimeUtc
+        };
+    }
+
+    private (string? Sid, string? Name) ResolveUser(byte[]? binarySid)
+    {
+        if (binarySid == null)
+            return (null, null);
+
+        string sid;
+        try
+        {
+            sid = new SecurityIdentifier(binarySid, 0).Value;
+        }
+        catch (ArgumentException)
+        {
+            return (null, null);
+        }
+
+        var name = _accountNames.GetOrAdd(sid, static value =>
+        {
+            try
+            {
+                return new SecurityIdentifier(value).Translate(typeof(NTAccount)).Value;
+            }
+            catch (Exception ex) when (ex is IdentityNotMappedException or SystemException)
+            {
+                return null;
+            }
+        });
+
+        return (sid, name);
+    }
+
+    /// <summary>
+    /// Converts \Device\HarddiskVolumeN\... to C:\...; paths on devices
+    /// without a drive letter are returned unchanged
+    /// </summary>
+    private string ToDosPath(string ntPath)
+    {
+        if (!ntPath.StartsWith(@"\Device\", StringComparison.OrdinalIgnoreCase))
+            return ntPath;
+
+        if (TryMapDosDevice(_dosDevices, ntPath, out var dosPath))
+            return dosPath;
+
+        // A volume mounted since the map was built
+        var now = Environment.TickCount64;
+        var last = Interlocked.Read(ref _dosDevicesRefreshedAt);
+        if (now - last >= (long)s_dosDeviceRefreshInterval.TotalMilliseconds &&
+            Interlocked.CompareExchange(ref _dosDevicesRefreshedAt, now, last) == last)
+        {
+            _dosDevices = BuildDosDeviceMap();
+            if (TryMapDosDevice(_dosDevices, ntPath, out dosPath))
+                return dosPath;
+        }
+
+        return ntPath;
+    }
+
+    private static bool TryMapDosDevice(KeyValuePair<string, string>[] map, string ntPath, out string dosPath)
+    {
+        foreach (var (device, drive) in map)
+        {
+            if (ntPath.Length > device.Length &&
+                ntPath[device.Length] == '\\' &&
+                ntPath.StartsWith(device, StringComparison.OrdinalIgnoreCase))
+            {
+                dosPath = string.Concat(drive, ntPath.AsSpan(device.Length));
+                return true;
+            }
+        }
+
+        dosPath = ntPath;
+        return false;
+    }
+
+    private KeyValuePair<string, string>[] BuildDosDeviceMap()
+    {
+        var map = new List<KeyValuePair<string, string>>();
+        var target = new StringBuilder(1024);
+
+        foreach (var drive in Environment.GetLogicalDrives())
+        {
+            var name = drive.TrimEnd('\\');
+            target.Clear();
+
+            if (QueryDosDevice(name, target, target.Capacity) == 0)
+            {
+                _logger.LogDebug("QueryDosDevice({Drive}) failed: {Error}",
+                    name, new Win32Exception(Marshal.GetLastWin32Error()).Message);
+                continue;
+            }
+
+            // The first target is the current one
+            map.Add(new KeyValuePair<string, string>(target.ToString(), name));
+        }
+
+        return map.ToArray();
+    }
+
+    [DllImport("kernel32.dll", CharSet = CharSet.Unicode, SetLastError = true)]
+    private static extern uint QueryDosDevice(string lpDeviceName, StringBuilder lpTargetPath, int ucchMax);
+}
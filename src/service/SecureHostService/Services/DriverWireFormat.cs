@@ -0,0 +1,227 @@
+using System.Collections.Concurrent;
+using System.Net;
+using System.Numerics;
+using System.Runtime.InteropServices;
+
+namespace SecureHostService.Services;
+
+/// <summary>
+/// Rule wire formats shared with the drivers (SecureHostWire.h)
+/// Records are blittable and written straight into driver I/O buffers.
+/// Fields are only ever appended, with zero meaning the old behaviour, and
+/// each batch states its own header and record size, so either side can
+/// grow a record without the other repacking.
+/// </summary>
+internal static class DriverWireFormat
+{
+    public const uint NetworkRulesetVersion = 3;
+    public const uint NetworkRuleDeltaVersion = 1;
+    public const uint DeviceRulesetVersion = 1;
+
+    public const uint RuleFlagEnabled = 0x1;
+    public const uint RuleFlagDeferred = 0x2;        // Network only
+
+    public const uint MaxAuditRate = 0xFFFFF;        // SECUREHOST_MAX_AUDIT_RATE
+
+    public const uint RuleDeltaUpsert = 1;
+    public const uint RuleDeltaRemove = 2;
+    public const int MaxRuleDeltas = 64;             // SECUREHOST_MAX_RULE_DELTAS
+
+    public const int MaxProcessNameChars = 256;
+    public const int MaxProcessQueries = 64;         // SECUREHOST_MAX_PROCESS_QUERIES
+
+    public static readonly int HeaderSize = Marshal.SizeOf<RulesetHeader>();
+    public static readonly int DeltaHeaderSize = Marshal.SizeOf<RuleDeltaHeader>();
+    public static readonly int NetworkRuleSize = Marshal.SizeOf<NetworkRuleRecord>();
+    public static readonly int NetworkRuleDeltaSize = Marshal.SizeOf<NetworkRuleDeltaRecord>();
+    public static readonly int DeviceRuleSize = Marshal.SizeOf<DeviceRuleRecord>();
+    public static readonly int ProcessQuerySize = Marshal.SizeOf<ProcessQueryRecord>();
+    public static readonly int ProcessInfoSize = Marshal.SizeOf<ProcessInfoRecord>();
+
+    public static RulesetHeader CreateHeader(uint version, int ruleSize, int ruleCount, ulong generation)
+    {
+        return new RulesetHeader
+        {
+            Version = version,
+            HeaderSize = (uint)HeaderSize,
+            RuleSize = (uint)ruleSize,
+            RuleCount = (uint)ruleCount,
+            Generation = generation
+        };
+    }
+}
+
+/// <summary>
+/// SECUREHOST_RULESET_HEADER
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 24)]
+internal struct RulesetHeader
+{
+    public uint Version;
+    public uint HeaderSize;
+    public uint RuleSize;
+    public uint RuleCount;
+    public ulong Generation;
+}
+
+/// <summary>
+/// SECUREHOST_RULE_DELTA_HEADER; Header.HeaderSize covers the whole struct
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 32)]
+internal struct RuleDeltaHeader
+{
+    public RulesetHeader Header;
+    public ulong BaseGeneration;
+}
+
+/// <summary>
+/// SECUREHOST_NETWORK_RULE_DELTA_RECORD
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 72)]
+internal struct NetworkRuleDeltaRecord
+{
+    public uint Operation;
+    public uint Reserved;
+    public ulong InsertBefore;              // Rule ID; 0 = at the end
+    public NetworkRuleRecord Rule;
+}
+
+/// <summary>
+/// SECUREHOST_NETWORK_RULE_RECORD
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 56)]
+internal unsafe struct NetworkRuleRecord
+{
+    public ulong RuleId;
+    public uint ProcessId;
+    public ushort Protocol;
+    public ushort LocalPort;
+    public ushort RemotePort;
+    public ushort Action;
+    public uint Flags;
+    public ulong AppIdHash;
+    public fixed byte RemoteAddress[16];    // Network byte order
+    public byte RemoteIpVersion;            // 4 or 6; 0 = any address
+    public byte RemotePrefixLength;
+    public byte AuditMode;                  // PermitAuditMode
+    public byte Reserved0;
+    public uint AuditRate;
+
+    public void SetRemotePrefix(IPNetwork prefix)
+    {
+        fixed (byte* address = RemoteAddress)
+        {
+            prefix.BaseAddress.TryWriteBytes(new Span<byte>(address, 16), out var length);
+            RemoteIpVersion = (byte)(length == 4 ? 4 : 6);
+        }
+
+        RemotePrefixLength = (byte)prefix.PrefixLength;
+    }
+}
+
+/// <summary>
+/// SECUREHOST_DEVICE_RULE_RECORD; the process name lives after the
+/// records at ProcessNameOffset from the start of the batch
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 32)]
+internal struct DeviceRuleRecord
+{
+    public ulong RuleId;
+    public uint ProcessId;
+    public uint DeviceType;
+    public ushort Action;
+    public ushort ProcessNameLength;        // Bytes
+    public uint ProcessNameOffset;
+    public uint Flags;
+    public uint Reserved;
+}
+
+/// <summary>
+/// SECUREHOST_PROCESS_QUERY; CreateTime 0 asks for the live process
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 16)]
+internal struct ProcessQueryRecord
+{
+    public uint ProcessId;
+    public uint Reserved;
+    public ulong CreateTime;
+}
+
+/// <summary>
+/// SECUREHOST_PROCESS_RECORD; strings live at their offsets from the
+/// start of the output
+/// </summary>
+[StructLayout(LayoutKind.Sequential, Size = 48)]
+internal struct ProcessInfoRecord
+{
+    public const uint FlagFound = 0x1;
+    public const uint FlagExited = 0x2;
+    public const uint FlagSigningLevel = 0x4;
+    public const uint FlagTruncated = 0x8;
+
+    public ulong CreateTime;
+    public ulong ExitTime;
+    public uint ProcessId;
+    public uint ParentProcessId;
+    public uint Flags;
+    public byte SigningLevel;
+    public byte Reserved0;
+    public ushort ImagePathLength;           // Bytes
+    public uint ImagePathOffset;
+    public ushort UserSidLength;             // Bytes
+    public ushort Reserved1;
+    public uint UserSidOffset;
+    public uint Reserved2;
+}
+
+/// <summary>
+/// Driver I/O buffers allocated on the pinned object heap and reused
+/// Buffers come in power-of-two buckets; <see cref="Rent"/> may return a
+/// larger buffer than asked for, so callers pass explicit lengths. Pinned
+/// buffers never fragment the compacting heaps while a request is out.
+/// </summary>
+internal static class DriverBufferPool
+{
+    private const int MinBucketShift = 12;      // 4 KB
+    private const int MaxBucketShift = 24;      // 16 MB; larger buffers are not pooled
+    private const int BuffersPerBucket = 4;
+
+    private static readonly ConcurrentQueue<byte[]>[] s_buckets = CreateBuckets();
+
+    public static byte[] Rent(int length)
+    {
+        ArgumentOutOfRangeException.ThrowIfNegative(length);
+
+        if (length > 1 << MaxBucketShift)
+            return GC.AllocateUninitializedArray<byte>(length, pinned: true);
+
+        var shift = Math.Max(MinBucketShift, BitOperations.Log2(BitOperations.RoundUpToPowerOf2((uint)length)));
+
+        if (s_buckets[shift - MinBucketShift].TryDequeue(out var buffer))
+            return buffer;
+
+        return GC.AllocateUninitializedArray<byte>(1 << shift, pinned: true);
+    }
+
+    public static void Return(byte[] buffer)
+    {
+        if (!BitOperations.IsPow2(buffer.Length))
+            return;
+
+        var shift = BitOperations.Log2((uint)buffer.Length);
+        if (shift < MinBucketShift || shift > MaxBucketShift)
+            return;
+
+        var bucket = s_buckets[shift - MinBucketShift];
+        if (bucket.Count < BuffersPerBucket)
+            bucket.Enqueue(buffer);
+    }
+
+    private static ConcurrentQueue<byte[]>[] CreateBuckets()
+    {
+        var buckets = new ConcurrentQueue<byte[]>[MaxBucketShift - MinBucketShift + 1];
+        for (var i = 0; i < buckets.Length; i++)
+            buckets[i] = new ConcurrentQueue<byte[]>();
+        return buckets;
+    }
+}
@@ -1,6 +1,7 @@
 using Microsoft.Extensions.Logging;
 using SecureHostCore.Engine;
 using SecureHostCore.Models;
+using System.Diagnostics;
 using System.Net;
 using System.Net.NetworkInformation;
 
@@ -15,16 +16,44 @@ public sealed class NetworkControlService
     private readonly ILogger<NetworkControlService> _logger;
     private readonly PolicyEngine _policyEngine;
     private readonly AuditEngine _auditEngine;
+    private readonly DriverCommunicationService _driverComm;
+    private readonly ConnectionTracker _connectionTracker;
+    private readonly AnomalyDetector _anomalyDetector;
+    private readonly ProcessMetadataCache _processCache;
+    private readonly LatencyTracer _latencyTracer;
     private Timer? _monitorTimer;
+    private ConnectionEventChannel? _eventChannel;
+    private CancellationTokenSource? _eventReaderCts;
+    private Task? _eventReaderTask;
+    private ConnectionDecisionChannel? _decisionChannel;
+    private CancellationTokenSource? _decisionCts;
+    private Task? _decisionTask;
+
+    // Interval for re-aborting a decision fetch while the reader stops
+    private static readonly TimeSpan DecisionCancelRetry = TimeSpan.FromMilliseconds(50);
+
+    // Longest a decision waits on a process lookup; a full batch of misses
+    // stays well inside the driver's one second fallback
+    private static readonly TimeSpan DecisionProcessLookupTimeout = TimeSpan.FromMilliseconds(10);
 
     public NetworkControlService(
         ILogger<NetworkControlService> logger,
         PolicyEngine policyEngine,
-        AuditEngine auditEngine)
+        AuditEngine auditEngine,
+        DriverCommunicationService driverComm,
+        ConnectionTracker connectionTracker,
+        AnomalyDetector anomalyDetector,
+        ProcessMetadataCache processCache,
+        LatencyTracer latencyTracer)
     {
         _logger = logger ?? throw new ArgumentNullException(nameof(logger));
         _policyEngine = policyEngine ?? throw new ArgumentNullException(nameof(policyEngine));
         _auditEngine = auditEngine ?? throw new ArgumentNullException(nameof(auditEngine));
+        _driverComm = driverComm ?? throw new ArgumentNullException(nameof(driverComm));
+        _connectionTracker = connectionTracker ?? throw new ArgumentNullException(nameof(connectionTracker));
+        _anomalyDetector = anomalyDetector ?? throw new ArgumentNullException(nameof(anomalyDetector));
+        _processCache = processCache ?? throw new ArgumentNullException(nameof(processCache));
+        _latencyTracer = latencyTracer ?? throw new ArgumentNullException(nameof(latencyTracer));
     }
 
     /// <summary>
@@ -34,6 +63,26 @@ public sealed class NetworkControlService
     {
         _logger.LogInformation("Starting network control service...");
 
+        // Connection verdicts come from the WFP driver when it is loaded;
+        // polling then only covers listeners
+        _eventChannel = await _driverComm.OpenConnectionEventChannelAsync(cancellationToken);
+        if (_eventChannel != null)
+        {
+            _eventReaderCts = new CancellationTokenSource();
+            _eventReaderTask = _eventChannel.RunAsync(OnConnectionEvent, _eventReaderCts.Token);
+            _logger.LogInformation("Reading connection events from WFP driver");
+        }
+
+        // Connections matching deferred rules are held by the driver until
+        // the policy engine decides them here
+        _decisionChannel = _driverComm.OpenConnectionDecisionChannel();
+        if (_decisionChannel != null)
+        {
+            _decisionCts = new CancellationTokenSource();
+            _decisionTask = _decisionChannel.RunAsync(OnDecisionRequest, _decisionCts.Token);
+            _logger.LogInformation("Answering connection decisions from WFP driver");
+        }
+
         // Start periodic monitoring (every 10 seconds)
         _monitorTimer = new Timer(
             MonitorNetworkConnections,
@@ -58,6 +107,40 @@ public sealed class NetworkControlService
             _monitorTimer = null;
         }
 
+        // The channel is unmapped when the driver handle closes, so the
+        // reader has to be finished before driver communication shuts down
+        if (_eventChannel != null)
+        {
+            _eventReaderCts!.Cancel();
+            await _eventReaderTask!;
+
+            _logger.LogInformation("Driver dropped {Count} connection events", _eventChannel.DroppedEvents);
+
+            _eventChannel.Dispose();
+            _eventChannel = null;
+            _eventReaderCts.Dispose();
+            _eventReaderCts = null;
+            _eventReaderTask = null;
+        }
+
+        if (_decisionChannel != null)
+        {
+            _decisionCts!.Cancel();
+            while (await Task.WhenAny(_decisionTask!, Task.Delay(DecisionCancelRetry)) != _decisionTask)
+            {
+                _decisionChannel.CancelPendingFetch();
+            }
+
+            _logger.LogInformation("Answered {Count} connection decisions", _decisionChannel.Decisions);
+
+            // Closing the handle releases anything still held to its fallback
+            _decisionChannel.Dispose();
+            _decisionChannel = null;
+            _decisionCts.Dispose();
+            _decisionCts = null;
+            _decisionTask = null;
+        }
+
         _logger.LogInformation("Network monitoring stopped");
     }
 
@@ -69,14 +152,20 @@ public sealed class NetworkControlService
         try
         {
             var properties = IPGlobalProperties.GetIPGlobalProperties();
-
-            // Monitor TCP connections
             var tcpConnections = properties.GetActiveTcpConnections();
-            foreach (var conn in tcpConnections)
+
+            // Drops closed connections from the stream API's table
+            _connectionTracker.Reconcile(tcpConnections);
+
+            // Monitor TCP connections (the driver reports them when available)
+            if (_eventChannel == null)
             {
-                if (conn.State == TcpState.Established)
+                foreach (var conn in tcpConnections)
                 {
-                    _ = EvaluateConnectionAsync(conn);
+                    if (conn.State == TcpState.Established)
+                    {
+                        _ = EvaluateConnectionAsync(conn);
+                    }
                 }
             }
 
@@ -151,6 +240,176 @@ public sealed class NetworkControlService
         }
     }
 
+    /// <summary>
+    /// Audits a connection verdict reported by the WFP driver
+    /// Runs on the channel reader thread; must not block
+    /// </summary>
+    private void OnConnectionEvent(in ConnectionEventRecord record)
+    {
+        var trace = TraceEvent(in record);
+
+        _connectionTracker.Record(in record, trace);
+        RecordObservation(in record);
+
+        if (record.Verdict != (byte)PolicyAction.Block)
+        {
+            // Permits are audited only for rules that ask; the driver has
+            // already sampled them
+            if ((PermitAuditMode)record.AuditMode is PermitAuditMode.Sampled or PermitAuditMode.RateLimited or PermitAuditMode.Full)
+                AuditPermit(in record, trace);
+            return;
+        }
+
+        var remoteAddress = record.GetRemoteAddress().ToString();
+        var protocol = (NetworkProtocol)record.Protocol;
+        var attempts = record.Count > 1 ? $" ({record.Count} attempts)" : string.Empty;
+
+        // The audit pipeline resolves the process from its cache key
+        _ = _auditEngine.LogNetworkEventAsync(
+            record.ProcessId,
+            string.Empty,
+            PolicyAction.Block,
+            new NetworkEventDetails
+            {
+                Protocol = protocol,
+                LocalAddress = record.GetLocalAddress().ToString(),
+                LocalPort = record.LocalPort,
+                RemoteAddress = remoteAddress,
+                RemotePort = record.RemotePort,
+                Direction = (NetworkDirection)record.Direction
+            },
+            record.RuleId != 0 ? record.RuleId : null,
+            $"{protocol} connection blocked by driver: {remoteAddress}:{record.RemotePort}{attempts}",
+            AuditEngine.CreateRepeatMetadata(record.Count, record.TimestampUtc, record.LastTimestampUtc),
+            record.ProcessCreateTime,
+            trace);
+    }
+
+    /// <summary>
+    /// Records the driver's verdict time and the event's delivery here.
+    /// A summary of repeats was held for its window, so only its verdict
+    /// time counts and later stages are not timed from it.
+    /// </summary>
+    private VerdictTrace TraceEvent(in ConnectionEventRecord record)
+    {
+        if (record.CorrelationId == 0 || record.ClassifyTime == 0)
+            return default;
+
+        _latencyTracer.Record(
+            record.ServiceVerdict ? LatencyStage.ServiceVerdict : LatencyStage.KernelVerdict,
+            record.CorrelationId,
+            record.VerdictTicks);
+
+        if (record.Count > 1)
+            return new VerdictTrace(record.CorrelationId, 0);
+
+        var verdictTime = (long)record.ClassifyTime + record.VerdictTicks;
+        _latencyTracer.RecordSince(LatencyStage.EventDelivery, record.CorrelationId, verdictTime);
+        return new VerdictTrace(record.CorrelationId, verdictTime);
+    }
+
+    private unsafe void RecordObservation(in ConnectionEventRecord record)
+    {
+        UInt128 remoteAddress;
+        fixed (byte* address = record.RemoteAddress)
+        {
+            remoteAddress = ConnectionObservation.PackAddress(new ReadOnlySpan<byte>(address, 16));
+        }
+
+        _anomalyDetector.RecordConnection(new ConnectionObservation(
+            record.ProcessKey,
+            remoteAddress,
+            record.IpVersion,
+            record.RemotePort,
+            (NetworkProtocol)record.Protocol,
+            record.Verdict == (byte)PolicyAction.Block,
+            record.Count,
+            record.Timestamp));
+    }
+
+    private void AuditPermit(in ConnectionEventRecord record, VerdictTrace trace)
+    {
+        var remoteAddress = record.GetRemoteAddress().ToString();
+        var protocol = (NetworkProtocol)record.Protocol;
+        var mode = (PermitAuditMode)record.AuditMode;
+        var weight = Math.Max(record.Weight, record.Count);
+        var connections = weight > 1 ? $" ({weight} connections)" : string.Empty;
+
+        _ = _auditEngine.LogNetworkEventAsync(
+            record.ProcessId,
+            string.Empty,
+            PolicyAction.Allow,
+            new NetworkEventDetails
+            {
+                Protocol = protocol,
+                LocalAddress = record.GetLocalAddress().ToString(),
+                LocalPort = record.LocalPort,
+                RemoteAddress = remoteAddress,
+                RemotePort = record.RemotePort,
+                Direction = (NetworkDirection)record.Direction
+            },
+            record.RuleId != 0 ? record.RuleId : null,
+            $"{protocol} connection permitted by driver: {remoteAddress}:{record.RemotePort}{connections}",
+            AuditEngine.CreateSampleMetadata(record.Count, weight, mode, record.TimestampUtc, record.LastTimestampUtc),
+            record.ProcessCreateTime,
+            trace);
+    }
+
+    /// <summary>
+    /// Decides a connection the WFP driver is holding for a deferred rule
+    /// Runs on the decision channel thread; the connection stays pended
+    /// until the batch is answered. The driver reports the applied verdict
+    /// as a connection event, so blocks are audited there. That event
+    /// carries the request's correlation ID and times the whole round trip.
+    /// </summary>
+    private PolicyAction OnDecisionRequest(in ConnectionDecisionRequest request)
+    {
+        _latencyTracer.RecordSince(LatencyStage.DecisionDelivery, request.CorrelationId, (long)request.PendTime);
+
+        var remoteAddress = request.GetRemoteAddress().ToString();
+        var processName = GetProcessImageName(request.ProcessKey);
+
+        var start = Stopwatch.GetTimestamp();
+        var decision = _policyEngine.EvaluateNetworkConnection(
+            request.ProcessId,
+            processName,
+            (NetworkProtocol)request.Protocol,
+            request.LocalPort,
+            request.RemotePort,
+            remoteAddress,
+            null);
+        _latencyTracer.Record(LatencyStage.PolicyEvaluation, request.CorrelationId, Stopwatch.GetTimestamp() - start);
+
+        return decision.Action;
+    }
+
+    /// <summary>
+    /// Image path of a process, or its name when the path is not known.
+    /// A miss waits briefly for the lookup, usually a driver query answered
+    /// from kernel memory. One that takes longer is decided without a name,
+    /// so only rules not scoped to a process can match it; the lookup goes
+    /// on and fills the cache for the process's next connection.
+    /// </summary>
+    private string GetProcessImageName(ProcessKey key)
+    {
+        if (!_processCache.TryGet(key, out var process))
+        {
+            // Off this thread: the local fallback inside the lookup is synchronous
+            var lookup = Task.Run(() => _processCache.GetAsync(key).AsTask());
+            if (lookup.Wait(DecisionProcessLookupTimeout))
+            {
+                process = lookup.Result;
+            }
+            else
+            {
+                _logger.LogDebug("Process lookup for {ProcessId} still running; deciding without its name",
+                    key.ProcessId);
+            }
+        }
+
+        return process?.ImagePath ?? process?.Name ?? "Unknown";
+    }
+
     /// <summary>
     /// Evaluates a listening port
     /// </summary>
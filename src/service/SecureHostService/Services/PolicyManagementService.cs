@@ -1,3 +1,4 @@
+using System.Globalization;
 using Microsoft.Extensions.Logging;
 using SecureHostCore.Engine;
 using SecureHostCore.Models;
@@ -16,6 +17,7 @@ public sealed class PolicyManagementService
     private readonly SecureStorage _storage;
     private readonly DriverCommunicationService _driverComm;
     private DeviceControlService? _deviceControl;
+    private readonly SemaphoreSlim _networkSyncLock = new(1, 1);
 
     private const string POLICY_STORAGE_KEY = "policies";
 
@@ -50,7 +52,7 @@ public sealed class PolicyManagementService
         {
             _logger.LogInformation("Loading policies from secure storage...");
 
-            var policies = await _storage.LoadAsync<List<PolicyRule>>(POLICY_STORAGE_KEY);
+            var policies = await _storage.LoadCollectionAsync<PolicyRule>(POLICY_STORAGE_KEY);
 
             if (policies == null || policies.Count == 0)
             {
@@ -59,12 +61,16 @@ public sealed class PolicyManagementService
                 return;
             }
 
-            foreach (var policy in policies)
+            foreach (var policy in policies.OrderBy(r => r.Id))
             {
-                var ruleId = _policyEngine.AddRule(policy);
-                await SyncRuleToDriverAsync(policy, cancellationToken);
+                _policyEngine.RestoreRule(policy);
             }
 
+            await SyncDeviceRulesToDriverAsync(
+                policies.Where(r => r.Type == PolicyRuleType.Device).ToList(),
+                cancellationToken);
+            await SyncNetworkRulesToDriverAsync(null, cancellationToken);
+
             _logger.LogInformation("Loaded {Count} policies from storage", policies.Count);
             await _auditEngine.LogPolicyChangeAsync(
                 "PoliciesLoaded",
@@ -87,8 +93,9 @@ public sealed class PolicyManagementService
         {
             _logger.LogInformation("Saving policies to secure storage...");
 
+            // Rewrites only the storage chunks whose rules changed
             var policies = _policyEngine.GetAllRules();
-            await _storage.SaveAsync(POLICY_STORAGE_KEY, policies.ToList());
+            await _storage.SaveCollectionAsync(POLICY_STORAGE_KEY, policies, GetStorageKey);
 
             _logger.LogInformation("Saved {Count} policies to storage", policies.Count);
             await _auditEngine.LogPolicyChangeAsync(
@@ -102,6 +109,36 @@ public sealed class PolicyManagementService
         }
     }
 
+    /// <summary>
+    /// Saves one rule, or its removal, to secure storage. Only the storage
+    /// chunk holding the rule is re-encrypted and written.
+    /// </summary>
+    private async Task SaveRuleAsync(ulong ruleId)
+    {
+        try
+        {
+            var rule = _policyEngine.GetRule(ruleId);
+            if (rule != null)
+            {
+                await _storage.UpdateCollectionAsync(
+                    POLICY_STORAGE_KEY, new[] { rule }, Array.Empty<string>(), GetStorageKey);
+            }
+            else
+            {
+                await _storage.UpdateCollectionAsync(
+                    POLICY_STORAGE_KEY, Array.Empty<PolicyRule>(), new[] { GetStorageKey(ruleId) }, GetStorageKey);
+            }
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error saving policy rule {RuleId}", ruleId);
+        }
+    }
+
+    private static string GetStorageKey(PolicyRule rule) => GetStorageKey(rule.Id);
+
+    private static string GetStorageKey(ulong ruleId) => ruleId.ToString(CultureInfo.InvariantCulture);
+
     /// <summary>
     /// Adds a new policy rule
     /// </summary>
@@ -109,8 +146,8 @@ public sealed class PolicyManagementService
     {
         var ruleId = _policyEngine.AddRule(rule);
 
-        await SyncRuleToDriverAsync(rule, cancellationToken);
-        await SavePoliciesAsync(cancellationToken);
+        await SyncRuleToDriverAsync(ruleId, rule, cancellationToken);
+        await SaveRuleAsync(ruleId);
 
         // Enforce device policies if this is a device rule
         if (rule.Type == PolicyRuleType.Device && _deviceControl != null)
@@ -135,8 +172,8 @@ public sealed class PolicyManagementService
         if (!success)
             return false;
 
-        await SyncRuleToDriverAsync(rule, cancellationToken);
-        await SavePoliciesAsync(cancellationToken);
+        await SyncRuleToDriverAsync(ruleId, rule, cancellationToken);
+        await SaveRuleAsync(ruleId);
 
         // Enforce device policies if this is a device rule
         if (rule.Type == PolicyRuleType.Device && _deviceControl != null)
@@ -167,7 +204,18 @@ public sealed class PolicyManagementService
         if (!success)
             return false;
 
-        await SavePoliciesAsync(cancellationToken);
+        if (rule.Type == PolicyRuleType.Network)
+        {
+            await SyncNetworkRulesToDriverAsync(ruleId, cancellationToken);
+        }
+        else if (isDeviceRule)
+        {
+            // A disabled record removes the driver's policy
+            rule.Enabled = false;
+            await SyncDeviceRulesToDriverAsync(new[] { rule }, cancellationToken);
+        }
+
+        await SaveRuleAsync(ruleId);
 
         // Enforce device policies if this was a device rule
         if (isDeviceRule && _deviceControl != null)
@@ -186,40 +234,113 @@ public sealed class PolicyManagementService
     /// <summary>
     /// Syncs a rule to the kernel driver
     /// </summary>
-    private async Task SyncRuleToDriverAsync(PolicyRule rule, CancellationToken cancellationToken)
+    private async Task SyncRuleToDriverAsync(ulong ruleId, PolicyRule rule, CancellationToken cancellationToken)
     {
-        if (!rule.Enabled)
+        if (rule.Type == PolicyRuleType.Network)
+        {
+            await SyncNetworkRulesToDriverAsync(ruleId, cancellationToken);
             return;
+        }
+
+        if (rule.Type == PolicyRuleType.Device)
+        {
+            await SyncDeviceRulesToDriverAsync(new[] { rule }, cancellationToken);
+        }
+    }
 
+    /// <summary>
+    /// Applies device rules to the device driver in one round trip;
+    /// disabled rules are removed from it
+    /// </summary>
+    private async Task SyncDeviceRulesToDriverAsync(
+        IReadOnlyList<PolicyRule> rules,
+        CancellationToken cancellationToken)
+    {
         try
         {
-            if (rule.Type == PolicyRuleType.Network)
-            {
-                await _driverComm.SendNetworkRuleAsync(
-                    rule.Id,
-                    rule.ProcessId,
-                    (ushort)rule.Protocol,
-                    rule.LocalPort,
-                    rule.RemotePort,
-                    (uint)rule.Action,
-                    cancellationToken);
-            }
-            else if (rule.Type == PolicyRuleType.Device)
+            await _driverComm.ApplyDeviceRulesAsync(rules, cancellationToken);
+        }
+        catch (Exception ex)
+        {
+            _logger.LogError(ex, "Error syncing {Count} device rules to driver", rules.Count);
+        }
+    }
+
+    /// <summary>
+    /// Brings the WFP driver's rule set up to date with the current network
+    /// rules in one round trip. Rules are sent in evaluation order; those
+    /// the driver cannot evaluate itself are deferred to the service. When
+    /// only <paramref name="changedRuleId"/> changed, the driver is sent
+    /// just that rule, so flows other rules decide keep their cached
+    /// verdicts; the whole set is loaded if the driver cannot apply it.
+    /// Either way the driver never sees a partially applied policy.
+    /// </summary>
+    private async Task SyncNetworkRulesToDriverAsync(ulong? changedRuleId, CancellationToken cancellationToken)
+    {
+        // Serialize snapshot and load so generations reach the driver in order
+        await _networkSyncLock.WaitAsync(cancellationToken);
+        try
+        {
+            var rules = _policyEngine.GetAllRules()
+                .Where(r => r.Type == PolicyRuleType.Network && r.Enabled)
+                .OrderByDescending(r => r.Priority)
+                .ThenBy(r => r.Id)
+                .ToList();
+
+            if (changedRuleId is { } id)
             {
-                await _driverComm.SendDeviceRuleAsync(
-                    rule.Id,
-                    rule.ProcessId,
-                    (uint)rule.DeviceType,
-                    (uint)rule.Action,
-                    cancellationToken);
+                // A rule that is no longer in the set (removed, disabled
+                // or retyped) is removed; otherwise it is placed ahead of
+                // its successor
+                var index = rules.FindIndex(r => r.Id == id);
+                var change = index < 0
+                    ? new NetworkRuleChange(id, null, 0)
+                    : new NetworkRuleChange(id, rules[index], index + 1 < rules.Count ? rules[index + 1].Id : 0);
+
+                if (await _driverComm.UpdateNetworkRulesAsync(
+                        rules,
+                        new[] { change },
+                        r => !IsDriverEnforceable(r),
+                        cancellationToken))
+                {
+                    return;
+                }
             }
+
+            await _driverComm.LoadNetworkRulesetAsync(
+                rules,
+                r => !IsDriverEnforceable(r),
+                cancellationToken);
         }
         catch (Exception ex)
         {
-            _logger.LogError(ex, "Error syncing rule {RuleId} to driver", rule.Id);
+            _logger.LogError(ex, "Error syncing network rules to driver");
+        }
+        finally
+        {
+            _networkSyncLock.Release();
         }
     }
 
+    /// <summary>
+    /// Whether the driver can evaluate every condition of a network rule.
+    /// A process name is only driver-side when it is a full image path the
+    /// driver can match by app ID, and a remote address when it is a CIDR
+    /// prefix or single address. Rules scoped by a process name or address
+    /// pattern, user or validity window are loaded as deferred, and the
+    /// driver asks the service.
+    /// </summary>
+    private static bool IsDriverEnforceable(PolicyRule rule)
+    {
+        return (string.IsNullOrEmpty(rule.ProcessName) ||
+                DriverCommunicationService.TryGetAppIdHash(rule.ProcessName, out _)) &&
+               (string.IsNullOrEmpty(rule.RemoteAddress) ||
+                PolicyRule.TryParseAddressPrefix(rule.RemoteAddress, out _)) &&
+               string.IsNullOrEmpty(rule.UserSid) &&
+               rule.ValidFrom == null &&
+               rule.ValidUntil == null;
+    }
+
     /// <summary>
     /// Loads default policies on first run
     /// </summary>
@@ -268,10 +389,14 @@ public sealed class PolicyManagementService
 
         foreach (var rule in defaultRules)
         {
-            var ruleId = _policyEngine.AddRule(rule);
-            await SyncRuleToDriverAsync(rule, cancellationToken);
+            _policyEngine.AddRule(rule);
         }
 
+        await SyncDeviceRulesToDriverAsync(
+            defaultRules.Where(r => r.Type == PolicyRuleType.Device).ToList(),
+            cancellationToken);
+        await SyncNetworkRulesToDriverAsync(null, cancellationToken);
+
         await SavePoliciesAsync(cancellationToken);
 
         // Enforce device policies after loading defaults
@@ -0,0 +1,745 @@
+/*++
+
+Module Name:
+    bench.c
+
+Abstract:
+    User-mode benchmark for the drivers' policy matching hot paths.
+    Compiles SecureHostMatch.h, the code the WFP classify path and the
+    device access check run, against synthetic policies of increasing
+    size and reports per-operation cost.
+
+    For each size it prints:
+      ns/op     mean over a long run cycling through pre-generated inputs
+      p50, p99  per-operation latency from timestamp-counter samples
+      lines/op  distinct cache lines a lookup touches (a footprint
+                estimate; hardware miss counters need a kernel profiler)
+
+    Results are checked against a linear reference scan first, so the
+    run also fails if the matching logic is wrong.
+
+    Usage:
+      SecureHostBench [--sizes 100,1000,10000,100000] [--ops N]
+                      [--hit PERCENT] [--seed N] [--max-ns NS]
+
+    With --max-ns the exit code is 2 if any mean exceeds NS, so the
+    benchmark can gate a build.
+
+Environment:
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SecureHostMatch.h"
+
+#define BENCH_DEFAULT_OPS           2000000u
+#define BENCH_DEFAULT_HIT_PERCENT   80u
+#define BENCH_INPUT_POOL            65536u      // Power of two
+#define BENCH_LATENCY_SAMPLES       200000u
+#define BENCH_VERIFY_INPUTS         20000u
+#define BENCH_MAX_SIZES             16u
+#define BENCH_DEVICE_TYPES          5u
+#define BENCH_CACHE_LINE            64u
+#define BENCH_MAX_LINES             64u
+
+#define BENCH_ACTION_BLOCK          0x1001u     // FWP_ACTION_BLOCK
+#define BENCH_ACTION_PERMIT         0x1002u     // FWP_ACTION_PERMIT
+
+typedef struct _BENCH_OPTIONS {
+    UINT32 Sizes[BENCH_MAX_SIZES];
+    UINT32 SizeCount;
+    UINT32 Operations;
+    UINT32 HitPercent;
+    UINT32 Seed;
+    double MaxNanoseconds;          // 0 = no gate
+} BENCH_OPTIONS;
+
+typedef struct _BENCH_RESULT {
+    double NanosecondsPerOp;
+    double P50;
+    double P99;
+    double LinesPerOp;
+    double MatchRate;
+} BENCH_RESULT;
+
+static double TicksPerNanosecond;
+
+//
+// Keeps the compiler from discarding benchmarked work
+//
+static volatile UINT64 BenchSink;
+
+static UINT64
+BenchNow(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (UINT64)now.QuadPart;
+}
+
+static double
+BenchElapsedNanoseconds(UINT64 Start, UINT64 End)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (double)(End - Start) * 1e9 / (double)frequency.QuadPart;
+}
+
+//
+// Calibrates the timestamp counter against the performance counter
+//
+static void
+BenchCalibrate(void)
+{
+    UINT64 qpcStart = BenchNow();
+    UINT64 tscStart = __rdtsc();
+    UINT64 qpcEnd;
+
+    do {
+        qpcEnd = BenchNow();
+    } while (BenchElapsedNanoseconds(qpcStart, qpcEnd) < 200e6);
+
+    TicksPerNanosecond = (double)(__rdtsc() - tscStart) / BenchElapsedNanoseconds(qpcStart, qpcEnd);
+}
+
+//
+// Smallest back-to-back timestamp delta, subtracted from each sample
+//
+static UINT64
+BenchTimerOverhead(void)
+{
+    UINT64 best = MAXUINT64;
+    UINT32 i;
+
+    for (i = 0; i < 10000; i++) {
+        UINT64 start = __rdtsc();
+        UINT64 delta = __rdtsc() - start;
+        if (delta < best) {
+            best = delta;
+        }
+    }
+
+    return best;
+}
+
+static int
+BenchCompareTicks(const void* Left, const void* Right)
+{
+    UINT64 left = *(const UINT64*)Left;
+    UINT64 right = *(const UINT64*)Right;
+    return (left > right) - (left < right);
+}
+
+static void
+BenchPercentiles(UINT64* Samples, UINT32 Count, BENCH_RESULT* Result)
+{
+    qsort(Samples, Count, sizeof(UINT64), BenchCompareTicks);
+    Result->P50 = (double)Samples[Count / 2] / TicksPerNanosecond;
+    Result->P99 = (double)Samples[(UINT32)((UINT64)Count * 99 / 100)] / TicksPerNanosecond;
+}
+
+//
+// Counts distinct cache lines in a small set
+//
+typedef struct _BENCH_LINES {
+    ULONG_PTR Lines[BENCH_MAX_LINES];
+    UINT32 Count;
+} BENCH_LINES;
+
+static void
+BenchTouch(BENCH_LINES* Set, const void* Address, SIZE_T Size)
+{
+    ULONG_PTR line = (ULONG_PTR)Address / BENCH_CACHE_LINE;
+    ULONG_PTR last = ((ULONG_PTR)Address + Size - 1) / BENCH_CACHE_LINE;
+    UINT32 i;
+
+    for (; line <= last; line++) {
+        for (i = 0; i < Set->Count; i++) {
+            if (Set->Lines[i] == line) {
+                break;
+            }
+        }
+        if (i == Set->Count && Set->Count < BENCH_MAX_LINES) {
+            Set->Lines[Set->Count++] = line;
+        }
+    }
+}
+
+/*++
+
+    Network rules
+
+--*/
+
+//
+// Generates a rule set with the shape of a large deployment: mostly
+// port, per-process and per-application rules, a blocklist-style share
+// of remote prefixes (mostly IPv4), a few protocol-wide ones.
+// Application hashes share SecureHostSynthesizeConnection's 4096-app space.
+//
+static void
+BenchGenerateRules(SECUREHOST_POLICY_RULE* Rules, UINT32 Count, UINT32* State)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count; i++) {
+        SECUREHOST_POLICY_RULE* rule = &Rules[i];
+        UINT32 kind = SecureHostWorkloadRandom(State) % 100;
+
+        memset(rule, 0, sizeof(*rule));
+        rule->RuleId = i + 1;
+        rule->Enabled = (SecureHostWorkloadRandom(State) % 100) < 95;
+        rule->Action = (SecureHostWorkloadRandom(State) & 1) ? BENCH_ACTION_BLOCK : BENCH_ACTION_PERMIT;
+
+        if (SecureHostWorkloadRandom(State) & 1) {
+            rule->Protocol = (SecureHostWorkloadRandom(State) & 1) ? 6 : 17;
+        }
+
+        if (kind < 25) {
+            rule->RemotePort = (UINT16)(SecureHostWorkloadRandom(State) % 65535 + 1);
+        } else if (kind < 40) {
+            rule->LocalPort = (UINT16)(SecureHostWorkloadRandom(State) % 65535 + 1);
+        } else if (kind < 52) {
+            rule->ProcessId = (SecureHostWorkloadRandom(State) & 0xFFFCu) + 4;
+        } else if (kind < 60) {
+            rule->AppIdHash = 0x100000000ull | (SecureHostWorkloadRandom(State) & 0xFFFu);
+        } else if (kind < 80) {
+            UINT32 word;
+
+            rule->Protocol = 0;
+            if (SecureHostWorkloadRandom(State) % 8 != 0) {
+                rule->RemoteIpVersion = 4;
+                rule->RemotePrefixLength = (UINT8)(16 + SecureHostWorkloadRandom(State) % 17);
+                rule->RemoteAddress.V4 = SecureHostWorkloadRandom(State);
+            } else {
+                rule->RemoteIpVersion = 6;
+                rule->RemotePrefixLength = (UINT8)(32 + SecureHostWorkloadRandom(State) % 33);
+                for (word = 0; word < 4; word++) {
+                    ((UINT32*)rule->RemoteAddress.Bytes)[word] = SecureHostWorkloadRandom(State);
+                }
+            }
+        } else if (kind < 98) {
+            rule->ProcessId = (SecureHostWorkloadRandom(State) & 0xFFFCu) + 4;
+            rule->RemotePort = (UINT16)(SecureHostWorkloadRandom(State) % 65535 + 1);
+        } else {
+            //
+            // Generic bucket. ICMP-scoped so it is probed on every lookup
+            // without swallowing the TCP/UDP traffic being measured.
+            //
+            rule->Protocol = 1;
+        }
+    }
+}
+
+static SECUREHOST_RULE_TABLE*
+BenchCompileRules(const SECUREHOST_POLICY_RULE* Rules, UINT32 Count)
+{
+    SECUREHOST_RULE_TABLE_LAYOUT layout;
+    SECUREHOST_RULE_TABLE* table;
+    UINT32* bucketFill;
+
+    SecureHostGetRuleTableLayout(Rules, Count, &layout);
+
+    table = (SECUREHOST_RULE_TABLE*)_aligned_malloc(layout.TotalSize, SYSTEM_CACHE_ALIGNMENT_SIZE);
+    bucketFill = (UINT32*)calloc((SIZE_T)layout.BucketCount + 1, sizeof(UINT32));
+
+    if (table == NULL || bucketFill == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    SecureHostBuildRuleTable(Rules, Count, 1, &layout, table, bucketFill);
+    free(bucketFill);
+
+    return table;
+}
+
+static BOOLEAN
+BenchPrefixMatches(const SECUREHOST_POLICY_RULE* Rule, const SECUREHOST_CONNECTION_KEY* Key)
+{
+    UINT64 ruleHigh;
+    UINT64 ruleLow;
+    UINT64 keyHigh;
+    UINT64 keyLow;
+
+    if (Rule->RemoteIpVersion == 0) {
+        return TRUE;
+    }
+
+    if (Rule->RemoteIpVersion != Key->IpVersion) {
+        return FALSE;
+    }
+
+    SecureHostAddressToHost(&Rule->RemoteAddress, &ruleHigh, &ruleLow);
+    SecureHostAddressToHost(&Key->RemoteAddress, &keyHigh, &keyLow);
+    SecureHostMaskPrefix(&ruleHigh, &ruleLow, Rule->RemotePrefixLength);
+    SecureHostMaskPrefix(&keyHigh, &keyLow, Rule->RemotePrefixLength);
+
+    return ruleHigh == keyHigh && ruleLow == keyLow;
+}
+
+//
+// Reference: first enabled rule in source order that matches
+//
+static UINT64
+BenchReferenceLookup(const SECUREHOST_POLICY_RULE* Rules, UINT32 Count, const SECUREHOST_CONNECTION_KEY* Key)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count; i++) {
+        const SECUREHOST_POLICY_RULE* rule = &Rules[i];
+
+        if (rule->Enabled &&
+            (rule->RemotePort == 0 || rule->RemotePort == Key->RemotePort) &&
+            (rule->LocalPort == 0 || rule->LocalPort == Key->LocalPort) &&
+            (rule->Protocol == 0 || rule->Protocol == Key->Protocol) &&
+            (rule->ProcessId == 0 || rule->ProcessId == Key->ProcessId) &&
+            (rule->AppIdHash == 0 || rule->AppIdHash == Key->AppIdHash) &&
+            BenchPrefixMatches(rule, Key)) {
+            return rule->RuleId;
+        }
+    }
+
+    return 0;
+}
+
+static void
+BenchRuleRangeLines(BENCH_LINES* Lines,
+                    const SECUREHOST_RULE_TABLE* Table,
+                    UINT32 Start,
+                    UINT32 End,
+                    const SECUREHOST_CONNECTION_KEY* Key,
+                    UINT32* BestOrdinal)
+{
+    UINT32 index;
+
+    for (index = Start; index < End; index++) {
+        const SECUREHOST_COMPILED_RULE* rule = &Table->Rules[index];
+
+        BenchTouch(Lines, rule, sizeof(*rule));
+
+        if (rule->Ordinal >= *BestOrdinal) {
+            break;
+        }
+
+        if (SecureHostRuleMatches(rule, Key)) {
+            *BestOrdinal = rule->Ordinal;
+            break;
+        }
+    }
+}
+
+//
+// Mirrors SecureHostLookupRule's probe sequence, recording what it reads
+//
+static UINT32
+BenchLookupLines(const SECUREHOST_RULE_TABLE* Table, const SECUREHOST_CONNECTION_KEY* Key)
+{
+    BENCH_LINES lines = {0};
+    UINT32 bestOrdinal = MAXUINT32;
+    UINT32 buckets[5];
+    UINT32 bucketCount = 0;
+    UINT32 probe;
+
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_REMOTE_PORT, Key->RemotePort) & Table->BucketMask;
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_LOCAL_PORT, Key->LocalPort) & Table->BucketMask;
+    buckets[bucketCount++] = SecureHostHashRuleKey(SECUREHOST_RULE_KEY_PROCESS_ID, Key->ProcessId) & Table->BucketMask;
+    if (Key->AppIdHash != 0) {
+        buckets[bucketCount++] = SecureHostHashRuleKey(
+            SECUREHOST_RULE_KEY_APP_ID, SecureHostAppIdKeyValue(Key->AppIdHash)) & Table->BucketMask;
+    }
+    buckets[bucketCount++] = Table->BucketMask + 1;
+
+    BenchTouch(&lines, Table, sizeof(*Table));
+
+    for (probe = 0; probe < bucketCount; probe++) {
+        BenchTouch(&lines, &Table->BucketStart[buckets[probe]], 2 * sizeof(UINT32));
+        BenchRuleRangeLines(&lines, Table, Table->BucketStart[buckets[probe]],
+                            Table->BucketStart[buckets[probe] + 1], Key, &bestOrdinal);
+    }
+
+    if (Key->IpVersion == 4 || Key->IpVersion == 6) {
+        const SECUREHOST_PREFIX_SET* set = &Table->RemotePrefixes[Key->IpVersion == 6];
+
+        if (set->Count != 0) {
+            UINT64 high;
+            UINT64 low;
+            UINT32 front;
+            UINT32 first;
+            UINT32 last;
+            UINT32 prefix;
+
+            SecureHostAddressToHost(&Key->RemoteAddress, &high, &low);
+            front = SecureHostPrefixFrontIndex(high, set->FrontBits);
+            BenchTouch(&lines, &set->Front[front], 2 * sizeof(UINT32));
+
+            first = set->Front[front];
+            last = set->Front[front + 1];
+            while (first < last) {
+                UINT32 middle = first + (last - first) / 2;
+
+                BenchTouch(&lines, &set->Prefixes[middle], sizeof(SECUREHOST_REMOTE_PREFIX));
+                if (set->Prefixes[middle].High < high ||
+                    (set->Prefixes[middle].High == high && set->Prefixes[middle].Low <= low)) {
+                    first = middle + 1;
+                } else {
+                    last = middle;
+                }
+            }
+
+            for (prefix = first - 1; prefix != SECUREHOST_PREFIX_NONE; prefix = set->Prefixes[prefix].Parent) {
+                BenchTouch(&lines, &set->Prefixes[prefix], sizeof(SECUREHOST_REMOTE_PREFIX));
+                if (SecureHostPrefixContains(&set->Prefixes[prefix], high, low)) {
+                    break;
+                }
+            }
+
+            for (; prefix != SECUREHOST_PREFIX_NONE && set->Prefixes[prefix].ChainOrdinal < bestOrdinal;
+                 prefix = set->Prefixes[prefix].Parent) {
+                BenchTouch(&lines, &set->Prefixes[prefix], 2 * sizeof(SECUREHOST_REMOTE_PREFIX));
+                BenchRuleRangeLines(&lines, Table, set->Prefixes[prefix].RuleStart,
+                                    SecureHostPrefixRuleEnd(set, prefix), Key, &bestOrdinal);
+            }
+        }
+    }
+
+    return lines.Count;
+}
+
+static int
+BenchNetwork(UINT32 Size, const BENCH_OPTIONS* Options, UINT64 Overhead, BENCH_RESULT* Result)
+{
+    SECUREHOST_POLICY_RULE* rules;
+    SECUREHOST_RULE_TABLE* table;
+    SECUREHOST_CONNECTION_KEY* keys;
+    UINT64* samples;
+    UINT64 matches = 0;
+    UINT64 lines = 0;
+    UINT64 start;
+    UINT32 state = Options->Seed;
+    UINT32 i;
+
+    rules = (SECUREHOST_POLICY_RULE*)malloc((SIZE_T)Size * sizeof(SECUREHOST_POLICY_RULE));
+    keys = (SECUREHOST_CONNECTION_KEY*)malloc(BENCH_INPUT_POOL * sizeof(SECUREHOST_CONNECTION_KEY));
+    samples = (UINT64*)malloc(BENCH_LATENCY_SAMPLES * sizeof(UINT64));
+
+    if (rules == NULL || keys == NULL || samples == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    BenchGenerateRules(rules, Size, &state);
+    table = BenchCompileRules(rules, Size);
+
+    for (i = 0; i < BENCH_INPUT_POOL; i++) {
+        SecureHostSynthesizeConnection(table, Options->HitPercent, &state, &keys[i]);
+    }
+
+    //
+    // Correctness against the reference scan
+    //
+    for (i = 0; i < BENCH_VERIFY_INPUTS; i++) {
+        const SECUREHOST_CONNECTION_KEY* key = &keys[i % BENCH_INPUT_POOL];
+        const SECUREHOST_COMPILED_RULE* rule = SecureHostLookupRule(table, key);
+        UINT64 expected = BenchReferenceLookup(rules, Size, key);
+
+        if ((rule != NULL ? rule->RuleId : 0) != expected) {
+            fprintf(stderr, "network lookup mismatch at %u rules: got %llu, expected %llu\n",
+                    Size, (unsigned long long)(rule != NULL ? rule->RuleId : 0),
+                    (unsigned long long)expected);
+            return 1;
+        }
+
+        lines += BenchLookupLines(table, key);
+    }
+
+    //
+    // Throughput
+    //
+    start = BenchNow();
+    for (i = 0; i < Options->Operations; i++) {
+        if (SecureHostLookupRule(table, &keys[i & (BENCH_INPUT_POOL - 1)]) != NULL) {
+            matches++;
+        }
+    }
+    Result->NanosecondsPerOp = BenchElapsedNanoseconds(start, BenchNow()) / Options->Operations;
+
+    //
+    // Per-operation latency
+    //
+    for (i = 0; i < BENCH_LATENCY_SAMPLES; i++) {
+        const SECUREHOST_CONNECTION_KEY* key = &keys[i & (BENCH_INPUT_POOL - 1)];
+        UINT64 begin = __rdtsc();
+        BenchSink += (UINT64)(ULONG_PTR)SecureHostLookupRule(table, key);
+        samples[i] = __rdtsc() - begin;
+        samples[i] = (samples[i] > Overhead) ? samples[i] - Overhead : 0;
+    }
+
+    BenchPercentiles(samples, BENCH_LATENCY_SAMPLES, Result);
+    Result->LinesPerOp = (double)lines / BENCH_VERIFY_INPUTS;
+    Result->MatchRate = 100.0 * (double)matches / Options->Operations;
+
+    _aligned_free(table);
+    free(rules);
+    free(keys);
+    free(samples);
+    return 0;
+}
+
+/*++
+
+    Device policies
+
+--*/
+
+static void
+BenchGeneratePolicies(SECUREHOST_DEVICE_POLICY* Policies, UINT32 Count, UINT32* State)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count; i++) {
+        Policies[i].DeviceType = (UINT8)(SecureHostWorkloadRandom(State) % BENCH_DEVICE_TYPES);
+        Policies[i].ProcessId = (SecureHostWorkloadRandom(State) % 100 < 98) ?
+            (SecureHostWorkloadRandom(State) & 0xFFFCu) + 4 : 0;
+        Policies[i].Allowed = (BOOLEAN)(SecureHostWorkloadRandom(State) & 1);
+        Policies[i].Reserved = 0;
+    }
+}
+
+static BOOLEAN
+BenchReferenceScan(const SECUREHOST_DEVICE_POLICY* Policies, UINT32 Count, UINT8 DeviceType, UINT32 ProcessId)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count; i++) {
+        if (Policies[i].DeviceType == DeviceType &&
+            (Policies[i].ProcessId == 0 || Policies[i].ProcessId == ProcessId) &&
+            Policies[i].Allowed) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// Lines a scan reads: the array prefix up to the first grant
+//
+static double
+BenchScanLines(const SECUREHOST_DEVICE_POLICY* Policies, UINT32 Count, UINT8 DeviceType, UINT32 ProcessId)
+{
+    UINT32 i;
+
+    for (i = 0; i < Count; i++) {
+        if (Policies[i].DeviceType == DeviceType &&
+            Policies[i].Allowed &&
+            (Policies[i].ProcessId == 0 || Policies[i].ProcessId == ProcessId)) {
+            i++;
+            break;
+        }
+    }
+
+    return (double)i * sizeof(SECUREHOST_DEVICE_POLICY) / BENCH_CACHE_LINE;
+}
+
+static int
+BenchDevice(UINT32 Size, const BENCH_OPTIONS* Options, UINT64 Overhead, BENCH_RESULT* Result)
+{
+    SECUREHOST_DEVICE_POLICY* policies;
+    UINT8* deviceTypes;
+    UINT32* processIds;
+    UINT64* samples;
+    UINT64 matches = 0;
+    double lines = 0;
+    UINT64 start;
+    UINT32 state = Options->Seed ^ 0x5A5A5A5Au;
+    UINT32 i;
+
+    policies = (SECUREHOST_DEVICE_POLICY*)_aligned_malloc(
+        (SIZE_T)Size * sizeof(SECUREHOST_DEVICE_POLICY), SYSTEM_CACHE_ALIGNMENT_SIZE);
+    deviceTypes = (UINT8*)malloc(BENCH_INPUT_POOL * sizeof(UINT8));
+    processIds = (UINT32*)malloc(BENCH_INPUT_POOL * sizeof(UINT32));
+    samples = (UINT64*)malloc(BENCH_LATENCY_SAMPLES * sizeof(UINT64));
+
+    if (policies == NULL || deviceTypes == NULL || processIds == NULL || samples == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    BenchGeneratePolicies(policies, Size, &state);
+
+    for (i = 0; i < BENCH_INPUT_POOL; i++) {
+        SecureHostSynthesizeDeviceRequest(policies, Size, BENCH_DEVICE_TYPES, Options->HitPercent,
+                                          &state, &deviceTypes[i], &processIds[i]);
+    }
+
+    for (i = 0; i < BENCH_VERIFY_INPUTS; i++) {
+        UINT32 input = i % BENCH_INPUT_POOL;
+
+        if (SecureHostScanDevicePolicies(policies, Size, deviceTypes[input], processIds[input]) !=
+            BenchReferenceScan(policies, Size, deviceTypes[input], processIds[input])) {
+            fprintf(stderr, "device scan mismatch at %u policies\n", Size);
+            return 1;
+        }
+
+        lines += BenchScanLines(policies, Size, deviceTypes[input], processIds[input]);
+    }
+
+    start = BenchNow();
+    for (i = 0; i < Options->Operations; i++) {
+        UINT32 input = i & (BENCH_INPUT_POOL - 1);
+        if (SecureHostScanDevicePolicies(policies, Size, deviceTypes[input], processIds[input])) {
+            matches++;
+        }
+    }
+    Result->NanosecondsPerOp = BenchElapsedNanoseconds(start, BenchNow()) / Options->Operations;
+
+    for (i = 0; i < BENCH_LATENCY_SAMPLES; i++) {
+        UINT32 input = i & (BENCH_INPUT_POOL - 1);
+        UINT64 begin = __rdtsc();
+        BenchSink += SecureHostScanDevicePolicies(policies, Size, deviceTypes[input], processIds[input]);
+        samples[i] = __rdtsc() - begin;
+        samples[i] = (samples[i] > Overhead) ? samples[i] - Overhead : 0;
+    }
+
+    BenchPercentiles(samples, BENCH_LATENCY_SAMPLES, Result);
+    Result->LinesPerOp = lines / BENCH_VERIFY_INPUTS;
+    Result->MatchRate = 100.0 * (double)matches / Options->Operations;
+
+    _aligned_free(policies);
+    free(deviceTypes);
+    free(processIds);
+    free(samples);
+    return 0;
+}
+
+/*++
+
+    Driver
+
+--*/
+
+static void
+BenchUsage(void)
+{
+    fprintf(stderr,
+            "usage: SecureHostBench [--sizes N,N,...] [--ops N] [--hit PERCENT]\n"
+            "                       [--seed N] [--max-ns NS]\n");
+}
+
+static int
+BenchParseOptions(int argc, char** argv, BENCH_OPTIONS* Options)
+{
+    static const UINT32 defaultSizes[] = { 100, 1000, 10000, 100000 };
+    int i;
+
+    memset(Options, 0, sizeof(*Options));
+    memcpy(Options->Sizes, defaultSizes, sizeof(defaultSizes));
+    Options->SizeCount = (UINT32)RTL_NUMBER_OF(defaultSizes);
+    Options->Operations = BENCH_DEFAULT_OPS;
+    Options->HitPercent = BENCH_DEFAULT_HIT_PERCENT;
+    Options->Seed = 0x2545F491u;
+
+    for (i = 1; i < argc; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (value == NULL) {
+            return 0;
+        }
+
+        if (strcmp(argv[i], "--sizes") == 0) {
+            char* cursor = (char*)value;
+            Options->SizeCount = 0;
+            while (*cursor != '\0' && Options->SizeCount < BENCH_MAX_SIZES) {
+                UINT32 size = (UINT32)strtoul(cursor, &cursor, 10);
+                if (size == 0 || size > SECUREHOST_MAX_RULES) {
+                    return 0;
+                }
+                Options->Sizes[Options->SizeCount++] = size;
+                if (*cursor == ',') {
+                    cursor++;
+                }
+            }
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            Options->Operations = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--hit") == 0) {
+            Options->HitPercent = (UINT32)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            Options->Seed = (UINT32)strtoul(value, NULL, 10) | 1;
+        } else if (strcmp(argv[i], "--max-ns") == 0) {
+            Options->MaxNanoseconds = strtod(value, NULL);
+        } else {
+            return 0;
+        }
+
+        i++;
+    }
+
+    return Options->SizeCount != 0 && Options->Operations != 0 && Options->HitPercent <= 100;
+}
+
+static void
+BenchPrint(const char* Path, UINT32 Size, const BENCH_RESULT* Result)
+{
+    printf("%-8s %8u %10.1f %10.1f %10.1f %10.2f %8.1f%%\n",
+           Path, Size, Result->NanosecondsPerOp, Result->P50, Result->P99,
+           Result->LinesPerOp, Result->MatchRate);
+}
+
+int
+main(int argc, char** argv)
+{
+    BENCH_OPTIONS options;
+    BENCH_RESULT result;
+    UINT64 overhead;
+    int exitCode = 0;
+    UINT32 i;
+
+    if (!BenchParseOptions(argc, argv, &options)) {
+        BenchUsage();
+        return 1;
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+    SetThreadAffinityMask(GetCurrentThread(), 1);
+
+    BenchCalibrate();
+    overhead = BenchTimerOverhead();
+
+    printf("%-8s %8s %10s %10s %10s %10s %9s\n",
+           "path", "size", "ns/op", "p50 ns", "p99 ns", "lines/op", "matched");
+
+    for (i = 0; i < options.SizeCount; i++) {
+        if (BenchNetwork(options.Sizes[i], &options, overhead, &result) != 0) {
+            return 1;
+        }
+        BenchPrint("classify", options.Sizes[i], &result);
+
+        if (options.MaxNanoseconds != 0 && result.NanosecondsPerOp > options.MaxNanoseconds) {
+            exitCode = 2;
+        }
+    }
+
+    for (i = 0; i < options.SizeCount; i++) {
+        if (BenchDevice(options.Sizes[i], &options, overhead, &result) != 0) {
+            return 1;
+        }
+        BenchPrint("device", options.Sizes[i], &result);
+
+        if (options.MaxNanoseconds != 0 && result.NanosecondsPerOp > options.MaxNanoseconds) {
+            exitCode = 2;
+        }
+    }
+
+    if (exitCode != 0) {
+        fprintf(stderr, "mean latency above %.1f ns/op\n", options.MaxNanoseconds);
+    }
+
+    return exitCode;
+}
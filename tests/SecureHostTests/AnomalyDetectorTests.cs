@@ -0,0 +1,129 @@
+using Xunit;
+using FluentAssertions;
+using SecureHostCore.Engine;
+using SecureHostCore.Models;
+
+namespace SecureHostTests;
+
+public class AnomalyDetectorTests
+{
+    private static readonly DateTime Start = new(2024, 1, 1, 0, 0, 0, DateTimeKind.Utc);
+
+    private static ConnectionObservation Connection(uint processId, byte lastOctet, ushort port, DateTime time)
+    {
+        Span<byte> address = stackalloc byte[16];
+        address[0] = 10;
+        address[3] = lastOctet;
+
+        return new ConnectionObservation(
+            new ProcessKey(processId, 1),
+            ConnectionObservation.PackAddress(address),
+            4,
+            port,
+            NetworkProtocol.TCP,
+            false,
+            1,
+            (ulong)time.ToFileTimeUtc());
+    }
+
+    [Fact]
+    public void AnomalyDetector_ShouldFlagPortScanButNotBusyClient()
+    {
+        // Arrange
+        var detector = new AnomalyDetector();
+
+        // Act: one process sweeps 500 ports, another makes as many
+        // connections to a single service
+        for (var i = 0; i < 500; i++)
+        {
+            detector.RecordConnection(Connection(100, 1, (ushort)(1000 + i), Start.AddMilliseconds(i)));
+            detector.RecordConnection(Connection(200, 2, 443, Start.AddMilliseconds(i)));
+        }
+
+        var alerts = detector.Evaluate(Start.AddSeconds(5));
+
+        // Assert
+        alerts.Should().HaveCount(1);
+        alerts[0].Kind.Should().Be(AnomalyKind.PortScan);
+        alerts[0].Process!.Value.ProcessId.Should().Be(100u);
+        detector.TrackedProcesses.Should().Be(2);
+    }
+
+    [Fact]
+    public void AnomalyDetector_ShouldFlagSteadyBeaconOnce()
+    {
+        // Arrange
+        var detector = new AnomalyDetector();
+        var random = new Random(7);
+
+        // Act: one process calls home every 60 s, another at irregular times
+        var irregular = Start;
+        for (var i = 0; i < 20; i++)
+        {
+            detector.RecordConnection(Connection(300, 3, 8443, Start.AddSeconds(60 * i)));
+
+            irregular = irregular.AddSeconds(10 + random.Next(0, 300));
+            detector.RecordConnection(Connection(400, 4, 8443, irregular));
+        }
+
+        var alerts = detector.Evaluate(Start.AddMinutes(30));
+
+        // Assert
+        alerts.Should().HaveCount(1);
+        alerts[0].Kind.Should().Be(AnomalyKind.Beaconing);
+        alerts[0].Process!.Value.ProcessId.Should().Be(300u);
+        alerts[0].Endpoint.Should().Be("10.0.0.3:8443");
+        alerts[0].Observed.Should().BeApproximately(60, 1);
+    }
+
+    [Fact]
+    public void AnomalyDetector_ShouldFlagDeviceBurstOnlyAgainstWarmBaseline()
+    {
+        // Arrange
+        var detector = new AnomalyDetector();
+        var process = new ProcessKey(500, 1);
+        var now = Start;
+        detector.Evaluate(now);
+
+        // Act: a quiet baseline of one check a second, then a burst
+        var quiet = new List<AnomalyAlert>();
+        for (var i = 0; i < 60; i++)
+        {
+            detector.RecordDeviceAccess(process, DeviceType.Camera, 5);
+            now = now.AddSeconds(5);
+            quiet.AddRange(detector.Evaluate(now));
+        }
+
+        for (var i = 0; i < 4; i++)
+            detector.RecordDeviceAccess(process, DeviceType.Camera, 200);
+        now = now.AddSeconds(5);
+        var burst = detector.Evaluate(now);
+
+        // Assert
+        quiet.Should().BeEmpty();
+        burst.Should().HaveCount(1);
+        burst[0].Kind.Should().Be(AnomalyKind.DeviceAccessBurst);
+        burst[0].DeviceType.Should().Be(DeviceType.Camera);
+        burst[0].Process.Should().Be(process);
+    }
+
+    [Fact]
+    public void Sketches_ShouldEstimateWithinBounds()
+    {
+        // Arrange
+        var sketch = new CountMinSketch(width: 1024, depth: 4);
+        var distinct = new HyperLogLog(precision: 10);
+
+        // Act
+        for (var key = 0ul; key < 20000; key++)
+        {
+            sketch.Add(key % 100, 1);
+            distinct.Add(SketchHash.Mix(key));
+        }
+
+        // Assert: count-min never undercounts; HLL is within 3 standard errors
+        for (var key = 0ul; key < 100; key++)
+            sketch.Estimate(key).Should().BeGreaterThan(199u);
+        distinct.Estimate().Should().BeApproximately(20000, 2000);
+    }
+}
@@ -0,0 +1,356 @@
+using System.Text;
+using System.Text.Json;
+using Xunit;
+using FluentAssertions;
+using Microsoft.Extensions.Logging.Abstractions;
+using SecureHostCore.Engine;
+using SecureHostCore.Models;
+
+namespace SecureHostTests;
+
+public class AuditEngineTests : IDisposable
+{
+    private readonly string _directory;
+    private readonly string _auditLogPath;
+
+    public AuditEngineTests()
+    {
+        _directory = Path.Combine(Path.GetTempPath(), "SecureHostTests", Guid.NewGuid().ToString("N"));
+        _auditLogPath = Path.Combine(_directory, "audit.shlog");
+    }
+
+    public void Dispose()
+    {
+        if (Directory.Exists(_directory))
+            Directory.Delete(_directory, recursive: true);
+    }
+
+    [Fact]
+    public async Task ExportToSiemAsync_ShouldExportEventsInWindowAsCef()
+    {
+        // Arrange
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath);
+        var details = new NetworkEventDetails { Protocol = NetworkProtocol.TCP, RemoteAddress = "10.0.0.1", RemotePort = 443 };
+
+        await auditEngine.LogNetworkEventAsync(1234, "chrome.exe", PolicyAction.Block, details, 7, "a|b=c\\d\ne");
+        await auditEngine.LogNetworkEventAsync(1234, "chrome.exe", PolicyAction.Allow, details);
+        await auditEngine.FlushAsync();
+
+        var outputPath = Path.Combine(_directory, "export.cef");
+
+        // Act
+        var count = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+        var outsideWindow = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddDays(-3), DateTime.UtcNow.AddDays(-2), Path.Combine(_directory, "empty.cef"));
+
+        // Assert
+        count.Should().Be(2);
+        outsideWindow.Should().Be(0);
+
+        var lines = File.ReadAllLines(outputPath);
+        lines.Should().HaveCount(2);
+        lines[0].Should().Be(
+            "CEF:0|SecureHost|SecureHostSuite|1.0|NetworkConnection|NetworkConnection|5|" +
+            $"dvchost={Environment.MachineName} duser= suid= sproc=chrome.exe spid=1234 act=Block " +
+            "msg=a\\|b\\=c\\\\d\\ne");
+        lines[1].EndsWith("act=Allow msg=Network connection allow").Should().BeTrue();
+    }
+
+    [Fact]
+    public async Task ExportToSiemAsync_ShouldStreamJsonInLogOrderAcrossParallelChunks()
+    {
+        // Arrange: one block per flush, one block per chunk
+        var options = new AuditPipelineOptions { ExportChunkEvents = 1, ExportParallelism = 4 };
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath, options);
+        var details = new NetworkEventDetails { Protocol = NetworkProtocol.UDP, RemoteAddress = "10.0.0.9", RemotePort = 53 };
+
+        for (var i = 0; i < 40; i++)
+        {
+            await auditEngine.LogNetworkEventAsync(42, "dns.exe", PolicyAction.Allow, details, (ulong)i, $"query \"{i}\"");
+            await auditEngine.FlushAsync();
+        }
+
+        using var output = new MemoryStream();
+
+        // Act
+        var count = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), output, SiemExportFormat.Json);
+
+        // Assert
+        count.Should().Be(40);
+
+        var lines = Encoding.UTF8.GetString(output.ToArray())
+            .Split(Environment.NewLine, StringSplitOptions.RemoveEmptyEntries);
+        lines.Should().HaveCount(40);
+
+        for (var i = 0; i < lines.Length; i++)
+        {
+            var evt = JsonSerializer.Deserialize<AuditEvent>(lines[i])!;
+            evt.RuleId.Should().Be((ulong)i);
+            evt.Message.Should().Be($"query \"{i}\"");
+            evt.ProcessName.Should().Be("dns.exe");
+            evt.NetworkDetails!.RemotePort.Should().Be((ushort)53);
+            evt.NetworkDetails.Protocol.Should().Be(NetworkProtocol.UDP);
+        }
+    }
+
+    [Fact]
+    public async Task StartSiemExport_ShouldWriteEachEventOnceAfterCancelAndResume()
+    {
+        // Arrange
+        var options = new AuditPipelineOptions { ExportChunkEvents = 10 };
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath, options);
+
+        for (var block = 0; block < 20; block++)
+        {
+            for (var i = 0; i < 10; i++)
+                await auditEngine.LogPolicyChangeAsync("RuleUpdated", (ulong)(block * 10 + i), $"event {block * 10 + i}");
+            await auditEngine.FlushAsync();
+        }
+
+        var request = new SiemExportRequest
+        {
+            StartTime = DateTime.UtcNow.AddMinutes(-5),
+            EndTime = DateTime.UtcNow.AddMinutes(5),
+            Destination = "resume.cef"
+        };
+
+        // Act: cancel wherever the export has got to, then resume
+        var started = auditEngine.StartSiemExport(request);
+        auditEngine.CancelSiemExport(started.Id);
+        await WaitForExportAsync(auditEngine, started.Id);
+
+        auditEngine.ResumeSiemExport(started.Id).Should().NotBeNull();
+        var progress = await WaitForExportAsync(auditEngine, started.Id);
+
+        // Assert
+        progress.State.Should().Be(SiemExportState.Completed);
+        progress.EventsWritten.Should().Be(200);
+        progress.SegmentsDone.Should().Be(progress.SegmentsTotal);
+
+        var lines = File.ReadAllLines(Path.Combine(auditEngine.ExportDirectory, "resume.cef"));
+        lines.Should().HaveCount(200);
+        for (var i = 0; i < lines.Length; i++)
+            lines[i].EndsWith($"msg=RuleUpdated: event {i}").Should().BeTrue();
+        progress.BytesWritten.Should().Be(new FileInfo(Path.Combine(auditEngine.ExportDirectory, "resume.cef")).Length);
+    }
+
+    [Fact]
+    public void StartSiemExport_ShouldRejectPathsOutsideExportDirectory()
+    {
+        // Arrange
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath);
+
+        // Act
+        Action act = () => auditEngine.StartSiemExport(new SiemExportRequest
+        {
+            StartTime = DateTime.UtcNow.AddDays(-1),
+            EndTime = DateTime.UtcNow,
+            Destination = Path.Combine("..", "escape.cef")
+        });
+
+        // Assert
+        act.Should().Throw<ArgumentException>();
+        auditEngine.GetSiemExports().Should().BeEmpty();
+    }
+
+    private static async Task<SiemExportProgress> WaitForExportAsync(AuditEngine auditEngine, Guid id)
+    {
+        var deadline = DateTime.UtcNow.AddSeconds(30);
+        while (true)
+        {
+            var progress = auditEngine.GetSiemExport(id)!;
+            if (progress.State != SiemExportState.Running || DateTime.UtcNow > deadline)
+                return progress;
+
+            await Task.Delay(10);
+        }
+    }
+
+    [Fact]
+    public async Task AuditEngine_ShouldEnrichEventsFromProcessCacheByCreateTime()
+    {
+        // Arrange: the source knows one start of PID 4321; a reused ID
+        // (other creation time) must not pick up its details
+        var source = new FakeProcessMetadataSource(new ProcessMetadata
+        {
+            Key = new ProcessKey(4321, 0x01DA000000000001),
+            ImagePath = @"C:\Tools\agent.exe",
+            Name = "agent",
+            UserSid = "S-1-5-21-1000",
+            UserName = @"HOST\alice"
+        });
+        var processCache = new ProcessMetadataCache(source: source);
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath, processCache: processCache);
+        var details = new NetworkEventDetails { Protocol = NetworkProtocol.TCP, RemotePort = 443 };
+
+        // Act
+        await auditEngine.LogNetworkEventAsync(4321, string.Empty, PolicyAction.Block, details, processCreateTime: 0x01DA000000000001);
+        await auditEngine.LogNetworkEventAsync(4321, string.Empty, PolicyAction.Block, details, processCreateTime: 0x01DA000000000001);
+        await auditEngine.LogNetworkEventAsync(4321, string.Empty, PolicyAction.Block, details, processCreateTime: 0x01DA000000000002);
+        await auditEngine.FlushAsync();
+
+        var outputPath = Path.Combine(_directory, "export.cef");
+        await auditEngine.ExportToSiemAsync(DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+
+        // Assert
+        var lines = File.ReadAllLines(outputPath);
+        lines.Should().HaveCount(3);
+        lines[0].Contains(@"duser=HOST\alice suid=S-1-5-21-1000 sproc=agent spid=4321").Should().BeTrue();
+        lines[1].Contains("sproc=agent").Should().BeTrue();
+        lines[2].Contains("alice").Should().BeFalse();
+        source.Lookups.Should().Be(2);
+        processCache.Hits.Should().BeGreaterThan(0);
+    }
+
+    private sealed class FakeProcessMetadataSource : IProcessMetadataSource
+    {
+        private readonly ProcessMetadata _process;
+        private int _lookups;
+
+        public FakeProcessMetadataSource(ProcessMetadata process) => _process = process;
+
+        public int Lookups => _lookups;
+
+        public ValueTask<ProcessMetadata?> ResolveAsync(ProcessKey key, CancellationToken cancellationToken = default)
+        {
+            Interlocked.Increment(ref _lookups);
+            return ValueTask.FromResult(key == _process.Key ? _process : null);
+        }
+    }
+
+    [Fact]
+    public async Task ExportToSiemAsync_ShouldReadSegmentAppendedAcrossRestarts()
+    {
+        // Arrange
+        using (var first = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath))
+        {
+            await first.LogPolicyChangeAsync("RuleAdded", 1, "first");
+        }
+
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath);
+        await auditEngine.LogPolicyChangeAsync("RuleAdded", 2, "second");
+        await auditEngine.FlushAsync();
+
+        var outputPath = Path.Combine(_directory, "export.cef");
+
+        // Act
+        var count = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+
+        // Assert
+        count.Should().Be(2);
+        Directory.GetFiles(_directory, "*.corrupt-*").Should().BeEmpty();
+    }
+
+    [Fact]
+    public async Task AuditEngine_ShouldQuarantineModifiedSegment()
+    {
+        // Arrange
+        using (var first = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath))
+        {
+            await first.LogPolicyChangeAsync("RuleAdded", 1, "original");
+        }
+
+        var segment = Directory.GetFiles(_directory, "audit_*.shlog").Single();
+        var bytes = File.ReadAllBytes(segment);
+        var index = bytes.AsSpan().LastIndexOf("original"u8);
+        bytes[index] = (byte)'O';
+        File.WriteAllBytes(segment, bytes);
+
+        var outputPath = Path.Combine(_directory, "export.cef");
+
+        // Act
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath);
+        var tamperedCount = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+
+        await auditEngine.LogPolicyChangeAsync("RuleAdded", 2, "after");
+        await auditEngine.FlushAsync();
+
+        // Assert
+        tamperedCount.Should().Be(0);
+        Directory.GetFiles(_directory, "*.corrupt-*").Should().HaveCount(1);
+
+        var count = await auditEngine.ExportToSiemAsync(
+            DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+        count.Should().Be(2);
+        File.ReadAllLines(outputPath)[0].Contains("TamperAttempt").Should().BeTrue();
+    }
+
+    [Fact]
+    public async Task FlushAsync_ShouldCommitEventsAndReportCounters()
+    {
+        // Arrange
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath);
+
+        // Act
+        for (var i = 0; i < 500; i++)
+            await auditEngine.LogPolicyChangeAsync("RuleUpdated", (ulong)i, "bulk");
+        await auditEngine.FlushAsync();
+
+        var statistics = auditEngine.GetStatistics();
+
+        // Assert
+        statistics.EventsWritten.Should().Be(500);
+        statistics.EventsLost.Should().Be(0);
+        statistics.Commits.Should().BeGreaterThan(0);
+        statistics.Stages.Sum(s => s.Dropped).Should().Be(0);
+    }
+
+    [Fact]
+    public async Task AuditEngine_ShouldDropInfoButKeepCriticalEventsWhenFull()
+    {
+        // Arrange: one-slot stages, and a serializer that sits on a
+        // partial block long enough for the queues to fill
+        var options = new AuditPipelineOptions
+        {
+            CaptureCapacity = 1,
+            SerializeCapacity = 1,
+            WriteCapacity = 1,
+            BatchDelay = TimeSpan.FromSeconds(1)
+        };
+        using var auditEngine = new AuditEngine(NullLogger<AuditEngine>.Instance, _auditLogPath, options);
+        var details = new NetworkEventDetails { Protocol = NetworkProtocol.TCP, RemotePort = 80 };
+
+        // Act
+        for (var i = 0; i < 50; i++)
+            await auditEngine.LogNetworkEventAsync(100, "storm.exe", PolicyAction.Allow, details);
+        await auditEngine.LogTamperAttemptAsync(100, "storm.exe", "driver unload");
+        await auditEngine.FlushAsync();
+
+        var statistics = auditEngine.GetStatistics();
+        var outputPath = Path.Combine(_directory, "export.cef");
+        await auditEngine.ExportToSiemAsync(DateTime.UtcNow.AddMinutes(-5), DateTime.UtcNow.AddMinutes(5), outputPath);
+
+        // Assert
+        var dropped = statistics.Stages.Sum(s => s.Dropped);
+        dropped.Should().BeGreaterThan(0);
+        (statistics.EventsWritten + dropped).Should().Be(51);
+        File.ReadAllLines(outputPath).Count(line => line.Contains("TamperAttempt")).Should().Be(1);
+    }
+
+    [Fact]
+    public void CreateSampleMetadata_ShouldRecordWeightOfSampledPermits()
+    {
+        // Arrange
+        var first = new DateTime(2024, 1, 1, 0, 0, 0, DateTimeKind.Utc);
+        var last = first.AddSeconds(1);
+
+        // Act
+        var sampled = AuditEngine.CreateSampleMetadata(1, 100, PermitAuditMode.Sampled, first, first);
+        var repeated = AuditEngine.CreateSampleMetadata(3, 250, PermitAuditMode.RateLimited, first, last);
+        var full = AuditEngine.CreateSampleMetadata(1, 1, PermitAuditMode.Full, first, first);
+
+        // Assert
+        sampled.Should().NotBeNull();
+        sampled!["auditMode"].Should().Be("Sampled");
+        sampled["weight"].Should().Be("100");
+        sampled.ContainsKey("count").Should().BeFalse();
+        repeated.Should().NotBeNull();
+        repeated!["count"].Should().Be("3");
+        repeated["weight"].Should().Be("250");
+        full.Should().BeNull();
+    }
+}
@@ -0,0 +1,84 @@
+using System.Diagnostics;
+using Xunit;
+using FluentAssertions;
+using SecureHostCore.Engine;
+
+namespace SecureHostTests;
+
+public class LatencyTracerTests
+{
+    private static long MicrosecondsToTicks(double microseconds)
+    {
+        return (long)(microseconds * Stopwatch.Frequency / 1_000_000.0);
+    }
+
+    private static LatencyStageStatistics GetStage(LatencyTracer tracer, LatencyStage stage)
+    {
+        return tracer.GetStatistics().Single(s => s.Stage == stage.ToString());
+    }
+
+    [Fact]
+    public void GetStatistics_ShouldReportPercentilesWithinBucketPrecision()
+    {
+        // Arrange
+        var tracer = new LatencyTracer();
+
+        // Act: 1..1000 microseconds
+        for (var i = 1; i <= 1000; i++)
+            tracer.Record(LatencyStage.EventDelivery, (ulong)i, MicrosecondsToTicks(i));
+
+        var stats = GetStage(tracer, LatencyStage.EventDelivery);
+
+        // Assert
+        stats.Count.Should().Be(1000);
+        stats.P50Microseconds.Should().BeApproximately(500, 500 * 0.125 + 1);
+        stats.P99Microseconds.Should().BeApproximately(990, 990 * 0.125 + 1);
+        stats.MaxMicroseconds.Should().BeApproximately(1000, 1);
+        stats.TargetP99Microseconds.Should().BeNull();
+        stats.MeetsTarget.Should().BeNull();
+    }
+
+    [Fact]
+    public void GetStatistics_ShouldCompareVerdictStagesWithTheirTargets()
+    {
+        // Arrange
+        var tracer = new LatencyTracer(new LatencyTracingOptions
+        {
+            KernelVerdictTarget = TimeSpan.FromMicroseconds(20),
+            ServiceVerdictTarget = TimeSpan.FromMilliseconds(2)
+        });
+
+        // Act
+        for (var i = 0; i < 200; i++)
+        {
+            tracer.Record(LatencyStage.KernelVerdict, (ulong)i, MicrosecondsToTicks(5));
+            tracer.Record(LatencyStage.ServiceVerdict, (ulong)i, MicrosecondsToTicks(i < 190 ? 500 : 5000));
+        }
+
+        // Assert
+        var kernel = GetStage(tracer, LatencyStage.KernelVerdict);
+        kernel.TargetP99Microseconds.Should().Be(20);
+        kernel.MeetsTarget.Should().Be(true);
+
+        var service = GetStage(tracer, LatencyStage.ServiceVerdict);
+        service.TargetP99Microseconds.Should().Be(2000);
+        service.MeetsTarget.Should().Be(false);
+
+        GetStage(tracer, LatencyStage.DeviceVerdict).MeetsTarget.Should().BeNull();
+    }
+
+    [Fact]
+    public void Record_ShouldIgnoreUntracedSamples()
+    {
+        // Arrange
+        var tracer = new LatencyTracer();
+
+        // Act
+        tracer.Record(LatencyStage.AuditDurable, 1, -1);
+        tracer.RecordSince(LatencyStage.AuditDurable, 2, startTimestamp: 0);
+        tracer.RecordSince(LatencyStage.AuditDurable, 3, Stopwatch.GetTimestamp());
+
+        // Assert
+        GetStage(tracer, LatencyStage.AuditDurable).Count.Should().Be(1);
+    }
+}
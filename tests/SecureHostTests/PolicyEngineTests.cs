@@ -159,6 +159,40 @@ public class PolicyEngineTests : IDisposable
         decision.RuleId.Should().BeNull();
     }
 
+    [Theory]
+    [InlineData("10.0.0.0/8", "10.200.1.7", PolicyAction.Block)]
+    [InlineData("10.0.0.0/8", "11.0.0.1", PolicyAction.Allow)]
+    [InlineData("192.168.1.10", "192.168.1.10", PolicyAction.Block)]
+    [InlineData("2001:db8::/32", "2001:db8:1::5", PolicyAction.Block)]
+    [InlineData("2001:db8::/32", "10.0.0.1", PolicyAction.Allow)]
+    public void EvaluateNetworkConnection_WithRemotePrefix_ShouldMatchByCidr(
+        string pattern, string remoteAddress, PolicyAction expected)
+    {
+        // Arrange
+        _policyEngine.AddRule(new PolicyRule
+        {
+            Name = "Block Prefix",
+            Type = PolicyRuleType.Network,
+            Action = PolicyAction.Block,
+            RemoteAddress = pattern,
+            Enabled = true
+        });
+
+        // Act
+        var decision = _policyEngine.EvaluateNetworkConnection(
+            processId: 1234,
+            processName: "notepad.exe",
+            protocol: NetworkProtocol.TCP,
+            localPort: 50000,
+            remotePort: 443,
+            remoteAddress: remoteAddress,
+            userSid: null
+        );
+
+        // Assert
+        decision.Action.Should().Be(expected);
+    }
+
     [Fact]
     public void EvaluateDeviceAccess_WithBlockRule_ShouldReturnBlock()
     {
@@ -317,6 +351,14 @@ public class PolicyEngineTests : IDisposable
     [InlineData("chrome.exe", "chrom?.exe", true)]
     [InlineData("chrome.exe", "firefox.exe", false)]
     [InlineData("notepad.exe", "*", true)]
+    [InlineData("CHROME.EXE", "chrome.exe", true)]
+    [InlineData(@"C:\Windows\System32\svchost.exe", @"C:\Windows\*", true)]
+    [InlineData(@"C:\Program Files\app.exe", @"C:\Windows\*", false)]
+    [InlineData("chrome.exe", "*rom*", true)]
+    [InlineData("chrome.exe", "c*o*e.exe", true)]
+    [InlineData("chrome.exe", "c*z*.exe", false)]
+    [InlineData("chrome.exe", "chrome.ex?", true)]
+    [InlineData("chrome.exe", "chrome.exe?", false)]
     public void ProcessNameFilter_ShouldMatchWildcardsCorrectly(string processName, string filter, bool shouldMatch)
     {
         // Arrange
@@ -352,4 +394,46 @@ public class PolicyEngineTests : IDisposable
             decision.Action.Should().Be(PolicyAction.Allow); // Default policy
         }
     }
+
+    [Fact]
+    public void EvaluateNetworkConnection_ShouldHonorPriorityAcrossRuleShapes()
+    {
+        // Arrange: the exact-name rule is added first but has lower priority
+        // than the port-only rule; the higher-priority wildcard rule is disabled
+        _policyEngine.AddRule(new PolicyRule
+        {
+            Name = "Exact Name",
+            Type = PolicyRuleType.Network,
+            Action = PolicyAction.Allow,
+            ProcessName = "chrome.exe",
+            Priority = 10
+        });
+        _policyEngine.AddRule(new PolicyRule
+        {
+            Name = "Remote Port",
+            Type = PolicyRuleType.Network,
+            Action = PolicyAction.Block,
+            RemotePort = 443,
+            Priority = 20
+        });
+        _policyEngine.AddRule(new PolicyRule
+        {
+            Name = "Wildcard",
+            Type = PolicyRuleType.Network,
+            Action = PolicyAction.Allow,
+            ProcessName = "*.exe",
+            Priority = 30,
+            Enabled = false
+        });
+
+        // Act
+        var decision = _policyEngine.EvaluateNetworkConnection(
+            1234, "chrome.exe", NetworkProtocol.TCP, 50000, 443, "10.0.0.1", null);
+        var otherPort = _policyEngine.EvaluateNetworkConnection(
+            1234, "chrome.exe", NetworkProtocol.TCP, 50000, 80, "10.0.0.1", null);
+
+        // Assert
+        decision.RuleName.Should().Be("Remote Port");
+        otherPort.RuleName.Should().Be("Exact Name");
+    }
 }
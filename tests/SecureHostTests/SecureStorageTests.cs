@@ -0,0 +1,139 @@
+using System.Globalization;
+using System.Security.Cryptography;
+using Xunit;
+using FluentAssertions;
+using Microsoft.Extensions.Logging.Abstractions;
+using SecureHostCore.Models;
+using SecureHostCore.Storage;
+
+namespace SecureHostTests;
+
+public class SecureStorageTests : IDisposable
+{
+    private const string Key = "policies";
+
+    private readonly string _directory;
+    private readonly string _storagePath;
+
+    public SecureStorageTests()
+    {
+        _directory = Path.Combine(Path.GetTempPath(), "SecureHostTests", Guid.NewGuid().ToString("N"));
+        _storagePath = Path.Combine(_directory, "*.dat");
+    }
+
+    public void Dispose()
+    {
+        if (Directory.Exists(_directory))
+            Directory.Delete(_directory, recursive: true);
+    }
+
+    private SecureStorage CreateStorage()
+    {
+        return new SecureStorage(
+            NullLogger<SecureStorage>.Instance,
+            _storagePath,
+            new SecureStorageOptions { CollectionChunkItems = 4 });
+    }
+
+    private static List<PolicyRule> CreateRules(int count)
+    {
+        return Enumerable.Range(1, count)
+            .Select(i => new PolicyRule { Id = (ulong)i, Name = $"rule {i}", Priority = i })
+            .ToList();
+    }
+
+    private static string GetKey(PolicyRule rule) => rule.Id.ToString(CultureInfo.InvariantCulture);
+
+    private string[] GetChunkFiles()
+    {
+        return Directory.GetFiles(Path.Combine(_directory, $"{Key}.chunks"), "*.chunk")
+            .Select(Path.GetFileName)
+            .Cast<string>()
+            .ToArray();
+    }
+
+    [Fact]
+    public async Task UpdateCollectionAsync_ShouldWriteOnlyTheChangedChunk()
+    {
+        // Arrange
+        await CreateStorage().SaveCollectionAsync(Key, CreateRules(64), GetKey);
+        var chunksBefore = GetChunkFiles();
+
+        var storage = CreateStorage();
+        var updated = new PolicyRule { Id = 7, Name = "renamed", Priority = 7 };
+
+        // Act
+        await storage.UpdateCollectionAsync(Key, new[] { updated }, new[] { "9" }, GetKey);
+        var loaded = await CreateStorage().LoadCollectionAsync<PolicyRule>(Key);
+
+        // Assert
+        loaded.Should().NotBeNull();
+        loaded!.Should().HaveCount(63);
+        loaded.Single(r => r.Id == 7).Name.Should().Be("renamed");
+        loaded.Any(r => r.Id == 9).Should().BeFalse();
+
+        // 64 rules in 16 chunks; at most the two holding rules 7 and 9 were rewritten
+        chunksBefore.Should().HaveCount(16);
+        var chunksAfter = GetChunkFiles();
+        chunksAfter.Should().HaveCount(16);
+        chunksAfter.Except(chunksBefore).Count().Should().BeGreaterThan(0);
+        (chunksAfter.Except(chunksBefore).Count() <= 2).Should().BeTrue();
+    }
+
+    [Fact]
+    public async Task SaveCollectionAsync_ShouldSkipUnchangedChunks()
+    {
+        // Arrange
+        var rules = CreateRules(64);
+        var storage = CreateStorage();
+        await storage.SaveCollectionAsync(Key, rules, GetKey);
+        var chunksBefore = GetChunkFiles();
+
+        // Act
+        rules.Reverse();
+        await storage.SaveCollectionAsync(Key, rules, GetKey);
+        await CreateStorage().SaveCollectionAsync(Key, rules, GetKey);
+
+        // Assert
+        GetChunkFiles().Should().BeEquivalentTo(chunksBefore);
+        (await CreateStorage().LoadCollectionAsync<PolicyRule>(Key))!.Should().HaveCount(64);
+    }
+
+    [Fact]
+    public async Task LoadCollectionAsync_ShouldRejectModifiedChunk()
+    {
+        // Arrange
+        await CreateStorage().SaveCollectionAsync(Key, CreateRules(16), GetKey);
+
+        var chunkPath = Path.Combine(_directory, $"{Key}.chunks", GetChunkFiles()[0]);
+        var bytes = File.ReadAllBytes(chunkPath);
+        bytes[^1] ^= 0x01;
+        File.WriteAllBytes(chunkPath, bytes);
+
+        // Act
+        var act = () => CreateStorage().LoadCollectionAsync<PolicyRule>(Key);
+
+        // Assert
+        await act.Should().ThrowAsync<CryptographicException>();
+    }
+
+    [Fact]
+    public async Task UpdateCollectionAsync_ShouldChunkListSavedAsSingleValue()
+    {
+        // Arrange
+        var storage = CreateStorage();
+        await storage.SaveAsync(Key, CreateRules(10));
+
+        // Act
+        var legacy = await storage.LoadCollectionAsync<PolicyRule>(Key);
+        await storage.UpdateCollectionAsync(Key, new[] { new PolicyRule { Id = 11, Name = "rule 11" } },
+            Array.Empty<string>(), GetKey);
+        var loaded = await CreateStorage().LoadCollectionAsync<PolicyRule>(Key);
+
+        // Assert
+        legacy!.Should().HaveCount(10);
+        loaded!.Should().HaveCount(11);
+        loaded.Select(r => r.Id).OrderBy(id => id).Should().Equal(Enumerable.Range(1, 11).Select(i => (ulong)i));
+        GetChunkFiles().Length.Should().BeGreaterThan(0);
+    }
+}
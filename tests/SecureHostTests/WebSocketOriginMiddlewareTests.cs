@@ -0,0 +1,70 @@
+using Xunit;
+using FluentAssertions;
+using Microsoft.AspNetCore.Http;
+using Microsoft.Extensions.Logging.Abstractions;
+using SecureHostService.Api;
+
+namespace SecureHostTests;
+
+public class WebSocketOriginMiddlewareTests
+{
+    private static readonly string[] AllowedOrigins = { "http://localhost:5555" };
+
+    private static (WebSocketOriginMiddleware Middleware, Func<bool> Passed) CreateMiddleware()
+    {
+        var passed = false;
+        var middleware = new WebSocketOriginMiddleware(
+            _ =>
+            {
+                passed = true;
+                return Task.CompletedTask;
+            },
+            NullLogger.Instance,
+            AllowedOrigins);
+
+        return (middleware, () => passed);
+    }
+
+    private static DefaultHttpContext CreateUpgrade(string? origin)
+    {
+        var context = new DefaultHttpContext();
+        context.Request.Method = "GET";
+        context.Request.Path = "/api/network/connections/stream";
+        context.Request.Headers["Connection"] = "Upgrade";
+        context.Request.Headers["Upgrade"] = "websocket";
+        if (origin != null)
+            context.Request.Headers["Origin"] = origin;
+        return context;
+    }
+
+    [Fact]
+    public async Task InvokeAsync_ShouldRefuseUpgradeFromForeignOrigin()
+    {
+        // Arrange
+        var (middleware, passed) = CreateMiddleware();
+        var context = CreateUpgrade("https://attacker.example");
+
+        // Act
+        await middleware.InvokeAsync(context);
+
+        // Assert
+        context.Response.StatusCode.Should().Be(StatusCodes.Status403Forbidden);
+        passed().Should().BeFalse();
+    }
+
+    [Fact]
+    public async Task InvokeAsync_ShouldAcceptUpgradeWithoutOriginOrFromOwnOrigin()
+    {
+        // Arrange
+        var (nativeMiddleware, nativePassed) = CreateMiddleware();
+        var (pageMiddleware, pagePassed) = CreateMiddleware();
+
+        // Act
+        await nativeMiddleware.InvokeAsync(CreateUpgrade(origin: null));
+        await pageMiddleware.InvokeAsync(CreateUpgrade("http://localhost:5555"));
+
+        // Assert
+        nativePassed().Should().BeTrue();
+        pagePassed().Should().BeTrue();
+    }
+}